@@ -5,8 +5,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <time.h>
 
 #include "DiskImage.h"
+#include "crc.h"
+#include "offload.h"
 
 #define ERR_OPEN        "Error: can't open source file"
 #define ERR_GETLEN      "Error: can't get file length!"
@@ -803,6 +807,8 @@ static const unsigned char sbootimage[] = {
 
 TRDOS_DIR_ELEMENT sbootdir = { {'b','o','o','t',' ',' ',' ',' '}, 'B', 0xB4, 0xB4, (sizeof(sbootimage)+255)/256, 0, 0 };
 
+// UDI checksum: the reference implementation shifts a signed long, so this
+// is not a plain CRC-32 and can't use crc32_update().
 long CalcCRC32(long CRC, unsigned char Symbol)
 {
 	long temp;
@@ -861,17 +867,7 @@ TDiskImage::~TDiskImage()
 //-----------------------------------------------------------------------------
 unsigned short TDiskImage::MakeVGCRC(unsigned char *data, unsigned long length)
 {
-	unsigned short CRC = 0xFFFF;
-	for (unsigned int i = 0; i < length; i++)
-	{
-		CRC ^= data[i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
-		}
-	}
-	return CRC;          // H<-->L !!!
+	return crc16_ccitt(0xFFFF, data, length); // H<-->L !!!
 }
 //-----------------------------------------------------------------------------
 void TDiskImage::ApplySectorCRC(VGFIND_SECTOR vgfs)
@@ -889,26 +885,8 @@ void TDiskImage::ApplySectorCRC(VGFIND_SECTOR vgfs)
 	unsigned int len2 = 0;
 	if (len1 < len) len2 = len - len1;
 
-	unsigned int i;
-	unsigned short CRC = 0xFFFF;
-	for (i = 0; i < len1; i++)
-	{
-		CRC ^= TrackPtr[off1 + i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
-		}
-	}
-	for (i = 0; i < len2; i++)
-	{
-		CRC ^= TrackPtr[off2 + i] << 8;
-		for (unsigned int j = 0; j < 8; j++)
-		{
-			if (CRC & 0x8000) CRC = (CRC << 1) ^ 0x1021;
-			else CRC <<= 1;
-		}
-	}
+	unsigned short CRC = crc16_ccitt(0xFFFF, TrackPtr + off1, len1);
+	CRC = crc16_ccitt(CRC, TrackPtr + off2, len2);
 	unsigned int crcoff = (off1 + len1) % TrackLen;
 	if (len2) crcoff = (off2 + len2) % TrackLen;
 
@@ -3179,6 +3157,106 @@ unsigned unpack_lzh(unsigned char *src, unsigned size, unsigned char *buf)
 	}
 	return count;
 }
+//--------------------------------------------------------------------------
+// Converted images are kept in tmpfs, keyed by a hash and the size of the
+// source, so remounting a disk (also after a core reload) skips conversion.
+#define CONVCACHE_DIR   "/tmp/convcache"
+#define CONVCACHE_FILES 8
+
+// content key, for formats which are often renamed or copied around
+static int convcache_crc_key(const char *path, uint32_t *crc, uint64_t *size)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	static uint8_t buf[65536];
+	uint32_t c = 0;
+	uint64_t total = 0;
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		c = crc32_update(c, buf, n);
+		total += n;
+	}
+	close(fd);
+
+	if (n < 0 || !total) return 0;
+	*crc = c;
+	*size = total;
+	return 1;
+}
+
+static void convcache_name(char *name, const char *kind, uint32_t hash, uint64_t size)
+{
+	sprintf(name, CONVCACHE_DIR "/%s_%08X_%llX", kind, hash, (unsigned long long)size);
+}
+
+static int convcache_load(const char *kind, uint32_t hash, uint64_t size, fileTYPE *f)
+{
+	char name[64];
+	convcache_name(name, kind, hash, size);
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = 0;
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size > 0)
+	{
+		uint8_t *buf = (uint8_t*)malloc(st.st_size);
+		if (buf && read(fd, buf, st.st_size) == st.st_size)
+		{
+			ok = FileWriteAdv(f, buf, st.st_size) == st.st_size;
+		}
+		free(buf);
+	}
+	close(fd);
+
+	if (ok) printf("%s: using cached %s.\n", kind, name);
+	return ok;
+}
+
+// runs on the offload pool, owns buf
+static void convcache_write(uint8_t *buf, size_t len, const char *kind, uint32_t hash, uint64_t size)
+{
+	char name[64];
+	convcache_name(name, kind, hash, size);
+	cache_write(CONVCACHE_DIR, name + sizeof(CONVCACHE_DIR), buf, len, CONVCACHE_FILES);
+	free(buf);
+}
+
+static void convcache_store(const char *kind, uint32_t hash, uint64_t size, fileTYPE *f)
+{
+	size_t len = f->size;
+	uint8_t *buf = len ? (uint8_t*)malloc(len) : 0;
+	if (!buf) return;
+
+	if (FileReadAt(f, 0, buf, len) != (int)len)
+	{
+		free(buf);
+		return;
+	}
+
+	offload_add_work([buf, len, kind, hash, size]() { convcache_write(buf, len, kind, hash, size); }, OFFLOAD_IO);
+}
+
+// path and mtime key, cheap enough for any mount
+static int convcache_path_key(const char *path, uint32_t *hash, uint64_t *size)
+{
+	struct stat st;
+	if (stat(path, &st) || !st.st_size) return 0;
+
+	char key[1100];
+	snprintf(key, sizeof(key), "%s|%lld|%ld", path, (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+
+	// FNV-1a, the size in the name tells most collisions apart
+	uint32_t h = 2166136261u;
+	for (const char *p = key; *p; p++) h = (h ^ (uint8_t)*p) * 16777619u;
+	*hash = h;
+	*size = st.st_size;
+	return 1;
+}
+
 //--------------------------------------------------------------------------
 
 #define VOLUME_NUMBER 254
@@ -3329,6 +3407,27 @@ int dsk2nib(const char *name, fileTYPE *f)
 	static uint8_t dos_track[SECTORS * SECTOR_SIZE]; // , pro_track[SECTORS * SECTOR_SIZE];
 	static uint8_t raw_track[RAW_TRACK_uint8_tS];
 
+	uint32_t hash = 0;
+	uint64_t size = 0;
+	int keyed = convcache_path_key(getFullPath(name), &hash, &size);
+	if (keyed)
+	{
+		if (!FileOpenEx(f, "vdsk", -1))
+		{
+			printf("ERROR: fail to create vdsk\n");
+			return 0;
+		}
+
+		if (convcache_load("dsk2nib", hash, size, f))
+		{
+			f->size = FileGetSize(f);
+			FileSeekLBA(f, 0);
+			printf("dsk2nib: vdsk size=%llu.\n", f->size);
+			return 1;
+		}
+		FileClose(f);
+	}
+
 	fileTYPE disk_file = {};
 
 	if (!FileOpen(&disk_file, name))
@@ -3382,6 +3481,8 @@ int dsk2nib(const char *name, fileTYPE *f)
 	FileClose(&disk_file);
 
 	f->size = FileGetSize(f);
+	if (keyed) convcache_store("dsk2nib", hash, size, f);
+
 	FileSeekLBA(f, 0);
 	printf("dsk2nib: vdsk size=%llu.\n", f->size);
 
@@ -3391,18 +3492,29 @@ int dsk2nib(const char *name, fileTYPE *f)
 //--------------------------------------------------------------------------
 int x2trd(const char *name, fileTYPE *f)
 {
-	TDiskImage *img = new TDiskImage;
-	img->Open(getFullPath(name), true);
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", getFullPath(name));
+
+	uint32_t crc = 0;
+	uint64_t size = 0;
+	int keyed = convcache_crc_key(path, &crc, &size);
 
 	if (!FileOpenEx(f, "vdsk", -1))
 	{
-		delete img;
 		printf("ERROR: fail to create vdsk\n");
 		return 0;
 	}
 
-	img->writeTRD(f);
-	delete(img);
+	if (!keyed || !convcache_load("x2trd", crc, size, f))
+	{
+		TDiskImage *img = new TDiskImage;
+		img->Open(path, true);
+		img->writeTRD(f);
+		delete(img);
+
+		f->size = FileGetSize(f);
+		if (keyed) convcache_store("x2trd", crc, size, f);
+	}
 
 	f->size = FileGetSize(f);
 	FileSeekLBA(f, 0);
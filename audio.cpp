@@ -26,96 +26,139 @@ static int has_filter = 0;
 static char filter_cfg_path[1024] = {};
 static char filter_cfg[1024] = {};
 
-static void setFilter()
+// Coefficients of the last filter file, so a volume change doesn't read
+// and parse the file again.
+static char filter_words_path[1024] = {};
+static int64_t filter_words_mtime = 0;
+static uint16_t filter_words[16];
+static int filter_words_num = -1;
+
+static void filter_add(uint16_t word)
+{
+	if (filter_words_num < (int)(sizeof(filter_words) / sizeof(filter_words[0]))) filter_words[filter_words_num++] = word;
+}
+
+static void filter_parse(char *buf, int size)
+{
+	filter_words_num = 0;
+
+	int line = 0;
+	char *end = buf + size;
+	char *pos = buf;
+	while (pos < end && line < 9)
+	{
+		char *st = pos;
+		while ((pos < end) && *pos && (*pos != 10)) pos++;
+		*pos = 0;
+		while (*st == ' ' || *st == '\t' || *st == 13) st++;
+		if (*st == '#' || *st == ';' || !*st) pos++;
+		else
+		{
+			if (line == 0)
+			{
+				printf("version: %s\n", st);
+				if (strncasecmp(st, "v1", 2)) break;
+				line++;
+			}
+			else if (line == 1 || line == 3 || line == 4 || line == 5)
+			{
+				int val = 0;
+				int n = sscanf(st, "%d", &val);
+				printf("got %d values: %d\n", n, val);
+				if (n == 1)
+				{
+					filter_add((uint16_t)val);
+					if (line == 1) filter_add((uint16_t)(val >> 16));
+					line++;
+				}
+			}
+			else if (line == 2)
+			{
+				double val = 0;
+				int n = sscanf(st, "%lg", &val);
+				printf("got %d values: %g\n", n, val);
+				if (n == 1)
+				{
+					int64_t coeff = 0x8000000000 * val;
+					printf("  -> converted to: %lld\n", coeff);
+					filter_add((uint16_t)coeff);
+					filter_add((uint16_t)(coeff >> 16));
+					filter_add((uint16_t)(coeff >> 32));
+					line++;
+				}
+			}
+			else
+			{
+				double val = 0;
+				int n = sscanf(st, "%lg", &val);
+				printf("got %d values: %g\n", n, val);
+				if (n == 1)
+				{
+					int32_t coeff = 0x200000 * val;
+					printf("  -> converted to: %d\n", coeff);
+					filter_add((uint16_t)coeff);
+					filter_add((uint16_t)(coeff >> 16));
+					line++;
+				}
+			}
+		}
+	}
+}
+
+static int filter_load(const char *path)
 {
+	struct stat64 st;
+	if (stat64(getFullPath(path), &st)) return 0;
+
+	int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	if (filter_words_num >= 0 && filter_words_mtime == mtime && !strcmp(filter_words_path, path)) return 1;
+
+	filter_words_num = -1;
 	fileTYPE f = {};
+	if (!FileOpen(&f, path)) return 0;
 
+	char *buf = (char*)malloc(f.size + 1);
+	if (buf)
+	{
+		memset(buf, 0, f.size + 1);
+		int size = FileReadAdv(&f, buf, f.size);
+		if (size)
+		{
+			filter_parse(buf, size);
+			snprintf(filter_words_path, sizeof(filter_words_path), "%s", path);
+			filter_words_mtime = mtime;
+		}
+		free(buf);
+	}
+
+	return filter_words_num >= 0;
+}
+
+static void setFilter()
+{
 	has_filter = spi_uio_cmd(UIO_SET_AFILTER);
 	if (!has_filter) return;
 
 	snprintf(filter_cfg_path, sizeof(filter_cfg_path), AFILTER_DIR"/%s", filter_cfg + 1);
-	if(filter_cfg[0]) printf("\nLoading audio filter: %s\n", filter_cfg_path);
 
-	if (filter_cfg[0] && FileExists(filter_cfg_path) && FileOpen(&f, filter_cfg_path))
+	if (filter_cfg[0] && FileExists(filter_cfg_path))
 	{
-		char *buf = (char*)malloc(f.size + 1);
-		if (buf)
+		if (filter_words_num < 0 || strcmp(filter_words_path, filter_cfg_path)) printf("\nLoading audio filter: %s\n", filter_cfg_path);
+		if (filter_load(filter_cfg_path))
 		{
-			memset(buf, 0, f.size + 1);
-			int size;
-			if ((size = FileReadAdv(&f, buf, f.size)))
-			{
-				int line = 0;
-				spi_uio_cmd_cont(UIO_SET_AFILTER);
-				spi_w((uint8_t)get_core_volume());
-
-				char *end = buf + size;
-				char *pos = buf;
-				while (pos < end && line < 9)
-				{
-					char *st = pos;
-					while ((pos < end) && *pos && (*pos != 10)) pos++;
-					*pos = 0;
-					while (*st == ' ' || *st == '\t' || *st == 13) st++;
-					if (*st == '#' || *st == ';' || !*st) pos++;
-					else
-					{
-						if (line == 0)
-						{
-							printf("version: %s\n", st);
-							if (strncasecmp(st, "v1", 2)) break;
-							line++;
-						}
-						else if (line == 1 || line == 3 || line == 4 || line == 5)
-						{
-							int val = 0;
-							int n = sscanf(st, "%d", &val);
-							printf("got %d values: %d\n", n, val);
-							if (n == 1)
-							{
-								spi_w((uint16_t)val);
-								if (line == 1) spi_w((uint16_t)(val >> 16));
-								line++;
-							}
-						}
-						else if (line == 2)
-						{
-							double val = 0;
-							int n = sscanf(st, "%lg", &val);
-							printf("got %d values: %g\n", n, val);
-							if (n == 1)
-							{
-								int64_t coeff = 0x8000000000 * val;
-								printf("  -> converted to: %lld\n", coeff);
-								spi_w((uint16_t)coeff);
-								spi_w((uint16_t)(coeff >> 16));
-								spi_w((uint16_t)(coeff >> 32));
-								line++;
-							}
-						}
-						else
-						{
-							double val = 0;
-							int n = sscanf(st, "%lg", &val);
-							printf("got %d values: %g\n", n, val);
-							if (n == 1)
-							{
-								int32_t coeff = 0x200000 * val;
-								printf("  -> converted to: %d\n", coeff);
-								spi_w((uint16_t)coeff);
-								spi_w((uint16_t)(coeff >> 16));
-								line++;
-							}
-						}
-					}
-				}
-				DisableIO();
-			}
-			free(buf);
+			// volume and coefficients in one acknowledged burst
+			uint16_t words[1 + sizeof(filter_words) / sizeof(filter_words[0])];
+			words[0] = (uint8_t)get_core_volume();
+			memcpy(words + 1, filter_words, filter_words_num * sizeof(uint16_t));
+
+			spi_uio_cmd_cont(UIO_SET_AFILTER);
+			spi_write((const uint8_t*)words, (1 + filter_words_num) * sizeof(uint16_t), 1);
+			DisableIO();
 		}
 	}
 	else
 	{
+		if (filter_cfg[0]) printf("\nLoading audio filter: %s\n", filter_cfg_path);
 		spi_uio_cmd8(UIO_SET_AFILTER, (uint8_t)get_core_volume());
 	}
 }
@@ -195,11 +238,11 @@ void save_volume()
 	if (vol_set_timeout && CheckTimer(vol_set_timeout))
 	{
 		vol_set_timeout = 0;
-		FileSaveConfig("Volume.dat", &vol_att, 1);
+		FileSaveConfigLater("Volume.dat", &vol_att, 1);
 
 		static char cfg_name[128];
 		sprintf(cfg_name, "%s_volume.cfg", user_io_get_core_name());
-		FileSaveConfig(cfg_name, &corevol_att, 1);
+		FileSaveConfigLater(cfg_name, &corevol_att, 1);
 	}
 }
 
@@ -252,7 +295,7 @@ void audio_set_filter(const char *name)
 {
 	strcpy(filter_cfg + 1, name);
 	sprintf(filter_cfg_path, "%s_afilter.cfg", user_io_get_core_name());
-	FileSaveConfig(filter_cfg_path, &filter_cfg, sizeof(filter_cfg));
+	FileSaveConfigLater(filter_cfg_path, &filter_cfg, sizeof(filter_cfg));
 	setFilter();
 }
 
@@ -260,6 +303,6 @@ void audio_set_filter_en(int n)
 {
 	filter_cfg[0] = n ? 1 : 0;
 	sprintf(filter_cfg_path, "%s_afilter.cfg", user_io_get_core_name());
-	FileSaveConfig(filter_cfg_path, &filter_cfg, sizeof(filter_cfg));
+	FileSaveConfigLater(filter_cfg_path, &filter_cfg, sizeof(filter_cfg));
 	setFilter();
 }
@@ -0,0 +1,171 @@
+// Timings of the CPU bound kernels without the FPGA, built by "make bench".
+// All inputs are generated, files go to a temp folder which is removed at
+// the end. "bench <name>..." runs only the named kernels.
+//
+// The host build links just the standalone units. The ARM build has the
+// whole program linked in (BENCH_FULL) and also times the ini parser, the
+// core config string and the folder scan.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <libchdr/chd.h>
+
+#include "miniz.h"
+#include "crc.h"
+#include "swap_util.h"
+#include "scaler.h"
+#include "profiling.h"
+#include "support/c64/c64_gcr.h"
+#include "support/neogeo/neogeo_convert.h"
+
+#ifdef BENCH_FULL
+#include "cfg.h"
+#include "file_io.h"
+#include "user_io.h"
+
+const char *version = "$VER:bench";
+#endif
+
+#define CHD_HUNKS     256
+#define CHD_HUNKBYTES (8 * 2448) // 8 raw CD frames with subcode
+
+static void put_be(uint8_t *p, uint64_t v, int len)
+{
+	while (len--)
+	{
+		p[len] = (uint8_t)v;
+		v >>= 8;
+	}
+}
+
+// Writes a v4 CHD of zlib hunks, the one layout that takes no compressed
+// map. The data is half repeating, half noise, about what discs pack to.
+static int chd_write(const char *name)
+{
+	static uint8_t raw[CHD_HUNKBYTES];
+	static uint8_t packed[CHD_HUNKS][CHD_HUNKBYTES];
+	static uint32_t len[CHD_HUNKS];
+	uint32_t seed = 1;
+
+	int flags = tdefl_create_comp_flags_from_zip_params(6, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY);
+	for (int h = 0; h < CHD_HUNKS; h++)
+	{
+		for (uint32_t i = 0; i < sizeof(raw); i++)
+		{
+			seed = seed * 1103515245 + 12345;
+			raw[i] = (i & 256) ? (uint8_t)(seed >> 24) : (uint8_t)(i >> 4);
+		}
+
+		len[h] = tdefl_compress_mem_to_mem(packed[h], sizeof(packed[h]), raw, sizeof(raw), flags);
+		if (!len[h]) return 0;
+	}
+
+	uint8_t hdr[108] = { 'M', 'C', 'o', 'm', 'p', 'r', 'H', 'D' };
+	put_be(hdr + 8, sizeof(hdr), 4);
+	put_be(hdr + 12, 4, 4);                                   // version
+	put_be(hdr + 20, CHDCOMPRESSION_ZLIB, 4);
+	put_be(hdr + 24, CHD_HUNKS, 4);
+	put_be(hdr + 28, (uint64_t)CHD_HUNKS * CHD_HUNKBYTES, 8); // logical bytes
+	put_be(hdr + 44, CHD_HUNKBYTES, 4);
+
+	FILE *fp = fopen(name, "wb");
+	if (!fp) return 0;
+
+	int ok = fwrite(hdr, sizeof(hdr), 1, fp) == 1;
+	uint64_t offset = sizeof(hdr) + (CHD_HUNKS + 1) * 16;
+	for (int h = 0; h < CHD_HUNKS && ok; h++)
+	{
+		// offset, crc, 24 bit length, compressed without a crc to check
+		uint8_t entry[16] = {};
+		put_be(entry, offset, 8);
+		put_be(entry + 12, len[h] & 0xFFFF, 2);
+		entry[14] = (uint8_t)(len[h] >> 16);
+		entry[15] = 0x11; // V34_MAP_ENTRY_TYPE_COMPRESSED | MAP_ENTRY_FLAG_NO_CRC
+		ok = fwrite(entry, sizeof(entry), 1, fp) == 1;
+		offset += len[h];
+	}
+
+	ok = ok && fwrite("EndOfListCookie", 16, 1, fp) == 1;
+	for (int h = 0; h < CHD_HUNKS && ok; h++) ok = fwrite(packed[h], len[h], 1, fp) == 1;
+	return !fclose(fp) && ok;
+}
+
+static void chd_bench(const char *dir)
+{
+	char name[1024];
+	snprintf(name, sizeof(name), "%s/bench.chd", dir);
+
+	chd_file *chd = NULL;
+	chd_error err = chd_write(name) ? chd_open(name, CHD_OPEN_READ, NULL, &chd) : CHDERR_FILE_NOT_WRITEABLE;
+	if (err != CHDERR_NONE)
+	{
+		printf("chd_bench: %s\n", chd_error_string(err));
+		unlink(name);
+		return;
+	}
+
+	static uint8_t buf[CHD_HUNKBYTES];
+	const int loops = 4;
+	uint64_t start = profiling_time_us();
+	for (int n = 0; n < loops && err == CHDERR_NONE; n++)
+	{
+		for (int h = 0; h < CHD_HUNKS && err == CHDERR_NONE; h++) err = chd_read(chd, h, buf);
+	}
+	uint64_t us = profiling_time_us() - start;
+
+	chd_close(chd);
+	unlink(name);
+
+	if (err != CHDERR_NONE) printf("chd_bench: %s\n", chd_error_string(err));
+	else profiling_bench_report("chd zlib hunk", us, CHD_HUNKS * loops, (uint64_t)CHD_HUNKS * CHD_HUNKBYTES * loops);
+}
+
+static const char *tmp_dir;
+
+static void chd_run() { chd_bench(tmp_dir); }
+#ifdef BENCH_FULL
+static void ini_run() { cfg_bench(tmp_dir); }
+#endif
+
+static const struct
+{
+	const char *name;
+	void (*fn)();
+} benches[] =
+{
+	{ "crc", crc_bench },
+	{ "swap", swap_bench },
+	{ "gcr", c64_gcr_bench },
+	{ "neogeo", neogeo_convert_bench },
+	{ "scaler", mister_scaler_bench },
+	{ "chd", chd_run },
+#ifdef BENCH_FULL
+	{ "ini", ini_run },
+	{ "confstr", user_io_confstr_bench },
+	{ "scan", scan_bench },
+#endif
+};
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/mister_bench.XXXXXX";
+	if (!mkdtemp(dir))
+	{
+		printf("Unable to create %s\n", dir);
+		return 1;
+	}
+	tmp_dir = dir;
+
+	for (uint32_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+	{
+		int run = argc < 2;
+		for (int a = 1; a < argc; a++) if (!strcmp(argv[a], benches[i].name)) run = 1;
+		if (run) benches[i].fn();
+	}
+
+	rmdir(dir);
+	return 0;
+}
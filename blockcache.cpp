@@ -0,0 +1,570 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <stdio_ext.h>
+#include <sys/mman.h>
+#include <atomic>
+
+#include "blockcache.h"
+#include "hardware.h"
+#include "offload.h"
+#include "cfg.h"
+#include "menu.h"
+#include "user_io.h"
+
+#define BC_DISKS     20  // 16 SD disks + 4 IDE drives
+#define BC_EXTENT    (16 * 1024)
+#define BC_READAHEAD 2
+#define BC_COALESCE  (256 * 1024)
+#define BC_MAP_MAX   (256 * 1024)
+
+enum
+{
+	EXT_EMPTY = 0,
+	EXT_LOADING,  // read-ahead in flight on the offload thread
+	EXT_VALID
+};
+
+struct Extent
+{
+	uint64_t offset;          // BC_EXTENT aligned
+	std::atomic<int> state;
+	uint32_t dirty_lo;        // dirty byte range, clean if lo >= hi
+	uint32_t dirty_hi;
+	uint32_t last_use;
+	uint8_t *data;
+};
+
+struct DiskCache
+{
+	fileTYPE *file;
+	Extent *ext;
+	int count;
+	int dirty;
+	uint32_t use_counter;
+	uint64_t seq_end;         // end of the previous read
+	unsigned long flush_timer;
+	offload_job_t flush_job;  // write-back in flight
+};
+
+// dirty runs handed over to the offload thread, data follows each header
+struct FlushRun
+{
+	uint64_t offset;
+	uint32_t len;
+};
+
+static DiskCache disks[BC_DISKS] = {};
+
+// Small images (save files, memory cards) are mapped whole with MAP_SHARED,
+// so sector access is a memcpy and writes are synced with msync on the
+// offload thread under the same delay rules as the extent cache.
+struct DiskMap
+{
+	fileTYPE *file;           // set once tried, data is null if it can't be mapped
+	uint8_t *data;
+	uint32_t size;
+	int dirty;
+	unsigned long flush_timer;
+	offload_job_t sync_job;
+};
+
+static DiskMap maps[BC_DISKS] = {};
+static blockcache_stats_t stats = {};
+
+static uint16_t write_delay(int disk)
+{
+	int hdd = (disk >= BLOCKCACHE_IDE(0)) || (disk >= BLOCKCACHE_ACSI(0) && is_st());
+	return hdd ? cfg.ide_write_delay : cfg.sd_write_delay;
+}
+
+static void map_sync(DiskMap *m, int async)
+{
+	if (!m->dirty) return;
+
+	if (!offload_job_done(m->sync_job))
+	{
+		if (async) return;
+		offload_wait(m->sync_job);
+	}
+
+	uint8_t *data = m->data;
+	uint32_t size = m->size;
+	m->dirty = 0;
+	m->sync_job = !async ? 0 : offload_try_work([data, size]()
+		{
+			if (msync(data, size, MS_SYNC)) printf("blockcache: msync error(%d).\n", errno);
+		}, OFFLOAD_IO);
+
+	if (!m->sync_job && msync(data, size, MS_SYNC)) printf("blockcache: msync error(%d).\n", errno);
+}
+
+static void map_drop(DiskMap *m)
+{
+	if (m->data)
+	{
+		map_sync(m, 0);
+		offload_wait(m->sync_job);
+		munmap(m->data, m->size);
+	}
+
+	memset(m, 0, sizeof(DiskMap));
+}
+
+static DiskMap *get_map(int disk, fileTYPE *file)
+{
+	if (disk < 0 || disk >= BC_DISKS) return nullptr;
+
+	DiskMap *m = &maps[disk];
+	if (m->file != file)
+	{
+		map_drop(m);
+		m->file = file;
+
+		if (file->filp && !file->zip && !file->zcache && file->size > 0 && file->size <= BC_MAP_MAX)
+		{
+			void *data = mmap(NULL, file->size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file->filp), 0);
+			if (data != MAP_FAILED)
+			{
+				// drop stdio read-ahead which may hold older data than the mapping
+				if (__freading(file->filp)) fflush(file->filp);
+				m->data = (uint8_t*)data;
+				m->size = file->size;
+			}
+		}
+	}
+
+	return m->data ? m : nullptr;
+}
+
+static void wait_extent(Extent *e)
+{
+	while (e->state.load(std::memory_order_acquire) == EXT_LOADING) sched_yield();
+}
+
+// the file is behind the cache until the pending write-back lands
+static void wait_flush(DiskCache *dc)
+{
+	offload_wait(dc->flush_job);
+	dc->flush_job = 0;
+}
+
+static DiskCache *get_cache(int disk, fileTYPE *file)
+{
+	if (disk < 0 || disk >= BC_DISKS || !cfg.sd_cache_extents) return nullptr;
+
+	DiskCache *dc = &disks[disk];
+	if (dc->file != file) blockcache_drop(disk);
+
+	if (!dc->ext)
+	{
+		dc->ext = new Extent[cfg.sd_cache_extents];
+		dc->count = cfg.sd_cache_extents;
+		for (int i = 0; i < dc->count; i++)
+		{
+			dc->ext[i].state.store(EXT_EMPTY);
+			dc->ext[i].dirty_lo = dc->ext[i].dirty_hi = 0;
+			dc->ext[i].last_use = 0;
+			dc->ext[i].data = (uint8_t*)malloc(BC_EXTENT);
+			if (!dc->ext[i].data)
+			{
+				printf("blockcache: out of memory.\n");
+				dc->count = i;
+				break;
+			}
+		}
+		dc->file = file;
+		dc->seq_end = UINT64_MAX;
+	}
+
+	return dc->count ? dc : nullptr;
+}
+
+static Extent *find_extent(DiskCache *dc, uint64_t offset)
+{
+	for (int i = 0; i < dc->count; i++)
+	{
+		Extent *e = &dc->ext[i];
+		if (e->offset == offset && e->state.load(std::memory_order_acquire) != EXT_EMPTY) return e;
+	}
+	return nullptr;
+}
+
+static int write_file(fileTYPE *file, uint64_t offset, void *buf, uint32_t size)
+{
+	return FileWriteAt(file, offset, buf, size) > 0;
+}
+
+static void write_runs(int fd, uint8_t *runs, uint32_t size)
+{
+	uint32_t pos = 0;
+	while (pos < size)
+	{
+		FlushRun *run = (FlushRun*)(runs + pos);
+		pos += sizeof(FlushRun);
+		if (pwrite64(fd, runs + pos, run->len, run->offset) != (ssize_t)run->len) printf("blockcache: write error(%d).\n", errno);
+		pos += (run->len + 7) & ~7;
+	}
+}
+
+static void flush_extent(DiskCache *dc, Extent *e)
+{
+	if (e->dirty_lo >= e->dirty_hi) return;
+
+	wait_flush(dc);
+	write_file(dc->file, e->offset + e->dirty_lo, e->data + e->dirty_lo, e->dirty_hi - e->dirty_lo);
+	e->dirty_lo = e->dirty_hi = 0;
+}
+
+static Extent *alloc_extent(DiskCache *dc, uint64_t offset)
+{
+	Extent *victim = nullptr;
+	for (int i = 0; i < dc->count; i++)
+	{
+		Extent *e = &dc->ext[i];
+		int state = e->state.load(std::memory_order_acquire);
+		if (state == EXT_EMPTY)
+		{
+			victim = e;
+			break;
+		}
+
+		if (state == EXT_VALID && (!victim || e->last_use < victim->last_use)) victim = e;
+	}
+
+	if (!victim) return nullptr;
+
+	flush_extent(dc, victim);
+	victim->state.store(EXT_EMPTY, std::memory_order_relaxed);
+	victim->offset = offset;
+	victim->last_use = ++dc->use_counter;
+	return victim;
+}
+
+static Extent *load_extent(DiskCache *dc, uint64_t offset)
+{
+	Extent *e = find_extent(dc, offset);
+	if (e)
+	{
+		wait_extent(e);
+		e->last_use = ++dc->use_counter;
+		return e;
+	}
+
+	e = alloc_extent(dc, offset);
+	if (!e) return nullptr;
+
+	wait_flush(dc);
+	int len = FileReadAt(dc->file, offset, e->data, BC_EXTENT);
+	if (len < BC_EXTENT) memset(e->data + len, 0, BC_EXTENT - len);
+
+	e->state.store(EXT_VALID, std::memory_order_release);
+	return e;
+}
+
+static void prefetch_extent(DiskCache *dc, uint64_t offset)
+{
+	fileTYPE *file = dc->file;
+
+	// only plain files can be read with pread from another thread
+	if (!file->filp || file->zip || file->zcache || (__off64_t)offset >= file->size) return;
+	if (find_extent(dc, offset) || !offload_job_done(dc->flush_job)) return;
+
+	Extent *e = alloc_extent(dc, offset);
+	if (!e) return;
+
+	e->state.store(EXT_LOADING, std::memory_order_relaxed);
+	if (!offload_try_work([e, file, offset]()
+		{
+			int len = FileReadAt(file, offset, e->data, BC_EXTENT);
+			if (len < BC_EXTENT) memset(e->data + len, 0, BC_EXTENT - len);
+			e->state.store(EXT_VALID, std::memory_order_release);
+		}, OFFLOAD_IO))
+	{
+		e->state.store(EXT_EMPTY, std::memory_order_relaxed);
+	}
+}
+
+int blockcache_read(int disk, fileTYPE *file, uint64_t offset, void *buf, uint32_t size)
+{
+	stats.reads++;
+	stats.read_bytes += size;
+
+	DiskMap *m = get_map(disk, file);
+	if (m && offset + size <= m->size)
+	{
+		memcpy(buf, m->data + offset, size);
+		return size;
+	}
+
+	DiskCache *dc = get_cache(disk, file);
+	if (!dc) return FileReadAt(file, offset, buf, size);
+
+	uint8_t *dst = (uint8_t*)buf;
+	uint64_t pos = offset;
+	uint64_t end = offset + size;
+	while (pos < end)
+	{
+		uint64_t base = pos & ~(uint64_t)(BC_EXTENT - 1);
+		Extent *e = load_extent(dc, base);
+		if (!e)
+		{
+			wait_flush(dc);
+			return FileReadAt(file, offset, buf, size);
+		}
+
+		uint32_t len = (uint32_t)((end < base + BC_EXTENT ? end : base + BC_EXTENT) - pos);
+		memcpy(dst, e->data + (pos - base), len);
+		dst += len;
+		pos += len;
+	}
+
+	if (offset == dc->seq_end)
+	{
+		uint64_t base = (end + BC_EXTENT - 1) & ~(uint64_t)(BC_EXTENT - 1);
+		for (int i = 0; i < BC_READAHEAD && i < dc->count / 2; i++) prefetch_extent(dc, base + i * BC_EXTENT);
+	}
+	dc->seq_end = end;
+
+	return size;
+}
+
+int blockcache_write(int disk, fileTYPE *file, uint64_t offset, void *buf, uint32_t size)
+{
+	stats.writes++;
+	stats.write_bytes += size;
+
+	DiskMap *m = get_map(disk, file);
+	if (m && offset + size <= m->size)
+	{
+		memcpy(m->data + offset, buf, size);
+		m->dirty = 1;
+		if (!write_delay(disk)) map_sync(m, 0);
+		else m->flush_timer = GetTimer(write_delay(disk));
+		return size;
+	}
+
+	DiskCache *dc = get_cache(disk, file);
+	int write_back = dc && write_delay(disk);
+
+	uint8_t *src = (uint8_t*)buf;
+	uint64_t pos = offset;
+	uint64_t end = offset + size;
+	while (dc && pos < end)
+	{
+		uint64_t base = pos & ~(uint64_t)(BC_EXTENT - 1);
+		uint32_t lo = (uint32_t)(pos - base);
+		uint32_t len = (uint32_t)((end < base + BC_EXTENT ? end : base + BC_EXTENT) - pos);
+
+		Extent *e = find_extent(dc, base);
+		if (e) wait_extent(e);
+		else if (write_back)
+		{
+			// full extent writes don't need the old data
+			if (len == BC_EXTENT)
+			{
+				e = alloc_extent(dc, base);
+				if (e) e->state.store(EXT_VALID, std::memory_order_relaxed);
+			}
+			else e = load_extent(dc, base);
+		}
+
+		if (e)
+		{
+			memcpy(e->data + lo, src, len);
+			e->last_use = ++dc->use_counter;
+			if (write_back)
+			{
+				if (e->dirty_lo >= e->dirty_hi)
+				{
+					e->dirty_lo = lo;
+					e->dirty_hi = lo + len;
+				}
+				else
+				{
+					if (lo < e->dirty_lo) e->dirty_lo = lo;
+					if (lo + len > e->dirty_hi) e->dirty_hi = lo + len;
+				}
+			}
+		}
+		else if (write_back)
+		{
+			// no extent available, write this part through
+			wait_flush(dc);
+			if (!write_file(file, pos, src, len)) return 0;
+		}
+
+		src += len;
+		pos += len;
+	}
+
+	if (!write_back) return write_file(file, offset, buf, size) ? size : 0;
+
+	// the write is pending, but the image already has its new size
+	if ((__off64_t)end > file->size) file->size = end;
+
+	dc->dirty = 1;
+	dc->flush_timer = GetTimer(write_delay(disk));
+	return size;
+}
+
+// Dirty extents are collected in offset order, adjacent ones merged into
+// one run. With async the runs are written on the offload thread, so the
+// main loop doesn't wait for the (O_SYNC) writes.
+static void flush_disk(DiskCache *dc, int async)
+{
+	if (!dc->dirty) return;
+
+	// keep the writes in order, a newer flush waits for the previous one
+	if (!offload_job_done(dc->flush_job))
+	{
+		if (async) return;
+		wait_flush(dc);
+	}
+
+	uint32_t total = 0;
+	for (int i = 0; i < dc->count; i++)
+	{
+		Extent *e = &dc->ext[i];
+		if (e->dirty_lo < e->dirty_hi) total += sizeof(FlushRun) + ((e->dirty_hi - e->dirty_lo + 7) & ~7);
+	}
+
+	uint8_t *runs = (uint8_t*)malloc(total);
+	if (!runs)
+	{
+		printf("blockcache: out of memory, writing through.\n");
+		for (int i = 0; i < dc->count; i++) flush_extent(dc, &dc->ext[i]);
+		dc->dirty = 0;
+		return;
+	}
+
+	uint32_t size = 0;
+	while (1)
+	{
+		Extent *first = nullptr;
+		for (int i = 0; i < dc->count; i++)
+		{
+			Extent *e = &dc->ext[i];
+			if (e->dirty_lo < e->dirty_hi && (!first || e->offset < first->offset)) first = e;
+		}
+
+		if (!first) break;
+
+		FlushRun *run = (FlushRun*)(runs + size);
+		uint8_t *data = runs + size + sizeof(FlushRun);
+		run->offset = first->offset + first->dirty_lo;
+		run->len = first->dirty_hi - first->dirty_lo;
+		memcpy(data, first->data + first->dirty_lo, run->len);
+
+		Extent *cur = first;
+		while (cur->dirty_hi == BC_EXTENT && run->len + BC_EXTENT <= BC_COALESCE)
+		{
+			Extent *next = find_extent(dc, cur->offset + BC_EXTENT);
+			if (!next || next->dirty_lo != 0 || next->dirty_hi <= next->dirty_lo) break;
+
+			// merged runs reuse the padding room of the extents they swallow
+			memcpy(data + run->len, next->data, next->dirty_hi);
+			run->len += next->dirty_hi;
+			cur->dirty_lo = cur->dirty_hi = 0;
+			cur = next;
+		}
+		cur->dirty_lo = cur->dirty_hi = 0;
+		first->dirty_lo = first->dirty_hi = 0;
+
+		size += sizeof(FlushRun) + ((run->len + 7) & ~7);
+	}
+
+	dc->dirty = 0;
+
+	fileTYPE *file = dc->file;
+	if (!file->filp)
+	{
+		printf("blockcache: write error(not supported for this file type).\n");
+		free(runs);
+		return;
+	}
+
+	int fd = fileno(file->filp);
+
+	// drop stdio read-ahead which may hold the old data
+	if (__freading(file->filp)) fflush(file->filp);
+
+	dc->flush_job = !async ? 0 : offload_try_work([fd, runs, size]()
+		{
+			write_runs(fd, runs, size);
+			free(runs);
+		}, OFFLOAD_IO);
+
+	if (!dc->flush_job)
+	{
+		write_runs(fd, runs, size);
+		free(runs);
+	}
+}
+
+void blockcache_flush(int disk)
+{
+	for (int i = 0; i < BC_DISKS; i++)
+	{
+		if ((disk < 0 || disk == i) && disks[i].ext)
+		{
+			flush_disk(&disks[i], 0);
+			wait_flush(&disks[i]);
+		}
+
+		if ((disk < 0 || disk == i) && maps[i].data)
+		{
+			map_sync(&maps[i], 0);
+			offload_wait(maps[i].sync_job);
+			maps[i].sync_job = 0;
+		}
+	}
+}
+
+void blockcache_drop(int disk)
+{
+	if (disk < 0 || disk >= BC_DISKS) return;
+
+	map_drop(&maps[disk]);
+
+	DiskCache *dc = &disks[disk];
+	if (dc->ext)
+	{
+		flush_disk(dc, 0);
+		wait_flush(dc);
+		for (int i = 0; i < dc->count; i++)
+		{
+			wait_extent(&dc->ext[i]);
+			free(dc->ext[i].data);
+		}
+		delete[] dc->ext;
+	}
+
+	dc->ext = nullptr;
+	dc->count = 0;
+	dc->dirty = 0;
+	dc->file = nullptr;
+}
+
+void blockcache_poll()
+{
+	// the OSD showing up is a good hint that the machine may be switched off next
+	static int osd_was_open = 0;
+	int osd_open = menu_present();
+	int force = osd_open && !osd_was_open;
+	osd_was_open = osd_open;
+
+	for (int i = 0; i < BC_DISKS; i++)
+	{
+		if (disks[i].dirty && (force || CheckTimer(disks[i].flush_timer))) flush_disk(&disks[i], 1);
+		if (maps[i].dirty && (force || CheckTimer(maps[i].flush_timer))) map_sync(&maps[i], 1);
+	}
+}
+
+void blockcache_get_stats(blockcache_stats_t *st)
+{
+	*st = stats;
+}
@@ -0,0 +1,39 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <stdint.h>
+#include "file_io.h"
+
+// Per-disk extent cache for the SD block emulation. Reads are served from
+// cached extents with sequential read-ahead, writes are coalesced and
+// written back on the offload thread after sd_write_delay ms of idle time
+// (write-through if 0) or as soon as the OSD opens.
+// sd_cache_extents=0 passes everything straight to the file.
+// Images up to 256KB (saves, memory cards) are always kept mmap'ed and
+// synced the same way.
+// HDD images use ide_write_delay instead of sd_write_delay: the IDE drives
+// of ao486, PCXT, Minimig and Archie and, on the ST, the ACSI targets which
+// take the two last SD disks.
+
+#define BLOCKCACHE_ACSI(n) (14 + (n))
+#define BLOCKCACHE_IDE(n)  (16 + (n))
+
+int  blockcache_read(int disk, fileTYPE *file, uint64_t offset, void *buf, uint32_t size);
+int  blockcache_write(int disk, fileTYPE *file, uint64_t offset, void *buf, uint32_t size);
+
+void blockcache_flush(int disk); // -1 flushes all disks, returns once written
+void blockcache_drop(int disk);  // flush and forget, call before the image changes
+void blockcache_poll();
+
+struct blockcache_stats_t
+{
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t writes;
+	uint64_t write_bytes;
+};
+
+// Totals of all disks since start.
+void blockcache_get_stats(blockcache_stats_t *stats);
+
+#endif
@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "blockdev.h"
+#include "blockcache.h"
+#include "file_io.h"
+#include "cfg.h"
+#include "profiling.h"
+#include "support/chd/mister_chd.h"
+
+// Overlay files (CHD overlays and sparse images) start with a header
+// sector, followed by a log of 32KB blocks, each behind a sector naming
+// the block. A block is allocated on its first write and rewritten in
+// place afterwards, unless it predates the snapshot: then it's appended
+// again, so a rollback only has to cut the log. Later records win.
+#define OVL_MAGIC   0x4C564F4D  // "MOVL"
+#define OVL_VERSION 1
+#define OVL_BLOCK   (32 * 1024)
+#define OVL_HDR     512
+#define OVL_REC     (OVL_HDR + OVL_BLOCK)
+#define REC_MAGIC   0x4B4C424D  // "MBLK"
+
+struct ovl_hdr_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;   // disk size, CHD overlays take it from the CHD
+	uint32_t snap;   // records before the snapshot
+};
+
+struct ovl_rec_t
+{
+	uint32_t magic;
+	uint32_t block;
+};
+
+struct ovl_dev_t
+{
+	const fileTYPE *file;
+	chd_file *chd;   // base image, holes read as zeros without one
+	fileTYPE log;
+	char log_name[1024];
+	uint32_t records;
+	uint32_t snap;
+	std::unordered_map<uint32_t, uint32_t> map;  // block -> record
+};
+
+static blockdev_stats_t stats[BLOCKDEV_NUM] = {};
+static ovl_dev_t ovl_dev[BLOCKDEV_NUM];
+
+static ovl_dev_t *get_ovl(int dev, const fileTYPE *file)
+{
+	ovl_dev_t *d = &ovl_dev[dev];
+	return (d->file && d->file == file) ? d : nullptr;
+}
+
+static inline uint64_t rec_pos(uint32_t rec)
+{
+	return OVL_HDR + (uint64_t)rec * OVL_REC;
+}
+
+static int ovl_write_hdr(ovl_dev_t *d)
+{
+	uint8_t sec[OVL_HDR] = {};
+	ovl_hdr_t *hdr = (ovl_hdr_t*)sec;
+	hdr->magic = OVL_MAGIC;
+	hdr->version = OVL_VERSION;
+	hdr->size = d->chd ? 0 : d->file->size;
+	hdr->snap = d->snap;
+	return FileWriteAt(&d->log, 0, sec, sizeof(sec)) == sizeof(sec);
+}
+
+// rebuilds the block map, a torn record at the end is dropped and overwritten
+static void ovl_scan(ovl_dev_t *d)
+{
+	d->map.clear();
+	d->records = 0;
+
+	uint32_t num = (d->log.size > OVL_HDR) ? (uint32_t)((d->log.size - OVL_HDR) / OVL_REC) : 0;
+	for (uint32_t i = 0; i < num; i++)
+	{
+		ovl_rec_t rec;
+		if (FileReadAt(&d->log, rec_pos(i), &rec, sizeof(rec)) != sizeof(rec) || rec.magic != REC_MAGIC) break;
+		d->map[rec.block] = i;
+		d->records = i + 1;
+	}
+
+	if (d->snap > d->records) d->snap = d->records;
+}
+
+// opens the log and checks its header, create makes a new CHD overlay
+static int ovl_open(ovl_dev_t *d, int create)
+{
+	if (d->log.opened()) return 1;
+
+	int mode = O_RDWR | O_SYNC;
+	if (!FileOpenEx(&d->log, d->log_name, create ? (mode | O_CREAT) : mode, !create))
+	{
+		if (create) printf("blockdev: can't create the overlay %s\n", d->log_name);
+		return 0;
+	}
+
+	ovl_hdr_t hdr = {};
+	if (!d->log.size && create)
+	{
+		d->snap = 0;
+		if (!ovl_write_hdr(d))
+		{
+			FileClose(&d->log);
+			return 0;
+		}
+	}
+	else if (FileReadAt(&d->log, 0, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != OVL_MAGIC || hdr.version != OVL_VERSION)
+	{
+		printf("blockdev: %s is not an overlay\n", d->log_name);
+		FileClose(&d->log);
+		return 0;
+	}
+	else
+	{
+		d->snap = hdr.snap;
+	}
+
+	ovl_scan(d);
+	printf("blockdev: %s, %u blocks, snapshot at %u\n", d->log_name, d->records, d->snap);
+	return 1;
+}
+
+// data of one range within a block
+static int ovl_get(ovl_dev_t *d, uint64_t pos, uint8_t *buf, uint32_t len)
+{
+	auto it = d->map.find((uint32_t)(pos / OVL_BLOCK));
+	if (it != d->map.end())
+	{
+		uint64_t at = rec_pos(it->second) + OVL_HDR + pos % OVL_BLOCK;
+		return FileReadAt(&d->log, at, buf, len) == (int)len;
+	}
+
+	if (!d->chd)
+	{
+		memset(buf, 0, len);
+		return 1;
+	}
+
+	return mister_chd_read(d->chd, pos, buf, len) == CHDERR_NONE;
+}
+
+static uint32_t ovl_clamp(ovl_dev_t *d, uint64_t offset, uint32_t size)
+{
+	uint64_t total = d->file->size;
+	if (offset >= total) return 0;
+	return (offset + size > total) ? (uint32_t)(total - offset) : size;
+}
+
+static int ovl_read(ovl_dev_t *d, uint64_t offset, uint8_t *buf, uint32_t size)
+{
+	size = ovl_clamp(d, offset, size);
+	for (uint32_t done = 0; done < size;)
+	{
+		uint64_t pos = offset + done;
+		uint32_t len = OVL_BLOCK - (uint32_t)(pos % OVL_BLOCK);
+		if (len > size - done) len = size - done;
+
+		if (!ovl_get(d, pos, buf + done, len)) return 0;
+		done += len;
+	}
+
+	return size;
+}
+
+static int ovl_write(ovl_dev_t *d, uint64_t offset, const uint8_t *buf, uint32_t size)
+{
+	static uint8_t blk[OVL_BLOCK];
+
+	size = ovl_clamp(d, offset, size);
+	if (!size || !ovl_open(d, 1)) return 0;
+
+	for (uint32_t done = 0; done < size;)
+	{
+		uint64_t pos = offset + done;
+		uint32_t block = (uint32_t)(pos / OVL_BLOCK);
+		uint32_t lo = (uint32_t)(pos % OVL_BLOCK);
+		uint32_t len = OVL_BLOCK - lo;
+		if (len > size - done) len = size - done;
+
+		auto it = d->map.find(block);
+		if (it != d->map.end() && it->second >= d->snap)
+		{
+			uint64_t at = rec_pos(it->second) + OVL_HDR + lo;
+			if (FileWriteAt(&d->log, at, buf + done, len) != (int)len) return 0;
+		}
+		else
+		{
+			// the rest of the block comes from the older record or the base,
+			// the tail of the disk is zero padded
+			if (len < OVL_BLOCK)
+			{
+				memset(blk, 0, sizeof(blk));
+				if (!ovl_read(d, (uint64_t)block * OVL_BLOCK, blk, OVL_BLOCK)) return 0;
+			}
+			memcpy(blk + lo, buf + done, len);
+
+			// data first, the header makes the record valid
+			uint32_t rec = d->records;
+			ovl_rec_t hdr = { REC_MAGIC, block };
+			if (FileWriteAt(&d->log, rec_pos(rec) + OVL_HDR, blk, OVL_BLOCK) != OVL_BLOCK) return 0;
+			if (FileWriteAt(&d->log, rec_pos(rec), &hdr, sizeof(hdr)) != sizeof(hdr)) return 0;
+
+			d->map[block] = rec;
+			d->records++;
+		}
+
+		done += len;
+	}
+
+	return size;
+}
+
+static void ovl_attach(ovl_dev_t *d, fileTYPE *file, const char *name, uint64_t size)
+{
+	FileClose(file);
+	const char *path = getFullPath(name);
+	const char *p = strrchr(path, '/');
+	snprintf(file->path, sizeof(file->path), "%s", path);
+	snprintf(file->name, sizeof(file->name), "%s", p ? p + 1 : path);
+	file->size = size;
+	file->offset = 0;
+	file->mode = O_RDWR;
+
+	d->file = file;
+	d->records = 0;
+	d->snap = 0;
+	d->map.clear();
+}
+
+static int is_sparse(const char *name, uint64_t *size)
+{
+	fileTYPE f;
+	ovl_hdr_t hdr = {};
+	if (!FileOpenEx(&f, name, O_RDONLY, 1)) return 0;
+
+	int res = FileReadAt(&f, 0, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == OVL_MAGIC && hdr.version == OVL_VERSION && hdr.size;
+	FileClose(&f);
+
+	*size = hdr.size;
+	return res;
+}
+
+int blockdev_attach(int dev, fileTYPE *file, const char *name)
+{
+	if (dev < 0 || dev >= BLOCKDEV_NUM) return 0;
+
+	int len = strlen(name);
+	int chd = dev >= BLOCKDEV_IDE(0) && len > 4 && !strcasecmp(name + len - 4, ".chd");
+
+	uint64_t size = 0;
+	chd_file *chd_f = nullptr;
+	if (chd)
+	{
+		if (mister_chd_open_hdd(name, &chd_f) != CHDERR_NONE) return 0;
+		size = chd_get_header(chd_f)->logicalbytes;
+	}
+	else if (!FileCanWrite(name) || !is_sparse(name, &size))
+	{
+		return 0;
+	}
+
+	blockdev_detach(file);
+	ovl_dev_t *d = &ovl_dev[dev];
+	if (d->file) blockdev_detach(d->file);
+
+	ovl_attach(d, file, name, size);
+	d->chd = chd_f;
+	if (chd)
+	{
+		snprintf(d->log_name, sizeof(d->log_name), "%s.cow", name);
+		ovl_open(d, 0);
+		printf("blockdev: %s as HDD (%llu MB), writes go to %s\n", file->name, file->size >> 20, d->log_name);
+	}
+	else
+	{
+		snprintf(d->log_name, sizeof(d->log_name), "%s", name);
+		if (!ovl_open(d, 0))
+		{
+			d->file = nullptr;
+			return 0;
+		}
+		printf("blockdev: %s as sparse disk (%llu MB)\n", file->name, file->size >> 20);
+	}
+
+	return 1;
+}
+
+void blockdev_detach(const fileTYPE *file)
+{
+	for (int i = 0; i < BLOCKDEV_NUM; i++)
+	{
+		ovl_dev_t *d = &ovl_dev[i];
+		if (!d->file || d->file != file) continue;
+
+		if (d->chd) mister_chd_close(d->chd);
+		FileClose(&d->log);
+		d->map.clear();
+		d->chd = nullptr;
+		d->file = nullptr;
+	}
+}
+
+int blockdev_create_sparse(const char *name, uint64_t size)
+{
+	if (!size || size / OVL_BLOCK > 0xFFFFFFFFULL)
+	{
+		printf("blockdev: bad disk size\n");
+		return 0;
+	}
+
+	fileTYPE f;
+	if (!FileOpenEx(&f, name, O_CREAT | O_TRUNC | O_RDWR | O_SYNC))
+	{
+		printf("blockdev: can't create %s\n", name);
+		return 0;
+	}
+
+	uint8_t sec[OVL_HDR] = {};
+	ovl_hdr_t *hdr = (ovl_hdr_t*)sec;
+	hdr->magic = OVL_MAGIC;
+	hdr->version = OVL_VERSION;
+	hdr->size = size;
+	int res = FileWriteAt(&f, 0, sec, sizeof(sec)) == sizeof(sec);
+	FileClose(&f);
+
+	if (res) printf("blockdev: created %s, %llu MB\n", name, size >> 20);
+	return res;
+}
+
+int blockdev_snapshot(int dev)
+{
+	ovl_dev_t *d = (dev >= 0 && dev < BLOCKDEV_NUM) ? &ovl_dev[dev] : nullptr;
+	if (!d || !d->file || !ovl_open(d, 1))
+	{
+		printf("blockdev: no overlay on device %d\n", dev);
+		return 0;
+	}
+
+	d->snap = d->records;
+	if (!ovl_write_hdr(d)) return 0;
+
+	printf("blockdev: snapshot of %s at %u blocks\n", d->log_name, d->snap);
+	return 1;
+}
+
+int blockdev_rollback(int dev)
+{
+	ovl_dev_t *d = (dev >= 0 && dev < BLOCKDEV_NUM) ? &ovl_dev[dev] : nullptr;
+	if (!d || !d->file || !ovl_open(d, 0))
+	{
+		printf("blockdev: no overlay on device %d\n", dev);
+		return 0;
+	}
+
+	if (ftruncate64(fileno(d->log.filp), rec_pos(d->snap)) < 0)
+	{
+		printf("blockdev: can't truncate %s\n", d->log_name);
+		return 0;
+	}
+
+	d->log.size = rec_pos(d->snap);
+	ovl_scan(d);
+	printf("blockdev: %s rolled back to %u blocks\n", d->log_name, d->records);
+	return 1;
+}
+
+int blockdev_by_name(const char *name)
+{
+	int n = -1;
+	if (sscanf(name, "sd%d", &n) == 1 && n >= 0 && n < BLOCKCACHE_IDE(0)) return BLOCKDEV_SD(n);
+	if (sscanf(name, "ide%d", &n) == 1 && n >= 0 && n < 4) return BLOCKDEV_IDE(n);
+	if (sscanf(name, "fdd%d", &n) == 1 && n >= 0 && n < 2) return BLOCKDEV_FDD(n);
+	return -1;
+}
+
+int blockdev_cached(int dev)
+{
+	if (dev >= 0 && dev < BLOCKDEV_NUM && ovl_dev[dev].file) return 0;
+
+	// SD images always go through the cache, it passes them straight to
+	// the file with sd_cache_extents=0 and keeps the small ones mapped
+	if (dev < BLOCKCACHE_IDE(0)) return 1;
+	if (dev < BLOCKDEV_FDD(0)) return cfg.ide_write_delay != 0;
+	return 0;
+}
+
+static void add_stats(int dev, int write, uint32_t size, uint64_t start)
+{
+	uint32_t us = (uint32_t)(profiling_time_us() - start);
+	blockdev_stats_t *st = &stats[dev];
+
+	if (write)
+	{
+		st->writes++;
+		st->write_bytes += size;
+	}
+	else
+	{
+		st->reads++;
+		st->read_bytes += size;
+	}
+
+	st->busy_us += us;
+	if (us > st->max_us) st->max_us = us;
+}
+
+int blockdev_read(int dev, fileTYPE *file, uint64_t offset, void *buf, uint32_t size)
+{
+	if (dev < 0 || dev >= BLOCKDEV_NUM) return 0;
+
+	uint64_t start = profiling_time_us();
+	ovl_dev_t *d = get_ovl(dev, file);
+	int res = d ? ovl_read(d, offset, (uint8_t*)buf, size) :
+		blockdev_cached(dev) ? blockcache_read(dev, file, offset, buf, size) : FileReadAt(file, offset, buf, size);
+	if (res > 0) add_stats(dev, 0, res, start);
+	return (res > 0) ? res : 0;
+}
+
+int blockdev_write(int dev, fileTYPE *file, uint64_t offset, const void *buf, uint32_t size)
+{
+	if (dev < 0 || dev >= BLOCKDEV_NUM) return 0;
+
+	uint64_t start = profiling_time_us();
+	ovl_dev_t *d = get_ovl(dev, file);
+	int res = d ? ovl_write(d, offset, (const uint8_t*)buf, size) :
+		blockdev_cached(dev) ? blockcache_write(dev, file, offset, (void*)buf, size) : FileWriteAt(file, offset, buf, size);
+	if (res > 0) add_stats(dev, 1, res, start);
+	return (res > 0) ? res : 0;
+}
+
+void blockdev_get_stats(blockdev_stats_t *st)
+{
+	memset(st, 0, sizeof(*st));
+	for (int i = 0; i < BLOCKDEV_NUM; i++)
+	{
+		st->reads += stats[i].reads;
+		st->read_bytes += stats[i].read_bytes;
+		st->writes += stats[i].writes;
+		st->write_bytes += stats[i].write_bytes;
+		st->busy_us += stats[i].busy_us;
+		if (stats[i].max_us > st->max_us) st->max_us = stats[i].max_us;
+	}
+}
+
+static void dev_name(int dev, char *name, size_t len)
+{
+	if (dev >= BLOCKDEV_FDD(0)) snprintf(name, len, "fdd%d", dev - BLOCKDEV_FDD(0));
+	else if (dev >= BLOCKDEV_IDE(0)) snprintf(name, len, "ide%d", dev - BLOCKDEV_IDE(0));
+	else snprintf(name, len, "sd%d", dev);
+}
+
+void blockdev_report(FILE *fp)
+{
+	fprintf(fp, "dev       reads    read KB   writes   write KB   avg us   max us\n");
+	for (int i = 0; i < BLOCKDEV_NUM; i++)
+	{
+		blockdev_stats_t *st = &stats[i];
+		uint64_t num = st->reads + st->writes;
+		if (!num) continue;
+
+		char name[8];
+		dev_name(i, name, sizeof(name));
+		fprintf(fp, "%-6s %8llu %10llu %8llu %10llu %8llu %8u%s\n", name, st->reads, st->read_bytes >> 10,
+			st->writes, st->write_bytes >> 10, st->busy_us / num, st->max_us, ovl_dev[i].chd ? " chd" : ovl_dev[i].file ? " sparse" : blockdev_cached(i) ? "" : " direct");
+	}
+	fflush(fp);
+}
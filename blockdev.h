@@ -0,0 +1,64 @@
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stdio.h>
+#include <inttypes.h>
+#include "file_io.h"
+#include "blockcache.h"
+
+// Common front end of the disk emulations. A device number is a block
+// cache disk (the SD images, the ST ACSI targets and the IDE drives, see
+// blockcache.h) or one of the direct devices after them. Every request is
+// routed here to the block cache or to positional file I/O and counted, so
+// caching and statistics work covers all cores at once.
+// Zipped images stay behind fileTYPE, CD CHDs and converted formats (NIB,
+// TRD, GCR) keep their own loaders on top. Main thread only.
+
+#define BLOCKDEV_SD(n)   (n)
+#define BLOCKDEV_ACSI(n) BLOCKCACHE_ACSI(n)
+#define BLOCKDEV_IDE(n)  BLOCKCACHE_IDE(n)
+#define BLOCKDEV_FDD(n)  (20 + (n))         // x86 floppies, not cached
+#define BLOCKDEV_NUM     22
+
+// 1 if the requests of the device go through the block cache
+int  blockdev_cached(int dev);
+
+// Return the number of bytes done, 0 on error.
+int  blockdev_read(int dev, fileTYPE *file, uint64_t offset, void *buf, uint32_t size);
+int  blockdev_write(int dev, fileTYPE *file, uint64_t offset, const void *buf, uint32_t size);
+
+// Serves file from an overlay backend if name is one, file then becomes a
+// closed placeholder with the size of the disk. Returns 0 otherwise.
+// - CHD HDD images (IDE devices only): reads are decoded through the
+//   shared hunk cache, writes go to a copy-on-write overlay next to the
+//   image (<name>.cow), the CHD itself is never modified.
+// - Sparse images made by blockdev_create_sparse(), whatever the extension:
+//   blocks are allocated on write, holes read as zeros without any I/O.
+int  blockdev_attach(int dev, fileTYPE *file, const char *name);
+void blockdev_detach(const fileTYPE *file);
+
+int  blockdev_create_sparse(const char *name, uint64_t size);
+
+// The overlay of a device can be frozen and later reset to that point,
+// the core should be reset after a rollback.
+int  blockdev_snapshot(int dev);
+int  blockdev_rollback(int dev);
+
+// "sd1", "ide0", ... as in the report, -1 if unknown
+int  blockdev_by_name(const char *name);
+
+struct blockdev_stats_t
+{
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t writes;
+	uint64_t write_bytes;
+	uint64_t busy_us;
+	uint32_t max_us;
+};
+
+// Totals of all devices since start.
+void blockdev_get_stats(blockdev_stats_t *stats);
+void blockdev_report(FILE *fp);
+
+#endif
@@ -9,6 +9,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vector>
 
 
 extern int xml_load(const char *xml);
@@ -117,47 +121,160 @@ char* loadLastcore()
 
 }
 
-char *findCore(const char *name, char *coreName, int indent)
+// The cores, MRAs and MGLs of the root and its "_" folders are listed in
+// tmpfs, so bootcore doesn't walk the whole tree on every core load. The
+// list is reused while none of the listed folders changed.
+#define CORE_INDEX_FILE  "/tmp/bootcore.idx"
+#define CORE_INDEX_MAGIC 0x42434901
+#define CORE_PATH_MAX    256
+
+struct core_index_hdr_t
 {
-	char *spl;
-	DIR *dir;
+	uint32_t magic;
+	char root[1024];
+	uint32_t dir_count;
+	uint32_t file_count;
+	uint32_t names_size;
+};
+
+struct core_index_dir_t
+{
+	uint32_t name;
+	int64_t mtime;
+};
+
+static std::vector<core_index_dir_t> core_dirs;
+static std::vector<uint32_t> core_files; // in the order of the old recursive scan
+static std::vector<char> core_names;
+
+static uint32_t core_index_name(const char *name)
+{
+	uint32_t pos = core_names.size();
+	core_names.insert(core_names.end(), name, name + strlen(name) + 1);
+	return pos;
+}
+
+static int64_t core_index_mtime(const char *path)
+{
+	struct stat64 st;
+	if (stat64(path, &st)) return -1;
+	return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+static void core_index_clear()
+{
+	core_dirs.clear();
+	core_files.clear();
+	core_names.clear();
+}
+
+static void core_index_walk(const char *name)
+{
+	DIR *dir = opendir(name);
+	if (!dir) return;
+
+	core_index_dir_t d = { core_index_name(name), core_index_mtime(name) };
+	core_dirs.push_back(d);
+
+	char path[CORE_PATH_MAX];
 	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (snprintf(path, sizeof(path), "%s/%s", name, entry->d_name) >= (int)sizeof(path)) continue;
 
-	if (!(dir = opendir(name)))
+		if (entry->d_type == DT_DIR)
+		{
+			if (entry->d_name[0] == '_') core_index_walk(path);
+		}
+		else if (isExactcoreName(path))
+		{
+			core_files.push_back(core_index_name(path));
+		}
+	}
+	closedir(dir);
+}
+
+static int core_index_load(const char *root)
+{
+	int fd = open(CORE_INDEX_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = 0;
+	core_index_hdr_t hdr;
+	struct stat64 st;
+	if (!fstat64(fd, &st) && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == CORE_INDEX_MAGIC &&
+		!strcmp(hdr.root, root) && hdr.dir_count && hdr.names_size &&
+		st.st_size == (__off64_t)(sizeof(hdr) + hdr.dir_count * sizeof(core_index_dir_t) + hdr.file_count * sizeof(uint32_t) + hdr.names_size))
 	{
-		return NULL;
+		core_dirs.resize(hdr.dir_count);
+		core_files.resize(hdr.file_count);
+		core_names.resize(hdr.names_size);
+
+		size_t dirs_size = hdr.dir_count * sizeof(core_index_dir_t);
+		size_t files_size = hdr.file_count * sizeof(uint32_t);
+		ok = read(fd, core_dirs.data(), dirs_size) == (ssize_t)dirs_size &&
+			(!files_size || read(fd, core_files.data(), files_size) == (ssize_t)files_size) &&
+			read(fd, core_names.data(), hdr.names_size) == (ssize_t)hdr.names_size &&
+			!core_names.back();
+
+		for (auto &d : core_dirs) if (!ok || d.name >= hdr.names_size || core_index_mtime(core_names.data() + d.name) != d.mtime) ok = 0;
+		for (auto f : core_files) if (f >= hdr.names_size) ok = 0;
 	}
+	close(fd);
 
+	if (!ok) core_index_clear();
+	return ok;
+}
 
-	char *indir;
-	char* path = new char[256];
-	while ((entry = readdir(dir)) != NULL) {
-		if (entry->d_type == DT_DIR) {
-			if (entry->d_name[0] != '_')
-				continue;
-			snprintf(path, 256, "%s/%s", name, entry->d_name);
-			indir = findCore(path, coreName, indent + 2);
-			if (indir != NULL)
-			{
-				closedir(dir);
-				delete[] path;
-				return indir;
-			}
+static void core_index_store(const char *root)
+{
+	core_index_hdr_t hdr = {};
+	hdr.magic = CORE_INDEX_MAGIC;
+	snprintf(hdr.root, sizeof(hdr.root), "%s", root);
+	hdr.dir_count = core_dirs.size();
+	hdr.file_count = core_files.size();
+	hdr.names_size = core_names.size();
+
+	int fd = open(CORE_INDEX_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	size_t dirs_size = hdr.dir_count * sizeof(core_index_dir_t);
+	size_t files_size = hdr.file_count * sizeof(uint32_t);
+	int ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		write(fd, core_dirs.data(), dirs_size) == (ssize_t)dirs_size &&
+		(!files_size || write(fd, core_files.data(), files_size) == (ssize_t)files_size) &&
+		write(fd, core_names.data(), hdr.names_size) == (ssize_t)hdr.names_size;
+	close(fd);
+
+	if (!ok || rename(CORE_INDEX_FILE ".tmp", CORE_INDEX_FILE)) unlink(CORE_INDEX_FILE ".tmp");
+}
+
+char *findCore(const char *name, char *coreName, int indent)
+{
+	(void)indent;
+
+	if (core_dirs.empty() || strcmp(core_names.data() + core_dirs[0].name, name))
+	{
+		core_index_clear();
+		if (!core_index_load(name))
+		{
+			core_index_walk(name);
+			if (core_dirs.empty()) return NULL;
+			core_index_store(name);
 		}
-		else {
-			snprintf(path, 256, "%s/%s", name, entry->d_name);
-			if (strstr(path, coreName) != NULL) {
-				spl = strrchr(path, '.');
-				if (spl && (!strcmp(spl, ".rbf") || !strcmp(spl, ".mra") || !strcmp(spl, ".mgl")))
-				{
-					closedir(dir);
-					return path;
-				}
-			}
+	}
+
+	for (auto f : core_files)
+	{
+		const char *path = core_names.data() + f;
+		if (strstr(path, coreName) != NULL)
+		{
+			char *res = new char[CORE_PATH_MAX];
+			snprintf(res, CORE_PATH_MAX, "%s", path);
+			return res;
 		}
 	}
-	closedir(dir);
-	delete[] path;
+
 	return NULL;
 }
 
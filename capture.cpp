@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+#include <atomic>
+
+#include "capture.h"
+#include "scaler.h"
+#include "profiling.h"
+
+// The capture thread shares core #0 with the offload workers, so the main
+// loop on core #1 keeps servicing the core while frames are converted.
+#define CAPTURE_SLOT_SIZE ((MISTER_SCALER_BUFFERSIZE / 3) * 3 / 2) // I420 of the largest frame
+
+static pthread_t cap_thread;
+static std::atomic<bool> cap_quit;
+static int cap_running = 0;
+static int cap_fd = -1;
+static size_t cap_size = 0;
+static capture_hdr_t *cap_hdr = nullptr;
+
+static void *capture_thread(void *)
+{
+	mister_scaler *ms = mister_scaler_init();
+	if (!ms)
+	{
+		printf("capture: scaler not compatible\n");
+		return nullptr;
+	}
+
+	int fb = open("/dev/fb0", O_RDWR | O_CLOEXEC);
+	uint64_t last_vs = 0, period = 0;
+
+	while (!cap_quit.load())
+	{
+		int zero = 0;
+		if (fb < 0 || ioctl(fb, FBIO_WAITFORVSYNC, &zero) == -1) usleep(16666);
+
+		uint64_t vs = profiling_time_us();
+		if (last_vs)
+		{
+			// vsyncs which passed while the previous frame was converted
+			uint64_t delta = vs - last_vs;
+			if (!period || delta < period + period / 2) period = period ? (period * 7 + delta) / 8 : delta;
+			else cap_hdr->dropped += (delta + period / 2) / period - 1;
+		}
+		last_vs = vs;
+
+		if (!mister_scaler_update(ms) || (uint32_t)(ms->width * ms->height * 3 / 2 + ms->width * 2) > cap_hdr->slot_size) continue;
+
+		uint32_t n = cap_hdr->frames % CAPTURE_SLOTS;
+		capture_slot_t *slot = &cap_hdr->slot[n];
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		unsigned char *y = (unsigned char *)cap_hdr + slot->offset;
+		unsigned char *u = y + ms->width * ms->height;
+		unsigned char *v = u + ((ms->width + 1) / 2) * ((ms->height + 1) / 2);
+		mister_scaler_read_i420(ms, y, u, v);
+
+		slot->width = ms->width;
+		slot->height = ms->height;
+		slot->vsync_us = vs;
+		slot->ready_us = profiling_time_us();
+		__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+		cap_hdr->latency_us = slot->ready_us - vs;
+		if (cap_hdr->latency_us > cap_hdr->latency_max_us) cap_hdr->latency_max_us = cap_hdr->latency_us;
+		__atomic_store_n(&cap_hdr->frames, cap_hdr->frames + 1, __ATOMIC_RELEASE);
+	}
+
+	if (fb >= 0) close(fb);
+	mister_scaler_free(ms);
+	return nullptr;
+}
+
+void capture_start()
+{
+	if (cap_running) return;
+
+	cap_size = sizeof(capture_hdr_t) + (size_t)CAPTURE_SLOTS * CAPTURE_SLOT_SIZE;
+	cap_fd = open(CAPTURE_FILE, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cap_fd < 0 || ftruncate(cap_fd, cap_size))
+	{
+		printf("capture: can't create %s: %s\n", CAPTURE_FILE, strerror(errno));
+		if (cap_fd >= 0) close(cap_fd);
+		cap_fd = -1;
+		return;
+	}
+
+	void *map = mmap(nullptr, cap_size, PROT_READ | PROT_WRITE, MAP_SHARED, cap_fd, 0);
+	if (map == MAP_FAILED)
+	{
+		printf("capture: can't map %s\n", CAPTURE_FILE);
+		close(cap_fd);
+		cap_fd = -1;
+		unlink(CAPTURE_FILE);
+		return;
+	}
+
+	cap_hdr = (capture_hdr_t *)map;
+	cap_hdr->fourcc = 0x30323449; // I420
+	cap_hdr->slots = CAPTURE_SLOTS;
+	cap_hdr->slot_size = CAPTURE_SLOT_SIZE;
+	for (int i = 0; i < CAPTURE_SLOTS; i++) cap_hdr->slot[i].offset = sizeof(capture_hdr_t) + i * CAPTURE_SLOT_SIZE;
+	__atomic_store_n(&cap_hdr->magic, CAPTURE_MAGIC, __ATOMIC_RELEASE);
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	// Set affinity to core #0 since main runs on core #1
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	cap_quit.store(false);
+	int res = pthread_create(&cap_thread, &attr, capture_thread, nullptr);
+	pthread_attr_destroy(&attr);
+
+	if (res)
+	{
+		printf("capture: can't start the thread (%d)\n", res);
+		capture_stop();
+		return;
+	}
+
+	cap_running = 1;
+	printf("capture: started, frames in %s\n", CAPTURE_FILE);
+}
+
+void capture_stop()
+{
+	if (cap_running)
+	{
+		cap_quit.store(true);
+		pthread_join(cap_thread, nullptr);
+		cap_running = 0;
+
+		printf("capture: %llu frames, %llu dropped, latency last/max %llu/%lluus\n",
+			cap_hdr->frames, cap_hdr->dropped, cap_hdr->latency_us, cap_hdr->latency_max_us);
+	}
+
+	if (cap_hdr)
+	{
+		cap_hdr->magic = 0;
+		munmap(cap_hdr, cap_size);
+		cap_hdr = nullptr;
+	}
+
+	if (cap_fd >= 0)
+	{
+		close(cap_fd);
+		cap_fd = -1;
+		unlink(CAPTURE_FILE);
+	}
+}
+
+int capture_active()
+{
+	return cap_running;
+}
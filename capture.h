@@ -0,0 +1,44 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <inttypes.h>
+
+// Continuous capture of the scaler output, one I420 frame per vsync of the
+// HDMI output, published in a ring in CAPTURE_FILE for an external encoder.
+//
+// Reader side: mmap the file, then for the newest frame take slot
+// (frames - 1) % slots, read its seq, copy the planes, and re-read seq.
+// The copy is valid if seq was even and didn't change.
+#define CAPTURE_FILE  "/tmp/MiSTer_capture"
+#define CAPTURE_MAGIC 0x5043534D // "MSCP"
+#define CAPTURE_SLOTS 3
+
+struct capture_slot_t
+{
+	uint32_t seq;         // odd while the slot is written
+	uint32_t width;
+	uint32_t height;
+	uint32_t offset;      // of the Y plane from the start of the file, U and V follow
+	uint64_t vsync_us;    // CLOCK_MONOTONIC
+	uint64_t ready_us;
+};
+
+struct capture_hdr_t
+{
+	uint32_t magic;
+	uint32_t fourcc;      // 'I420'
+	uint32_t slots;
+	uint32_t slot_size;
+	uint64_t frames;      // published so far
+	uint64_t dropped;     // vsyncs without a grabbed frame
+	uint64_t latency_us;  // vsync to publish, last frame
+	uint64_t latency_max_us;
+	capture_slot_t slot[CAPTURE_SLOTS];
+};
+
+// main thread only, the capture itself runs on a thread of its own
+void capture_start();
+void capture_stop();
+int  capture_active();
+
+#endif
@@ -0,0 +1,508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "cd.h"
+#include "file_io.h"
+#include "swap_util.h"
+#include "support/chd/mister_chd.h"
+
+int sgets(char *out, int sz, char **in)
+{
+	*out = 0;
+	do
+	{
+		char *instr = *in;
+		int cnt = 0;
+
+		while (*instr && *instr != 10)
+		{
+			if (*instr == 13)
+			{
+				instr++;
+				continue;
+			}
+
+			if (cnt < sz - 1)
+			{
+				out[cnt++] = *instr;
+				out[cnt] = 0;
+			}
+
+			instr++;
+		}
+
+		if (*instr == 10) instr++;
+		*in = instr;
+	} while (!*out && **in);
+
+	return *out;
+}
+
+#define TOC_CACHE_DIR   "/tmp/cdtoc"
+#define TOC_CACHE_MAGIC 0x434F5401
+
+struct toc_cache_hdr_t
+{
+	uint32_t magic;
+	char path[1024];
+	uint64_t size;
+	int64_t mtime;
+	int end;
+	int last;
+	int sector_size;
+	int chd_hunksize;
+};
+
+struct toc_cache_track_t
+{
+	int offset;
+	int pregap;
+	int start;
+	int end;
+	int type;
+	int sector_size;
+	int indexes[100];
+	int index_num;
+	int sbc_type;
+};
+
+static int toc_cache_key(const char *path, toc_cache_hdr_t *hdr, char *cache_name)
+{
+	struct stat64 st;
+	if (stat64(path, &st)) return 0;
+
+	memset(hdr, 0, sizeof(toc_cache_hdr_t));
+	hdr->magic = TOC_CACHE_MAGIC;
+	snprintf(hdr->path, sizeof(hdr->path), "%s", path);
+	hdr->size = st.st_size;
+	hdr->mtime = st.st_mtime;
+
+	// FNV-1a of the path, the header tells collisions apart
+	uint32_t hash = 2166136261u;
+	for (const char *p = path; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	sprintf(cache_name, TOC_CACHE_DIR "/%08X", hash);
+	return 1;
+}
+
+int cd_toc_cache_load(const char *path, toc_t *toc)
+{
+	toc_cache_hdr_t key, hdr;
+	char name[64];
+	if (!toc_cache_key(path, &key, name)) return 0;
+
+	FILE *fp = fopen(name, "rb");
+	if (!fp) return 0;
+
+	int ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 && !memcmp(&hdr, &key, offsetof(toc_cache_hdr_t, end)) &&
+		hdr.last >= 0 && hdr.last < 100;
+
+	for (int i = 0; ok && i < hdr.last; i++)
+	{
+		toc_cache_track_t trk;
+		ok = fread(&trk, sizeof(trk), 1, fp) == 1;
+		if (!ok) break;
+
+		cd_track_t *dst = &toc->tracks[i];
+		dst->offset = trk.offset;
+		dst->pregap = trk.pregap;
+		dst->start = trk.start;
+		dst->end = trk.end;
+		dst->type = trk.type;
+		dst->sector_size = trk.sector_size;
+		memcpy(dst->indexes, trk.indexes, sizeof(dst->indexes));
+		dst->index_num = trk.index_num;
+		dst->sbc_type = (cd_subcode_types_t)trk.sbc_type;
+	}
+	fclose(fp);
+
+	if (!ok) return 0;
+
+	toc->end = hdr.end;
+	toc->last = hdr.last;
+	toc->sectorSize = hdr.sector_size;
+	toc->chd_hunksize = hdr.chd_hunksize;
+	return 1;
+}
+
+void cd_toc_cache_store(const char *path, const toc_t *toc)
+{
+	toc_cache_hdr_t hdr;
+	char name[64];
+	if (toc->last < 0 || toc->last >= 100 || !toc_cache_key(path, &hdr, name)) return;
+
+	hdr.end = toc->end;
+	hdr.last = toc->last;
+	hdr.sector_size = toc->sectorSize;
+	hdr.chd_hunksize = toc->chd_hunksize;
+
+	mkdir(TOC_CACHE_DIR, 0755);
+	FILE *fp = fopen(name, "wb");
+	if (!fp) return;
+
+	int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+	for (int i = 0; ok && i < toc->last; i++)
+	{
+		const cd_track_t *src = &toc->tracks[i];
+		toc_cache_track_t trk = {};
+		trk.offset = src->offset;
+		trk.pregap = src->pregap;
+		trk.start = src->start;
+		trk.end = src->end;
+		trk.type = src->type;
+		trk.sector_size = src->sector_size;
+		memcpy(trk.indexes, src->indexes, sizeof(trk.indexes));
+		trk.index_num = src->index_num;
+		trk.sbc_type = src->sbc_type;
+		ok = fwrite(&trk, sizeof(trk), 1, fp) == 1;
+	}
+
+	if (fclose(fp) || !ok) unlink(name);
+}
+
+static void cd_locate_default(const toc_t *toc, int track, int lba, cd_loc_t *loc)
+{
+	if (track < 0) track = toc->GetTrackByLBA(lba);
+	if (lba < 0 || track >= toc->last)
+	{
+		loc->blank = 1;
+		return;
+	}
+
+	const cd_track_t *trk = &toc->tracks[track];
+	int sector_size = trk->sector_size ? trk->sector_size : 2352;
+
+	loc->f = (fileTYPE *)&trk->f;
+	loc->pos = (__off64_t)lba * sector_size - trk->offset;
+	loc->chd_lba = lba + trk->offset;
+	loc->audio = !trk->type;
+}
+
+struct cd_pool_t
+{
+	fileTYPE *f;
+	char *path;
+	uint32_t used;
+};
+
+// the ring fetches read from a worker, so a file isn't closed under a read
+static pthread_mutex_t cd_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cd_pool_t cd_pool[100];
+static int cd_pool_num = 0;
+static uint32_t cd_pool_tick = 0;
+
+static void cd_pool_park(fileTYPE *f)
+{
+	__off64_t size = f->size;
+	FileClose(f);
+	f->size = size;
+}
+
+void cd_pool_remove(toc_t *toc)
+{
+	pthread_mutex_lock(&cd_pool_mutex);
+	for (int i = 0; i < cd_pool_num;)
+	{
+		cd_pool_t *e = &cd_pool[i];
+		if (e->f >= &toc->tracks[0].f && e->f <= &toc->tracks[99].f)
+		{
+			free(e->path);
+			*e = cd_pool[--cd_pool_num];
+		}
+		else i++;
+	}
+	pthread_mutex_unlock(&cd_pool_mutex);
+}
+
+void cd_pool_add(toc_t *toc)
+{
+	cd_pool_remove(toc);
+	if (toc->last < 2) return;
+
+	pthread_mutex_lock(&cd_pool_mutex);
+	for (int i = 0; i < toc->last && cd_pool_num < (int)(sizeof(cd_pool) / sizeof(cd_pool[0])); i++)
+	{
+		fileTYPE *f = &toc->tracks[i].f;
+		if (!f->filp || f->zip || f->zcache) continue;
+
+		char link[32], path[1024];
+		sprintf(link, "/proc/self/fd/%d", fileno(f->filp));
+		ssize_t len = readlink(link, path, sizeof(path) - 1);
+		if (len <= 0 || len >= (ssize_t)sizeof(path) - 1) continue;
+		path[len] = 0;
+
+		cd_pool_t *e = &cd_pool[cd_pool_num++];
+		e->f = f;
+		e->path = strdup(path);
+		e->used = 0;
+	}
+	pthread_mutex_unlock(&cd_pool_mutex);
+}
+
+static int cd_pool_read(fileTYPE *f, __off64_t pos, uint8_t *buf, int len)
+{
+	cd_pool_t *cur = NULL;
+	pthread_mutex_lock(&cd_pool_mutex);
+	for (int i = 0; i < cd_pool_num && !cur; i++) if (cd_pool[i].f == f) cur = &cd_pool[i];
+	if (!cur)
+	{
+		pthread_mutex_unlock(&cd_pool_mutex);
+		return FileReadAt(f, pos, buf, len);
+	}
+
+	cur->used = ++cd_pool_tick;
+	if (!f->filp && FileOpen(f, cur->path)) FileAdvise(f, FILE_ADV_SEQUENTIAL);
+
+	// the least recently read ones go, all are open after the parsing
+	while (1)
+	{
+		int open = 0;
+		cd_pool_t *lru = NULL;
+		for (int i = 0; i < cd_pool_num; i++)
+		{
+			cd_pool_t *e = &cd_pool[i];
+			if (e == cur || !e->f->filp) continue;
+			open++;
+			if (!lru || e->used < lru->used) lru = e;
+		}
+		if (open < CD_POOL_OPEN) break;
+		cd_pool_park(lru->f);
+	}
+
+	int res = FileReadAt(f, pos, buf, len);
+	pthread_mutex_unlock(&cd_pool_mutex);
+	return res;
+}
+
+static int cd_read(const toc_t *toc, int track, int lba, int count, uint8_t *buf, int s_offset, int length, cd_locate_fn locate)
+{
+	// pending run of bin sectors which are contiguous in their file
+	fileTYPE *run_f = NULL;
+	__off64_t run_pos = 0;
+	uint8_t *run_buf = NULL;
+	int run_len = 0;
+	int run_cnt = 0;
+	int done = 0;
+
+	// track lookups happen once per track run
+	int cur = track;
+	int cur_end = 0;
+
+	for (int i = 0; i <= count; i++, lba++, buf += length)
+	{
+		cd_loc_t loc = {};
+		if (i < count)
+		{
+			if (locate) locate(toc, lba, &loc);
+			else
+			{
+				if (track < 0 && (cur < 0 || lba >= cur_end))
+				{
+					cur = toc->GetTrackByLBA(lba);
+					cur_end = toc->GetRunEnd(lba);
+				}
+				cd_locate_default(toc, cur, lba, &loc);
+			}
+		}
+
+		if (run_len && (i == count || loc.blank || loc.f != run_f || loc.pos + s_offset != run_pos + run_len))
+		{
+			int res = cd_pool_read(run_f, run_pos, run_buf, run_len);
+			if (res < run_len) memset(run_buf + res, 0, run_len - res);
+			if (res > 0) done += (res >= run_len) ? run_cnt : res / length;
+			run_len = 0;
+			run_cnt = 0;
+		}
+		if (i == count) break;
+
+		if (loc.blank)
+		{
+			memset(buf, loc.fill, length);
+		}
+		else if (toc->chd_f)
+		{
+			if (mister_chd_read_sector(toc->chd_f, loc.chd_lba, 0, s_offset, length, buf) == CHDERR_NONE)
+			{
+				if (loc.audio) swap16_buf(buf, length / 2);
+				done++;
+			}
+			else
+			{
+				printf("\x1b[32mCD: CHD read error: %d\n\x1b[0m", lba);
+				memset(buf, 0, length);
+			}
+		}
+		else
+		{
+			if (!run_len)
+			{
+				run_f = loc.f;
+				run_pos = loc.pos + s_offset;
+				run_buf = buf;
+			}
+			run_len += length;
+			run_cnt++;
+		}
+	}
+
+	return done;
+}
+
+int cd_read_sectors(const toc_t *toc, int lba, int count, uint8_t *buf, int s_offset, int length, cd_locate_fn locate)
+{
+	return cd_read(toc, -1, lba, count, buf, s_offset, length, locate);
+}
+
+int cd_read_track(const toc_t *toc, int track, int lba, int count, uint8_t *buf, int s_offset, int length)
+{
+	return cd_read(toc, track, lba, count, buf, s_offset, length, NULL);
+}
+
+#define CD_CDDA_BATCH 8
+
+static void cdda_reap(cd_cdda_t *s, int wait)
+{
+	if (!s->job) return;
+
+	if (wait) offload_wait(s->job);
+	else if (!offload_job_done(s->job)) return;
+
+	s->count += s->job_cnt;
+	s->job_cnt = 0;
+	s->job = 0;
+}
+
+void cd_cdda_reset(cd_cdda_t *s)
+{
+	cdda_reap(s, 1);
+	s->src = NULL;
+	s->head = 0;
+	s->count = 0;
+}
+
+static void cdda_refill(cd_cdda_t *s, cd_cdda_fetch_fn fetch, int end)
+{
+	if (s->job) return;
+
+	const void *src = s->src;
+	int track = s->track;
+
+	// one batch at a time once there is room for it, contiguous up to the ring wrap
+	int slot = (s->head + s->count) % CD_CDDA_RING;
+	int next = s->start + s->count;
+	int cnt = CD_CDDA_RING - s->count;
+	if (cnt > end - next) cnt = end - next;
+	else if (cnt < CD_CDDA_BATCH) return;
+	if (cnt > CD_CDDA_BATCH) cnt = CD_CDDA_BATCH;
+	if (cnt > CD_CDDA_RING - slot) cnt = CD_CDDA_RING - slot;
+	if (cnt <= 0) return;
+
+	uint8_t *dst = s->ring[slot];
+	s->job = offload_try_work([fetch, src, track, next, cnt, dst]()
+	{
+		fetch(src, track, next, cnt, dst);
+	}, OFFLOAD_IO);
+	if (s->job) s->job_cnt = cnt;
+}
+
+void cd_cdda_read(cd_cdda_t *s, cd_cdda_fetch_fn fetch, const void *src, int track, int lba, int end, uint8_t *buf, int async)
+{
+	cdda_reap(s, 0);
+
+	if (s->src != src || s->track != track || lba < s->start || lba >= s->start + s->count + s->job_cnt)
+	{
+		cd_cdda_reset(s);
+		s->src = src;
+		s->track = track;
+		s->start = lba;
+	}
+	else if (lba >= s->start + s->count)
+	{
+		// being fetched right now
+		cdda_reap(s, 1);
+	}
+
+	if (lba < s->start + s->count)
+	{
+		memcpy(buf, s->ring[(s->head + lba - s->start) % CD_CDDA_RING], 2352);
+
+		int used = lba + 1 - s->start;
+		s->head = (s->head + used) % CD_CDDA_RING;
+		s->start += used;
+		s->count -= used;
+	}
+	else
+	{
+		fetch(src, track, lba, 1, buf);
+		s->start = lba + 1;
+	}
+
+	if (async) cdda_refill(s, fetch, end);
+}
+
+void cd_cdda_seek(cd_cdda_t *s, cd_cdda_fetch_fn fetch, const void *src, int track, int lba, int end)
+{
+	cdda_reap(s, 0);
+
+	if (s->src == src && s->track == track && lba >= s->start && lba < s->start + s->count + s->job_cnt) return;
+
+	cd_cdda_reset(s);
+	s->src = src;
+	s->track = track;
+	s->start = lba;
+	cdda_refill(s, fetch, end);
+}
+
+static void cdda_fetch_toc(const void *src, int track, int lba, int count, uint8_t *buf)
+{
+	cd_read_track((const toc_t *)src, track, lba, count, buf);
+}
+
+void cd_cdda_read_toc(cd_cdda_t *s, const toc_t *toc, int track, int lba, uint8_t *buf)
+{
+	// CHD decoding isn't reentrant, bin tracks are read with pread
+	int async = !toc->chd_f && toc->tracks[track].f.filp;
+	cd_cdda_read(s, cdda_fetch_toc, toc, track, lba, toc->tracks[track].end, buf, async);
+}
+
+void cd_cdda_seek_toc(cd_cdda_t *s, const toc_t *toc, int track, int lba)
+{
+	if (track < 0 || track >= toc->last || lba < 0) return;
+
+	if (toc->chd_f) mister_chd_prefetch(toc->chd_f, lba + toc->tracks[track].offset);
+	else if (toc->tracks[track].f.filp) cd_cdda_seek(s, cdda_fetch_toc, toc, track, lba, toc->tracks[track].end);
+}
+
+static void data_fetch_toc(const void *src, int track, int lba, int count, uint8_t *buf)
+{
+	const toc_t *toc = (const toc_t *)src;
+	int s_offset = (toc->tracks[track].sector_size != 2048) ? 16 : 0;
+	cd_read_track(toc, track, lba, count, buf, s_offset, 2048);
+
+	// one sector per ring slot, moved from the back so nothing is overwritten
+	for (int i = count - 1; i > 0; i--) memmove(buf + i * 2352, buf + i * 2048, 2048);
+}
+
+void cd_data_read_toc(cd_cdda_t *s, const toc_t *toc, int track, int lba, uint8_t *buf)
+{
+	if (toc->chd_f || !toc->tracks[track].f.filp)
+	{
+		data_fetch_toc(toc, track, lba, 1, buf);
+		return;
+	}
+
+	static uint8_t sector[2352];
+	cd_cdda_read(s, data_fetch_toc, toc, track, lba, toc->tracks[track].end, sector, 1);
+	memcpy(buf, sector, 2048);
+}
+
+void cd_data_seek_toc(cd_cdda_t *s, const toc_t *toc, int track, int lba)
+{
+	if (track < 0 || track >= toc->last || lba < 0) return;
+
+	if (toc->chd_f) mister_chd_prefetch(toc->chd_f, lba + toc->tracks[track].offset);
+	else if (toc->tracks[track].f.filp) cd_cdda_seek(s, data_fetch_toc, toc, track, lba, toc->tracks[track].end);
+}
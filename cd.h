@@ -3,6 +3,7 @@
 
 #include <libchdr/chd.h>
 #include "file_io.h"
+#include "offload.h"
 
 
 typedef enum
@@ -34,11 +35,25 @@ typedef struct
 	cd_track_t tracks[100];
 	fileTYPE sub;
 
-	int GetTrackByLBA(int lba)
+	// first track ending past lba, or last if there is none
+	int GetTrackByLBA(int lba) const
 	{
-		int i = 0;
-		while ((this->tracks[i].end <= lba) && (i < this->last)) i++;
-		return i;
+		int lo = 0, hi = this->last;
+		while (lo < hi)
+		{
+			int mid = (lo + hi) / 2;
+			if (this->tracks[mid].end <= lba) lo = mid + 1;
+			else hi = mid;
+		}
+		return lo;
+	}
+
+	// first lba past the run of sectors lba belongs to, batched readers
+	// can take everything up to it from one track
+	int GetRunEnd(int lba) const
+	{
+		int i = GetTrackByLBA(lba);
+		return (i < this->last) ? this->tracks[i].end : this->end;
 	}
 
 	int GetIndexByLBA(int track, int lba)
@@ -64,4 +79,88 @@ typedef struct
 
 typedef int (*SendDataFunc) (uint8_t* buf, int len, uint8_t index);
 
+// gets the next non-empty line of a CUE sheet held in memory
+int sgets(char *out, int sz, char **in);
+
+// Parsed TOC layouts (without open files) are cached in tmpfs, keyed by the
+// image path, size and mtime, so remounts and core reloads skip re-parsing.
+int cd_toc_cache_load(const char *path, toc_t *toc);
+void cd_toc_cache_store(const char *path, const toc_t *toc);
+
+// Image location of one sector, filled in by a cd_locate_fn
+typedef struct
+{
+	fileTYPE *f;      // bin image, NULL for CHD
+	__off64_t pos;    // byte position of the sector in f
+	int chd_lba;      // CHD frame
+	uint8_t audio;    // CHD audio sectors get byteswapped
+	uint8_t blank;    // not stored in the image, reads as fill bytes
+	uint8_t fill;
+} cd_loc_t;
+
+typedef void (*cd_locate_fn)(const toc_t *toc, int lba, cd_loc_t *loc);
+
+// Reads count sectors starting at lba, taking length bytes from s_offset of
+// each sector and packing them back to back into buf. Sectors contiguous in a
+// bin image are fetched with a single read. Without a locator the usual layout
+// is assumed: lba * sector_size - offset in the track file, or CHD frame
+// lba + offset. Returns the number of sectors read from the image.
+int cd_read_sectors(const toc_t *toc, int lba, int count, uint8_t *buf, int s_offset = 0, int length = 2352, cd_locate_fn locate = NULL);
+
+// Same with the default layout, but all sectors are taken from the given track
+int cd_read_track(const toc_t *toc, int track, int lba, int count, uint8_t *buf, int s_offset = 0, int length = 2352);
+
+// Track files of a multi file image, handed over by the loader once the
+// TOC is parsed. At most CD_POOL_OPEN of them stay open, the least recently
+// read is closed for another and reopened by its path when read again. The
+// sizes stay valid. Direct accesses to pooled track files bypass this, so
+// only loaders reading through cd_read_* use it.
+#define CD_POOL_OPEN 4
+void cd_pool_add(toc_t *toc);
+void cd_pool_remove(toc_t *toc);
+
+// CDDA is streamed through a ring of raw sectors refilled on the offload
+// pool, so a slow card doesn't stall the poll loop feeding the core.
+#define CD_CDDA_RING 32 // ~430ms of audio
+
+// reads count raw audio sectors, async fetches run on an offload worker
+typedef void (*cd_cdda_fetch_fn)(const void *src, int track, int lba, int count, uint8_t *buf);
+
+typedef struct
+{
+	const void *src;
+	int track;
+	int start;         // lba of the oldest sector in the ring
+	int head;          // its slot
+	int count;         // sectors ready from head
+	int job_cnt;       // sectors being fetched after them
+	offload_job_t job;
+	uint8_t ring[CD_CDDA_RING][2352];
+} cd_cdda_t;
+
+// Copies audio sector lba into buf and refills the ring with the sectors
+// following it up to end. Any other src, track or lba than the ring holds
+// drops it, so seeks need no extra handling. Without async every sector is
+// fetched directly on the caller.
+void cd_cdda_read(cd_cdda_t *s, cd_cdda_fetch_fn fetch, const void *src, int track, int lba, int end, uint8_t *buf, int async);
+
+// Same for toc_t images: bin tracks are streamed, CHD reads stay on the
+// caller and are covered by the hunk cache read-ahead.
+void cd_cdda_read_toc(cd_cdda_t *s, const toc_t *toc, int track, int lba, uint8_t *buf);
+
+// Starts filling the ring from lba on, for a seek command. The fetch runs
+// while the core waits out the emulated seek time, so the reads on the
+// deadline are served from RAM instead of waiting for the card.
+void cd_cdda_seek(cd_cdda_t *s, cd_cdda_fetch_fn fetch, const void *src, int track, int lba, int end);
+void cd_cdda_seek_toc(cd_cdda_t *s, const toc_t *toc, int track, int lba);
+
+// Mode 1 data sectors (2048 bytes of user data) streamed through a ring the
+// same way, started at the target lba of a seek by cd_data_seek_toc.
+void cd_data_read_toc(cd_cdda_t *s, const toc_t *toc, int track, int lba, uint8_t *buf);
+void cd_data_seek_toc(cd_cdda_t *s, const toc_t *toc, int track, int lba);
+
+// Waits for the in-flight fetch and empties the ring, must be called
+// before the image files are closed.
+void cd_cdda_reset(cd_cdda_t *s);
+
 #endif
@@ -5,10 +5,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "cfg.h"
+#include "profiling.h"
 #include "debug.h"
 #include "file_io.h"
 #include "user_io.h"
@@ -53,6 +58,7 @@ static const ini_var_t ini_vars[] =
 	{ "HDMI_LIMITED", (void*)(&(cfg.hdmi_limited)), UINT8, 0, 2 },
 	{ "KBD_NOMOUSE", (void*)(&(cfg.kbd_nomouse)), UINT8, 0, 1 },
 	{ "MOUSE_THROTTLE", (void*)(&(cfg.mouse_throttle)), UINT8, 1, 100 },
+	{ "MOUSE_INTERVAL", (void*)(&(cfg.mouse_interval)), UINT8, 1, 100 },
 	{ "BOOTSCREEN", (void*)(&(cfg.bootscreen)), UINT8, 0, 1 },
 	{ "VSCALE_MODE", (void*)(&(cfg.vscale_mode)), UINT8, 0, 5 },
 	{ "VSCALE_BORDER", (void*)(&(cfg.vscale_border)), UINT16, 0, 399 },
@@ -129,6 +135,20 @@ static const ini_var_t ini_vars[] =
 	{ "CONTROLLER_UNIQUE_MAPPING", (void *)(cfg.controller_unique_mapping), UINT32ARR, 0, 0xFFFFFFFF },
 	{ "OSD_LOCK", (void*)(&(cfg.osd_lock)), STRING, 0, sizeof(cfg.osd_lock) - 1 },
 	{ "OSD_LOCK_TIME", (void*)(&(cfg.osd_lock_time)), UINT16, 0, 60 },
+	{ "ZIP_CACHE_MB", (void*)(&(cfg.zip_cache_mb)), UINT16, 0, 1024 },
+	{ "SD_CACHE_EXTENTS", (void*)(&(cfg.sd_cache_extents)), UINT8, 0, 64 },
+	{ "SD_WRITE_DELAY", (void*)(&(cfg.sd_write_delay)), UINT16, 0, 10000 },
+	{ "IDE_WRITE_DELAY", (void*)(&(cfg.ide_write_delay)), UINT16, 0, 10000 },
+	{ "MRA_MD5_CACHE", (void*)(&(cfg.mra_md5_cache)), UINT8, 0, 1 },
+	{ "MRA_ROM_CACHE_MB", (void*)(&(cfg.mra_rom_cache_mb)), UINT16, 0, 1024 },
+	{ "NEOGEO_ROM_CACHE_MB", (void*)(&(cfg.neogeo_rom_cache_mb)), UINT16, 0, 1024 },
+	{ "INPUT_THREAD", (void*)(&(cfg.input_thread)), UINT8, 0, 1 },
+	{ "IDLE_WAIT", (void*)(&(cfg.idle_wait)), UINT8, 0, 100 },
+	{ "RBF_CACHE_MB", (void*)(&(cfg.rbf_cache_mb)), UINT16, 0, 512 },
+	{ "RBF_PIN", (void*)(&(cfg.rbf_pin)), STRINGARR, sizeof(cfg.rbf_pin) / sizeof(cfg.rbf_pin[0]), sizeof(cfg.rbf_pin[0]) },
+	{ "SAVESTATE_COMPRESS", (void*)(&(cfg.savestate_compress)), UINT8, 0, 1 },
+	{ "SAVESTATE_DELTA", (void*)(&(cfg.savestate_delta)), UINT8, 0, 1 },
+	{ "NET_INPUT_PORT", (void*)(&(cfg.net_input_port)), UINT16, 0, 65535 },
 	{ "DEBUG", (void *)(&(cfg.debug)), UINT8, 0, 1 },
 	{ "MAIN", (void*)(&(cfg.main)), STRING, 0, sizeof(cfg.main) - 1 },
 };
@@ -163,13 +183,15 @@ fileTYPE ini_file;
 static bool has_video_sections = false;
 static bool using_video_section = false;
 
+// the whole file is read at once and parsed from memory
+static char *ini_data = nullptr;
+static int ini_size = 0;
+
 int ini_pt = 0;
 static char ini_getch()
 {
-	static uint8_t buf[512];
-	if (!(ini_pt & 0x1ff)) FileReadSec(&ini_file, buf);
-	if (ini_pt >= ini_file.size) return 0;
-	return buf[(ini_pt++) & 0x1ff];
+	if (ini_pt >= ini_size) return 0;
+	return ini_data[ini_pt++];
 }
 
 static int ini_getline(char* line)
@@ -327,6 +349,37 @@ static void ini_parse_numeric(const ini_var_t *var, const char *text, void *out)
 	}
 }
 
+// variables sorted by name for a binary search, built on first use
+static int ini_var_order[nvars];
+
+static int ini_var_cmp(const void *a, const void *b)
+{
+	return strcasecmp(ini_vars[*(const int*)a].name, ini_vars[*(const int*)b].name);
+}
+
+static int ini_var_find(const char *name)
+{
+	static int sorted = 0;
+	if (!sorted)
+	{
+		for (int i = 0; i < nvars; i++) ini_var_order[i] = i;
+		qsort(ini_var_order, nvars, sizeof(int), ini_var_cmp);
+		sorted = 1;
+	}
+
+	int lo = 0, hi = nvars - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		int res = strcasecmp(name, ini_vars[ini_var_order[mid]].name);
+		if (!res) return ini_var_order[mid];
+		if (res < 0) hi = mid - 1;
+		else lo = mid + 1;
+	}
+
+	return -1;
+}
+
 static void ini_parse_var(char* buf)
 {
 	// find var
@@ -343,11 +396,7 @@ static void ini_parse_var(char* buf)
 	}
 
 	// parse var
-	int var_id = -1;
-	for (int j = 0; j < (int)(sizeof(ini_vars) / sizeof(ini_var_t)); j++)
-	{
-		if (!strcasecmp(buf, ini_vars[j].name)) var_id = j;
-	}
+	int var_id = ini_var_find(buf);
 
 	if (var_id == -1)
 	{
@@ -403,12 +452,8 @@ static void ini_parse_var(char* buf)
 	}
 }
 
-static void ini_parse(int alt, const char *vmode)
+static void ini_init_stdout()
 {
-	static char line[INI_LINE_SIZE];
-	int section = 0;
-	int eof;
-
 	if (!orig_stdout) orig_stdout = stdout;
 	if (!dev_null)
 	{
@@ -420,17 +465,31 @@ static void ini_parse(int alt, const char *vmode)
 			stdout = dev_null;
 		}
 	}
+}
+
+static void ini_parse_file(const char *name, const char *vmode)
+{
+	static char line[INI_LINE_SIZE];
+	int section = 0;
+	int eof;
+
+	ini_init_stdout();
 
 	ini_parser_debugf("Start INI parser for core \"%s\"(%s), video mode \"%s\".", user_io_get_core_name(0), user_io_get_core_name(1), vmode);
 
 	memset(line, 0, sizeof(line));
 	memset(&ini_file, 0, sizeof(ini_file));
 
-	const char *name = cfg_get_name(alt);
 	if (!FileOpen(&ini_file, name))	return;
 
 	ini_parser_debugf("Opened file %s with size %llu bytes.", name, ini_file.size);
 
+	ini_size = 0;
+	ini_data = (char*)malloc(ini_file.size + 1);
+	if (ini_data) ini_size = FileReadAdv(&ini_file, ini_data, ini_file.size);
+	FileClose(&ini_file);
+	if (ini_size < 0) ini_size = 0;
+
 	ini_pt = 0;
 
 	// parse ini
@@ -459,7 +518,60 @@ static void ini_parse(int alt, const char *vmode)
 		if (eof) break;
 	}
 
-	FileClose(&ini_file);
+	free(ini_data);
+	ini_data = nullptr;
+	ini_size = 0;
+}
+
+static void ini_parse(int alt, const char *vmode)
+{
+	ini_parse_file(cfg_get_name(alt), vmode);
+}
+
+// Parses a generated ini of 64 core sections into cfg, which is put back
+// afterwards. Only for the bench harness, the main loop reads cfg freely.
+void cfg_bench(const char *dir)
+{
+	static const char *opts[] =
+	{
+		"video_mode=8", "vsync_adjust=2", "hdmi_audio_96k=0", "dvi_mode=0", "hdmi_limited=0",
+		"vscale_mode=0", "vscale_border=0", "bootscreen=1", "rbf_hide_datecode=0", "menu_pal=0",
+		"fb_size=0", "fb_terminal=1", "osd_timeout=30", "mouse_throttle=10", "video_info=0",
+		"composite_sync=1", "vga_scaler=0", "vga_sog=0", "keyrah_mode=0x18d80002", "reset_combo=0",
+	};
+
+	char name[1024];
+	snprintf(name, sizeof(name), "%s/MiSTer_bench.ini", dir);
+	FILE *fp = fopen(name, "w");
+	if (!fp)
+	{
+		printf("cfg_bench: unable to create %s\n", name);
+		return;
+	}
+
+	for (int s = 0; s < 64; s++)
+	{
+		if (s) fprintf(fp, "\n[core%02d]\n", s);
+		else fprintf(fp, "[MiSTer]\n");
+		for (uint32_t i = 0; i < sizeof(opts) / sizeof(opts[0]); i++) fprintf(fp, "%s ; comment %u\n", opts[i], i);
+	}
+	long size = ftell(fp);
+	fclose(fp);
+
+	static cfg_t saved;
+	saved = cfg;
+	FILE *out = stdout;
+
+	const int loops = 32;
+	uint64_t start = profiling_time_us();
+	for (int n = 0; n < loops; n++) ini_parse_file(name, "");
+	uint64_t us = profiling_time_us() - start;
+
+	stdout = out;
+	cfg = saved;
+	unlink(name);
+
+	profiling_bench_report("ini_parse 64 sections", us, loops, (uint64_t)size * loops);
 }
 
 static constexpr int CFG_ERRORS_MAX = 4;
@@ -537,8 +649,100 @@ const char* cfg_get_label(uint8_t alt)
 	return label;
 }
 
+// The parsed ini is kept in tmpfs per core and video mode along with the
+// ini mtime and size, so the restart after a core switch doesn't parse
+// the same file again.
+#define CFGSNAP_DIR   "/tmp/cfgsnap"
+#define CFGSNAP_MAGIC 0x43464701
+
+struct cfgsnap_t
+{
+	uint32_t magic;
+	uint32_t size;
+	int64_t ini_mtime;
+	int64_t ini_size;
+	char key[512];
+	uint8_t has_video_sections;
+	uint8_t using_video_section;
+	int32_t error_count;
+	char errors[CFG_ERRORS_MAX][CFG_ERRORS_STRLEN];
+};
+
+static int cfgsnap_key(int alt, cfgsnap_t *hdr, char *name)
+{
+	const char *ini = cfg_get_name(alt);
+	struct stat64 *st = getPathStat(ini);
+	if (!st) return 0;
+
+	memset(hdr, 0, sizeof(cfgsnap_t));
+	hdr->magic = CFGSNAP_MAGIC;
+	hdr->size = sizeof(cfg_t);
+	hdr->ini_mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+	hdr->ini_size = st->st_size;
+	// defaults and the layout belong to this very binary
+	struct stat64 exe;
+	if (stat64("/proc/self/exe", &exe)) return 0;
+
+	snprintf(hdr->key, sizeof(hdr->key), "%lld|%s|%s|%s|%d|%d|%s|%s", (long long)exe.st_mtime, getFullPath(ini), user_io_get_core_name(0), user_io_get_core_name(1),
+		is_arcade() ? 1 : 0, arcade_is_vertical() ? 1 : 0, video_get_core_mode_name(1), video_get_core_mode_name(0));
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = hdr->key; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	sprintf(name, CFGSNAP_DIR "/%08X", hash);
+	return 1;
+}
+
+static int cfgsnap_load(const char *name, const cfgsnap_t *key)
+{
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	static cfgsnap_t hdr;
+	int ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && !memcmp(&hdr, key, offsetof(cfgsnap_t, has_video_sections)) &&
+		read(fd, &cfg, sizeof(cfg)) == sizeof(cfg);
+	close(fd);
+	if (!ok) return 0;
+
+	has_video_sections = hdr.has_video_sections;
+	using_video_section = hdr.using_video_section;
+	cfg_error_count = hdr.error_count;
+	memcpy(cfg_errors, hdr.errors, sizeof(cfg_errors));
+
+	// same console state as after parsing
+	ini_init_stdout();
+	if (dev_null) stdout = cfg.debug ? orig_stdout : dev_null;
+	return 1;
+}
+
+static void cfgsnap_store(const char *name, cfgsnap_t *hdr)
+{
+	mkdir(CFGSNAP_DIR, 0755);
+
+	char tmp_name[64];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	hdr->has_video_sections = has_video_sections;
+	hdr->using_video_section = using_video_section;
+	hdr->error_count = cfg_error_count;
+	memcpy(hdr->errors, cfg_errors, sizeof(cfg_errors));
+
+	int ok = write(fd, hdr, sizeof(cfgsnap_t)) == sizeof(cfgsnap_t) && write(fd, &cfg, sizeof(cfg)) == sizeof(cfg);
+	close(fd);
+	if (!ok || rename(tmp_name, name)) unlink(tmp_name);
+}
+
 void cfg_parse()
 {
+	int alt = altcfg();
+
+	static cfgsnap_t snap;
+	char snap_name[64];
+	int use_snap = cfgsnap_key(alt, &snap, snap_name);
+	if (use_snap && cfgsnap_load(snap_name, &snap)) return;
+
 	memset(&cfg, 0, sizeof(cfg));
 	cfg.bootscreen = 1;
 	cfg.fb_terminal = 1;
@@ -555,16 +759,18 @@ void cfg_parse()
 	cfg.video_contrast = 50;
 	cfg.video_saturation = 100;
 	cfg.video_hue = 0;
+	cfg.sd_cache_extents = 8;
+	cfg.sd_write_delay = 1000;
 	strcpy(cfg.video_gain_offset, "1, 0, 1, 0, 1, 0");
 	strcpy(cfg.main, "MiSTer");
 	has_video_sections = false;
 	using_video_section = false;
 	cfg_error_count = 0;
-	ini_parse(altcfg(), video_get_core_mode_name(1));
+	ini_parse(alt, video_get_core_mode_name(1));
 	if (has_video_sections && !using_video_section)
 	{
 		// second pass to look for section without vrefresh
-		ini_parse(altcfg(), video_get_core_mode_name(0));
+		ini_parse(alt, video_get_core_mode_name(0));
 	}
 
 	if (strlen(cfg.vga_mode))
@@ -574,6 +780,8 @@ void cfg_parse()
 		if (!strcasecmp(cfg.vga_mode, "svideo")) cfg.vga_mode_int = 2;
 		if (!strcasecmp(cfg.vga_mode, "cvbs")) cfg.vga_mode_int = 3;
 	}
+
+	if (use_snap) cfgsnap_store(snap_name, &snap);
 }
 
 bool cfg_has_video_sections()
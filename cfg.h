@@ -27,6 +27,7 @@ typedef struct {
 	uint8_t vsync_adjust;
 	uint8_t kbd_nomouse;
 	uint8_t mouse_throttle;
+	uint8_t mouse_interval;
 	uint8_t bootscreen;
 	uint8_t vscale_mode;
 	uint16_t vscale_border;
@@ -97,6 +98,20 @@ typedef struct {
 	uint32_t controller_unique_mapping[256];
 	char osd_lock[25];
 	uint16_t osd_lock_time;
+	uint16_t zip_cache_mb;
+	uint8_t sd_cache_extents;
+	uint16_t sd_write_delay;
+	uint16_t ide_write_delay;
+	uint8_t mra_md5_cache;
+	uint16_t mra_rom_cache_mb;
+	uint16_t neogeo_rom_cache_mb;
+	uint8_t input_thread;
+	uint8_t idle_wait;
+	uint16_t rbf_cache_mb;
+	char rbf_pin[8][256];
+	uint8_t savestate_compress;
+	uint8_t savestate_delta;
+	uint16_t net_input_port;
 	char debug;
 	char main[1024];
 } cfg_t;
@@ -110,6 +125,9 @@ const char* cfg_get_name(uint8_t alt);
 const char* cfg_get_label(uint8_t alt);
 bool cfg_has_video_sections();
 
+// Timing of the ini parser on a generated file in dir, for the bench harness.
+void cfg_bench(const char *dir);
+
 void cfg_error(const char *fmt, ...);
 bool cfg_check_errors(char *msg, size_t max_len);
 
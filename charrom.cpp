@@ -174,6 +174,34 @@ unsigned char charfont[256][8] =
 
 static unsigned char tempfont[2048];
 
+static unsigned char charfont_rot[256][8];
+static bool charfont_rot_ok = false;
+
+void charrom_rotate(const unsigned char *in, unsigned char *out)
+{
+	for (int b = 0; b < 8; ++b)
+	{
+		int a = 0;
+		for (int c = 0; c < 8; ++c)
+		{
+			a <<= 1;
+			a |= (in[c] >> b) & 1;
+		}
+		out[b] = a;
+	}
+}
+
+const unsigned char *charrom_rotated(unsigned char ch)
+{
+	if (!charfont_rot_ok)
+	{
+		for (int i = 0; i < 256; i++) charrom_rotate(charfont[i], charfont_rot[i]);
+		charfont_rot_ok = true;
+	}
+
+	return charfont_rot[ch];
+}
+
 void LoadFont(char* name)
 {
 	memset(tempfont, 0, sizeof(tempfont));
@@ -181,6 +209,8 @@ void LoadFont(char* name)
 	int sz = FileLoad(name, tempfont, sizeof(tempfont));
 	if (sz <= 0) return;
 
+	charfont_rot_ok = false;
+
 	int ch = 32;
 	int start = 0;
 	if (sz != 768)
@@ -5,4 +5,10 @@ extern unsigned char charfont[256][8];
 
 void LoadFont(char* name);
 
+// 90 degree turn of a glyph, as used by the OSD side stripe
+void charrom_rotate(const unsigned char *in, unsigned char *out);
+
+// rotated copy of a glyph, cached until the next font load
+const unsigned char *charrom_rotated(unsigned char ch);
+
 #endif
@@ -16,6 +16,7 @@
 #include "osd.h"
 #include "cheats.h"
 #include "support.h"
+#include "romindex.h"
 
 struct cheat_rec_t
 {
@@ -73,38 +74,13 @@ static int find_by_crc(uint32_t romcrc)
 	if (!romcrc) return 0;
 
 	sprintf(cheat_zip, "%s/cheats/%s", getRootDir(), CoreName2);
-	DIR *d = opendir(cheat_zip);
-	if (!d)
-	{
-		printf("Couldn't open dir: %s\n", cheat_zip);
-		return 0;
-	}
 
-	struct dirent *de;
-	while ((de = readdir(d)))
-	{
-		if (de->d_type == DT_REG)
-		{
-			int len = strlen(de->d_name);
-			if (len >= 14 && de->d_name[len - 14] == '[' && !strcasecmp(de->d_name + len - 5, "].zip"))
-			{
-				uint32_t crc = 0;
-				if (sscanf(de->d_name + len - 14, "[%X].zip", &crc) == 1)
-				{
-					if (crc == romcrc)
-					{
-						strcat(cheat_zip, "/");
-						strcat(cheat_zip, de->d_name);
-						closedir(d);
-						return 1;
-					}
-				}
-			}
-		}
-	}
+	char name[256];
+	if (!romindex_find_tag(cheat_zip, romcrc, ".zip", name, sizeof(name))) return 0;
 
-	closedir(d);
-	return 0;
+	strcat(cheat_zip, "/");
+	strcat(cheat_zip, name);
+	return 1;
 }
 
 static int find_in_same_dir(const char *name)
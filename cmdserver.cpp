@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "offload.h"
+#include "cmdserver.h"
+
+#define CMD_LEN     1024
+#define CMD_QUEUE   64
+#define CMD_BATCH   8   // commands run per poll
+#define CMD_JOBS    8
+#define CMD_TAG_LEN 64
+#define CMD_PARTIAL_MS 100  // a line without a newline for this long is a whole command
+
+struct cmd_job_t
+{
+	offload_job_t job;
+	char tag[CMD_TAG_LEN];
+};
+
+static cmd_handler_fn cmd_handler = nullptr;
+
+static char queue[CMD_QUEUE][CMD_LEN];
+static int queue_head = 0, queue_num = 0;
+
+// start of a line which didn't end in the last read
+static char partial[CMD_LEN];
+static int partial_len = 0;
+static int partial_skip = 0;
+static uint64_t partial_ms = 0;
+
+static cmd_job_t jobs[CMD_JOBS] = {};
+static char cur_tag[CMD_TAG_LEN];
+
+// Goes only to a reader which has the fifo open now. Without one the open
+// fails with ENXIO and the reply is dropped, so nothing piles up for a
+// later reader. The fifo is closed again right away for the same reason.
+static void cmd_reply(const char *status, const char *tag)
+{
+	int fd = open(CMD_REPLY_FIFO, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) return;
+
+	char line[CMD_TAG_LEN + 16];
+	int len = snprintf(line, sizeof(line), "%s %s\n", status, tag);
+	if (len > (int)sizeof(line) - 1) len = sizeof(line) - 1;
+	if (write(fd, line, len) < 0) {}
+	close(fd);
+}
+
+int cmdserver_open(cmd_handler_fn handler)
+{
+	cmd_handler = handler;
+
+	// a reader leaving between the open and the write of a reply
+	signal(SIGPIPE, SIG_IGN);
+
+	unlink(CMD_REPLY_FIFO);
+	mkfifo(CMD_REPLY_FIFO, 0666);
+
+	unlink(CMD_FIFO);
+	mkfifo(CMD_FIFO, 0666);
+	return open(CMD_FIFO, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+}
+
+static uint64_t cmd_time_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static void cmd_queue(const char *line, int len)
+{
+	while (len && (line[len - 1] == '\r' || line[len - 1] == ' ')) len--;
+	if (!len) return;
+
+	if (queue_num >= CMD_QUEUE)
+	{
+		printf("MiSTer_cmd: queue full, dropped: %.*s\n", len, line);
+		return;
+	}
+
+	char *cmd = queue[(queue_head + queue_num++) % CMD_QUEUE];
+	memcpy(cmd, line, len);
+	cmd[len] = 0;
+}
+
+void cmdserver_read(int fd)
+{
+	static char buf[4096];
+	int len;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		char *p = buf, *end = buf + len;
+		while (p < end)
+		{
+			char *nl = (char*)memchr(p, '\n', end - p);
+			int n = (nl ? nl : end) - p;
+
+			// overlong lines are dropped as a whole
+			if (!partial_skip)
+			{
+				if (partial_len + n >= CMD_LEN)
+				{
+					printf("MiSTer_cmd: command too long, dropped.\n");
+					partial_skip = 1;
+				}
+				else
+				{
+					memcpy(partial + partial_len, p, n);
+					partial_len += n;
+				}
+			}
+
+			if (!nl)
+			{
+				p = end;
+				break;
+			}
+
+			if (!partial_skip) cmd_queue(partial, partial_len);
+			partial_len = 0;
+			partial_skip = 0;
+			p = nl + 1;
+		}
+	}
+
+	// the rest of the line may come with the next write, cmdserver_poll()
+	// takes it as it is if nothing follows
+	if (partial_len || partial_skip) partial_ms = cmd_time_ms();
+}
+
+static void cmd_run(char *cmd)
+{
+	printf("MiSTer_cmd: %s\n", cmd);
+
+	char *tag = cmd;
+	if (*cmd == '@')
+	{
+		char *sp = strchr(cmd, ' ');
+		if (!sp) sp = cmd + strlen(cmd);
+		snprintf(cur_tag, sizeof(cur_tag), "%.*s", (int)(sp - cmd), cmd);
+		cmd = sp;
+		while (*cmd == ' ') cmd++;
+		tag = cur_tag;
+	}
+	else
+	{
+		snprintf(cur_tag, sizeof(cur_tag), "%s", cmd);
+	}
+
+	int res = cmd_handler ? cmd_handler(cmd) : CMD_UNKNOWN;
+	cmd_reply((res == CMD_PENDING) ? "pending" : (res == CMD_OK) ? "ok" : "unknown", tag);
+	cur_tag[0] = 0;
+}
+
+void cmdserver_poll()
+{
+	// "echo -n" style writes without a newline, as they always worked
+	if ((partial_len || partial_skip) && cmd_time_ms() - partial_ms >= CMD_PARTIAL_MS)
+	{
+		if (!partial_skip) cmd_queue(partial, partial_len);
+		partial_len = 0;
+		partial_skip = 0;
+	}
+
+	for (int i = 0; i < CMD_JOBS; i++)
+	{
+		if (jobs[i].job && offload_job_done(jobs[i].job))
+		{
+			cmd_reply("done", jobs[i].tag);
+			jobs[i].job = 0;
+		}
+	}
+
+	for (int n = 0; n < CMD_BATCH && queue_num; n++)
+	{
+		char *cmd = queue[queue_head];
+		queue_head = (queue_head + 1) % CMD_QUEUE;
+		queue_num--;
+		cmd_run(cmd);
+	}
+}
+
+int cmdserver_busy()
+{
+	return queue_num || partial_len || partial_skip;
+}
+
+int cmdserver_offload(void (*fn)())
+{
+	for (int i = 0; i < CMD_JOBS; i++)
+	{
+		if (jobs[i].job) continue;
+
+		jobs[i].job = offload_try_work([fn] { fn(); }, OFFLOAD_UI);
+		if (!jobs[i].job) break;
+
+		snprintf(jobs[i].tag, sizeof(jobs[i].tag), "%s", cur_tag);
+		return CMD_PENDING;
+	}
+
+	fn();
+	return CMD_OK;
+}
@@ -0,0 +1,42 @@
+#ifndef CMDSERVER_H
+#define CMDSERVER_H
+
+// Line based command server behind /dev/MiSTer_cmd. Every write may hold
+// any number of newline separated commands; they are queued and run a few
+// per poll, so a burst doesn't hold up the core. A command can start with
+// "@<tag> " to tell its replies apart. Results go to CMD_REPLY_FIFO as
+// "<ok|unknown|pending|done> <tag or command>" lines; "pending" commands run
+// on the offload pool and report "done" once finished. Replies only go to
+// a reader which has the fifo open at the time, others are dropped, so
+// scripts which never read it are unaffected. Main thread only.
+#define CMD_FIFO       "/dev/MiSTer_cmd"
+#define CMD_REPLY_FIFO "/dev/MiSTer_cmd_reply"
+
+enum
+{
+	CMD_UNKNOWN = 0,
+	CMD_OK,
+	CMD_PENDING
+};
+
+typedef int (*cmd_handler_fn)(char *cmd);
+
+// Creates the fifos, returns the command fd to poll or -1.
+int  cmdserver_open(cmd_handler_fn handler);
+
+// Reads everything available on fd and queues the complete lines. A line
+// split across writes is joined, one left without a newline for 100ms is
+// taken as a whole command.
+void cmdserver_read(int fd);
+
+// Runs queued commands and reports finished jobs.
+void cmdserver_poll();
+
+// Commands are waiting to run.
+int  cmdserver_busy();
+
+// For handlers: runs fn on the offload pool and replies when it's done.
+// Returns CMD_PENDING, or CMD_OK if the pool was full and fn ran here.
+int  cmdserver_offload(void (*fn)());
+
+#endif
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include "profiling.h"
+#include "crc.h"
+#include "lib/md5/md5.h"
+
+struct crc_tables_t
+{
+	uint32_t c32[8][256];
+	uint16_t c16[8][256];
+
+	// built by the compiler, so there's no init order or threading concern
+	constexpr crc_tables_t() : c32(), c16()
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : (c >> 1);
+			c32[0][i] = c;
+
+			uint16_t s = (uint16_t)(i << 8);
+			for (int k = 0; k < 8; k++) s = (s & 0x8000) ? (uint16_t)((s << 1) ^ 0x1021) : (uint16_t)(s << 1);
+			c16[0][i] = s;
+		}
+
+		for (int t = 1; t < 8; t++)
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				c32[t][i] = (c32[t - 1][i] >> 8) ^ c32[0][c32[t - 1][i] & 0xFF];
+				c16[t][i] = (uint16_t)((c16[t - 1][i] << 8) ^ c16[0][c16[t - 1][i] >> 8]);
+			}
+		}
+	}
+};
+
+static constexpr crc_tables_t tables;
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+extern "C" uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	const auto &t = tables.c32;
+	crc = ~crc;
+
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		uint32_t one = load32(p) ^ crc;
+		uint32_t two = load32(p + 4);
+		crc = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+			t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+	}
+
+	while (len--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+	return ~crc;
+}
+
+uint16_t crc16_ccitt(uint16_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = (const uint8_t*)data;
+	const auto &t = tables.c16;
+
+	for (; len >= 8; len -= 8, p += 8)
+	{
+		crc = t[7][p[0] ^ (crc >> 8)] ^ t[6][p[1] ^ (crc & 0xFF)] ^ t[5][p[2]] ^ t[4][p[3]] ^
+			t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+	}
+
+	while (len--) crc = (uint16_t)((crc << 8) ^ t[0][(crc >> 8) ^ *p++]);
+	return crc;
+}
+
+static volatile uint32_t crc_sink;
+
+void crc_bench()
+{
+	static uint8_t buf[1024 * 1024];
+	const int loops = 8;
+
+	for (uint32_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)(i * 13 + (i >> 9));
+
+	uint64_t start = profiling_time_us();
+	uint32_t crc = 0;
+	for (int n = 0; n < loops; n++) crc = crc32_update(crc, buf, sizeof(buf));
+	profiling_bench_report("crc32 1MB", profiling_time_us() - start, loops, sizeof(buf) * loops);
+
+	start = profiling_time_us();
+	uint32_t ref = 0;
+	for (int n = 0; n < loops; n++)
+	{
+		ref = ~ref;
+		for (uint32_t i = 0; i < sizeof(buf); i++) ref = (ref >> 8) ^ tables.c32[0][(ref ^ buf[i]) & 0xFF];
+		ref = ~ref;
+	}
+	profiling_bench_report("crc32 bytewise 1MB", profiling_time_us() - start, loops, sizeof(buf) * loops);
+	if (crc != ref) printf("crc_bench: crc32 %08X, bytewise %08X\n", crc, ref);
+
+	start = profiling_time_us();
+	uint16_t crc16 = 0xFFFF;
+	for (int n = 0; n < loops; n++) crc16 = crc16_ccitt(crc16, buf, sizeof(buf));
+	profiling_bench_report("crc16 1MB", profiling_time_us() - start, loops, sizeof(buf) * loops);
+	crc_sink = crc16; // else the unused result lets the loop go
+
+	start = profiling_time_us();
+	unsigned char md5[16];
+	MD5Context ctx;
+	MD5Init(&ctx);
+	for (int n = 0; n < loops; n++) MD5Update(&ctx, buf, sizeof(buf));
+	MD5Final(md5, &ctx);
+	profiling_bench_report("md5 1MB", profiling_time_us() - start, loops, sizeof(buf) * loops);
+}
@@ -0,0 +1,25 @@
+#ifndef CRC_H
+#define CRC_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+// Table driven (slice-by-8) CRC kernels. Safe to call from any thread.
+
+// CRC-32 (IEEE, reflected), same semantics as zlib crc32(): start with 0
+// and pass the previous result to continue. C linkage, miniz uses it too.
+#ifdef __cplusplus
+extern "C"
+#endif
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+// CRC-16/CCITT (poly 0x1021, MSB first) without final xor, as used by
+// WD179x/VG93 floppy controllers. Start with 0xFFFF for the FDC CRC.
+uint16_t crc16_ccitt(uint16_t crc, const void *data, size_t len);
+
+#ifdef __cplusplus
+// Throughput of the kernels against a bytewise table loop (and MD5), for MiSTer_cmd.
+void crc_bench();
+#endif
+
+#endif
@@ -14,12 +14,19 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/syscall.h>
 #include <linux/magic.h>
 #include <algorithm>
 #include <vector>
 #include <string>
 #include <set>
+#include <unordered_map>
+#include <atomic>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdio_ext.h>
 #include "lib/miniz/miniz.h"
+#include "zstd.h"
 #include "osd.h"
 #include "fpga_io.h"
 #include "menu.h"
@@ -32,34 +39,176 @@
 #include "scheduler.h"
 #include "video.h"
 #include "support.h"
+#include "offload.h"
+#include "hardware.h"
+#include "profiling.h"
 
 #define MIN(a,b) (((a)<(b)) ? (a) : (b))
 
 typedef std::vector<direntext_t> DirentVector;
 typedef std::set<std::string> DirNameSet;
 
-static const size_t YieldIterations = 128;
+// how often long directory loops check the scheduler time budget
+static const size_t YieldIterations = 16;
 
 DirentVector DirItem;
 DirNameSet DirNames;
 
+// one entry while it is being built, DirAdd() stores it compactly
+struct dirent_build_t
+{
+	dirent de;
+	unsigned int flags;
+	char datecode[16];
+	char altname[256];
+};
+
+// Names of the listed entries are packed into blocks which never move, so
+// DirItem entries can point right into them.
+#define DIR_ARENA_BLOCK (64 * 1024)
+
+struct DirArenaBlock
+{
+	char *data;
+	size_t size;
+	size_t used;
+};
+
+static std::vector<DirArenaBlock> DirArena;
+
+static char *DirArenaAlloc(size_t size)
+{
+	if (DirArena.empty() || DirArena.back().used + size > DirArena.back().size)
+	{
+		DirArenaBlock block;
+		block.size = (size > DIR_ARENA_BLOCK) ? size : DIR_ARENA_BLOCK;
+		block.data = (char *)malloc(block.size);
+		block.used = 0;
+		if (!block.data) return NULL;
+		DirArena.push_back(block);
+	}
+
+	DirArenaBlock *block = &DirArena.back();
+	char *p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+static const char *DirArenaStr(const char *str)
+{
+	size_t len = strlen(str) + 1;
+	char *p = DirArenaAlloc(len);
+	if (!p) return "";
+	memcpy(p, str, len);
+	return p;
+}
+
+static void DirClear()
+{
+	DirItem.clear();
+	for (size_t i = 0; i < DirArena.size(); i++) free(DirArena[i].data);
+	DirArena.clear();
+}
+
+// Listing group in the top byte, then the first three characters of the name
+// without its extension, lowered like strncasecmp does. Entries with different
+// keys compare like their keys, DirentComp only looks deeper on a tie.
+static uint32_t DirSortKey(const direntext_t *item)
+{
+	uint32_t group = 3;
+	if (item->de.d_type == DT_DIR)
+	{
+		group = !strcmp(item->altname, "..") ? 0 : (item->flags & DT_EXT_ZIP) ? 2 : 1;
+	}
+
+	int len = strlen(item->altname);
+	if ((len > 4) && (item->altname[len - 4] == '.')) len -= 4;
+
+	uint32_t key = group << 24;
+	for (int i = 0; i < 3 && i < len; i++) key |= (uint32_t)tolower((uint8_t)item->altname[i]) << (16 - i * 8);
+	return key;
+}
+
+static void DirAdd(const dirent_build_t *dext)
+{
+	direntext_t item;
+	item.de.d_name = DirArenaStr(dext->de.d_name);
+	item.de.d_type = dext->de.d_type;
+	item.flags = dext->flags;
+	item.altname = strcmp(dext->altname, dext->de.d_name) ? DirArenaStr(dext->altname) : item.de.d_name;
+	item.datecode = dext->datecode[0] ? DirArenaStr(dext->datecode) : "";
+	item.sort_key = DirSortKey(&item);
+	DirItem.push_back(item);
+}
+
 
 // Directory scanning can cause the same zip file to be opened multiple times
 // due to testing file types to adjust the path
 // (and the fact the code path is shared with regular files)
-// cache the opened mz_zip_archive so we only open it once
-// this has the extra benefit that if a user is navigating through multiple directories
-// in a zip archive, the zip will only be opened once and things will be more responsive
+// and arcade sets pull their parts from several zips (parent + clone).
+// Keep the last few archives open with their central directory parsed and
+// name/crc lookup tables built, so switching between them costs no re-parse.
 // ** We have to open the file outselves with open() so we can set O_CLOEXEC to prevent
 // leaking the file descriptor when the user changes cores
 
-static mz_zip_archive last_zip_archive = {};
-static int last_zip_fd = -1;
-static FILE *last_zip_cfile = NULL;
-static char last_zip_fname[256] = {};
+#define ZIP_CACHE_SIZE 4
+
+// Inflate state snapshots taken while an entry is streamed for the first time.
+// A seek resumes from the closest one instead of inflating from the start.
+#define ZIP_CHECKPOINT_MIN_STEP (256 * 1024)
+#define ZIP_CHECKPOINT_MAX      32
+
+struct ZipCheckpoint
+{
+	mz_zip_reader_extract_iter_state state;
+	uint8_t *dict;
+};
+
+struct ZipSeekIndex
+{
+	uint64_t step = 0;
+	std::vector<ZipCheckpoint> points; // ascending output offset
+
+	ZipSeekIndex() {}
+	ZipSeekIndex(const ZipSeekIndex &) = delete;
+	ZipSeekIndex &operator=(const ZipSeekIndex &) = delete;
+	~ZipSeekIndex() { for (auto &cp : points) free(cp.dict); }
+};
+
+struct ZipCacheEntry
+{
+	char fname[1024];
+	mz_zip_archive archive;
+	FILE *cfile;
+	time_t mtime;
+	__off64_t fsize;
+	int refs;           // open files using the archive, never evicted while set
+	uint32_t last_use;
+	bool indexed;
+	std::unordered_map<std::string, int> by_name; // lower case names
+	std::unordered_map<uint32_t, int> by_crc;
+	std::unordered_map<int, ZipSeekIndex> seek; // per file index
+};
+
+static ZipCacheEntry zip_cache[ZIP_CACHE_SIZE];
+static uint32_t zip_cache_counter = 0;
+static mz_zip_archive *last_zip_archive = nullptr;
+static mz_zip_error last_zip_error = MZ_ZIP_NO_ERROR;
 static char scanned_path[1024] = {};
 static int scanned_opts = 0;
 
+// request behind the complete listing in DirItem, so typing ahead in the
+// browser narrows it in memory instead of reading the directory again
+static struct
+{
+	int valid;
+	int options;
+	char ext[256];
+	char prefix[256];
+	char filter[256];
+	int has_prefix;
+} listed = {};
+
 static int iSelectedEntry = 0;       // selected entry index
 static int iFirstEntry = 0;
 
@@ -72,6 +221,12 @@ fileTYPE::fileTYPE()
 	mode = 0;
 	type = 0;
 	zip = 0;
+	zcache = 0;
+	zst = 0;
+	dfd = 0;
+	net = 0;
+	ra_next = 0;
+	oneshot = 0;
 	size = 0;
 	offset = 0;
 }
@@ -83,54 +238,534 @@ fileTYPE::~fileTYPE()
 
 int fileTYPE::opened()
 {
-	return filp || zip;
+	return filp || zip || zst;
 }
 
 struct fileZipArchive
 {
-	mz_zip_archive                    archive;
+	mz_zip_archive*                   archive;
+	ZipCacheEntry*                    cache;   // null if the archive is private
+	mz_zip_archive                    own;
 	int                               index;
 	mz_zip_reader_extract_iter_state* iter;
 	__off64_t                         offset;
+	ZipSeekIndex*                     seek;    // owned by the cache entry if cached
 };
 
+// Seekable zstd images (independent frames and a seek table in a skippable
+// frame at the end, the format of zstd's contrib/seekable_format). A read
+// decodes the frame holding the offset, sequential reads get the following
+// frame decoded on a worker meanwhile.
+#define ZST_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZST_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZST_FOOTER_SIZE    9
+#define ZST_FRAME_MAX      (64 * 1024 * 1024)
 
-static int OpenZipfileCached(char *path, int flags)
+struct fileZstdFrame
 {
-  if (last_zip_fname[0] && !strcasecmp(path, last_zip_fname))
-  {
-    return 1;
-  }
+	uint64_t cpos;
+	uint64_t dpos;
+	uint32_t csize;
+	uint32_t dsize;
+};
 
-  mz_zip_reader_end(&last_zip_archive);
-  mz_zip_zero_struct(&last_zip_archive);
-  if (last_zip_cfile)
-  {
-    fclose(last_zip_cfile);
-    last_zip_cfile = nullptr;
-  }
+struct fileZstdBuf
+{
+	ZSTD_DCtx *dctx;
+	uint8_t *cbuf;
+	uint8_t *dbuf;
+	int64_t frame;    // decoded frame, -1 - none
+	int ok;
+};
 
-  last_zip_fname[0] = '\0';
-  last_zip_fd = open(path, O_RDONLY|O_CLOEXEC);
-  if (last_zip_fd < 0)
-  {
-    return 0;
-  }
+struct fileZstd
+{
+	int fd;
+	uint32_t frames;
+	fileZstdFrame *frame;  // frames + 1, the last one marks the end
+	uint32_t csize_max;
+	uint32_t dsize_max;
+	fileZstdBuf buf[2];
+	int cur;               // buffer of the last read
+	offload_job_t job;     // decoding the other buffer
+};
 
-  last_zip_cfile = fdopen(last_zip_fd, "r");
-  if (!last_zip_cfile)
-  {
-    close(last_zip_fd);
-    last_zip_fd = -1;
-    return 0;
-  }
+static uint32_t zst_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-  int mz_ret = mz_zip_reader_init_cfile(&last_zip_archive, last_zip_cfile, 0, flags);
-  if (mz_ret)
-  {
-    strncpy(last_zip_fname, path, sizeof(last_zip_fname));
-  }
-  return mz_ret;
+static void zst_free(fileZstd *z)
+{
+	offload_wait(z->job);
+	for (int i = 0; i < 2; i++)
+	{
+		ZSTD_freeDCtx(z->buf[i].dctx);
+		free(z->buf[i].cbuf);
+		free(z->buf[i].dbuf);
+	}
+	free(z->frame);
+	if (z->fd >= 0) close(z->fd);
+	delete z;
+}
+
+// takes the seek table of fd, null if it's not a seekable image
+static fileZstd *zst_open(int fd, __off64_t fsize)
+{
+	uint8_t foot[ZST_FOOTER_SIZE];
+	if (fsize < 8 + ZST_FOOTER_SIZE || pread64(fd, foot, sizeof(foot), fsize - sizeof(foot)) != sizeof(foot)) return nullptr;
+	if (zst_le32(foot + 5) != ZST_SEEKABLE_MAGIC || (foot[4] & 0x7C)) return nullptr;
+
+	uint32_t frames = zst_le32(foot);
+	uint32_t esize = (foot[4] & 0x80) ? 12 : 8;
+	uint64_t tsize = (uint64_t)frames * esize + ZST_FOOTER_SIZE;
+	if (!frames || tsize + 8 > (uint64_t)fsize) return nullptr;
+
+	uint8_t *table = (uint8_t*)malloc(tsize + 8);
+	if (!table) return nullptr;
+
+	fileZstd *z = nullptr;
+	if (pread64(fd, table, tsize + 8, fsize - tsize - 8) == (ssize_t)(tsize + 8) &&
+		zst_le32(table) == ZST_SKIPPABLE_MAGIC && zst_le32(table + 4) == tsize)
+	{
+		z = new fileZstd{};
+		z->fd = -1;
+		z->frames = frames;
+		z->frame = (fileZstdFrame*)malloc((frames + 1) * sizeof(fileZstdFrame));
+
+		uint64_t cpos = 0, dpos = 0;
+		for (uint32_t i = 0; z->frame && i < frames; i++)
+		{
+			const uint8_t *e = table + 8 + i * esize;
+			fileZstdFrame *f = &z->frame[i];
+			f->cpos = cpos;
+			f->dpos = dpos;
+			f->csize = zst_le32(e);
+			f->dsize = zst_le32(e + 4);
+			if (f->csize > z->csize_max) z->csize_max = f->csize;
+			if (f->dsize > z->dsize_max) z->dsize_max = f->dsize;
+			cpos += f->csize;
+			dpos += f->dsize;
+		}
+
+		// the frames have to fill the file up to the table
+		if (!z->frame || cpos + tsize + 8 != (uint64_t)fsize || z->dsize_max > ZST_FRAME_MAX || !z->dsize_max)
+		{
+			zst_free(z);
+			z = nullptr;
+		}
+		else
+		{
+			z->frame[frames].cpos = cpos;
+			z->frame[frames].dpos = dpos;
+			for (int i = 0; i < 2; i++)
+			{
+				z->buf[i].dctx = ZSTD_createDCtx();
+				z->buf[i].cbuf = (uint8_t*)malloc(z->csize_max);
+				z->buf[i].dbuf = (uint8_t*)malloc(z->dsize_max);
+				z->buf[i].frame = -1;
+				if (!z->buf[i].dctx || !z->buf[i].cbuf || !z->buf[i].dbuf)
+				{
+					zst_free(z);
+					z = nullptr;
+					break;
+				}
+			}
+		}
+	}
+
+	free(table);
+	if (z) z->fd = fd;
+	return z;
+}
+
+// on the caller or a worker, preads are fine from both
+static void zst_decode(fileZstd *z, fileZstdBuf *b, uint32_t idx)
+{
+	const fileZstdFrame *f = &z->frame[idx];
+	b->frame = idx;
+	b->ok = pread64(z->fd, b->cbuf, f->csize, f->cpos) == (ssize_t)f->csize &&
+		ZSTD_decompressDCtx(b->dctx, b->dbuf, f->dsize, b->cbuf, f->csize) == f->dsize;
+}
+
+static uint32_t zst_find(const fileZstd *z, uint64_t pos)
+{
+	uint32_t lo = 0, hi = z->frames;
+	while (lo + 1 < hi)
+	{
+		uint32_t mid = (lo + hi) / 2;
+		if (z->frame[mid].dpos <= pos) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+static int zst_read(fileTYPE *file, __off64_t offset, void *pBuffer, int length)
+{
+	fileZstd *z = file->zst;
+	if (offset < 0 || offset >= file->size) return 0;
+	if (length > file->size - offset) length = file->size - offset;
+
+	// only the main thread may queue work or wait for it
+	int main = syscall(SYS_gettid) == getpid();
+
+	uint8_t *dst = (uint8_t*)pBuffer;
+	int done = 0;
+	while (done < length)
+	{
+		uint32_t idx = zst_find(z, offset + done);
+		fileZstdBuf *b = &z->buf[z->cur];
+		if (b->frame != idx && !main)
+		{
+			// off the main thread (a read stream worker) the frame is decoded
+			// right here, the buffer of a pending job is left alone
+			zst_decode(z, b, idx);
+		}
+		else if (b->frame != idx)
+		{
+			// the worker's frame or a fresh decode into the free buffer
+			offload_wait(z->job);
+			z->job = 0;
+			z->cur ^= 1;
+			b = &z->buf[z->cur];
+			if (b->frame != idx) zst_decode(z, b, idx);
+
+			if (idx + 1 < z->frames)
+			{
+				fileZstdBuf *next = &z->buf[z->cur ^ 1];
+				next->frame = -1;
+				z->job = offload_try_work([z, next, idx] { zst_decode(z, next, idx + 1); }, OFFLOAD_IO);
+			}
+		}
+
+		if (!b->ok)
+		{
+			printf("FileReadAdv error(zstd frame %u).\n", idx);
+			break;
+		}
+
+		const fileZstdFrame *f = &z->frame[idx];
+		uint32_t pos = offset + done - f->dpos;
+		int len = MIN((int)(f->dsize - pos), length - done);
+		memcpy(dst + done, b->dbuf + pos, len);
+		done += len;
+	}
+
+	return done;
+}
+
+static void zip_cache_close(ZipCacheEntry *entry)
+{
+	mz_zip_reader_end(&entry->archive);
+	mz_zip_zero_struct(&entry->archive);
+	if (entry->cfile) fclose(entry->cfile);
+	entry->cfile = nullptr;
+	entry->fname[0] = 0;
+	entry->indexed = false;
+	entry->by_name.clear();
+	entry->by_crc.clear();
+	entry->seek.clear();
+}
+
+// With pin set the entry is kept for an open file. At most ZIP_CACHE_SIZE-1
+// entries can be pinned, so directory scanning always finds a free slot.
+static ZipCacheEntry *zip_cache_open(const char *path, int pin)
+{
+	struct stat64 st;
+	if (stat64(path, &st) < 0)
+	{
+		last_zip_error = MZ_ZIP_FILE_NOT_FOUND;
+		return nullptr;
+	}
+
+	int pinned = 0;
+	for (int i = 0; i < ZIP_CACHE_SIZE; i++) if (zip_cache[i].refs) pinned++;
+	int can_pin = pinned < ZIP_CACHE_SIZE - 1;
+
+	ZipCacheEntry *victim = nullptr;
+	for (int i = 0; i < ZIP_CACHE_SIZE; i++)
+	{
+		ZipCacheEntry *entry = &zip_cache[i];
+		if (entry->fname[0] && !strcasecmp(path, entry->fname))
+		{
+			if (entry->mtime == st.st_mtime && entry->fsize == st.st_size)
+			{
+				if (pin && !entry->refs && !can_pin) break;
+				entry->last_use = ++zip_cache_counter;
+				if (pin) entry->refs++;
+				return entry;
+			}
+
+			// file has changed since it was parsed
+			if (entry->refs) continue;
+			zip_cache_close(entry);
+		}
+
+		if (entry->refs) continue;
+		if (!victim || (victim->fname[0] && (!entry->fname[0] || entry->last_use < victim->last_use))) victim = entry;
+	}
+
+	if (!victim || (pin && !can_pin))
+	{
+		last_zip_error = MZ_ZIP_ALLOC_FAILED;
+		return nullptr;
+	}
+
+	zip_cache_close(victim);
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		last_zip_error = MZ_ZIP_FILE_OPEN_FAILED;
+		return nullptr;
+	}
+
+	victim->cfile = fdopen(fd, "r");
+	if (!victim->cfile)
+	{
+		close(fd);
+		last_zip_error = MZ_ZIP_FILE_OPEN_FAILED;
+		return nullptr;
+	}
+
+	if (!mz_zip_reader_init_cfile(&victim->archive, victim->cfile, 0, 0))
+	{
+		last_zip_error = mz_zip_get_last_error(&victim->archive);
+		zip_cache_close(victim);
+		return nullptr;
+	}
+
+	strncpy(victim->fname, path, sizeof(victim->fname) - 1);
+	victim->fname[sizeof(victim->fname) - 1] = 0;
+	victim->mtime = st.st_mtime;
+	victim->fsize = st.st_size;
+	victim->last_use = ++zip_cache_counter;
+	if (pin) victim->refs++;
+	return victim;
+}
+
+static void zip_cache_index(ZipCacheEntry *entry)
+{
+	if (entry->indexed) return;
+
+	mz_uint num = mz_zip_reader_get_num_files(&entry->archive);
+	entry->by_name.reserve(num);
+	entry->by_crc.reserve(num);
+
+	for (mz_uint i = 0; i < num; i++)
+	{
+		mz_zip_archive_file_stat s;
+		if (!mz_zip_reader_file_stat(&entry->archive, i, &s)) continue;
+
+		std::string name(s.m_filename);
+		std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+		// keep the first match like a linear scan would
+		entry->by_name.emplace(name, i);
+		entry->by_crc.emplace(s.m_crc32, i);
+	}
+
+	entry->indexed = true;
+}
+
+static int zip_cache_locate(ZipCacheEntry *entry, const char *name)
+{
+	zip_cache_index(entry);
+
+	std::string key(name);
+	std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+
+	auto it = entry->by_name.find(key);
+	return (it != entry->by_name.end()) ? it->second : -1;
+}
+
+static int zip_cache_find_crc(ZipCacheEntry *entry, uint32_t crc32)
+{
+	zip_cache_index(entry);
+
+	auto it = entry->by_crc.find(crc32);
+	return (it != entry->by_crc.end()) ? it->second : -1;
+}
+
+static ZipCacheEntry *last_zip_entry = nullptr;
+
+static int OpenZipfileCached(char *path)
+{
+	last_zip_entry = zip_cache_open(path, 0);
+	last_zip_archive = last_zip_entry ? &last_zip_entry->archive : nullptr;
+	return last_zip_entry != nullptr;
+}
+
+// Attach an open file to a cached archive, or to a private one if too many
+// cache entries are held by other open files.
+static int zip_attach(fileTYPE *file, const char *zip_path)
+{
+	file->zip = new fileZipArchive{};
+
+	ZipCacheEntry *entry = zip_cache_open(zip_path, 1);
+	if (entry)
+	{
+		file->zip->cache = entry;
+		file->zip->archive = &entry->archive;
+		return 1;
+	}
+
+	if (last_zip_error != MZ_ZIP_ALLOC_FAILED) return 0;
+
+	file->zip->archive = &file->zip->own;
+	if (!mz_zip_reader_init_file(&file->zip->own, zip_path, 0))
+	{
+		last_zip_error = mz_zip_get_last_error(&file->zip->own);
+		file->zip->archive = nullptr;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int zip_locate(fileTYPE *file, const char *name)
+{
+	if (file->zip->cache) return zip_cache_locate(file->zip->cache, name);
+	return mz_zip_reader_locate_file(file->zip->archive, name, NULL, 0);
+}
+
+// Called on open, so reads from worker threads never touch the cache entry.
+static void zip_attach_seek_index(fileTYPE *file)
+{
+	if (file->zip->cache) file->zip->seek = &file->zip->cache->seek[file->zip->index];
+	else file->zip->seek = new ZipSeekIndex;
+}
+
+static void zip_checkpoint(fileTYPE *file)
+{
+	mz_zip_reader_extract_iter_state *iter = file->zip->iter;
+	ZipSeekIndex *idx = file->zip->seek;
+
+	// stored entries seek directly
+	if (!idx || !iter->pWrite_buf || iter->status < 0) return;
+
+	if (!idx->step) idx->step = std::max<uint64_t>(ZIP_CHECKPOINT_MIN_STEP, iter->file_stat.m_uncomp_size / ZIP_CHECKPOINT_MAX);
+
+	uint64_t last = idx->points.empty() ? 0 : idx->points.back().state.out_buf_ofs;
+	if (iter->out_buf_ofs < last + idx->step || iter->out_buf_ofs >= iter->file_stat.m_uncomp_size) return;
+	if (idx->points.size() >= ZIP_CHECKPOINT_MAX) return;
+
+	ZipCheckpoint cp;
+	cp.dict = (uint8_t*)malloc(TINFL_LZ_DICT_SIZE);
+	if (!cp.dict) return;
+
+	memcpy(cp.dict, iter->pWrite_buf, TINFL_LZ_DICT_SIZE);
+	cp.state = *iter;
+	idx->points.push_back(cp);
+}
+
+static ZipCheckpoint *zip_find_checkpoint(fileTYPE *file, __off64_t offset)
+{
+	ZipCheckpoint *best = nullptr;
+	if (file->zip->seek)
+	{
+		for (auto &cp : file->zip->seek->points)
+		{
+			if ((__off64_t)cp.state.out_buf_ofs > offset) break;
+			best = &cp;
+		}
+	}
+	return best;
+}
+
+// true if a new iterator gets closer to offset than reading forward
+static int zip_can_skip(fileTYPE *file, __off64_t offset)
+{
+	if (!file->zip->iter->pWrite_buf) return offset > file->zip->offset;
+
+	ZipCheckpoint *cp = zip_find_checkpoint(file, offset);
+	return cp && (__off64_t)cp->state.out_buf_ofs > file->zip->offset;
+}
+
+// New iterator positioned at the closest known point at or before offset
+static mz_zip_reader_extract_iter_state *zip_iter_new(fileTYPE *file, __off64_t offset)
+{
+	mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
+	if (!iter) return nullptr;
+
+	if (offset > (__off64_t)iter->file_stat.m_uncomp_size) offset = iter->file_stat.m_uncomp_size;
+
+	if (!iter->pWrite_buf)
+	{
+		iter->cur_file_ofs += offset;
+		iter->out_buf_ofs = offset;
+		iter->comp_remaining -= offset;
+	}
+	else if (ZipCheckpoint *cp = zip_find_checkpoint(file, offset))
+	{
+		void *read_buf = iter->pRead_buf;
+		void *write_buf = iter->pWrite_buf;
+		mz_uint64 read_buf_size = iter->read_buf_size;
+
+		*iter = cp->state;
+		iter->pRead_buf = read_buf;
+		iter->pWrite_buf = write_buf;
+		iter->read_buf_size = read_buf_size;
+		memcpy(write_buf, cp->dict, TINFL_LZ_DICT_SIZE);
+
+		// input buffer isn't saved, re-read its unconsumed part from the file
+		iter->cur_file_ofs -= iter->read_buf_avail;
+		iter->comp_remaining += iter->read_buf_avail;
+		iter->read_buf_avail = 0;
+		iter->read_buf_ofs = 0;
+	}
+
+	return iter;
+}
+
+// Mounted zip members extracted into tmpfs on the offload thread. Readers
+// only wait for the part they access, so the mount returns immediately.
+
+#define ZCACHE_SLOTS 8
+#define ZCACHE_CHUNK (256 * 1024)
+
+enum
+{
+	ZCACHE_FREE = 0,
+	ZCACHE_EXTRACTING,
+	ZCACHE_DONE,
+	ZCACHE_FAILED
+};
+
+struct fileZipCache
+{
+	char zip_path[1024];
+	char member[512];
+	time_t mtime;              // of the zip file
+	__off64_t fsize;
+	__off64_t size;            // uncompressed member size
+	uint32_t crc;              // stored CRC32 of the member
+	int fd;                    // writer side, owned by the extraction job
+	int refs;
+	uint32_t last_use;
+	std::atomic<int> state;
+	std::atomic<int> cancel;
+	std::atomic<uint64_t> ready; // bytes extracted so far
+};
+
+static fileZipCache zcache[ZCACHE_SLOTS];
+static uint32_t zcache_counter = 0;
+static int zcache_init = 0;
+
+static void zcache_name(fileZipCache *zc, char *name)
+{
+	sprintf(name, "/MiSTer_zc%d", (int)(zc - zcache));
+}
+
+static void zcache_drop(fileZipCache *zc)
+{
+	char name[32];
+	zcache_name(zc, name);
+	shm_unlink(name);
+
+	zc->zip_path[0] = 0;
+	zc->ready.store(0);
+	zc->state.store(ZCACHE_FREE);
 }
 
 
@@ -165,6 +800,44 @@ static char* make_fullpath(const char *path, int mode = 0)
 	return full_path;
 }
 
+// Files on network shares are latency bound. They get a large stdio buffer,
+// so the sector sized reads of the loaders don't go to the server one by
+// one, and the kernel is asked to read ahead of the position in big steps.
+// O_DIRECT isn't used there, the page cache is what keeps them local.
+#define NET_BUF_SIZE (256 * 1024)
+#define NET_RA_SIZE  (4 * 1024 * 1024)
+
+static int is_network_fs(int fd)
+{
+	struct statfs fs;
+	if (fstatfs(fd, &fs)) return 0;
+
+	switch ((uint32_t)fs.f_type)
+	{
+	case 0xFF534D42: // CIFS
+	case 0xFE534D42: // SMB2
+	case 0x0000517B: // SMB
+	case 0x00006969: // NFS
+	case 0x65735546: // FUSE
+		return 1;
+	}
+
+	return 0;
+}
+
+static void net_readahead(fileTYPE *file, __off64_t offset, int length)
+{
+	if (!file->net) return;
+
+	// a seek away from the window starts a new one
+	__off64_t end = offset + length;
+	if (offset > file->ra_next || end + 2 * NET_RA_SIZE < file->ra_next) file->ra_next = offset;
+	if (end + NET_RA_SIZE / 2 < file->ra_next) return;
+
+	posix_fadvise(fileno(file->filp), file->ra_next, NET_RA_SIZE, POSIX_FADV_WILLNEED);
+	file->ra_next += NET_RA_SIZE;
+}
+
 static int get_stmode(const char *path)
 {
 	struct stat64 st;
@@ -178,7 +851,80 @@ struct stat64* getPathStat(const char *path)
 	return (stat64(full_path, &st) >= 0) ? &st : NULL;
 }
 
-static int isPathDirectory(const char *path, int use_zip = 1)
+// Results of the path queries, the loaders ask for the same names many times
+// during one load. Entries, negative ones too, live for PATH_CACHE_MS and are
+// dropped by every file_io call which creates or removes files. The savers
+// run on the offload workers, so dropping only bumps a generation.
+#define PATH_CACHE_NUM  64
+#define PATH_CACHE_MS   1000
+
+enum
+{
+	PATH_Q_DIR = 0,
+	PATH_Q_DIR_NOZIP,
+	PATH_Q_FILE,
+	PATH_Q_FILE_NOZIP,
+	PATH_Q_TYPE
+};
+
+struct path_cache_t
+{
+	uint32_t hash;
+	uint32_t gen;
+	unsigned long time;
+	uint32_t query;
+	uint32_t res;
+	char path[256];
+};
+
+static path_cache_t path_cache[PATH_CACHE_NUM];
+static int path_cache_next = 0;
+static std::atomic<uint32_t> path_cache_gen(1);
+
+static uint32_t path_cache_hash(const char *path, uint32_t query)
+{
+	uint32_t hash = 2166136261u ^ query;
+	while (*path) hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	return hash;
+}
+
+static int path_cache_get(const char *path, uint32_t query, uint32_t *res)
+{
+	uint32_t hash = path_cache_hash(path, query);
+	uint32_t gen = path_cache_gen.load(std::memory_order_acquire);
+	for (int i = 0; i < PATH_CACHE_NUM; i++)
+	{
+		path_cache_t *c = &path_cache[i];
+		if (c->hash == hash && c->gen == gen && c->query == query && !CheckTimer(c->time) && !strcmp(c->path, path))
+		{
+			*res = c->res;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void path_cache_put(const char *path, uint32_t query, uint32_t res, uint32_t gen)
+{
+	if (strlen(path) >= sizeof(path_cache[0].path)) return;
+
+	path_cache_t *c = &path_cache[path_cache_next];
+	path_cache_next = (path_cache_next + 1) % PATH_CACHE_NUM;
+
+	c->hash = path_cache_hash(path, query);
+	c->gen = gen;
+	c->time = GetTimer(PATH_CACHE_MS);
+	c->query = query;
+	c->res = res;
+	strcpy(c->path, path);
+}
+
+static void path_cache_drop()
+{
+	path_cache_gen.fetch_add(1, std::memory_order_release);
+}
+
+static int probePathDirectory(const char *path, int use_zip)
 {
 	make_fullpath(path);
 
@@ -190,10 +936,10 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 			return 1;
 		}
 
-		if (!OpenZipfileCached(full_path, 0))
+		if (!OpenZipfileCached(full_path))
 		{
 			printf("isPathDirectory(OpenZipfileCached) Zip:%s, error:%s\n", zip_path,
-				mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
+				mz_zip_get_error_string(last_zip_error));
 			return 0;
 		}
 
@@ -202,20 +948,19 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 		strcat(file_path, "/");
 
 		// Some zip files don't have directory entries
-		// Use the locate_file call to try and find the directory entry first, since
-		// this is a binary search (usually) If that fails then scan for the first
-		// entry that starts with file_path
+		// Use the name index to try and find the directory entry first,
+		// If that fails then scan for the first entry that starts with file_path
 
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
-		if (file_index >= 0 && mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index))
+		const int file_index = zip_cache_locate(last_zip_entry, file_path);
+		if (file_index >= 0 && mz_zip_reader_is_file_a_directory(last_zip_archive, file_index))
 		{
 			return 1;
 		}
 
-		for (size_t i = 0; i < mz_zip_reader_get_num_files(&last_zip_archive); i++)
+		for (size_t i = 0; i < mz_zip_reader_get_num_files(last_zip_archive); i++)
 		{
 			char zip_fname[256];
-			mz_zip_reader_get_filename(&last_zip_archive, i, &zip_fname[0], sizeof(zip_fname));
+			mz_zip_reader_get_filename(last_zip_archive, i, &zip_fname[0], sizeof(zip_fname));
 			if (strcasestr(zip_fname, file_path))
 			{
 				return 1;
@@ -238,7 +983,20 @@ static int isPathDirectory(const char *path, int use_zip = 1)
 	return 0;
 }
 
-static int isPathRegularFile(const char *path, int use_zip = 1)
+static int isPathDirectory(const char *path, int use_zip = 1)
+{
+	char key[256];
+	uint32_t res, query = use_zip ? PATH_Q_DIR : PATH_Q_DIR_NOZIP;
+	snprintf(key, sizeof(key), "%s", make_fullpath(path));
+	if (path_cache_get(key, query, &res)) return res;
+
+	uint32_t gen = path_cache_gen.load(std::memory_order_acquire);
+	res = probePathDirectory(path, use_zip);
+	path_cache_put(key, query, res, gen);
+	return res;
+}
+
+static int probePathRegularFile(const char *path, int use_zip)
 {
 	make_fullpath(path);
 
@@ -250,13 +1008,13 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 		{
 			return 0;
 		}
-		if (!OpenZipfileCached(full_path, 0))
+		if (!OpenZipfileCached(full_path))
 		{
 			//printf("isPathRegularFile(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
 			//       mz_zip_get_error_string(mz_zip_get_last_error(&z)));
 			return 0;
 		}
-		const int file_index = mz_zip_reader_locate_file(&last_zip_archive, file_path, NULL, 0);
+		const int file_index = zip_cache_locate(last_zip_entry, file_path);
 		if (file_index < 0)
 		{
 			//printf("isPathRegularFile(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
@@ -265,7 +1023,7 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 			return 0;
 		}
 
-		if (!mz_zip_reader_is_file_a_directory(&last_zip_archive, file_index) && mz_zip_reader_is_file_supported(&last_zip_archive, file_index))
+		if (!mz_zip_reader_is_file_a_directory(last_zip_archive, file_index) && mz_zip_reader_is_file_supported(last_zip_archive, file_index))
 		{
 			return 1;
 		}
@@ -278,6 +1036,19 @@ static int isPathRegularFile(const char *path, int use_zip = 1)
 	return 0;
 }
 
+static int isPathRegularFile(const char *path, int use_zip = 1)
+{
+	char key[256];
+	uint32_t res, query = use_zip ? PATH_Q_FILE : PATH_Q_FILE_NOZIP;
+	snprintf(key, sizeof(key), "%s", make_fullpath(path));
+	if (path_cache_get(key, query, &res)) return res;
+
+	uint32_t gen = path_cache_gen.load(std::memory_order_acquire);
+	res = probePathRegularFile(path, use_zip);
+	path_cache_put(key, query, res, gen);
+	return res;
+}
+
 void FileClose(fileTYPE *file)
 {
 	if (file->zip)
@@ -286,7 +1057,13 @@ void FileClose(fileTYPE *file)
 		{
 			mz_zip_reader_extract_iter_free(file->zip->iter);
 		}
-		mz_zip_reader_end(&file->zip->archive);
+
+		if (file->zip->cache) file->zip->cache->refs--;
+		else
+		{
+			delete file->zip->seek;
+			mz_zip_reader_end(&file->zip->own);
+		}
 
 		delete file->zip;
 	}
@@ -305,26 +1082,25 @@ void FileClose(fileTYPE *file)
 		}
 	}
 
-	file->zip = nullptr;
-	file->filp = nullptr;
-	file->size = 0;
-}
-
-static int zip_search_by_crc(mz_zip_archive *zipArchive, uint32_t crc32)
-{
-	for (unsigned int file_index = 0; file_index < zipArchive->m_total_files; file_index++)
+	if (file->zcache)
 	{
-		mz_zip_archive_file_stat s;
-		if (mz_zip_reader_file_stat(zipArchive, file_index, &s))
-		{
-			if (s.m_crc32 == crc32)
-			{
-				return file_index;
-			}
-		}
+		fileZipCache *zc = file->zcache;
+		if (!--zc->refs && zc->state.load() == ZCACHE_FAILED) zcache_drop(zc);
 	}
 
-	return -1;
+	if (file->zst) zst_free(file->zst);
+	if (file->dfd > 0) close(file->dfd);
+	if (file->oneshot && file->filp) posix_fadvise(fileno(file->filp), 0, 0, POSIX_FADV_DONTNEED);
+
+	file->zip = nullptr;
+	file->zcache = nullptr;
+	file->zst = nullptr;
+	file->dfd = 0;
+	file->net = 0;
+	file->ra_next = 0;
+	file->oneshot = 0;
+	file->filp = nullptr;
+	file->size = 0;
 }
 
 int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
@@ -344,47 +1120,61 @@ int FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32)
 		return 0;
 	}
 
-	file->zip = new fileZipArchive{};
-	if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+	if (!zip_attach(file, zip_path))
 	{
-		printf("FileOpenZip(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+		printf("FileOpenZip(zip_attach) Zip:%s, error:%s\n", zip_path, mz_zip_get_error_string(last_zip_error));
 		return 0;
 	}
 
 	file->zip->index = -1;
-	if (crc32) file->zip->index = zip_search_by_crc(&file->zip->archive, crc32);
-	if (file->zip->index < 0) file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
+	if (crc32)
+	{
+		if (file->zip->cache) file->zip->index = zip_cache_find_crc(file->zip->cache, crc32);
+		else
+		{
+			for (unsigned int i = 0; i < file->zip->own.m_total_files; i++)
+			{
+				mz_zip_archive_file_stat s;
+				if (mz_zip_reader_file_stat(&file->zip->own, i, &s) && s.m_crc32 == crc32)
+				{
+					file->zip->index = i;
+					break;
+				}
+			}
+		}
+	}
+	if (file->zip->index < 0) file->zip->index = zip_locate(file, file_path);
 	if (file->zip->index < 0)
 	{
 		printf("FileOpenZip(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 
 	mz_zip_archive_file_stat s;
-	if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+	if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
 	{
 		printf("FileOpenZip(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 	file->size = s.m_uncomp_size;
 
-	file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+	file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
 	if (!file->zip->iter)
 	{
 		printf("FileOpenZip(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
 					zip_path, file_path,
-					mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 		FileClose(file);
 		return 0;
 	}
 
+	zip_attach_seek_index(file);
 	file->zip->offset = 0;
 	file->offset = 0;
 	file->mode = O_RDONLY;
@@ -411,50 +1201,50 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 			return 0;
 		}
 
-		file->zip = new fileZipArchive{};
-		if (!mz_zip_reader_init_file(&file->zip->archive, zip_path, 0))
+		if (!zip_attach(file, zip_path))
 		{
-			if(!mute) printf("FileOpenEx(mz_zip_reader_init_file) Zip:%s, error:%s\n", zip_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+			if(!mute) printf("FileOpenEx(zip_attach) Zip:%s, error:%s\n", zip_path, mz_zip_get_error_string(last_zip_error));
 			return 0;
 		}
 
-		file->zip->index = mz_zip_reader_locate_file(&file->zip->archive, file_path, NULL, 0);
+		file->zip->index = zip_locate(file, file_path);
 		if (file->zip->index < 0)
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_locate_file) Zip:%s, file:%s, error: %s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 
 		mz_zip_archive_file_stat s;
-		if (!mz_zip_reader_file_stat(&file->zip->archive, file->zip->index, &s))
+		if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s))
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_file_stat) Zip:%s, file:%s, error:%s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
 		file->size = s.m_uncomp_size;
 
-		file->zip->iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+		file->zip->iter = mz_zip_reader_extract_iter_new(file->zip->archive, file->zip->index, 0);
 		if (!file->zip->iter)
 		{
 			if(!mute) printf("FileOpenEx(mz_zip_reader_extract_iter_new) Zip:%s, file:%s, error:%s\n",
 					 zip_path, file_path,
-					 mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+					 mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			FileClose(file);
 			return 0;
 		}
+		zip_attach_seek_index(file);
 		file->zip->offset = 0;
 		file->offset = 0;
 		file->mode = mode;
 	}
 	else
 	{
+		if (mode & O_CREAT) path_cache_drop();
 		int fd = (mode == -1) ? shm_open("/vdsk", O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0777) : open(full_path, mode | O_CLOEXEC, 0777);
 		if (fd <= 0)
 		{
@@ -470,6 +1260,14 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 			return 0;
 		}
 
+		if (mode != -1 && is_network_fs(fd))
+		{
+			file->net = 1;
+			file->dfd = -1;
+			setvbuf(file->filp, nullptr, _IOFBF, NET_BUF_SIZE);
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+
 		if (mode == -1)
 		{
 			file->type = 1;
@@ -504,6 +1302,23 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 
 			file->offset = 0;
 			file->mode = mode;
+
+			// seekable zstd images only read through the frames
+			int len = strlen(full_path);
+			if (mode == O_RDONLY && len > 4 && !strcasecmp(full_path + len - 4, ".zst"))
+			{
+				int zfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+				file->zst = (zfd >= 0) ? zst_open(zfd, file->size) : nullptr;
+				if (file->zst)
+				{
+					fclose(file->filp);
+					file->filp = nullptr;
+					file->net = 0;
+					file->dfd = 0;
+					file->size = file->zst->frame[file->zst->frames].dpos;
+				}
+				else if (zfd >= 0) close(zfd);
+			}
 		}
 	}
 
@@ -511,6 +1326,248 @@ int FileOpenEx(fileTYPE *file, const char *name, int mode, char mute, int use_zi
 	return 1;
 }
 
+static void zcache_extract(fileZipCache *zc)
+{
+	uint8_t *buf = (uint8_t*)malloc(ZCACHE_CHUNK);
+	mz_zip_reader_extract_iter_state *iter = nullptr;
+	uint64_t pos = 0;
+
+	mz_zip_archive z;
+	mz_zip_zero_struct(&z);
+	if (buf && mz_zip_reader_init_file(&z, zc->zip_path, 0))
+	{
+		int index = mz_zip_reader_locate_file(&z, zc->member, NULL, 0);
+		if (index >= 0) iter = mz_zip_reader_extract_iter_new(&z, index, 0);
+	}
+
+	if (iter)
+	{
+		while (pos < (uint64_t)zc->size && !zc->cancel.load(std::memory_order_relaxed))
+		{
+			size_t len = mz_zip_reader_extract_iter_read(iter, buf, ZCACHE_CHUNK);
+			if (!len || pwrite64(zc->fd, buf, len, pos) != (ssize_t)len) break;
+
+			pos += len;
+			zc->ready.store(pos, std::memory_order_release);
+		}
+		mz_zip_reader_extract_iter_free(iter);
+	}
+
+	mz_zip_reader_end(&z);
+	free(buf);
+	close(zc->fd);
+	zc->fd = -1;
+
+	int ok = (pos == (uint64_t)zc->size);
+	if (!ok && !zc->cancel.load()) printf("FileZipCache: failed to extract %s from %s.\n", zc->member, zc->zip_path);
+	zc->state.store(ok ? ZCACHE_DONE : ZCACHE_FAILED, std::memory_order_release);
+}
+
+static int zcache_wait(fileTYPE *file, __off64_t end)
+{
+	fileZipCache *zc = file->zcache;
+	if (end > zc->size) end = zc->size;
+
+	while (1)
+	{
+		if ((__off64_t)zc->ready.load(std::memory_order_acquire) >= end) return 1;
+		if (zc->state.load(std::memory_order_acquire) != ZCACHE_EXTRACTING)
+		{
+			return (__off64_t)zc->ready.load(std::memory_order_acquire) >= end;
+		}
+		sched_yield();
+	}
+}
+
+// free unused extractions in LRU order until size fits into the budget
+static int zcache_reserve(__off64_t size)
+{
+	uint64_t budget = cfg.zip_cache_mb * 1024ULL * 1024ULL;
+	if ((uint64_t)size > budget) return 0;
+
+	while (1)
+	{
+		uint64_t used = 0;
+		fileZipCache *victim = nullptr;
+		for (int i = 0; i < ZCACHE_SLOTS; i++)
+		{
+			fileZipCache *zc = &zcache[i];
+			int state = zc->state.load();
+			if (state == ZCACHE_FREE) continue;
+
+			used += zc->size;
+			if (zc->refs || state == ZCACHE_EXTRACTING) continue;
+			if (!victim || zc->last_use < victim->last_use) victim = zc;
+		}
+
+		if (used + size <= budget) return 1;
+		if (!victim) return 0;
+		zcache_drop(victim);
+	}
+}
+
+static fileZipCache *zcache_start(const char *zip_path, const char *member, struct stat64 *st, __off64_t size, uint32_t crc)
+{
+	if (!zcache_reserve(size)) return nullptr;
+
+	fileZipCache *zc = nullptr;
+	for (int i = 0; i < ZCACHE_SLOTS; i++)
+	{
+		fileZipCache *cur = &zcache[i];
+		int state = cur->state.load();
+		if (state == ZCACHE_FREE)
+		{
+			zc = cur;
+			break;
+		}
+
+		if (cur->refs || state == ZCACHE_EXTRACTING) continue;
+		if (!zc || cur->last_use < zc->last_use) zc = cur;
+	}
+
+	if (!zc) return nullptr;
+	if (zc->state.load() != ZCACHE_FREE) zcache_drop(zc);
+
+	char name[32];
+	zcache_name(zc, name);
+	zc->fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+	if (zc->fd < 0) return nullptr;
+
+	if (ftruncate64(zc->fd, size) < 0)
+	{
+		close(zc->fd);
+		shm_unlink(name);
+		return nullptr;
+	}
+
+	strncpy(zc->zip_path, zip_path, sizeof(zc->zip_path) - 1);
+	strncpy(zc->member, member, sizeof(zc->member) - 1);
+	zc->mtime = st->st_mtime;
+	zc->fsize = st->st_size;
+	zc->size = size;
+	zc->crc = crc;
+	zc->ready.store(0);
+	zc->cancel.store(0);
+	zc->state.store(ZCACHE_EXTRACTING);
+
+	if (!offload_try_work([zc]() { zcache_extract(zc); }, OFFLOAD_DECOMPRESS))
+	{
+		close(zc->fd);
+		zc->fd = -1;
+		zcache_drop(zc);
+		return nullptr;
+	}
+
+	printf("FileZipCache: extracting %s (%llu bytes) in background.\n", member, (uint64_t)size);
+	return zc;
+}
+
+int FileOpenZipCache(fileTYPE *file, const char *name)
+{
+	if (!cfg.zip_cache_mb) return 0;
+
+	if (!zcache_init)
+	{
+		// drop leftovers of the previous run
+		for (int i = 0; i < ZCACHE_SLOTS; i++) zcache_drop(&zcache[i]);
+		zcache_init = 1;
+	}
+
+	make_fullpath(name);
+
+	char *p = strrchr(full_path, '/');
+	char fname[sizeof(file->name)];
+	snprintf(fname, sizeof(fname), "%s", p ? p + 1 : full_path);
+
+	char *zip_path, *file_path;
+	if (!FileIsZipped(full_path, &zip_path, &file_path) || !*file_path) return 0;
+
+	struct stat64 st;
+	if (stat64(zip_path, &st) < 0) return 0;
+
+	fileZipCache *zc = nullptr;
+	for (int i = 0; i < ZCACHE_SLOTS; i++)
+	{
+		fileZipCache *cur = &zcache[i];
+		int state = cur->state.load();
+		if (state == ZCACHE_FREE || !cur->zip_path[0]) continue;
+		if (strcmp(cur->zip_path, zip_path) || strcasecmp(cur->member, file_path)) continue;
+
+		if (state != ZCACHE_FAILED && cur->mtime == st.st_mtime && cur->fsize == st.st_size)
+		{
+			zc = cur;
+			break;
+		}
+
+		if (!cur->refs && state != ZCACHE_EXTRACTING) zcache_drop(cur);
+	}
+
+	if (!zc)
+	{
+		ZipCacheEntry *entry = zip_cache_open(zip_path, 0);
+		if (!entry) return 0;
+
+		// stored members seek directly, only compressed ones are worth the RAM
+		mz_zip_archive_file_stat s;
+		int index = zip_cache_locate(entry, file_path);
+		if (index < 0 || !mz_zip_reader_file_stat(&entry->archive, index, &s) || s.m_is_directory || !s.m_method) return 0;
+
+		zc = zcache_start(zip_path, s.m_filename, &st, s.m_uncomp_size, s.m_crc32);
+		if (!zc) return 0;
+	}
+
+	char shm[32];
+	zcache_name(zc, shm);
+	int fd = shm_open(shm, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) return 0;
+
+	FileClose(file);
+	file->filp = fdopen(fd, "r");
+	if (!file->filp)
+	{
+		close(fd);
+		return 0;
+	}
+
+	// the file is sparse until extracted, stdio must not buffer ahead of it
+	setvbuf(file->filp, NULL, _IONBF, 0);
+
+	zc->refs++;
+	zc->last_use = ++zcache_counter;
+
+	strcpy(file->name, fname);
+	file->zcache = zc;
+	file->type = 0;
+	file->size = zc->size;
+	file->offset = 0;
+	file->mode = O_RDONLY;
+	return 1;
+}
+
+uint32_t FileZipCRC(fileTYPE *file)
+{
+	if (file->zcache) return file->zcache->crc;
+	if (!file->zip || file->zip->index < 0) return 0;
+
+	mz_zip_archive_file_stat s;
+	if (!mz_zip_reader_file_stat(file->zip->archive, file->zip->index, &s)) return 0;
+	return s.m_crc32;
+}
+
+void FileZipCacheFlush()
+{
+	for (int i = 0; i < ZCACHE_SLOTS; i++)
+	{
+		fileZipCache *zc = &zcache[i];
+		if (zc->state.load() == ZCACHE_FREE) continue;
+
+		zc->cancel.store(1);
+		char name[32];
+		zcache_name(zc, name);
+		shm_unlink(name);
+	}
+}
+
 __off64_t FileGetSize(fileTYPE *file)
 {
 	if (file->filp)
@@ -528,7 +1585,7 @@ __off64_t FileGetSize(fileTYPE *file)
 
 		return st.st_size;
 	}
-	else if (file->zip)
+	else if (file->zip || file->zst)
 	{
 		return file->size;
 	}
@@ -552,6 +1609,12 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 		}
 		offset = ftello64(file->filp);
 	}
+	else if (file->zst)
+	{
+		if (origin == SEEK_CUR) offset += file->offset;
+		else if (origin == SEEK_END) offset = file->size - offset;
+		if (offset < 0 || offset > file->size) return 0;
+	}
 	else if (file->zip)
 	{
 		if (origin == SEEK_CUR)
@@ -563,19 +1626,19 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			offset = file->size - offset;
 		}
 
-		if (offset < file->zip->offset)
+		if (offset < file->zip->offset || zip_can_skip(file, offset))
 		{
-			mz_zip_reader_extract_iter_state *iter = mz_zip_reader_extract_iter_new(&file->zip->archive, file->zip->index, 0);
+			mz_zip_reader_extract_iter_state *iter = zip_iter_new(file, offset);
 			if (!iter)
 			{
 				printf("FileSeek(mz_zip_reader_extract_iter_new) Failed to rewind iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+				       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 				return 0;
 			}
 
 			mz_zip_reader_extract_iter_free(file->zip->iter);
 			file->zip->iter = iter;
-			file->zip->offset = 0;
+			file->zip->offset = iter->out_buf_ofs;
 		}
 
 		static char buf[4*1024];
@@ -584,10 +1647,11 @@ int FileSeek(fileTYPE *file, __off64_t offset, int origin)
 			const size_t want_len = MIN((__off64_t)sizeof(buf), offset - file->zip->offset);
 			const size_t read_len = mz_zip_reader_extract_iter_read(file->zip->iter, buf, want_len);
 			file->zip->offset += read_len;
+			zip_checkpoint(file);
 			if (read_len < want_len)
 			{
 				printf("FileSeek(mz_zip_reader_extract_iter_read) Failed to advance iterator, error:%s\n",
-				       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+				       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 				return 0;
 			}
 		}
@@ -609,12 +1673,39 @@ int FileSeekLBA(fileTYPE *file, uint32_t offset)
 }
 
 // Read with offset advancing
+void FileAdvise(fileTYPE *file, int advice, __off64_t offset, __off64_t len)
+{
+	// extracted zips are in tmpfs already
+	if (!file->filp || file->zcache || file->type) return;
+
+	int fd = fileno(file->filp);
+	switch (advice)
+	{
+	case FILE_ADV_NORMAL:     posix_fadvise(fd, 0, 0, POSIX_FADV_NORMAL); break;
+	case FILE_ADV_SEQUENTIAL: posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL); break;
+	case FILE_ADV_RANDOM:     posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM); break;
+	case FILE_ADV_WILLNEED:   posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED); break;
+	case FILE_ADV_DONTNEED:   posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED); break;
+	case FILE_ADV_ONESHOT:
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		file->oneshot = 1;
+		break;
+	}
+}
+
 int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
 {
 	ssize_t ret = 0;
 
 	if (file->filp)
 	{
+		if (file->zcache && !zcache_wait(file, file->offset + length))
+		{
+			printf("FileReadAdv error(image extraction failed).\n");
+			return failres;
+		}
+
+		net_readahead(file, file->offset, length);
 		ret = fread(pBuffer, 1, length, file->filp);
 		if (ret < 0)
 		{
@@ -628,24 +1719,124 @@ int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres)
 		if (!ret)
 		{
 			printf("FileReadEx(mz_zip_reader_extract_iter_read) Failed to read, error:%s\n",
-			       mz_zip_get_error_string(mz_zip_get_last_error(&file->zip->archive)));
+			       mz_zip_get_error_string(mz_zip_get_last_error(file->zip->archive)));
 			return failres;
 		}
 		file->zip->offset += ret;
+		zip_checkpoint(file);
+	}
+	else if (file->zst)
+	{
+		ret = zst_read(file, file->offset, pBuffer, length);
+	}
+	else
+	{
+		printf("FileReadAdv error(unknown file type).\n");
+		return failres;
+	}
+
+	file->offset += ret;
+	return ret;
+}
+
+int FileReadSec(fileTYPE *file, void *pBuffer)
+{
+	return FileReadAdv(file, pBuffer, 512);
+}
+
+// Read with offset advancing, straight into the destination without
+// the stdio buffer copy. Zipped files fall back to FileReadAdv.
+int FileReadDirect(fileTYPE *file, void *pBuffer, int length, int failres)
+{
+	if (!file->filp) return FileReadAdv(file, pBuffer, length, failres);
+
+	int ret = FileReadAt(file, file->offset, pBuffer, length, -1);
+	if (ret < 0) return failres;
+
+	// keep the stdio position in sync for the following stdio reads
+	file->offset += ret;
+	fseeko64(file->filp, file->offset, SEEK_SET);
+	return ret;
+}
+
+int FileReadAt(fileTYPE *file, __off64_t offset, void *pBuffer, int length, int failres)
+{
+	if (!file->filp)
+	{
+		if (file->zst) return zst_read(file, offset, pBuffer, length);
+		if (!file->zip || !FileSeek(file, offset, SEEK_SET)) return failres;
+		return FileReadAdv(file, pBuffer, length, failres);
+	}
+
+	if (file->zcache && !zcache_wait(file, offset + length))
+	{
+		printf("FileReadAt error(image extraction failed).\n");
+		return failres;
+	}
+
+	net_readahead(file, offset, length);
+	ssize_t ret = pread64(fileno(file->filp), pBuffer, length, offset);
+	if (ret < 0)
+	{
+		printf("FileReadAt error(%d).\n", errno);
+		return failres;
+	}
+
+	return ret;
+}
+
+#define DIRECT_ALIGN 4096
+
+int FileReadAtDirect(fileTYPE *file, __off64_t offset, void *pBuffer, int length, int failres)
+{
+	int aligned = !(((uintptr_t)pBuffer | (uintptr_t)offset | (uintptr_t)length) & (DIRECT_ALIGN - 1));
+	if (!aligned || !file->filp || file->zcache || file->dfd < 0) return FileReadAt(file, offset, pBuffer, length, failres);
+
+	if (!file->dfd)
+	{
+		// second descriptor, O_DIRECT would break unaligned access through the stdio one
+		char path[32];
+		sprintf(path, "/proc/self/fd/%d", fileno(file->filp));
+		file->dfd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+		if (file->dfd <= 0)
+		{
+			file->dfd = -1;
+			return FileReadAt(file, offset, pBuffer, length, failres);
+		}
 	}
-	else
+
+	ssize_t ret = pread64(file->dfd, pBuffer, length, offset);
+	if (ret < 0)
 	{
-		printf("FileReadAdv error(unknown file type).\n");
-		return failres;
+		// the file system doesn't support it after all
+		close(file->dfd);
+		file->dfd = -1;
+		return FileReadAt(file, offset, pBuffer, length, failres);
 	}
 
-	file->offset += ret;
 	return ret;
 }
 
-int FileReadSec(fileTYPE *file, void *pBuffer)
+int FileWriteAt(fileTYPE *file, __off64_t offset, const void *pBuffer, int length, int failres)
 {
-	return FileReadAdv(file, pBuffer, 512);
+	if (!file->filp)
+	{
+		printf("FileWriteAt error(not supported for this file type).\n");
+		return failres;
+	}
+
+	ssize_t ret = pwrite64(fileno(file->filp), pBuffer, length, offset);
+	if (ret < 0)
+	{
+		printf("FileWriteAt error(%d).\n", errno);
+		return failres;
+	}
+
+	// drop stdio read-ahead which may hold the old data
+	if (__freading(file->filp)) fflush(file->filp);
+
+	if (offset + ret > file->size) file->size = offset + ret;
+	return ret;
 }
 
 // Write with offset advancing
@@ -685,9 +1876,142 @@ int FileWriteSec(fileTYPE *file, void *pBuffer)
 	return FileWriteAdv(file, pBuffer, 512);
 }
 
+#define RSTREAM_BUFS  4 // must be pow2
+
+struct fileReadStream
+{
+	fileTYPE *file;
+	uint32_t chunk_size;
+	uint32_t to_read;  // worker side
+	uint32_t to_get;   // consumer side
+	__off64_t read_pos;
+	__off64_t get_pos;
+	uint8_t *buf[RSTREAM_BUFS];
+	uint32_t len[RSTREAM_BUFS];
+	uint32_t get_idx;
+	int held;
+	sem_t filled;
+	sem_t empty;
+	std::atomic<bool> cancel;
+	offload_job_t job;
+};
+
+static void read_stream_worker(fileReadStream *stream)
+{
+	for (uint32_t idx = 0; stream->to_read; idx++)
+	{
+		while (sem_wait(&stream->empty) && errno == EINTR);
+		if (stream->cancel.load()) break;
+
+		uint32_t n = idx % RSTREAM_BUFS;
+		uint32_t chunk = (stream->to_read > stream->chunk_size) ? stream->chunk_size : stream->to_read;
+		int ret = FileReadAtDirect(stream->file, stream->read_pos, stream->buf[n], chunk);
+		if (ret <= 0)
+		{
+			stream->len[n] = 0;
+			sem_post(&stream->filled);
+			break;
+		}
+
+		stream->len[n] = ret;
+		stream->to_read -= ret;
+		stream->read_pos += ret;
+		sem_post(&stream->filled);
+	}
+}
+
+fileReadStream *FileReadStreamStart(fileTYPE *file, uint32_t size, uint32_t chunk_size)
+{
+	fileReadStream *stream = new fileReadStream{};
+	stream->file = file;
+	stream->chunk_size = chunk_size;
+	stream->to_read = size;
+	stream->to_get = size;
+	stream->read_pos = file->offset;
+	stream->get_pos = file->offset;
+
+	for (int i = 0; i < RSTREAM_BUFS; i++)
+	{
+		// page aligned, so the reads can go through O_DIRECT
+		if (posix_memalign((void**)&stream->buf[i], 4096, chunk_size)) stream->buf[i] = nullptr;
+		if (!stream->buf[i])
+		{
+			printf("FileReadStreamStart: couldn't allocate buffers.\n");
+			for (int n = 0; n < i; n++) free(stream->buf[n]);
+			delete stream;
+			return nullptr;
+		}
+	}
+
+	sem_init(&stream->filled, 0, 0);
+	sem_init(&stream->empty, 0, RSTREAM_BUFS);
+
+	// Without a free worker the stream simply reads synchronously in FileReadStreamNext.
+	stream->job = offload_try_work([stream] { read_stream_worker(stream); }, OFFLOAD_IO);
+	return stream;
+}
+
+uint32_t FileReadStreamNext(fileReadStream *stream, uint8_t **data)
+{
+	if (stream->held)
+	{
+		stream->held = 0;
+		stream->get_idx++;
+		if (stream->job) sem_post(&stream->empty);
+	}
+
+	if (!stream->to_get) return 0;
+
+	uint32_t n = stream->get_idx % RSTREAM_BUFS;
+	if (stream->job)
+	{
+		while (sem_wait(&stream->filled) && errno == EINTR);
+	}
+	else
+	{
+		uint32_t chunk = (stream->to_get > stream->chunk_size) ? stream->chunk_size : stream->to_get;
+		int ret = FileReadAtDirect(stream->file, stream->get_pos, stream->buf[n], chunk);
+		stream->len[n] = (ret > 0) ? ret : 0;
+	}
+
+	uint32_t len = stream->len[n];
+	if (!len)
+	{
+		stream->to_get = 0;
+		return 0;
+	}
+
+	stream->to_get -= len;
+	stream->get_pos += len;
+	stream->held = 1;
+	*data = stream->buf[n];
+	return len;
+}
+
+void FileReadStreamEnd(fileReadStream *stream)
+{
+	if (!stream) return;
+
+	if (stream->job)
+	{
+		stream->cancel.store(true);
+		sem_post(&stream->empty);
+		offload_wait(stream->job);
+	}
+
+	// positional reads don't move plain files, continue after the consumed data
+	if (stream->file->filp) FileSeek(stream->file, stream->get_pos, SEEK_SET);
+
+	sem_destroy(&stream->filled);
+	sem_destroy(&stream->empty);
+	for (int i = 0; i < RSTREAM_BUFS; i++) free(stream->buf[i]);
+	delete stream;
+}
+
 int FileSave(const char *name, void *pBuffer, int size)
 {
 	make_fullpath(name);
+	path_cache_drop();
 
 	int fd = open(full_path, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, S_IRWXU | S_IRWXG | S_IRWXO);
 	if (fd < 0)
@@ -708,8 +2032,124 @@ int FileSave(const char *name, void *pBuffer, int size)
 	return ret;
 }
 
+struct save_job_t
+{
+	char path[1024];
+	int size;
+};
+
+static void save_write(save_job_t *job)
+{
+	char tmp[1030];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", job->path);
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC | O_CLOEXEC, S_IRWXU | S_IRWXG | S_IRWXO);
+	if (fd < 0)
+	{
+		printf("FileSave(open) File:%s, error: %d.\n", tmp, fd);
+		return;
+	}
+
+	int ret = write(fd, job + 1, job->size);
+	close(fd);
+
+	if (ret != job->size || rename(tmp, job->path))
+	{
+		printf("FileSave(write) File:%s, error: %d.\n", job->path, ret);
+		unlink(tmp);
+	}
+	path_cache_drop();
+}
+
+uint32_t FileSaveAsync(const char *name, const void *pBuffer, int size)
+{
+	make_fullpath(name);
+
+	save_job_t *job = (save_job_t*)malloc(sizeof(save_job_t) + size);
+	if (!job)
+	{
+		FileSave(name, (void*)pBuffer, size);
+		return 0;
+	}
+
+	snprintf(job->path, sizeof(job->path), "%s", full_path);
+	job->size = size;
+	memcpy(job + 1, pBuffer, size);
+
+	return offload_add_work([job]()
+		{
+			save_write(job);
+			free(job);
+		}, OFFLOAD_IO);
+}
+
+// keeps the most recent ones only
+static void cache_evict(const char *dir, int limit)
+{
+	DIR *d = opendir(dir);
+	if (!d) return;
+
+	char oldest[1024] = {};
+	time_t oldest_time = 0;
+	int files = 0;
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_name[0] == '.') continue;
+
+		char name[1024];
+		struct stat st;
+		snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
+		if (stat(name, &st)) continue;
+
+		files++;
+		if (!oldest[0] || st.st_mtime < oldest_time)
+		{
+			snprintf(oldest, sizeof(oldest), "%s", name);
+			oldest_time = st.st_mtime;
+		}
+	}
+	closedir(d);
+
+	if (files >= limit) unlink(oldest);
+}
+
+int cache_writev(const char *dir, const char *name, const struct iovec *iov, int cnt, int limit)
+{
+	mkdir(dir, 0755);
+	if (limit) cache_evict(dir, limit);
+
+	// per thread temporary names, two workers may store the same file
+	char path[1024], tmp_name[1024];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	snprintf(tmp_name, sizeof(tmp_name), "%s/.%s.%ld", dir, name, (long)syscall(SYS_gettid));
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return 0;
+
+	ssize_t size = 0;
+	for (int i = 0; i < cnt; i++) size += iov[i].iov_len;
+
+	int ok = writev(fd, iov, cnt) == size;
+	close(fd);
+	if (!ok || rename(tmp_name, path))
+	{
+		unlink(tmp_name);
+		return 0;
+	}
+	return 1;
+}
+
+int cache_write(const char *dir, const char *name, const void *data, size_t size, int limit)
+{
+	struct iovec iov = { (void*)data, size };
+	return cache_writev(dir, name, &iov, 1, limit);
+}
+
 int FileDelete(const char *name)
 {
+	path_cache_drop();
 	make_fullpath(name);
 	printf("delete %s\n", full_path);
 	return !unlink(full_path);
@@ -717,6 +2157,7 @@ int FileDelete(const char *name)
 
 int DirDelete(const char *name)
 {
+	path_cache_drop();
 	make_fullpath(name);
 	printf("rmdir %s\n", full_path);
 	return !rmdir(full_path);
@@ -752,16 +2193,42 @@ int FileLoad(const char *name, void *pBuffer, int size)
 	return ret;
 }
 
-int FileLoadConfig(const char *name, void *pBuffer, int size)
+// Config files saved with FileSaveConfigLater() wait here until no newer
+// value came for CFG_SAVE_DELAY ms, then go to a worker. Loads take the
+// pending value, so the file is never read behind a newer one.
+#define CFG_SAVE_SLOTS 16
+#define CFG_SAVE_DELAY 500
+
+struct cfg_save_t
 {
-	char path[256] = { CONFIG_DIR"/" };
-	strcat(path, name);
-	return FileLoad(path, pBuffer, size);
+	char name[256];
+	void *data;
+	int size;
+	unsigned long timer;
+	uint32_t job;
+};
+
+static cfg_save_t cfg_saves[CFG_SAVE_SLOTS] = {};
+
+static cfg_save_t *cfg_save_find(const char *name)
+{
+	for (int i = 0; i < CFG_SAVE_SLOTS; i++)
+	{
+		if (cfg_saves[i].name[0] && !strcmp(cfg_saves[i].name, name)) return &cfg_saves[i];
+	}
+	return NULL;
 }
 
-int FileSaveConfig(const char *name, void *pBuffer, int size)
+static void cfg_save_release(cfg_save_t *s)
+{
+	offload_wait(s->job);
+	free(s->data);
+	memset(s, 0, sizeof(*s));
+}
+
+static void config_path(const char *name, char *path)
 {
-	char path[256] = { CONFIG_DIR };
+	strcpy(path, CONFIG_DIR);
 	const char *p;
 	while ((p = strchr(name, '/')))
 	{
@@ -773,11 +2240,120 @@ int FileSaveConfig(const char *name, void *pBuffer, int size)
 
 	strcat(path, "/");
 	strcat(path, name);
+}
+
+static void cfg_save_start(cfg_save_t *s)
+{
+	char path[256];
+	config_path(s->name, path);
+	s->timer = 0;
+	s->job = FileSaveAsync(path, s->data, s->size);
+}
+
+int FileLoadConfig(const char *name, void *pBuffer, int size)
+{
+	cfg_save_t *s = cfg_save_find(name);
+	if (s)
+	{
+		if (!pBuffer) return s->size;
+		if (!size || size > s->size) size = s->size;
+		memcpy(pBuffer, s->data, size);
+		return size;
+	}
+
+	char path[256] = { CONFIG_DIR"/" };
+	strcat(path, name);
+	return FileLoad(path, pBuffer, size);
+}
+
+int FileSaveConfig(const char *name, void *pBuffer, int size)
+{
+	cfg_save_t *s = cfg_save_find(name);
+	if (s) cfg_save_release(s);
+
+	char path[256];
+	config_path(name, path);
 	return FileSave(path, pBuffer, size);
 }
 
+int FileSaveConfigLater(const char *name, const void *pBuffer, int size)
+{
+	if (strlen(name) >= sizeof(cfg_saves[0].name)) return FileSaveConfig(name, (void*)pBuffer, size);
+
+	// a write already on its way is finished first, the new value makes another one
+	cfg_save_t *s = cfg_save_find(name);
+	if (s && !s->timer)
+	{
+		cfg_save_release(s);
+		s = NULL;
+	}
+
+	if (!s)
+	{
+		for (int i = 0; i < CFG_SAVE_SLOTS && !s; i++) if (!cfg_saves[i].name[0]) s = &cfg_saves[i];
+		if (!s)
+		{
+			// all taken, the oldest one goes out now
+			s = &cfg_saves[0];
+			for (int i = 1; i < CFG_SAVE_SLOTS && s->timer; i++)
+			{
+				if (!cfg_saves[i].timer || cfg_saves[i].timer < s->timer) s = &cfg_saves[i];
+			}
+			if (s->timer) cfg_save_start(s);
+			cfg_save_release(s);
+		}
+		snprintf(s->name, sizeof(s->name), "%s", name);
+	}
+
+	void *data = realloc(s->data, size);
+	if (!data)
+	{
+		cfg_save_release(s);
+		return FileSaveConfig(name, (void*)pBuffer, size);
+	}
+
+	memcpy(data, pBuffer, size);
+	s->data = data;
+	s->size = size;
+	s->timer = GetTimer(CFG_SAVE_DELAY);
+	return size;
+}
+
+void FileSaveConfigPoll()
+{
+	for (int i = 0; i < CFG_SAVE_SLOTS; i++)
+	{
+		cfg_save_t *s = &cfg_saves[i];
+		if (!s->name[0]) continue;
+
+		if (s->timer)
+		{
+			if (CheckTimer(s->timer)) cfg_save_start(s);
+		}
+		else if (offload_job_done(s->job))
+		{
+			cfg_save_release(s);
+		}
+	}
+}
+
+void FileSaveConfigFlush()
+{
+	for (int i = 0; i < CFG_SAVE_SLOTS; i++)
+	{
+		cfg_save_t *s = &cfg_saves[i];
+		if (!s->name[0]) continue;
+
+		if (s->timer) cfg_save_start(s);
+		cfg_save_release(s);
+	}
+}
+
 int FileDeleteConfig(const char *name)
 {
+	cfg_save_t *s = cfg_save_find(name);
+	if (s) cfg_save_release(s);
+
 	char path[256] = { CONFIG_DIR"/" };
 	strcat(path, name);
 	return FileDelete(path);
@@ -816,6 +2392,7 @@ int FileCanWrite(const char *name)
 
 void create_path(const char *base_dir, const char* sub_dir)
 {
+	path_cache_drop();
 	make_fullpath(base_dir);
 	mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
 	strcat(full_path, "/");
@@ -829,6 +2406,7 @@ int FileCreatePath(const char *dir)
 	if (!isPathDirectory(dir)) {
 		make_fullpath(dir);
 		res = !mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
+		path_cache_drop();
 	}
 	return res;
 }
@@ -930,13 +2508,17 @@ uint32_t getFileType(const char *name)
 {
 	make_fullpath(name);
 
-	struct stat64 st;
-	if (stat64(full_path, &st)) return 0;
+	uint32_t res;
+	if (path_cache_get(full_path, PATH_Q_TYPE, &res)) return res;
 
-	return st.st_mode;
+	uint32_t gen = path_cache_gen.load(std::memory_order_acquire);
+	struct stat64 st;
+	res = stat64(full_path, &st) ? 0 : st.st_mode;
+	path_cache_put(full_path, PATH_Q_TYPE, res, gen);
+	return res;
 }
 
-int findPrefixDir(char *dir, size_t dir_len)
+static int probePrefixDir(char *dir, size_t dir_len, int sd_only)
 {
 	// Searches for the core's folder in the following order:
 	// /media/usb<0..5>
@@ -952,7 +2534,7 @@ int findPrefixDir(char *dir, size_t dir_len)
 	static char temp_dir[1024];
 
 	// Usb<0..5>
-	for (int x = 0; x < 6; x++) {
+	for (int x = 0; x < 6 && !sd_only; x++) {
 		snprintf(temp_dir, 1024, "%s%d/%s", "../usb", x, dir);
 		if (isPathDirectory(temp_dir)) {
 			printf("Found USB dir: %s\n", temp_dir);
@@ -970,7 +2552,7 @@ int findPrefixDir(char *dir, size_t dir_len)
 
 	// Network share in /media/network/
 	snprintf(temp_dir, 1024, "%s/%s", "../network", dir);
-	if (isPathDirectory(temp_dir)) {
+	if (!sd_only && isPathDirectory(temp_dir)) {
 		printf("Found network dir: %s\n", temp_dir);
 		strncpy(dir, temp_dir, dir_len);
 		return 1;
@@ -978,7 +2560,7 @@ int findPrefixDir(char *dir, size_t dir_len)
 
 	// Network share in /media/network/games
 	snprintf(temp_dir, 1024, "%s/%s/%s", "../network", GAMES_DIR, dir);
-	if (isPathDirectory(temp_dir)) {
+	if (!sd_only && isPathDirectory(temp_dir)) {
 		printf("Found network dir: %s\n", temp_dir);
 		strncpy(dir, temp_dir, dir_len);
 		return 1;
@@ -986,7 +2568,7 @@ int findPrefixDir(char *dir, size_t dir_len)
 
 	// CIFS_DIR directory in /media/fat/cifs
 	snprintf(temp_dir, 1024, "%s/%s", CIFS_DIR, dir);
-	if (isPathDirectory(temp_dir)) {
+	if (!sd_only && isPathDirectory(temp_dir)) {
 		printf("Found CIFS dir: %s\n", temp_dir);
 		strncpy(dir, temp_dir, dir_len);
 		return 1;
@@ -994,7 +2576,7 @@ int findPrefixDir(char *dir, size_t dir_len)
 
 	// CIFS_DIR/GAMES_DIR directory in /media/fat/cifs/games
 	snprintf(temp_dir, 1024, "%s/%s/%s", CIFS_DIR, GAMES_DIR, dir);
-	if (isPathDirectory(temp_dir)) {
+	if (!sd_only && isPathDirectory(temp_dir)) {
 		printf("Found CIFS dir: %s\n", temp_dir);
 		strncpy(dir, temp_dir, dir_len);
 		return 1;
@@ -1017,6 +2599,91 @@ int findPrefixDir(char *dir, size_t dir_len)
 	return 0;
 }
 
+// The folder found for a name is kept in tmpfs until the mounts or the root
+// device change, so a core start doesn't probe every storage again (a round
+// trip per miss on network shares). A hit is checked with one stat, a miss
+// only probes the root storage again.
+#define PREFIX_CACHE_DIR   "/tmp/prefixdir"
+#define PREFIX_CACHE_MAGIC 0x58464550
+
+struct prefix_cache_t
+{
+	uint32_t magic;
+	uint32_t mounts;
+	int found;
+	char dir[256];
+	char path[1024];
+};
+
+static uint32_t prefix_mounts_hash()
+{
+	uint32_t hash = 2166136261u;
+	const char *root = getRootDir();
+	while (*root) hash = (hash ^ (uint8_t)*root++) * 16777619u;
+
+	int fd = open("/proc/mounts", O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	uint8_t buf[1024];
+	int len;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		for (int i = 0; i < len; i++) hash = (hash ^ buf[i]) * 16777619u;
+	}
+	close(fd);
+	return hash;
+}
+
+int findPrefixDir(char *dir, size_t dir_len)
+{
+	prefix_cache_t c;
+	char name[64];
+
+	uint32_t mounts = prefix_mounts_hash();
+	if (!mounts || strlen(dir) >= sizeof(c.dir)) return probePrefixDir(dir, dir_len, 0);
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = dir; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	sprintf(name, PREFIX_CACHE_DIR "/%08X", hash);
+
+	int sd_only = 0;
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0)
+	{
+		if (read(fd, &c, sizeof(c)) == sizeof(c) && c.magic == PREFIX_CACHE_MAGIC && c.mounts == mounts && !strcmp(c.dir, dir))
+		{
+			if (c.found && isPathDirectory(c.path))
+			{
+				close(fd);
+				strncpy(dir, c.path, dir_len);
+				return 1;
+			}
+
+			if (!c.found) sd_only = 1;
+		}
+		close(fd);
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.magic = PREFIX_CACHE_MAGIC;
+	c.mounts = mounts;
+	strcpy(c.dir, dir);
+
+	c.found = probePrefixDir(dir, dir_len, sd_only);
+	if (sd_only && !c.found) return 0;
+	snprintf(c.path, sizeof(c.path), "%s", dir);
+
+	mkdir(PREFIX_CACHE_DIR, 0755);
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0)
+	{
+		if (write(fd, &c, sizeof(c)) != sizeof(c)) unlink(name);
+		close(fd);
+	}
+
+	return c.found;
+}
+
 void prefixGameDir(char *dir, size_t dir_len)
 {
 	if (!findPrefixDir(dir, dir_len))
@@ -1124,71 +2791,28 @@ int isUSBMounted()
 	return 0;
 }
 
-void FindStorage(void)
-{
-	char str[128];
-	printf("Looking for root device...\n");
-	device = 0;
-	FileLoad(CONFIG_DIR"/device.bin", &device, sizeof(int));
-	orig_device = device;
-
-	if(device && !isUSBMounted())
-	{
-		uint8_t core_type = (fpga_core_id() & 0xFF);
-		if (core_type == CORE_TYPE_8BIT)
-		{
-			user_io_read_confstr();
-			user_io_read_core_name();
-		}
-
-		int saveddev = device;
-		device = 0;
-		cfg_parse();
-		device = saveddev;
-		video_init();
-		user_io_send_buttons(1);
-
-		printf("Waiting for USB...\n");
-		int btn = 0;
-		int done = 0;
-
-		OsdWrite(16, "", 1);
-		OsdWrite(17, "       www.MiSTerFPGA.org       ", 1);
-		OsdWrite(18, "", 1);
-
-		for (int i = 30; i >= 0; i--)
-		{
-			sprintf(str, "\n     Waiting for USB...\n\n             %d   \n\n\n  OSD/USER or ESC to cancel", i);
-			InfoMessage(str);
-			if (isUSBMounted())
-			{
-				done = 1;
-				break;
-			}
-
-			for (int i = 0; i < 10; i++)
-			{
-				btn = fpga_get_buttons();
-				if (!btn) btn = input_poll(1);
-				if (btn)
-				{
-					printf("Button has been pressed %d\n", btn);
-					InfoMessage("\n\n         Canceled!\n");
-					usleep(500000);
-					setStorage(0);
-					break;
-				}
-				usleep(100000);
-			}
-			if (done) break;
-		}
+// A USB root that isn't mounted yet at startup doesn't hold the boot. The
+// SD card is used meanwhile and the menu restarts on USB once it's there.
+#define STORAGE_WAIT_MS 30000
 
-		if (!done)
-		{
-			InfoMessage("\n\n     No USB storage found\n   Falling back to SD card\n");
-			usleep(2000000);
-			setStorage(0);
-		}
+static int storage_wait = 0;
+static unsigned long storage_wait_timer = 0;
+static unsigned long storage_poll_timer = 0;
+
+void FindStorage(void)
+{
+	printf("Looking for root device...\n");
+	device = 0;
+	FileLoad(CONFIG_DIR"/device.bin", &device, sizeof(int));
+	orig_device = device;
+
+	if(device && !isUSBMounted())
+	{
+		printf("USB storage isn't mounted yet, starting from SD card.\n");
+		device = 0;
+		storage_wait = 1;
+		storage_wait_timer = GetTimer(STORAGE_WAIT_MS);
+		storage_poll_timer = GetTimer(1000);
 	}
 
 	if (device)
@@ -1206,18 +2830,57 @@ void FindStorage(void)
 	else if (ENOENT == errno) mkdir(full_path, S_IRWXU | S_IRWXG | S_IRWXO);
 }
 
+int FileStorageWaiting()
+{
+	return storage_wait;
+}
+
+void FileStoragePoll()
+{
+	if (!storage_wait || !CheckTimer(storage_poll_timer)) return;
+	storage_poll_timer = GetTimer(1000);
+
+	if (isUSBMounted())
+	{
+		storage_wait = 0;
+
+		// a core started from SD keeps it, the next core load picks USB up
+		if (!is_menu())
+		{
+			printf("USB storage is mounted now, it's used from the next core load.\n");
+			return;
+		}
+
+		printf("USB storage is mounted now, restarting on it.\n");
+		Info("USB storage found");
+		app_restart("menu.rbf");
+	}
+	else if (CheckTimer(storage_wait_timer))
+	{
+		storage_wait = 0;
+		printf("No USB storage found. Falling back to SD card.\n");
+		Info("No USB storage found\nFalling back to SD card", 3000);
+
+		int dev = 0;
+		FileSave(CONFIG_DIR"/device.bin", &dev, sizeof(int));
+		orig_device = 0;
+	}
+}
+
 struct DirentComp
 {
 	bool operator()(const direntext_t& de1, const direntext_t& de2)
 	{
 
 #ifdef USE_SCHEDULER
-		if (++iterations % YieldIterations == 0)
+		if (yield && ++iterations % YieldIterations == 0)
 		{
-			scheduler_yield();
+			scheduler_yield_budget();
 		}
 #endif
 
+		if (de1.sort_key != de2.sort_key) return de1.sort_key < de2.sort_key;
+
 		if ((de1.de.d_type == DT_DIR) && !strcmp(de1.altname, "..")) return true;
 		if ((de2.de.d_type == DT_DIR) && !strcmp(de2.altname, "..")) return false;
 
@@ -1250,6 +2913,7 @@ struct DirentComp
 	}
 
 	size_t iterations = 0;
+	bool yield = true;
 };
 
 void AdjustDirectory(char *path)
@@ -1286,7 +2950,7 @@ static bool IsInSameFolder(const char *folder, const char *path)
 }
 
 static int names_loaded = 0;
-static void get_display_name(direntext_t *dext, const char *ext, int options)
+static void get_display_name(dirent_build_t *dext, const char *ext, int options)
 {
 	static char *names = 0;
 	memcpy(dext->altname, dext->de.d_name, sizeof(dext->altname));
@@ -1376,6 +3040,370 @@ static void get_display_name(direntext_t *dext, const char *ext, int options)
 	if (fext) *fext = 0;
 }
 
+// Sorted scan results of large folders are kept in tmpfs, so reopening them
+// (also after a core reload) skips readdir, stat and sorting. A cache is used
+// only while the folder mtime and the scan parameters match.
+#define DIRCACHE_DIR   "/tmp/dircache"
+#define DIRCACHE_MAGIC 0x44434102
+#define DIRCACHE_MIN   256 // smaller folders scan fast enough
+#define DIRCACHE_FILES 16
+
+struct dircache_hdr_t
+{
+	uint32_t magic;
+	int64_t dir_mtime;
+	int64_t names_mtime;
+	char key[2048];
+	uint32_t count;
+	uint32_t names_size;
+};
+
+// followed by the names, offsets point into them
+struct dircache_item_t
+{
+	uint32_t name;
+	uint32_t altname;
+	uint32_t datecode; // DIRCACHE_NONE if empty
+	uint32_t sort_key;
+	uint8_t type;
+	uint8_t flags;
+};
+
+#define DIRCACHE_NONE 0xFFFFFFFF
+
+static uint32_t dircache_key(const char *dir, const char *extension, int options, const char *prefix, const char *filter, dircache_hdr_t *hdr)
+{
+	struct stat64 st;
+	if (stat64(dir, &st)) return 0;
+
+	memset(hdr, 0, sizeof(dircache_hdr_t));
+	hdr->magic = DIRCACHE_MAGIC;
+	hdr->dir_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	if (!stat64(getFullPath("names.txt"), &st)) hdr->names_mtime = st.st_mtime;
+	snprintf(hdr->key, sizeof(hdr->key), "%s|%s|%X|%s|%s|%d", dir, extension, options, prefix ? prefix : "", filter ? filter : "", is_minimig());
+
+	// FNV-1a, the key in the header tells collisions apart
+	uint32_t hash = 2166136261u;
+	for (const char *p = hdr->key; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	return hash ? hash : 1;
+}
+
+static int dircache_load(const dircache_hdr_t *key, uint32_t hash)
+{
+	char name[64];
+	sprintf(name, DIRCACHE_DIR "/%08X", hash);
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = 0;
+	struct stat64 st;
+	if (!fstat64(fd, &st) && st.st_size >= (__off64_t)sizeof(dircache_hdr_t))
+	{
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			const dircache_hdr_t *hdr = (const dircache_hdr_t *)map;
+			const dircache_item_t *items = (const dircache_item_t *)(hdr + 1);
+			const char *names = (const char *)(items + hdr->count);
+			char *arena = NULL;
+
+			if (!memcmp(hdr, key, offsetof(dircache_hdr_t, count)) && hdr->names_size &&
+				st.st_size == (__off64_t)(sizeof(dircache_hdr_t) + hdr->count * sizeof(dircache_item_t) + hdr->names_size) &&
+				!names[hdr->names_size - 1] && (arena = DirArenaAlloc(hdr->names_size)))
+			{
+				// the names go into the arena in one piece
+				memcpy(arena, names, hdr->names_size);
+
+				ok = 1;
+				DirItem.reserve(hdr->count);
+				for (uint32_t i = 0; i < hdr->count && ok; i++)
+				{
+					const dircache_item_t *src = &items[i];
+					ok = src->name < hdr->names_size && src->altname < hdr->names_size &&
+						(src->datecode == DIRCACHE_NONE || src->datecode < hdr->names_size);
+
+					direntext_t item;
+					item.de.d_name = arena + src->name;
+					item.de.d_type = src->type;
+					item.flags = src->flags;
+					item.sort_key = src->sort_key;
+					item.altname = arena + src->altname;
+					item.datecode = (src->datecode == DIRCACHE_NONE) ? "" : arena + src->datecode;
+					DirItem.push_back(item);
+				}
+
+				if (!ok) DirClear();
+			}
+			munmap(map, st.st_size);
+		}
+	}
+
+	close(fd);
+	return ok;
+}
+
+// runs on the offload pool, owns buf
+static void dircache_write(uint8_t *buf, size_t size, uint32_t hash)
+{
+	char name[16];
+	sprintf(name, "%08X", hash);
+	cache_write(DIRCACHE_DIR, name, buf, size, DIRCACHE_FILES);
+	free(buf);
+}
+
+static void dircache_store(const dircache_hdr_t *key, uint32_t hash)
+{
+	if (DirItem.size() < DIRCACHE_MIN) return;
+
+	size_t names_size = 0;
+	for (size_t i = 0; i < DirItem.size(); i++)
+	{
+		const direntext_t *item = &DirItem[i];
+		names_size += strlen(item->de.d_name) + 1;
+		if (item->altname != item->de.d_name) names_size += strlen(item->altname) + 1;
+		if (item->datecode[0]) names_size += strlen(item->datecode) + 1;
+	}
+
+	size_t size = sizeof(dircache_hdr_t) + DirItem.size() * sizeof(dircache_item_t) + names_size;
+	uint8_t *buf = (uint8_t *)malloc(size);
+	if (!buf) return;
+
+	dircache_hdr_t *hdr = (dircache_hdr_t *)buf;
+	*hdr = *key;
+	hdr->count = DirItem.size();
+	hdr->names_size = names_size;
+
+	dircache_item_t *items = (dircache_item_t *)(hdr + 1);
+	char *names = (char *)(items + hdr->count);
+	uint32_t pos = 0;
+
+	for (size_t i = 0; i < DirItem.size(); i++)
+	{
+		const direntext_t *item = &DirItem[i];
+		dircache_item_t *dst = &items[i];
+		memset(dst, 0, sizeof(dircache_item_t));
+		dst->type = item->de.d_type;
+		dst->flags = item->flags;
+		dst->sort_key = item->sort_key;
+
+		dst->name = pos;
+		pos += sprintf(names + pos, "%s", item->de.d_name) + 1;
+
+		dst->altname = dst->name;
+		if (item->altname != item->de.d_name)
+		{
+			dst->altname = pos;
+			pos += sprintf(names + pos, "%s", item->altname) + 1;
+		}
+
+		dst->datecode = DIRCACHE_NONE;
+		if (item->datecode[0])
+		{
+			dst->datecode = pos;
+			pos += sprintf(names + pos, "%s", item->datecode) + 1;
+		}
+	}
+
+	offload_add_work([buf, size, hash]() { dircache_write(buf, size, hash); }, OFFLOAD_IO);
+}
+
+// Listings asked for with SCANO_ASYNC are read by the co_scan task while the
+// UI keeps running. The UI only sees the first DirShown entries, which are
+// sorted. Entries read since are sorted on their own and merged in once they
+// double the list, so the first screen shows up right away.
+enum { SCAN_IDLE = 0, SCAN_PENDING, SCAN_RUNNING };
+enum { SEL_NONE = 0, SEL_FILE, SEL_DIR, SEL_KEY };
+
+static size_t DirShown = 0;
+static int scan_state = SCAN_IDLE;
+static int scan_abort = 0;
+static int scan_in_task = 0;
+static int scan_updated = 0;
+static int render_busy = 0;
+
+static char scan_path[1024];
+static char scan_ext[1024];
+static char scan_prefix[256];
+static char scan_filter[256];
+static int scan_options;
+static int scan_has_prefix;
+static int scan_has_filter;
+
+// selection asked for before its entry was read
+static int scan_sel_mode = SEL_NONE;
+static char scan_sel[1024];
+
+// selects the matching entry and scrolls it to the middle of the OSD
+static int SelectDirItem(int sel_mode, const char *name)
+{
+	int pos = -1;
+	for (int i = 0; i < flist_nDirEntries(); i++)
+	{
+		if (sel_mode == SEL_KEY)
+		{
+			if (toupper(DirItem[i].altname[0]) == name[0])
+			{
+				pos = i;
+				break;
+			}
+			continue;
+		}
+
+		if (sel_mode == SEL_DIR && DirItem[i].de.d_type != DT_DIR) continue;
+
+		const char *item = (sel_mode == SEL_DIR) ? DirItem[i].altname : DirItem[i].de.d_name;
+		if (!strcmp(name, item))
+		{
+			pos = i;
+			break;
+		}
+		else if (!strcasecmp(name, item))
+		{
+			pos = i;
+		}
+	}
+
+	if (pos >= 0)
+	{
+		iSelectedEntry = pos;
+		if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
+		else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
+		if (iFirstEntry < 0) iFirstEntry = 0;
+	}
+	return pos;
+}
+
+static int SelectScannedFile(const char *file_name)
+{
+	if (file_name[0]) SelectDirItem(SEL_FILE, file_name);
+	return flist_nDirEntries();
+}
+
+// remembers SCANF_SET_ITEM or a letter jump which found nothing yet
+static void ScanSelectLater(int mode, const char *name)
+{
+	if (mode == SCANF_SET_ITEM)
+	{
+		snprintf(scan_sel, sizeof(scan_sel), "%s", name);
+		scan_sel_mode = SEL_DIR;
+	}
+	else if (mode > 0 && mode < 128 && isalnum(mode))
+	{
+		scan_sel[0] = toupper(mode);
+		scan_sel[1] = 0;
+		scan_sel_mode = SEL_KEY;
+	}
+}
+
+// sorts the entries read since the last call and merges them into the shown list
+static void ScanPublish()
+{
+	size_t shown = DirShown;
+	if (shown == DirItem.size()) return;
+
+	// entries past DirShown are never shown, so this sort may yield
+	std::sort(DirItem.begin() + shown, DirItem.end(), DirentComp());
+
+	direntext_t sel;
+	int sel_offset = iSelectedEntry - iFirstEntry;
+	if (shown) sel = DirItem[iSelectedEntry];
+
+	DirentComp comp;
+	comp.yield = false;
+	std::inplace_merge(DirItem.begin(), DirItem.begin() + shown, DirItem.end(), comp);
+	DirShown = DirItem.size();
+
+	if (scan_sel_mode != SEL_NONE)
+	{
+		if (SelectDirItem(scan_sel_mode, scan_sel) >= 0) scan_sel_mode = SEL_NONE;
+	}
+	else if (shown)
+	{
+		// keep the cursor on the same entry
+		DirentVector::iterator it = std::lower_bound(DirItem.begin(), DirItem.end(), sel, comp);
+		while (it != DirItem.end() && strcmp(it->de.d_name, sel.de.d_name) && !comp(sel, *it)) it++;
+		if (it != DirItem.end() && !strcmp(it->de.d_name, sel.de.d_name))
+		{
+			iSelectedEntry = it - DirItem.begin();
+			iFirstEntry = iSelectedEntry - sel_offset;
+			if (iFirstEntry < 0) iFirstEntry = 0;
+		}
+	}
+
+	scan_updated = 1;
+}
+
+// lets a running co_scan listing finish, or makes it stop early
+static void ScanWait(int abort)
+{
+	if (scan_in_task) return;
+	if (scan_state == SCAN_PENDING) scan_state = SCAN_IDLE;
+
+	while (scan_state != SCAN_IDLE)
+	{
+		if (abort) scan_abort = 1;
+		scheduler_yield();
+	}
+}
+
+void ScanDirectoryTask()
+{
+	if (scan_state != SCAN_PENDING) return;
+
+	scan_state = SCAN_RUNNING;
+	scan_in_task = 1;
+	ScanDirectory(scan_path, SCANF_INIT, scan_ext, scan_options, scan_has_prefix ? scan_prefix : NULL, scan_has_filter ? scan_filter : NULL);
+	scan_in_task = 0;
+	scan_abort = 0;
+	scan_updated = 1;
+	scan_state = SCAN_IDLE;
+}
+
+void flist_RenderBusy(int busy)
+{
+	render_busy = busy;
+}
+
+int flist_ScanUpdated()
+{
+	int updated = scan_updated;
+	scan_updated = 0;
+	return updated;
+}
+
+static void ScanListed(const char *extension, int options, const char *prefix, const char *filter)
+{
+	listed.valid = 1;
+	listed.options = options & ~SCANO_ASYNC;
+	snprintf(listed.ext, sizeof(listed.ext), "%s", extension);
+	snprintf(listed.prefix, sizeof(listed.prefix), "%s", prefix ? prefix : "");
+	snprintf(listed.filter, sizeof(listed.filter), "%s", filter ? filter : "");
+	listed.has_prefix = prefix != NULL;
+}
+
+// a longer filter containing the old one only drops entries
+static int ScanNarrow(const char *path, const char *extension, int options, const char *prefix, const char *filter)
+{
+	if (!filter || !listed.valid || scan_state != SCAN_IDLE) return 0;
+	if (options & (SCANO_NOENTER | SCANO_NEOGEO)) return 0;
+	if (strcmp(path, scanned_path) || listed.options != (options & ~SCANO_ASYNC) || strcmp(listed.ext, extension)) return 0;
+	if (listed.has_prefix != (prefix != NULL) || strcmp(listed.prefix, prefix ? prefix : "")) return 0;
+	if (listed.filter[0] && !strcasestr(filter, listed.filter)) return 0;
+
+	DirItem.erase(std::remove_if(DirItem.begin(), DirItem.end(), [filter](const direntext_t &item)
+	{
+		return !strcasestr(item.de.d_name, filter);
+	}), DirItem.end());
+
+	iFirstEntry = 0;
+	iSelectedEntry = 0;
+	DirShown = DirItem.size();
+	ScanListed(extension, options, prefix, filter);
+	printf("Narrowed to %d dir entries by: %s\n", flist_nDirEntries(), filter);
+	return 1;
+}
+
 int ScanDirectory(char* path, int mode, const char *extension, int options, const char *prefix, const char *filter)
 {
 	static char file_name[1024];
@@ -1395,10 +3423,16 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 
 	if (mode == SCANF_INIT)
 	{
+		ScanWait(1);
+		if (ScanNarrow(path, extension, options, prefix, filter)) return flist_nDirEntries();
+
+		listed.valid = 0;
 		iFirstEntry = 0;
 		iSelectedEntry = 0;
-		DirItem.clear();
+		DirClear();
 		DirNames.clear();
+		DirShown = 0;
+		if (!scan_in_task) scan_sel_mode = SEL_NONE;
 
 		file_name[0] = 0;
 
@@ -1433,6 +3467,41 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			return 0;
 		}
 
+		// zips keep their parsed directory in the zip cache already
+		dircache_hdr_t cache_key;
+		uint32_t cache_hash = 0;
+		if (!is_zipped && !(options & SCANO_NEOGEO))
+		{
+			cache_hash = dircache_key(full_path, extension, options & ~SCANO_ASYNC, prefix, filter, &cache_key);
+			if (cache_hash && dircache_load(&cache_key, cache_hash))
+			{
+				DirShown = DirItem.size();
+				printf("Got %d cached dir entries: %s\n", flist_nDirEntries(), full_path);
+				if (!file_name[0]) ScanListed(extension, options, prefix, filter);
+				return SelectScannedFile(file_name);
+			}
+
+			if ((options & SCANO_ASYNC) && !scan_in_task)
+			{
+				snprintf(scan_path, sizeof(scan_path), "%s", path);
+				snprintf(scan_ext, sizeof(scan_ext), "%s", extension);
+				snprintf(scan_prefix, sizeof(scan_prefix), "%s", prefix ? prefix : "");
+				snprintf(scan_filter, sizeof(scan_filter), "%s", filter ? filter : "");
+				scan_has_prefix = prefix != NULL;
+				scan_has_filter = filter != NULL;
+				scan_options = options & ~SCANO_NOENTER; // file_name is split off already
+
+				if (file_name[0])
+				{
+					snprintf(scan_sel, sizeof(scan_sel), "%s", file_name);
+					scan_sel_mode = SEL_FILE;
+				}
+
+				scan_state = SCAN_PENDING;
+				return 0;
+			}
+		}
+
 		printf("Start to scan %sdir: %s\n", is_zipped ? "zipped " : "", full_path);
 		printf("Position on item: %s\n", file_name);
 
@@ -1443,12 +3512,12 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		mz_zip_archive *z = nullptr;
 		if (is_zipped)
 		{
-			if (!OpenZipfileCached(full_path, 0))
+			if (!OpenZipfileCached(full_path))
 			{
-				printf("Couldn't open zip file %s: %s\n", full_path, mz_zip_get_error_string(mz_zip_get_last_error(&last_zip_archive)));
+				printf("Couldn't open zip file %s: %s\n", full_path, mz_zip_get_error_string(last_zip_error));
 				return 0;
 			}
-			z = &last_zip_archive;
+			z = last_zip_archive;
 		}
 		else
 		{
@@ -1467,7 +3536,10 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 #ifdef USE_SCHEDULER
 			if (0 < i && i % YieldIterations == 0)
 			{
-				scheduler_yield();
+				// a page drawn across yields keeps its layout, the merge waits for the next slice
+				if (scan_in_task && !render_busy && DirItem.size() - DirShown >= std::max<size_t>(DirShown, OsdGetSize())) ScanPublish();
+				scheduler_yield_budget();
+				if (scan_in_task && scan_abort) break;
 			}
 #endif
 			struct dirent64 _de = {};
@@ -1486,12 +3558,12 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 						strncpy(dirname, rname, fslash - rname);
 						if (rname[0] != '/' && !(DirNames.find(dirname) != DirNames.end()))
 						{
-							direntext_t dirext;
+							dirent_build_t dirext;
 							memset(&dirext, 0, sizeof(dirext));
 							strncpy(dirext.de.d_name, rname, fslash - rname);
 							dirext.de.d_type = DT_DIR;
 							memcpy(dirext.altname, dirext.de.d_name, sizeof(dirext.de.d_name));
-							DirItem.push_back(dirext);
+							DirAdd(&dirext);
 							DirNames.insert(dirname);
 						}
 					}
@@ -1582,7 +3654,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 					if (!strncasecmp(de->d_name, ".", 1)) continue;
 				}
 
-				direntext_t dext;
+				dirent_build_t dext;
 				memset(&dext, 0, sizeof(dext));
 				memcpy(&dext.de, de, sizeof(dext.de));
 				memcpy(dext.altname, de->d_name, sizeof(dext.altname));
@@ -1598,7 +3670,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 					memcpy(dext.altname, altname, sizeof(dext.altname));
 				}
 
-				DirItem.push_back(dext);
+				DirAdd(&dext);
 			}
 			else
 			{
@@ -1687,13 +3759,13 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 				}
 
         {
-			      direntext_t dext;
+			      dirent_build_t dext;
 				    memset(&dext, 0, sizeof(dext));
 				    memcpy(&dext.de, de, sizeof(dext.de));
 				    if (isZip)
 				        dext.flags |= DT_EXT_ZIP;
 				    get_display_name(&dext, extension, options);
-				    DirItem.push_back(dext);
+				    DirAdd(&dext);
         }
 			}
 		}
@@ -1702,12 +3774,12 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		{
 			// Since zip files aren't actually folders the entry to
 			// exit the zip file must be added manually.
-			direntext_t dext;
+			dirent_build_t dext;
 			memset(&dext, 0, sizeof(dext));
 			dext.de.d_type = DT_DIR;
 			strcpy(dext.de.d_name, "..");
 			get_display_name(&dext, extension, options);
-			DirItem.push_back(dext);
+			DirAdd(&dext);
 		}
 
 		if (d)
@@ -1715,38 +3787,41 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 			closedir(d);
 		}
 
-		printf("Got %d dir entries\n", flist_nDirEntries());
-		if (!flist_nDirEntries()) return 0;
+		while (scan_in_task && render_busy) scheduler_yield();
 
-		std::sort(DirItem.begin(), DirItem.end(), DirentComp());
-		if (file_name[0])
+		if (scan_in_task && scan_abort)
 		{
-			int pos = -1;
-			for (int i = 0; i < flist_nDirEntries(); i++)
-			{
-				if (!strcmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-					break;
-				}
-				else if (!strcasecmp(file_name, DirItem[i].de.d_name))
-				{
-					pos = i;
-				}
-			}
+			DirClear();
+			DirShown = 0;
+			return 0;
+		}
 
-			if(pos>=0)
-			{
-				iSelectedEntry = pos;
-				if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
-				else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
-				if (iFirstEntry < 0) iFirstEntry = 0;
-			}
+		printf("Got %d dir entries\n", (int)DirItem.size());
+		if (DirItem.empty()) return 0;
+
+		if (scan_in_task)
+		{
+			ScanPublish();
 		}
-		return flist_nDirEntries();
+		else
+		{
+			std::sort(DirItem.begin(), DirItem.end(), DirentComp());
+			DirShown = DirItem.size();
+		}
+
+		if (cache_hash) dircache_store(&cache_key, cache_hash);
+		if (cache_hash && !file_name[0]) ScanListed(extension, options, prefix, filter);
+		return SelectScannedFile(file_name);
 	}
 	else
 	{
+		// a new request replaces the one made while loading
+		if (scan_state != SCAN_IDLE)
+		{
+			scan_sel_mode = SEL_NONE;
+			if (!flist_nDirEntries()) ScanSelectLater(mode, extension);
+		}
+
 		if (flist_nDirEntries() == 0) // directory is empty so there is no point in searching for any entry
 			return 0;
 
@@ -1820,27 +3895,7 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 		}
 		else if (mode == SCANF_SET_ITEM)
 		{
-			int pos = -1;
-			for (int i = 0; i < flist_nDirEntries(); i++)
-			{
-				if ((DirItem[i].de.d_type == DT_DIR) && !strcmp(DirItem[i].altname, extension))
-				{
-					pos = i;
-					break;
-				}
-				else if ((DirItem[i].de.d_type == DT_DIR) && !strcasecmp(DirItem[i].altname, extension))
-				{
-					pos = i;
-				}
-			}
-
-			if(pos>=0)
-			{
-				iSelectedEntry = pos;
-				if (iSelectedEntry + (OsdGetSize() / 2) >= flist_nDirEntries()) iFirstEntry = flist_nDirEntries() - OsdGetSize();
-				else iFirstEntry = iSelectedEntry - (OsdGetSize() / 2) + 1;
-				if (iFirstEntry < 0) iFirstEntry = 0;
-			}
+			if (SelectDirItem(SEL_DIR, extension) < 0 && scan_state != SCAN_IDLE) ScanSelectLater(mode, extension);
 		}
 		else
 		{
@@ -1877,6 +3932,10 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 					else iFirstEntry = iSelectedEntry - (OsdGetSize()/2) + 1;
 					if (iFirstEntry < 0) iFirstEntry = 0;
 				}
+				else if (scan_state != SCAN_IDLE)
+				{
+					ScanSelectLater(mode, extension);
+				}
 			}
 		}
 	}
@@ -1884,6 +3943,75 @@ int ScanDirectory(char* path, int mode, const char *extension, int options, cons
 	return 0;
 }
 
+// Lists a generated folder of 2000 files and 50 subfolders. ScanDirectory
+// only lists below the root, so the folder is made there. A new folder
+// mtime defeats the listing cache for the cold runs.
+void scan_bench()
+{
+	char dir[1024];
+	snprintf(dir, sizeof(dir), "%s/bench.XXXXXX", getRootDir());
+	if (!mkdtemp(dir))
+	{
+		printf("scan_bench: unable to create %s\n", dir);
+		return;
+	}
+
+	static const char *regions[] = { "USA", "Europe", "Japan", "World" };
+	char name[1100];
+	for (int i = 0; i < 2050; i++)
+	{
+		if (i < 50)
+		{
+			snprintf(name, sizeof(name), "%s/Folder %02d", dir, i);
+			mkdir(name, 0755);
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "%s/Game %04d (%s)%s", dir, (i * 7919) % 10000, regions[i & 3], (i % 5) ? ".bin" : ".txt");
+			int fd = open(name, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+			if (fd >= 0) close(fd);
+		}
+	}
+
+	char path[1024];
+	const char *rel = dir + strlen(getRootDir()) + 1;
+	const int loops = 8;
+	uint64_t cold = 0, warm = 0;
+	for (int n = 0; n < loops * 2; n++)
+	{
+		if (n < loops)
+		{
+			// FAT keeps the mtime in 2s steps
+			struct timespec ts[2] = { { 0, UTIME_OMIT }, { 1000000000 + n * 2, 0 } };
+			utimensat(AT_FDCWD, dir, ts, 0);
+		}
+
+		snprintf(path, sizeof(path), "%s", rel);
+		uint64_t start = profiling_time_us();
+		ScanDirectory(path, SCANF_INIT, "BIN", 0);
+		uint64_t us = profiling_time_us() - start;
+		if (n < loops) cold += us;
+		else warm += us;
+	}
+	int entries = flist_nDirEntries();
+
+	DIR *d = opendir(dir);
+	struct dirent64 *de;
+	while (d && (de = readdir64(d)))
+	{
+		if (de->d_name[0] == '.') continue;
+		snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
+		if (de->d_type == DT_DIR) rmdir(name);
+		else unlink(name);
+	}
+	if (d) closedir(d);
+	rmdir(dir);
+
+	// per listed entry
+	profiling_bench_report("scan 2050 entries", cold, (uint64_t)entries * loops, 0);
+	profiling_bench_report("scan 2050 entries cached", warm, (uint64_t)entries * loops, 0);
+}
+
 char* flist_Path()
 {
 	return scanned_path;
@@ -1891,7 +4019,7 @@ char* flist_Path()
 
 int flist_nDirEntries()
 {
-	return DirItem.size();
+	return DirShown;
 }
 
 int flist_iFirstEntry()
@@ -1919,6 +4047,82 @@ direntext_t* flist_SelectedItem()
 	return &DirItem[iSelectedEntry];
 }
 
+// Sorted files of the folder flist_GetPrevNext() steps through. It's kept
+// until the folder changes, so stepping is a binary search instead of a
+// scan, and the listing of the file browser is left alone.
+struct prevnext_index_t
+{
+	char path[1024];
+	char ext[32];
+	int64_t mtime;
+	int64_t mtime_ns;
+	std::vector<std::string> names;
+};
+
+static prevnext_index_t pn_index = {};
+
+static int prevnext_ext_match(const char *name, const char *ext)
+{
+	const char *fext = strrchr(name, '.');
+	if (!fext) return 0;
+	fext++;
+
+	while (*ext)
+	{
+		int len = 0;
+		while (len < 3 && ext[len] && ext[len] != ' ') len++;
+		if (len && (int)strlen(fext) == len && !strncasecmp(fext, ext, len)) return 1;
+		if (strlen(ext) < 3) break;
+		ext += 3;
+	}
+	return 0;
+}
+
+// same order as the browser shows the files
+static bool prevnext_less(const std::string &a, const std::string &b)
+{
+	int len1 = a.length(), len2 = b.length();
+	if (len1 > 4 && a[len1 - 4] == '.') len1 -= 4;
+	if (len2 > 4 && b[len2 - 4] == '.') len2 -= 4;
+
+	int ret = strncasecmp(a.c_str(), b.c_str(), (len1 < len2) ? len1 : len2);
+	if (!ret && len1 != len2) return len1 < len2;
+	if (!ret) ret = strcasecmp(a.c_str(), b.c_str());
+	return ret < 0;
+}
+
+static prevnext_index_t *prevnext_index(const char *dir, const char *ext)
+{
+	make_fullpath(dir);
+
+	struct stat64 st;
+	if (stat64(full_path, &st) || !S_ISDIR(st.st_mode)) return NULL;
+
+	prevnext_index_t *idx = &pn_index;
+	if (!strcmp(idx->path, full_path) && !strcmp(idx->ext, ext) && idx->mtime == st.st_mtim.tv_sec && idx->mtime_ns == st.st_mtim.tv_nsec) return idx;
+
+	DIR *d = opendir(full_path);
+	if (!d) return NULL;
+
+	snprintf(idx->path, sizeof(idx->path), "%s", full_path);
+	snprintf(idx->ext, sizeof(idx->ext), "%s", ext);
+	idx->mtime = st.st_mtim.tv_sec;
+	idx->mtime_ns = st.st_mtim.tv_nsec;
+	idx->names.clear();
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_name[0] == '.' || de->d_type == DT_DIR) continue;
+		if (*ext && !prevnext_ext_match(de->d_name, ext)) continue;
+		idx->names.push_back(de->d_name);
+	}
+	closedir(d);
+
+	std::sort(idx->names.begin(), idx->names.end(), prevnext_less);
+	return idx;
+}
+
 char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext, int next)
 {
 	static char path[1024];
@@ -1930,13 +4134,30 @@ char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext
 		p = 0;
 	}
 
-	int len = (p) ? p - path : strlen(path);
-	if (strncasecmp(scanned_path, path, len) || (scanned_opts & SCANO_DIR)) ScanDirectory(path, SCANF_INIT, ext, 0);
+	if (p) *p = 0;
+	prevnext_index_t *idx = prevnext_index(path, ext);
+	if (!idx || idx->names.empty()) return NULL;
 
-	if (!DirItem.size()) return NULL;
-	if (p) ScanDirectory(path, next ? SCANF_NEXT : SCANF_PREV, "", 0);
-	snprintf(path, sizeof(path), "%s/%s", scanned_path, DirItem[iSelectedEntry].de.d_name);
+	// like the browser: next wraps around, prev stops at the first file
+	size_t pos = 0;
+	if (p)
+	{
+		std::string name(p + 1);
+		auto it = std::lower_bound(idx->names.begin(), idx->names.end(), name, prevnext_less);
+		pos = it - idx->names.begin();
+		if (it != idx->names.end() && *it == name)
+		{
+			if (next) pos = (pos + 1 < idx->names.size()) ? pos + 1 : 0;
+			else if (pos) pos--;
+		}
+		else if (pos >= idx->names.size() || !next)
+		{
+			pos = (!next && pos) ? pos - 1 : 0;
+		}
+	}
 
+	int len = strlen(path);
+	snprintf(path + len, sizeof(path) - len, "/%s", idx->names[pos].c_str());
 	return path + strlen(base_path) + 1;
 }
 
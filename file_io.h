@@ -6,9 +6,12 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <sys/uio.h>
 #include "spi.h"
 
 struct fileZipArchive;
+struct fileZipCache;
+struct fileZstd;
 
 struct fileTYPE
 {
@@ -20,20 +23,32 @@ struct fileTYPE
 	int             mode;
 	int             type;
 	fileZipArchive *zip;
+	fileZipCache   *zcache;
+	fileZstd       *zst;      // seekable zstd image
+	int             dfd;       // O_DIRECT descriptor, 0 - not opened, -1 - not supported
+	int             net;       // on a network share
+	__off64_t       ra_next;   // end of the readahead requested on a network share
+	int             oneshot;   // drop the cached pages on close
 	__off64_t       size;
 	__off64_t       offset;
 	char            path[1024];
 	char            name[261];
 };
 
+// Listed entry. The names are packed into an arena owned by the listing,
+// so entries stay small and cheap to move while sorting.
 struct direntext_t
 {
-	dirent de;
-	int  cookie;
+	struct
+	{
+		const char *d_name;
+		unsigned char d_type;
+	} de;
 #define DT_EXT_ZIP    0x1
 	unsigned int flags;
-	char datecode[16];
-	char altname[256];
+	uint32_t sort_key; // listing group and first name characters
+	const char *datecode;
+	const char *altname;
 };
 
 struct fileTextReader
@@ -52,6 +67,8 @@ void flist_iFirstEntryInc();
 int flist_iSelectedEntry();
 direntext_t* flist_DirItem(int n);
 direntext_t* flist_SelectedItem();
+int flist_ScanUpdated(); // the listing has grown since the last call
+void flist_RenderBusy(int busy); // a page is being drawn, the listing must not change
 char* flist_Path();
 char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext, int next);
 
@@ -74,26 +91,73 @@ char* flist_GetPrevNext(const char* base_path, const char* file, const char* ext
 #define SCANO_NOZIP      0b001000000
 #define SCANO_CLEAR      0b010000000 // allow backspace key, clear FC option
 #define SCANO_SAVES      0b100000000
+#define SCANO_ASYNC      0b1000000000 // return right away, the listing keeps loading in co_scan
 
 void FindStorage();
+
+// Pending USB root: FileStorageWaiting() tells if it's still expected,
+// FileStoragePoll() (main loop) switches to it once it's mounted.
+int FileStorageWaiting();
+void FileStoragePoll();
 int  getStorage(int from_setting);
 void setStorage(int dev);
 int  isUSBMounted();
 
 int  FileOpenZip(fileTYPE *file, const char *name, uint32_t crc32);
 int  FileOpenEx(fileTYPE *file, const char *name, int mode, char mute = 0, int use_zip = 1);
+
+// Read-only open of a compressed zip member through the RAM extraction cache
+// (zip_cache_mb). Returns 0 if the cache doesn't apply, use FileOpenEx then.
+int  FileOpenZipCache(fileTYPE *file, const char *name);
+void FileZipCacheFlush();
+
+// Stored CRC32 of an opened zip member, 0 if the file isn't from a zip.
+uint32_t FileZipCRC(fileTYPE *file);
+
 int  FileOpen(fileTYPE *file, const char *name, char mute = 0);
 void FileClose(fileTYPE *file);
 
 __off64_t FileGetSize(fileTYPE *file);
 
+// Access pattern hints for the page cache, plain files only. WILLNEED and
+// DONTNEED take a range, len 0 is up to the end. ONESHOT is for files read
+// once from start to end: sequential readahead, and the pages are dropped on
+// close, so a big ROM doesn't push the directory and index caches out.
+#define FILE_ADV_NORMAL     0
+#define FILE_ADV_SEQUENTIAL 1
+#define FILE_ADV_RANDOM     2
+#define FILE_ADV_WILLNEED   3
+#define FILE_ADV_DONTNEED   4
+#define FILE_ADV_ONESHOT    5
+
+void FileAdvise(fileTYPE *file, int advice, __off64_t offset = 0, __off64_t len = 0);
+
 int FileSeek(fileTYPE *file, __off64_t offset, int origin);
 int FileSeekLBA(fileTYPE *file, uint32_t offset);
 
 int FileReadAdv(fileTYPE *file, void *pBuffer, int length, int failres = 0);
 int FileReadSec(fileTYPE *file, void *pBuffer);
+int FileReadDirect(fileTYPE *file, void *pBuffer, int length, int failres = 0);
 int FileWriteAdv(fileTYPE *file, void *pBuffer, int length, int failres = 0);
+
+// Positional I/O straight between the file and the caller's buffer, without
+// the stdio buffer copy and seek. The file offset is left untouched, except
+// for zipped files which have to seek through the zip stream.
+int FileReadAt(fileTYPE *file, __off64_t offset, void *pBuffer, int length, int failres = 0);
+int FileWriteAt(fileTYPE *file, __off64_t offset, const void *pBuffer, int length, int failres = 0);
+
+// Same as FileReadAt, but through O_DIRECT if buffer, offset and length
+// are 4KB aligned and the file system supports it. For big sequential reads.
+int FileReadAtDirect(fileTYPE *file, __off64_t offset, void *pBuffer, int length, int failres = 0);
 int FileWriteSec(fileTYPE *file, void *pBuffer);
+
+// Sequential read-ahead on the offload thread. FileReadStreamNext() returns
+// the next chunk and hands the previous one back for refilling. Don't touch
+// the file until FileReadStreamEnd().
+struct fileReadStream;
+fileReadStream *FileReadStreamStart(fileTYPE *file, uint32_t size, uint32_t chunk_size = 128 * 1024);
+uint32_t FileReadStreamNext(fileReadStream *stream, uint8_t **data);
+void FileReadStreamEnd(fileReadStream *stream);
 int FileCreatePath(const char *dir);
 
 int FileExists(const char *name, int use_zip = 1);
@@ -112,8 +176,22 @@ void FileGenerateSavestatePath(const char *name, char* out_name, int sufx);
 void FileGenerateScreenshotName(const char *name, char *out_name, int buflen);
 
 int FileSave(const char *name, void *pBuffer, int size);
+
+// Same as FileSave, but the data is copied and written on the offload pool
+// to a temporary file which then replaces the old one, so a crash leaves
+// either version intact. Returns the job to wait for, saves of the same
+// file must be kept in order by the caller.
+uint32_t FileSaveAsync(const char *name, const void *pBuffer, int size);
 int FileLoad(const char *name, void *pBuffer, int size); // supply pBuffer = 0 to get the file size without loading
 int FileDelete(const char *name);
+
+// Files of the tmpfs caches, dir is a full path and made if needed. The
+// data goes to a temporary file renamed over name, so readers only ever
+// see complete files. With limit set the oldest file is dropped first once
+// the folder holds limit files. Takes no shared buffers, so the offload
+// workers can use it. Returns 1 on success.
+int cache_writev(const char *dir, const char *name, const struct iovec *iov, int cnt, int limit);
+int cache_write(const char *dir, const char *name, const void *data, size_t size, int limit);
 int DirDelete(const char *name);
 
 //save/load from config dir
@@ -123,8 +201,16 @@ int FileSaveConfig(const char *name, void *pBuffer, int size);
 int FileLoadConfig(const char *name, void *pBuffer, int size); // supply pBuffer = 0 to get the file size without loading
 int FileDeleteConfig(const char *name);
 
+// Keeps the latest value per file and writes it once it stopped changing,
+// for settings stepped through in the OSD. Flushed before a restart.
+int FileSaveConfigLater(const char *name, const void *pBuffer, int size);
+void FileSaveConfigPoll();
+void FileSaveConfigFlush();
+
 void AdjustDirectory(char *path);
 int ScanDirectory(char* path, int mode, const char *extension, int options, const char *prefix = NULL, const char *filter = NULL);
+void ScanDirectoryTask();
+void scan_bench(); // for the bench harness
 
 void prefixGameDir(char *dir, size_t dir_len);
 int findPrefixDir(char *dir, size_t dir_len);
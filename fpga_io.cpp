@@ -8,14 +8,24 @@
 #include <termios.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 #include "fpga_io.h"
 #include "file_io.h"
+#include "cfg.h"
+#include "blockcache.h"
 #include "input.h"
 #include "osd.h"
 #include "menu.h"
 #include "shmem.h"
 #include "offload.h"
+#include "profiling.h"
+#include "launch.h"
+#include "fpgasim.h"
 
 #include "fpga_base_addr_ac5.h"
 #include "fpga_manager.h"
@@ -239,6 +249,14 @@ static void fpgamgr_program_write(const void *rbf_data, unsigned long rbf_size)
 	/* Number of loops for 4-byte long copying + trailing bytes */
 	uint32_t loops4 = DIV_ROUND_UP(rbf_size % 32, 4);
 
+	/* The block loop below needs at least one pass */
+	if (!loops32)
+	{
+		const uint32_t *s = (const uint32_t *)rbf_data;
+		while (loops4--) writel(*s++, (void*)dst);
+		return;
+	}
+
 	__asm volatile(
 		"1:	ldmia %0!,{r0-r7}   \n"
 		"	stmia %1!,{r0-r7}   \n"
@@ -338,26 +356,114 @@ static int fpgamgr_program_poll_usermode(void)
 	return 0;
 }
 
+static void do_bridge(uint32_t enable);
+
+// The bitstream is read by a helper thread into a small ring of chunks
+// while the FPGA Manager is fed from the other end, so the SD read overlaps
+// the configuration and the file is never held in memory as a whole.
+// Chunks are a multiple of 32 bytes, so every write but the last is whole.
+#define RBF_CHUNK  (256 * 1024)
+#define RBF_CHUNKS 4
+
+struct rbf_stream_t
+{
+	int fd;
+	uint8_t *buf;
+	uint32_t len[RBF_CHUNKS];
+	int error;
+	int cache_fd;   // copy of the bitstream for the RAM cache, or -1
+	int cache_ok;
+	volatile int quit;
+	sem_t filled;
+	sem_t free;
+};
+
+static void *rbf_reader(void *arg)
+{
+	rbf_stream_t *s = (rbf_stream_t *)arg;
+
+	for (uint32_t i = 0;; i++)
+	{
+		while (sem_wait(&s->free) && errno == EINTR);
+		if (s->quit) break;
+
+		uint8_t *dst = s->buf + (i % RBF_CHUNKS) * RBF_CHUNK;
+		uint32_t len = 0;
+		while (len < RBF_CHUNK)
+		{
+			ssize_t n = read(s->fd, dst + len, RBF_CHUNK - len);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0) s->error = 1;
+			if (n <= 0) break;
+			len += n;
+		}
+
+		if (s->cache_fd >= 0 && len && write(s->cache_fd, dst, len) != (ssize_t)len) s->cache_ok = 0;
+
+		s->len[i % RBF_CHUNKS] = len;
+		sem_post(&s->filled);
+		if (len < RBF_CHUNK) break;
+	}
+
+	return (void *)0;
+}
+
 /*
-* FPGA Manager to program the FPGA. This is the interface used by FPGA driver.
+* FPGA Manager to program the FPGA from the bitstream stream.
 * Return 0 for sucess, non-zero for error.
 */
-static int socfpga_load(const void *rbf_data, size_t rbf_size)
+static int socfpga_load_stream(rbf_stream_t *s, uint64_t file_size)
 {
 	unsigned long status;
 
-	if ((uint32_t)rbf_data & 0x3) {
-		printf("FPGA: Unaligned data, realign to 32bit boundary.\n");
-		return -EINVAL;
+	while (sem_wait(&s->filled) && errno == EINTR);
+	uint32_t len = s->len[0];
+	if (s->error || !len)
+	{
+		printf("FPGA: Couldn't read the bitstream.\n");
+		return -EIO;
+	}
+
+	uint8_t *p = s->buf;
+	uint64_t remain = file_size;
+	if (len >= 16 && !memcmp(p, "MiSTer", 6))
+	{
+		remain = *(uint32_t*)(p + 12);
+		p += 16;
+		len -= 16;
 	}
 
+	do_bridge(0);
+
 	/* Initialize the FPGA Manager */
 	status = fpgamgr_program_init();
 	if (status)
 		return status;
 
-	/* Write the RBF data to FPGA Manager */
-	fpgamgr_program_write(rbf_data, rbf_size);
+	/* Write the RBF data to FPGA Manager as it arrives */
+	for (uint32_t i = 0;;)
+	{
+		if (len > remain) len = remain;
+		if (len) fpgamgr_program_write(p, len);
+		remain -= len;
+
+		bool last = !remain || (s->len[i % RBF_CHUNKS] < RBF_CHUNK);
+		sem_post(&s->free);
+		if (last) break;
+
+		i++;
+		while (sem_wait(&s->filled) && errno == EINTR);
+		if (s->error)
+		{
+			printf("FPGA: Read error in the bitstream.\n");
+			return -EIO;
+		}
+
+		p = s->buf + (i % RBF_CHUNKS) * RBF_CHUNK;
+		len = s->len[i % RBF_CHUNKS];
+	}
+
+	if (remain) printf("FPGA: Bitstream is %llu bytes short.\n", remain);
 
 	/* Ensure the FPGA entering config done */
 	status = fpgamgr_program_poll_cd();
@@ -421,12 +527,224 @@ static int make_env(const char *name, const char *cfg)
 	return 0;
 }
 
+// Bitstreams are kept in tmpfs (rbf_cache_mb) next to the mtime and size of
+// their source file. Every loaded core is copied there on the way to the
+// FPGA, pinned cores (rbf_pin) are preloaded while the menu is idle and are
+// only evicted for other pinned ones.
+#define RBFCACHE_DIR   "/tmp/rbfcache"
+#define RBFCACHE_MAGIC 0x52424601
+
+struct rbfcache_t
+{
+	uint32_t magic;
+	uint32_t pinned;
+	int64_t src_mtime;
+	int64_t src_size;
+};
+
+static void rbf_path(const char *name, char *path, size_t len)
+{
+	if (name[0] == '/') snprintf(path, len, "%s", name);
+	else snprintf(path, len, "%s/%s", !strcasecmp(name, "menu.rbf") ? getStorageDir(0) : getRootDir(), name);
+}
+
+static int rbfcache_pinned(const char *path)
+{
+	for (int i = 0; i < (int)(sizeof(cfg.rbf_pin) / sizeof(cfg.rbf_pin[0])); i++)
+	{
+		if (!cfg.rbf_pin[i][0]) continue;
+
+		char pin[1024];
+		rbf_path(cfg.rbf_pin[i], pin, sizeof(pin));
+		if (!strcmp(pin, path)) return 1;
+	}
+	return 0;
+}
+
+// fills the header and the cache file name of a bitstream
+static int rbfcache_key(const char *path, char *name, rbfcache_t *hdr)
+{
+	if (!cfg.rbf_cache_mb) return 0;
+
+	struct stat64 st;
+	if (stat64(path, &st)) return 0;
+
+	memset(hdr, 0, sizeof(rbfcache_t));
+	hdr->magic = RBFCACHE_MAGIC;
+	hdr->pinned = rbfcache_pinned(path);
+	hdr->src_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	hdr->src_size = st.st_size;
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = path; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	sprintf(name, RBFCACHE_DIR "/%c%08X", hdr->pinned ? 'P' : 'R', hash);
+	return 1;
+}
+
+// returns the descriptor positioned at the bitstream if the cached copy is still valid
+static int rbfcache_open(const char *name, const rbfcache_t *hdr)
+{
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+
+	rbfcache_t cur;
+	if (read(fd, &cur, sizeof(cur)) != sizeof(cur) || memcmp(&cur, hdr, sizeof(cur)))
+	{
+		close(fd);
+		unlink(name);
+		return -1;
+	}
+
+	// keeps it off the eviction list for a while
+	utimes(name, NULL);
+	return fd;
+}
+
+// drops the least recently used bitstreams until size more bytes fit into rbf_cache_mb
+static int rbfcache_make_room(uint64_t size, int pinned)
+{
+	uint64_t limit = cfg.rbf_cache_mb * 1024ULL * 1024ULL;
+	if (size > limit) return 0;
+
+	for (;;)
+	{
+		DIR *d = opendir(RBFCACHE_DIR);
+		if (!d) return 1;
+
+		char oldest[300] = {};
+		time_t oldest_time = 0;
+		int oldest_pinned = 0;
+		uint64_t total = 0;
+
+		struct dirent *de;
+		while ((de = readdir(d)))
+		{
+			if (de->d_name[0] == '.') continue;
+
+			char name[300];
+			struct stat st;
+			snprintf(name, sizeof(name), RBFCACHE_DIR "/%s", de->d_name);
+			if (stat(name, &st)) continue;
+
+			total += st.st_size;
+
+			// recent ones go first, pinned ones only make room for each other
+			int is_pinned = de->d_name[0] == 'P';
+			if (is_pinned && !pinned) continue;
+			if (!oldest[0] || is_pinned < oldest_pinned || (is_pinned == oldest_pinned && st.st_mtime < oldest_time))
+			{
+				strcpy(oldest, name);
+				oldest_time = st.st_mtime;
+				oldest_pinned = is_pinned;
+			}
+		}
+		closedir(d);
+
+		if (total + size <= limit || !oldest[0]) return total + size <= limit;
+		unlink(oldest);
+	}
+}
+
+// starts a cache file, the bitstream is appended as it's read
+static int rbfcache_create(const char *name, const rbfcache_t *hdr)
+{
+	mkdir(RBFCACHE_DIR, 0755);
+	if (!rbfcache_make_room(hdr->src_size + sizeof(rbfcache_t), hdr->pinned)) return -1;
+
+	char tmp_name[64];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	if (write(fd, hdr, sizeof(rbfcache_t)) != sizeof(rbfcache_t))
+	{
+		close(fd);
+		unlink(tmp_name);
+		return -1;
+	}
+	return fd;
+}
+
+static void rbfcache_finish(int fd, const char *name, int ok)
+{
+	if (fd < 0) return;
+
+	char tmp_name[64];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+	close(fd);
+	if (!ok || rename(tmp_name, name)) unlink(tmp_name);
+}
+
+static void rbfcache_preload_one(int idx)
+{
+	char path[1024], name[64];
+	rbfcache_t hdr;
+
+	rbf_path(cfg.rbf_pin[idx], path, sizeof(path));
+	if (!rbfcache_key(path, name, &hdr)) return;
+
+	int fd = rbfcache_open(name, &hdr);
+	if (fd >= 0)
+	{
+		close(fd);
+		return;
+	}
+
+	int src = open(path, O_RDONLY | O_CLOEXEC);
+	if (src < 0) return;
+
+	uint8_t *buf = (uint8_t *)malloc(RBF_CHUNK);
+	int dst = buf ? rbfcache_create(name, &hdr) : -1;
+	int ok = dst >= 0;
+	int64_t left = hdr.src_size;
+	while (ok && left > 0)
+	{
+		ssize_t n = read(src, buf, RBF_CHUNK);
+		ok = n > 0 && write(dst, buf, n) == n;
+		left -= n;
+	}
+	close(src);
+	free(buf);
+
+	rbfcache_finish(dst, name, ok && !left);
+	if (ok && !left) printf("RBF cache: preloaded %s\n", path);
+}
+
+void fpga_rbf_preload()
+{
+	static int next = 0;
+
+	if (!cfg.rbf_cache_mb) return;
+
+	// one core per job, the rest follows on the next idle calls
+	while (next < (int)(sizeof(cfg.rbf_pin) / sizeof(cfg.rbf_pin[0])))
+	{
+		int idx = next;
+		if (!cfg.rbf_pin[idx][0])
+		{
+			next++;
+			continue;
+		}
+
+		if (offload_try_work([idx] { rbfcache_preload_one(idx); }, OFFLOAD_IO)) next++;
+		break;
+	}
+}
+
 int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 {
+	PROFILE_FUNCTION();
+
 	OsdDisable();
 	static char path[1024];
 	int ret = 0;
 
+	// the next process reports its startup from here
+	profiling_boot_switch();
+	launch_phase(LAUNCH_CORE);
+
 	if(cfg)
 	{
 		fpga_core_reset(1);
@@ -437,10 +755,22 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 
 	printf("Loading RBF: %s\n", name);
 
-	if(name[0] == '/') strcpy(path, name);
-	else sprintf(path, "%s/%s", !strcasecmp(name, "menu.rbf") ? getStorageDir(0) : getRootDir(), name);
+	rbf_path(name, path, sizeof(path));
+
+	char cache_name[64];
+	rbfcache_t cache_hdr;
+	int cache_fd = -1;
+	int use_cache = rbfcache_key(path, cache_name, &cache_hdr);
 
-	int rbf = open(path, O_RDONLY);
+	int rbf = use_cache ? rbfcache_open(cache_name, &cache_hdr) : -1;
+	int from_cache = rbf >= 0;
+	if (from_cache) printf("Bitstream is in RAM cache.\n");
+	else
+	{
+		rbf = open(path, O_RDONLY);
+		if (rbf >= 0) posix_fadvise(rbf, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (rbf >= 0 && use_cache) cache_fd = rbfcache_create(cache_name, &cache_hdr);
+	}
 	if (rbf < 0)
 	{
 		char error[4096];
@@ -459,33 +789,46 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 		}
 		else
 		{
+			// the cached copy starts with its header
+			if (from_cache) st.st_size = cache_hdr.src_size;
 			printf("Bitstream size: %lld bytes\n", st.st_size);
 
-			void *buf = malloc(st.st_size);
-			if (!buf)
+			rbf_stream_t stream = {};
+			stream.fd = rbf;
+			stream.cache_fd = cache_fd;
+			stream.cache_ok = 1;
+			stream.buf = (uint8_t *)malloc(RBF_CHUNK * RBF_CHUNKS);
+			if (!stream.buf)
 			{
-				printf("Couldn't allocate %llu bytes.\n", st.st_size);
+				printf("Couldn't allocate %u bytes.\n", RBF_CHUNK * RBF_CHUNKS);
 				ret = -1;
 			}
 			else
 			{
+				sem_init(&stream.filled, 0, 0);
+				sem_init(&stream.free, 0, RBF_CHUNKS);
+
 				fpga_core_reset(1);
-				if (read(rbf, buf, st.st_size)<st.st_size)
+
+				pthread_t reader;
+				if (pthread_create(&reader, nullptr, rbf_reader, &stream))
 				{
-					printf("Couldn't read file %s\n", name);
+					printf("Couldn't start the bitstream reader.\n");
 					ret = -1;
 				}
 				else
 				{
-					void *p = buf;
-					__off64_t sz = st.st_size;
-					if (!memcmp(buf, "MiSTer", 6))
-					{
-						sz = *(uint32_t*)(((uint8_t*)buf) + 12);
-						p = (void*)(((uint8_t*)buf) + 16);
-					}
-					do_bridge(0);
-					ret = socfpga_load(p, sz);
+					ret = socfpga_load_stream(&stream, st.st_size);
+
+					// release the reader wherever it waits
+					stream.quit = 1;
+					for (int i = 0; i < RBF_CHUNKS; i++) sem_post(&stream.free);
+					pthread_join(reader, nullptr);
+
+					// only a complete copy is kept
+					rbfcache_finish(cache_fd, cache_name, !ret && !stream.error && stream.cache_ok && lseek(cache_fd, 0, SEEK_CUR) == cache_hdr.src_size + (off_t)sizeof(rbfcache_t));
+					cache_fd = -1;
+
 					if (ret)
 					{
 						printf("Error %d while loading %s\n", ret, path);
@@ -495,10 +838,17 @@ int fpga_load_rbf(const char *name, const char *cfg, const char *xml)
 						do_bridge(1);
 					}
 				}
-				free(buf);
+
+				sem_destroy(&stream.filled);
+				sem_destroy(&stream.free);
+				free(stream.buf);
 			}
 		}
 	}
+	rbfcache_finish(cache_fd, cache_name, 0);
+
+	// read once, the RAM cache has its own copy
+	if (!from_cache) posix_fadvise(rbf, 0, 0, POSIX_FADV_DONTNEED);
 	close(rbf);
 
 	app_restart(!strcasecmp(name, "menu.rbf") ? "menu.rbf" : path, xml);
@@ -509,12 +859,22 @@ static uint32_t gpo_copy = 0;
 void inline fpga_gpo_write(uint32_t value)
 {
 	gpo_copy = value;
+#ifdef FPGA_SIM
+	fpgasim_gpo_write(value);
+#else
 	writel(value, (void*)(SOCFPGA_MGR_ADDRESS + 0x10));
+#endif
 }
 
+#ifdef FPGA_SIM
+#define fpga_gpo_writeN(value) fpgasim_gpo_write(value)
+#define fpga_gpo_read() gpo_copy
+#define fpga_gpi_read() (int)fpgasim_gpi_read()
+#else
 #define fpga_gpo_writeN(value) writel((value), (void*)(SOCFPGA_MGR_ADDRESS + 0x10))
 #define fpga_gpo_read() gpo_copy //readl((void*)(SOCFPGA_MGR_ADDRESS + 0x10))
 #define fpga_gpi_read() (int)readl((void*)(SOCFPGA_MGR_ADDRESS + 0x14))
+#endif
 
 void fpga_core_write(uint32_t offset, uint32_t value)
 {
@@ -580,6 +940,11 @@ int fpga_get_io_type()
 
 void reboot(int cold)
 {
+	FileSaveConfigFlush();
+	blockcache_flush(-1);
+
+	// savestates and config files may still be written on the pool
+	offload_stop();
 	sync();
 	fpga_core_reset(1);
 
@@ -612,13 +977,19 @@ char *getappname()
 
 void app_restart(const char *path, const char *xml, const char *exe)
 {
-	sync();
+	FileSaveConfigFlush();
 	fpga_core_reset(1);
 
 	input_switch(0);
 	input_uinp_destroy();
 
+	blockcache_flush(-1);
+	FileZipCacheFlush();
+
+	// the sync covers the writes drained from the pool
 	offload_stop();
+	sync();
+	launch_switch();
 
 	const char *appname = exe ? exe : getappname();
 	printf("restarting to %s\n", appname);
@@ -646,6 +1017,7 @@ int is_fpga_ready(int quick)
 
 #define SSPI_STROBE  (1<<17)
 #define SSPI_ACK     SSPI_STROBE
+#define SSPI_ALL_EN  (7<<18)
 
 void fpga_spi_en(uint32_t mask, uint32_t en)
 {
@@ -667,8 +1039,14 @@ void fpga_wait_to_reset()
 	reboot(0);
 }
 
+uint32_t fpga_spi_words = 0;
+int32_t fpga_spi_first = 0;
+
 uint16_t fpga_spi(uint16_t word)
 {
+	fpga_spi_words++;
+	if (fpga_spi_first < 0) fpga_spi_first = word;
+
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE)) | word;
 
 	fpga_gpo_write(gpo);
@@ -704,6 +1082,9 @@ uint16_t fpga_spi(uint16_t word)
 
 uint16_t fpga_spi_fast(uint16_t word)
 {
+	fpga_spi_words++;
+	if (fpga_spi_first < 0) fpga_spi_first = word;
+
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE)) | word;
 	fpga_gpo_write(gpo);
 	fpga_gpo_write(gpo | SSPI_STROBE);
@@ -711,183 +1092,40 @@ uint16_t fpga_spi_fast(uint16_t word)
 	return (uint16_t)fpga_gpi_read();
 }
 
-void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
+// Block transfer engine. Every word takes one GPO write with data and one
+// with the strobe toggled, so the loop body is all that matters. Byte order
+// is fixed at compile time (REV16 instead of shifts for big endian) and the
+// inner loop is unrolled 16x.
+template<typename T, bool SWAP>
+static inline uint32_t spi_pack(T val)
 {
-	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-	uint32_t gpo = gpoH;
-
-	// should be optimized for speed by compiler automatically
-	while (length--)
-	{
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-	}
-	fpga_gpo_write(gpo);
+	uint16_t w = val;
+	return SWAP ? __builtin_bswap16(w) : w;
 }
 
-void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
-{
-	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-	uint32_t rem = length % 16;
-	length /= 16;
-
-	// not optimized by compiler automatically
-	// so do manual optimization for speed.
-	while (length--)
-	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-	}
-
-	while (rem--)
-	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint16_t)fpga_gpi_read();
-	}
-}
-
-void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
+template<typename T, bool SWAP>
+static inline void spi_block_write_t(const T *buf, uint32_t length)
 {
+	fpga_spi_words += length;
 	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t gpo = gpoH;
 	uint32_t rem = length % 16;
 	length /= 16;
 
-	// not optimized by compiler automatically
-	// so do manual optimization for speed.
 	while (length--)
 	{
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-
-		gpo = gpoH | *buf++;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
+#pragma GCC unroll 16
+		for (int i = 0; i < 16; i++)
+		{
+			gpo = gpoH | spi_pack<T, SWAP>(*buf++);
+			fpga_gpo_writeN(gpo);
+			fpga_gpo_writeN(gpo | SSPI_STROBE);
+		}
 	}
 
 	while (rem--)
 	{
-		gpo = gpoH | *buf++;
+		gpo = gpoH | spi_pack<T, SWAP>(*buf++);
 		fpga_gpo_writeN(gpo);
 		fpga_gpo_writeN(gpo | SSPI_STROBE);
 	}
@@ -895,116 +1133,103 @@ void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
 	fpga_gpo_write(gpo);
 }
 
-void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
+template<typename T, bool SWAP>
+static inline void spi_block_read_t(T *buf, uint32_t length)
 {
+	fpga_spi_words += length;
 	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
 	uint32_t rem = length % 16;
 	length /= 16;
 
-	// not optimized by compiler automatically
-	// so do manual optimization for speed.
 	while (length--)
 	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
-
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
+#pragma GCC unroll 16
+		for (int i = 0; i < 16; i++)
+		{
+			fpga_gpo_writeN(gpo | SSPI_STROBE);
+			fpga_gpo_writeN(gpo);
+			*buf++ = (T)spi_pack<uint16_t, SWAP>((uint16_t)fpga_gpi_read());
+		}
 	}
 
 	while (rem--)
 	{
 		fpga_gpo_writeN(gpo | SSPI_STROBE);
 		fpga_gpo_writeN(gpo);
-		*buf++ = (uint8_t)fpga_gpi_read();
+		*buf++ = (T)spi_pack<uint16_t, SWAP>((uint16_t)fpga_gpi_read());
 	}
 }
 
-void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
+void fpga_spi_fast_block_write(const uint16_t *buf, uint32_t length)
 {
-	uint32_t gpoH = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
-	uint32_t gpo = gpoH;
+	spi_block_write_t<uint16_t, false>(buf, length);
+}
 
-	// should be optimized for speed by compiler automatically
-	while (length--)
-	{
-		uint16_t tmp = *buf++;
-		tmp = (tmp << 8) | (tmp >> 8);
-		gpo = gpoH | tmp;
-		fpga_gpo_writeN(gpo);
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-	}
-	fpga_gpo_write(gpo);
+void fpga_spi_fast_block_read(uint16_t *buf, uint32_t length)
+{
+	spi_block_read_t<uint16_t, false>(buf, length);
+}
+
+void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length)
+{
+	spi_block_write_t<uint8_t, false>(buf, length);
+}
+
+void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length)
+{
+	spi_block_read_t<uint8_t, false>(buf, length);
+}
+
+void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length)
+{
+	spi_block_write_t<uint16_t, true>(buf, length);
 }
 
 void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length)
 {
-	uint32_t gpo = (fpga_gpo_read() & ~(0xFFFF | SSPI_STROBE));
+	spi_block_read_t<uint16_t, true>(buf, length);
+}
 
-	// should be optimized for speed by compiler automatically
-	while (length--)
+// Measures raw throughput of every block transfer variant. All chip selects
+// are released while it runs, so the core ignores the strobes.
+void fpga_spi_bench()
+{
+	static uint16_t buf[32768];
+	const uint32_t loops = 16;
+	const uint32_t bytes = sizeof(buf) * loops;
+
+	struct
 	{
-		fpga_gpo_writeN(gpo | SSPI_STROBE);
-		fpga_gpo_writeN(gpo);
-		uint16_t tmp = (uint16_t)fpga_gpi_read();
-		*buf++ = (tmp << 8) | (tmp >> 8);
+		const char *name;
+		int kind;
+	} variants[] =
+	{
+		{ "write16", 0 }, { "read16", 1 }, { "write8", 2 }, { "read8", 3 }, { "write_be", 4 }, { "read_be", 5 }
+	};
+
+	uint32_t gpo_saved = fpga_gpo_read();
+	fpga_gpo_write(gpo_saved & ~(SSPI_ALL_EN | SSPI_STROBE));
+
+	for (uint32_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++) buf[i] = i;
+
+	for (auto &v : variants)
+	{
+		uint64_t start = profiling_time_us();
+		for (uint32_t n = 0; n < loops; n++)
+		{
+			switch (v.kind)
+			{
+			case 0: fpga_spi_fast_block_write(buf, sizeof(buf) / 2); break;
+			case 1: fpga_spi_fast_block_read(buf, sizeof(buf) / 2); break;
+			case 2: fpga_spi_fast_block_write_8((uint8_t*)buf, sizeof(buf)); break;
+			case 3: fpga_spi_fast_block_read_8((uint8_t*)buf, sizeof(buf)); break;
+			case 4: fpga_spi_fast_block_write_be(buf, sizeof(buf) / 2); break;
+			case 5: fpga_spi_fast_block_read_be(buf, sizeof(buf) / 2); break;
+			}
+		}
+		uint64_t us = profiling_time_us() - start;
+		printf("spi_bench %-8s: %llu us, %.2f MB/s\n", v.name, us, us ? (bytes / (double)us) : 0.0);
 	}
+
+	fpga_gpo_write(gpo_saved);
 }
@@ -19,6 +19,12 @@ void fpga_spi_fast_block_write_8(const uint8_t *buf, uint32_t length);
 void fpga_spi_fast_block_read_8(uint8_t *buf, uint32_t length);
 void fpga_spi_fast_block_write_be(const uint16_t *buf, uint32_t length);
 void fpga_spi_fast_block_read_be(uint16_t *buf, uint32_t length);
+void fpga_spi_bench();
+
+// Bus words moved so far and the first word since fpga_spi_first was set
+// to -1, for the SPI statistics in spi.cpp.
+extern uint32_t fpga_spi_words;
+extern int32_t fpga_spi_first;
 
 void fpga_set_led(uint32_t on);
 int  fpga_get_buttons();
@@ -35,6 +41,9 @@ int fpga_get_io_version();
 
 int fpga_load_rbf(const char *name, const char *cfg = 0, const char *xml = 0);
 
+// Copies the next rbf_pin core into the RAM cache on the offload pool.
+void fpga_rbf_preload();
+
 void reboot(int cold);
 void app_restart(const char *path, const char *xml = 0, const char *exe = 0);
 char *getappname();
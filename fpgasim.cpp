@@ -0,0 +1,297 @@
+#ifdef FPGA_SIM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "fpgasim.h"
+#include "user_io.h"
+#include "file_io.h"
+#include "ide.h"
+#include "profiling.h"
+
+#define SIM_STROBE   (1<<17)
+#define SIM_IO_EN    (1<<20)
+#define SIM_CORE_RUN 0x80000000
+
+#define SIM_MAX_CMDS 65536
+
+static uint32_t sim_gpo = 0;
+static uint32_t sim_gpi = 0;
+
+// bus time charged for every strobe, the HPS to FPGA bridge needs two
+// register writes per word
+static uint32_t word_ns = 60;
+
+// current IO frame, started by the chip select
+static int frame_pos = -1;
+static uint16_t frame_cmd = 0;
+static uint32_t frame_addr = 0;
+static uint16_t frame_regs[6];
+static uint32_t frame_words = 0;
+
+// core side of the IDE stream
+struct sim_ide_t
+{
+	uint32_t base;
+	uint16_t req;          // pending request for ide_check, 4 - command, 5 - data
+	uint8_t cmd;
+	uint8_t count;
+	uint32_t lba;
+	uint32_t lba_max;
+
+	int regs_done;         // set_regs of the current chunk arrived
+	int data_done;         // data of the current chunk arrived
+	uint8_t status;
+
+	uint32_t cmds_left;
+	uint64_t cmd_start_us;
+	uint64_t cmd_bus_ns;
+	int failed;
+};
+
+static sim_ide_t ide_sim = {};
+static uint64_t bus_ns = 0;
+static uint64_t data_bytes = 0;
+static uint32_t lat_us[SIM_MAX_CMDS];
+static uint32_t lat_num = 0;
+
+static void ide_sim_issue(uint8_t cmd, uint8_t count)
+{
+	ide_sim.cmd = cmd;
+	ide_sim.count = count;
+	ide_sim.regs_done = 0;
+	ide_sim.data_done = 0;
+	ide_sim.cmd_start_us = profiling_time_us();
+	ide_sim.cmd_bus_ns = bus_ns;
+	ide_sim.req = 4;
+}
+
+// register block as ide_get_regs() expects it, LBA mode on drive 0
+static uint16_t ide_sim_regs(uint32_t idx)
+{
+	uint32_t lba = ide_sim.lba;
+	uint32_t data[3] =
+	{
+		((uint32_t)ide_sim.count << 16) | ((lba & 0xFF) << 24),
+		(lba >> 8) & 0xFFFF,
+		(((lba >> 24) & 0xF) << 16) | (1 << 22) | ((uint32_t)ide_sim.cmd << 24)
+	};
+
+	return (idx < 6) ? (uint16_t)(data[idx / 2] >> ((idx & 1) * 16)) : 0;
+}
+
+static void ide_sim_done()
+{
+	uint64_t bus = bus_ns - ide_sim.cmd_bus_ns;
+	if (ide_sim.cmd != 0xC6 && lat_num < SIM_MAX_CMDS)
+	{
+		lat_us[lat_num++] = (uint32_t)(profiling_time_us() - ide_sim.cmd_start_us + bus / 1000);
+	}
+
+	if (ide_sim.status & ATA_STATUS_ERR)
+	{
+		printf("sim: command %02X failed\n", ide_sim.cmd);
+		ide_sim.failed = 1;
+		ide_sim.cmds_left = 0;
+		return;
+	}
+
+	if (ide_sim.cmd == 0xC4)
+	{
+		ide_sim.lba += ide_sim.count;
+		if (ide_sim.lba + ide_sim.count > ide_sim.lba_max) ide_sim.lba = 0;
+		if (ide_sim.cmds_left) ide_sim.cmds_left--;
+	}
+
+	if (ide_sim.cmds_left) ide_sim_issue(0xC4, ide_sim.count);
+}
+
+// a chunk is complete once both the registers and its data went out,
+// the order depends on io_fast
+static void ide_sim_chunk()
+{
+	if (!ide_sim.regs_done) return;
+
+	if (ide_sim.status & ATA_STATUS_DRQ)
+	{
+		if (!ide_sim.data_done) return;
+
+		ide_sim.regs_done = 0;
+		ide_sim.data_done = 0;
+		if (!(ide_sim.status & ATA_STATUS_END))
+		{
+			ide_sim.req = 5;
+			return;
+		}
+	}
+
+	ide_sim.regs_done = 0;
+	ide_sim_done();
+}
+
+static uint16_t frame_word(uint16_t word)
+{
+	int pos = frame_pos++;
+	if (!pos)
+	{
+		frame_cmd = word;
+		frame_addr = 0;
+		frame_words = 0;
+		return 0;
+	}
+
+	if (pos == 1) frame_addr = word;
+	if (pos == 2) frame_addr |= (uint32_t)word << 16;
+	if (pos < 3 && frame_cmd != UIO_DMA_SDIO) return 0;
+
+	switch (frame_cmd)
+	{
+	case UIO_DMA_SDIO:
+		if (pos == 1)
+		{
+			uint16_t req = ide_sim.req;
+			ide_sim.req = 0;
+			return req;
+		}
+		break;
+
+	case UIO_DMA_READ:
+		if (frame_addr == ide_sim.base) return ide_sim_regs(pos - 3);
+		break;
+
+	case UIO_DMA_WRITE:
+		if (frame_addr == ide_sim.base && pos - 3 < 6) frame_regs[pos - 3] = word;
+		frame_words++;
+		break;
+	}
+
+	return 0;
+}
+
+static void frame_end()
+{
+	if (frame_cmd == UIO_DMA_WRITE && frame_words)
+	{
+		if (frame_addr == ide_sim.base)
+		{
+			ide_sim.status = frame_regs[5] >> 8;
+			ide_sim.regs_done = 1;
+		}
+		else if (frame_addr == ide_sim.base + 255)
+		{
+			data_bytes += frame_words * 2;
+			ide_sim.data_done = 1;
+		}
+
+		ide_sim_chunk();
+	}
+
+	frame_pos = -1;
+}
+
+void fpgasim_gpo_write(uint32_t value)
+{
+	uint32_t old = sim_gpo;
+	sim_gpo = value;
+
+	if ((value & SIM_IO_EN) && !(old & SIM_IO_EN)) frame_pos = 0;
+
+	// the ack follows the strobe right away, the delay is only accounted
+	if ((value ^ old) & SIM_STROBE)
+	{
+		sim_gpi = (sim_gpi & ~SIM_STROBE) | (value & SIM_STROBE);
+		if ((value & SIM_STROBE) && frame_pos >= 0)
+		{
+			sim_gpi = (sim_gpi & ~0xFFFF) | frame_word(value & 0xFFFF);
+			bus_ns += word_ns;
+		}
+	}
+
+	if (!(value & SIM_IO_EN) && (old & SIM_IO_EN)) frame_end();
+}
+
+uint32_t fpgasim_gpi_read()
+{
+	// core id is read with the core held in reset
+	if (!(sim_gpo & SIM_CORE_RUN)) return (0x5CA623 << 8) | CORE_TYPE_8BIT;
+	return sim_gpi;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int sim_ide(int argc, char *argv[])
+{
+	if (argc < 1)
+	{
+		printf("usage: --sim ide <image> [MB] [sectors] [word_ns]\n");
+		return 1;
+	}
+
+	uint32_t mb = (argc > 1) ? strtoul(argv[1], 0, 0) : 64;
+	uint32_t spb = (argc > 2) ? strtoul(argv[2], 0, 0) : 16;
+	if (argc > 3) word_ns = strtoul(argv[3], 0, 0);
+	if (!spb || spb > ide_io_max_size) spb = ide_io_max_size;
+
+	if (!ide_open(0, argv[0])) return 1;
+
+	drive_t *drive = &ide_inst[0].drive[0];
+	if (drive->cd || !drive->f || drive->f->size < spb * 512)
+	{
+		printf("sim: %s is not a usable HDD image\n", argv[0]);
+		return 1;
+	}
+
+	memset(&ide_sim, 0, sizeof(ide_sim));
+	ide_sim.base = ide_inst[0].base;
+	ide_sim.lba_max = (uint32_t)(drive->f->size >> 9);
+	if (ide_sim.lba_max > 0x0FFFFFFF) ide_sim.lba_max = 0x0FFFFFFF;
+	ide_sim.cmds_left = (uint32_t)(((uint64_t)mb << 11) / spb);
+	if (!ide_sim.cmds_left) ide_sim.cmds_left = 1;
+
+	printf("sim: ide stream of %u x %u sectors, %uns per SPI word\n", ide_sim.cmds_left, spb, word_ns);
+
+	// SET MULTIPLE first, as the guest BIOS does
+	ide_sim_issue(0xC6, spb);
+
+	bus_ns = 0;
+	data_bytes = 0;
+	lat_num = 0;
+
+	uint64_t start = profiling_time_us();
+	while (ide_sim.cmds_left || ide_sim.req)
+	{
+		uint16_t req = ide_check();
+		ide_io(0, req & 7);
+	}
+	uint64_t cpu_us = profiling_time_us() - start;
+
+	if (ide_sim.failed) return 1;
+
+	double total_us = cpu_us + bus_ns / 1000.0;
+	printf("sim: %llu bytes, cpu %llu us, bus %llu us\n", data_bytes, cpu_us, bus_ns / 1000);
+	printf("sim: %.2f MB/s (cpu only %.2f MB/s)\n", total_us ? data_bytes / total_us : 0.0, cpu_us ? data_bytes / (double)cpu_us : 0.0);
+
+	if (lat_num)
+	{
+		qsort(lat_us, lat_num, sizeof(lat_us[0]), cmp_u32);
+		printf("sim: command latency p50/p99/max: %u/%u/%u us\n", lat_us[lat_num / 2], lat_us[(uint64_t)lat_num * 99 / 100], lat_us[lat_num - 1]);
+	}
+
+	return 0;
+}
+
+int fpgasim_main(int argc, char *argv[])
+{
+	if (argc > 0 && !strcmp(argv[0], "ide")) return sim_ide(argc - 1, argv + 1);
+
+	printf("usage: --sim ide <image> [MB] [sectors] [word_ns]\n");
+	return 1;
+}
+
+#endif
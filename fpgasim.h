@@ -0,0 +1,20 @@
+#ifndef FPGASIM_H
+#define FPGASIM_H
+
+#include <inttypes.h>
+
+// Simulated FPGA bridge for benchmarking the I/O paths without a board,
+// built with "make FPGA_SIM=1". GPO/GPI go to a model of the SPI strobe
+// protocol and shmem_map() returns plain memory. The model plays the core
+// side of a request stream and charges a fixed bus time per SPI word, so
+// the results are the CPU cost of Main plus a modelled bus cost.
+
+void fpgasim_gpo_write(uint32_t value);
+uint32_t fpgasim_gpi_read();
+
+// "MiSTer --sim ide <image> [MB] [sectors] [word_ns]"
+// Services an ao486 style stream of READ MULTIPLE commands from unit 0
+// through ide_io() and prints throughput and command latency.
+int fpgasim_main(int argc, char *argv[]);
+
+#endif
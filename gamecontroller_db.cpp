@@ -2,7 +2,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
 #include "input.h"
 #include "file_io.h"
 #include "user_io.h"
@@ -449,21 +455,188 @@ static bool parse_mapping_string(char *map_str, char *guid, int dev_fd, uint32_t
 #define GCDB_DIR  "/media/fat/linux/gamecontrollerdb/"
 
 
-bool read_controller_map_from_file(char *fname, char *guid, int dev_fd, uint32_t *fill_map)
+// Lines of a DB file indexed by the hash of their GUID, kept in tmpfs next
+// to the DB mtime and size, so hotplug reads only the candidate lines.
+#define GCDB_INDEX_DIR   "/tmp/gcdbidx"
+#define GCDB_INDEX_MAGIC 0x47434401
+
+struct gcdb_line_t
+{
+	uint32_t hash;   // of the lower case GUID, 0 for a shorter (prefix) GUID
+	uint32_t offset;
+	uint32_t len;
+};
+
+struct gcdb_index_hdr_t
+{
+	uint32_t magic;
+	uint32_t count;
+	int64_t src_mtime;
+	int64_t src_size;
+};
+
+struct gcdb_index_t
+{
+	char path[256];
+	int64_t mtime;
+	int64_t size;
+	std::vector<gcdb_line_t> lines; // sorted by hash, then offset
+};
+
+static gcdb_index_t gcdb_index[2];
+static int gcdb_index_next = 0;
+
+static uint32_t gcdb_hash(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) hash = (hash ^ (uint8_t)tolower(str[i])) * 16777619u;
+	return hash ? hash : 1;
+}
+
+static bool gcdb_line_less(const gcdb_line_t &a, const gcdb_line_t &b)
+{
+	return (a.hash != b.hash) ? (a.hash < b.hash) : (a.offset < b.offset);
+}
+
+static void gcdb_index_name(const char *path, char *name, char *tmp_name)
+{
+	uint32_t hash = gcdb_hash(path, strlen(path));
+	sprintf(name, GCDB_INDEX_DIR "/%08X", hash);
+	sprintf(tmp_name, GCDB_INDEX_DIR "/.%08X", hash);
+}
+
+static bool gcdb_index_load(gcdb_index_t *idx)
+{
+	char name[64], tmp_name[64];
+	gcdb_index_name(idx->path, name, tmp_name);
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	gcdb_index_hdr_t hdr;
+	bool ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == GCDB_INDEX_MAGIC &&
+		hdr.src_mtime == idx->mtime && hdr.src_size == idx->size;
+	if (ok)
+	{
+		idx->lines.resize(hdr.count);
+		size_t size = hdr.count * sizeof(gcdb_line_t);
+		ok = !size || read(fd, idx->lines.data(), size) == (ssize_t)size;
+	}
+	close(fd);
+	return ok;
+}
+
+static void gcdb_index_store(const gcdb_index_t *idx)
+{
+	mkdir(GCDB_INDEX_DIR, 0755);
+
+	char name[64], tmp_name[64];
+	gcdb_index_name(idx->path, name, tmp_name);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	gcdb_index_hdr_t hdr = { GCDB_INDEX_MAGIC, (uint32_t)idx->lines.size(), idx->mtime, idx->size };
+	size_t size = hdr.count * sizeof(gcdb_line_t);
+	bool ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		(!size || write(fd, idx->lines.data(), size) == (ssize_t)size);
+	close(fd);
+
+	if (!ok || rename(tmp_name, name)) unlink(tmp_name);
+}
+
+static bool gcdb_index_build(gcdb_index_t *idx)
 {
+	PROFILE_FUNCTION();
+
 	fileTextReader reader;
+	if (!FileOpenTextReader(&reader, idx->path)) return false;
+
+	const char *line;
+	while ((line = FileReadLine(&reader)))
+	{
+		const char *gcom = strchr(line, ',');
+		if (!gcom || gcom - line > GUID_LEN - 1) continue; // never matches
+
+		gcdb_line_t entry;
+		entry.hash = (gcom - line == GUID_LEN - 1) ? gcdb_hash(line, GUID_LEN - 1) : 0;
+		entry.offset = line - reader.buffer;
+		entry.len = strlen(line);
+		idx->lines.push_back(entry);
+	}
+
+	std::sort(idx->lines.begin(), idx->lines.end(), gcdb_line_less);
+	printf("Gamecontrollerdb: indexed %d entries of %s\n", (int)idx->lines.size(), idx->path);
+	return true;
+}
+
+static gcdb_index_t *gcdb_index_get(const char *path)
+{
+	struct stat64 st;
+	if (stat64(path, &st)) return NULL;
+
+	int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	gcdb_index_t *idx = NULL;
+	for (int i = 0; i < 2; i++)
+	{
+		if (!strcmp(gcdb_index[i].path, path)) idx = &gcdb_index[i];
+	}
+
+	if (idx && idx->mtime == mtime && idx->size == st.st_size) return idx;
+
+	if (!idx)
+	{
+		idx = &gcdb_index[gcdb_index_next];
+		gcdb_index_next = (gcdb_index_next + 1) % 2;
+		snprintf(idx->path, sizeof(idx->path), "%s", path);
+	}
+
+	idx->mtime = mtime;
+	idx->size = st.st_size;
+	idx->lines.clear();
+
+	if (gcdb_index_load(idx)) return idx;
+	if (gcdb_index_build(idx))
+	{
+		gcdb_index_store(idx);
+		return idx;
+	}
+
+	idx->path[0] = 0;
+	return NULL;
+}
+
+bool read_controller_map_from_file(char *fname, char *guid, int dev_fd, uint32_t *fill_map)
+{
 	char matched[1024] = {};
 	char *map_start = NULL;
 
-	if (FileOpenTextReader(&reader, fname))
+	gcdb_index_t *idx = gcdb_index_get(fname);
+	int fd = idx ? open(fname, O_RDONLY | O_CLOEXEC) : -1;
+	if (fd >= 0)
 	{
-		const char *line;
 		printf("Gamecontrollerdb: searching for GUID %s in file %s\n", guid, fname);
-		while ((line = FileReadLine(&reader)))
+
+		// full GUID matches and the prefix entries (hash 0), in file order
+		gcdb_line_t key = { gcdb_hash(guid, strlen(guid)), 0, 0 };
+		auto full = std::lower_bound(idx->lines.begin(), idx->lines.end(), key, gcdb_line_less);
+		auto part = idx->lines.begin();
+
+		std::vector<uint32_t> cand;
+		for (; full != idx->lines.end() && full->hash == key.hash; full++) cand.push_back(full - idx->lines.begin());
+		for (; part != idx->lines.end() && !part->hash; part++) cand.push_back(part - idx->lines.begin());
+		std::sort(cand.begin(), cand.end(), [idx](uint32_t a, uint32_t b) { return idx->lines[a].offset < idx->lines[b].offset; });
+
+		std::vector<char> line;
+		for (uint32_t n : cand)
 		{
-			if (line[0] == '#') continue;
-			const char *gcom = strchr(line, ',');
-			if (!strncasecmp(line, guid, gcom-line))
+			const gcdb_line_t *entry = &idx->lines[n];
+			line.resize(entry->len + 1);
+			if (pread(fd, line.data(), entry->len, entry->offset) != (ssize_t)entry->len) continue;
+			line[entry->len] = 0;
+
+			const char *gcom = strchr(line.data(), ',');
+			if (!strncasecmp(line.data(), guid, gcom - line.data()))
 			{
 				if (cdb_entry_matches((char *)gcom))
 				{
@@ -475,7 +648,7 @@ bool read_controller_map_from_file(char *fname, char *guid, int dev_fd, uint32_t
 				}
 			}
 		}
-
+		close(fd);
 	}
 	if (matched[0] != 0)
 	{
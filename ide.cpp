@@ -20,6 +20,11 @@
 #include "file_io.h"
 #include "hardware.h"
 #include "ide.h"
+#include "offload.h"
+#include "iotrace.h"
+#include "blockcache.h"
+#include "blockdev.h"
+#include "cfg.h"
 
 #if 0
 	#define dbg_printf     printf
@@ -77,6 +82,30 @@ void ide_recvbuf(ide_config *ide, uint16_t reg, uint32_t length, uint16_t *data)
 const uint32_t ide_io_max_size = 32;
 uint8_t ide_buf[ide_io_max_size * 512];
 
+// HDD reads are double buffered: the next chunk is read on the offload
+// thread while the current one goes over SPI. After the last chunk of a
+// command the read-ahead stays armed for a sequential follow-up command.
+static uint8_t ide_rbuf[2][2][ide_io_max_size * 512];
+
+struct ide_readahead_t
+{
+	drive_t *drive;
+	uint32_t lba;
+	uint32_t cnt;
+	uint8_t *buf;
+	int len;
+	offload_job_t job;
+};
+
+static ide_readahead_t ahead = {};
+
+static void readahead_drop(drive_t *drive = nullptr)
+{
+	if (!ahead.drive || (drive && drive != ahead.drive)) return;
+	offload_wait(ahead.job);
+	ahead.drive = nullptr;
+}
+
 ide_config ide_inst[2] = {};
 
 uint16_t ide_check()
@@ -89,8 +118,20 @@ uint16_t ide_check()
 	return res;
 }
 
+// pending writes must land before the image file is closed or reused
+static void ide_cache_drop(fileTYPE *f)
+{
+	blockdev_detach(f);
+	for (int i = 0; i < 4; i++)
+	{
+		if (ide_inst[i >> 1].drive[i & 1].f == f) blockcache_drop(BLOCKCACHE_IDE(i));
+	}
+}
+
 int ide_img_mount(fileTYPE *f, const char *name, int rw)
 {
+	if (ahead.drive && ahead.drive->f == f) readahead_drop();
+	ide_cache_drop(f);
 	FileClose(f);
 	int writable = 0, ret = 0;
 
@@ -104,7 +145,7 @@ int ide_img_mount(fileTYPE *f, const char *name, int rw)
 		}
 		else {
 			writable = rw && FileCanWrite(name);
-			ret = FileOpenEx(f, name, writable ? (O_RDWR | O_SYNC) : O_RDONLY);
+			ret = (!writable && FileOpenZipCache(f, name)) || FileOpenEx(f, name, writable ? (O_RDWR | O_SYNC) : O_RDONLY);
 			if (!ret) printf("Failed to open file %s\n", name);
 		}
 	}
@@ -233,7 +274,7 @@ static void get_rdb_geometry(RigidDiskBlock *rdb, chs_t *chs, uint64_t size)
 	}
 }
 
-static void guess_geometry(fileTYPE *f, chs_t *chs, int allow_vrdb)
+static void guess_geometry(int dev, fileTYPE *f, chs_t *chs, int allow_vrdb)
 {
 	uint8_t flg = 0;
 	chs->offset = 0;
@@ -241,7 +282,7 @@ static void guess_geometry(fileTYPE *f, chs_t *chs, int allow_vrdb)
 	for (int i = 0; i < 16; ++i)
 	{
 		struct RigidDiskBlock *rdb = (struct RigidDiskBlock *)ide_buf;
-		if (!FileReadSec(f, ide_buf)) break;
+		if (blockdev_read(dev, f, i * 512, ide_buf, 512) != 512) break;
 		for (int i = 0; i < 512; i++) flg |= ide_buf[i];
 
 		if (rdb->rdb_ID == RDB_MAGIC)
@@ -320,14 +361,13 @@ static uint32_t checksum_rdb(uint32_t *p, int set)
 	return 0;
 }
 
-static void fill_fake_rdb(drive_t *drive, uint32_t sector, int cnt)
+// RDSK and PART blocks of a virtual RDB, built once per mount
+static void build_fake_rdb(drive_t *drive)
 {
-	printf("fill_fake_rdb(%u,%d)\n", sector, cnt);
-
-	uint8_t *buff = ide_buf;
-	memset(ide_buf, 0, sizeof(ide_buf));
+	uint8_t *buff = drive->fake_rdb[0];
+	memset(drive->fake_rdb, 0, sizeof(drive->fake_rdb));
 
-	while (cnt)
+	for (uint32_t sector = 0; sector < 2; sector++)
 	{
 		// if we're asked for LBA 0 we create an RDSK block, and if LBA 1, a PART block
 		if (sector == 0)
@@ -395,32 +435,37 @@ static void fill_fake_rdb(drive_t *drive, uint32_t sector, int cnt)
 			uint32_t *p = (uint32_t*)buff;
 			for (int i = 0; i < 64; i++) p[i] = SWAP(p[i]);
 		}
-		else
-		{
-			break;
-		}
 
 		checksum_rdb((uint32_t*)buff, 1);
 		//hexdump(buff, 256);
-		cnt--;
-		sector++;
 		buff += 512;
 	}
 }
 
+static void fill_fake_rdb(drive_t *drive, uint32_t sector, int cnt, uint8_t *buff)
+{
+	dbg_printf("fill_fake_rdb(%u,%d)\n", sector, cnt);
+
+	memset(buff, 0, sizeof(ide_buf));
+	for (; cnt && sector < 2; cnt--, sector++, buff += 512) memcpy(buff, drive->fake_rdb[sector], 512);
+}
+
 void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, int offset, int type)
 {
 	int drv = (drvnum & 1);
 	int port = (drvnum >> 1);
 
 	drive_t *drive = &ide_inst[port].drive[drv];
+	readahead_drop(drive);
+	blockcache_drop(BLOCKCACHE_IDE(drvnum));
 
 	ide_inst[port].base = port ? IDE1_BASE : IDE0_BASE;
 	ide_inst[port].drive[drv].drvnum = drvnum;
 
-	if (drive->f && (f != drive->f) && drive->f->opened())
+	if (drive->f && (f != drive->f))
 	{
-		FileClose(drive->f);
+		blockdev_detach(drive->f);
+		if (drive->f->opened()) FileClose(drive->f);
 	}
 
 	drive->f = f;
@@ -471,6 +516,7 @@ void ide_img_set(uint32_t drvnum, fileTYPE *f, int cd, int sectors, int heads, i
 			if (offset && drive->cylinders < 65535) drive->cylinders++;
 			drive->offset = offset;
 			drive->type = type;
+			if (offset && !type) build_fake_rdb(drive);
 		}
 
 		uint16_t identify[256] =
@@ -744,133 +790,203 @@ inline uint16_t get_cnt(ide_config *ide)
 	return cnt;
 }
 
-inline int readhdd(drive_t *drive, uint32_t lba, int cnt)
+// With ide_write_delay the block cache owns all I/O of the image, reads
+// have to see the writes it still holds.
+static int ide_cached(drive_t *drive)
+{
+	return drive->f && !drive->cd && blockdev_cached(BLOCKDEV_IDE(drive->drvnum));
+}
+
+inline int readhdd(drive_t *drive, uint32_t lba, int cnt, uint8_t *buf)
 {
 	if (lba < drive->offset)
 	{
-		if (!drive->type) fill_fake_rdb(drive, lba, cnt);
-		else memset(ide_buf, 0, sizeof(ide_buf));
+		if (!drive->type) fill_fake_rdb(drive, lba, cnt, buf);
+		else memset(buf, 0, sizeof(ide_buf));
 		return 1;
 	}
 	else
 	{
-		return FileReadAdv(drive->f, ide_buf, cnt * 512, -1);
+		__off64_t pos = (__off64_t)(lba - drive->offset) << 9;
+		return blockdev_read(BLOCKDEV_IDE(drive->drvnum), drive->f, pos, buf, cnt * 512);
 	}
 }
 
-static void process_read(ide_config *ide, int multi)
+static void readahead_start(drive_t *drive, uint32_t lba, uint32_t cnt, uint8_t *buf)
+{
+	readahead_drop();
+
+	// only positional reads of plain files are safe off the main thread,
+	// images still being extracted would just park the worker
+	// the block cache does its own read-ahead
+	fileTYPE *f = drive->f;
+	if (!cnt || lba < drive->offset || !f || !f->filp || f->zcache || ide_cached(drive)) return;
+
+	__off64_t pos = (__off64_t)(lba - drive->offset) << 9;
+	if (pos >= f->size) return;
+
+	ide_readahead_t *ra = &ahead;
+	int len = cnt * 512;
+	ra->lba = lba;
+	ra->cnt = cnt;
+	ra->buf = buf;
+	ra->len = -1;
+	ra->job = offload_try_work([ra, f, pos, len]() { ra->len = FileReadAt(f, pos, ra->buf, len, -1); }, OFFLOAD_IO);
+	if (ra->job) ra->drive = drive;
+}
+
+// returns the buffer holding cnt sectors from lba, null sectors are zeroed
+static uint8_t *fetchhdd(ide_config *ide, drive_t *drive, uint32_t lba, uint32_t cnt, uint8_t *buf)
+{
+	int len = 0;
+	if (ahead.drive == drive && ahead.lba == lba && ahead.cnt >= cnt)
+	{
+		offload_wait(ahead.job);
+		ahead.drive = nullptr;
+		buf = ahead.buf;
+		len = ahead.len;
+	}
+	else
+	{
+		readahead_drop();
+		if (!ide->null) len = readhdd(drive, lba, cnt, buf);
+	}
+
+	if (!ide->null) ide->null = (len <= 0);
+	if (ide->null) memset(buf, 0, cnt * 512);
+	return buf;
+}
+
+// sends the prepared chunk, then prepares the next one and returns to the
+// main loop until the guest asks for it
+static void read_send(ide_config *ide)
 {
+	drive_t *drive = &ide->drive[ide->regs.drv];
+	uint8_t (*rbuf)[ide_io_max_size * 512] = ide_rbuf[ide - ide_inst];
 	uint32_t lba = get_lba(ide);
-	uint16_t ide_req = 0;
+	uint32_t cnt = ide->io_cnt;
+	uint8_t *buf = ide->io_buf;
 
-	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
+	lba += cnt;
+	ide->regs.sector_count -= cnt;
+	put_lba(ide, lba);
 
-	uint32_t cnt = multi ? get_cnt(ide) : 1;
-	ide->null = !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset));
-	if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-	if (ide->null) memset(ide_buf, 0, cnt * 512);
+	// next chunk (or the next command's first one) is read during the transfer
+	uint8_t *next = (buf == rbuf[0]) ? rbuf[1] : rbuf[0];
+	uint32_t next_cnt = ide->io_multi ? get_cnt(ide) : 1;
+	if (!ide->null) readahead_start(drive, lba, next_cnt, next);
 
-	while (1)
+	ide->regs.io_size = cnt;
+	ide->regs.status = ATA_STATUS_RDP | ATA_STATUS_RDY | ATA_STATUS_DRQ | ATA_STATUS_IRQ;
+	if (!ide->regs.sector_count) ide->regs.status |= ATA_STATUS_END;
+
+	if (ide->regs.io_fast)
 	{
-		lba += cnt;
-		ide->regs.sector_count -= cnt;
-		put_lba(ide, lba);
+		ide_set_regs(ide);
+		ide_send_data(buf, cnt * 256);
+	}
+	else
+	{
+		ide_send_data(buf, cnt * 256);
+		ide->regs.status &= ~ATA_STATUS_RDP;
+		ide_set_regs(ide);
+	}
 
-		ide->regs.io_size = cnt;
-		ide->regs.status = ATA_STATUS_RDP | ATA_STATUS_RDY | ATA_STATUS_DRQ | ATA_STATUS_IRQ;
-		if (!ide->regs.sector_count) ide->regs.status |= ATA_STATUS_END;
+	if (!ide->regs.sector_count)
+	{
+		//ATA_STATUS_END will set ATA_STATUS_RDY at the end
+		ide->state = IDE_STATE_IDLE;
+		dbg2_printf("  finish\n");
+		return;
+	}
 
-		if (ide->regs.io_fast)
-		{
-			ide_set_regs(ide);
-			ide_send_data(ide_buf, cnt * 256);
-		}
-		else
-		{
-			ide_send_data(ide_buf, cnt * 256);
-			ide->regs.status &= ~ATA_STATUS_RDP;
-			ide_set_regs(ide);
-		}
+	ide->io_cnt = next_cnt;
+	ide->io_buf = fetchhdd(ide, drive, lba, next_cnt, next);
+	ide->state = IDE_STATE_WAIT_RD;
+}
 
-		if (!ide->regs.sector_count)
-		{
-			//ATA_STATUS_END will set ATA_STATUS_RDY at the end
-			ide->state = IDE_STATE_IDLE;
-			break;
-		}
+static void process_read(ide_config *ide, int multi)
+{
+	drive_t *drive = &ide->drive[ide->regs.drv];
 
-		cnt = multi ? get_cnt(ide) : 1;
-		if (!ide->null) ide->null = (readhdd(&ide->drive[ide->regs.drv], lba, cnt) <= 0);
-		if (ide->null) memset(ide_buf, 0, cnt * 512);
+	dbg2_printf("  sector_count: %d\n", ide->regs.sector_count);
 
-		ide_req = 0;
-		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
+	iotrace_add(IOTRACE_IDE, (ide - ide_inst) * 2 + ide->regs.drv, IOTRACE_READ, get_lba(ide), 512,
+		ide->regs.sector_count ? ide->regs.sector_count : 256, drive->f);
 
-		if (ide_req != 5)
-		{
-			ide->state = IDE_STATE_IDLE;
-			break;
-		}
-	}
+	ide->io_multi = multi;
+	ide->io_cnt = multi ? get_cnt(ide) : 1;
+	ide->null = 0;
+	ide->io_buf = fetchhdd(ide, drive, get_lba(ide), ide->io_cnt, ide_rbuf[ide - ide_inst][0]);
+	read_send(ide);
+}
+
+// asks the guest for the next chunk, data arrives with the next data request
+static void write_request(ide_config *ide)
+{
+	ide->io_cnt = ide->io_multi ? get_cnt(ide) : 1;
+	ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_DRQ | ide->io_irq;
+	ide->io_irq = ATA_STATUS_IRQ;
 
-	dbg2_printf("  finish\n");
+	ide->regs.io_size = ide->io_cnt;
+	ide_set_regs(ide);
+	ide->state = IDE_STATE_WAIT_WR;
 }
 
-static void process_write(ide_config *ide, int multi)
+static void write_recv(ide_config *ide)
 {
 	uint32_t lba = get_lba(ide);
-	uint32_t cnt = 1;
-	uint16_t ide_req;
+	uint32_t cnt = ide->io_cnt;
 
-	ide->null = (ide->regs.cmd != 0xFA) ? !FileSeekLBA(ide->drive[ide->regs.drv].f, (lba <= ide->drive[ide->regs.drv].offset) ? 0 : (lba - ide->drive[ide->regs.drv].offset)) : 1;
-	uint8_t irq = 0;
+	ide_recv_data(ide_buf, cnt * 256);
 
-	while (1)
+	if (ide->regs.cmd == 0xFA)
 	{
-		cnt = multi ? get_cnt(ide) : 1;
-		ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_DRQ | irq;
-		irq = ATA_STATUS_IRQ;
-
-		ide->regs.io_size = cnt;
-		ide_set_regs(ide);
-
-		ide_req = 0;
-		while (!ide_req) ide_req = (ide_check() >> ide->bitoff) & 7;
+		ide->regs.sector_count = 0;
+		char* filename = user_io_make_filepath(HomeDir(), (char*)ide_buf);
+		int drvnum = (ide->regs.head == 1) ? 0 : (ide->regs.head == 2) ? 1 : (ide->drive[ide->regs.drv].drvnum + 2);
 
-		if (ide_req != 5)
+		static const char* names[6] = { "fdd0", "fdd1", "ide00", "ide01", "ide10", "ide11" };
+		printf("Request for new image for drive %s: %s\n", names[drvnum], filename);
+		if(is_x86()) x86_set_image(drvnum, filename);
+	}
+	else
+	{
+		readahead_drop();
+		drive_t *drive = &ide->drive[ide->regs.drv];
+		if (!ide->null && lba >= drive->offset)
 		{
-			ide->state = IDE_STATE_IDLE;
-			break;
+			__off64_t pos = (__off64_t)(lba - drive->offset) << 9;
+			ide->null = !blockdev_write(BLOCKDEV_IDE(drive->drvnum), drive->f, pos, ide_buf, cnt * 512);
 		}
+		lba += cnt;
+		ide->regs.sector_count -= cnt;
+		put_lba(ide, lba);
+	}
 
-		ide_recv_data(ide_buf, cnt * 256);
-
-		if (ide->regs.cmd == 0xFA)
-		{
-			ide->regs.sector_count = 0;
-			char* filename = user_io_make_filepath(HomeDir(), (char*)ide_buf);
-			int drvnum = (ide->regs.head == 1) ? 0 : (ide->regs.head == 2) ? 1 : (ide->drive[ide->regs.drv].drvnum + 2);
+	if (!ide->regs.sector_count)
+	{
+		ide->state = IDE_STATE_IDLE;
+		ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_IRQ;
+		ide_set_regs(ide);
+		return;
+	}
 
-			static const char* names[6] = { "fdd0", "fdd1", "ide00", "ide01", "ide10", "ide11" };
-			printf("Request for new image for drive %s: %s\n", names[drvnum], filename);
-			if(is_x86()) x86_set_image(drvnum, filename);
-		}
-		else
-		{
-			if (!ide->null) ide->null = (lba < ide->drive[ide->regs.drv].offset) ? 0 : (FileWriteAdv(ide->drive[ide->regs.drv].f, ide_buf, cnt * 512, -1) <= 0);
-			lba += cnt;
-			ide->regs.sector_count -= cnt;
-			put_lba(ide, lba);
-		}
+	write_request(ide);
+}
 
-		if (!ide->regs.sector_count)
-		{
-			ide->state = IDE_STATE_IDLE;
-			ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_IRQ;
-			ide_set_regs(ide);
-			break;
-		}
+static void process_write(ide_config *ide, int multi)
+{
+	if (ide->regs.cmd != 0xFA)
+	{
+		iotrace_add(IOTRACE_IDE, (ide - ide_inst) * 2 + ide->regs.drv, IOTRACE_WRITE, get_lba(ide), 512,
+			ide->regs.sector_count ? ide->regs.sector_count : 256, ide->drive[ide->regs.drv].f);
 	}
+
+	ide->null = (ide->regs.cmd == 0xFA);
+	ide->io_multi = multi;
+	ide->io_irq = 0;
+	write_request(ide);
 }
 
 static int handle_hdd(ide_config *ide)
@@ -939,6 +1055,13 @@ static int handle_hdd(ide_config *ide)
 		ide_set_regs(ide);
 		break;
 
+	case 0xE7: // flush cache
+	case 0xEA: // flush cache ext
+		blockcache_flush(BLOCKCACHE_IDE(ide->drive[ide->regs.drv].drvnum));
+		ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_IRQ;
+		ide_set_regs(ide);
+		break;
+
 	case 0x91: // initialize device parameters
 		ide_set_geometry(&ide->drive[ide->regs.drv], ide->regs.sector_count, ide->regs.head + 1);
 		ide->regs.status = ATA_STATUS_RDY | ATA_STATUS_IRQ;
@@ -995,7 +1118,15 @@ void ide_io(int num, int req)
 	else if (req == 5) // data request
 	{
 		dbg2_printf("IDE data request (on %d)\n", ide->regs.drv);
-		if (ide->state == IDE_STATE_WAIT_PKT_CMD)
+		if (ide->state == IDE_STATE_WAIT_RD)
+		{
+			read_send(ide);
+		}
+		else if (ide->state == IDE_STATE_WAIT_WR)
+		{
+			write_recv(ide);
+		}
+		else if (ide->state == IDE_STATE_WAIT_PKT_CMD)
 		{
 			cdrom_handle_pkt(ide);
 		}
@@ -1089,10 +1220,13 @@ int ide_open(uint8_t unit, const char* filename)
 	if (!is_minimig() || ((minimig_config.ide_cfg & 1) && minimig_config.hardfile[unit].cfg))
 	{
 		printf("\nChecking HDD %d\n", unit);
+		ide_cache_drop(&hdd_file[unit]);
 		if (filename[0] && FileOpenEx(&hdd_file[unit], filename, FileCanWrite(filename) ? O_RDWR : O_RDONLY))
 		{
+			int chd = blockdev_attach(BLOCKDEV_IDE(unit), &hdd_file[unit], filename);
+
 			printf("file: \"%s\": ", hdd_file[unit].name);
-			guess_geometry(&hdd_file[unit], &chs, is_minimig() && !strcasecmp(".hdf", filename + strlen(filename) - 4));
+			guess_geometry(BLOCKDEV_IDE(unit), &hdd_file[unit], &chs, is_minimig() && !strcasecmp(".hdf", filename + strlen(filename) - 4));
 			printf("size: %llu (%llu MB)\n", hdd_file[unit].size, hdd_file[unit].size >> 20);
 			printf("CHS: %u/%u/%u", chs.cylinders, chs.heads, chs.sectors);
 			printf(" (%llu MB), ", ((((uint64_t)chs.cylinders) * chs.heads * chs.sectors) >> 11));
@@ -1105,7 +1239,11 @@ int ide_open(uint8_t unit, const char* filename)
 			const char *ext = filename + len - 4;
 			int vhd = (len > 4 && (!strcasecmp(ext, ".hdf") || (!strcasecmp(ext, ".vhd"))));
 
-			if (!vhd)
+			if (chd)
+			{
+				present = 1;
+			}
+			else if (!vhd)
 			{
 				const char *img_name = cdrom_parse(unit, filename);
 				if (img_name) present = ide_img_mount(&hdd_file[unit], img_name, 0);
@@ -31,6 +31,8 @@
 #define IDE_STATE_WAIT_PKT_RD   4
 #define IDE_STATE_WAIT_PKT_END  5
 #define IDE_STATE_WAIT_PKT_MODE 6
+#define IDE_STATE_WAIT_RD       7
+#define IDE_STATE_WAIT_WR       8
 
 struct regs_t
 {
@@ -105,9 +107,9 @@ struct drive_t
 	uint8_t  atapi_asc_code;
 	uint8_t  atapi_ascq_code;
 
+	uint8_t  fake_rdb[2][512];
+
 	chd_file *chd_f;
-	int      chd_hunknum;
-	uint8_t	 *chd_hunkbuf;
 	uint32_t  chd_total_size;
 	uint32_t  chd_last_partial_lba;
 
@@ -123,6 +125,12 @@ struct ide_config
 	uint32_t prepcnt;
 	regs_t   regs;
 
+	// HDD transfer in progress, resumed on each data request
+	uint8_t  *io_buf;
+	uint32_t io_cnt;
+	uint8_t  io_multi;
+	uint8_t  io_irq;
+
 	drive_t drive[2];
 };
 
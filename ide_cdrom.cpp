@@ -13,13 +13,13 @@
 #include <sys/stat.h>
 #include <cmath>
 #include <libchdr/chd.h>
-#include <byteswap.h>
 #include "spi.h"
 #include "user_io.h"
 #include "file_io.h"
 #include "hardware.h"
 #include "cd.h"
 #include "ide.h"
+#include "swap_util.h"
 
 #if 0
 #define dbg_printf     printf
@@ -169,21 +169,21 @@ static int get_timecode(uint32_t &frames, std::istream &in)
 
 static track_t *get_track_from_lba(drive_t *drive, uint32_t lba, bool &index0)
 {
-	track_t *ret = NULL;
 	index0 = false;
-	for (int i = 0; i < drive->track_cnt; i++)
-	{
-		uint32_t start_lba = i ? drive->track[i-1].start + drive->track[i-1].length : 0;
-		uint32_t end_lba = drive->track[i].start + drive->track[i].length;
 
-		if (lba >= start_lba && lba <= end_lba)
-		{
-			ret = &drive->track[i];
-			//In the "pregap" section
-			if (lba < drive->track[i].start) index0 = true;
-			break;
-		}
+	// binary search for the first track whose end is not before lba
+	int lo = 0, hi = drive->track_cnt;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (drive->track[mid].start + drive->track[mid].length < lba) lo = mid + 1;
+		else hi = mid;
 	}
+	if (lo >= drive->track_cnt) return NULL;
+
+	track_t *ret = &drive->track[lo];
+	//In the "pregap" section
+	if (lba < ret->start) index0 = true;
 	return ret;
 }
 
@@ -296,13 +296,6 @@ static const char* load_chd_file(drive_t *drv, const char *chdfile)
 		return 0;
 	}
 
-	if (drv->chd_hunkbuf)
-	{
-		free(drv->chd_hunkbuf);
-	}
-
-	drv->chd_hunkbuf = (uint8_t *)malloc(tmpTOC.chd_hunksize);
-	drv->chd_hunknum = -1;
 	drv->chd_f = tmpTOC.chd_f;
 
 	//don't use add_track, just do it ourselves...
@@ -1002,17 +995,36 @@ static void read_cd_sectors(ide_config *ide, track_t *track, int cnt)
 		return;
 	}
 
+	// raw sectors are read in runs and the user data is picked out of them
+	static uint8_t raw_buf[8 * 2352];
+	const int raw_max = sizeof(raw_buf) / sz;
+
 	uint32_t pre = drv->track[drv->data_num].mode2 ? 24 : 16;
-	uint32_t post = sz - pre - 2048;
 	uint32_t off = 0;
 
-	while (cnt--)
+	while (cnt > 0)
 	{
-		if (!ide->null) ide->null = !FileSeek(&track->f, pre, SEEK_CUR);
-		if (!ide->null) ide->null = (FileReadAdv(&track->f, ide_buf + off, 2048, -1) <= 0);
-		if (ide->null) memset(ide_buf + off, 0, 2048);
-		if (!ide->null) ide->null = !FileSeek(&track->f, post, SEEK_CUR);
-		off += 2048;
+		int num = (cnt > raw_max) ? raw_max : cnt;
+		int got = 0;
+
+		if (!ide->null)
+		{
+			int ret = FileReadAdv(&track->f, raw_buf, num * sz, -1);
+			// sectors with complete user data
+			int end = ret - (int)pre - 2048;
+			if (end >= 0) got = end / (int)sz + 1;
+			if (got > num) got = num;
+			if (got < num) ide->null = 1;
+		}
+
+		for (int i = 0; i < num; i++)
+		{
+			if (i < got) memcpy(ide_buf + off, raw_buf + i * sz + pre, 2048);
+			else memset(ide_buf + off, 0, 2048);
+			off += 2048;
+		}
+
+		cnt -= num;
 	}
 }
 
@@ -1063,7 +1075,7 @@ void cdrom_read(ide_config *ide)
 		for (uint32_t i = 0; i < cnt; i++)
 		{
 
-			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + drive->track[drive->data_num].chd_offset, d_offset, hdr, 2048, ide_buf, drive->chd_hunkbuf, &drive->chd_hunknum) != CHDERR_NONE)
+			if (mister_chd_read_sector(drive->chd_f, drive->chd_last_partial_lba + drive->track[drive->data_num].chd_offset, d_offset, hdr, 2048, ide_buf) != CHDERR_NONE)
 			{
 				//I don't think anything else uses this, but set it just in case.
 				ide->null = 1;
@@ -1506,21 +1518,34 @@ void cdrom_reply(ide_config *ide, uint8_t error, uint8_t asc_code, uint8_t ascq_
 }
 
 
-void cdrom_close_chd(drive_t *drv)
+// only one drive plays at a time, so all of them share the CDDA ring
+static cd_cdda_t ide_cdda;
+
+// reads raw audio sectors of a bin track, runs on the offload pool
+static void cdda_fetch_track(const void *src, int, int lba, int count, uint8_t *buf)
 {
+	const track_t *trk = (const track_t *)src;
 
-	if (drv->chd_f)
+	// raw sectors are contiguous in the file and go with a single read
+	int cnt = (trk->sectorSize == BYTES_PER_RAW_REDBOOK_FRAME) ? count : 1;
+	for (int i = 0; i < count; i += cnt)
 	{
-		chd_close(drv->chd_f);
-		drv->chd_f = NULL;
+		int len = cnt * BYTES_PER_RAW_REDBOOK_FRAME;
+		__off64_t pos = trk->skip + (__off64_t)(lba + i - (int)trk->start) * trk->sectorSize;
+		int res = (pos >= 0) ? FileReadAt((fileTYPE *)&trk->f, pos, buf, len, 0) : 0;
+		if (res < len) memset(buf + res, 0, len - res);
+		buf += len;
 	}
+}
 
-	if (drv->chd_hunkbuf)
+void cdrom_close_chd(drive_t *drv)
+{
+
+	if (drv->chd_f)
 	{
-		free(drv->chd_hunkbuf);
-		drv->chd_hunkbuf = NULL;
+		mister_chd_close(drv->chd_f);
+		drv->chd_f = NULL;
 	}
-	drv->chd_hunknum = -1;
 }
 
 const char* cdrom_parse(uint32_t num, const char *filename)
@@ -1531,6 +1556,7 @@ const char* cdrom_parse(uint32_t num, const char *filename)
 	num >>= 1;
 
 	//always close files and reset state. empty filename == unmounted cd from OSD
+	cd_cdda_reset(&ide_cdda);
 	cdrom_close_chd(&ide_inst[num].drive[drv]);
 	for (uint8_t i = 0; i < sizeof(ide_inst[num].drive[drv].track) / sizeof(track_t); i++)
 	{
@@ -1584,7 +1610,7 @@ void ide_cdda_send_sector()
 	{
 		if (drv->chd_f)
 		{
-			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + drv->track[drv->data_num].chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf, drv->chd_hunkbuf, &drv->chd_hunknum);
+			mister_chd_read_sector(drv->chd_f, drv->play_start_lba + drv->track[drv->data_num].chd_offset, 0, 0, BYTES_PER_RAW_REDBOOK_FRAME, cdda_buf);
 			needs_swap = true;
 		}
 		else
@@ -1601,13 +1627,9 @@ void ide_cdda_send_sector()
 				read_track = &drv->track[track->number-2];
 
 			}
-			uint32_t pos = read_track->skip + (drv->play_start_lba - read_track->start) * read_track->sectorSize;
-			if (FileSeek(&read_track->f, pos, SEEK_SET))
-			{
-				FileReadAdv(&read_track->f, cdda_buf, sizeof(cdda_buf), -1);
-			} else {
-				memset(cdda_buf, 0, sizeof(cdda_buf));
-			}
+			int end = is_index0 ? track->start : track->start + track->length;
+			if (end > (int)drv->play_end_lba) end = drv->play_end_lba;
+			cd_cdda_read(&ide_cdda, cdda_fetch_track, read_track, 0, drv->play_start_lba, end, cdda_buf, read_track->f.filp != NULL);
 		}
 	}
 	else
@@ -1618,9 +1640,9 @@ void ide_cdda_send_sector()
 	int16_t *cdda_buf16 = (int16_t *)cdda_buf;
 	const int buf_wsize = sizeof(cdda_buf) / 2;
 
+	if (needs_swap) swap16_buf(cdda_buf, buf_wsize);
 	for (int sidx = 0; sidx < buf_wsize; sidx++)
 	{
-		if (needs_swap) cdda_buf16[sidx] = bswap_16(cdda_buf16[sidx]);
 		double tmps = (double)cdda_buf16[sidx];
 		cdda_buf16[sidx] = (int16_t)(tmps*((sidx & 1) ? drv->volume_l : drv->volume_r));
 	}
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <sys/inotify.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/sysinfo.h>
 #include <dirent.h>
 #include <errno.h>
@@ -14,9 +15,14 @@
 #include <linux/input.h>
 #include <linux/uinput.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <stdarg.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <atomic>
 
 #include "input.h"
 #include "user_io.h"
@@ -30,16 +36,51 @@
 #include "joymapping.h"
 #include "support.h"
 #include "profiling.h"
+#include "launch.h"
 #include "gamecontroller_db.h"
 #include "str_util.h"
+#include "scaler.h"
+#include "capture.h"
+#include "blockcache.h"
+#include "inputscript.h"
+#include "pacing.h"
+#include "cmdserver.h"
+#include "scheduler.h"
+#include "crc.h"
+#include "swap_util.h"
+#include "iotrace.h"
+#include "netinput.h"
+#include "blockdev.h"
 
 #define NUMDEV 30
 #define NUMPLAYERS 6
+#define MAP_SLOTS 128 // power of 2, twice the codes of a map
 #define UINPUT_NAME "MiSTer virtual input"
 
 char joy_bnames[NUMBUTTONS][32] = {};
 int  joy_bcount = 0;
-static struct pollfd pool[NUMDEV + 3];
+static struct pollfd pool[NUMDEV + 4];
+
+// The pool stays registered with epoll, only slots whose fd changed are updated.
+static int epoll_fd = -1;
+static int epoll_reg[NUMDEV + 4];
+
+// a closed fd leaves epoll by itself, the next one to get its number has
+// to be added again
+static void pool_close(int n)
+{
+	close(pool[n].fd);
+	pool[n].fd = -1;
+	epoll_reg[n] = -1;
+}
+
+// Events are read from evdev in batches, the rest waits here for the next round
+#define EVBUF_SIZE 64
+#define RUMBLE_SLOTS 4
+static struct input_event evbuf[NUMDEV][EVBUF_SIZE];
+static uint8_t evbuf_pos[NUMDEV], evbuf_cnt[NUMDEV];
+
+static void input_rt_stop();
 
 static int ev2amiga[] =
 {
@@ -1145,6 +1186,11 @@ typedef struct
 	uint32_t map[NUMBUTTONS];
 	int      map_shown;
 
+	// map[] compiled into a code -> button mask lookup, see map_lookup()
+	uint32_t map_gen;
+	uint16_t map_code[MAP_SLOTS];
+	uint64_t map_mask[MAP_SLOTS];
+
 	uint8_t  osd_combo;
 
 	uint8_t  has_mmap;
@@ -1180,7 +1226,11 @@ typedef struct
 	int      has_rumble;
 	int      rumble_en;
 	uint16_t last_rumble;
-	ff_effect rumble_effect;
+	int16_t  rumble_id[RUMBLE_SLOTS];
+	uint16_t rumble_key[RUMBLE_SLOTS];
+	int8_t   rumble_slots;
+	int8_t   rumble_next;
+	int8_t   rumble_cur;
 
 	int8_t   wh_steer;
 	int8_t   wh_accel;
@@ -1218,6 +1268,49 @@ static devInput player_pdsp[NUMPLAYERS] = {};
 
 #define BTN_NUM (sizeof(devInput::map) / sizeof(devInput::map[0]))
 
+// Every change of map[] happens while loading it or in the mapping mode,
+// both bump the generation, so lookups recompile on their next use.
+static uint32_t map_gen = 1;
+
+static uint64_t *map_slot(devInput *inp, uint16_t code, int insert)
+{
+	uint32_t pos = ((code * 0x9E37u) >> 8) & (MAP_SLOTS - 1);
+	while (inp->map_mask[pos])
+	{
+		if (inp->map_code[pos] == code) return &inp->map_mask[pos];
+		pos = (pos + 1) & (MAP_SLOTS - 1);
+	}
+
+	if (!insert) return NULL;
+	inp->map_code[pos] = code;
+	return &inp->map_mask[pos];
+}
+
+static void map_compile(devInput *inp)
+{
+	memset(inp->map_mask, 0, sizeof(inp->map_mask));
+	for (uint i = 0; i < BTN_NUM; i++)
+	{
+		uint16_t lo = inp->map[i] & 0xFFFF;
+		uint16_t hi = inp->map[i] >> 16;
+
+		// the alternate code only counts if it differs from the primary one
+		*map_slot(inp, lo, 1) |= (uint64_t)1 << i;
+		if (hi != lo) *map_slot(inp, hi, 1) |= (uint64_t)1 << (i + 32);
+	}
+	inp->map_gen = map_gen;
+}
+
+// bit i: code is the primary mapping of button i, bit i+32: the alternate one
+static uint64_t map_lookup(int dev, uint16_t code)
+{
+	devInput *inp = &input[dev];
+	if (inp->map_gen != map_gen) map_compile(inp);
+
+	uint64_t *mask = map_slot(inp, code, 0);
+	return mask ? *mask : 0;
+}
+
 int mfd = -1;
 int mwd = -1;
 
@@ -1245,6 +1338,34 @@ static int set_watch()
 #define EVENT_SIZE  ( sizeof (struct inotify_event) )
 #define BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
 
+// Created and deleted nodes since the last check, in arrival order. If the
+// list overflows all devices are reopened.
+#define HOTPLUG_MAX 32
+
+struct hotplug_t
+{
+	char name[32];
+	int created;
+};
+
+static hotplug_t hotplug[HOTPLUG_MAX];
+static int hotplug_num = 0;
+static int hotplug_overflow = 0;
+
+static void hotplug_add(const char *name, int created)
+{
+	if (strncmp(name, "event", 5) && strncmp(name, "mouse", 5)) return;
+	if (hotplug_num >= HOTPLUG_MAX || strlen(name) >= sizeof(hotplug[0].name))
+	{
+		hotplug_overflow = 1;
+		return;
+	}
+
+	strcpy(hotplug[hotplug_num].name, name);
+	hotplug[hotplug_num].created = created;
+	hotplug_num++;
+}
+
 static int check_devs()
 {
 	int result = 0;
@@ -1273,6 +1394,7 @@ static int check_devs()
 				else
 				{
 					printf("The file %s was created.\n", event->name);
+					hotplug_add(event->name, 1);
 				}
 			}
 			else if (event->mask & IN_DELETE)
@@ -1285,6 +1407,7 @@ static int check_devs()
 				else
 				{
 					printf("The file %s was deleted.\n", event->name);
+					hotplug_add(event->name, 0);
 				}
 			}
 			/*
@@ -1308,12 +1431,25 @@ static int check_devs()
 	return result;
 }
 
+static volatile sig_atomic_t exit_req = 0;
+
+// the exit itself is left to input_poll(), a second signal doesn't wait
+// for a main loop which is stuck
 static void INThandler(int code)
 {
 	(void)code;
 
+	if (exit_req) _exit(0);
+	exit_req = 1;
+}
+
+static void input_exit()
+{
 	printf("\nExiting...\n");
 
+	// write-back data of the mounted images (save RAM) must not be lost
+	blockcache_flush(-1);
+
 	if (mwd >= 0) inotify_rm_watch(mfd, mwd);
 	if (mfd >= 0) close(mfd);
 
@@ -1385,7 +1521,7 @@ static int save_map(const char *name, void *pBuffer, int size)
 	char path[256] = { JOYMAP_DIR };
 	strcat(path, name);
 	FileDeleteConfig(name);
-	return FileSaveConfig(path, pBuffer, size);
+	return FileSaveConfigLater(path, pBuffer, size);
 }
 
 static int mapping = 0;
@@ -1551,6 +1687,16 @@ static void input_lightgun_load(int idx)
 	FileLoadConfig(name, input[idx].guncal, 4 * sizeof(int32_t));
 }
 
+int input_dev_info(int dev, uint16_t *vid, uint16_t *pid, const char **name)
+{
+	if (dev < 0 || dev >= NUMDEV || pool[dev].fd < 0) return 0;
+
+	*vid = input[dev].vid;
+	*pid = input[dev].pid;
+	*name = input[dev].name;
+	return 1;
+}
+
 int input_has_lightgun()
 {
 	for (int i = 0; i < NUMDEV; i++)
@@ -2502,6 +2648,11 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 	if (ev->type == EV_KEY && (!ev->code || ev->code == KEY_UNKNOWN)) return;
 
 	static uint16_t last_axis = 0;
+	static int last_mapping = 0;
+
+	// the mapping mode edits map[] directly, including the event it ends on
+	if (mapping || last_mapping) map_gen++;
+	last_mapping = mapping;
 
 	int sub_dev = dev;
 
@@ -2635,6 +2786,7 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 			input[dev].has_map++;
 		}
 		input[dev].has_map++;
+		map_gen++;
 	}
 
 	if (!input[dev].has_jkmap)
@@ -3293,16 +3445,19 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 						input[dev].has_map = 1;
 					}
 					
-					for (uint i = 0; i < BTN_NUM; i++)
+					uint64_t hits = map_lookup(dev, ev->code);
+					uint32_t btns = (uint32_t)hits | (uint32_t)(hits >> 32);
+					while (btns)
 					{
-						uint64_t mask = 0;
-						if (ev->code == (input[dev].map[i] & 0xFFFF)) mask = (uint64_t)1 << i;
-						else if (ev->code == (input[dev].map[i] >> 16)) mask = (uint64_t)1 << (i + 32); // 1 is uint32_t. i spent hours realizing this.
-						if (mask) {
-							if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
-							if (ev->value <=1) joy_digital(input[dev].num, mask, origcode, ev->value, i, (ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 1] || ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 2]));
-							// support 2 simultaneous functions for 1 button if defined in 2 sets. No return.
-						}
+						uint i = __builtin_ctz(btns);
+						btns &= btns - 1;
+
+						uint64_t mask = (uint64_t)1 << i;
+						if (!(hits & mask)) mask <<= 32; // 1 is uint32_t. i spent hours realizing this.
+
+						if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
+						if (ev->value <=1) joy_digital(input[dev].num, mask, origcode, ev->value, i, (ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 1] || ev->code == input[dev].mmap[SYS_BTN_OSD_KTGL + 2]));
+						// support 2 simultaneous functions for 1 button if defined in 2 sets. No return.
 					}
 
 					if (ev->code == input[dev].mmap[SYS_MS_BTN_EMU] && (ev->value <= 1) && ((!(mouse_emu & 1)) ^ (!ev->value)))
@@ -3349,14 +3504,13 @@ static void input_cb(struct input_event *ev, struct input_absinfo *absinfo, int
 				{
 					if (!kbd_toggle)
 					{
-						for (uint i = 0; i < BTN_NUM; i++)
+						uint32_t btns = (uint32_t)map_lookup(dev, ev->code);
+						if (btns)
 						{
-							if (ev->code == (uint16_t)input[dev].map[i])
-							{
-								if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
-								if (ev->value <= 1) joy_digital((user_io_get_kbdemu() == EMU_JOY0) ? 1 : 2, 1 << i, origcode, ev->value, i);
-								return;
-							}
+							uint i = __builtin_ctz(btns);
+							if (i <= 3 && origcode == ev->code) origcode = 0; // prevent autofire for original dpad
+							if (ev->value <= 1) joy_digital((user_io_get_kbdemu() == EMU_JOY0) ? 1 : 2, 1 << i, origcode, ev->value, i);
+							return;
 						}
 					}
 
@@ -3586,7 +3740,6 @@ void send_map_cmd(int key)
 	}
 }
 
-#define CMD_FIFO "/dev/MiSTer_cmd"
 #define LED_MONITOR "/sys/class/leds/hps_led0/brightness_hw_changed"
 
 // add sequential suffixes for non-merged devices
@@ -4322,6 +4475,7 @@ int process_joycon(int dev, input_event *ev, input_absinfo *absinfo)
 			led_path = get_led_path(r); if (led_path) set_led(led_path, ":combo", id);
 
 			printf("Close all devices.\n");
+			input_rt_stop();
 			for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
 			{
 				ioctl(pool[i].fd, EVIOCGRAB, 0);
@@ -4356,63 +4510,74 @@ static int get_rumble_device(int player)
 	return -1;
 }
 
-static int rumble_input_device(int devnum, uint16_t strong_mag, uint16_t weak_mag, uint16_t duration = 500, uint16_t delay = 0)
+static int rumble_play(int devnum, int slot, int value)
+{
+	struct input_event play_ev = {};
+	play_ev.type = EV_FF;
+	play_ev.code = input[devnum].rumble_id[slot];
+	play_ev.value = value;
+	return write(pool[devnum].fd, (const void *)&play_ev, sizeof(play_ev)) != -1;
+}
+
+// Effects stay uploaded per rumble value (as many as the device holds), so
+// a change back to a known value only restarts its effect. Otherwise the
+// oldest upload is modified in place.
+static int rumble_input_device(int devnum, uint16_t rumble_val, uint16_t duration = 500)
 {
-	int ioret = 0;
-	if (!input[devnum].has_rumble) return 0;
+	devInput *inp = &input[devnum];
+	if (!inp->has_rumble) return 0;
 	int fd = pool[devnum].fd;
 	if (!(fd >= 0)) return 0;
 
-	if (!strong_mag && !weak_mag) //Stop rumble
+	if (inp->rumble_cur >= 0)
 	{
-		if (input[devnum].rumble_effect.id == -1) return 1; //No uploaded effect
-
-		ioret = ioctl(fd, EVIOCRMFF, input[devnum].rumble_effect.id);
-		input[devnum].rumble_effect.id = -1; //always set to -1 even if we fail to remove it?
-		return ioret != -1;
+		rumble_play(devnum, inp->rumble_cur, 0);
+		inp->rumble_cur = -1;
 	}
-	else {
-		//Upload effect and then immediately play it
-		//If the effect id in the input struct is -1, it will be filled with the newly uploaded effect
-		//If it is filled with an already uploaded effect, the effect is modified in place
-		struct ff_effect *fef;
-		fef = &input[devnum].rumble_effect;
-		fef->type = FF_RUMBLE;
 
-		fef->direction = input[devnum].quirk == QUIRK_WHEEL ? 0x4000 : 0x0000;
-		fef->u.rumble.strong_magnitude = strong_mag;
-		fef->u.rumble.weak_magnitude = weak_mag;
-		fef->replay.length = duration;
-		fef->replay.delay = delay;
-		ioret = ioctl(fd, EVIOCSFF, fef);
+	if (!rumble_val) return 1; //Stop rumble
+
+	int slot = -1;
+	for (int i = 0; i < inp->rumble_slots; i++) if (inp->rumble_id[i] >= 0 && inp->rumble_key[i] == rumble_val) slot = i;
+
+	if (slot < 0)
+	{
+		for (int i = 0; i < inp->rumble_slots && slot < 0; i++) if (inp->rumble_id[i] < 0) slot = i;
+		if (slot < 0)
+		{
+			slot = inp->rumble_next;
+			inp->rumble_next = (slot + 1) % inp->rumble_slots;
+		}
+
+		//If the id is -1, it will be filled with the newly uploaded effect
+		struct ff_effect fef = {};
+		fef.type = FF_RUMBLE;
+		fef.id = inp->rumble_id[slot];
+		fef.direction = inp->quirk == QUIRK_WHEEL ? 0x4000 : 0x0000;
+		fef.u.rumble.strong_magnitude = (rumble_val & 0xFF00) + (rumble_val >> 8);
+		fef.u.rumble.weak_magnitude = (rumble_val << 8) + (rumble_val & 0x00FF);
+		fef.replay.length = duration;
 
-		if (ioret == -1)
+		if (ioctl(fd, EVIOCSFF, &fef) == -1)
 		{
 			printf("RUMBLE UPLOAD FAILED %s\n", strerror(errno));
 			return 0;
 		}
 
-		//Play effect
-		struct input_event play_ev;
-		play_ev.type = EV_FF;
-		play_ev.code = input[devnum].rumble_effect.id;
-		play_ev.value = 1;
-		ioret = write(fd, (const void *)&play_ev, sizeof(play_ev));
-		return ioret != -1;
+		inp->rumble_id[slot] = fef.id;
+		inp->rumble_key[slot] = rumble_val;
 	}
-	return 0;
+
+	if (!rumble_play(devnum, slot, 1)) return 0;
+	inp->rumble_cur = slot;
+	return 1;
 }
 
 static void set_rumble(int dev, uint16_t rumble_val)
 {
 	if (input[dev].last_rumble != rumble_val)
 	{
-		uint16_t strong_m, weak_m;
-
-		strong_m = (rumble_val & 0xFF00) + (rumble_val >> 8);
-		weak_m = (rumble_val << 8) + (rumble_val & 0x00FF);
-
-		rumble_input_device(dev, strong_m, weak_m, 0x7FFF);
+		rumble_input_device(dev, rumble_val, 0x7FFF);
 		input[dev].last_rumble = rumble_val;
 	}
 }
@@ -4433,13 +4598,14 @@ static void set_wheel_range(int dev, int range)
 	}
 }
 
-static void setup_wheels()
+// all open devices, or only dev
+static void setup_wheels(int dev = -1)
 {
 	if (cfg.wheel_force > 100) cfg.wheel_force = 100;
 
 	for (int i = 0; i < NUMDEV; i++)
 	{
-		if (pool[i].fd != -1)
+		if (pool[i].fd != -1 && (dev < 0 || dev == i))
 		{
 			// steering wheel axis
 			input[i].wh_steer = 0;
@@ -4588,374 +4754,1231 @@ static void setup_wheels()
 	}
 }
 
-int input_test(int getchar)
-{
-	static char cur_leds = 0;
-	static int state = 0;
-	struct input_absinfo absinfo;
-	struct input_event ev;
-	static uint32_t timeout = 0;
-
-	if (touch_rel && CheckTimer(touch_rel))
-	{
-		touch_rel = 0;
-		mice_btn = 0;
-		mouse_btn_req();
-	}
-
-	if (state == 0)
-	{
-		input_uinp_setup();
-		memset(pool, -1, sizeof(pool));
-
-		signal(SIGINT, INThandler);
-		pool[NUMDEV].fd = set_watch();
-		pool[NUMDEV].events = POLLIN;
-
-		unlink(CMD_FIFO);
-		mkfifo(CMD_FIFO, 0666);
+// Optional real-time reader (input_thread=1). A SCHED_FIFO thread waits on
+// the evdev devices and queues their events in lock-free rings, so events
+// are taken from the kernel right away even while the main loop is busy.
+// input_test consumes the rings, and tasks with a budget yield early while
+// events are pending, which brings co_poll around to send them to the core.
+#define EVRING_SIZE 256 // power of 2
 
-		pool[NUMDEV+1].fd = open(CMD_FIFO, O_RDWR | O_NONBLOCK | O_CLOEXEC);
-		pool[NUMDEV+1].events = POLLIN;
+struct evring_t
+{
+	struct input_event ev[EVRING_SIZE];
+	std::atomic<uint32_t> head; // written by the reader thread
+	std::atomic<uint32_t> tail; // written by the main thread
+};
 
-		pool[NUMDEV + 2].fd = open(LED_MONITOR, O_RDONLY | O_CLOEXEC);
-		pool[NUMDEV + 2].events = POLLPRI;
+static evring_t evring[NUMDEV];
+static uint8_t rt_owned[NUMDEV];
+static uint8_t rt_dead[NUMDEV];    // reader thread only: unplugged, out of its epoll
+static pthread_t rt_thread;
+static int rt_running = 0;
+static int rt_epoll = -1, rt_quit = -1, rt_notify = -1;
+static std::atomic<int> rt_pending(0);
 
-		state++;
-	}
+int input_rt_pending()
+{
+	return rt_pending.load(std::memory_order_relaxed);
+}
 
-	if (state == 1)
+static void *input_rt_thread(void *)
+{
+	struct epoll_event evs[NUMDEV + 1];
+	for (;;)
 	{
-		timeout = 0;
-		printf("Open up to %d input devices.\n", NUMDEV);
-		for (int i = 0; i < NUMDEV; i++)
+		int n = epoll_wait(rt_epoll, evs, NUMDEV + 1, -1);
+		if (n < 0 && errno != EINTR) break;
+
+		int queued = 0, full = 0;
+		for (int k = 0; k < n; k++)
 		{
-			pool[i].fd = -1;
-			pool[i].events = 0;
-		}
+			uint32_t i = evs[k].data.u32;
+			if (i >= NUMDEV) return NULL;
+			if (rt_dead[i]) continue;
 
-		memset(input, 0, sizeof(input));
+			// level triggered, a gone device would keep waking the thread up
+			// until the hotplug closes it
+			if (evs[k].events & (EPOLLHUP | EPOLLERR))
+			{
+				epoll_ctl(rt_epoll, EPOLL_CTL_DEL, pool[i].fd, NULL);
+				rt_dead[i] = 1;
+				continue;
+			}
 
-		int n = 0;
-		DIR *d = opendir("/dev/input");
-		if (d)
-		{
-			struct dirent *de;
-			while ((de = readdir(d)))
+			evring_t *ring = &evring[i];
+			uint32_t head = ring->head.load(std::memory_order_relaxed);
+			uint32_t space = EVRING_SIZE - (head - ring->tail.load(std::memory_order_acquire));
+			if (!space)
 			{
-				if (!strncmp(de->d_name, "event", 5) || !strncmp(de->d_name, "mouse", 5))
-				{
-					memset(&input[n], 0, sizeof(input[n]));
-					sprintf(input[n].devname, "/dev/input/%s", de->d_name);
-					int fd = open(input[n].devname, O_RDWR | O_CLOEXEC);
-					//printf("open(%s): %d\n", input[n].devname, fd);
+				full = 1;
+				continue;
+			}
 
-					if (fd > 0)
-					{
-						pool[n].fd = fd;
-						pool[n].events = POLLIN;
-						input[n].mouse = !strncmp(de->d_name, "mouse", 5);
+			// read straight into the ring up to its wrap point
+			uint32_t pos = head & (EVRING_SIZE - 1);
+			if (space > EVRING_SIZE - pos) space = EVRING_SIZE - pos;
+			int len = read(pool[i].fd, &ring->ev[pos], space * sizeof(struct input_event));
+			if (len < 0 && errno != EAGAIN && errno != EINTR)
+			{
+				epoll_ctl(rt_epoll, EPOLL_CTL_DEL, pool[i].fd, NULL);
+				rt_dead[i] = 1;
+				continue;
+			}
+			if (len < (int)sizeof(struct input_event)) continue;
 
-						char uniq[32] = {};
-						if (!input[n].mouse)
-						{
-							struct input_id id;
-							memset(&id, 0, sizeof(id));
-							ioctl(pool[n].fd, EVIOCGID, &id);
-							input[n].vid = id.vendor;
-							input[n].pid = id.product;
-							input[n].version = id.version;
-							input[n].bustype = id.bustype;
-
-							ioctl(pool[n].fd, EVIOCGUNIQ(sizeof(uniq)), uniq);
-							ioctl(pool[n].fd, EVIOCGNAME(sizeof(input[n].name)), input[n].name);
-							input[n].led = has_led(pool[n].fd);
-						}
+			ring->head.store(head + len / sizeof(struct input_event), std::memory_order_release);
+			queued = 1;
+		}
 
-						//skip our virtual device
-						if (!strcmp(input[n].name, UINPUT_NAME))
-						{
-							close(pool[n].fd);
+		if (queued)
+		{
+			rt_pending.store(1, std::memory_order_relaxed);
+			uint64_t one = 1;
+			if (write(rt_notify, &one, sizeof(one))) {}
+		}
 
-							pool[n].fd = -1;
-							continue;
-						}
+		// main thread is behind, give it time to drain the rings
+		if (full) usleep(1000);
+	}
 
-						input[n].bind = -1;
+	return NULL;
+}
 
-						int effects;
-						input[n].has_rumble = false;
-						if (cfg.rumble)
-						{
-							if (ioctl(fd, EVIOCGEFFECTS, &effects) >= 0)
-							{
-								unsigned char ff_features[(FF_MAX + 7) / 8] = {};
+static void input_rt_start()
+{
+	if (!cfg.input_thread || rt_running) return;
 
-								if (ioctl(fd, EVIOCGBIT(EV_FF, sizeof(ff_features)), ff_features) != -1)
-								{
-									if (test_bit(FF_RUMBLE, ff_features)) {
-										input[n].rumble_effect.id = -1;
-										input[n].has_rumble = true;
-									}
-								}
-							}
-						}
+	rt_epoll = epoll_create1(EPOLL_CLOEXEC);
+	rt_quit = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (rt_notify < 0) rt_notify = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (rt_epoll < 0 || rt_quit < 0 || rt_notify < 0)
+	{
+		printf("input: can't set up the input thread.\n");
+		if (rt_epoll >= 0) close(rt_epoll);
+		if (rt_quit >= 0) close(rt_quit);
+		rt_epoll = rt_quit = -1;
+		return;
+	}
 
-						// enable scroll wheel reading
-						if (input[n].mouse)
-						{
-							unsigned char buffer[4];
-							static const unsigned char mousedev_imps_seq[] = { 0xf3, 200, 0xf3, 100, 0xf3, 80 };
-							if (write(pool[n].fd, mousedev_imps_seq, sizeof(mousedev_imps_seq)) != sizeof(mousedev_imps_seq))
-							{
-								printf("Cannot switch %s to ImPS/2 protocol(1)\n", input[n].devname);
-							}
-							else if (read(pool[n].fd, buffer, sizeof buffer) != 1 || buffer[0] != 0xFA)
-							{
-								printf("Failed to switch %s to ImPS/2 protocol(2)\n", input[n].devname);
-							}
-						}
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.u32 = NUMDEV;
+	epoll_ctl(rt_epoll, EPOLL_CTL_ADD, rt_quit, &ev);
 
-						// RasPad3 touchscreen
-						if (input[n].vid == 0x222a && input[n].pid == 1)
-						{
-							input[n].quirk = QUIRK_TOUCHGUN;
-							input[n].num = 1;
-							input[n].map_shown = 1;
-
-							input[n].lightgun = 0;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 16383;
-							input[n].guncal[2] = 2047;
-							input[n].guncal[3] = 14337;
-							input_lightgun_load(n);
-						}
+	// the rings are kept, a hotplug restarts the thread with events queued
+	memset(rt_dead, 0, sizeof(rt_dead));
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		rt_owned[i] = 0;
+		if (pool[i].fd < 0 || input[i].mouse) continue;
 
-						if (input[n].vid == 0x054c)
-						{
-							if (strcasestr(input[n].name, "Motion"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
+		ev.data.u32 = i;
+		if (!epoll_ctl(rt_epoll, EPOLL_CTL_ADD, pool[i].fd, &ev)) rt_owned[i] = 1;
+	}
 
-							if (input[n].pid == 0x0268)  input[n].quirk = QUIRK_DS3;
-							else if (input[n].pid == 0x05c4 || input[n].pid == 0x09cc || input[n].pid == 0x0ba0 || input[n].pid == 0x0ce6)
-							{
-								input[n].quirk = QUIRK_DS4;
-								if (strcasestr(input[n].name, "Touchpad"))
-								{
-									input[n].quirk = QUIRK_DS4TOUCH;
-								}
-							}
-						}
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
 
-						if (input[n].vid == 0x0079 && input[n].pid == 0x1802)
-						{
-							input[n].lightgun = 1;
-							input[n].num = 2; // force mayflash mode 1/2 as second joystick.
-						}
+	struct sched_param param = {};
+	param.sched_priority = 50;
+	pthread_attr_setschedparam(&attr, &param);
 
-						if (input[n].vid == 0x057e && (input[n].pid == 0x0306 || input[n].pid == 0x0330))
-						{
-							if (strcasestr(input[n].name, "Accelerometer"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-							else if (strcasestr(input[n].name, "Motion Plus"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-							else
-							{
-								input[n].quirk = QUIRK_WIIMOTE;
-								input[n].guncal[0] = 0;
-								input[n].guncal[1] = 767;
-								input[n].guncal[2] = 1;
-								input[n].guncal[3] = 1023;
-								input_lightgun_load(n);
-							}
-						}
+	// core #0 next to the offload workers, main runs on core #1
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
 
-						if (input[n].vid == 0x057e)
-						{
-							if (strstr(input[n].name, " IMU"))
-							{
-								// don't use Accelerometer
-								close(pool[n].fd);
-								pool[n].fd = -1;
-								continue;
-							}
-						}
+	// without the rights for SCHED_FIFO it still beats waiting for the main loop
+	int res = pthread_create(&rt_thread, &attr, input_rt_thread, NULL);
+	if (res == EPERM)
+	{
+		pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+		res = pthread_create(&rt_thread, &attr, input_rt_thread, NULL);
+	}
+	pthread_attr_destroy(&attr);
 
-						if (input[n].vid == 0x057e && input[n].pid == 0x2006)
-						{
-							input[n].misc_flags = 1 << 30;
-							input[n].quirk = QUIRK_JOYCON;
-						}
-						if (input[n].vid == 0x057e && input[n].pid == 0x2007)
-						{
-							input[n].misc_flags = 1 << 29;
-							input[n].quirk = QUIRK_JOYCON;
-						}
+	if (res)
+	{
+		printf("input: can't start the input thread (%d).\n", res);
+		memset(rt_owned, 0, sizeof(rt_owned));
+		close(rt_epoll);
+		close(rt_quit);
+		rt_epoll = rt_quit = -1;
+		return;
+	}
 
-						//Ultimarc lightgun
-						if (input[n].vid == 0xd209 && input[n].pid == 0x1601)
-						{
-							input[n].lightgun = 1;
-						}
+	rt_running = 1;
+	printf("input: real-time input thread started.\n");
+}
 
-						//Namco Guncon via Arduino, RetroZord or Reflex Adapt
-						if (((input[n].vid == 0x2341 || (input[n].vid == 0x1209 && input[n].pid == 0x595A)) && (strstr(uniq, "RZordPsGun") || strstr(input[n].name, "RZordPsGun"))) ||
-							(input[n].vid == 0x16D0 && input[n].pid == 0x127E && (strstr(uniq, "ReflexPSGun") || strstr(input[n].name, "ReflexPSGun"))))
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = 0;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
+// must be called before any device of the pool is closed
+static void input_rt_stop()
+{
+	if (!rt_running) return;
+
+	uint64_t one = 1;
+	if (write(rt_quit, &one, sizeof(one))) {}
+	pthread_join(rt_thread, NULL);
+
+	close(rt_epoll);
+	close(rt_quit);
+	rt_epoll = rt_quit = -1;
+	rt_running = 0;
+	rt_pending.store(0);
+	memset(rt_owned, 0, sizeof(rt_owned));
+}
 
-						//Namco GunCon 2
-						if (input[n].vid == 0x0b9a && input[n].pid == 0x016a)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN_CRT;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 25;
-							input[n].guncal[1] = 245;
-							input[n].guncal[2] = 145;
-							input[n].guncal[3] = 700;
-							input_lightgun_load(n);
-						}
+static void input_rt_reset(int dev)
+{
+	evring[dev].head.store(0);
+	evring[dev].tail.store(0);
+}
 
-						//Namco GunCon 3
-						if (input[n].vid == 0x0b9a && input[n].pid == 0x0800)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = -32768;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = -32768;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
+static int input_rt_queued(int dev)
+{
+	return rt_owned[dev] && evring[dev].head.load(std::memory_order_acquire) != evring[dev].tail.load(std::memory_order_relaxed);
+}
 
-						//GUN4IR Lightgun
-						if (input[n].vid == 0x2341 && input[n].pid >= 0x8042 && input[n].pid <= 0x8049)
-						{
-							input[n].quirk = QUIRK_LIGHTGUN;
-							input[n].lightgun = 1;
-							input[n].guncal[0] = 0;
-							input[n].guncal[1] = 32767;
-							input[n].guncal[2] = 0;
-							input[n].guncal[3] = 32767;
-							input_lightgun_load(n);
-						}
+// Latency from the evdev timestamp of an event to its send to the core, per
+// device and event type. The devices are switched to CLOCK_MONOTONIC on open,
+// so the stamps compare to profiling_time_us(). Only the first send after an
+// event is taken, it's reported with the other histograms by the "latency" cmd.
+#define LAT_NAMES 24
 
-						//Madcatz Arcade Stick 360
-						if (input[n].vid == 0x0738 && input[n].pid == 0x4758) input[n].quirk = QUIRK_MADCATZ360;
-
-						// mr.Spinner
-						// 0x120  - Button
-						// Axis 7 - EV_REL is spinner
-						// Axis 8 - EV_ABS is Paddle
-						// Overlays on other existing gamepads
-						if (strstr(uniq, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
-						if (strstr(input[n].name, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
-
-						// Arcade with spinner and/or paddle:
-						// Axis 7 - EV_REL is spinner
-						// Axis 8 - EV_ABS is Paddle
-						// Includes other buttons and axes, works as a full featured gamepad.
-						if (strstr(uniq, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
-						if (strstr(input[n].name, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
-
-						//Jamma
-						if (cfg.jamma_vid && cfg.jamma_pid && input[n].vid == cfg.jamma_vid && input[n].pid == cfg.jamma_pid)
-						{
-							input[n].quirk = QUIRK_JAMMA;
-						}
+static int lat_hist[NUMDEV][3];
+static char lat_names[LAT_NAMES][20];
+static int lat_dev = -1, lat_type = 0;
+static uint64_t lat_ts = 0;
+static std::atomic<int> lat_bench_run(0);
 
-						//Jamma2
-						if (cfg.jamma2_vid && cfg.jamma2_pid && input[n].vid == cfg.jamma2_vid && input[n].pid == cfg.jamma2_pid)
-						{
-							input[n].quirk = QUIRK_JAMMA2;
-						}
+static void input_lat_open(int dev)
+{
+	int clk = CLOCK_MONOTONIC;
+	int res = ioctl(pool[dev].fd, EVIOCSCLOCKID, &clk) ? -1 : -2;
+	for (int t = 0; t < 3; t++) lat_hist[dev][t] = res;
+}
 
-						//Atari VCS wireless joystick with spinner
-						if (input[n].vid == 0x3250 && input[n].pid == 0x1001)
-						{
-							input[n].quirk = QUIRK_VCS;
-							input[n].spinner_acc = -1;
-							input[n].misc_flags = 0;
-						}
+static void input_lat_mark(int dev, const struct input_event *ev)
+{
+	lat_dev = -1;
+	int type = (ev->type == EV_KEY) ? 0 : (ev->type == EV_ABS) ? 1 : (ev->type == EV_REL) ? 2 : -1;
+	if (type < 0 || lat_hist[dev][type] == -1 || (!ev->time.tv_sec && !ev->time.tv_usec)) return;
 
-						//Arduino and Teensy devices may share the same VID:PID, so additional field UNIQ is used to differentiate them
-						//Reflex Adapt also uses the UNIQ field to differentiate between device modes
-						//RetroZord Adapter also uses the UNIQ field to differentiate between device modes
-						if ((input[n].vid == 0x2341 || (input[n].vid == 0x16C0 && (input[n].pid>>8) == 0x4) || (input[n].vid == 0x16D0 && input[n].pid == 0x127E) || (input[n].vid == 0x1209 && input[n].pid == 0x595A)) && strlen(uniq))
-						{
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%s", input[n].vid, input[n].pid, uniq);
-							char *p;
-							while ((p = strchr(input[n].idstr, '/'))) *p = '_';
-							while ((p = strchr(input[n].idstr, ' '))) *p = '_';
-							while ((p = strchr(input[n].idstr, '*'))) *p = '_';
-							while ((p = strchr(input[n].idstr, ':'))) *p = '_';
-							strcpy(input[n].name, uniq);
-						}
-						else if (input[n].vid == 0x1209 && (input[n].pid == 0xFACE || input[n].pid == 0xFACA))
-						{
-							int sum = 0;
-							for (uint32_t i = 0; i < sizeof(input[n].name); i++)
-							{
-								if (!input[n].name[i]) break;
-								sum += (uint8_t)input[n].name[i];
-							}
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%d", input[n].vid, input[n].pid, sum);
-						}
-						else
-						{
-							snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x", input[n].vid, input[n].pid);
-						}
+	lat_dev = dev;
+	lat_type = type;
+	lat_ts = (ev->time.tv_sec * 1000000ULL) + ev->time.tv_usec;
+}
 
-						ioctl(pool[n].fd, EVIOCGRAB, (grabbed | user_io_osd_is_visible()) ? 1 : 0);
+void input_latency_sent()
+{
+	if (lat_dev < 0) return;
 
-						n++;
-						if (n >= NUMDEV) break;
-					}
-				}
-			}
-			closedir(d);
+	int *hist = &lat_hist[lat_dev][lat_type];
+	if (*hist == -2)
+	{
+		static const char *type_names[] = { "key", "abs", "rel" };
+		char name[20];
+		snprintf(name, sizeof(name), "in %04x:%04x %s", input[lat_dev].vid, input[lat_dev].pid, type_names[lat_type]);
 
-			mergedevs();
-			check_joycon();
-			setup_wheels();
-			for (int i = 0; i < n; i++)
+		// histograms keep the name pointer, so names live in a pool of their own
+		*hist = -1;
+		for (int i = 0; i < LAT_NAMES; i++)
+		{
+			if (!lat_names[i][0]) strcpy(lat_names[i], name);
+			if (!strcmp(lat_names[i], name))
 			{
-				printf("opened %d(%2d): %s (%04x:%04x:%08x) %d \"%s\" \"%s\"\n", i, input[i].bind, input[i].devname, input[i].vid, input[i].pid, input[i].unique_hash, input[i].quirk, input[i].id, input[i].name);
-				restore_player(i);
-				setup_deadzone(&ev, i);
+				*hist = profiling_hist_id(lat_names[i]);
+				break;
 			}
-			unflag_players();
 		}
-		cur_leds |= 0x80;
-		state++;
 	}
 
-	if (cfg.bt_auto_disconnect)
-	{
-		if (!timeout) timeout = GetTimer(6000);
-		else if (CheckTimer(timeout))
+	uint64_t now = profiling_time_us();
+	if (now >= lat_ts) profiling_hist_add(*hist, now - lat_ts);
+	lat_dev = -1;
+}
+
+// Synthetic key events at 1kHz through a uinput device of its own, which is
+// picked up by the hotplug like any other keyboard. Best run on the menu core.
+static void *input_lat_bench_thread(void *arg)
+{
+	int secs = (int)(intptr_t)arg;
+
+	struct uinput_user_dev uinp;
+	memset(&uinp, 0, sizeof(uinp));
+	strncpy(uinp.name, "MiSTer latency bench", UINPUT_MAX_NAME_SIZE);
+	uinp.id.version = 4;
+	uinp.id.bustype = BUS_VIRTUAL;
+
+	int fd = open("/dev/uinput", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("latency bench: unable to open /dev/uinput\n");
+		lat_bench_run.store(0);
+		return NULL;
+	}
+
+	ioctl(fd, UI_SET_EVBIT, EV_KEY);
+	ioctl(fd, UI_SET_KEYBIT, KEY_RIGHTCTRL);
+	if (write(fd, &uinp, sizeof(uinp)) != sizeof(uinp) || ioctl(fd, UI_DEV_CREATE))
+	{
+		printf("latency bench: unable to create the device\n");
+		close(fd);
+		lat_bench_run.store(0);
+		return NULL;
+	}
+
+	// give the hotplug time to open it
+	sleep(2);
+	printf("latency bench: %d events at 1kHz\n", secs * 1000);
+
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (int n = 0; n < secs * 1000; n++)
+	{
+		struct input_event ev[2] = {};
+		ev[0].type = EV_KEY;
+		ev[0].code = KEY_RIGHTCTRL;
+		ev[0].value = !(n & 1);
+		ev[1].type = EV_SYN;
+		ev[1].code = SYN_REPORT;
+		if (write(fd, ev, sizeof(ev)) != sizeof(ev)) break;
+
+		next.tv_nsec += 1000000;
+		if (next.tv_nsec >= 1000000000)
+		{
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	sleep(1);
+	ioctl(fd, UI_DEV_DESTROY);
+	close(fd);
+	printf("latency bench: done\n");
+	lat_bench_run.store(0);
+	return NULL;
+}
+
+static void input_lat_bench(int secs)
+{
+	if (secs <= 0) secs = 5;
+	if (secs > 60) secs = 60;
+	if (lat_bench_run.exchange(1)) return;
+
+	pthread_t th;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&th, &attr, input_lat_bench_thread, (void *)(intptr_t)secs)) lat_bench_run.store(0);
+	pthread_attr_destroy(&attr);
+}
+
+static void input_epoll_sync(int reset)
+{
+	if (reset && epoll_fd >= 0)
+	{
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+
+	if (epoll_fd < 0)
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll_fd < 0) return;
+		for (int i = 0; i < NUMDEV + 4; i++) epoll_reg[i] = -1;
+	}
+
+	// all removals first, a closed fd number may have been reused by another slot
+	for (int i = 0; i < NUMDEV + 4; i++)
+	{
+		int fd = (i < NUMDEV && rt_owned[i]) ? -1 : pool[i].fd;
+		if (epoll_reg[i] >= 0 && epoll_reg[i] != fd)
+		{
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, epoll_reg[i], NULL);
+			epoll_reg[i] = -1;
+		}
+	}
+
+	for (int i = 0; i < NUMDEV + 4; i++)
+	{
+		int fd = (i < NUMDEV && rt_owned[i]) ? -1 : pool[i].fd;
+		if (fd >= 0 && epoll_reg[i] != fd)
+		{
+			struct epoll_event ev = {};
+			ev.events = (pool[i].events & POLLPRI) ? EPOLLPRI : EPOLLIN;
+			ev.data.u32 = i;
+			if (!epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) || (errno == EEXIST && !epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev)))
+			{
+				epoll_reg[i] = fd;
+			}
+		}
+	}
+
+	// wakeups from the input thread
+	if (reset && rt_notify >= 0)
+	{
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.u32 = NUMDEV + 4;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rt_notify, &ev);
+	}
+}
+
+// Waits for input like poll() on the pool would, and fills in the revents.
+// Devices with buffered events are ready without waiting.
+static int input_wait(int timeout)
+{
+	int buffered = 0;
+	rt_pending.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < NUMDEV + 4; i++) pool[i].revents = 0;
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (evbuf_pos[i] < evbuf_cnt[i] || input_rt_queued(i))
+		{
+			pool[i].revents = POLLIN;
+			buffered++;
+		}
+	}
+
+	// the rest of a batch is handled before asking the kernel again
+	if (buffered) return buffered;
+
+	input_epoll_sync(0);
+	if (epoll_fd < 0) return poll(pool, NUMDEV + 4, timeout);
+
+	struct epoll_event evs[NUMDEV + 4];
+	int n = epoll_wait(epoll_fd, evs, NUMDEV + 4, timeout);
+	if (n < 0) return (errno == EINTR) ? 0 : -1;
+
+	for (int k = 0; k < n; k++)
+	{
+		uint32_t i = evs[k].data.u32;
+		if (i == NUMDEV + 4)
+		{
+			uint64_t cnt;
+			if (read(rt_notify, &cnt, sizeof(cnt))) {}
+			for (int dev = 0; dev < NUMDEV; dev++)
+			{
+				if (!pool[dev].revents && input_rt_queued(dev))
+				{
+					pool[dev].revents = POLLIN;
+					buffered++;
+				}
+			}
+			continue;
+		}
+		if (i >= NUMDEV + 4) continue;
+
+		if (evs[k].events & EPOLLIN) pool[i].revents |= POLLIN;
+		if (evs[k].events & EPOLLPRI) pool[i].revents |= POLLPRI;
+		if (evs[k].events & EPOLLERR) pool[i].revents |= POLLERR;
+		if (evs[k].events & EPOLLHUP) pool[i].revents |= POLLHUP;
+		buffered++;
+	}
+
+	return buffered;
+}
+
+int input_idle_wait(int timeout)
+{
+	if (epoll_fd < 0 || rt_pending.load(std::memory_order_relaxed) || cmdserver_busy()) return 1;
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (evbuf_pos[i] < evbuf_cnt[i] || input_rt_queued(i)) return 1;
+	}
+
+	// level triggered, whatever wakes this up is read by the next input_poll()
+	struct epoll_event ev;
+	int n = epoll_wait(epoll_fd, &ev, 1, timeout);
+	return (n < 0) ? 0 : n;
+}
+
+// next event of a device, reading a whole batch when the buffer runs dry
+static int input_next_event(int dev, struct input_event *ev)
+{
+	if (rt_owned[dev])
+	{
+		evring_t *ring = &evring[dev];
+		uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+		if (tail == ring->head.load(std::memory_order_acquire)) return 0;
+
+		*ev = ring->ev[tail & (EVRING_SIZE - 1)];
+		ring->tail.store(tail + 1, std::memory_order_release);
+		return 1;
+	}
+
+	if (evbuf_pos[dev] >= evbuf_cnt[dev])
+	{
+		evbuf_pos[dev] = evbuf_cnt[dev] = 0;
+		int len = read(pool[dev].fd, evbuf[dev], sizeof(evbuf[dev]));
+		if (len < (int)sizeof(struct input_event)) return 0;
+		evbuf_cnt[dev] = len / sizeof(struct input_event);
+	}
+
+	*ev = evbuf[dev][evbuf_pos[dev]++];
+	return 1;
+}
+
+// Rumble state of the cores changes at frame rate at most, so it's fetched
+// once per player every few ms instead of per device on every wakeup.
+static void input_update_rumble()
+{
+	static unsigned long rumble_timer = 0;
+	if (rumble_timer && !CheckTimer(rumble_timer)) return;
+	rumble_timer = GetTimer(4);
+
+	int32_t player_rumble[NUMPLAYERS + 1];
+	for (int n = 0; n <= NUMPLAYERS; n++) player_rumble[n] = -1;
+
+	for (int i = 0; i < NUMDEV; i++)
+	{
+		if (!input[i].has_rumble) continue;
+
+		int dev = i;
+		if (input[i].bind >= 0) dev = input[i].bind;
+		int num = input[dev].num;
+		if (!num) continue;
+
+		if (num > NUMPLAYERS)
+		{
+			set_rumble(i, spi_uio_cmd(UIO_GET_RUMBLE | ((num - 1) << 8)));
+			continue;
+		}
+
+		if (player_rumble[num] < 0) player_rumble[num] = spi_uio_cmd(UIO_GET_RUMBLE | ((num - 1) << 8));
+		set_rumble(i, player_rumble[num]);
+	}
+}
+
+// MiSTer_cmd commands, run by the command server
+// all the CPU only kernels in one go, FPGA benches stay separate
+static void input_cpu_bench()
+{
+	crc_bench();
+	swap_bench();
+	c64_gcr_bench();
+	neogeo_convert_bench();
+	mister_scaler_bench();
+}
+
+static int input_cmd(char *cmd)
+{
+	if (!strncmp(cmd, "fb_cmd", 6)) video_cmd(cmd);
+	else if (!strncmp(cmd, "load_core ", 10))
+	{
+		if(isXmlName(cmd)) xml_load(cmd + 10);
+		else fpga_load_rbf(cmd + 10);
+	}
+	else if (!strncmp(cmd, "screenshot", 10))
+	{
+		user_io_screenshot_cmd(cmd);
+	}
+	else if (!strcmp(cmd, "spi_bench"))
+	{
+		fpga_spi_bench();
+	}
+	else if (!strcmp(cmd, "gcr_bench"))
+	{
+		return cmdserver_offload(c64_gcr_bench);
+	}
+	else if (!strcmp(cmd, "swap_bench"))
+	{
+		return cmdserver_offload(swap_bench);
+	}
+	else if (!strcmp(cmd, "neogeo_bench"))
+	{
+		return cmdserver_offload(neogeo_convert_bench);
+	}
+	else if (!strcmp(cmd, "bench"))
+	{
+		return cmdserver_offload(input_cpu_bench);
+	}
+	else if (!strcmp(cmd, "crc_bench"))
+	{
+		return cmdserver_offload(crc_bench);
+	}
+	else if (!strcmp(cmd, "scaler_bench"))
+	{
+		return cmdserver_offload(mister_scaler_bench);
+	}
+	else if (!strncmp(cmd, "capture ", 8))
+	{
+		if (!strcmp(cmd + 8, "start")) capture_start();
+		else if (!strcmp(cmd + 8, "stop")) capture_stop();
+	}
+	else if (!strncmp(cmd, "latency bench", 13))
+	{
+		// "latency bench [seconds]" feeds synthetic input at 1kHz
+		input_lat_bench(atoi(cmd + 13));
+	}
+	else if (!strncmp(cmd, "latency", 7))
+	{
+		// "latency" dumps the histograms, "latency reset" also clears them
+		profiling_hist_report(stdout);
+		FILE *fp = fopen("/tmp/MiSTer_latency", "wt");
+		if (fp)
+		{
+			profiling_hist_report(fp);
+			fclose(fp);
+		}
+		if (!strcmp(cmd + 7, " reset")) profiling_hist_reset();
+	}
+	else if (!strncmp(cmd, "spi", 3) && (!cmd[3] || cmd[3] == ' '))
+	{
+		// "spi start|stop|reset", "spi" dumps the counters
+		if (!strcmp(cmd + 3, " start")) spi_stats_enable(1);
+		else if (!strcmp(cmd + 3, " stop")) spi_stats_enable(0);
+		else if (!strcmp(cmd + 3, " reset")) spi_stats_reset();
+		else
+		{
+			spi_stats_report(stdout);
+			FILE *fp = fopen("/tmp/MiSTer_spi", "wt");
+			if (fp)
+			{
+				spi_stats_report(fp);
+				fclose(fp);
+			}
+		}
+	}
+	else if (!strncmp(cmd, "pacing", 6) && (!cmd[6] || cmd[6] == ' '))
+	{
+		// "pacing start|stop|reset", "pacing" dumps the histogram
+		if (!strcmp(cmd + 6, " start")) pacing_start();
+		else if (!strcmp(cmd + 6, " stop")) pacing_stop();
+		else if (!strcmp(cmd + 6, " reset")) pacing_reset();
+		else
+		{
+			pacing_report(stdout);
+			scheduler_phase_report(stdout);
+			FILE *fp = fopen("/tmp/MiSTer_pacing", "wt");
+			if (fp)
+			{
+				pacing_report(fp);
+				scheduler_phase_report(fp);
+				fclose(fp);
+			}
+		}
+	}
+	else if (!strncmp(cmd, "iotrace", 7) && (!cmd[7] || cmd[7] == ' '))
+	{
+		// "iotrace start [path]|stop|replay <path> [fast]", "iotrace" shows the state
+		if (!strncmp(cmd + 7, " start", 6)) iotrace_start(cmd[13] ? cmd + 14 : nullptr);
+		else if (!strcmp(cmd + 7, " stop")) iotrace_stop();
+		else if (!strncmp(cmd + 7, " replay ", 8))
+		{
+			char *path = cmd + 15;
+			char *opt = strrchr(path, ' ');
+			int fast = opt && !strcmp(opt, " fast");
+			if (fast) *opt = 0;
+			iotrace_replay(path, fast);
+		}
+		else
+		{
+			iotrace_report(stdout);
+			FILE *fp = fopen("/tmp/MiSTer_iotrace", "wt");
+			if (fp)
+			{
+				iotrace_report(fp);
+				fclose(fp);
+			}
+		}
+	}
+	else if (!strncmp(cmd, "netinput", 8) && (!cmd[8] || cmd[8] == ' '))
+	{
+		// "netinput open <port>|close", "netinput" shows the players
+		// both close the old socket, its fd number is likely to come back
+		if (!strncmp(cmd + 8, " open ", 6))
+		{
+			epoll_reg[NUMDEV + 3] = -1;
+			pool[NUMDEV + 3].fd = netinput_open(atoi(cmd + 14));
+		}
+		else if (!strcmp(cmd + 8, " close"))
+		{
+			netinput_close();
+			pool[NUMDEV + 3].fd = -1;
+			epoll_reg[NUMDEV + 3] = -1;
+		}
+		else
+		{
+			netinput_report(stdout);
+			FILE *fp = fopen("/tmp/MiSTer_netinput", "wt");
+			if (fp)
+			{
+				netinput_report(fp);
+				fclose(fp);
+			}
+		}
+	}
+	else if (!strncmp(cmd, "blockdev ", 9))
+	{
+		// "blockdev create <path> <MB>|snapshot <dev>|rollback <dev>"
+		char path[1024];
+		unsigned int mb = 0;
+		if (sscanf(cmd + 9, "create %1023s %u", path, &mb) == 2) blockdev_create_sparse(path, (uint64_t)mb << 20);
+		else if (!strncmp(cmd + 9, "snapshot ", 9)) blockdev_snapshot(blockdev_by_name(cmd + 18));
+		else if (!strncmp(cmd + 9, "rollback ", 9)) blockdev_rollback(blockdev_by_name(cmd + 18));
+		else printf("blockdev: unknown command %s\n", cmd + 9);
+	}
+	else if (!strcmp(cmd, "blockdev"))
+	{
+		blockdev_report(stdout);
+		FILE *fp = fopen("/tmp/MiSTer_blockdev", "wt");
+		if (fp)
+		{
+			blockdev_report(fp);
+			fclose(fp);
+		}
+	}
+	else if (!strcmp(cmd, "mem"))
+	{
+		scheduler_mem_report(stdout);
+		FILE *fp = fopen("/tmp/MiSTer_mem", "wt");
+		if (fp)
+		{
+			scheduler_mem_report(fp);
+			fclose(fp);
+		}
+	}
+	else if (!strcmp(cmd, "boot"))
+	{
+		profiling_boot_report(stdout);
+		FILE *fp = fopen("/tmp/MiSTer_boot", "wt");
+		if (fp)
+		{
+			profiling_boot_report(fp);
+			fclose(fp);
+		}
+	}
+	else if (!strcmp(cmd, "launch"))
+	{
+		launch_report(stdout);
+		FILE *fp = fopen("/tmp/MiSTer_launch", "wt");
+		if (fp)
+		{
+			launch_report(fp);
+			fclose(fp);
+		}
+	}
+#ifdef PROFILING
+	else if (!strncmp(cmd, "trace ", 6))
+	{
+		if (!strcmp(cmd + 6, "start")) profiling_trace_start();
+		else if (!strcmp(cmd + 6, "stop")) profiling_trace_stop();
+		else if (!strcmp(cmd + 6, "dump")) profiling_trace_dump("/tmp/MiSTer_trace.json");
+	}
+#endif
+	else if (!strncmp(cmd, "input_script ", 13))
+	{
+		if (!strcmp(cmd + 13, "stop")) inputscript_stop();
+		else inputscript_run(cmd + 13);
+	}
+	else if (!strncmp(cmd, "input_type ", 11))
+	{
+		inputscript_type(cmd + 11);
+	}
+	else if (!strncmp(cmd, "volume ", 7))
+	{
+		if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
+		else if (!strcmp(cmd + 7, "unmute")) set_volume(0x80);
+		else if (cmd[7] >= '0' && cmd[7] <= '7') set_volume(0x40 - 0x30 + cmd[7]);
+	}
+	else return CMD_UNKNOWN;
+
+	return CMD_OK;
+}
+
+// Opens /dev/input/<name> into slot n, returns 0 if the device is not used.
+static int input_open_dev(int n, const char *name)
+{
+	memset(&input[n], 0, sizeof(input[n]));
+	sprintf(input[n].devname, "/dev/input/%s", name);
+	int fd = open(input[n].devname, O_RDWR | O_CLOEXEC);
+	//printf("open(%s): %d\n", input[n].devname, fd);
+	if (fd <= 0) return 0;
+
+	pool[n].fd = fd;
+	pool[n].events = POLLIN;
+	input[n].mouse = !strncmp(name, "mouse", 5);
+
+	char uniq[32] = {};
+	if (!input[n].mouse)
+	{
+		struct input_id id;
+		memset(&id, 0, sizeof(id));
+		ioctl(pool[n].fd, EVIOCGID, &id);
+		input[n].vid = id.vendor;
+		input[n].pid = id.product;
+		input[n].version = id.version;
+		input[n].bustype = id.bustype;
+
+		ioctl(pool[n].fd, EVIOCGUNIQ(sizeof(uniq)), uniq);
+		ioctl(pool[n].fd, EVIOCGNAME(sizeof(input[n].name)), input[n].name);
+		input[n].led = has_led(pool[n].fd);
+		input_lat_open(n);
+	}
+
+	//skip our virtual device
+	if (!strcmp(input[n].name, UINPUT_NAME))
+	{
+		pool_close(n);
+		return 0;
+	}
+
+	input[n].bind = -1;
+
+	int effects;
+	input[n].has_rumble = false;
+	if (cfg.rumble)
+	{
+		if (ioctl(fd, EVIOCGEFFECTS, &effects) >= 0)
+		{
+			unsigned char ff_features[(FF_MAX + 7) / 8] = {};
+
+			if (ioctl(fd, EVIOCGBIT(EV_FF, sizeof(ff_features)), ff_features) != -1)
+			{
+				if (test_bit(FF_RUMBLE, ff_features)) {
+					for (int i = 0; i < RUMBLE_SLOTS; i++) input[n].rumble_id[i] = -1;
+					input[n].rumble_slots = (effects < 1) ? 1 : (effects > RUMBLE_SLOTS) ? RUMBLE_SLOTS : effects;
+					input[n].rumble_cur = -1;
+					input[n].has_rumble = true;
+				}
+			}
+		}
+	}
+
+	// enable scroll wheel reading
+	if (input[n].mouse)
+	{
+		unsigned char buffer[4];
+		static const unsigned char mousedev_imps_seq[] = { 0xf3, 200, 0xf3, 100, 0xf3, 80 };
+		if (write(pool[n].fd, mousedev_imps_seq, sizeof(mousedev_imps_seq)) != sizeof(mousedev_imps_seq))
+		{
+			printf("Cannot switch %s to ImPS/2 protocol(1)\n", input[n].devname);
+		}
+		else if (read(pool[n].fd, buffer, sizeof buffer) != 1 || buffer[0] != 0xFA)
+		{
+			printf("Failed to switch %s to ImPS/2 protocol(2)\n", input[n].devname);
+		}
+	}
+
+	// RasPad3 touchscreen
+	if (input[n].vid == 0x222a && input[n].pid == 1)
+	{
+		input[n].quirk = QUIRK_TOUCHGUN;
+		input[n].num = 1;
+		input[n].map_shown = 1;
+
+		input[n].lightgun = 0;
+		input[n].guncal[0] = 0;
+		input[n].guncal[1] = 16383;
+		input[n].guncal[2] = 2047;
+		input[n].guncal[3] = 14337;
+		input_lightgun_load(n);
+	}
+
+	if (input[n].vid == 0x054c)
+	{
+		if (strcasestr(input[n].name, "Motion"))
+		{
+			// don't use Accelerometer
+			pool_close(n);
+			return 0;
+		}
+
+		if (input[n].pid == 0x0268)  input[n].quirk = QUIRK_DS3;
+		else if (input[n].pid == 0x05c4 || input[n].pid == 0x09cc || input[n].pid == 0x0ba0 || input[n].pid == 0x0ce6)
+		{
+			input[n].quirk = QUIRK_DS4;
+			if (strcasestr(input[n].name, "Touchpad"))
+			{
+				input[n].quirk = QUIRK_DS4TOUCH;
+			}
+		}
+	}
+
+	if (input[n].vid == 0x0079 && input[n].pid == 0x1802)
+	{
+		input[n].lightgun = 1;
+		input[n].num = 2; // force mayflash mode 1/2 as second joystick.
+	}
+
+	if (input[n].vid == 0x057e && (input[n].pid == 0x0306 || input[n].pid == 0x0330))
+	{
+		if (strcasestr(input[n].name, "Accelerometer"))
+		{
+			// don't use Accelerometer
+			pool_close(n);
+			return 0;
+		}
+		else if (strcasestr(input[n].name, "Motion Plus"))
+		{
+			// don't use Accelerometer
+			pool_close(n);
+			return 0;
+		}
+		else
+		{
+			input[n].quirk = QUIRK_WIIMOTE;
+			input[n].guncal[0] = 0;
+			input[n].guncal[1] = 767;
+			input[n].guncal[2] = 1;
+			input[n].guncal[3] = 1023;
+			input_lightgun_load(n);
+		}
+	}
+
+	if (input[n].vid == 0x057e)
+	{
+		if (strstr(input[n].name, " IMU"))
+		{
+			// don't use Accelerometer
+			pool_close(n);
+			return 0;
+		}
+	}
+
+	if (input[n].vid == 0x057e && input[n].pid == 0x2006)
+	{
+		input[n].misc_flags = 1 << 30;
+		input[n].quirk = QUIRK_JOYCON;
+	}
+	if (input[n].vid == 0x057e && input[n].pid == 0x2007)
+	{
+		input[n].misc_flags = 1 << 29;
+		input[n].quirk = QUIRK_JOYCON;
+	}
+
+	//Ultimarc lightgun
+	if (input[n].vid == 0xd209 && input[n].pid == 0x1601)
+	{
+		input[n].lightgun = 1;
+	}
+
+	//Namco Guncon via Arduino, RetroZord or Reflex Adapt
+	if (((input[n].vid == 0x2341 || (input[n].vid == 0x1209 && input[n].pid == 0x595A)) && (strstr(uniq, "RZordPsGun") || strstr(input[n].name, "RZordPsGun"))) ||
+		(input[n].vid == 0x16D0 && input[n].pid == 0x127E && (strstr(uniq, "ReflexPSGun") || strstr(input[n].name, "ReflexPSGun"))))
+	{
+		input[n].quirk = QUIRK_LIGHTGUN;
+		input[n].lightgun = 1;
+		input[n].guncal[0] = 0;
+		input[n].guncal[1] = 32767;
+		input[n].guncal[2] = 0;
+		input[n].guncal[3] = 32767;
+		input_lightgun_load(n);
+	}
+
+	//Namco GunCon 2
+	if (input[n].vid == 0x0b9a && input[n].pid == 0x016a)
+	{
+		input[n].quirk = QUIRK_LIGHTGUN_CRT;
+		input[n].lightgun = 1;
+		input[n].guncal[0] = 25;
+		input[n].guncal[1] = 245;
+		input[n].guncal[2] = 145;
+		input[n].guncal[3] = 700;
+		input_lightgun_load(n);
+	}
+
+	//Namco GunCon 3
+	if (input[n].vid == 0x0b9a && input[n].pid == 0x0800)
+	{
+		input[n].quirk = QUIRK_LIGHTGUN;
+		input[n].lightgun = 1;
+		input[n].guncal[0] = -32768;
+		input[n].guncal[1] = 32767;
+		input[n].guncal[2] = -32768;
+		input[n].guncal[3] = 32767;
+		input_lightgun_load(n);
+	}
+
+	//GUN4IR Lightgun
+	if (input[n].vid == 0x2341 && input[n].pid >= 0x8042 && input[n].pid <= 0x8049)
+	{
+		input[n].quirk = QUIRK_LIGHTGUN;
+		input[n].lightgun = 1;
+		input[n].guncal[0] = 0;
+		input[n].guncal[1] = 32767;
+		input[n].guncal[2] = 0;
+		input[n].guncal[3] = 32767;
+		input_lightgun_load(n);
+	}
+
+	//Madcatz Arcade Stick 360
+	if (input[n].vid == 0x0738 && input[n].pid == 0x4758) input[n].quirk = QUIRK_MADCATZ360;
+
+	// mr.Spinner
+	// 0x120  - Button
+	// Axis 7 - EV_REL is spinner
+	// Axis 8 - EV_ABS is Paddle
+	// Overlays on other existing gamepads
+	if (strstr(uniq, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
+	if (strstr(input[n].name, "MiSTer-S1")) input[n].quirk = QUIRK_PDSP;
+
+	// Arcade with spinner and/or paddle:
+	// Axis 7 - EV_REL is spinner
+	// Axis 8 - EV_ABS is Paddle
+	// Includes other buttons and axes, works as a full featured gamepad.
+	if (strstr(uniq, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
+	if (strstr(input[n].name, "MiSTer-A1")) input[n].quirk = QUIRK_PDSP_ARCADE;
+
+	//Jamma
+	if (cfg.jamma_vid && cfg.jamma_pid && input[n].vid == cfg.jamma_vid && input[n].pid == cfg.jamma_pid)
+	{
+		input[n].quirk = QUIRK_JAMMA;
+	}
+
+	//Jamma2
+	if (cfg.jamma2_vid && cfg.jamma2_pid && input[n].vid == cfg.jamma2_vid && input[n].pid == cfg.jamma2_pid)
+	{
+		input[n].quirk = QUIRK_JAMMA2;
+	}
+
+	//Atari VCS wireless joystick with spinner
+	if (input[n].vid == 0x3250 && input[n].pid == 0x1001)
+	{
+		input[n].quirk = QUIRK_VCS;
+		input[n].spinner_acc = -1;
+		input[n].misc_flags = 0;
+	}
+
+	//Arduino and Teensy devices may share the same VID:PID, so additional field UNIQ is used to differentiate them
+	//Reflex Adapt also uses the UNIQ field to differentiate between device modes
+	//RetroZord Adapter also uses the UNIQ field to differentiate between device modes
+	if ((input[n].vid == 0x2341 || (input[n].vid == 0x16C0 && (input[n].pid>>8) == 0x4) || (input[n].vid == 0x16D0 && input[n].pid == 0x127E) || (input[n].vid == 0x1209 && input[n].pid == 0x595A)) && strlen(uniq))
+	{
+		snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%s", input[n].vid, input[n].pid, uniq);
+		char *p;
+		while ((p = strchr(input[n].idstr, '/'))) *p = '_';
+		while ((p = strchr(input[n].idstr, ' '))) *p = '_';
+		while ((p = strchr(input[n].idstr, '*'))) *p = '_';
+		while ((p = strchr(input[n].idstr, ':'))) *p = '_';
+		strcpy(input[n].name, uniq);
+	}
+	else if (input[n].vid == 0x1209 && (input[n].pid == 0xFACE || input[n].pid == 0xFACA))
+	{
+		int sum = 0;
+		for (uint32_t i = 0; i < sizeof(input[n].name); i++)
+		{
+			if (!input[n].name[i]) break;
+			sum += (uint8_t)input[n].name[i];
+		}
+		snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x_%d", input[n].vid, input[n].pid, sum);
+	}
+	else
+	{
+		snprintf(input[n].idstr, sizeof(input[n].idstr), "%04x_%04x", input[n].vid, input[n].pid);
+	}
+
+	ioctl(pool[n].fd, EVIOCGRAB, (grabbed | user_io_osd_is_visible()) ? 1 : 0);
+	return 1;
+}
+
+// Applies the queued hotplug events to the open devices only, the others
+// keep their fds, grabs, players and maps. Returns 0 if all devices have
+// to be reopened instead.
+static int input_hotplug()
+{
+	if (hotplug_overflow) return 0;
+
+	// the input thread reads from the pool, it's restarted with the new set
+	input_rt_stop();
+
+	int opened[NUMDEV] = {};
+	int changed = 0;
+	for (int k = 0; k < hotplug_num; k++)
+	{
+		char devname[64];
+		sprintf(devname, "/dev/input/%s", hotplug[k].name);
+
+		int n = -1;
+		for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0 && !strcmp(input[i].devname, devname)) n = i;
+
+		if (!hotplug[k].created)
+		{
+			if (n < 0) continue;
+
+			printf("closed %d: %s \"%s\"\n", n, input[n].devname, input[n].name);
+			if (mapping_dev == n) mapping_dev = -1;
+			ioctl(pool[n].fd, EVIOCGRAB, 0);
+			pool_close(n);
+			pool[n].events = 0;
+			pool[n].revents = 0;
+			memset(&input[n], 0, sizeof(input[n]));
+			evbuf_cnt[n] = 0;
+			evbuf_pos[n] = 0;
+			crtgun_timeout[n] = 0;
+			input_rt_reset(n);
+			opened[n] = 0;
+			changed = 1;
+			continue;
+		}
+
+		if (n >= 0) continue;
+		for (int i = 0; i < NUMDEV; i++) if (pool[i].fd < 0)
+		{
+			n = i;
+			break;
+		}
+
+		if (n < 0)
+		{
+			printf("No free slot for %s\n", devname);
+			continue;
+		}
+
+		pool[n].revents = 0;
+		evbuf_cnt[n] = 0;
+		evbuf_pos[n] = 0;
+		input_rt_reset(n);
+		if (input_open_dev(n, hotplug[k].name))
+		{
+			opened[n] = 1;
+			changed = 1;
+		}
+	}
+	hotplug_num = 0;
+
+	if (changed)
+	{
+		// combined joycons are kept as long as both halves are there
+		int combo[NUMDEV];
+		for (int i = 0; i < NUMDEV; i++) combo[i] = (pool[i].fd >= 0 && JOYCON_COMBO(i)) ? input[i].bind : -1;
+
+		mergedevs();
+
+		for (int i = 0; i < NUMDEV; i++)
+		{
+			if (combo[i] < 0) continue;
+
+			int b = combo[i];
+			if (pool[b].fd >= 0 && combo[b] == i)
+			{
+				input[i].bind = b;
+			}
+			else
+			{
+				input[i].misc_flags &= ~(1 << 31);
+				snprintf(input[i].idstr, sizeof(input[i].idstr), "%04x_%04x", input[i].vid, input[i].pid);
+			}
+		}
+
+		check_joycon();
+
+		struct input_event ev = {};
+		for (int i = 0; i < NUMDEV; i++)
+		{
+			if (!opened[i]) continue;
+
+			setup_wheels(i);
+			printf("opened %d(%2d): %s (%04x:%04x:%08x) %d \"%s\" \"%s\"\n", i, input[i].bind, input[i].devname, input[i].vid, input[i].pid, input[i].unique_hash, input[i].quirk, input[i].id, input[i].name);
+			restore_player(i);
+			setup_deadzone(&ev, i);
+		}
+		unflag_players();
+	}
+
+	input_rt_start();
+	input_epoll_sync(0);
+	return 1;
+}
+
+int input_test(int getchar)
+{
+	static char cur_leds = 0;
+	static int state = 0;
+	struct input_absinfo absinfo;
+	struct input_event ev;
+	static uint32_t timeout = 0;
+
+	if (touch_rel && CheckTimer(touch_rel))
+	{
+		touch_rel = 0;
+		mice_btn = 0;
+		mouse_btn_req();
+	}
+
+	if (state == 0)
+	{
+		input_uinp_setup();
+		memset(pool, -1, sizeof(pool));
+
+		signal(SIGINT, INThandler);
+		signal(SIGTERM, INThandler);
+		pool[NUMDEV].fd = set_watch();
+		pool[NUMDEV].events = POLLIN;
+
+		pool[NUMDEV+1].fd = cmdserver_open(input_cmd);
+		pool[NUMDEV+1].events = POLLIN;
+
+		pool[NUMDEV + 2].fd = open(LED_MONITOR, O_RDONLY | O_CLOEXEC);
+		pool[NUMDEV + 2].events = POLLPRI;
+
+		pool[NUMDEV + 3].fd = netinput_open(cfg.net_input_port);
+		pool[NUMDEV + 3].events = POLLIN;
+
+		state++;
+	}
+
+	if (state == 1)
+	{
+		BOOT_SCOPE("input devices");
+		input_rt_stop();
+		timeout = 0;
+		printf("Open up to %d input devices.\n", NUMDEV);
+		for (int i = 0; i < NUMDEV; i++)
+		{
+			pool[i].fd = -1;
+			pool[i].events = 0;
+		}
+
+		memset(input, 0, sizeof(input));
+		memset(evbuf_cnt, 0, sizeof(evbuf_cnt));
+		memset(evbuf_pos, 0, sizeof(evbuf_pos));
+		for (int i = 0; i < NUMDEV; i++) input_rt_reset(i);
+		hotplug_num = 0;
+		hotplug_overflow = 0;
+
+		int n = 0;
+		DIR *d = opendir("/dev/input");
+		if (d)
+		{
+			struct dirent *de;
+			while ((de = readdir(d)))
+			{
+				if (!strncmp(de->d_name, "event", 5) || !strncmp(de->d_name, "mouse", 5))
+				{
+					if (input_open_dev(n, de->d_name)) n++;
+					if (n >= NUMDEV) break;
+				}
+			}
+			closedir(d);
+
+			mergedevs();
+			check_joycon();
+			setup_wheels();
+			for (int i = 0; i < n; i++)
+			{
+				printf("opened %d(%2d): %s (%04x:%04x:%08x) %d \"%s\" \"%s\"\n", i, input[i].bind, input[i].devname, input[i].vid, input[i].pid, input[i].unique_hash, input[i].quirk, input[i].id, input[i].name);
+				restore_player(i);
+				setup_deadzone(&ev, i);
+			}
+			unflag_players();
+		}
+		cur_leds |= 0x80;
+		input_rt_start();
+		input_epoll_sync(1);
+		state++;
+	}
+
+	if (cfg.bt_auto_disconnect)
+	{
+		if (!timeout) timeout = GetTimer(6000);
+		else if (CheckTimer(timeout))
 		{
 			timeout = GetTimer(6000);
 			for (int i = 0; i < NUMDEV; i++)
@@ -4987,21 +6010,9 @@ int input_test(int getchar)
 
 		while (1)
 		{
-			if (cfg.rumble && !is_menu())
-			{
-				for (int i = 0; i < NUMDEV; i++)
-				{
-					if (!input[i].has_rumble) continue;
-
-					int dev = i;
-					if (input[i].bind >= 0) dev = input[i].bind;
-					if (!input[dev].num) continue;
+			if (cfg.rumble && !is_menu()) input_update_rumble();
 
-					set_rumble(i, spi_uio_cmd(UIO_GET_RUMBLE | ((input[dev].num - 1) << 8)));
-				}
-			}
-
-			int return_value = poll(pool, NUMDEV + 3, timeout);
+			int return_value = input_wait(timeout);
 			if (!return_value) break;
 
 			if (return_value < 0)
@@ -5010,16 +6021,28 @@ int input_test(int getchar)
 				break;
 			}
 
+			// stick updates of the events read in this pass go out once per stick
+			SpiBatch spi_batch;
+
 			if ((pool[NUMDEV].revents & POLLIN) && check_devs())
 			{
-				printf("Close all devices.\n");
-				for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
+				if (input_hotplug())
+				{
+					// new keyboards get the current LEDs
+					cur_leds |= 0x80;
+				}
+				else
 				{
-					ioctl(pool[i].fd, EVIOCGRAB, 0);
-					close(pool[i].fd);
+					printf("Close all devices.\n");
+					input_rt_stop();
+					for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
+					{
+						ioctl(pool[i].fd, EVIOCGRAB, 0);
+						close(pool[i].fd);
+					}
+					state = 1;
+					return 0;
 				}
-				state = 1;
-				return 0;
 			}
 
 			for (int pos = 0; pos < NUMDEV; pos++)
@@ -5033,7 +6056,7 @@ int input_test(int getchar)
 					{
 
 						memset(&ev, 0, sizeof(ev));
-						if (read(pool[i].fd, &ev, sizeof(ev)) == sizeof(ev))
+						if (input_next_event(i, &ev))
 						{
 							if (getchar)
 							{
@@ -5044,6 +6067,8 @@ int input_test(int getchar)
 							}
 							else if (ev.type)
 							{
+								input_lat_mark(i, &ev);
+
 								int dev = i;
 								if (!JOYCON_COMBINED(i) && input[dev].bind >= 0) dev = input[dev].bind;
 
@@ -5593,32 +6618,17 @@ int input_test(int getchar)
 				}
 			}
 
+			// sends past this point aren't caused by a device event
+			lat_dev = -1;
+
 			if ((pool[NUMDEV + 1].fd >= 0) && (pool[NUMDEV + 1].revents & POLLIN))
 			{
-				static char cmd[1024];
-				int len = read(pool[NUMDEV + 1].fd, cmd, sizeof(cmd) - 1);
-				if (len)
-				{
-					if (cmd[len - 1] == '\n') cmd[len - 1] = 0;
-					cmd[len] = 0;
-					printf("MiSTer_cmd: %s\n", cmd);
-					if (!strncmp(cmd, "fb_cmd", 6)) video_cmd(cmd);
-					else if (!strncmp(cmd, "load_core ", 10))
-					{
-						if(isXmlName(cmd)) xml_load(cmd + 10);
-						else fpga_load_rbf(cmd + 10);
-					}
-					else if (!strncmp(cmd, "screenshot", 10))
-					{
-						user_io_screenshot_cmd(cmd);
-					}
-					else if (!strncmp(cmd, "volume ", 7))
-					{
-						if (!strcmp(cmd + 7, "mute")) set_volume(0x81);
-						else if (!strcmp(cmd + 7, "unmute")) set_volume(0x80);
-						else if (cmd[7] >= '0' && cmd[7] <= '7') set_volume(0x40 - 0x30 + cmd[7]);
-					}
-				}
+				cmdserver_read(pool[NUMDEV + 1].fd);
+			}
+
+			if ((pool[NUMDEV + 3].fd >= 0) && (pool[NUMDEV + 3].revents & POLLIN))
+			{
+				netinput_read(pool[NUMDEV + 3].fd);
 			}
 
 			if ((pool[NUMDEV + 2].fd >= 0) && (pool[NUMDEV + 2].revents & POLLPRI))
@@ -5668,10 +6678,14 @@ int input_poll(int getchar)
 	static uint32_t time[NUMPLAYERS] = {};
 	static uint64_t joy_prev[NUMPLAYERS] = {};
 
+	if (exit_req) input_exit();
+
 	int ret = input_test(getchar);
 	if (getchar) return ret;
 
 	uinp_check_key();
+	cmdserver_poll();
+	netinput_check();
 
 	static int prev_dx = 0;
 	static int prev_dy = 0;
@@ -5700,6 +6714,9 @@ int input_poll(int getchar)
 
 	if (!mouse_emu_x && !mouse_emu_y) mouse_timer = 0;
 
+	// all the players in one go
+	spi_batch_begin();
+
 	if (grabbed)
 	{
 		for (int i = 0; i < NUMPLAYERS; i++)
@@ -5708,31 +6725,35 @@ int input_poll(int getchar)
 
 			if (!time[i]) time[i] = GetTimer(af_delay[i]);
 			int send = 0;
-			int newdir = ((((uint32_t)(joy[i]) | (uint32_t)(joy[i] >> 32)) & 0xF) != (((uint32_t)(joy_prev[i]) | (uint32_t)(joy_prev[i] >> 32)) & 0xF));
+
+			// remote players are merged in, the OSD keeps them from the core like the local ones
+			uint64_t cur = joy[i] | (user_io_osd_is_visible() ? 0 : netinput_joy(i));
+			int newdir = ((((uint32_t)(cur) | (uint32_t)(cur >> 32)) & 0xF) != (((uint32_t)(joy_prev[i]) | (uint32_t)(joy_prev[i] >> 32)) & 0xF));
 			
-			if (joy[i] != joy_prev[i])
+			if (cur != joy_prev[i])
 			{
-				if ((joy[i] ^ joy_prev[i]) & autofire[i])
+				if ((cur ^ joy_prev[i]) & autofire[i])
 				{
 					time[i] = GetTimer(af_delay[i]);
 					af[i] = 0;
 				}
 
 				send = 1;
-				joy_prev[i] = joy[i];
+				joy_prev[i] = cur;
 			}
 
 			if (CheckTimer(time[i]))
 			{
 				time[i] = GetTimer(af_delay[i]);
 				af[i] = !af[i];
-				if (joy[i] & autofire[i]) send = 1;
+				if (cur & autofire[i]) send = 1;
 			}
 
 			if (send)
 			{
-				user_io_digital_joystick(i, af[i] ? joy[i] & ~autofire[i] : joy[i], newdir);
+				user_io_digital_joystick(i, af[i] ? cur & ~autofire[i] : cur, newdir);
 			}
+			netinput_done(i, send);
 		}
 	}
 
@@ -5740,26 +6761,43 @@ int input_poll(int getchar)
 	{
 		for (int i = 0; i < NUMPLAYERS; i++)
 		{
-			if(joy[i]) user_io_digital_joystick(i, 0, 1);
+			// remote buttons may still be held in the core
+			if (joy[i] || joy_prev[i]) user_io_digital_joystick(i, 0, 1);
+			netinput_done(i, 0);
 
 			joy[i] = 0;
+			joy_prev[i] = 0;
 			af[i] = 0;
 			autofire[i] = 0;
 		}
 	}
+	spi_batch_end();
 
 	if (mouse_req)
 	{
+		// all the motion since the last update goes out in one packet,
+		// whatever doesn't fit the packet is kept for the next one
 		static uint32_t old_time = 0;
 		uint32_t time = GetTimer(0);
-		if ((time - old_time > 15) || (mouse_req & 2))
+		uint32_t interval = cfg.mouse_interval ? cfg.mouse_interval : 16;
+		if ((time - old_time >= interval) || (mouse_req & 2))
 		{
+			int range = is_minimig() ? 127 : 255;
+			int range_w = is_minimig() ? 127 : 63;
+			int x = mouse_x, y = mouse_y, w = mouse_w;
+			joy_clamp(&x, -range, range);
+			joy_clamp(&y, -range, range);
+			joy_clamp(&w, -range_w, range_w);
+
 			old_time = time;
-			user_io_mouse(mouse_btn | mice_btn, mouse_x, mouse_y, mouse_w);
-			mouse_req = 0;
-			mouse_x = 0;
-			mouse_y = 0;
-			mouse_w = 0;
+			user_io_mouse(mouse_btn | mice_btn, x, y, w);
+			mouse_x -= x;
+			mouse_y -= y;
+			mouse_w -= w;
+			mouse_req = (mouse_x || mouse_y || mouse_w) ? 1 : 0;
+
+			// the core doesn't get the motion behind the OSD
+			if (user_io_osd_is_visible() && !is_menu()) mouse_req = mouse_x = mouse_y = mouse_w = 0;
 		}
 	}
 
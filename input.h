@@ -78,6 +78,16 @@ void sysled_enable(int en);
 
 void input_notify_mode();
 int input_poll(int getchar);
+
+// events from the input thread are waiting to be handled
+int input_rt_pending();
+
+// Sleeps up to timeout ms until an input device, the command fifo or the
+// input thread has something. Nothing is consumed. Returns 0 on timeout.
+int input_idle_wait(int timeout);
+
+// called on every input send to the core, records the latency of the event behind it
+void input_latency_sent();
 int is_key_pressed(int key);
 
 void start_map_setting(int cnt, int set = 0);
@@ -100,6 +110,9 @@ uint32_t get_amiga_code(uint16_t key);
 uint32_t get_archie_code(uint16_t key);
 
 int input_has_lightgun();
+
+// Device in slot dev (0..NUMDEV-1), returns 0 if the slot is free.
+int input_dev_info(int dev, uint16_t *vid, uint16_t *pid, const char **name);
 void input_lightgun_save(int idx, int32_t *cal);
 
 void input_switch(int grab);
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <linux/input.h>
+
+#include "user_io.h"
+#include "scheduler.h"
+#include "inputscript.h"
+
+// The script is compiled into a list of events with the delay before each.
+// A scheduler timer replays it, so the timing doesn't depend on the loop.
+#define SCRIPT_MAX_EVENTS 65536
+#define SCRIPT_JOYS       6
+
+enum
+{
+	SCRIPT_KEY_DOWN,
+	SCRIPT_KEY_UP,
+	SCRIPT_JOY
+};
+
+struct script_event_t
+{
+	uint32_t delay_us;
+	uint8_t type;
+	uint8_t num;
+	uint16_t code;
+	uint32_t mask;
+};
+
+static script_event_t *events = nullptr;
+static int event_num = 0, event_cap = 0, event_pos = 0;
+static uint32_t pending_us = 0;
+static uint32_t key_delay_us = 40000;
+static int timer_id = -1;
+
+static uint8_t key_held[KEY_MAX + 1];
+static uint32_t joy_held[SCRIPT_JOYS];
+
+static int script_add(int type, int num, int code, uint32_t mask)
+{
+	if (event_num >= event_cap)
+	{
+		if (event_cap >= SCRIPT_MAX_EVENTS) return 0;
+
+		int cap = event_cap ? event_cap * 2 : 1024;
+		script_event_t *ev = (script_event_t*)realloc(events, cap * sizeof(script_event_t));
+		if (!ev) return 0;
+
+		events = ev;
+		event_cap = cap;
+	}
+
+	script_event_t *ev = &events[event_num++];
+	ev->delay_us = pending_us;
+	ev->type = type;
+	ev->num = num;
+	ev->code = code;
+	ev->mask = mask;
+	pending_us = 0;
+	return 1;
+}
+
+static int script_key(int code, int down)
+{
+	int res = script_add(down ? SCRIPT_KEY_DOWN : SCRIPT_KEY_UP, 0, code, 0);
+	pending_us = key_delay_us;
+	return res;
+}
+
+static int script_tap(int code, int shift)
+{
+	return (!shift || script_key(KEY_LEFTSHIFT, 1)) && script_key(code, 1) &&
+		script_key(code, 0) && (!shift || script_key(KEY_LEFTSHIFT, 0));
+}
+
+// ASCII to linux key codes of a US layout, the rows start at KEY_1
+static const char ascii_lo[] = "1234567890-=\0\0qwertyuiop[]\0\0asdfghjkl;'`\0\\zxcvbnm,./";
+static const char ascii_hi[] = "!@#$%^&*()_+\0\0QWERTYUIOP{}\0\0ASDFGHJKL:\"~\0|ZXCVBNM<>?";
+
+static int script_char(char c)
+{
+	if (c == ' ') return script_tap(KEY_SPACE, 0);
+	if (c == '\n') return script_tap(KEY_ENTER, 0);
+	if (c == '\t') return script_tap(KEY_TAB, 0);
+
+	for (int i = 0; c && i < (int)sizeof(ascii_lo) - 1; i++)
+	{
+		if (ascii_lo[i] == c) return script_tap(KEY_1 + i, 0);
+		if (ascii_hi[i] == c) return script_tap(KEY_1 + i, 1);
+	}
+
+	// not on the layout, skip it
+	return 1;
+}
+
+static int script_text(const char *text)
+{
+	for (const char *p = text; *p; p++)
+	{
+		char c = *p;
+		if (c == '\\' && p[1])
+		{
+			p++;
+			c = (*p == 'n') ? '\n' : (*p == 't') ? '\t' : *p;
+		}
+
+		if (!script_char(c)) return 0;
+	}
+
+	return 1;
+}
+
+static int script_line(char *line, int num)
+{
+	int len = strlen(line);
+	while (len && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+
+	char *p = line;
+	while (*p == ' ' || *p == '\t') p++;
+	if (!*p || *p == '#') return 1;
+
+	if (!strncmp(p, "text ", 5)) return script_text(p + 5);
+
+	if (!strncmp(p, "key ", 4))
+	{
+		char *end;
+		int code = strtol(p + 4, &end, 0);
+		if (code <= 0 || code > KEY_MAX) goto fail;
+
+		while (*end == ' ') end++;
+		if (!strcmp(end, "down")) return script_key(code, 1);
+		if (!strcmp(end, "up")) return script_key(code, 0);
+		if (!*end) return script_tap(code, 0);
+		goto fail;
+	}
+
+	if (!strncmp(p, "joy ", 4))
+	{
+		char *end;
+		int joy = strtol(p + 4, &end, 0);
+		if (joy < 0 || joy >= SCRIPT_JOYS) goto fail;
+
+		uint32_t mask = strtoul(end, nullptr, 16);
+		return script_add(SCRIPT_JOY, joy, 0, mask);
+	}
+
+	if (!strncmp(p, "wait ", 5))
+	{
+		pending_us += strtoul(p + 5, nullptr, 0) * 1000;
+		return 1;
+	}
+
+	if (!strncmp(p, "delay ", 6))
+	{
+		key_delay_us = strtoul(p + 6, nullptr, 0) * 1000;
+		if (key_delay_us < 1000) key_delay_us = 1000;
+		return 1;
+	}
+
+fail:
+	printf("inputscript: bad line %d: %s\n", num, p);
+	return 0;
+}
+
+static void script_send(const script_event_t *ev)
+{
+	switch (ev->type)
+	{
+	case SCRIPT_KEY_DOWN:
+		key_held[ev->code] = 1;
+		user_io_kbd(ev->code, 1);
+		break;
+
+	case SCRIPT_KEY_UP:
+		key_held[ev->code] = 0;
+		user_io_kbd(ev->code, 0);
+		break;
+
+	case SCRIPT_JOY:
+		joy_held[ev->num] = ev->mask;
+		user_io_digital_joystick(ev->num, ev->mask, 1);
+		break;
+	}
+}
+
+static void script_release()
+{
+	for (int i = 0; i <= KEY_MAX; i++)
+	{
+		if (key_held[i]) user_io_kbd(i, 0);
+		key_held[i] = 0;
+	}
+
+	for (int i = 0; i < SCRIPT_JOYS; i++)
+	{
+		if (joy_held[i]) user_io_digital_joystick(i, 0, 1);
+		joy_held[i] = 0;
+	}
+}
+
+static uint32_t script_tick()
+{
+	// events without a delay go out in the same tick
+	do
+	{
+		script_send(&events[event_pos++]);
+	} while (event_pos < event_num && !events[event_pos].delay_us);
+
+	if (event_pos < event_num) return events[event_pos].delay_us;
+
+	printf("inputscript: done, %d events.\n", event_num);
+	script_release();
+	return 0;
+}
+
+void inputscript_stop()
+{
+	if (timer_id >= 0) scheduler_timer_set(timer_id, 0);
+	script_release();
+
+	free(events);
+	events = nullptr;
+	event_num = event_cap = event_pos = 0;
+	pending_us = 0;
+	key_delay_us = 40000;
+}
+
+static int script_start()
+{
+	if (!event_num)
+	{
+		inputscript_stop();
+		return 0;
+	}
+
+	if (timer_id < 0) timer_id = scheduler_timer_add("inputscript", script_tick, 0);
+	if (timer_id < 0)
+	{
+		inputscript_stop();
+		return 0;
+	}
+
+	event_pos = 0;
+	scheduler_timer_set(timer_id, events[0].delay_us ? events[0].delay_us : 1);
+	return 1;
+}
+
+int inputscript_run(const char *path)
+{
+	inputscript_stop();
+
+	FILE *fp = fopen(path, "rt");
+	if (!fp)
+	{
+		printf("inputscript: can't open %s\n", path);
+		return 0;
+	}
+
+	static char line[1024];
+	int num = 0, ok = 1;
+	while (ok && fgets(line, sizeof(line), fp)) ok = script_line(line, ++num);
+	fclose(fp);
+
+	if (!ok)
+	{
+		inputscript_stop();
+		return 0;
+	}
+
+	return script_start();
+}
+
+int inputscript_type(const char *text)
+{
+	inputscript_stop();
+
+	if (!script_text(text))
+	{
+		inputscript_stop();
+		return 0;
+	}
+
+	return script_start();
+}
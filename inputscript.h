@@ -0,0 +1,22 @@
+#ifndef INPUTSCRIPT_H
+#define INPUTSCRIPT_H
+
+// Timed key and joystick sequences fed straight to the core, for automated
+// text entry. A script has one command per line:
+//   key <code> [down|up]   linux key code, a tap if no state is given
+//   text <string>          types ASCII on a US layout, \n is Enter
+//   joy <num> <mask>       joystick buttons (hex mask) of player num (0 based)
+//   wait <ms>              pause
+//   delay <ms>             time between the steps of key taps, 40 by default
+// Lines starting with # are comments. All calls are main thread only.
+
+// Loads and starts a script, a running one is stopped. Returns 0 on error.
+int  inputscript_run(const char *path);
+
+// Types a single line of text.
+int  inputscript_type(const char *text);
+
+// Stops the script and releases everything it holds.
+void inputscript_stop();
+
+#endif
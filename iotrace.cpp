@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "iotrace.h"
+#include "file_io.h"
+#include "blockcache.h"
+#include "user_io.h"
+#include "scheduler.h"
+#include "profiling.h"
+
+#define IOTRACE_MAGIC   0x544F494D  // "MIOT"
+#define IOTRACE_VERSION 1
+#define IOTRACE_DISKS   16
+#define IOTRACE_MAX     (64 * 1024 * 1024)
+
+#define IOTRACE_PATH    0           // op of a path record, followed by the path
+
+struct iotrace_hdr_t
+{
+	uint32_t magic;
+	uint32_t version;
+};
+
+struct iotrace_rec_t
+{
+	uint32_t time_us;
+	uint8_t src;
+	uint8_t disk;
+	uint8_t op;
+	uint8_t reserved;
+	uint32_t lba;
+	uint16_t blksz;
+	uint16_t count;     // blocks, path length for path records
+};
+
+static FILE *rec_fp = nullptr;
+static char rec_path[256];
+static uint64_t rec_start = 0;
+static uint32_t rec_num = 0;
+static uint8_t rec_named[3][IOTRACE_DISKS];
+
+struct iotrace_replay_t
+{
+	uint8_t *data;
+	uint32_t len;
+	uint32_t pos;
+	int fast;
+	uint64_t start;
+
+	uint32_t *lat_us;
+	uint32_t num;
+	uint32_t skipped;
+	uint64_t bytes;
+	uint64_t elapsed_us;
+	int running;
+};
+
+static iotrace_replay_t rp = {};
+static fileTYPE rp_file[3][IOTRACE_DISKS];
+static int timer_id = -1;
+
+static void rec_write(const void *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, rec_fp) != len)
+	{
+		printf("iotrace: write failed, stopped\n");
+		iotrace_stop();
+	}
+}
+
+int iotrace_start(const char *path)
+{
+	iotrace_stop();
+
+	snprintf(rec_path, sizeof(rec_path), "%s", (path && *path) ? path : "/tmp/MiSTer_iotrace.bin");
+	rec_fp = fopen(rec_path, "wb");
+	if (!rec_fp)
+	{
+		printf("iotrace: can't create %s\n", rec_path);
+		return 0;
+	}
+
+	// the trace usually goes to tmpfs, a large buffer keeps the calls cheap
+	setvbuf(rec_fp, nullptr, _IOFBF, 64 * 1024);
+
+	iotrace_hdr_t hdr = { IOTRACE_MAGIC, IOTRACE_VERSION };
+	fwrite(&hdr, sizeof(hdr), 1, rec_fp);
+
+	memset(rec_named, 0, sizeof(rec_named));
+	rec_start = profiling_time_us();
+	rec_num = 0;
+	printf("iotrace: recording to %s\n", rec_path);
+	return 1;
+}
+
+void iotrace_stop()
+{
+	if (!rec_fp) return;
+
+	fclose(rec_fp);
+	rec_fp = nullptr;
+	printf("iotrace: %u requests in %s\n", rec_num, rec_path);
+}
+
+void iotrace_add(int src, int disk, int op, uint32_t lba, uint32_t blksz, uint32_t count, const fileTYPE *file)
+{
+	if (!rec_fp || src < 0 || src > IOTRACE_CD) return;
+
+	disk &= IOTRACE_DISKS - 1;
+
+	iotrace_rec_t rec = {};
+	rec.time_us = (uint32_t)(profiling_time_us() - rec_start);
+	rec.src = src;
+	rec.disk = disk;
+
+	if (!rec_named[src][disk] && file && file->path[0])
+	{
+		rec_named[src][disk] = 1;
+		rec.op = IOTRACE_PATH;
+		rec.count = strlen(file->path);
+		rec_write(&rec, sizeof(rec));
+		if (rec_fp) rec_write(file->path, rec.count);
+		if (!rec_fp) return;
+	}
+
+	rec.op = op;
+	rec.lba = lba;
+	rec.blksz = blksz;
+	rec.count = (count > 0xFFFF) ? 0xFFFF : count;
+	rec_write(&rec, sizeof(rec));
+	rec_num++;
+}
+
+static void replay_close()
+{
+	for (int s = 0; s < 3; s++)
+	{
+		for (int d = 0; d < IOTRACE_DISKS; d++)
+		{
+			if (!rp_file[s][d].opened()) continue;
+			if (s == IOTRACE_SD) blockcache_drop(d);
+			FileClose(&rp_file[s][d]);
+		}
+	}
+
+	free(rp.data);
+	rp.data = nullptr;
+	rp.running = 0;
+}
+
+// Writes are replayed as reads of the same range, the images stay intact.
+static void replay_one(const iotrace_rec_t *rec)
+{
+	static uint8_t buf[256 * 512];
+	fileTYPE *f = &rp_file[rec->src][rec->disk];
+
+	if (rec->src == IOTRACE_CD || !f->opened() || !rec->blksz)
+	{
+		rp.skipped++;
+		return;
+	}
+
+	uint64_t offset = (uint64_t)rec->lba * rec->blksz;
+	uint32_t size = rec->count * rec->blksz;
+	if (size > sizeof(buf)) size = sizeof(buf);
+
+	uint64_t t = profiling_time_us();
+	if (rec->src == IOTRACE_SD) blockcache_read(rec->disk, f, offset, buf, size);
+	else FileReadAt(f, offset, buf, size, -1);
+
+	rp.lat_us[rp.num++] = (uint32_t)(profiling_time_us() - t);
+	rp.bytes += size;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static void replay_finish()
+{
+	rp.elapsed_us = profiling_time_us() - rp.start;
+	if (rp.num) qsort(rp.lat_us, rp.num, sizeof(rp.lat_us[0]), cmp_u32);
+
+	replay_close();
+	iotrace_report(stdout);
+}
+
+static uint32_t replay_tick()
+{
+	// don't hold the main loop for more than a few ms per tick
+	uint64_t now = profiling_time_us();
+	uint64_t until = now + 4000;
+
+	while (rp.pos + sizeof(iotrace_rec_t) <= rp.len)
+	{
+		iotrace_rec_t rec;
+		memcpy(&rec, rp.data + rp.pos, sizeof(rec));
+
+		uint64_t due = rp.start + rec.time_us;
+		if (!rp.fast && due > now) return (uint32_t)(due - now);
+		if (now >= until) return 1;
+
+		rp.pos += sizeof(rec);
+
+		// a corrupt or foreign trace may name any source and disk
+		int valid = rec.src <= IOTRACE_CD && rec.disk < IOTRACE_DISKS;
+		if (rec.op == IOTRACE_PATH)
+		{
+			char path[1024];
+			uint32_t len = (rec.count < sizeof(path)) ? rec.count : sizeof(path) - 1;
+			if (rp.pos + rec.count > rp.len) break;
+
+			memcpy(path, rp.data + rp.pos, len);
+			path[len] = 0;
+			rp.pos += rec.count;
+
+			if (valid && !rp_file[rec.src][rec.disk].opened() && !FileOpen(&rp_file[rec.src][rec.disk], path, 1))
+			{
+				printf("iotrace: can't open %s, its requests are skipped\n", path);
+			}
+			if (valid && rec.src == IOTRACE_SD) blockcache_drop(rec.disk);
+		}
+		else if (valid)
+		{
+			replay_one(&rec);
+		}
+
+		now = profiling_time_us();
+	}
+
+	replay_finish();
+	return 0;
+}
+
+int iotrace_replay(const char *path, int fast)
+{
+	if (rp.running)
+	{
+		printf("iotrace: a replay is running\n");
+		return 0;
+	}
+
+	// the SD disks of a running core share the block cache
+	if (!is_menu())
+	{
+		printf("iotrace: replay needs the menu core\n");
+		return 0;
+	}
+
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+	{
+		printf("iotrace: can't open %s\n", path);
+		return 0;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	long len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	iotrace_hdr_t hdr = {};
+	if (len < (long)sizeof(hdr) || len > IOTRACE_MAX || fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+		hdr.magic != IOTRACE_MAGIC || hdr.version != IOTRACE_VERSION)
+	{
+		printf("iotrace: %s is not a trace\n", path);
+		fclose(fp);
+		return 0;
+	}
+
+	free(rp.lat_us);
+	memset(&rp, 0, sizeof(rp));
+	rp.len = len - sizeof(hdr);
+	rp.data = (uint8_t*)malloc(rp.len);
+	rp.lat_us = (uint32_t*)malloc((rp.len / sizeof(iotrace_rec_t) + 1) * sizeof(uint32_t));
+	if (!rp.data || !rp.lat_us || fread(rp.data, 1, rp.len, fp) != rp.len)
+	{
+		printf("iotrace: can't load %s\n", path);
+		fclose(fp);
+		replay_close();
+		return 0;
+	}
+	fclose(fp);
+
+	if (timer_id < 0) timer_id = scheduler_timer_add("iotrace", replay_tick, 0);
+	if (timer_id < 0)
+	{
+		replay_close();
+		return 0;
+	}
+
+	rp.fast = fast;
+	rp.running = 1;
+	rp.start = profiling_time_us();
+	scheduler_timer_set(timer_id, 1);
+	printf("iotrace: replaying %s%s\n", path, fast ? " (fast)" : "");
+	return 1;
+}
+
+void iotrace_report(FILE *fp)
+{
+	if (rec_fp) fprintf(fp, "recording: %u requests to %s\n", rec_num, rec_path);
+	else fprintf(fp, "recording: off\n");
+
+	if (rp.running)
+	{
+		fprintf(fp, "replay: running, %u requests so far\n", rp.num);
+	}
+	else if (rp.lat_us)
+	{
+		fprintf(fp, "replay: %u requests, %u skipped, %llu bytes in %llu us\n", rp.num, rp.skipped, rp.bytes, rp.elapsed_us);
+		if (rp.num)
+		{
+			fprintf(fp, "latency p50/p99/max: %u/%u/%u us, %.2f MB/s\n", rp.lat_us[rp.num / 2], rp.lat_us[(uint64_t)rp.num * 99 / 100],
+				rp.lat_us[rp.num - 1], rp.elapsed_us ? rp.bytes / (double)rp.elapsed_us : 0.0);
+		}
+	}
+
+	fflush(fp);
+}
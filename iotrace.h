@@ -0,0 +1,35 @@
+#ifndef IOTRACE_H
+#define IOTRACE_H
+
+#include <inttypes.h>
+#include "file_io.h"
+
+// Block request trace of the running core. Every SD, IDE and CD request
+// is appended to a binary file (/tmp by default) as a 16 byte record with
+// a microsecond timestamp, the first request of a disk also stores the
+// image path. The replayer runs the SD and IDE requests of a trace through
+// the file layer again, with the original timing or as fast as possible,
+// so cache and prefetch changes can be compared on real workloads.
+// All calls are main thread only, recording is off until iotrace_start().
+
+#define IOTRACE_SD  0
+#define IOTRACE_IDE 1
+#define IOTRACE_CD  2
+
+#define IOTRACE_READ  1
+#define IOTRACE_WRITE 2
+
+int  iotrace_start(const char *path);
+void iotrace_stop();
+
+// lba and count are in blocks of blksz. file (may be null) names the
+// image on the first request of the disk.
+void iotrace_add(int src, int disk, int op, uint32_t lba, uint32_t blksz, uint32_t count, const fileTYPE *file);
+
+// Replays a trace, fast skips the recorded delays. Runs from a scheduler
+// timer and prints the result when done.
+int  iotrace_replay(const char *path, int fast);
+
+void iotrace_report(FILE *fp);
+
+#endif
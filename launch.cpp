@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "launch.h"
+#include "user_io.h"
+#include "profiling.h"
+
+#define LAUNCH_ENV     "MISTER_LAUNCH"
+#define LAUNCH_FILE    "/tmp/MiSTer_launch.bin"
+#define LAUNCH_MAGIC   0x4C4E434D // "MCNL"
+#define LAUNCH_CORES   16
+#define LAUNCH_TIMEOUT (120 * 1000000ULL) // a launch which never ends is dropped
+
+static const char *phase_names[LAUNCH_PHASES] = { "resolve", "core", "open", "read", "convert", "transfer", "post", "release" };
+
+struct launch_core_t
+{
+	char name[32];
+	uint32_t count;
+	uint32_t last_us;
+	uint32_t runs[LAUNCH_RUNS][LAUNCH_PHASES];
+};
+
+struct launch_file_t
+{
+	uint32_t magic;
+	uint32_t num;
+	launch_core_t cores[LAUNCH_CORES];
+};
+
+static struct
+{
+	int active;
+	int phase;
+	uint64_t start_us;
+	uint64_t last_us;
+	uint32_t us[LAUNCH_PHASES];
+} cur = {};
+
+static int cur_init = 0;
+static launch_file_t stats = {};
+static int stats_loaded = 0;
+
+static void launch_init()
+{
+	if (cur_init) return;
+	cur_init = 1;
+
+	// the core switch stores the running launch before the exec
+	const char *env = getenv(LAUNCH_ENV);
+	if (!env) return;
+
+	unsigned long long start, last;
+	uint32_t *us = cur.us;
+	if (sscanf(env, "%llu %llu %u %u %u %u %u %u %u %u", &start, &last,
+		&us[0], &us[1], &us[2], &us[3], &us[4], &us[5], &us[6], &us[7]) == 2 + LAUNCH_PHASES)
+	{
+		cur.active = 1;
+		cur.phase = LAUNCH_CORE;
+		cur.start_us = start;
+		cur.last_us = last;
+	}
+	unsetenv(LAUNCH_ENV);
+}
+
+static void stats_load()
+{
+	if (stats_loaded) return;
+	stats_loaded = 1;
+
+	int fd = open(LAUNCH_FILE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+
+	if (read(fd, &stats, sizeof(stats)) != sizeof(stats) || stats.magic != LAUNCH_MAGIC || stats.num > LAUNCH_CORES)
+	{
+		memset(&stats, 0, sizeof(stats));
+	}
+	close(fd);
+}
+
+static void stats_save()
+{
+	int fd = open(LAUNCH_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	int ok = write(fd, &stats, sizeof(stats)) == sizeof(stats);
+	close(fd);
+	if (!ok || rename(LAUNCH_FILE ".tmp", LAUNCH_FILE)) unlink(LAUNCH_FILE ".tmp");
+}
+
+static void launch_charge(uint64_t now)
+{
+	cur.us[cur.phase] += (uint32_t)(now - cur.last_us);
+	cur.last_us = now;
+}
+
+void launch_begin()
+{
+	launch_init();
+
+	memset(&cur, 0, sizeof(cur));
+	cur.active = 1;
+	cur.phase = LAUNCH_RESOLVE;
+	cur.start_us = profiling_time_us();
+	cur.last_us = cur.start_us;
+}
+
+void launch_phase(int phase)
+{
+	launch_init();
+	if (!cur.active || phase < 0 || phase >= LAUNCH_PHASES) return;
+
+	uint64_t now = profiling_time_us();
+	if (now - cur.start_us > LAUNCH_TIMEOUT)
+	{
+		cur.active = 0;
+		return;
+	}
+
+	launch_charge(now);
+	cur.phase = phase;
+}
+
+void launch_end()
+{
+	launch_init();
+	if (!cur.active) return;
+
+	cur.active = 0;
+	uint64_t now = profiling_time_us();
+	if (now - cur.start_us > LAUNCH_TIMEOUT) return;
+	launch_charge(now);
+
+	stats_load();
+	stats.magic = LAUNCH_MAGIC;
+
+	const char *name = user_io_get_core_name();
+	launch_core_t *core = nullptr;
+	for (uint32_t i = 0; i < stats.num; i++)
+	{
+		if (!strcmp(stats.cores[i].name, name)) core = &stats.cores[i];
+	}
+
+	if (!core)
+	{
+		// full, the least launched core makes room
+		if (stats.num < LAUNCH_CORES) core = &stats.cores[stats.num++];
+		else
+		{
+			core = &stats.cores[0];
+			for (int i = 1; i < LAUNCH_CORES; i++) if (stats.cores[i].count < core->count) core = &stats.cores[i];
+		}
+
+		memset(core, 0, sizeof(*core));
+		snprintf(core->name, sizeof(core->name), "%s", name);
+	}
+
+	memcpy(core->runs[core->count % LAUNCH_RUNS], cur.us, sizeof(cur.us));
+	core->last_us = (uint32_t)(now - cur.start_us);
+	core->count++;
+	stats_save();
+
+	printf("launch: %s in %.1fms (", core->name, core->last_us / 1000.0);
+	for (int i = 0; i < LAUNCH_PHASES; i++) if (cur.us[i]) printf(" %s %.1f", phase_names[i], cur.us[i] / 1000.0);
+	printf(" )\n");
+}
+
+void launch_switch()
+{
+	launch_init();
+	if (!cur.active) return;
+
+	uint64_t now = profiling_time_us();
+	launch_charge(now);
+
+	char str[160];
+	const uint32_t *us = cur.us;
+	snprintf(str, sizeof(str), "%llu %llu %u %u %u %u %u %u %u %u", cur.start_us, now,
+		us[0], us[1], us[2], us[3], us[4], us[5], us[6], us[7]);
+	setenv(LAUNCH_ENV, str, 1);
+}
+
+int launch_get(int n, const char **core, uint32_t *count, uint32_t *last_us, uint32_t avg_us[LAUNCH_PHASES])
+{
+	stats_load();
+	if (n < 0 || (uint32_t)n >= stats.num) return 0;
+
+	const launch_core_t *c = &stats.cores[n];
+	uint32_t runs = (c->count < LAUNCH_RUNS) ? c->count : LAUNCH_RUNS;
+
+	*core = c->name;
+	*count = c->count;
+	*last_us = c->last_us;
+	for (int p = 0; p < LAUNCH_PHASES; p++)
+	{
+		uint64_t sum = 0;
+		for (uint32_t r = 0; r < runs; r++) sum += c->runs[r][p];
+		avg_us[p] = runs ? (uint32_t)(sum / runs) : 0;
+	}
+	return 1;
+}
+
+void launch_report(FILE *fp)
+{
+	fprintf(fp, "Average of the last %d launches per core, ms\n", LAUNCH_RUNS);
+	fprintf(fp, "%-16s %5s", "core", "runs");
+	for (int p = 0; p < LAUNCH_PHASES; p++) fprintf(fp, " %8s", phase_names[p]);
+	fprintf(fp, " %8s %8s\n", "total", "last");
+
+	const char *name;
+	uint32_t count, last_us, avg_us[LAUNCH_PHASES];
+	for (int n = 0; launch_get(n, &name, &count, &last_us, avg_us); n++)
+	{
+		uint64_t total = 0;
+		fprintf(fp, "%-16.16s %5u", name, count);
+		for (int p = 0; p < LAUNCH_PHASES; p++)
+		{
+			fprintf(fp, " %8.1f", avg_us[p] / 1000.0);
+			total += avg_us[p];
+		}
+		fprintf(fp, " %8.1f %8.1f\n", total / 1000.0, last_us / 1000.0);
+	}
+
+	if (cur.active) fprintf(fp, "(a launch is running, in %s)\n", phase_names[cur.phase]);
+	fflush(fp);
+}
@@ -0,0 +1,37 @@
+#ifndef LAUNCH_H
+#define LAUNCH_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// Launch latency, from picking a file or core in the menu to the core
+// running it. The loaders stamp the phase they enter, the time since the
+// previous stamp goes to the phase left. A launch which switches the core
+// is carried over the restart. Finished launches are kept per core (the
+// last LAUNCH_RUNS of each) in tmpfs, so they survive later core switches.
+// All calls are main thread only and cheap enough for the transfer loops.
+
+#define LAUNCH_RESOLVE  0  // menu side: path, recents, config
+#define LAUNCH_CORE     1  // FPGA programming and restart
+#define LAUNCH_OPEN     2
+#define LAUNCH_READ     3
+#define LAUNCH_CONVERT  4
+#define LAUNCH_TRANSFER 5
+#define LAUNCH_POST     6  // saves, cheats and other setup after the load
+#define LAUNCH_RELEASE  7  // end of the download, core out of reset
+#define LAUNCH_PHASES   8
+
+#define LAUNCH_RUNS     8
+
+void launch_begin();
+void launch_phase(int phase);
+void launch_end();
+
+// Right before the exec of a core switch.
+void launch_switch();
+
+// Averages of core n over its last runs (0 up to the first 0 return).
+int  launch_get(int n, const char **core, uint32_t *count, uint32_t *last_us, uint32_t avg_us[LAUNCH_PHASES]);
+void launch_report(FILE *fp);
+
+#endif
@@ -82,6 +82,13 @@ mz_ulong mz_adler32(mz_ulong adler, const unsigned char *ptr, size_t buf_len)
         }
         return ~crcu32;
     }
+#elif !defined(MINIZ_OWN_CRC32)
+/* MiSTer: the slice-by-8 kernel of crc.cpp, shared with the ROM loaders. */
+#include "crc.h"
+mz_ulong mz_crc32(mz_ulong crc, const mz_uint8 *ptr, size_t buf_len)
+{
+    return crc32_update((mz_uint32)crc, ptr, ptr ? buf_len : 0);
+}
 #else
 /* Faster, but larger CPU cache footprint.
  */
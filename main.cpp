@@ -33,6 +33,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "scheduler.h"
 #include "osd.h"
 #include "offload.h"
+#include "profiling.h"
+#include "sysstatus.h"
+#include "statuspage.h"
+#include "fpgasim.h"
 
 const char *version = "$VER:" VDATE;
 
@@ -46,9 +50,19 @@ int main(int argc, char *argv[])
 	CPU_SET(1, &set);
 	sched_setaffinity(0, sizeof(set), &set);
 
-	offload_start();
+	{
+		BOOT_SCOPE("offload_start");
+		offload_start();
+	}
+
+	{
+		BOOT_SCOPE("fpga_io_init");
+		fpga_io_init();
+	}
 
-	fpga_io_init();
+#ifdef FPGA_SIM
+	if (argc > 1 && !strcmp(argv[1], "--sim")) return fpgasim_main(argc - 2, argv + 2);
+#endif
 
 	DISKLED_OFF;
 
@@ -68,8 +82,18 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
-	FindStorage();
-	user_io_init((argc > 1) ? argv[1] : "",(argc > 2) ? argv[2] : NULL);
+	{
+		BOOT_SCOPE("FindStorage");
+		FindStorage();
+	}
+
+	{
+		BOOT_SCOPE("user_io_init");
+		user_io_init((argc > 1) ? argv[1] : "",(argc > 2) ? argv[2] : NULL);
+	}
+
+	sysstatus_init();
+	statuspage_init();
 
 #ifdef USE_SCHEDULER
 	scheduler_init();
@@ -82,10 +106,12 @@ int main(int argc, char *argv[])
 			fpga_wait_to_reset();
 		}
 
+		scheduler_timer_run();
 		user_io_poll();
 		input_poll(0);
 		HandleUI();
 		OsdUpdate();
+		profiling_boot_done();
 	}
 #endif
 	return 0;
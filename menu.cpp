@@ -31,9 +31,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netdb.h>
-#include <ifaddrs.h>
 #include <sys/stat.h>
-#include <sys/statvfs.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <sched.h>
@@ -64,6 +62,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "bootcore.h"
 #include "ide.h"
 #include "profiling.h"
+#include "scheduler.h"
+#include "sysstatus.h"
+#include "launch.h"
+#include "thumbs.h"
 
 /*menu states*/
 enum MENU
@@ -424,12 +426,13 @@ void SelectFile(const char* path, const char* pFileExt, int Options, unsigned ch
 		}
 	}
 
-	ScanDirectory(selPath, SCANF_INIT, pFileExt, Options);
+	// the browser paints while large folders are still loading
+	ScanDirectory(selPath, SCANF_INIT, pFileExt, Options | SCANO_ASYNC);
 	AdjustDirectory(selPath);
 
 	strcpy(fs_pFileExt, pFileExt);
 	fs_ExtLen = strlen(fs_pFileExt);
-	fs_Options = Options & ~SCANO_NOENTER;
+	fs_Options = (Options & ~SCANO_NOENTER) | SCANO_ASYNC;
 	fs_MenuSelect = MenuSelect;
 	fs_MenuCancel = MenuCancel;
 
@@ -470,6 +473,8 @@ void SelectINI()
 
 /* the Atari core handles OSD keys competely inside the core */
 static uint32_t menu_key = 0;
+static uint32_t menu_key_seen = 0;   // the key as last taken by menu_key_get()
+static unsigned char menu_but_seen = 0;
 
 void menu_key_set(unsigned int c)
 {
@@ -504,6 +509,7 @@ static uint32_t menu_key_get(void)
 			hold_cnt = 1;
 		}
 		c2 = c1;
+		menu_key_seen = c1;
 
 		// generate repeat "key-pressed" events
 		if ((c1 & UPSTROKE) || (!c1))
@@ -526,10 +532,9 @@ static uint32_t menu_key_get(void)
 	if (!c && !select_ini)
 	{
 		static unsigned long longpress = 0, longpress_consumed = 0;
-		static unsigned char last_but = 0;
 		unsigned char but = user_io_menu_button();
 
-		if (but && !last_but) longpress = GetTimer(3000);
+		if (but && !menu_but_seen) longpress = GetTimer(3000);
 		if (but && CheckTimer(longpress) && !longpress_consumed)
 		{
 			longpress_consumed = 1;
@@ -537,10 +542,10 @@ static uint32_t menu_key_get(void)
 			else menustate = MENU_BTPAIR;
 		}
 
-		if (!but && last_but && !longpress_consumed) c = KEY_F12;
+		if (!but && menu_but_seen && !longpress_consumed) c = KEY_F12;
 
 		if (!but) longpress_consumed = 0;
-		last_but = but;
+		menu_but_seen = but;
 	}
 
 	if (!c)
@@ -585,49 +590,15 @@ static uint32_t menu_key_get(void)
 	return(c);
 }
 
-static char* getNet(int spec)
+int menu_ui_idle()
 {
-	int netType = 0;
-	struct ifaddrs *ifaddr, *ifa, *ifae = 0, *ifaw = 0;
-	static char host[NI_MAXHOST];
-
-	if (getifaddrs(&ifaddr) == -1)
-	{
-		printf("getifaddrs: error\n");
-		return NULL;
-	}
-
-	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
-	{
-		if (ifa->ifa_addr == NULL) continue;
-		if (!memcmp(ifa->ifa_addr->sa_data, "\x00\x00\xa9\xfe", 4)) continue; // 169.254.x.x
+	// the menu core has its own timeouts on screen
+	if (is_menu() || select_ini || menustate != MENU_NONE2 || bt_timer >= 0) return 0;
+	if (user_io_osd_is_visible() || video_fb_state() || !mgl_get()->done) return 0;
 
-		if ((strcmp(ifa->ifa_name, "eth0") == 0)     && (ifa->ifa_addr->sa_family == AF_INET)) ifae = ifa;
-		if ((strncmp(ifa->ifa_name, "wlan", 4) == 0) && (ifa->ifa_addr->sa_family == AF_INET)) ifaw = ifa;
-	}
-
-	ifa = 0;
-	netType = 0;
-	if (ifae && (!spec || spec == 1))
-	{
-		ifa = ifae;
-		netType = 1;
-	}
-
-	if (ifaw && (!spec || spec == 2))
-	{
-		ifa = ifaw;
-		netType = 2;
-	}
-
-	if (spec && ifa)
-	{
-		strcpy(host, "IP: ");
-		getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in), host + strlen(host), NI_MAXHOST - strlen(host), NULL, 0, NI_NUMERICHOST);
-	}
-
-	freeifaddrs(ifaddr);
-	return spec ? (ifa ? host : 0) : (char*)netType;
+	// a key or a button press not taken yet, or one held
+	if (menu_key != menu_key_seen || (menu_key && !(menu_key & UPSTROKE))) return 0;
+	return !user_io_menu_button() && !menu_but_seen;
 }
 
 static long sysinfo_timer;
@@ -649,8 +620,9 @@ static void printSysInfo()
 	if (!sysinfo_timer || CheckTimer(sysinfo_timer))
 	{
 		sysinfo_timer = GetTimer(2000);
-		struct battery_data_t bat;
-		int hasbat = getBattery(0, &bat);
+		const sysstatus_t *st = sysstatus_get();
+		const struct battery_data_t &bat = st->bat;
+		int hasbat = st->has_battery;
 		int n = 2;
 		static int flip = 0;
 
@@ -658,18 +630,15 @@ static void printSysInfo()
 		OsdWrite(n++, info_top, 0, 0);
 
 		int j = 0;
-		char *net;
-		net = getNet(1);
-		if (net)
+		if (st->eth[0])
 		{
-			sprintf(str, "\x1c %s", net);
+			sprintf(str, "\x1c IP: %s", st->eth);
 			infowrite(n++, str);
 			j++;
 		}
-		net = getNet(2);
-		if (net)
+		if (st->wlan[0])
 		{
-			sprintf(str, "\x1d %s", net);
+			sprintf(str, "\x1d IP: %s", st->wlan);
 			infowrite(n++, str);
 			j++;
 		}
@@ -1025,7 +994,11 @@ void HandleUI(void)
 			mgl->state = 0;
 			mgl->current++;
 			if (mgl->current < mgl->count) mgl->timer = GetTimer(mgl->item[mgl->current].delay * 1000);
-			else mgl->done = 1;
+			else
+			{
+				mgl->done = 1;
+				launch_end();
+			}
 			break;
 
 		case 4:
@@ -1370,6 +1343,8 @@ void HandleUI(void)
 		break;
 	}
 
+	if (menustate != MENU_FILE_SELECT1 && menustate != MENU_FILE_SELECT2) thumbs_hide();
+
 	// Switch to current menu screen
 	switch (menustate)
 	{
@@ -2392,6 +2367,9 @@ void HandleUI(void)
 
 	case MENU_GENERIC_FILE_SELECTED:
 		{
+			// the files of an MGL belong to the launch of its core
+			if (mgl->done) launch_begin();
+
 			if (!mgl->done)
 			{
 				if(mgl->item[mgl->current].path[0] == '/') snprintf(selPath, sizeof(selPath), "%s", mgl->item[mgl->current].path);
@@ -2421,6 +2399,7 @@ void HandleUI(void)
 				{
 					neocd_set_en(0);
 					neogeo_romset_tx(selPath, 0);
+					launch_phase(LAUNCH_POST);
 				}
 				else
 				{
@@ -2433,12 +2412,15 @@ void HandleUI(void)
 					if (is_n64())
 					{
 						uint32_t n64_crc;
-						if (!n64_rom_tx(selPath, idx, load_addr, n64_crc)) Info("failed to load ROM");
+						int n64_ok = n64_rom_tx(selPath, idx, load_addr, n64_crc);
+						launch_phase(LAUNCH_POST);
+						if (!n64_ok) Info("failed to load ROM");
 						else if (user_io_use_cheats() && !store_name) cheats_init(selPath, n64_crc);
 					}
 					else
 					{
 						user_io_file_tx(selPath, idx, opensave, 0, 0, load_addr);
+						launch_phase(LAUNCH_POST);
 						if (user_io_use_cheats() && !store_name) cheats_init(selPath, user_io_get_file_crc());
 					}
 				}
@@ -2446,6 +2428,7 @@ void HandleUI(void)
 				if (addon[0] == 'f' && addon[1] == '1') process_addon(addon, idx);
 			}
 
+			if (mgl->done) launch_end();
 			mgl->state = 3;
 		}
 		break;
@@ -4979,6 +4962,7 @@ void HandleUI(void)
 		OsdSetTitle((fs_Options & SCANO_CORES) ? "Cores" : "Select", 0);
 		PrintDirectory(hold_cnt<2);
 		menustate = MENU_FILE_SELECT2;
+		if ((fs_Options & SCANO_CORES) && strcasestr(selPath, "_Arcade")) mraindex_update(selPath);
 		if (cfg.log_file_entry && flist_nDirEntries())
 		{
 			//Write out paths infos for external integration
@@ -4990,6 +4974,10 @@ void HandleUI(void)
 
 	case MENU_FILE_SELECT2:
 		menumask = 0;
+		if (flist_ScanUpdated()) menustate = MENU_FILE_SELECT1;
+
+		if (flist_nDirEntries() && flist_SelectedItem()->de.d_type != DT_DIR) thumbs_select(flist_Path(), flist_SelectedItem()->altname);
+		else thumbs_select(flist_Path(), nullptr);
 
 		if (c == KEY_BACKSPACE && (fs_Options & (SCANO_UMOUNT | SCANO_CLEAR)) && !strlen(filter))
 		{
@@ -5055,8 +5043,9 @@ void HandleUI(void)
 
 			if (c == KEY_HOME || c == KEY_TAB)
 			{
+				// TAB needs the complete listing to pick the up-dir entry
 				filter_typing_timer = 0;
-				ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options);
+				ScanDirectory(selPath, SCANF_INIT, fs_pFileExt, fs_Options & ~SCANO_ASYNC);
 				menustate = MENU_FILE_SELECT1;
 				select = (c == KEY_TAB && flist_SelectedItem()->de.d_type == DT_DIR && !strcmp(flist_SelectedItem()->de.d_name, ".."));
 			}
@@ -5130,7 +5119,7 @@ void HandleUI(void)
 			{
 				static char name[256];
 				char type = flist_SelectedItem()->de.d_type;
-				memcpy(name, flist_SelectedItem()->de.d_name, sizeof(name));
+				snprintf(name, sizeof(name), "%s", flist_SelectedItem()->de.d_name);
 
 				if ((fs_Options & SCANO_UMOUNT) && (is_megacd() || is_pce() || is_neogeo() || (is_psx() && !(fs_Options & SCANO_SAVES)) || is_saturn()) && type == DT_DIR && strcmp(flist_SelectedItem()->de.d_name, ".."))
 				{
@@ -5142,7 +5131,7 @@ void HandleUI(void)
 					else
 					{
 						type = flist_SelectedItem()->de.d_type;
-						memcpy(name, flist_SelectedItem()->de.d_name, sizeof(name));
+						snprintf(name, sizeof(name), "%s", flist_SelectedItem()->de.d_name);
 					}
 				}
 
@@ -5553,8 +5542,7 @@ void HandleUI(void)
 				ioctl_index = 0;
 				if (df[menusub].status & DSK_INSERTED) // eject selected floppy
 				{
-					df[menusub].status = 0;
-					FileClose(&df[menusub].file);
+					EjectFloppy(&df[menusub]);
 					menustate = MENU_MINIMIG_MAIN1;
 				}
 				else
@@ -6110,7 +6098,7 @@ void HandleUI(void)
 					fs_MenuSelect = MENU_MINIMIG_HDFFILE_SELECTED;
 					fs_MenuCancel = MENU_MINIMIG_DISK1;
 					int idx = (menusub - 3) / 2;
-					strcpy(fs_pFileExt, (minimig_config.hardfile[idx].cfg == 2) ? "ISOCUECHDIMG" : "HDFVHDIMGDSK");
+					strcpy(fs_pFileExt, (minimig_config.hardfile[idx].cfg == 2) ? "ISOCUECHDIMG" : "HDFVHDIMGDSKCHD");
 					if (select)
 					{
 						if (!Selected_S[idx][0]) memcpy(Selected_S[idx], minimig_config.hardfile[idx].filename, sizeof(Selected_S[idx]));
@@ -6356,10 +6344,7 @@ void HandleUI(void)
 		OsdWrite(m++, s);
 
 		{
-			uint64_t avail = 0;
-			struct statvfs buf;
-			memset(&buf, 0, sizeof(buf));
-			if (!statvfs(getRootDir(), &buf)) avail = buf.f_bsize * buf.f_bavail;
+			uint64_t avail = sysstatus_get()->storage_avail;
 			if(avail < (10ull*1024*1024*1024)) sprintf(s, "   Available space: %llumb", avail / (1024 * 1024));
 			else sprintf(s, "   Available space: %llugb", avail / (1024 * 1024 * 1024));
 			OsdWrite(m+2, s, 0, 0);
@@ -6883,6 +6868,7 @@ void HandleUI(void)
 			}
 		}
 
+		launch_begin();
 		if (isXmlName(Selected_tmp))
 		{
 			// find the RBF file from the XML
@@ -6975,10 +6961,11 @@ void HandleUI(void)
 					strftime(str + strlen(str), sizeof(str) - 1 - strlen(str), "%b %d %a%H:%M:%S", &tm);
 				}
 
+				const sysstatus_t *st = sysstatus_get();
 				int n = 8;
-				if (getNet(2)) str[n++] = 0x1d;
-				if (getNet(1)) str[n++] = 0x1c;
-				if (hci_get_route(0) >= 0) str[n++] = 4;
+				if (st->wlan[0]) str[n++] = 0x1d;
+				if (st->eth[0]) str[n++] = 0x1c;
+				if (st->bluetooth) str[n++] = 4;
 				if (user_io_get_sdram_cfg() & 0x8000)
 				{
 					switch (user_io_get_sdram_cfg() & 7)
@@ -7075,6 +7062,8 @@ void PrintDirectory(int expand)
 		}
 	}
 
+	flist_RenderBusy(1);
+
 	int i = 0;
 	int k = flist_iFirstEntry();
 	while(i < OsdGetSize())
@@ -7108,7 +7097,7 @@ void PrintDirectory(int expand)
 				strncpy(s + 1, flist_DirItem(k)->altname, len); // display only name
 			}
 
-			char *datecode = flist_DirItem(k)->datecode;
+			const char *datecode = flist_DirItem(k)->datecode;
 			if (flist_DirItem(k)->de.d_type == DT_DIR) // mark directory with suffix
 			{
 				if (!strcmp(flist_DirItem(k)->altname, ".."))
@@ -7176,7 +7165,13 @@ void PrintDirectory(int expand)
 		}
 
 		k++;
+
+#ifdef USE_SCHEDULER
+		scheduler_yield_budget();
+#endif
 	}
+
+	flist_RenderBusy(0);
 }
 
 static void set_text(const char *message, unsigned char code)
@@ -7309,20 +7304,27 @@ static char pchar[] = { 0x8C, 0x8E, 0x8F, 0x90, 0x91, 0x7F };
 #define PROGRESS_CNT    28
 #define PROGRESS_CHARS  (int)(sizeof(pchar)/sizeof(pchar[0]))
 #define PROGRESS_MAX    ((PROGRESS_CHARS*PROGRESS_CNT)-1)
+#define PROGRESS_PERIOD 50  // ms, the bar is redrawn at 20Hz at most
 
+// Called from the transfer loops, which run inside the UI task, so the bar
+// is drawn right here. The redraws are rate limited to keep the OSD SPI
+// traffic off the transfer, a skipped step shows up with the next redraw.
 void ProgressMessage(const char* title, const char* text, int current, int max)
 {
 	static int progress;
+	static unsigned long next_draw = 0;
 	if (!current && !max)
 	{
 		progress = -1;
+		next_draw = 0;
 		MenuHide();
 		return;
 	}
 
 	int new_progress = (((uint64_t)current)*PROGRESS_MAX) / max;
-	if (progress != new_progress)
+	if (progress != new_progress && (!next_draw || CheckTimer(next_draw)))
 	{
+		next_draw = GetTimer(PROGRESS_PERIOD);
 		progress = new_progress;
 		static char progress_buf[128];
 		memset(progress_buf, 0, sizeof(progress_buf));
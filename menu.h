@@ -6,6 +6,10 @@
 void SelectFile(const char* path, const char* pFileExt, int Options, unsigned char MenuSelect, unsigned char MenuCancel);
 
 void HandleUI(void);
+
+// OSD hidden and nothing for HandleUI() to do until a menu key or a message
+int menu_ui_idle();
+
 void menu_key_set(unsigned int c);
 void menu_process_save();
 void PrintDirectory(int expand = 0);
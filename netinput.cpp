@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "netinput.h"
+#include "input.h"
+#include "user_io.h"
+#include "profiling.h"
+
+#define NET_BATCH   16
+#define NET_RESTART 4096  // a sequence this far back is a restarted sender
+
+struct net_player_t
+{
+	int active;
+	uint32_t seq;
+	uint32_t buttons;
+	int8_t axes[4];
+	uint64_t last_us;
+	uint64_t pending_us;    // receive time of a button change not sent yet
+	int ack;                // reply owed for seq
+	uint32_t stamp;
+	struct sockaddr_in from;
+
+	uint32_t packets;
+	uint32_t lost;          // sequence gaps, late arrivals of them count as late too
+	uint32_t late;
+	uint32_t restarts;
+	uint32_t timeouts;
+};
+
+static int net_fd = -1;
+static int net_port = 0;
+static int net_hist = -1;
+static int net_active = 0;
+static uint32_t net_bad = 0;
+static net_player_t players[NETINPUT_PLAYERS] = {};
+
+static void net_ack(int player)
+{
+	net_player_t *p = &players[player];
+	p->ack = 0;
+
+	netinput_pkt_t pkt = {};
+	pkt.magic = NETINPUT_MAGIC;
+	pkt.player = player;
+	pkt.flags = NETINPUT_ACK;
+	pkt.seq = p->seq;
+	pkt.buttons = p->buttons;
+	memcpy(pkt.axes, p->axes, sizeof(pkt.axes));
+	pkt.stamp = p->stamp;
+
+	if (sendto(net_fd, &pkt, sizeof(pkt), MSG_DONTWAIT, (struct sockaddr*)&p->from, sizeof(p->from)) < 0) {}
+}
+
+// sticks go out right away, like the ones of the local pads
+static int net_send_axes(int player, const int8_t *axes, int changed)
+{
+	if (!input_state() || user_io_osd_is_visible()) return 0;
+
+	if (changed & 1) user_io_l_analog_joystick(player, axes[0], axes[1]);
+	if (changed & 2) user_io_r_analog_joystick(player, axes[2], axes[3]);
+	return 1;
+}
+
+static void net_release(int player)
+{
+	net_player_t *p = &players[player];
+	if (!p->active) return;
+
+	p->active = 0;
+	net_active--;
+	p->buttons = 0;
+	p->pending_us = 0;
+	p->ack = 0;
+
+	int changed = ((p->axes[0] || p->axes[1]) ? 1 : 0) | ((p->axes[2] || p->axes[3]) ? 2 : 0);
+	memset(p->axes, 0, sizeof(p->axes));
+	if (changed) net_send_axes(player, p->axes, changed);
+}
+
+static void net_packet(const netinput_pkt_t *pkt, uint32_t len, const struct sockaddr_in *from, uint64_t rx)
+{
+	if (len < sizeof(*pkt) || pkt->magic != NETINPUT_MAGIC || pkt->player >= NETINPUT_PLAYERS)
+	{
+		net_bad++;
+		return;
+	}
+
+	net_player_t *p = &players[pkt->player];
+	int32_t d = (int32_t)(pkt->seq - p->seq);
+	if (!p->active)
+	{
+		p->active = 1;
+		net_active++;
+	}
+	else if (d < -NET_RESTART)
+	{
+		p->restarts++;
+	}
+	else if (d <= 0)
+	{
+		p->late++;
+		return;
+	}
+	else
+	{
+		p->lost += d - 1;
+	}
+
+	p->packets++;
+	p->seq = pkt->seq;
+	p->last_us = rx;
+	p->from = *from;
+
+	if (pkt->buttons != p->buttons)
+	{
+		p->buttons = pkt->buttons;
+		p->pending_us = rx;
+	}
+
+	int changed = ((pkt->axes[0] != p->axes[0] || pkt->axes[1] != p->axes[1]) ? 1 : 0) |
+		((pkt->axes[2] != p->axes[2] || pkt->axes[3] != p->axes[3]) ? 2 : 0);
+	if (changed)
+	{
+		memcpy(p->axes, pkt->axes, sizeof(p->axes));
+		if (net_send_axes(pkt->player, p->axes, changed)) profiling_hist_add(net_hist, (uint32_t)(profiling_time_us() - rx));
+	}
+
+	if (pkt->flags & NETINPUT_ACK)
+	{
+		p->ack = 1;
+		p->stamp = pkt->stamp;
+
+		// with a button change the reply waits for input_poll() to send it
+		if (!p->pending_us) net_ack(pkt->player);
+	}
+}
+
+int netinput_open(int port)
+{
+	netinput_close();
+	if (port <= 0 || port > 65535) return -1;
+
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		printf("netinput: can't create the socket\n");
+		return -1;
+	}
+
+	// kernel receive stamps, so the latency includes the wait for the main loop
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
+	struct sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)))
+	{
+		printf("netinput: can't bind UDP port %d\n", port);
+		close(fd);
+		return -1;
+	}
+
+	if (net_hist < 0) net_hist = profiling_hist_id("net input");
+	memset(players, 0, sizeof(players));
+	net_active = 0;
+	net_bad = 0;
+	net_fd = fd;
+	net_port = port;
+	printf("netinput: listening on UDP port %d\n", port);
+	return fd;
+}
+
+void netinput_close()
+{
+	if (net_fd < 0) return;
+
+	for (int i = 0; i < NETINPUT_PLAYERS; i++) net_release(i);
+	close(net_fd);
+	net_fd = -1;
+}
+
+void netinput_read(int fd)
+{
+	struct mmsghdr msgs[NET_BATCH];
+	struct iovec iov[NET_BATCH];
+	netinput_pkt_t pkts[NET_BATCH];
+	struct sockaddr_in from[NET_BATCH];
+	char ctrl[NET_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+
+	while (1)
+	{
+		memset(msgs, 0, sizeof(msgs));
+		for (int i = 0; i < NET_BATCH; i++)
+		{
+			iov[i].iov_base = &pkts[i];
+			iov[i].iov_len = sizeof(pkts[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+			msgs[i].msg_hdr.msg_control = ctrl[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+		}
+
+		int n = recvmmsg(fd, msgs, NET_BATCH, MSG_DONTWAIT, nullptr);
+		if (n <= 0) break;
+
+		// the stamps are CLOCK_REALTIME, profiling_time_us() is monotonic
+		struct timespec rt;
+		clock_gettime(CLOCK_REALTIME, &rt);
+		uint64_t now = profiling_time_us();
+		int64_t rt_off = (int64_t)rt.tv_sec * 1000000 + rt.tv_nsec / 1000 - (int64_t)now;
+
+		for (int k = 0; k < n; k++)
+		{
+			uint64_t rx = now;
+			for (struct cmsghdr *c = CMSG_FIRSTHDR(&msgs[k].msg_hdr); c; c = CMSG_NXTHDR(&msgs[k].msg_hdr, c))
+			{
+				if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPNS) continue;
+
+				struct timespec ts;
+				memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+				int64_t t = (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - rt_off;
+				if (t > 0 && (uint64_t)t <= now) rx = t;
+			}
+
+			net_packet(&pkts[k], msgs[k].msg_len, &from[k], rx);
+		}
+
+		if (n < NET_BATCH) break;
+	}
+}
+
+void netinput_check()
+{
+	if (!net_active) return;
+
+	uint64_t now = profiling_time_us();
+	for (int i = 0; i < NETINPUT_PLAYERS; i++)
+	{
+		if (players[i].active && now - players[i].last_us > NETINPUT_TIMEOUT * 1000ULL)
+		{
+			players[i].timeouts++;
+			net_release(i);
+		}
+	}
+}
+
+uint64_t netinput_joy(int player)
+{
+	return (player >= 0 && player < NETINPUT_PLAYERS) ? players[player].buttons : 0;
+}
+
+void netinput_done(int player, int sent)
+{
+	if (player < 0 || player >= NETINPUT_PLAYERS) return;
+
+	net_player_t *p = &players[player];
+	if (!p->pending_us) return;
+
+	if (sent) profiling_hist_add(net_hist, (uint32_t)(profiling_time_us() - p->pending_us));
+	p->pending_us = 0;
+	if (p->ack) net_ack(player);
+}
+
+void netinput_report(FILE *fp)
+{
+	if (net_fd < 0) fprintf(fp, "netinput: off\n");
+	else fprintf(fp, "netinput: UDP port %d, %u bad packets\n", net_port, net_bad);
+
+	fprintf(fp, "%-6s %6s %10s %8s %8s %8s %8s %8s\n", "player", "state", "packets", "lost", "late", "restarts", "timeouts", "buttons");
+	for (int i = 0; i < NETINPUT_PLAYERS; i++)
+	{
+		const net_player_t *p = &players[i];
+		if (!p->packets) continue;
+
+		fprintf(fp, "%-6d %6s %10u %8u %8u %8u %8u %08X\n", i + 1, p->active ? "active" : "idle",
+			p->packets, p->lost, p->late, p->restarts, p->timeouts, p->buttons);
+	}
+
+	const char *name;
+	uint32_t count, p50, p99, max;
+	if (net_hist >= 0 && profiling_hist_get(net_hist, &name, &count, &p50, &p99, &max) && count)
+	{
+		fprintf(fp, "latency p50/p99/max: %u/%u/%u us over %u sends\n", p50, p99, max, count);
+	}
+
+	fflush(fp);
+}
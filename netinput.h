@@ -0,0 +1,52 @@
+#ifndef NETINPUT_H
+#define NETINPUT_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// UDP input of remote controllers. Every datagram holds the full state of
+// one player, so a lost packet is made up by the next one and late or
+// duplicated packets (sequence not newer than the last one taken) are
+// dropped. The buttons are merged into the player's joystick state by
+// input_poll(), the sticks go to the core on arrival. A player without
+// packets for NETINPUT_TIMEOUT ms is released, senders keep repeating the
+// state while idle. The latency from the kernel receive to the send to the
+// core is the "net input" histogram. All calls are main thread only.
+
+#define NETINPUT_MAGIC   0x314E494D  // "MIN1", little endian like the rest
+#define NETINPUT_PLAYERS 6
+#define NETINPUT_TIMEOUT 1000
+
+#define NETINPUT_ACK     1           // reply with the packet once it reached the core
+
+struct netinput_pkt_t
+{
+	uint32_t magic;
+	uint8_t  player;    // 0 based
+	uint8_t  flags;
+	uint16_t reserved;
+	uint32_t seq;       // incremented per packet by the sender
+	uint32_t buttons;   // core joystick bits: right, left, down, up, then the buttons
+	int8_t   axes[4];   // left x, y, right x, y
+	uint32_t stamp;     // sender's own, echoed back in the reply
+} __attribute__((packed));
+
+// Binds the port, returns the socket to poll or -1.
+int  netinput_open(int port);
+void netinput_close();
+
+// Reads everything pending on fd.
+void netinput_read(int fd);
+
+// Releases the players that timed out.
+void netinput_check();
+
+// Buttons of a player, the bit layout of the joystick map.
+uint64_t netinput_joy(int player);
+
+// Called per player after its buttons were merged, sent if they went out.
+void netinput_done(int player, int sent);
+
+void netinput_report(FILE *fp);
+
+#endif
@@ -1,77 +1,147 @@
 #include "offload.h"
 #include "profiling.h"
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <atomic>
 
-static constexpr uint32_t QUEUE_SIZE = 8;
+static constexpr uint32_t QUEUE_SIZE = 8; // per class, must be pow2
 
-static pthread_t s_thread_handle;
-static pthread_cond_t s_cond_work, s_cond_available;
-static pthread_mutex_t s_queue_lock;
+// job handle layout: [31:5] sequence, [4:2] slot, [1:0] class
+#define JOB_HANDLE(seq, slot, cls) (((seq) << 5) | ((slot) << 2) | (cls))
+#define JOB_SEQ(job)   ((job) >> 5)
+#define JOB_SLOT(job)  (((job) >> 2) & (QUEUE_SIZE - 1))
+#define JOB_CLASS(job) ((job) & 3)
+
+// Both workers share core #0 since main runs on core #1. A second worker
+// keeps the pool moving while the other one is blocked on slow storage.
+static constexpr int NUM_WORKERS = 2;
+
+enum WorkState
+{
+	WORK_FREE = 0,
+	WORK_QUEUED,
+	WORK_RUNNING
+};
 
 struct Work
 {
-	std::function<void()> handler;
+	offload_fn handler;
+	uint32_t seq;              // written by the producer only
+	std::atomic<int> state;
+	uint64_t submit_us;
 };
 
-static Work s_queue[QUEUE_SIZE];
-static uint32_t s_queue_head, s_queue_tail;
-static bool s_quit;
+// Single producer (main thread) ring per class. The producer only touches
+// head and FREE slots, so it never needs the consumer lock. Workers share
+// the tail and the stats under s_consumer_lock.
+struct WorkQueue
+{
+	Work slots[QUEUE_SIZE];
+	std::atomic<uint32_t> head; // next slot to fill
+	uint32_t tail;              // next slot to dispatch
+	uint32_t seq;
+	uint32_t submitted;         // producer side counters
+	uint32_t inline_runs;
+	offload_stats_t stats;
+};
+
+static pthread_t s_thread_handle[NUM_WORKERS];
+static pthread_mutex_t s_consumer_lock;
+static sem_t s_work_sem;
+
+static WorkQueue s_queue[OFFLOAD_CLASS_COUNT];
+static std::atomic<bool> s_quit;
+static int s_running = 0;
+
+static const char *class_names[OFFLOAD_CLASS_COUNT] = { "io", "decompress", "ui" };
+
+static uint64_t time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+// returns the highest priority queue with dispatchable work
+static WorkQueue *next_queue()
+{
+	for (int i = 0; i < OFFLOAD_CLASS_COUNT; i++)
+	{
+		if (s_queue[i].head.load(std::memory_order_acquire) != s_queue[i].tail) return &s_queue[i];
+	}
+	return nullptr;
+}
 
 static void *worker_thread(void *)
 {
 	while (true)
 	{
-		Work *current_work = nullptr;
-		// Wait for work
-		pthread_mutex_lock(&s_queue_lock);
-		if (s_queue_head == s_queue_tail)
+		// Wait for work, every posted job and the quit request carry one count
+		while (sem_wait(&s_work_sem) && errno == EINTR);
+
+		pthread_mutex_lock(&s_consumer_lock);
+		WorkQueue *queue = next_queue();
+		if (!queue)
 		{
-			// queue empty and quit flag set, exit
-			if (s_quit)
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
-
-			// wait for work signal
-			pthread_cond_wait(&s_cond_work, &s_queue_lock);
-			
-			// quit flag was set and queue still empty, quit
-			if (s_quit && (s_queue_head == s_queue_tail))
-			{
-				pthread_mutex_unlock(&s_queue_lock);
-				break;
-			}
+			pthread_mutex_unlock(&s_consumer_lock);
+			if (s_quit.load()) break;
+			continue;
 		}
 
 		// get work
-		current_work = &s_queue[s_queue_tail % QUEUE_SIZE];
-		pthread_mutex_unlock(&s_queue_lock);
+		Work *current_work = &queue->slots[queue->tail % QUEUE_SIZE];
+		queue->tail++;
+		current_work->state.store(WORK_RUNNING, std::memory_order_relaxed);
+		pthread_mutex_unlock(&s_consumer_lock);
+
+		uint64_t start_us = time_us();
+		uint64_t wait_us = start_us - current_work->submit_us;
 
 		// execute
-		current_work->handler();
-		current_work->handler = nullptr;
-
-		// lock and move tail forward
-		pthread_mutex_lock(&s_queue_lock);
-		s_queue_tail++;
-		pthread_cond_signal(&s_cond_available);
-		pthread_mutex_unlock(&s_queue_lock);
+		{
+			PROFILE_SCOPE(class_names[queue - s_queue]);
+			current_work->handler();
+		}
+		current_work->handler.reset();
+		uint64_t run_us = time_us() - start_us;
+
+		pthread_mutex_lock(&s_consumer_lock);
+		offload_stats_t *stats = &queue->stats;
+		stats->jobs++;
+		stats->wait_us += wait_us;
+		stats->run_us += run_us;
+		if (wait_us > stats->wait_max_us) stats->wait_max_us = wait_us;
+		if (run_us > stats->run_max_us) stats->run_max_us = run_us;
+		pthread_mutex_unlock(&s_consumer_lock);
+
+		// hand the slot back to the producer
+		current_work->state.store(WORK_FREE, std::memory_order_release);
 	}
 	return (void *)0;
 }
 
 void offload_start()
 {
-	pthread_cond_init(&s_cond_available, nullptr);
-	pthread_cond_init(&s_cond_work, nullptr);
-	pthread_mutex_init(&s_queue_lock, nullptr);
+	pthread_mutex_init(&s_consumer_lock, nullptr);
+	sem_init(&s_work_sem, 0, 0);
 
-	s_queue_head = s_queue_tail = 0;
-	s_quit = false;
+	for (int i = 0; i < OFFLOAD_CLASS_COUNT; i++)
+	{
+		for (uint32_t n = 0; n < QUEUE_SIZE; n++) s_queue[i].slots[n].state.store(WORK_FREE);
+		s_queue[i].head.store(0);
+		s_queue[i].tail = 0;
+		s_queue[i].seq = 0;
+		s_queue[i].submitted = 0;
+		s_queue[i].inline_runs = 0;
+		memset(&s_queue[i].stats, 0, sizeof(offload_stats_t));
+	}
+	s_quit.store(false);
 
 	pthread_attr_t attr;
 
@@ -83,40 +153,106 @@ void offload_start()
 	CPU_SET(0, &set);
 	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
 
-	pthread_create(&s_thread_handle, &attr, worker_thread, nullptr);
+	for (int i = 0; i < NUM_WORKERS; i++) pthread_create(&s_thread_handle[i], &attr, worker_thread, nullptr);
+	s_running = 1;
 }
 
 void offload_stop()
 {
-	pthread_mutex_lock(&s_queue_lock);
-
-	s_quit = true;
-	pthread_cond_signal(&s_cond_work);
+	// app_restart() falls back to reboot() which stops the pool too
+	if (!s_running) return;
+	s_running = 0;
 
-	pthread_mutex_unlock(&s_queue_lock);
+	s_quit.store(true);
+	for (int i = 0; i < NUM_WORKERS; i++) sem_post(&s_work_sem);
 
 	printf("Waiting for offloaded work to finish...");
-	pthread_join(s_thread_handle, nullptr);
+	for (int i = 0; i < NUM_WORKERS; i++) pthread_join(s_thread_handle[i], nullptr);
 	printf("Done\n");
+
+	offload_print_stats();
 }
 
-void offload_add_work(std::function<void()> handler)
+static offload_job_t submit_work(offload_fn &handler, offload_class_t cls)
 {
-	PROFILE_FUNCTION();
+	WorkQueue *queue = &s_queue[cls];
+	uint32_t head = queue->head.load(std::memory_order_relaxed);
+	uint32_t slot = head % QUEUE_SIZE;
+	Work *work = &queue->slots[slot];
+
+	// slots are released out of order by the workers, so check the head slot itself
+	if (work->state.load(std::memory_order_acquire) != WORK_FREE) return 0;
 
-	pthread_mutex_lock(&s_queue_lock);
+	queue->seq = (queue->seq + 1) & 0x7FFFFFF;
+	if (!queue->seq) queue->seq = 1;
 
-	if ((s_queue_head - s_queue_tail) == QUEUE_SIZE)
+	work->handler = std::move(handler);
+	work->seq = queue->seq;
+	work->submit_us = time_us();
+	work->state.store(WORK_QUEUED, std::memory_order_relaxed);
+
+	queue->submitted++;
+	queue->head.store(head + 1, std::memory_order_release);
+
+	sem_post(&s_work_sem);
+
+	return JOB_HANDLE(work->seq, slot, cls);
+}
+
+offload_job_t offload_add_work(offload_fn handler, offload_class_t cls)
+{
+	PROFILE_FUNCTION();
+
+	offload_job_t job = submit_work(handler, cls);
+	if (!job)
 	{
-		pthread_cond_wait(&s_cond_available, &s_queue_lock);
+		s_queue[cls].inline_runs++;
+		handler();
 	}
 
-	Work *work = &s_queue[s_queue_head % QUEUE_SIZE];
-	work->handler = handler;
+	return job;
+}
+
+offload_job_t offload_try_work(offload_fn handler, offload_class_t cls)
+{
+	PROFILE_FUNCTION();
+
+	return submit_work(handler, cls);
+}
+
+int offload_job_done(offload_job_t job)
+{
+	if (!job) return 1;
+
+	Work *work = &s_queue[JOB_CLASS(job)].slots[JOB_SLOT(job)];
+	return (work->seq != JOB_SEQ(job)) || (work->state.load(std::memory_order_acquire) == WORK_FREE);
+}
+
+void offload_wait(offload_job_t job)
+{
+	while (!offload_job_done(job)) sched_yield();
+}
+
+void offload_get_stats(offload_class_t cls, offload_stats_t *stats)
+{
+	pthread_mutex_lock(&s_consumer_lock);
+	*stats = s_queue[cls].stats;
+	pthread_mutex_unlock(&s_consumer_lock);
 
-	s_queue_head++;
+	stats->pending = s_queue[cls].submitted - stats->jobs;
+	stats->inline_runs = s_queue[cls].inline_runs;
+}
 
-	pthread_cond_signal(&s_cond_work);
+void offload_print_stats()
+{
+	for (int i = 0; i < OFFLOAD_CLASS_COUNT; i++)
+	{
+		offload_stats_t stats;
+		offload_get_stats((offload_class_t)i, &stats);
+		if (!stats.jobs && !stats.inline_runs) continue;
 
-	pthread_mutex_unlock(&s_queue_lock);
-}
\ No newline at end of file
+		printf("offload %-10s: %u jobs (%u inline), wait avg/max %llu/%lluus, run avg/max %llu/%lluus\n", class_names[i],
+			stats.jobs, stats.inline_runs, stats.jobs ? stats.wait_us / stats.jobs : 0, stats.wait_max_us,
+			stats.jobs ? stats.run_us / stats.jobs : 0, stats.run_max_us);
+	}
+}
@@ -2,11 +2,125 @@
 #define OFFLOAD_H
 
 #include <stddef.h>
-#include <functional>
+#include <inttypes.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// Job classes in priority order. Workers always pick the oldest job
+// of the highest priority class that has pending work.
+enum offload_class_t
+{
+	OFFLOAD_IO = 0,      // file/sysfs writes, read prefetch
+	OFFLOAD_DECOMPRESS,  // ROM/CHD decompression
+	OFFLOAD_UI,          // screenshots, background rendering
+	OFFLOAD_CLASS_COUNT
+};
+
+// Handle of a submitted job. 0 is never a valid handle.
+typedef uint32_t offload_job_t;
+
+struct offload_stats_t
+{
+	uint32_t jobs;         // completed jobs
+	uint32_t pending;      // queued or running right now
+	uint32_t inline_runs;  // queue was full, job ran on the caller
+	uint64_t wait_us;      // total time spent in queue
+	uint64_t wait_max_us;
+	uint64_t run_us;       // total execution time
+	uint64_t run_max_us;
+};
+
+// Fixed-capacity callable. Captures are stored inline, so building
+// and queueing a job never touches the heap.
+class offload_fn
+{
+public:
+	static constexpr size_t CAPACITY = 48;
+
+	offload_fn() : ops(nullptr) {}
+
+	template<typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, offload_fn>::value>::type>
+	offload_fn(F fn)
+	{
+		static_assert(sizeof(F) <= CAPACITY, "offload job captures too much state");
+		static_assert(alignof(F) <= alignof(max_align_t), "offload job capture alignment");
+		new (storage) F(std::move(fn));
+		ops = &ops_for<F>::table;
+	}
+
+	offload_fn(offload_fn &&other) : ops(other.ops)
+	{
+		if (ops) ops->relocate(storage, other.storage);
+		other.ops = nullptr;
+	}
+
+	offload_fn &operator=(offload_fn &&other)
+	{
+		if (this != &other)
+		{
+			reset();
+			ops = other.ops;
+			if (ops) ops->relocate(storage, other.storage);
+			other.ops = nullptr;
+		}
+		return *this;
+	}
+
+	offload_fn(const offload_fn &) = delete;
+	offload_fn &operator=(const offload_fn &) = delete;
+
+	~offload_fn() { reset(); }
+
+	void operator()() { if (ops) ops->call(storage); }
+	explicit operator bool() const { return ops != nullptr; }
+
+	void reset()
+	{
+		if (ops) ops->destroy(storage);
+		ops = nullptr;
+	}
+
+private:
+	struct Ops
+	{
+		void (*call)(void *obj);
+		void (*relocate)(void *dst, void *src);
+		void (*destroy)(void *obj);
+	};
+
+	template<typename F>
+	struct ops_for
+	{
+		static void call(void *obj) { (*(F*)obj)(); }
+		static void relocate(void *dst, void *src) { new (dst) F(std::move(*(F*)src)); ((F*)src)->~F(); }
+		static void destroy(void *obj) { ((F*)obj)->~F(); }
+		static constexpr Ops table = { call, relocate, destroy };
+	};
+
+	alignas(max_align_t) unsigned char storage[CAPACITY];
+	const Ops *ops;
+};
+
+template<typename F>
+constexpr offload_fn::Ops offload_fn::ops_for<F>::table;
 
 void offload_start();
 void offload_stop();
 
-void offload_add_work(std::function<void()> work);
+// Must be called from the main thread only. Never allocates, locks or
+// blocks; if the class queue is full the job runs on the caller instead.
+offload_job_t offload_add_work(offload_fn work, offload_class_t cls);
+
+// Same as above, but returns 0 without running the job if the queue is full.
+// Use it for jobs which must not run on the main thread.
+offload_job_t offload_try_work(offload_fn work, offload_class_t cls);
+
+// Non-blocking completion check, safe to call from coroutines.
+int offload_job_done(offload_job_t job);
+void offload_wait(offload_job_t job);
+
+void offload_get_stats(offload_class_t cls, offload_stats_t *stats);
+void offload_print_stats();
 
-#endif
\ No newline at end of file
+#endif
@@ -46,6 +46,7 @@ as rotated copies of the first 128 entries.  -- AMR
 #include "user_io.h"
 #include "hardware.h"
 #include "profiling.h"
+#include "scheduler.h"
 
 #include "support.h"
 
@@ -56,8 +57,31 @@ as rotated copies of the first 128 entries.  -- AMR
 
 static int osd_size = 8;
 
+// what the last OsdWriteOffset() drew on each line, a repeated write of the
+// same text is skipped. Any other drawing on a line drops its entry.
+struct osd_line_key_t
+{
+	uint32_t hash;
+	uint8_t valid;
+	uint8_t invert;
+	uint8_t stipple;
+	char offset;
+	char leftchar;
+	int maxinv;
+	int mininv;
+	int arrow;
+};
+
+static osd_line_key_t line_keys[32];
+
+static void osd_keys_reset()
+{
+	memset(line_keys, 0, sizeof(line_keys));
+}
+
 void OsdSetSize(int n)
 {
+	if (osd_size != n) osd_keys_reset();
 	osd_size = n;
 }
 
@@ -77,6 +101,10 @@ static uint8_t osdbuf[256 * 32];
 static int  osdbufpos = 0;
 static int  osdset = 0;
 
+// copy of what the core has got, for the lines marked in osdknown
+static uint8_t osdsent[256 * 32];
+static uint32_t osdknown = 0;
+
 char framebuffer[16][256];
 static void framebuffer_clear()
 {
@@ -132,29 +160,13 @@ static unsigned long scroll_timer[2] = {};  // file/dir name scrolling timer
 static int arrow;
 static unsigned char titlebuffer[256];
 
-static void rotatechar(unsigned char *in, unsigned char *out)
-{
-	int a;
-	int b;
-	int c;
-	for (b = 0; b<8; ++b)
-	{
-		a = 0;
-		for (c = 0; c<8; ++c)
-		{
-			a <<= 1;
-			a |= (in[c] >> b) & 1;
-		}
-		out[b] = a;
-	}
-}
-
 #define OSDHEIGHT (uint)(osd_size*8)
 
 void OsdSetTitle(const char *s, int a)
 {
 	// Compose the title, condensing character gaps
 	arrow = a;
+	osd_keys_reset();
 	int zeros = 0;
 	uint i = 0, j = 0;
 	uint outp = 0;
@@ -197,7 +209,7 @@ void OsdSetTitle(const char *s, int a)
 	for (i = 0; i<OSDHEIGHT; i += 8)
 	{
 		unsigned char tmp[8];
-		rotatechar(&titlebuffer[i], tmp);
+		charrom_rotate(&titlebuffer[i], tmp);
 		for (c = 0; c<8; ++c)
 		{
 			titlebuffer[i + c] = tmp[c];
@@ -220,6 +232,7 @@ static void osd_start(int line)
 	line = line & 0x1F;
 	osdset |= 1 << line;
 	osdbufpos = line * 256;
+	line_keys[line].valid = 0;
 }
 
 static void draw_title(const unsigned char *p)
@@ -265,7 +278,28 @@ void OsdWriteOffset(unsigned char n, const char *s, unsigned char invert, unsign
 	else
 		stipple = 0;
 
+	// single line text without background can be checked against the last write
+	osd_line_key_t key;
+	memset(&key, 0, sizeof(key));
+	key.hash = 2166136261u;
+	key.valid = !usebg;
+	for (const char *t = s; key.valid && *t; t++)
+	{
+		if (*t == 0x0d || *t == 0x0a) key.valid = 0;
+		key.hash = (key.hash ^ (uint8_t)*t) * 16777619u;
+	}
+	key.invert = invert;
+	key.stipple = stipple;
+	key.offset = offset;
+	key.leftchar = leftchar;
+	key.maxinv = maxinv;
+	key.mininv = mininv;
+	key.arrow = arrow;
+
+	if (key.valid && !memcmp(&line_keys[n & 0x1F], &key, sizeof(key))) return;
+
 	osd_start(n);
+	if (key.valid) line_keys[n & 0x1F] = key;
 
 	unsigned char xormask = 0;
 	unsigned char xorchar = 0;
@@ -279,14 +313,9 @@ void OsdWriteOffset(unsigned char n, const char *s, unsigned char invert, unsign
 
 		if (i == 0 && (n < osd_size))
 		{	// Render sidestripe
-			unsigned char tmp[8];
-
 			if (leftchar)
 			{
-				unsigned char tmp2[8];
-				memcpy(tmp2, charfont[(uint)leftchar], 8);
-				rotatechar(tmp2, tmp);
-				p = tmp;
+				p = charrom_rotated(leftchar);
 			}
 			else
 			{
@@ -342,6 +371,15 @@ void OsdWriteOffset(unsigned char n, const char *s, unsigned char invert, unsign
 				// send new line number to OSD
 				osd_start(n);
 			}
+			else if (i<(linelimit - 8) && !usebg && !offset && !stipple && stipplemask == 0xff)
+			{  // plain character, one 8 byte copy
+				uint64_t glyph;
+				memcpy(&glyph, charfont[b], 8);
+				glyph ^= 0x0101010101010101ULL * (uint8_t)(xormask ^ xorchar);
+				memcpy(osdbuf + osdbufpos, &glyph, 8);
+				osdbufpos += 8;
+				i += 8;
+			}
 			else if (i<(linelimit - 8))
 			{  // normal character
 				unsigned char c;
@@ -495,6 +533,7 @@ void OsdClear(void)
 {
 	osdset = -1;
 	memset(osdbuf, 0, 16 * 256);
+	osd_keys_reset();
 }
 
 // enable displaying of OSD
@@ -503,6 +542,10 @@ void OsdEnable(unsigned char mode)
 	user_io_osd_key_enable(mode & DISABLE_KEYBOARD);
 	mode &= (DISABLE_KEYBOARD | OSD_MSG);
 	spi_osd_cmd(OSD_CMD_ENABLE | mode);
+
+	// resend everything once per opening in case the core lost its buffer
+	osdknown = 0;
+	osd_keys_reset();
 }
 
 void InfoEnable(int x, int y, int width, int height)
@@ -540,6 +583,7 @@ void OsdMenuCtl(int en)
 	{
 		spi_osd_cmd(OSD_CMD_WRITE | 8);
 		spi_osd_cmd(OSD_CMD_ENABLE);
+		osdknown = 0;
 	}
 	else
 	{
@@ -668,15 +712,32 @@ void OsdUpdate()
 	{
 		if (osdset & (1 << i))
 		{
-			spi_osd_cmd_cont(OSD_CMD_WRITE | i);
-			spi_write(osdbuf + i * 256, 256, 0);
-			DisableOsd();
-			if (is_megacd()) mcd_poll();
-			if (is_pce()) pcecd_poll();
-			if (is_saturn()) saturn_poll();
-			if (is_neogeo_cd()) neocd_poll();
+			osdset &= ~(1 << i);
+
+			// a write always starts at the beginning of the line,
+			// so only the unchanged tail of it can be skipped
+			uint8_t *line = osdbuf + i * 256;
+			uint8_t *sent = osdsent + i * 256;
+			int len = 256;
+			if (osdknown & (1 << i))
+			{
+				while (len && line[len - 1] == sent[len - 1]) len--;
+			}
+
+			if (len)
+			{
+				spi_osd_cmd_cont(OSD_CMD_WRITE | i);
+				spi_write(line, len, 0);
+				DisableOsd();
+				memcpy(sent, line, len);
+			}
+			osdknown |= 1 << i;
+
+			// CD servicing runs in co_poll, let it in on long redraws
+			scheduler_yield_budget();
 		}
 	}
 
-	osdset = 0;
+	// lines past the OSD size are dropped, the ones redrawn during a yield wait for the next update
+	if (n < 32) osdset &= (1 << n) - 1;
 }
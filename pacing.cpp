@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+#include <atomic>
+
+#include "pacing.h"
+#include "profiling.h"
+
+// Deviation of every vsync interval from the core frame time, in steps of
+// PACING_STEP_US, the outer buckets collect everything beyond the range.
+#define PACING_STEP_US  100
+#define PACING_RANGE    20
+#define PACING_BUCKETS  (PACING_RANGE * 2 + 1)
+
+struct pacing_stats_t
+{
+	uint32_t frames;
+	uint32_t missed;       // intervals of 1.5 frames or more, not in the histogram
+	uint64_t sum_us;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t sum_dev_us;   // absolute deviation
+	uint32_t max_dev_us;
+	uint32_t dev[PACING_BUCKETS];
+};
+
+static pthread_t pacing_thread_id;
+static pthread_mutex_t pacing_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<bool> pacing_quit;
+static std::atomic<uint32_t> pacing_vtime(0);
+static uint32_t pacing_vtimeh = 0;
+static int pacing_running = 0;
+static pacing_stats_t stats = {};
+
+static void pacing_add(uint32_t interval, uint32_t vtime)
+{
+	pthread_mutex_lock(&pacing_mutex);
+
+	// no core timing yet, only the interval is known
+	int dev = vtime ? (int)interval - (int)(vtime / 100) : 0;
+	if (vtime && interval >= vtime / 100 + vtime / 200)
+	{
+		stats.missed++;
+	}
+	else
+	{
+		stats.frames++;
+		stats.sum_us += interval;
+		if (!stats.min_us || interval < stats.min_us) stats.min_us = interval;
+		if (interval > stats.max_us) stats.max_us = interval;
+
+		uint32_t adev = (dev < 0) ? -dev : dev;
+		stats.sum_dev_us += adev;
+		if (adev > stats.max_dev_us) stats.max_dev_us = adev;
+
+		int n = (dev + ((dev < 0) ? -PACING_STEP_US / 2 : PACING_STEP_US / 2)) / PACING_STEP_US;
+		if (n < -PACING_RANGE) n = -PACING_RANGE;
+		if (n > PACING_RANGE) n = PACING_RANGE;
+		stats.dev[n + PACING_RANGE]++;
+	}
+
+	pthread_mutex_unlock(&pacing_mutex);
+}
+
+static void *pacing_thread(void *)
+{
+	int fb = open("/dev/fb0", O_RDWR | O_CLOEXEC);
+	if (fb < 0)
+	{
+		printf("pacing: can't open /dev/fb0\n");
+		return nullptr;
+	}
+
+	uint64_t last_vs = 0;
+	while (!pacing_quit.load())
+	{
+		int zero = 0;
+		if (ioctl(fb, FBIO_WAITFORVSYNC, &zero) == -1)
+		{
+			usleep(16666);
+			last_vs = 0;
+			continue;
+		}
+
+		uint64_t vs = profiling_time_us();
+		if (last_vs) pacing_add(vs - last_vs, pacing_vtime.load());
+		last_vs = vs;
+	}
+
+	close(fb);
+	return nullptr;
+}
+
+void pacing_start()
+{
+	if (pacing_running) return;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	// Set affinity to core #0 since main runs on core #1
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	pacing_quit.store(false);
+	int res = pthread_create(&pacing_thread_id, &attr, pacing_thread, nullptr);
+	pthread_attr_destroy(&attr);
+
+	if (res)
+	{
+		printf("pacing: can't start the thread (%d)\n", res);
+		return;
+	}
+
+	pacing_running = 1;
+	printf("pacing: started\n");
+}
+
+void pacing_stop()
+{
+	if (!pacing_running) return;
+
+	// the thread quits after its next vsync
+	pacing_quit.store(true);
+	pthread_join(pacing_thread_id, nullptr);
+	pacing_running = 0;
+	printf("pacing: stopped\n");
+}
+
+void pacing_reset()
+{
+	pthread_mutex_lock(&pacing_mutex);
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_unlock(&pacing_mutex);
+}
+
+void pacing_set_frame_time(uint32_t vtime, uint32_t vtimeh)
+{
+	pacing_vtime.store(vtime);
+	pacing_vtimeh = vtimeh;
+}
+
+void pacing_report(FILE *fp)
+{
+	pacing_stats_t st;
+	pthread_mutex_lock(&pacing_mutex);
+	st = stats;
+	pthread_mutex_unlock(&pacing_mutex);
+
+	uint32_t vtime = pacing_vtime.load();
+	fprintf(fp, "Frame pacing %s\n", pacing_running ? "(running)" : "(stopped)");
+	fprintf(fp, "core frame: %.1fus, HDMI frame: %.1fus\n", vtime / 100.0, pacing_vtimeh / 100.0);
+
+	if (!st.frames)
+	{
+		fprintf(fp, "no frames\n");
+		fflush(fp);
+		return;
+	}
+
+	fprintf(fp, "frames: %u, missed: %u, interval avg/min/max: %.1f/%u/%uus\n", st.frames, st.missed,
+		(double)st.sum_us / st.frames, st.min_us, st.max_us);
+	fprintf(fp, "deviation avg/max: %.1f/%uus\n", (double)st.sum_dev_us / st.frames, st.max_dev_us);
+
+	uint32_t peak = 0;
+	for (int i = 0; i < PACING_BUCKETS; i++) if (st.dev[i] > peak) peak = st.dev[i];
+
+	fprintf(fp, "+- Deviation(us) -+---- Count +\n");
+	for (int i = 0; i < PACING_BUCKETS; i++)
+	{
+		if (!st.dev[i]) continue;
+
+		char bar[33];
+		int len = (int)((uint64_t)st.dev[i] * 32 / peak);
+		memset(bar, '#', len);
+		bar[len] = 0;
+
+		int dev = (i - PACING_RANGE) * PACING_STEP_US;
+		const char *edge = (i == 0) ? "<=" : (i == PACING_BUCKETS - 1) ? ">=" : "  ";
+		fprintf(fp, "| %s %+12d | %10u | %s\n", edge, dev, st.dev[i], bar);
+	}
+	fprintf(fp, "+------------------+------------+\n");
+	fflush(fp);
+}
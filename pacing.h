@@ -0,0 +1,20 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// Frame pacing telemetry of the HDMI output. A side thread timestamps every
+// vsync and compares the interval to the frame time of the core, so it
+// shows whether VRR actually tracks the core and how much judder there is.
+// Off until pacing_start(), all calls are main thread only.
+
+void pacing_start();
+void pacing_stop();
+void pacing_reset();
+void pacing_report(FILE *fp);
+
+// Frame times reported by the FPGA (100MHz counters): core and HDMI output.
+void pacing_set_frame_time(uint32_t vtime, uint32_t vtimeh);
+
+#endif
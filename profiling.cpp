@@ -1,13 +1,268 @@
-#ifdef PROFILING
-
 #include "profiling.h"
 
 #include "str_util.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#define HIST_MAX    32
+#define HIST_SUB    2 // log2 of steps per octave
+#define HIST_BUCKETS (32 << HIST_SUB)
+
+struct Histogram
+{
+	const char *name;
+	uint32_t count;
+	uint32_t max_us;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+static Histogram s_hist[HIST_MAX];
+static int s_hist_num = 0;
+
+uint64_t profiling_time_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+int profiling_hist_id(const char *name)
+{
+	for (int i = 0; i < s_hist_num; i++)
+	{
+		if (!strcmp(s_hist[i].name, name)) return i;
+	}
+
+	if (s_hist_num >= HIST_MAX) return -1;
+
+	memset(&s_hist[s_hist_num], 0, sizeof(Histogram));
+	s_hist[s_hist_num].name = name;
+	return s_hist_num++;
+}
+
+static uint32_t hist_bucket(uint32_t us)
+{
+	if (us < (1 << HIST_SUB)) return us;
+
+	uint32_t msb = 31 - __builtin_clz(us);
+	uint32_t sub = (us >> (msb - HIST_SUB)) & ((1 << HIST_SUB) - 1);
+	return ((msb - HIST_SUB + 1) << HIST_SUB) | sub;
+}
+
+// upper bound in us of the given bucket
+static uint32_t hist_bucket_limit(uint32_t bucket)
+{
+	if (bucket < (1 << HIST_SUB)) return bucket;
+
+	uint32_t msb = (bucket >> HIST_SUB) + HIST_SUB - 1;
+	uint32_t sub = bucket & ((1 << HIST_SUB) - 1);
+	uint64_t low = (1ULL << msb) | ((uint64_t)sub << (msb - HIST_SUB));
+	uint64_t high = low + (1ULL << (msb - HIST_SUB)) - 1;
+	return (high > UINT32_MAX) ? UINT32_MAX : (uint32_t)high;
+}
+
+void profiling_hist_add(int id, uint32_t us)
+{
+	if (id < 0 || id >= s_hist_num) return;
+
+	Histogram *hist = &s_hist[id];
+	hist->count++;
+	hist->buckets[hist_bucket(us)]++;
+	if (us > hist->max_us) hist->max_us = us;
+}
+
+static uint32_t hist_percentile(const Histogram *hist, uint32_t pct)
+{
+	uint64_t target = ((uint64_t)hist->count * pct + 99) / 100;
+	uint64_t sum = 0;
+
+	for (uint32_t i = 0; i < HIST_BUCKETS; i++)
+	{
+		sum += hist->buckets[i];
+		if (sum >= target)
+		{
+			uint32_t limit = hist_bucket_limit(i);
+			return (limit > hist->max_us) ? hist->max_us : limit;
+		}
+	}
+
+	return hist->max_us;
+}
+
+void profiling_hist_report(FILE *fp)
+{
+	fprintf(fp, "+----- Name ---------+--- Count +-- p50(us) +-- p99(us) +-- max(us) +\n");
+	for (int i = 0; i < s_hist_num; i++)
+	{
+		const Histogram *hist = &s_hist[i];
+		fprintf(fp, "| %-18s | %9u | %9u | %9u | %9u |\n", hist->name, hist->count,
+			hist_percentile(hist, 50), hist_percentile(hist, 99), hist->max_us);
+	}
+	fprintf(fp, "+--------------------+-----------+-----------+-----------+-----------+\n");
+	fflush(fp);
+}
+
+int profiling_hist_get(int id, const char **name, uint32_t *count, uint32_t *p50_us, uint32_t *p99_us, uint32_t *max_us)
+{
+	if (id < 0 || id >= s_hist_num) return 0;
+
+	const Histogram *hist = &s_hist[id];
+	*name = hist->name;
+	*count = hist->count;
+	*p50_us = hist_percentile(hist, 50);
+	*p99_us = hist_percentile(hist, 99);
+	*max_us = hist->max_us;
+	return 1;
+}
+
+void profiling_bench_report(const char *name, uint64_t us, uint64_t ops, uint64_t bytes)
+{
+	double ns = ops ? us * 1000.0 / ops : 0.0;
+	if (bytes) printf("%-26s %12.1f ns/op %10.2f MB/s\n", name, ns, us ? bytes / (double)us : 0.0);
+	else printf("%-26s %12.1f ns/op\n", name, ns);
+	fflush(stdout);
+}
+
+void profiling_hist_reset()
+{
+	for (int i = 0; i < s_hist_num; i++)
+	{
+		const char *name = s_hist[i].name;
+		memset(&s_hist[i], 0, sizeof(Histogram));
+		s_hist[i].name = name;
+	}
+}
+
+#define BOOT_MAX   32
+#define BOOT_DEPTH 8
+#define BOOT_ENV   "MISTER_SWITCH_US"
+
+struct BootPhase
+{
+	const char *name;
+	uint64_t start_us;
+	uint64_t end_us;
+	int depth;
+};
+
+static BootPhase s_boot[BOOT_MAX];
+static int s_boot_num = 0;
+static int s_boot_stack[BOOT_DEPTH];
+static int s_boot_depth = 0;
+static int s_boot_done = 0;
+static uint64_t s_boot_base = 0;   // start of the switch or of the process
+static uint64_t s_boot_main = 0;   // first phase of this process
+
+static void boot_init()
+{
+	if (s_boot_main) return;
+
+	s_boot_main = profiling_time_us();
+	s_boot_base = s_boot_main;
+
+	// the core switch stamps the environment before the exec
+	const char *sw = getenv(BOOT_ENV);
+	if (sw)
+	{
+		uint64_t us = strtoull(sw, NULL, 10);
+		if (us && us < s_boot_main) s_boot_base = us;
+		unsetenv(BOOT_ENV);
+	}
+}
+
+void profiling_boot_switch()
+{
+	char str[32];
+	snprintf(str, sizeof(str), "%llu", profiling_time_us());
+	setenv(BOOT_ENV, str, 1);
+}
+
+void profiling_boot_begin(const char *name)
+{
+	boot_init();
+	if (s_boot_done) return;
+
+	if (s_boot_num < BOOT_MAX)
+	{
+		BootPhase *phase = &s_boot[s_boot_num];
+		phase->name = name;
+		phase->start_us = profiling_time_us();
+		phase->end_us = 0;
+		phase->depth = s_boot_depth;
+	}
+
+	if (s_boot_depth < BOOT_DEPTH) s_boot_stack[s_boot_depth] = s_boot_num;
+	s_boot_depth++;
+	s_boot_num++;
+}
+
+void profiling_boot_end()
+{
+	if (s_boot_done || !s_boot_depth) return;
+
+	s_boot_depth--;
+	if (s_boot_depth < BOOT_DEPTH)
+	{
+		int idx = s_boot_stack[s_boot_depth];
+		if (idx < BOOT_MAX) s_boot[idx].end_us = profiling_time_us();
+	}
+}
+
+void profiling_boot_done()
+{
+	boot_init();
+	if (s_boot_done) return;
+
+	profiling_boot_begin("first loop");
+	profiling_boot_end();
+	s_boot_done = 1;
+
+	if (getenv("MISTER_BOOT_BENCH"))
+	{
+		profiling_boot_report(stdout);
+		FILE *fp = fopen("/tmp/MiSTer_boot", "wt");
+		if (fp)
+		{
+			profiling_boot_report(fp);
+			fclose(fp);
+		}
+		exit(0);
+	}
+}
+
+void profiling_boot_report(FILE *fp)
+{
+	fprintf(fp, "+----- Phase ------------------+- Start(ms) +-- Time(ms) +\n");
+	if (s_boot_base != s_boot_main)
+	{
+		fprintf(fp, "| %-28s | %10.1f | %10.1f |\n", "core switch", 0.0, (s_boot_main - s_boot_base) / 1000.0);
+	}
+
+	int num = (s_boot_num < BOOT_MAX) ? s_boot_num : BOOT_MAX;
+	for (int i = 0; i < num; i++)
+	{
+		const BootPhase *phase = &s_boot[i];
+		char name[64];
+		snprintf(name, sizeof(name), "%*s%s", phase->depth * 2, "", phase->name);
+		fprintf(fp, "| %-28s | %10.1f | %10.1f |\n", name, (phase->start_us - s_boot_base) / 1000.0,
+			phase->end_us ? (phase->end_us - phase->start_us) / 1000.0 : 0.0);
+	}
+	fprintf(fp, "+------------------------------+------------+------------+\n");
+	if (!s_boot_done) fprintf(fp, "(startup is still running)\n");
+	fflush(fp);
+}
+
+#ifdef PROFILING
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <atomic>
+
 struct Event
 {
 	const char *name;
@@ -24,12 +279,100 @@ static constexpr Event *get_event(uint32_t idx)
 	return &s_events[idx % MAX_EVENTS];
 }
 
+// Trace ring lives in a tmpfs file, so a trace started before a core
+// switch keeps collecting after app_restart() exec'ed the new binary.
+#define TRACE_FILE   "/tmp/MiSTer_trace.bin"
+#define TRACE_EVENTS 32768 // must be pow2
+#define TRACE_MAGIC  0x54524345
+
+struct TraceEvent
+{
+	uint64_t ts_ns;
+	uint32_t tid;
+	char type;
+	char name[19];
+};
+
+struct TraceRing
+{
+	uint32_t magic;
+	uint32_t enabled;
+	std::atomic<uint32_t> head;
+	uint32_t reserved;
+	TraceEvent events[TRACE_EVENTS];
+};
+
+static TraceRing *s_trace = nullptr;
+static bool s_trace_probed = false;
+static pid_t s_main_tid = 0;
+static __thread pid_t s_tid = 0;
+
+static pid_t current_tid()
+{
+	if (!s_tid) s_tid = syscall(SYS_gettid);
+	return s_tid;
+}
+
+static TraceRing *trace_map(bool create)
+{
+	int fd = open(TRACE_FILE, create ? (O_RDWR | O_CREAT | O_CLOEXEC) : (O_RDWR | O_CLOEXEC), 0644);
+	if (fd < 0) return nullptr;
+
+	if (create && ftruncate(fd, sizeof(TraceRing)) < 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	void *map = mmap(0, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return (map == MAP_FAILED) ? nullptr : (TraceRing *)map;
+}
+
+static void trace_event(char type, const char *name, const struct timespec *ts)
+{
+	if (!s_trace_probed)
+	{
+		// pick up a trace started by the previous process
+		s_trace_probed = true;
+		s_trace = trace_map(false);
+		if (s_trace && s_trace->magic != TRACE_MAGIC)
+		{
+			munmap(s_trace, sizeof(TraceRing));
+			s_trace = nullptr;
+		}
+	}
+
+	if (!s_trace || !s_trace->enabled) return;
+
+	uint32_t idx = s_trace->head.fetch_add(1, std::memory_order_relaxed);
+	TraceEvent *ev = &s_trace->events[idx % TRACE_EVENTS];
+	ev->ts_ns = (ts->tv_sec * 1000000000ULL) + ts->tv_nsec;
+	ev->tid = current_tid();
+	ev->type = type;
+	strcpyz(ev->name, name);
+}
+
+// Only the main thread feeds the spike report ring, other threads
+// (offload workers) go to the trace ring only.
+static bool is_main_thread()
+{
+	if (!s_main_tid) s_main_tid = getpid();
+	return current_tid() == s_main_tid;
+}
+
 uint32_t profiling_event_begin(const char *name)
 {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	trace_event('B', name, &ts);
+
+	if (!is_main_thread()) return 0;
+
 	Event *newEvent = get_event(s_event_tail);
 	newEvent->begin_idx = s_event_tail;
 	newEvent->name = name;
-	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+	newEvent->ts = ts;
 
 	uint32_t r = s_event_tail;
 	s_event_tail++;
@@ -38,13 +381,84 @@ uint32_t profiling_event_begin(const char *name)
 
 void profiling_event_end(uint32_t begin_idx, const char *name)
 {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	trace_event('E', name, &ts);
+
+	if (!is_main_thread()) return;
+
 	Event *newEvent = get_event(s_event_tail);
 	newEvent->begin_idx = begin_idx;
 	newEvent->name = name;
-	clock_gettime(CLOCK_MONOTONIC, &newEvent->ts);
+	newEvent->ts = ts;
 	s_event_tail++;
 }
 
+void profiling_trace_start()
+{
+	if (!s_trace)
+	{
+		s_trace_probed = true;
+		s_trace = trace_map(true);
+		if (!s_trace)
+		{
+			printf("profiling: unable to create %s\n", TRACE_FILE);
+			return;
+		}
+	}
+
+	s_trace->enabled = 0;
+	s_trace->head.store(0);
+	s_trace->magic = TRACE_MAGIC;
+	s_trace->enabled = 1;
+	printf("profiling: trace started.\n");
+}
+
+void profiling_trace_stop()
+{
+	if (s_trace) s_trace->enabled = 0;
+}
+
+static void json_escaped(FILE *fp, const char *str, size_t max)
+{
+	for (size_t i = 0; i < max && str[i]; i++)
+	{
+		if (str[i] == '"' || str[i] == '\\') fputc('\\', fp);
+		if ((unsigned char)str[i] >= 0x20) fputc(str[i], fp);
+	}
+}
+
+int profiling_trace_dump(const char *path)
+{
+	if (!s_trace || s_trace->magic != TRACE_MAGIC) return 0;
+
+	FILE *fp = fopen(path, "wt");
+	if (!fp) return 0;
+
+	uint32_t enabled = s_trace->enabled;
+	s_trace->enabled = 0;
+
+	uint32_t head = s_trace->head.load();
+	uint32_t start = (head > TRACE_EVENTS) ? head - TRACE_EVENTS : 0;
+	pid_t pid = getpid();
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (uint32_t idx = start; idx != head; idx++)
+	{
+		const TraceEvent *ev = &s_trace->events[idx % TRACE_EVENTS];
+		fprintf(fp, "%s{\"name\":\"", (idx == start) ? "" : ",\n");
+		json_escaped(fp, ev->name, sizeof(ev->name));
+		fprintf(fp, "\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%u}", ev->type,
+			ev->ts_ns / 1000ULL, (uint32_t)(ev->ts_ns % 1000ULL), pid, ev->tid);
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	s_trace->enabled = enabled;
+	printf("profiling: %u trace events written to %s\n", head - start, path);
+	return 1;
+}
+
 // result_ns = a - b
 static uint64_t delta_ns(const struct timespec *a, const struct timespec *b)
 {
@@ -73,6 +487,7 @@ void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us)
 {
 	int stack_pos = 0;
 
+	if (!is_main_thread()) return;
 	if ((s_event_tail - begin_idx) < 2) return; // not enough events
 	if ((s_event_tail - begin_idx) > MAX_EVENTS) return; // too many events
 
@@ -2,6 +2,37 @@
 #define PROFILING_H 1
 
 #include <inttypes.h>
+#include <stdio.h>
+
+// Always-on latency histograms, cheap enough for the main loop.
+// Buckets are log2 of microseconds with 4 linear steps per octave.
+uint64_t profiling_time_us();
+int profiling_hist_id(const char *name);
+void profiling_hist_add(int id, uint32_t us);
+void profiling_hist_report(FILE *fp);
+void profiling_hist_reset();
+
+// Summary of histogram id (0 up to the first 0 return).
+int profiling_hist_get(int id, const char **name, uint32_t *count, uint32_t *p50_us, uint32_t *p99_us, uint32_t *max_us);
+
+// One line of a kernel bench: ops calls over bytes in total took us.
+// MB/s is left out when bytes is 0.
+void profiling_bench_report(const char *name, uint64_t us, uint64_t ops, uint64_t bytes);
+
+// Always-on record of the startup phases, from the start of the core switch
+// that exec'ed this process (or from main) to the first main loop pass.
+// MISTER_BOOT_BENCH=1 in the environment prints it and exits right there.
+void profiling_boot_begin(const char *name);
+void profiling_boot_end();
+void profiling_boot_done();
+void profiling_boot_report(FILE *fp);
+void profiling_boot_switch();
+
+struct ProfilingBootPhase
+{
+	ProfilingBootPhase(const char *name) { profiling_boot_begin(name); }
+	~ProfilingBootPhase() { profiling_boot_end(); }
+};
 
 #ifdef PROFILING
 
@@ -9,6 +40,11 @@ uint32_t profiling_event_begin(const char *name);
 void profiling_event_end(uint32_t begin_idx, const char *name);
 void profiling_spike_report(uint32_t begin_idx, uint32_t spike_us);
 
+// Chrome trace (chrome://tracing, ui.perfetto.dev) capture of all threads.
+void profiling_trace_start();
+void profiling_trace_stop();
+int profiling_trace_dump(const char *path);
+
 struct ProfilingScopedEvent
 {
 	const char *name;
@@ -40,6 +76,7 @@ struct ProfilingScopedEvent
 #define PROFILE_FUNCTION() ProfilingScopedEvent __scope_timer(__FUNCTION__)
 #define SPIKE_SCOPE(name, us) ProfilingScopedEvent __scope_timer(name, us)
 #define SPIKE_FUNCTION(us) ProfilingScopedEvent __scope_timer(__FUNCTION__, us)
+#define BOOT_SCOPE(name) ProfilingBootPhase __boot_phase(name); ProfilingScopedEvent __boot_timer(name)
 
 #else // PROFILING
 
@@ -47,6 +84,7 @@ struct ProfilingScopedEvent
 #define PROFILE_FUNCTION()
 #define SPIKE_SCOPE(name, us)
 #define SPIKE_FUNCTION(us)
+#define BOOT_SCOPE(name) ProfilingBootPhase __boot_phase(name)
 
 #endif // PROFILING
 
@@ -5,11 +5,14 @@
 #include <stdbool.h>
 #include <limits.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "file_io.h"
 #include "user_io.h"
 #include "osd.h"
 #include "cfg.h"
+#include "offload.h"
 #include "recent.h"
 
 #define RECENT_MAX 16
@@ -26,6 +29,14 @@ static char ena[RECENT_MAX];
 
 static int numlast = 0;
 
+// list held in recents, so an update doesn't read the file back
+static char loaded_name[256] = {};
+
+// the file is written on the offload pool from its own copy
+static recent_rec_t save_recs[RECENT_MAX];
+static char save_path[1024];
+static offload_job_t save_job = 0;
+
 static int iSelectedEntry = 0;
 static int iFirstEntry = 0;
 
@@ -50,13 +61,52 @@ static const char* recent_path(char* dir, char* name)
 	return path;
 }
 
-static void recent_load(int idx)
+static void recent_save(int idx)
 {
+	const char *name = recent_create_config_name(idx);
+	snprintf(loaded_name, sizeof(loaded_name), "%s", name);
+
+	if (save_job) offload_wait(save_job);
+	save_job = 0;
+
+	memcpy(save_recs, recents, sizeof(save_recs));
+	snprintf(save_path, sizeof(save_path), "%s", getFullPath(CONFIG_DIR));
+	strncat(save_path, "/", sizeof(save_path) - strlen(save_path) - 1);
+	strncat(save_path, name, sizeof(save_path) - strlen(save_path) - 1);
+
+	save_job = offload_add_work([] {
+		int fd = open(save_path, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC, S_IRWXU | S_IRWXG | S_IRWXO);
+		if (fd < 0)
+		{
+			printf("recent: can't write %s\n", save_path);
+			return;
+		}
+
+		if (write(fd, save_recs, sizeof(save_recs)) != (int)sizeof(save_recs)) printf("recent: can't write %s\n", save_path);
+		close(fd);
+	}, OFFLOAD_IO);
+}
+
+static void recent_read(int idx)
+{
+	const char *name = recent_create_config_name(idx);
+	if (!strcmp(loaded_name, name)) return;
+
+	// a pending write of this list must land first
+	if (save_job) offload_wait(save_job);
+	save_job = 0;
+
 	// initialize recent to empty strings
 	memset(recents, 0, sizeof(recents));
 
 	// load the config file into memory
-	FileLoadConfig(recent_create_config_name(idx), recents, sizeof(recents));
+	FileLoadConfig(name, recents, sizeof(recents));
+	snprintf(loaded_name, sizeof(loaded_name), "%s", name);
+}
+
+static void recent_load(int idx)
+{
+	recent_read(idx);
 
 	for (numlast = 0; numlast < (int)(sizeof(recents)/sizeof(recents[0])) && strlen(recents[numlast].name); numlast++) {}
 
@@ -248,8 +298,8 @@ void recent_update(char* dir, char* path, char* label, int idx)
 	char* name = strrchr(path, '/');
 	if (name) name++; else name = path;
 
-	// load the current state.  this is necessary because we may have started a ROM from multiple sources
-	recent_load(idx);
+	// get the current state.  this is necessary because we may have started a ROM from multiple sources
+	recent_read(idx);
 
 	// update the selection
 	int indexToErase = RECENT_MAX - 1;
@@ -267,17 +317,21 @@ void recent_update(char* dir, char* path, char* label, int idx)
 		}
 	}
 
+	// launching the latest entry again changes nothing
+	if (!indexToErase && !memcmp(recents, &rec, sizeof(rec))) return;
+
 	if(indexToErase) memmove(recents + 1, recents, sizeof(recents[0])*indexToErase);
 	memcpy(recents, &rec, sizeof(recents[0]));
 
-	// store the config file to storage
-	FileSaveConfig(recent_create_config_name(idx), recents, sizeof(recents));
+	// store the config file to storage, off the load path
+	recent_save(idx);
 }
 
 void recent_clear(int idx)
 {
 	memset(recents, 0, sizeof(recents));
+	numlast = 0;
 
 	// store the config file to storage
-	FileSaveConfig(recent_create_config_name(idx), recents, sizeof(recents));
+	recent_save(idx);
 }
@@ -0,0 +1,689 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include "file_io.h"
+#include "offload.h"
+#include "miniz.h"
+#include "romindex.h"
+
+// The index is built by a single job on the offload pool. Only that job
+// replaces the published index, the main thread reads it under index_lock.
+#define ROMINDEX_DIR   "/tmp/romindex"
+#define ROMINDEX_MAGIC 0x52494401
+#define ROMINDEX_DEPTH 2
+
+// zips to read before a second thread is worth starting
+#define ROMINDEX_PAR_MIN 8
+
+static const char *index_dirs[] = { "mame", "hbmame" };
+
+struct romindex_zip_t
+{
+	uint32_t path;   // relative to the root
+	uint32_t first;  // members in roms[first .. first + count)
+	uint32_t count;
+	int64_t mtime;
+	int64_t size;
+};
+
+struct romindex_rom_t
+{
+	uint32_t crc;
+	uint32_t size;
+	uint32_t member; // index inside the zip
+	uint32_t zip;
+	uint32_t name;
+};
+
+struct romindex_hdr_t
+{
+	uint32_t magic;
+	char root[1024];
+	uint32_t zip_count;
+	uint32_t rom_count;
+	uint32_t names_size;
+};
+
+struct romindex_t
+{
+	char root[1024];
+	int verified;    // built from the folders, not just loaded from tmpfs
+	std::vector<romindex_zip_t> zips; // sorted by path
+	std::vector<romindex_rom_t> roms;
+	std::vector<uint32_t> by_crc;
+	std::vector<char> names;
+};
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static romindex_t *index_cur = nullptr;
+
+// main thread side
+static char build_root[1024] = {};
+static offload_job_t build_job = 0;
+static int build_dirty = 0;
+static int notify_fd = -1;
+
+static uint32_t index_add_name(romindex_t *idx, const char *name)
+{
+	uint32_t pos = idx->names.size();
+	idx->names.insert(idx->names.end(), name, name + strlen(name) + 1);
+	return pos;
+}
+
+static const char *index_name(const romindex_t *idx, uint32_t pos)
+{
+	return idx->names.data() + pos;
+}
+
+static int index_find_zip(const romindex_t *idx, const char *path)
+{
+	int lo = 0, hi = (int)idx->zips.size() - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		int cmp = strcasecmp(index_name(idx, idx->zips[mid].path), path);
+		if (!cmp) return mid;
+		if (cmp < 0) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return -1;
+}
+
+static void index_sort_crc(romindex_t *idx)
+{
+	idx->by_crc.resize(idx->roms.size());
+	for (uint32_t i = 0; i < idx->roms.size(); i++) idx->by_crc[i] = i;
+
+	const romindex_rom_t *roms = idx->roms.data();
+	std::sort(idx->by_crc.begin(), idx->by_crc.end(), [roms](uint32_t a, uint32_t b) { return roms[a].crc < roms[b].crc; });
+}
+
+static uint32_t index_hash(const char *root)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = root; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	return hash;
+}
+
+static romindex_t *index_load(const char *root)
+{
+	char name[64];
+	sprintf(name, ROMINDEX_DIR "/%08X", index_hash(root));
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	romindex_t *idx = nullptr;
+	struct stat64 st;
+	if (!fstat64(fd, &st) && st.st_size >= (__off64_t)sizeof(romindex_hdr_t))
+	{
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			const romindex_hdr_t *hdr = (const romindex_hdr_t *)map;
+			const romindex_zip_t *zips = (const romindex_zip_t *)(hdr + 1);
+			const romindex_rom_t *roms = (const romindex_rom_t *)(zips + hdr->zip_count);
+			const char *names = (const char *)(roms + hdr->rom_count);
+
+			if (hdr->magic == ROMINDEX_MAGIC && !strcmp(hdr->root, root) && hdr->names_size &&
+				st.st_size == (__off64_t)(sizeof(romindex_hdr_t) + hdr->zip_count * sizeof(romindex_zip_t) +
+					hdr->rom_count * sizeof(romindex_rom_t) + hdr->names_size) && !names[hdr->names_size - 1])
+			{
+				idx = new romindex_t();
+				snprintf(idx->root, sizeof(idx->root), "%s", root);
+				idx->zips.assign(zips, zips + hdr->zip_count);
+				idx->roms.assign(roms, roms + hdr->rom_count);
+				idx->names.assign(names, names + hdr->names_size);
+
+				for (auto &rom : idx->roms)
+				{
+					if (rom.zip >= hdr->zip_count || rom.name >= hdr->names_size)
+					{
+						delete idx;
+						idx = nullptr;
+						break;
+					}
+				}
+				if (idx) index_sort_crc(idx);
+			}
+			munmap(map, st.st_size);
+		}
+	}
+
+	close(fd);
+	return idx;
+}
+
+static void index_store(const romindex_t *idx)
+{
+	mkdir(ROMINDEX_DIR, 0755);
+
+	romindex_hdr_t hdr = {};
+	hdr.magic = ROMINDEX_MAGIC;
+	snprintf(hdr.root, sizeof(hdr.root), "%s", idx->root);
+	hdr.zip_count = idx->zips.size();
+	hdr.rom_count = idx->roms.size();
+	hdr.names_size = idx->names.size();
+
+	char name[64], tmp_name[64];
+	uint32_t hash = index_hash(idx->root);
+	sprintf(name, ROMINDEX_DIR "/%08X", hash);
+	sprintf(tmp_name, ROMINDEX_DIR "/.%08X", hash);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	size_t zips_size = hdr.zip_count * sizeof(romindex_zip_t);
+	size_t roms_size = hdr.rom_count * sizeof(romindex_rom_t);
+	int ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		(!zips_size || write(fd, idx->zips.data(), zips_size) == (ssize_t)zips_size) &&
+		(!roms_size || write(fd, idx->roms.data(), roms_size) == (ssize_t)roms_size) &&
+		write(fd, idx->names.data(), hdr.names_size) == (ssize_t)hdr.names_size;
+	close(fd);
+
+	if (!ok || rename(tmp_name, name)) unlink(tmp_name);
+}
+
+static void index_publish(romindex_t *idx)
+{
+	pthread_mutex_lock(&index_lock);
+	romindex_t *old = index_cur;
+	index_cur = idx;
+	pthread_mutex_unlock(&index_lock);
+
+	if (old != idx) delete old;
+}
+
+// collects the zips of a folder, paths relative to the root
+static void index_walk(romindex_t *idx, const char *root, const char *rel, int depth, int fd)
+{
+	char path[2048];
+	snprintf(path, sizeof(path), "%s/%s", root, rel);
+
+	DIR *d = opendir(path);
+	if (!d) return;
+
+	if (fd >= 0) inotify_add_watch(fd, path, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE);
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_name[0] == '.') continue;
+
+		char name[1024];
+		struct stat64 st;
+		if (snprintf(name, sizeof(name), "%s/%s", rel, de->d_name) >= (int)sizeof(name)) continue;
+		snprintf(path, sizeof(path), "%s/%s", root, name);
+		if (stat64(path, &st)) continue;
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (depth < ROMINDEX_DEPTH) index_walk(idx, root, name, depth + 1, fd);
+			continue;
+		}
+
+		int len = strlen(de->d_name);
+		if (len > 4 && !strcasecmp(de->d_name + len - 4, ".zip"))
+		{
+			romindex_zip_t zip = {};
+			zip.path = index_add_name(idx, name);
+			zip.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+			zip.size = st.st_size;
+			idx->zips.push_back(zip);
+		}
+	}
+	closedir(d);
+}
+
+// members of one zip, read apart from the index so several zips can be
+// read at once
+struct zip_part_t
+{
+	uint32_t zip;
+	std::vector<romindex_rom_t> roms;
+	std::vector<char> names;
+};
+
+struct zip_scan_t
+{
+	const romindex_t *idx;
+	std::vector<zip_part_t> *parts;
+	std::atomic<uint32_t> next;
+};
+
+// reads the central directory of a zip
+static void index_scan_zip(const romindex_t *idx, zip_part_t *part)
+{
+	char path[2048];
+	snprintf(path, sizeof(path), "%s/%s", idx->root, index_name(idx, idx->zips[part->zip].path));
+
+	mz_zip_archive z = {};
+	if (!mz_zip_reader_init_file(&z, path, 0))
+	{
+		printf("romindex: can't open %s\n", path);
+		return;
+	}
+
+	for (uint32_t i = 0; i < mz_zip_reader_get_num_files(&z); i++)
+	{
+		mz_zip_archive_file_stat s;
+		if (!mz_zip_reader_file_stat(&z, i, &s) || s.m_is_directory) continue;
+
+		romindex_rom_t rom;
+		rom.crc = s.m_crc32;
+		rom.size = s.m_uncomp_size;
+		rom.member = i;
+		rom.zip = part->zip;
+		rom.name = part->names.size();
+		part->names.insert(part->names.end(), s.m_filename, s.m_filename + strlen(s.m_filename) + 1);
+		part->roms.push_back(rom);
+	}
+
+	mz_zip_reader_end(&z);
+}
+
+static void *index_scan_thread(void *arg)
+{
+	zip_scan_t *scan = (zip_scan_t*)arg;
+
+	uint32_t i;
+	while ((i = scan->next.fetch_add(1)) < scan->parts->size()) index_scan_zip(scan->idx, &(*scan->parts)[i]);
+	return nullptr;
+}
+
+// Rebuilds the index, members of zips which didn't change since the old
+// index (same path, mtime and size) are taken over without opening them.
+// The other zips are read by this worker and a helper thread together.
+static romindex_t *index_build(const char *root, const romindex_t *old, int fd, int *changed)
+{
+	romindex_t *idx = new romindex_t();
+	snprintf(idx->root, sizeof(idx->root), "%s", root);
+	idx->verified = 1;
+
+	for (auto dir : index_dirs) index_walk(idx, root, dir, 1, fd);
+
+	const char *names = idx->names.data();
+	std::sort(idx->zips.begin(), idx->zips.end(), [names](const romindex_zip_t &a, const romindex_zip_t &b) {
+		return strcasecmp(names + a.path, names + b.path) < 0;
+	});
+
+	std::vector<int> from_old(idx->zips.size(), -1);
+	std::vector<zip_part_t> parts;
+	for (uint32_t i = 0; i < idx->zips.size(); i++)
+	{
+		const romindex_zip_t *zip = &idx->zips[i];
+		int n = old ? index_find_zip(old, index_name(idx, zip->path)) : -1;
+		if (n >= 0 && old->zips[n].mtime == zip->mtime && old->zips[n].size == zip->size)
+		{
+			from_old[i] = n;
+		}
+		else
+		{
+			parts.emplace_back();
+			parts.back().zip = i;
+		}
+	}
+
+	zip_scan_t scan;
+	scan.idx = idx;
+	scan.parts = &parts;
+	scan.next = 0;
+
+	pthread_t helper;
+	int has_helper = parts.size() >= ROMINDEX_PAR_MIN && !pthread_create(&helper, nullptr, index_scan_thread, &scan);
+	index_scan_thread(&scan);
+	if (has_helper) pthread_join(helper, nullptr);
+
+	uint32_t part = 0;
+	for (uint32_t i = 0; i < idx->zips.size(); i++)
+	{
+		romindex_zip_t *zip = &idx->zips[i];
+		zip->first = idx->roms.size();
+		zip->count = 0;
+
+		if (from_old[i] >= 0)
+		{
+			const romindex_zip_t *src = &old->zips[from_old[i]];
+			for (uint32_t m = src->first; m < src->first + src->count; m++)
+			{
+				romindex_rom_t rom = old->roms[m];
+				rom.zip = i;
+				rom.name = index_add_name(idx, index_name(old, rom.name));
+				idx->roms.push_back(rom);
+				zip->count++;
+			}
+		}
+		else
+		{
+			const zip_part_t *src = &parts[part++];
+			for (auto rom : src->roms)
+			{
+				rom.name = index_add_name(idx, src->names.data() + rom.name);
+				idx->roms.push_back(rom);
+				zip->count++;
+			}
+		}
+	}
+
+	int scanned = parts.size();
+	index_sort_crc(idx);
+	*changed = !old || scanned || old->zips.size() != idx->zips.size();
+	if (*changed) printf("romindex: %s, %u zips, %u roms (%d scanned)\n", root, (uint32_t)idx->zips.size(), (uint32_t)idx->roms.size(), scanned);
+	return idx;
+}
+
+// runs on the offload pool, build_root and notify_fd don't change meanwhile
+static void index_job(void)
+{
+	romindex_t *old = index_cur;
+	if (!old || strcmp(old->root, build_root))
+	{
+		// publish what survived the last reload while the folders are checked
+		old = index_load(build_root);
+		index_publish(old);
+	}
+
+	int changed = 0;
+	romindex_t *idx = index_build(build_root, old, notify_fd, &changed);
+	index_publish(idx);
+	if (changed) index_store(idx);
+}
+
+static int notify_pending()
+{
+	if (notify_fd < 0) return 0;
+
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	int events = 0;
+	while (read(notify_fd, buf, sizeof(buf)) > 0) events = 1;
+	return events;
+}
+
+void romindex_update(const char *root)
+{
+	if (build_job && !offload_job_done(build_job)) return;
+	build_job = 0;
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s%s%s", (root[0] == '/') ? "" : getRootDir(), (root[0] == '/') ? "" : "/", root);
+
+	if (strcmp(path, build_root))
+	{
+		if (notify_fd >= 0) close(notify_fd);
+		notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		strcpy(build_root, path);
+		build_dirty = 1;
+	}
+	else if (notify_pending())
+	{
+		build_dirty = 1;
+	}
+
+	if (!build_dirty) return;
+
+	// never let a full queue run the build on the main thread
+	build_job = offload_try_work([]() { index_job(); }, OFFLOAD_IO);
+	if (build_job) build_dirty = 0;
+}
+
+static romindex_t *index_get()
+{
+	pthread_mutex_lock(&index_lock);
+	if (index_cur && !strcmp(index_cur->root, build_root)) return index_cur;
+	pthread_mutex_unlock(&index_lock);
+	return nullptr;
+}
+
+static void index_put()
+{
+	pthread_mutex_unlock(&index_lock);
+}
+
+int romindex_ready()
+{
+	if (!build_root[0]) return 0;
+
+	// pick up changes first, a pending build means the index is behind
+	romindex_update(build_root);
+	if (build_dirty || !offload_job_done(build_job)) return 0;
+
+	romindex_t *idx = index_get();
+	if (!idx) return 0;
+
+	int ready = idx->verified;
+	index_put();
+	return ready;
+}
+
+int romindex_find_crc(uint32_t crc, uint32_t size, char *zip, size_t len)
+{
+	romindex_t *idx = index_get();
+	if (!idx) return -1;
+
+	const romindex_rom_t *roms = idx->roms.data();
+	auto it = std::lower_bound(idx->by_crc.begin(), idx->by_crc.end(), crc, [roms](uint32_t a, uint32_t crc) { return roms[a].crc < crc; });
+
+	int member = -1;
+	for (; it != idx->by_crc.end() && roms[*it].crc == crc; it++)
+	{
+		const romindex_rom_t *rom = &roms[*it];
+		if (size && rom->size != size) continue;
+
+		snprintf(zip, len, "%s/%s", idx->root, index_name(idx, idx->zips[rom->zip].path));
+		member = rom->member;
+		break;
+	}
+
+	index_put();
+	return member;
+}
+
+int romindex_has_member(const char *zip, const char *name, uint32_t crc)
+{
+	romindex_t *idx = index_get();
+	if (!idx) return -1;
+
+	int res = -1;
+	size_t root_len = strlen(idx->root);
+	if (!strncmp(zip, idx->root, root_len) && zip[root_len] == '/')
+	{
+		const char *rel = zip + root_len + 1;
+		int covered = 0;
+		for (auto dir : index_dirs)
+		{
+			size_t dir_len = strlen(dir);
+			if (!strncasecmp(rel, dir, dir_len) && rel[dir_len] == '/') covered = 1;
+		}
+
+		// the walk stops ROMINDEX_DEPTH folders down
+		int depth = 0;
+		for (const char *p = rel; *p; p++) if (*p == '/') depth++;
+
+		// a zip which isn't in the index (too deep, or added since) is unknown
+		int n = (covered && depth <= ROMINDEX_DEPTH) ? index_find_zip(idx, rel) : -1;
+		if (n >= 0)
+		{
+			res = 0;
+			const romindex_zip_t *z = &idx->zips[n];
+			for (uint32_t m = z->first; m < z->first + z->count && !res; m++)
+			{
+				const romindex_rom_t *rom = &idx->roms[m];
+				if ((crc && rom->crc == crc) || !strcasecmp(index_name(idx, rom->name), name)) res = 1;
+			}
+		}
+	}
+
+	index_put();
+	return res;
+}
+
+#define ROMINDEX_TAG_MAGIC 0x52495401
+
+struct tag_rec_t
+{
+	uint32_t crc;
+	uint32_t name;
+};
+
+struct tag_hdr_t
+{
+	uint32_t magic;
+	char dir[1024];
+	char ext[16];
+	int64_t mtime;
+	uint32_t count;
+	uint32_t names_size;
+};
+
+// Listing of the last folder, sorted by crc. It's kept in tmpfs as well, so
+// the first lookup after a core reload doesn't scan the folder again.
+static char tag_dir[1024] = {};
+static char tag_ext[16] = {};
+static int64_t tag_mtime = 0;
+static std::vector<tag_rec_t> tags;
+static std::vector<char> tag_names;
+
+static void tag_file(const char *dir, const char *ext, char *name, char *tmp_name)
+{
+	uint32_t hash = index_hash(dir) ^ index_hash(ext);
+	sprintf(name, ROMINDEX_DIR "/T%08X", hash);
+	sprintf(tmp_name, ROMINDEX_DIR "/.T%08X", hash);
+}
+
+static int tag_load(const char *dir, const char *ext, int64_t mtime)
+{
+	char name[64], tmp_name[64];
+	tag_file(dir, ext, name, tmp_name);
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = 0;
+	tag_hdr_t hdr;
+	struct stat64 st;
+	if (!fstat64(fd, &st) && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == ROMINDEX_TAG_MAGIC &&
+		hdr.mtime == mtime && !strcmp(hdr.dir, dir) && !strcmp(hdr.ext, ext) &&
+		st.st_size == (__off64_t)(sizeof(hdr) + hdr.count * sizeof(tag_rec_t) + hdr.names_size))
+	{
+		tags.resize(hdr.count);
+		tag_names.resize(hdr.names_size);
+		size_t tags_size = hdr.count * sizeof(tag_rec_t);
+		ok = (!tags_size || read(fd, tags.data(), tags_size) == (ssize_t)tags_size) &&
+			(!hdr.names_size || read(fd, tag_names.data(), hdr.names_size) == (ssize_t)hdr.names_size) &&
+			(!hdr.names_size || !tag_names.back());
+
+		for (uint32_t i = 0; ok && i < hdr.count; i++) if (tags[i].name >= hdr.names_size) ok = 0;
+	}
+	close(fd);
+
+	if (!ok)
+	{
+		tags.clear();
+		tag_names.clear();
+	}
+	return ok;
+}
+
+static void tag_store(const char *dir, const char *ext, int64_t mtime)
+{
+	mkdir(ROMINDEX_DIR, 0755);
+
+	tag_hdr_t hdr = {};
+	hdr.magic = ROMINDEX_TAG_MAGIC;
+	snprintf(hdr.dir, sizeof(hdr.dir), "%s", dir);
+	snprintf(hdr.ext, sizeof(hdr.ext), "%s", ext);
+	hdr.mtime = mtime;
+	hdr.count = tags.size();
+	hdr.names_size = tag_names.size();
+
+	char name[64], tmp_name[64];
+	tag_file(dir, ext, name, tmp_name);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	size_t tags_size = hdr.count * sizeof(tag_rec_t);
+	int ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+		(!tags_size || write(fd, tags.data(), tags_size) == (ssize_t)tags_size) &&
+		(!hdr.names_size || write(fd, tag_names.data(), hdr.names_size) == (ssize_t)hdr.names_size);
+	close(fd);
+
+	if (!ok || rename(tmp_name, name)) unlink(tmp_name);
+}
+
+static int tag_scan(const char *dir, const char *ext)
+{
+	DIR *d = opendir(dir);
+	if (!d)
+	{
+		printf("Couldn't open dir: %s\n", dir);
+		return 0;
+	}
+
+	int ext_len = strlen(ext);
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_type != DT_REG) continue;
+
+		int n = strlen(de->d_name);
+		if (n < 10 + ext_len) continue;
+
+		const char *p = de->d_name + n - 10 - ext_len;
+		tag_rec_t tag;
+		if (p[0] == '[' && p[9] == ']' && !strcasecmp(p + 10, ext) && sscanf(p, "[%X]", &tag.crc) == 1)
+		{
+			tag.name = tag_names.size();
+			tag_names.insert(tag_names.end(), de->d_name, de->d_name + n + 1);
+			tags.push_back(tag);
+		}
+	}
+	closedir(d);
+
+	// stable, so the first file of a duplicated crc is still the one found
+	std::stable_sort(tags.begin(), tags.end(), [](const tag_rec_t &a, const tag_rec_t &b) { return a.crc < b.crc; });
+	return 1;
+}
+
+int romindex_find_tag(const char *dir, uint32_t crc, const char *ext, char *name, size_t len)
+{
+	struct stat64 st;
+	if (stat64(dir, &st) || strlen(dir) >= sizeof(tag_dir) || strlen(ext) >= sizeof(tag_ext)) return 0;
+
+	int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	if (strcmp(tag_dir, dir) || strcmp(tag_ext, ext) || tag_mtime != mtime)
+	{
+		tags.clear();
+		tag_names.clear();
+		tag_dir[0] = 0;
+
+		if (!tag_load(dir, ext, mtime))
+		{
+			if (!tag_scan(dir, ext)) return 0;
+			tag_store(dir, ext, mtime);
+		}
+
+		snprintf(tag_dir, sizeof(tag_dir), "%s", dir);
+		snprintf(tag_ext, sizeof(tag_ext), "%s", ext);
+		tag_mtime = mtime;
+	}
+
+	auto it = std::lower_bound(tags.begin(), tags.end(), crc, [](const tag_rec_t &tag, uint32_t crc) { return tag.crc < crc; });
+	if (it == tags.end() || it->crc != crc) return 0;
+
+	snprintf(name, len, "%s", tag_names.data() + it->name);
+	return 1;
+}
@@ -0,0 +1,27 @@
+#ifndef ROMINDEX_H
+#define ROMINDEX_H
+
+#include <stddef.h>
+#include <inttypes.h>
+
+// Index of the members of every zip in <root>/mame and <root>/hbmame.
+// It's built and kept up to date (through inotify) on the offload pool and
+// survives core reloads in tmpfs. All calls are main thread only.
+
+// Starts or refreshes the index of a ROM root, never blocks.
+void romindex_update(const char *root);
+int  romindex_ready();
+
+// Finds a member by crc32 (and size if not 0) in any indexed zip.
+// Returns the member index and the full path of its zip, or -1.
+int  romindex_find_crc(uint32_t crc, uint32_t size, char *zip, size_t len);
+
+// Checks a zip (full path) for a member with this name or crc32.
+// Returns 1 if found, 0 if missing, -1 if the zip isn't covered by the index.
+int  romindex_has_member(const char *zip, const char *name, uint32_t crc);
+
+// Finds a file tagged "[crc].<ext>" in a folder, the listing is cached
+// (in tmpfs too) until the folder changes. Returns 1 and the file name if found.
+int  romindex_find_tag(const char *dir, uint32_t crc, const char *ext, char *name, size_t len);
+
+#endif
@@ -12,12 +12,18 @@ with help from the MiSTer contributors including Grabulosaure
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <err.h>
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 #include "scaler.h"
 #include "shmem.h"
+#include "profiling.h"
 
 
 mister_scaler * mister_scaler_init()
@@ -48,12 +54,7 @@ mister_scaler * mister_scaler_init()
         return NULL;
     }
 
-    ms->header=buffer[2]<<8 | buffer[3];
-    ms->width =buffer[6]<<8 | buffer[7];
-    ms->height=buffer[8]<<8 | buffer[9];
-    ms->line  =buffer[10]<<8 | buffer[11];
-    ms->output_width =buffer[12]<<8 | buffer[13];
-    ms->output_height=buffer[14]<<8 | buffer[15];
+    mister_scaler_update(ms);
 
     printf ("Image: Width=%i Height=%i  Line=%i  Header=%i output_width=%i output_height=%i \n",ms->width,ms->height,ms->line,ms->header,ms->output_width,ms->output_height);
    /*
@@ -66,44 +67,121 @@ mister_scaler * mister_scaler_init()
 
 }
 
+int mister_scaler_update(mister_scaler *ms)
+{
+    unsigned char *buffer = (unsigned char *)(ms->map+ms->map_off);
+    if (buffer[0]!=1 || buffer[1]!=1) return 0;
+
+    ms->header=buffer[2]<<8 | buffer[3];
+    ms->width =buffer[6]<<8 | buffer[7];
+    ms->height=buffer[8]<<8 | buffer[9];
+    ms->line  =buffer[10]<<8 | buffer[11];
+    ms->output_width =buffer[12]<<8 | buffer[13];
+    ms->output_height=buffer[14]<<8 | buffer[15];
+
+    // the frame has to fit the mapped buffer
+    return ms->width > 0 && ms->height > 0 && ms->line >= ms->width*3 &&
+        ms->header + ms->line*ms->height <= ms->num_bytes;
+}
+
 void mister_scaler_free(mister_scaler *ms)
 {
    shmem_unmap(ms->map,ms->num_bytes+ms->map_off);
    free(ms);
 }
 
+// BT.601 studio range in 8.8 fixed point, offsets include the rounding
+#define YUV_Y(r, g, b) ((( 66 * (r) + 129 * (g) +  25 * (b) + 4224) >> 8) & 0xFF)
+#define YUV_U(r, g, b) (((-38 * (r) -  74 * (g) + 112 * (b) + 32896) >> 8) & 0xFF)
+#define YUV_V(r, g, b) (((112 * (r) -  94 * (g) -  18 * (b) + 32896) >> 8) & 0xFF)
+
+static void yuv_row(const unsigned char *pix, unsigned char *outY, unsigned char *outU, unsigned char *outV, int width)
+{
+    int x = 0;
+#ifdef __ARM_NEON
+    // the sums of U and V stay positive with their offset, so they fit u16
+    for (; x + 8 <= width; x += 8, pix += 24)
+    {
+        uint8x8x3_t rgb = vld3_u8(pix);
+        uint16x8_t y = vdupq_n_u16(4224);
+        y = vmlal_u8(y, rgb.val[0], vdup_n_u8(66));
+        y = vmlal_u8(y, rgb.val[1], vdup_n_u8(129));
+        y = vmlal_u8(y, rgb.val[2], vdup_n_u8(25));
+
+        uint16x8_t u = vdupq_n_u16(32896);
+        u = vmlal_u8(u, rgb.val[2], vdup_n_u8(112));
+        u = vmlsl_u8(u, rgb.val[0], vdup_n_u8(38));
+        u = vmlsl_u8(u, rgb.val[1], vdup_n_u8(74));
+
+        uint16x8_t v = vdupq_n_u16(32896);
+        v = vmlal_u8(v, rgb.val[0], vdup_n_u8(112));
+        v = vmlsl_u8(v, rgb.val[1], vdup_n_u8(94));
+        v = vmlsl_u8(v, rgb.val[2], vdup_n_u8(18));
+
+        vst1_u8(outY + x, vshrn_n_u16(y, 8));
+        vst1_u8(outU + x, vshrn_n_u16(u, 8));
+        vst1_u8(outV + x, vshrn_n_u16(v, 8));
+    }
+#endif
+    for (; x < width; x++, pix += 3)
+    {
+        outY[x] = YUV_Y(pix[0], pix[1], pix[2]);
+        outU[x] = YUV_U(pix[0], pix[1], pix[2]);
+        outV[x] = YUV_V(pix[0], pix[1], pix[2]);
+    }
+}
+
 int mister_scaler_read_yuv(mister_scaler *ms,int lineY,unsigned char *bufY, int lineU, unsigned char *bufU, int lineV, unsigned char *bufV)
 {
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..
-    unsigned char *pixbuf;
-    unsigned char *outbufy;
-    unsigned char *outbufU;
-    unsigned char *outbufV;
     for (int  y=0; y< ms->height ; y++)
-	{
-        pixbuf=&buffer[ms->header + y*ms->line];
-        outbufy=&bufY[y*(lineY)];
-        outbufU=&bufU[y*(lineU)];
-        outbufV=&bufV[y*(lineV)];
-        for (int x = 0; x < ms->width ; x++)
-		{
-			int R,G,B;
-			R = *pixbuf++;
-			G = *pixbuf++;
-			B = *pixbuf++;
-			int Y =  (0.257 * R) + (0.504 * G) + (0.098 * B) + 16;
-			int U = -(0.148 * R) - (0.291 * G) + (0.439 * B) + 128;
-			int V =  (0.439 * R) - (0.368 * G) - (0.071 * B) + 128;
-
-			*outbufy++ = Y;
-			*outbufU++ = U;
-			*outbufV++ = V;
-        }
+    {
+        yuv_row(&buffer[ms->header + y*ms->line], &bufY[y*lineY], &bufU[y*lineU], &bufV[y*lineV], ms->width);
+    }
+
+    return 0;
+}
+
+// 2x2 average of the U and V of two full resolution rows
+static void chroma_row(const unsigned char *u0, const unsigned char *u1, unsigned char *out, int width)
+{
+    int x = 0;
+#ifdef __ARM_NEON
+    for (; x + 16 <= width; x += 16)
+    {
+        uint16x8_t sum = vaddq_u16(vpaddlq_u8(vld1q_u8(u0 + x)), vpaddlq_u8(vld1q_u8(u1 + x)));
+        vst1_u8(out + x/2, vrshrn_n_u16(sum, 2));
+    }
+#endif
+    for (; x < width; x += 2)
+    {
+        int x1 = (x + 1 < width) ? x + 1 : x;
+        out[x/2] = (u0[x] + u0[x1] + u1[x] + u1[x1] + 2) >> 2;
+    }
+}
+
+int mister_scaler_read_i420(mister_scaler *ms, unsigned char *bufY, unsigned char *bufU, unsigned char *bufV)
+{
+    unsigned char *buffer;
+    buffer = (unsigned char *)(ms->map+ms->map_off);
+
+    int w = ms->width;
+    int cw = (w + 1) / 2;
+    unsigned char *tmp = (unsigned char *)malloc(w*4);
+    if (!tmp) return -1;
+
+    for (int  y=0; y< ms->height ; y+=2)
+    {
+        int y1 = (y + 1 < ms->height) ? y + 1 : y;
+        yuv_row(&buffer[ms->header + y*ms->line], &bufY[y*w], tmp, tmp + w, w);
+        yuv_row(&buffer[ms->header + y1*ms->line], &bufY[y1*w], tmp + w*2, tmp + w*3, w);
+        chroma_row(tmp, tmp + w*2, &bufU[(y/2)*cw], w);
+        chroma_row(tmp + w, tmp + w*3, &bufV[(y/2)*cw], w);
     }
 
+    free(tmp);
     return 0;
 }
 
@@ -112,40 +190,103 @@ int mister_scaler_read(mister_scaler *ms,unsigned char *gbuf)
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
+    // same RGB layout, only the line padding has to go
+    int row = ms->width*3;
+    if (ms->line == row)
+    {
+        memcpy(gbuf, &buffer[ms->header], row*ms->height);
+        return 0;
+    }
+
     for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*3)];
-          for (int x = 0; x < ms->width ; x++) {
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-            *outbuf++ = *pixbuf++;
-          }
+        memcpy(&gbuf[y*row], &buffer[ms->header + y*ms->line], row);
     }
 
     return 0;
 }
 
+static void bgra_row(const unsigned char *pix, unsigned char *out, int width)
+{
+    int x = 0;
+#ifdef __ARM_NEON
+    for (; x + 16 <= width; x += 16, pix += 48, out += 64)
+    {
+        uint8x16x3_t rgb = vld3q_u8(pix);
+        uint8x16x4_t bgra;
+        bgra.val[0] = rgb.val[2];
+        bgra.val[1] = rgb.val[1];
+        bgra.val[2] = rgb.val[0];
+        bgra.val[3] = vdupq_n_u8(0xFF);
+        vst4q_u8(out, bgra);
+    }
+#endif
+    for (; x < width; x++, pix += 3, out += 4)
+    {
+        out[0] = pix[2];
+        out[1] = pix[1];
+        out[2] = pix[0];
+        out[3] = 0xFF;
+    }
+}
+
 int mister_scaler_read_32(mister_scaler *ms, unsigned char *gbuf) {
     unsigned char *buffer;
     buffer = (unsigned char *)(ms->map+ms->map_off);
 
-    // do this slow way for now..  - could use a memcpy?
-    unsigned char *pixbuf;
-    unsigned char *outbuf;
     for (int  y=0; y< ms->height ; y++) {
-          pixbuf=&buffer[ms->header + y*ms->line];
-          outbuf=&gbuf[y*(ms->width*4)];
-          for (int x = 0; x < ms->width ; x++) {
-            outbuf[2] = *pixbuf++;
-            outbuf[1] = *pixbuf++;
-            outbuf[0] = *pixbuf++;
-            outbuf[3] = 0xFF;
-	    outbuf+=4;
-          }
+        bgra_row(&buffer[ms->header + y*ms->line], &gbuf[y*(ms->width*4)], ms->width);
     }
 
     return 0;
 }
+
+// times the readers on a synthetic 1080p frame in normal memory,
+// so the numbers are the conversion cost without the uncached reads
+void mister_scaler_bench()
+{
+    const int w = 1920, h = 1080, header = 16, loops = 8;
+
+    mister_scaler ms = {};
+    ms.header = header;
+    ms.width = w;
+    ms.height = h;
+    ms.num_bytes = header + (w*3 + 64)*h;
+    ms.map = (char *)malloc(ms.num_bytes);
+
+    unsigned char *out = (unsigned char *)malloc(w*h*4);
+    unsigned char *u = (unsigned char *)malloc(w*h);
+    unsigned char *v = (unsigned char *)malloc(w*h);
+    if (!ms.map || !out || !u || !v)
+    {
+        printf("scaler_bench: out of memory\n");
+    }
+    else
+    {
+        for (int i = 0; i < ms.num_bytes; i++) ms.map[i] = (char)(i * 7);
+
+        for (int kind = 0; kind < 5; kind++)
+        {
+            static const char *names[] = { "scaler rgb 1080p", "scaler rgb_pad 1080p", "scaler bgra 1080p", "scaler yuv 1080p", "scaler i420 1080p" };
+            ms.line = (kind == 1) ? w*3 + 64 : w*3; // padded lines take the per row copy
+
+            uint64_t start = profiling_time_us();
+            for (int n = 0; n < loops; n++)
+            {
+                switch (kind)
+                {
+                case 0:
+                case 1: mister_scaler_read(&ms, out); break;
+                case 2: mister_scaler_read_32(&ms, out); break;
+                case 3: mister_scaler_read_yuv(&ms, w, out, w, u, w, v); break;
+                case 4: mister_scaler_read_i420(&ms, out, u, v); break;
+                }
+            }
+            profiling_bench_report(names[kind], profiling_time_us() - start, loops, (uint64_t)w*3*h*loops);
+        }
+    }
+
+    free(v);
+    free(u);
+    free(out);
+    free(ms.map);
+}
@@ -23,9 +23,14 @@ typedef struct {
 #define MISTER_SCALER_BUFFERSIZE   2048*3*1024
 
 mister_scaler *mister_scaler_init();
+// re-reads the frame geometry, returns 0 if the frame isn't valid
+int mister_scaler_update(mister_scaler *ms);
 int mister_scaler_read(mister_scaler *,unsigned char *buffer);
 int mister_scaler_read_32(mister_scaler *ms, unsigned char *buffer);
 int mister_scaler_read_yuv(mister_scaler *ms,int,unsigned char *y,int, unsigned char *U,int, unsigned char *V);
+// planar 4:2:0, Y lines of width, U and V lines of (width+1)/2
+int mister_scaler_read_i420(mister_scaler *ms, unsigned char *y, unsigned char *u, unsigned char *v);
 void mister_scaler_free(mister_scaler *);
+void mister_scaler_bench();
 
 #endif
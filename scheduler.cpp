@@ -1,17 +1,238 @@
 #include "scheduler.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+#include <atomic>
 #include "libco.h"
 #include "menu.h"
 #include "user_io.h"
 #include "input.h"
 #include "fpga_io.h"
 #include "osd.h"
+#include "file_io.h"
 #include "profiling.h"
+#include "cfg.h"
+
+#define SCHED_MAX_TASKS 8
+#define SCHED_MAX_TIMERS 16
+#define SCHED_STACK_SIZE (262144 * sizeof(void*))
+
+// MISTER_MEM_AUDIT=1 in the environment fills the stacks with a pattern,
+// so scheduler_mem_report() can tell how deep each one was used. Left off
+// otherwise, the painting makes the whole stack resident.
+#define SCHED_STACK_PAINT 0x5AC0FFEEu
+#define SCHED_PAINT_SKIP  512  // libco keeps its state at the bottom and the entry frame at the top
+
+// tasks waiting for longer than this are run regardless of priority
+#define SCHED_STARVE_US 50000
+
+struct SchedTask
+{
+	const char *name;
+	void (*entry)(void);
+	cothread_t co;
+	uint32_t period_us;  // minimal interval between two runs
+	uint32_t budget_us;  // slice length honored by scheduler_yield_budget()
+	int priority;        // lower value runs first
+	uint64_t next_run_us;
+	uint64_t slice_start_us;
+	int hist;            // iteration time histogram
+	int painted;
+};
+
+static SchedTask tasks[SCHED_MAX_TASKS];
+static int task_num = 0;
 
 static cothread_t co_scheduler = nullptr;
-static cothread_t co_poll = nullptr;
-static cothread_t co_ui = nullptr;
-static cothread_t co_last = nullptr;
+static SchedTask *task_cur = nullptr;
+static SchedTask *task_last = nullptr;
+
+static int hist_poll_gap = -1;
+
+struct SchedTimer
+{
+	const char *name;
+	scheduler_timer_fn cb;
+	uint64_t deadline_us;  // 0 - stopped
+	int hist;              // lateness histogram
+};
+
+// Input window: the last SCHED_INPUT_LEAD_US of every frame, right before
+// the vsync where the cores latch their inputs, only co_poll runs and the
+// bulk transfers wait. The phase comes from the HDMI vsync, so it's used
+// only while the output runs at the core's rate (vsync_adjust).
+#define SCHED_INPUT_LEAD_US 1500
+#define SCHED_LOCK_DIV      200    // HDMI and core frame times within 0.5%
+
+static pthread_t phase_thread_id;
+static int phase_running = 0;
+static std::atomic<bool> phase_locked(false);
+static std::atomic<uint64_t> phase_vs_us(0);
+static std::atomic<uint32_t> phase_frame_us(0);
+
+static void *scheduler_phase_thread(void *)
+{
+	int fb = open("/dev/fb0", O_RDWR | O_CLOEXEC);
+	if (fb < 0)
+	{
+		printf("scheduler: can't open /dev/fb0, no input window\n");
+		return nullptr;
+	}
+
+	uint64_t last_vs = 0;
+	for (;;)
+	{
+		int zero = 0;
+		if (ioctl(fb, FBIO_WAITFORVSYNC, &zero) == -1)
+		{
+			phase_vs_us.store(0);
+			last_vs = 0;
+			usleep(16666);
+			continue;
+		}
+
+		// the interval is averaged, so one late wakeup barely moves the phase
+		uint64_t vs = profiling_time_us();
+		if (last_vs)
+		{
+			uint32_t frame = phase_frame_us.load();
+			uint32_t interval = (uint32_t)(vs - last_vs);
+			if (!frame || interval > frame * 2) frame = interval;
+			else if (interval < frame + frame / 2) frame = frame - (frame >> 4) + (interval >> 4);
+			phase_frame_us.store(frame);
+		}
+		phase_vs_us.store(vs);
+		last_vs = vs;
+	}
+
+	return nullptr;
+}
+
+void scheduler_set_frame_time(uint32_t vtime, uint32_t vtimeh)
+{
+	uint32_t diff = (vtime > vtimeh) ? vtime - vtimeh : vtimeh - vtime;
+	bool locked = vtime && vtimeh && diff <= vtime / SCHED_LOCK_DIV && !is_menu();
+	phase_locked.store(locked);
+	if (!locked || phase_running) return;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	// core #0 like the other side threads, main runs on core #1
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+
+	int res = pthread_create(&phase_thread_id, &attr, scheduler_phase_thread, nullptr);
+	pthread_attr_destroy(&attr);
+
+	if (res) printf("scheduler: can't start the vsync thread (%d)\n", res);
+	else
+	{
+		pthread_detach(phase_thread_id);
+		phase_running = 1;
+	}
+}
+
+int scheduler_input_window(void)
+{
+	if (!phase_locked.load()) return 0;
+
+	uint32_t frame = phase_frame_us.load();
+	uint64_t vs = phase_vs_us.load();
+	if (frame <= SCHED_INPUT_LEAD_US * 2 || !vs) return 0;
+
+	// a stale stamp (no vsync for a few frames) is no phase
+	uint64_t since = profiling_time_us() - vs;
+	if (since > frame * 4ULL) return 0;
+
+	return (uint32_t)(since % frame) >= frame - SCHED_INPUT_LEAD_US;
+}
+
+void scheduler_phase_report(FILE *fp)
+{
+	fprintf(fp, "input window: %s, frame %uus, lead %uus\n", phase_locked.load() ? "on" : "off",
+		phase_frame_us.load(), SCHED_INPUT_LEAD_US);
+	fflush(fp);
+}
+
+static SchedTimer timers[SCHED_MAX_TIMERS];
+static int timer_num = 0;
+static uint64_t timer_next_us = 0;
+
+static void scheduler_timer_update(void)
+{
+	timer_next_us = 0;
+	for (int i = 0; i < timer_num; i++)
+	{
+		uint64_t deadline = timers[i].deadline_us;
+		if (deadline && (!timer_next_us || deadline < timer_next_us)) timer_next_us = deadline;
+	}
+}
+
+int scheduler_timer_add(const char *name, scheduler_timer_fn cb, uint32_t delay_us)
+{
+	if (timer_num >= SCHED_MAX_TIMERS)
+	{
+		printf("scheduler: too many timers, %s is not added.\n", name);
+		return -1;
+	}
+
+	SchedTimer *timer = &timers[timer_num];
+	timer->name = name;
+	timer->cb = cb;
+	timer->deadline_us = 0;
+	timer->hist = profiling_hist_id(name);
+	scheduler_timer_set(timer_num, delay_us);
+	return timer_num++;
+}
+
+void scheduler_timer_set(int id, uint32_t delay_us)
+{
+	if (id < 0 || id >= SCHED_MAX_TIMERS) return;
+
+	timers[id].deadline_us = delay_us ? profiling_time_us() + delay_us : 0;
+	scheduler_timer_update();
+}
+
+void scheduler_timer_run(void)
+{
+	if (!timer_next_us) return;
+
+	uint64_t now = profiling_time_us();
+	if (now < timer_next_us) return;
+
+	for (int i = 0; i < timer_num; i++)
+	{
+		SchedTimer *timer = &timers[i];
+		if (!timer->deadline_us || now < timer->deadline_us) continue;
+
+		profiling_hist_add(timer->hist, now - timer->deadline_us);
+
+		uint32_t delay = timer->cb();
+		if (!delay) timer->deadline_us = 0;
+		else
+		{
+			// keep the cadence, unless it's more than a period behind
+			timer->deadline_us += delay;
+			if (timer->deadline_us <= now) timer->deadline_us = now + delay;
+		}
+	}
+
+	scheduler_timer_update();
+}
+
+uint64_t scheduler_timer_next_us(void)
+{
+	return timer_next_us;
+}
 
 static void scheduler_wait_fpga_ready(void)
 {
@@ -21,56 +242,228 @@ static void scheduler_wait_fpga_ready(void)
 	}
 }
 
-static void scheduler_co_poll(void)
+// Sleeps before a poll once nothing happened for a while, up to idle_wait ms
+// or the next timer. Input ends the sleep right away and keeps the loop busy.
+#define SCHED_IDLE_AFTER_US 200000
+
+static void scheduler_idle(void)
 {
-	for (;;)
+	static uint64_t busy_us = 0;
+
+	uint64_t now = profiling_time_us();
+	if (!cfg.idle_wait || !user_io_idle())
 	{
-		scheduler_wait_fpga_ready();
+		busy_us = now;
+		return;
+	}
 
-		{
-			SPIKE_SCOPE("co_poll", 1000);
-			user_io_poll();
-			input_poll(0);
-		}
+	if (now - busy_us < SCHED_IDLE_AFTER_US) return;
 
-		scheduler_yield();
+	int timeout = cfg.idle_wait;
+	if (timer_next_us)
+	{
+		if (timer_next_us <= now) return;
+		if (timer_next_us - now < (uint64_t)timeout * 1000) timeout = (timer_next_us - now) / 1000;
 	}
+
+	if (input_idle_wait(timeout)) busy_us = profiling_time_us();
+}
+
+static void scheduler_co_poll(void)
+{
+	static uint64_t last_poll_us = 0;
+
+	scheduler_wait_fpga_ready();
+	scheduler_idle();
+
+	SPIKE_SCOPE("co_poll", 1000);
+
+	uint64_t now = profiling_time_us();
+	if (last_poll_us) profiling_hist_add(hist_poll_gap, now - last_poll_us);
+	last_poll_us = now;
+
+	scheduler_timer_run();
+	user_io_poll();
+	input_poll(0);
+	profiling_boot_done();
 }
 
+// While playing with the OSD hidden the menu only runs every
+// SCHED_UI_IDLE_US for its timers, a menu key brings it back right away.
+#define SCHED_UI_IDLE_US 100000
+
 static void scheduler_co_ui(void)
 {
+	static uint64_t last_us = 0;
+
+	uint64_t now = profiling_time_us();
+	if (menu_ui_idle() && now - last_us < SCHED_UI_IDLE_US)
+	{
+		OsdUpdate();
+		return;
+	}
+	last_us = now;
+
+	SPIKE_SCOPE("co_ui", 1000);
+	HandleUI();
+	OsdUpdate();
+}
+
+static void scheduler_co_scan(void)
+{
+	// a listing runs for as long as it takes, yielding on its budget
+	ScanDirectoryTask();
+}
+
+static void scheduler_co_entry(void)
+{
+	SchedTask *task = task_cur;
 	for (;;)
 	{
+		uint64_t start_us = profiling_time_us();
+		task->entry();
+		profiling_hist_add(task->hist, profiling_time_us() - start_us);
+		scheduler_yield();
+	}
+}
+
+static SchedTask *scheduler_pick(uint64_t now)
+{
+	SchedTask *best = nullptr;
+	SchedTask *earliest = nullptr;
+	int window = scheduler_input_window();
+
+	for (int i = 0; i < task_num; i++)
+	{
+		SchedTask *task = &tasks[i];
+
+		// in the input window only co_poll and the starving tasks run
+		if (window && task->priority && (now < task->next_run_us || (now - task->next_run_us) <= SCHED_STARVE_US)) continue;
+
+		if (!earliest || task->next_run_us < earliest->next_run_us) earliest = task;
+
+		// don't run the same task twice in a row while others are due
+		if (task == task_last || now < task->next_run_us) continue;
+
+		if (!best) best = task;
+		else
 		{
-			SPIKE_SCOPE("co_ui", 1000);
-			HandleUI();
-			OsdUpdate();
-		}
+			bool starved = (now - task->next_run_us) > SCHED_STARVE_US;
+			bool best_starved = (now - best->next_run_us) > SCHED_STARVE_US;
 
-		scheduler_yield();
+			if (starved != best_starved)
+			{
+				if (starved) best = task;
+			}
+			else if (task->priority < best->priority ||
+				(task->priority == best->priority && task->next_run_us < best->next_run_us))
+			{
+				best = task;
+			}
+		}
 	}
+
+	if (!best && task_last && now >= task_last->next_run_us) best = task_last;
+
+	// nothing is due, keep the loop busy with whatever comes next
+	return best ? best : earliest;
 }
 
 static void scheduler_schedule(void)
 {
-	if (co_last == co_poll)
+	uint64_t now = profiling_time_us();
+	SchedTask *task = scheduler_pick(now);
+
+	task->next_run_us = now + task->period_us;
+	task->slice_start_us = now;
+
+	task_cur = task;
+	co_switch(task->co);
+	task_cur = nullptr;
+	task_last = task;
+}
+
+int scheduler_add_task(const char *name, void (*entry)(void), uint32_t period_us, uint32_t budget_us, int priority)
+{
+	if (task_num >= SCHED_MAX_TASKS)
 	{
-		co_last = co_ui;
-		co_switch(co_ui);
+		printf("scheduler: too many tasks, %s is not added.\n", name);
+		return 0;
 	}
-	else
+
+	SchedTask *task = &tasks[task_num++];
+	task->name = name;
+	task->entry = entry;
+	task->period_us = period_us;
+	task->budget_us = budget_us;
+	task->priority = priority;
+	task->next_run_us = 0;
+	task->slice_start_us = 0;
+	task->hist = profiling_hist_id(name);
+	task->co = co_create(SCHED_STACK_SIZE, scheduler_co_entry);
+	task->painted = 0;
+
+	if (task->co && getenv("MISTER_MEM_AUDIT"))
 	{
-		co_last = co_poll;
-		co_switch(co_poll);
+		uint32_t *p = (uint32_t*)((uint8_t*)task->co + SCHED_PAINT_SKIP);
+		uint32_t *end = (uint32_t*)((uint8_t*)task->co + SCHED_STACK_SIZE - SCHED_PAINT_SKIP);
+		while (p < end) *p++ = SCHED_STACK_PAINT;
+		task->painted = 1;
 	}
+	return 1;
 }
 
-void scheduler_init(void)
+// the stack grows down, the lowest overwritten word is the high-water mark
+static uint32_t scheduler_stack_used(const SchedTask *task)
 {
-	const unsigned int co_stack_size = 262144 * sizeof(void*);
+	const uint32_t *p = (const uint32_t*)((const uint8_t*)task->co + SCHED_PAINT_SKIP);
+	const uint32_t *end = (const uint32_t*)((const uint8_t*)task->co + SCHED_STACK_SIZE - SCHED_PAINT_SKIP);
+	while (p < end && *p == SCHED_STACK_PAINT) p++;
+	return (uint32_t)((const uint8_t*)task->co + SCHED_STACK_SIZE - (const uint8_t*)p);
+}
+
+void scheduler_mem_report(FILE *fp)
+{
+	fprintf(fp, "+----- Task ---------+-- Stack(KB) +--- Used(KB) +\n");
+	for (int i = 0; i < task_num; i++)
+	{
+		const SchedTask *task = &tasks[i];
+		if (task->painted)
+		{
+			fprintf(fp, "| %-18s | %11u | %11u |\n", task->name, (uint32_t)(SCHED_STACK_SIZE / 1024),
+				(scheduler_stack_used(task) + 1023) / 1024);
+		}
+		else
+		{
+			fprintf(fp, "| %-18s | %11u | %11s |\n", task->name, (uint32_t)(SCHED_STACK_SIZE / 1024), "-");
+		}
+	}
+	fprintf(fp, "+--------------------+-------------+-------------+\n");
 
-	co_poll = co_create(co_stack_size, scheduler_co_poll);
-	co_ui = co_create(co_stack_size, scheduler_co_ui);
+	// resident memory of the whole process, the stacks and static buffers
+	// only count for the pages which were touched
+	FILE *st = fopen("/proc/self/status", "rt");
+	if (st)
+	{
+		char line[128];
+		while (fgets(line, sizeof(line), st))
+		{
+			if (!strncmp(line, "VmHWM:", 6) || !strncmp(line, "VmRSS:", 6) || !strncmp(line, "VmData:", 7) ||
+				!strncmp(line, "VmStk:", 6) || !strncmp(line, "RssAnon:", 8)) fputs(line, fp);
+		}
+		fclose(st);
+	}
+	fflush(fp);
+}
+
+void scheduler_init(void)
+{
+	// I/O runs between every UI slice, UI yields from long loops after 2ms.
+	// Background directory listings take turns with the UI.
+	scheduler_add_task("co_poll", scheduler_co_poll, 0, 0, 0);
+	scheduler_add_task("co_ui", scheduler_co_ui, 0, 2000, 1);
+	scheduler_add_task("co_scan", scheduler_co_scan, 0, 2000, 1);
+	hist_poll_gap = profiling_hist_id("user_io_poll gap");
 }
 
 void scheduler_run(void)
@@ -82,8 +475,7 @@ void scheduler_run(void)
 		scheduler_schedule();
 	}
 
-	co_delete(co_ui);
-	co_delete(co_poll);
+	for (int i = 0; i < task_num; i++) co_delete(tasks[i].co);
 	co_delete(co_scheduler);
 }
 
@@ -91,3 +483,15 @@ void scheduler_yield(void)
 {
 	co_switch(co_scheduler);
 }
+
+void scheduler_yield_budget(void)
+{
+	SchedTask *task = task_cur;
+	if (!task || !task->budget_us) return;
+
+	// let co_poll hand over the input as soon as it arrives
+	if (input_rt_pending() || (profiling_time_us() - task->slice_start_us) >= task->budget_us)
+	{
+		scheduler_yield();
+	}
+}
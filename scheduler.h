@@ -1,10 +1,47 @@
 #ifndef SCHEDULER_H
 #define SCHEDULER_H
 
+#include <inttypes.h>
+#include <stdio.h>
+
 #define USE_SCHEDULER
 
 void scheduler_init(void);
 void scheduler_run(void);
 void scheduler_yield(void);
 
+// Registers a coroutine which calls entry() once per run. A task is due
+// period_us after its last run. Among due tasks the lowest priority value
+// wins, unless another task has been waiting for too long.
+int scheduler_add_task(const char *name, void (*entry)(void), uint32_t period_us, uint32_t budget_us, int priority);
+
+// Stack high-water marks of the tasks (with MISTER_MEM_AUDIT=1 set) and the
+// memory use of the process.
+void scheduler_mem_report(FILE *fp);
+
+// Yields only if the running task has used up its time budget.
+// Call it from long loops which may run inside the UI task.
+void scheduler_yield_budget(void);
+
+// Callbacks on CLOCK_MONOTONIC deadlines with microsecond precision, run
+// right before user_io_poll(). A callback returns the delay until its next
+// run, or 0 to stop. Late runs keep the cadence instead of drifting.
+// Returns the timer id, or -1 if all slots are taken.
+typedef uint32_t (*scheduler_timer_fn)(void);
+int scheduler_timer_add(const char *name, scheduler_timer_fn cb, uint32_t delay_us);
+void scheduler_timer_set(int id, uint32_t delay_us);
+void scheduler_timer_run(void);
+
+// Deadline of the earliest armed timer, 0 if there is none
+uint64_t scheduler_timer_next_us(void);
+
+// Frame times reported by the FPGA (100MHz counters): core and HDMI output.
+// While they match, the HDMI vsync gives the core's frame phase.
+void scheduler_set_frame_time(uint32_t vtime, uint32_t vtimeh);
+
+// Inside the window right before the vsync reserved for the input: bulk
+// SPI work (disk sectors, CD drives, the OSD) should wait for its end.
+int scheduler_input_window(void);
+void scheduler_phase_report(FILE *fp);
+
 #endif
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+#include "sharedir.h"
+#include "file_io.h"
+
+#define SHAREDIR_SIZE 8
+
+struct sharedir_t
+{
+	std::string path;
+	time_t mtime;
+	long mtime_ns;
+	uint32_t last_use;
+	int skip_dots;
+	std::vector<sharedir_item_t> items;
+};
+
+static std::vector<sharedir_t> dir_cache;
+static uint32_t dir_cache_use = 0;
+static int dir_cache_written = 0;
+
+const std::vector<sharedir_item_t> *sharedir_get(const char *path, int skip_dots)
+{
+	struct stat64 *st = getPathStat(path);
+	if (!st || !S_ISDIR(st->st_mode)) return nullptr;
+
+	time_t mtime = st->st_mtim.tv_sec;
+	long mtime_ns = st->st_mtim.tv_nsec;
+
+	sharedir_t *dc = nullptr;
+	for (auto &item : dir_cache)
+	{
+		if (item.path == path)
+		{
+			dc = &item;
+			break;
+		}
+	}
+
+	if (dc && dc->mtime == mtime && dc->mtime_ns == mtime_ns && dc->skip_dots == skip_dots)
+	{
+		dc->last_use = ++dir_cache_use;
+		return &dc->items;
+	}
+
+	const char* full_path = getFullPath(path);
+	DIR *d = opendir(full_path);
+	if (!d)
+	{
+		printf("Couldn't open dir: %s\n", full_path);
+		return nullptr;
+	}
+
+	if (!dc)
+	{
+		if (dir_cache.size() < SHAREDIR_SIZE)
+		{
+			dir_cache.emplace_back();
+			dc = &dir_cache.back();
+		}
+		else
+		{
+			dc = &dir_cache[0];
+			for (auto &item : dir_cache) if (item.last_use < dc->last_use) dc = &item;
+		}
+	}
+
+	static char str[1024];
+	dc->path = path;
+	dc->mtime = mtime;
+	dc->mtime_ns = mtime_ns;
+	dc->last_use = ++dir_cache_use;
+	dc->skip_dots = skip_dots;
+	dc->items.clear();
+
+	struct dirent64 *de;
+	while ((de = readdir64(d)))
+	{
+		if (skip_dots && (!strcmp(de->d_name, "..") || !strcmp(de->d_name, "."))) continue;
+
+		snprintf(str, sizeof(str), "%s/%s", path, de->d_name);
+		st = getPathStat(str);
+		if (st) dc->items.push_back({ *de, *st });
+	}
+	closedir(d);
+
+	return &dc->items;
+}
+
+void sharedir_drop()
+{
+	dir_cache.clear();
+}
+
+void sharedir_written()
+{
+	dir_cache_written = 1;
+}
+
+void sharedir_close()
+{
+	if (dir_cache_written) dir_cache.clear();
+	dir_cache_written = 0;
+}
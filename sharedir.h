@@ -0,0 +1,27 @@
+#ifndef SHAREDIR_H
+#define SHAREDIR_H
+
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Listings of the shared folders (minimig and x86 shares) with the stat of
+// every entry. A listing is reused while the folder mtime doesn't change,
+// writes through the share drop all of them since a new file size doesn't
+// touch the folder. Main thread only.
+
+struct sharedir_item_t
+{
+	dirent64 de;
+	struct stat64 st;
+};
+
+// Listing of a path relative to the storage root, null if it's no folder.
+// The entries stay valid until the next call.
+const std::vector<sharedir_item_t> *sharedir_get(const char *path, int skip_dots);
+
+void sharedir_drop();     // the share changed a folder
+void sharedir_written();  // file data written, dropped by the next sharedir_close()
+void sharedir_close();
+
+#endif
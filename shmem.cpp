@@ -10,24 +10,50 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "shmem.h"
 
-static int memfd = -1;
+#define SHMEM_CACHE_SIZE 8
 
-void *shmem_map(uint32_t address, uint32_t size)
+// larger windows are still tracked while acquired, but unmapped on release
+#define SHMEM_CACHE_MAX_WINDOW (4 * 1024 * 1024)
+
+static int memfd[2] = { -1, -1 };
+
+struct shmem_window
+{
+	uint32_t base;  // page aligned physical range
+	uint32_t size;
+	int flags;
+	uint8_t *map;
+	int refs;
+	uint32_t last_use;
+};
+
+static shmem_window windows[SHMEM_CACHE_SIZE];
+static uint32_t use_counter = 0;
+static pthread_mutex_t windows_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *map_fd(uint32_t address, uint32_t size, int flags)
 {
-	if (memfd < 0)
+#ifdef FPGA_SIM
+	// no FPGA behind the bridge, every window is plain memory
+	(void)flags;
+	void *res = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+#else
+	if (memfd[flags] < 0)
 	{
-		memfd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
-		if (memfd == -1)
+		memfd[flags] = open("/dev/mem", O_RDWR | O_CLOEXEC | ((flags == SHMEM_UNCACHED) ? O_SYNC : 0));
+		if (memfd[flags] == -1)
 		{
 			printf("Error: Unable to open /dev/mem!\n");
 			return 0;
 		}
 	}
 
-	void *res = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, address);
+	void *res = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd[flags], address);
+#endif
 	if (res == (void *)-1)
 	{
 		printf("Error: Unable to mmap (0x%X, %d)!\n", address, size);
@@ -37,24 +63,106 @@ void *shmem_map(uint32_t address, uint32_t size)
 	return res;
 }
 
+void *shmem_map(uint32_t address, uint32_t size)
+{
+	return map_fd(address, size, SHMEM_UNCACHED);
+}
+
 int shmem_unmap(void* map, uint32_t size)
 {
 	if (munmap(map, size) < 0)
 	{
-		printf("Error: Unable to unmap(0x%X, %d)!\n", (uint32_t)map, size);
+		printf("Error: Unable to unmap(%p, %d)!\n", map, size);
 		return 0;
 	}
 
 	return 1;
 }
 
+void *shmem_acquire(uint32_t address, uint32_t size, int flags)
+{
+	flags = flags ? SHMEM_CACHED : SHMEM_UNCACHED;
+
+	uint32_t page = (uint32_t)sysconf(_SC_PAGESIZE);
+	uint32_t base = address & ~(page - 1);
+	uint32_t end = (address + size + page - 1) & ~(page - 1);
+
+	pthread_mutex_lock(&windows_lock);
+
+	shmem_window *win = 0;
+	shmem_window *victim = 0;
+	for (int i = 0; i < SHMEM_CACHE_SIZE; i++)
+	{
+		shmem_window *w = &windows[i];
+		if (w->map && w->flags == flags && base >= w->base && end <= w->base + w->size)
+		{
+			win = w;
+			break;
+		}
+
+		if (w->refs) continue;
+		if (!victim || !w->map || (victim->map && w->last_use < victim->last_use)) victim = w;
+	}
+
+	if (!win)
+	{
+		if (!victim)
+		{
+			pthread_mutex_unlock(&windows_lock);
+			printf("Error: shmem window cache is exhausted (0x%X, %d)!\n", address, size);
+			return 0;
+		}
+
+		if (victim->map) shmem_unmap(victim->map, victim->size);
+		victim->map = (uint8_t*)map_fd(base, end - base, flags);
+		if (!victim->map)
+		{
+			pthread_mutex_unlock(&windows_lock);
+			return 0;
+		}
+
+		victim->base = base;
+		victim->size = end - base;
+		victim->flags = flags;
+		win = victim;
+	}
+
+	win->refs++;
+	win->last_use = ++use_counter;
+	pthread_mutex_unlock(&windows_lock);
+
+	return win->map + (address - win->base);
+}
+
+void shmem_release(void *ptr)
+{
+	if (!ptr) return;
+
+	pthread_mutex_lock(&windows_lock);
+	for (int i = 0; i < SHMEM_CACHE_SIZE; i++)
+	{
+		shmem_window *w = &windows[i];
+		if (w->refs && (uint8_t*)ptr >= w->map && (uint8_t*)ptr < w->map + w->size)
+		{
+			w->refs--;
+			if (!w->refs && w->size > SHMEM_CACHE_MAX_WINDOW)
+			{
+				shmem_unmap(w->map, w->size);
+				w->map = 0;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&windows_lock);
+}
+
 int shmem_put(uint32_t address, uint32_t size, void *buf)
 {
-	void *shmem = shmem_map(address, size);
+	void *shmem = shmem_acquire(address, size);
 	if (shmem)
 	{
 		memcpy(shmem, buf, size);
-		shmem_unmap(shmem, size);
+		shmem_release(shmem);
 	}
 
 	return shmem != 0;
@@ -62,11 +170,11 @@ int shmem_put(uint32_t address, uint32_t size, void *buf)
 
 int shmem_get(uint32_t address, uint32_t size, void *buf)
 {
-	void *shmem = shmem_map(address, size);
+	void *shmem = shmem_acquire(address, size);
 	if (shmem)
 	{
 		memcpy(buf, shmem, size);
-		shmem_unmap(shmem, size);
+		shmem_release(shmem);
 	}
 
 	return shmem != 0;
@@ -1,4 +1,3 @@
-
 #include <stdint.h>
 
 #ifndef SHMEM_H
@@ -9,5 +8,15 @@ int shmem_unmap(void* map, uint32_t size);
 int shmem_put(uint32_t address, uint32_t size, void *buf);
 int shmem_get(uint32_t address, uint32_t size, void *buf);
 
+// Cached windows. A released window stays mapped until it is evicted in LRU
+// order, so repeated access to the same region costs no mmap/munmap.
+// Every shmem_acquire() must be paired with shmem_release().
+#define SHMEM_UNCACHED 0  // O_SYNC mapping, always coherent with the FPGA
+#define SHMEM_CACHED   1  // CPU cached where the kernel allows it, use only for
+                          // regions the FPGA doesn't touch while mapped
+
+void *shmem_acquire(uint32_t address, uint32_t size, int flags = SHMEM_UNCACHED);
+void shmem_release(void *ptr);
+
 #define fpga_mem(x) (0x20000000 | ((x) & 0x1FFFFFFF))
 #endif
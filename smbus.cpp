@@ -24,8 +24,11 @@
 #include "smbus.h"
 
 #define I2C_SLAVE                   0x0703
+#define I2C_RDWR                    0x0707	/* Combined R/W transfer */
 #define I2C_SMBUS                   0x0720	/* SMBus-level access */
 
+#define I2C_RDWR_MAX_MSGS           42	/* kernel limit per transfer */
+
 #define I2C_SMBUS_READ              1
 #define I2C_SMBUS_WRITE	            0
 
@@ -58,6 +61,20 @@ struct i2c_smbus_ioctl_data
 	union i2c_smbus_data *data;
 };
 
+struct i2c_msg
+{
+	uint16_t addr;
+	uint16_t flags;
+	uint16_t len;
+	uint8_t *buf;
+};
+
+struct i2c_rdwr_ioctl_data
+{
+	struct i2c_msg *msgs;
+	uint32_t nmsgs;
+};
+
 static int i2c_smbus_access(int file, char read_write, uint8_t command,
 		       int size, union i2c_smbus_data *data)
 {
@@ -260,3 +277,118 @@ void i2c_close(int fd)
 {
 	if (fd >= 0) close(fd);
 }
+
+// Devices stay open for the lifetime of the process. The last value
+// written to every register is kept, so rewriting a whole table only sends
+// what changed.
+#define I2C_DEV_MAX 4
+
+struct i2c_dev_t
+{
+	int addr;
+	int fd;
+	uint8_t known[32];  // bitmap of the registers with a valid shadow
+	uint8_t regs[256];
+};
+
+static i2c_dev_t i2c_devs[I2C_DEV_MAX];
+static int i2c_dev_num = 0;
+
+static i2c_dev_t *i2c_dev_get(int dev_address)
+{
+	i2c_dev_t *dev = nullptr;
+	for (int i = 0; i < i2c_dev_num; i++)
+	{
+		if (i2c_devs[i].addr == dev_address) dev = &i2c_devs[i];
+	}
+
+	if (!dev)
+	{
+		if (i2c_dev_num >= I2C_DEV_MAX) return nullptr;
+
+		dev = &i2c_devs[i2c_dev_num++];
+		memset(dev, 0, sizeof(i2c_dev_t));
+		dev->addr = dev_address;
+		dev->fd = -1;
+	}
+
+	// a missing device is looked for again next time
+	if (dev->fd < 0) dev->fd = i2c_open(dev_address, 0);
+	return (dev->fd < 0) ? nullptr : dev;
+}
+
+int i2c_dev_fd(int dev_address)
+{
+	i2c_dev_t *dev = i2c_dev_get(dev_address);
+	return dev ? dev->fd : -1;
+}
+
+int i2c_dev_read(int dev_address, uint8_t reg)
+{
+	i2c_dev_t *dev = i2c_dev_get(dev_address);
+	return dev ? i2c_smbus_read_byte_data(dev->fd, reg) : -ENODEV;
+}
+
+int i2c_dev_write(int dev_address, uint8_t reg, uint8_t value)
+{
+	uint8_t data[2] = { reg, value };
+	return i2c_dev_write_regs(dev_address, data, sizeof(data));
+}
+
+static void i2c_dev_store(i2c_dev_t *dev, uint8_t reg, uint8_t value)
+{
+	dev->regs[reg] = value;
+	dev->known[reg >> 3] |= 1 << (reg & 7);
+}
+
+int i2c_dev_write_regs(int dev_address, const uint8_t *data, int len)
+{
+	i2c_dev_t *dev = i2c_dev_get(dev_address);
+	if (!dev) return -ENODEV;
+
+	struct i2c_msg msgs[I2C_RDWR_MAX_MSGS];
+	uint8_t bufs[I2C_RDWR_MAX_MSGS][2];
+	int failed = 0;
+
+	for (int i = 0; i + 1 < len;)
+	{
+		int num = 0;
+		for (; i + 1 < len && num < I2C_RDWR_MAX_MSGS; i += 2)
+		{
+			uint8_t reg = data[i];
+			uint8_t value = data[i + 1];
+			if ((dev->known[reg >> 3] & (1 << (reg & 7))) && dev->regs[reg] == value) continue;
+
+			bufs[num][0] = reg;
+			bufs[num][1] = value;
+			msgs[num].addr = dev->addr;
+			msgs[num].flags = 0;
+			msgs[num].len = 2;
+			msgs[num].buf = bufs[num];
+			num++;
+		}
+
+		if (!num) break;
+
+		struct i2c_rdwr_ioctl_data rdwr = { msgs, (uint32_t)num };
+		if (ioctl(dev->fd, I2C_RDWR, &rdwr) == num)
+		{
+			for (int n = 0; n < num; n++) i2c_dev_store(dev, bufs[n][0], bufs[n][1]);
+			continue;
+		}
+
+		// the adapter may not take combined transfers, go one by one
+		for (int n = 0; n < num; n++)
+		{
+			int res = i2c_smbus_write_byte_data(dev->fd, bufs[n][0], bufs[n][1]);
+			if (res >= 0) i2c_dev_store(dev, bufs[n][0], bufs[n][1]);
+			else
+			{
+				printf("i2c: write error (%02X: %02X %02X): %d\n", dev->addr, bufs[n][0], bufs[n][1], res);
+				failed++;
+			}
+		}
+	}
+
+	return failed ? -EIO : 0;
+}
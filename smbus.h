@@ -6,6 +6,16 @@
 int i2c_open(int dev_address, int is_smbus);
 void i2c_close(int fd);
 
+// Persistent devices: opened once and kept open. Writes go through a
+// register shadow and registers already holding the value are skipped.
+int i2c_dev_fd(int dev_address);
+int i2c_dev_read(int dev_address, uint8_t reg);
+int i2c_dev_write(int dev_address, uint8_t reg, uint8_t value);
+
+// Writes (register, value) pairs, len is in bytes. The changed ones are
+// sent as combined I2C_RDWR transfers. Returns 0 or a negative error.
+int i2c_dev_write_regs(int dev_address, const uint8_t *data, int len);
+
 int i2c_smbus_write_quick(int file, uint8_t value);
 int i2c_smbus_read_byte(int file);
 int i2c_smbus_write_byte(int file, uint8_t value);
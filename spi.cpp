@@ -1,6 +1,9 @@
+#include <stdio.h>
+#include <string.h>
 #include "spi.h"
 #include "hardware.h"
 #include "fpga_io.h"
+#include "profiling.h"
 
 #define SSPI_FPGA_EN (1<<18)
 #define SSPI_OSD_EN  (1<<19)
@@ -8,13 +11,120 @@
 
 #define SWAPW(a) ((((a)<<8)&0xff00)|(((a)>>8)&0x00ff))
 
+// Transactions, bus words and chip select time per select and command
+// (the first word after the select). Off until spi_stats_enable(1).
+enum
+{
+	SPI_CS_IO,
+	SPI_CS_OSD,
+	SPI_CS_FPGA,
+	SPI_CS_NUM
+};
+
+#define SPI_CMD_NONE 256
+
+struct spi_stat_t
+{
+	uint32_t count;
+	uint64_t words;
+	uint64_t us;
+};
+
+static spi_stat_t spi_stats[SPI_CS_NUM][SPI_CMD_NONE + 1];
+static int spi_stats_on = 0;
+static int spi_stats_cs = -1;
+static uint32_t spi_stats_words;
+static uint64_t spi_stats_start;
+
+static void spi_stats_begin(int cs)
+{
+	if (!spi_stats_on || spi_stats_cs >= 0) return;
+
+	spi_stats_cs = cs;
+	spi_stats_words = fpga_spi_words;
+	fpga_spi_first = -1;
+	spi_stats_start = profiling_time_us();
+}
+
+static void spi_stats_end(int cs)
+{
+	if (spi_stats_cs != cs) return;
+
+	spi_stat_t *stat = &spi_stats[cs][(fpga_spi_first < 0) ? SPI_CMD_NONE : (fpga_spi_first & 0xFF)];
+	stat->count++;
+	stat->words += fpga_spi_words - spi_stats_words;
+	stat->us += profiling_time_us() - spi_stats_start;
+	spi_stats_cs = -1;
+}
+
+void spi_stats_enable(int on)
+{
+	spi_stats_on = on;
+	spi_stats_cs = -1;
+}
+
+void spi_stats_reset()
+{
+	memset(spi_stats, 0, sizeof(spi_stats));
+	spi_stats_cs = -1;
+}
+
+#define SPI_BATCH_MAX   32
+#define SPI_BATCH_WORDS 4
+
+struct spi_batch_cmd_t
+{
+	uint16_t cmd;
+	uint16_t key;
+	uint16_t count;
+	uint16_t words[SPI_BATCH_WORDS];
+};
+
+static spi_batch_cmd_t batch[SPI_BATCH_MAX];
+static int batch_num = 0;
+static int batch_depth = 0;
+static uint32_t batch_sent = 0;
+static uint32_t batch_merged = 0;
+
+void spi_stats_report(FILE *fp)
+{
+	static const char *cs_names[SPI_CS_NUM] = { "io", "osd", "fpga" };
+
+	uint64_t total = 0;
+	for (int cs = 0; cs < SPI_CS_NUM; cs++)
+		for (int cmd = 0; cmd <= SPI_CMD_NONE; cmd++) total += spi_stats[cs][cmd].us;
+
+	fprintf(fp, "SPI statistics %s\n", spi_stats_on ? "(running)" : "(stopped)");
+	fprintf(fp, "+-- CS -+ Cmd -+------ Count +------- Words +------ Time(us) +- Share +\n");
+	for (int cs = 0; cs < SPI_CS_NUM; cs++)
+	{
+		for (int cmd = 0; cmd <= SPI_CMD_NONE; cmd++)
+		{
+			const spi_stat_t *stat = &spi_stats[cs][cmd];
+			if (!stat->count) continue;
+
+			char name[8];
+			if (cmd == SPI_CMD_NONE) strcpy(name, "-");
+			else sprintf(name, "%02X", cmd);
+
+			fprintf(fp, "| %-5s | %4s | %12u | %13llu | %14llu | %5.1f%% |\n", cs_names[cs], name, stat->count,
+				stat->words, stat->us, total ? (stat->us * 100.0 / total) : 0.0);
+		}
+	}
+	fprintf(fp, "+-------+------+--------------+---------------+----------------+--------+\n");
+	fprintf(fp, "batched: %u commands sent, %u merged into later ones\n", batch_sent, batch_merged);
+	fflush(fp);
+}
+
 void EnableFpga()
 {
 	fpga_spi_en(SSPI_FPGA_EN, 1);
+	spi_stats_begin(SPI_CS_FPGA);
 }
 
 void DisableFpga()
 {
+	spi_stats_end(SPI_CS_FPGA);
 	fpga_spi_en(SSPI_FPGA_EN, 0);
 }
 
@@ -35,20 +145,24 @@ void EnableOsd()
 	if (osd_target & OSD_VGA) mask &= ~SSPI_IO_EN;
 
 	fpga_spi_en(mask, 1);
+	spi_stats_begin(SPI_CS_OSD);
 }
 
 void DisableOsd()
 {
+	spi_stats_end(SPI_CS_OSD);
 	fpga_spi_en(SSPI_OSD_EN | SSPI_IO_EN | SSPI_FPGA_EN, 0);
 }
 
 void EnableIO()
 {
 	fpga_spi_en(SSPI_IO_EN, 1);
+	spi_stats_begin(SPI_CS_IO);
 }
 
 void DisableIO()
 {
+	spi_stats_end(SPI_CS_IO);
 	fpga_spi_en(SSPI_IO_EN, 0);
 }
 
@@ -157,6 +271,60 @@ void spi_uio_cmd32(uint8_t cmd, uint32_t parm, int wide)
 	DisableIO();
 }
 
+static void spi_batch_flush()
+{
+	for (int i = 0; i < batch_num; i++)
+	{
+		const spi_batch_cmd_t *c = &batch[i];
+		EnableIO();
+		spi_w(c->cmd);
+		for (int n = 0; n < c->count; n++) spi_w(c->words[n]);
+		DisableIO();
+	}
+
+	batch_sent += batch_num;
+	batch_num = 0;
+}
+
+void spi_batch_begin()
+{
+	batch_depth++;
+}
+
+void spi_batch_end()
+{
+	if (batch_depth > 0 && --batch_depth) return;
+	spi_batch_flush();
+}
+
+int spi_batch_add(uint16_t cmd, uint16_t key, const uint16_t *words, int count)
+{
+	if (!batch_depth || count > SPI_BATCH_WORDS) return 0;
+
+	spi_batch_cmd_t *c = NULL;
+	for (int i = 0; i < batch_num; i++)
+	{
+		if (batch[i].cmd == cmd && batch[i].key == key)
+		{
+			c = &batch[i];
+			batch_merged++;
+			break;
+		}
+	}
+
+	if (!c)
+	{
+		if (batch_num >= SPI_BATCH_MAX) spi_batch_flush();
+		c = &batch[batch_num++];
+		c->cmd = cmd;
+		c->key = key;
+	}
+
+	c->count = count;
+	memcpy(c->words, words, count * sizeof(uint16_t));
+	return 1;
+}
+
 void spi_n(uint8_t value, uint16_t cnt)
 {
 	while (cnt--) spi_b(value);
@@ -2,6 +2,7 @@
 #define SPI_H
 
 #include <inttypes.h>
+#include <stdio.h>
 #include "fpga_io.h"
 
 #define OSD_HDMI 1
@@ -60,4 +61,26 @@ uint16_t spi_uio_cmd16(uint8_t cmd, uint16_t parm);
 void spi_uio_cmd32(uint8_t cmd, uint32_t parm, int wide);
 void spi_uio_cmd32_cont(uint8_t cmd, uint32_t parm);
 
+/* Command batches. Write only UIO commands added while a batch is open go
+   out back to back when the outermost batch ends. A command added again
+   with the same opcode and key replaces the pending one, so a burst of
+   updates of one state (a stick moving over several events) costs one
+   transaction. spi_batch_add returns 0 with no batch open, the caller then
+   sends the command itself. The cores have no multi command opcode, so
+   every command still gets its own chip select window. */
+void spi_batch_begin();
+void spi_batch_end();
+int  spi_batch_add(uint16_t cmd, uint16_t key, const uint16_t *words, int count);
+
+struct SpiBatch
+{
+	SpiBatch() { spi_batch_begin(); }
+	~SpiBatch() { spi_batch_end(); }
+};
+
+/* Per command transaction, bus word and chip select time accounting */
+void spi_stats_enable(int on);
+void spi_stats_reset();
+void spi_stats_report(FILE *fp);
+
 #endif // SPI_H
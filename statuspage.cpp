@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "user_io.h"
+#include "input.h"
+#include "video.h"
+#include "fpga_io.h"
+#include "blockdev.h"
+#include "scheduler.h"
+#include "profiling.h"
+#include "launch.h"
+#include "statuspage.h"
+
+#define STATUS_PERIOD_US 100000
+
+static status_page_t *page = nullptr;
+
+static void copy_str(char *dst, const char *src, size_t size)
+{
+	snprintf(dst, size, "%s", src ? src : "");
+}
+
+static uint32_t statuspage_update()
+{
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	page->update_us = profiling_time_us();
+	copy_str(page->core_name, user_io_get_core_name(), sizeof(page->core_name));
+	copy_str(page->core_path, get_rbf_path(), sizeof(page->core_path));
+	copy_str(page->file_name, user_io_get_filename(), sizeof(page->file_name));
+
+	VideoInfo vi;
+	video_get_info(&vi);
+	page->width = vi.width;
+	page->height = vi.height;
+	page->htime = vi.htime;
+	page->vtime = vi.vtime;
+	page->vtimeh = vi.vtimeh;
+	page->ptime = vi.ptime;
+	page->ctime = vi.ctime;
+	page->pixrep = vi.pixrep;
+	page->interlaced = vi.interlaced;
+	page->rotated = vi.rotated;
+
+	uint32_t n = 0;
+	for (int dev = 0; dev < STATUS_INPUTS; dev++)
+	{
+		uint16_t vid, pid;
+		const char *name;
+		if (!input_dev_info(dev, &vid, &pid, &name)) continue;
+
+		page->inputs[n].vid = vid;
+		page->inputs[n].pid = pid;
+		copy_str(page->inputs[n].name, name, sizeof(page->inputs[n].name));
+		n++;
+	}
+	page->input_num = n;
+
+	blockdev_stats_t bc;
+	blockdev_get_stats(&bc);
+	page->spi_words = fpga_spi_words;
+	page->disk_reads = bc.reads;
+	page->disk_read_bytes = bc.read_bytes;
+	page->disk_writes = bc.writes;
+	page->disk_write_bytes = bc.write_bytes;
+
+	for (n = 0; n < STATUS_HISTS; n++)
+	{
+		status_hist_t *h = &page->hists[n];
+		const char *name;
+		if (!profiling_hist_get(n, &name, &h->count, &h->p50_us, &h->p99_us, &h->max_us)) break;
+		copy_str(h->name, name, sizeof(h->name));
+	}
+	page->hist_num = n;
+
+	static_assert(STATUS_LAUNCH_PHASES == LAUNCH_PHASES, "status page launch phases");
+	for (n = 0; n < STATUS_LAUNCHES; n++)
+	{
+		status_launch_t *l = &page->launches[n];
+		const char *name;
+		if (!launch_get(n, &name, &l->count, &l->last_us, l->avg_us)) break;
+		copy_str(l->core, name, sizeof(l->core));
+	}
+	page->launch_num = n;
+
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+	return STATUS_PERIOD_US;
+}
+
+void statuspage_init()
+{
+	if (page) return;
+
+	// kept at its size across restarts, a truncate would fault the readers
+	// which have it mapped
+	int fd = open(STATUS_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || ftruncate(fd, sizeof(status_page_t)))
+	{
+		printf("statuspage: can't create %s: %s\n", STATUS_FILE, strerror(errno));
+		if (fd >= 0) close(fd);
+		return;
+	}
+
+	void *map = mmap(nullptr, sizeof(status_page_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		printf("statuspage: can't map %s\n", STATUS_FILE);
+		unlink(STATUS_FILE);
+		return;
+	}
+
+	page = (status_page_t *)map;
+	page->version = STATUS_VERSION;
+	page->size = sizeof(status_page_t);
+	__atomic_store_n(&page->magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+
+	// first update once input_poll has set up the device slots
+	scheduler_timer_add("statuspage", statuspage_update, STATUS_PERIOD_US);
+}
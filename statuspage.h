@@ -0,0 +1,90 @@
+#ifndef STATUSPAGE_H
+#define STATUSPAGE_H
+
+#include <inttypes.h>
+
+// Status of the running core published in shared memory, so monitoring
+// tools can poll it without syscalls or touching MiSTer_cmd.
+//
+// Reader side: mmap STATUS_FILE read only, check magic and version, then
+// read seq, copy the page and re-read seq. The copy is valid if seq was
+// even and didn't change. New fields are only added at the end, with the
+// version bumped; size is the size of the page as written.
+#define STATUS_FILE    "/dev/shm/MiSTer_status"
+#define STATUS_MAGIC   0x5453534D // "MSST"
+#define STATUS_VERSION 2
+#define STATUS_INPUTS  32
+#define STATUS_HISTS   32
+#define STATUS_LAUNCHES 16
+#define STATUS_LAUNCH_PHASES 8  // resolve, core, open, read, convert, transfer, post, release
+
+struct status_input_t
+{
+	uint16_t vid;
+	uint16_t pid;
+	char name[128];
+};
+
+struct status_hist_t
+{
+	char name[32];
+	uint32_t count;
+	uint32_t p50_us;
+	uint32_t p99_us;
+	uint32_t max_us;
+};
+
+// launch latency of a core, averaged over its last launches
+struct status_launch_t
+{
+	char core[32];
+	uint32_t count;
+	uint32_t last_us;
+	uint32_t avg_us[STATUS_LAUNCH_PHASES];
+};
+
+struct status_page_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	uint32_t seq;           // odd while the page is written
+	uint64_t update_us;     // CLOCK_MONOTONIC
+
+	char core_name[32];
+	char core_path[1024];
+	char file_name[1024];   // last loaded file, without path and extension
+
+	// video mode as reported by the FPGA, times in 100MHz ticks
+	uint32_t width;
+	uint32_t height;
+	uint32_t htime;
+	uint32_t vtime;
+	uint32_t vtimeh;
+	uint32_t ptime;
+	uint32_t ctime;
+	uint32_t pixrep;
+	uint32_t interlaced;
+	uint32_t rotated;
+
+	uint32_t input_num;
+	status_input_t inputs[STATUS_INPUTS];
+
+	uint64_t spi_words;     // 16 bit words moved over the FPGA bus (wraps at 32 bits)
+	uint64_t disk_reads;
+	uint64_t disk_read_bytes;
+	uint64_t disk_writes;
+	uint64_t disk_write_bytes;
+
+	uint32_t hist_num;
+	status_hist_t hists[STATUS_HISTS];
+
+	// version 2
+	uint32_t launch_num;
+	status_launch_t launches[STATUS_LAUNCHES];
+};
+
+// Creates the page and updates it every 100ms from the main loop.
+void statuspage_init();
+
+#endif
@@ -26,10 +26,12 @@
 // NeoGeo  support
 #include "support/neogeo/neogeo_loader.h"
 #include "support/neogeo/neogeocd.h"
+#include "support/neogeo/neogeo_convert.h"
 
 
 // Arcade support
 #include "support/arcade/mra_loader.h"
+#include "support/arcade/mra_index.h"
 
 // MEGACD  support
 #include "support/megacd/megacd.h"
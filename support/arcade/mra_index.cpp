@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <atomic>
+
+#include "../../sxmlc.h"
+#include "../../file_io.h"
+#include "../../offload.h"
+#include "mra_index.h"
+
+// One index per top level folder, built by a job on the offload pool or
+// record by record when an MRA is looked up. Both replace or extend the
+// published index under index_lock only.
+#define MRAINDEX_DIR   "/tmp/mraindex"
+#define MRAINDEX_MAGIC 0x4D524901
+#define MRAINDEX_DEPTH 3
+
+struct mraindex_rec_t
+{
+	uint32_t path;   // full path
+	int64_t mtime;
+	int64_t size;
+	uint32_t name;
+	uint32_t setname;
+	uint32_t rbf;
+	uint32_t year;
+	uint32_t manufacturer;
+	uint32_t zips;
+	int8_t has_setname;
+	int8_t same_dir;
+	int8_t rotation;
+};
+
+struct mraindex_hdr_t
+{
+	uint32_t magic;
+	char root[1024];
+	uint32_t count;
+	uint32_t names_size;
+};
+
+struct mraindex_t
+{
+	char root[1024];
+	std::vector<mraindex_rec_t> recs; // sorted by path
+	std::vector<char> names;
+};
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static mraindex_t *index_cur = nullptr;
+
+// main thread side
+static char build_root[1024] = {};
+static int64_t build_mtime = 0;
+static offload_job_t build_job = 0;
+
+static uint32_t meta_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+	for (const char *p = str; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	return hash;
+}
+
+static int64_t meta_stat(const char *path, int64_t *size)
+{
+	struct stat64 st;
+	if (stat64(path, &st)) return -1;
+	if (size) *size = st.st_size;
+	return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+// the "_" folder below the root holding path, or the folder of path itself
+static void meta_root(const char *path, int is_dir, char *root, size_t len)
+{
+	snprintf(root, len, "%s", path);
+	char *p = strstr(root, "/_");
+	if (p) p = strchr(p + 1, '/');
+
+	if (p) *p = 0;
+	else if (!is_dir && (p = strrchr(root, '/'))) *p = 0;
+}
+
+static uint32_t meta_add_name(mraindex_t *idx, const char *name)
+{
+	uint32_t pos = idx->names.size();
+	idx->names.insert(idx->names.end(), name, name + strlen(name) + 1);
+	return pos;
+}
+
+static const char *meta_name(const mraindex_t *idx, uint32_t pos)
+{
+	return idx->names.data() + pos;
+}
+
+static int meta_find(const mraindex_t *idx, const char *path)
+{
+	int lo = 0, hi = (int)idx->recs.size() - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		int cmp = strcmp(meta_name(idx, idx->recs[mid].path), path);
+		if (!cmp) return mid;
+		if (cmp < 0) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return -1;
+}
+
+static void meta_sort(mraindex_t *idx)
+{
+	const char *names = idx->names.data();
+	std::sort(idx->recs.begin(), idx->recs.end(), [names](const mraindex_rec_t &a, const mraindex_rec_t &b) {
+		return strcmp(names + a.path, names + b.path) < 0;
+	});
+}
+
+enum { META_NONE = 0, META_NAME, META_SETNAME, META_ROTATION, META_RBF, META_YEAR, META_MANUFACTURER };
+
+struct meta_parse_t
+{
+	mra_meta_t *meta;
+	int tag;
+	int same_dir;
+	int found_setname;
+	int found_rotation;
+	int pre_done; // setname and rotation are taken as arcade_pre_parse did
+};
+
+static void meta_add_zips(mra_meta_t *meta, const char *zips)
+{
+	char list[1024];
+	snprintf(list, sizeof(list), "%s", zips);
+
+	char *ptr = list, *zip;
+	while ((zip = strsep(&ptr, "|")) != NULL)
+	{
+		if (!zip[0]) continue;
+
+		char item[1030];
+		snprintf(item, sizeof(item), "|%s|", zip);
+		char all[1030];
+		snprintf(all, sizeof(all), "|%s|", meta->zips);
+		if (strcasestr(all, item)) continue;
+
+		size_t len = strlen(meta->zips);
+		snprintf(meta->zips + len, sizeof(meta->zips) - len, "%s%s", len ? "|" : "", zip);
+	}
+}
+
+static int meta_scan(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+{
+	meta_parse_t *mp = (meta_parse_t *)sd->user;
+	mra_meta_t *meta = mp->meta;
+
+	switch (evt)
+	{
+	case XML_EVENT_START_NODE:
+		mp->tag = META_NONE;
+		if (!strcasecmp(node->tag, "setname"))
+		{
+			mp->tag = META_SETNAME;
+			mp->found_setname = 1;
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				if (!strcasecmp(node->attributes[i].name, "same_dir") && !strcmp(node->attributes[i].value, "1")) mp->same_dir = 1;
+			}
+		}
+		else if (!strcasecmp(node->tag, "rotation"))
+		{
+			mp->tag = META_ROTATION;
+			mp->found_rotation = 1;
+		}
+		else if (!strcasecmp(node->tag, "rbf")) mp->tag = META_RBF;
+		else if (!strcasecmp(node->tag, "name")) mp->tag = META_NAME;
+		else if (!strcasecmp(node->tag, "year")) mp->tag = META_YEAR;
+		else if (!strcasecmp(node->tag, "manufacturer")) mp->tag = META_MANUFACTURER;
+		else if (!strcasecmp(node->tag, "rom"))
+		{
+			int index = 0;
+			const char *zip = NULL;
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				if (!strcasecmp(node->attributes[i].name, "index")) index = atoi(node->attributes[i].value);
+				if (!strcasecmp(node->attributes[i].name, "zip")) zip = node->attributes[i].value;
+			}
+			if (!index && zip) meta_add_zips(meta, zip);
+		}
+		break;
+
+	case XML_EVENT_TEXT:
+		switch (mp->tag)
+		{
+		case META_SETNAME:
+			if (!mp->pre_done)
+			{
+				snprintf(meta->setname, sizeof(meta->setname), "%s", text);
+				meta->has_setname = 1;
+				meta->same_dir = mp->same_dir;
+			}
+			break;
+
+		case META_ROTATION:
+			if (!mp->pre_done) meta->rotation = strncasecmp(text, "vertical", 8) == 0;
+			break;
+
+		case META_RBF:
+			// only the first text of a node, as xml_scan_rbf
+			snprintf(meta->rbf, sizeof(meta->rbf), "%s", text);
+			mp->tag = META_NONE;
+			break;
+
+		case META_NAME:
+			if (!meta->name[0]) snprintf(meta->name, sizeof(meta->name), "%s", text);
+			break;
+
+		case META_YEAR:
+			if (!meta->year[0]) snprintf(meta->year, sizeof(meta->year), "%s", text);
+			break;
+
+		case META_MANUFACTURER:
+			if (!meta->manufacturer[0]) snprintf(meta->manufacturer, sizeof(meta->manufacturer), "%s", text);
+			break;
+		}
+		break;
+
+	case XML_EVENT_END_NODE:
+		mp->tag = META_NONE;
+		if (mp->found_rotation && mp->found_setname) mp->pre_done = 1;
+		break;
+
+	case XML_EVENT_ERROR:
+		printf("XML parse: %s: ERROR %d\n", text, n);
+		break;
+	default:
+		break;
+	}
+
+	return true;
+}
+
+static int meta_parse(const char *path, mra_meta_t *meta)
+{
+	memset(meta, 0, sizeof(mra_meta_t));
+	meta->rotation = -1;
+
+	meta_parse_t mp = {};
+	mp.meta = meta;
+
+	SAX_Callbacks sax;
+	SAX_Callbacks_init(&sax);
+	sax.all_event = meta_scan;
+	return XMLDoc_parse_file_SAX(path, &sax, &mp);
+}
+
+static void meta_add(mraindex_t *idx, const char *path, int64_t mtime, int64_t size, const mra_meta_t *meta)
+{
+	mraindex_rec_t rec = {};
+	rec.path = meta_add_name(idx, path);
+	rec.mtime = mtime;
+	rec.size = size;
+	rec.name = meta_add_name(idx, meta->name);
+	rec.setname = meta_add_name(idx, meta->setname);
+	rec.rbf = meta_add_name(idx, meta->rbf);
+	rec.year = meta_add_name(idx, meta->year);
+	rec.manufacturer = meta_add_name(idx, meta->manufacturer);
+	rec.zips = meta_add_name(idx, meta->zips);
+	rec.has_setname = meta->has_setname;
+	rec.same_dir = meta->same_dir;
+	rec.rotation = meta->rotation;
+	idx->recs.push_back(rec);
+}
+
+static void meta_get(const mraindex_t *idx, const mraindex_rec_t *rec, mra_meta_t *meta)
+{
+	snprintf(meta->name, sizeof(meta->name), "%s", meta_name(idx, rec->name));
+	snprintf(meta->setname, sizeof(meta->setname), "%s", meta_name(idx, rec->setname));
+	snprintf(meta->rbf, sizeof(meta->rbf), "%s", meta_name(idx, rec->rbf));
+	snprintf(meta->year, sizeof(meta->year), "%s", meta_name(idx, rec->year));
+	snprintf(meta->manufacturer, sizeof(meta->manufacturer), "%s", meta_name(idx, rec->manufacturer));
+	snprintf(meta->zips, sizeof(meta->zips), "%s", meta_name(idx, rec->zips));
+	meta->has_setname = rec->has_setname;
+	meta->same_dir = rec->same_dir;
+	meta->rotation = rec->rotation;
+}
+
+static mraindex_t *index_load(const char *root)
+{
+	char name[64];
+	sprintf(name, MRAINDEX_DIR "/%08X", meta_hash(root));
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	mraindex_t *idx = nullptr;
+	mraindex_hdr_t hdr;
+	struct stat64 st;
+	if (!fstat64(fd, &st) && read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == MRAINDEX_MAGIC &&
+		!strcmp(hdr.root, root) && hdr.names_size &&
+		st.st_size == (__off64_t)(sizeof(hdr) + hdr.count * sizeof(mraindex_rec_t) + hdr.names_size))
+	{
+		idx = new mraindex_t();
+		snprintf(idx->root, sizeof(idx->root), "%s", root);
+		idx->recs.resize(hdr.count);
+		idx->names.resize(hdr.names_size);
+
+		size_t recs_size = hdr.count * sizeof(mraindex_rec_t);
+		int ok = (!recs_size || read(fd, idx->recs.data(), recs_size) == (ssize_t)recs_size) &&
+			read(fd, idx->names.data(), hdr.names_size) == (ssize_t)hdr.names_size && !idx->names.back();
+
+		for (auto &rec : idx->recs)
+		{
+			uint32_t max = std::max({ rec.path, rec.name, rec.setname, rec.rbf, rec.year, rec.manufacturer, rec.zips });
+			if (max >= hdr.names_size) ok = 0;
+		}
+
+		if (!ok)
+		{
+			delete idx;
+			idx = nullptr;
+		}
+	}
+
+	close(fd);
+	return idx;
+}
+
+// runs on the offload pool, owns buf
+static void index_write(uint8_t *buf, size_t size, uint32_t hash)
+{
+	char name[16];
+	sprintf(name, "%08X", hash);
+	cache_write(MRAINDEX_DIR, name, buf, size, 0);
+	free(buf);
+}
+
+static uint8_t *index_pack(const mraindex_t *idx, size_t *size)
+{
+	size_t recs_size = idx->recs.size() * sizeof(mraindex_rec_t);
+	*size = sizeof(mraindex_hdr_t) + recs_size + idx->names.size();
+
+	uint8_t *buf = (uint8_t *)malloc(*size);
+	if (!buf) return nullptr;
+
+	mraindex_hdr_t *hdr = (mraindex_hdr_t *)buf;
+	memset(hdr, 0, sizeof(mraindex_hdr_t));
+	hdr->magic = MRAINDEX_MAGIC;
+	snprintf(hdr->root, sizeof(hdr->root), "%s", idx->root);
+	hdr->count = idx->recs.size();
+	hdr->names_size = idx->names.size();
+
+	if (recs_size) memcpy(hdr + 1, idx->recs.data(), recs_size);
+	memcpy(buf + sizeof(mraindex_hdr_t) + recs_size, idx->names.data(), idx->names.size());
+	return buf;
+}
+
+static void index_publish(mraindex_t *idx)
+{
+	pthread_mutex_lock(&index_lock);
+	mraindex_t *old = index_cur;
+	index_cur = idx;
+	pthread_mutex_unlock(&index_lock);
+
+	if (old != idx) delete old;
+}
+
+// collects the MRAs of a folder and its subfolders
+static void index_walk(const char *path, int depth, std::vector<std::string> &list)
+{
+	DIR *d = opendir(path);
+	if (!d) return;
+
+	struct dirent *de;
+	while ((de = readdir(d)))
+	{
+		if (de->d_name[0] == '.') continue;
+
+		char name[1024];
+		if (snprintf(name, sizeof(name), "%s/%s", path, de->d_name) >= (int)sizeof(name)) continue;
+
+		if (de->d_type == DT_DIR)
+		{
+			if (depth < MRAINDEX_DEPTH) index_walk(name, depth + 1, list);
+			continue;
+		}
+
+		int len = strlen(de->d_name);
+		if (len > 4 && !strcasecmp(de->d_name + len - 4, ".mra")) list.push_back(name);
+	}
+	closedir(d);
+}
+
+// Runs on the offload pool, build_root doesn't change meanwhile. Records of
+// MRAs which didn't change (same path, mtime and size) are taken over.
+static void index_job(void)
+{
+	mraindex_t *old = nullptr;
+	pthread_mutex_lock(&index_lock);
+	if (index_cur && !strcmp(index_cur->root, build_root)) old = new mraindex_t(*index_cur);
+	pthread_mutex_unlock(&index_lock);
+
+	if (!old) old = index_load(build_root);
+
+	std::vector<std::string> list;
+	index_walk(build_root, 1, list);
+
+	mraindex_t *idx = new mraindex_t();
+	snprintf(idx->root, sizeof(idx->root), "%s", build_root);
+	idx->names.push_back(0);
+
+	int parsed = 0;
+	for (auto &path : list)
+	{
+		int64_t size;
+		int64_t mtime = meta_stat(path.c_str(), &size);
+		if (mtime < 0) continue;
+
+		mra_meta_t meta;
+		int n = old ? meta_find(old, path.c_str()) : -1;
+		if (n >= 0 && old->recs[n].mtime == mtime && old->recs[n].size == size) meta_get(old, &old->recs[n], &meta);
+		else if (meta_parse(path.c_str(), &meta)) parsed++;
+		else continue;
+
+		meta_add(idx, path.c_str(), mtime, size, &meta);
+	}
+	meta_sort(idx);
+
+	int changed = !old || parsed || old->recs.size() != idx->recs.size();
+	delete old;
+
+	if (changed)
+	{
+		printf("mraindex: %s, %u MRAs (%d parsed)\n", idx->root, (uint32_t)idx->recs.size(), parsed);
+
+		size_t size;
+		uint8_t *buf = index_pack(idx, &size);
+		if (buf) index_write(buf, size, meta_hash(idx->root));
+	}
+
+	index_publish(idx);
+}
+
+void mraindex_update(const char *dir)
+{
+	if (build_job && !offload_job_done(build_job)) return;
+	build_job = 0;
+
+	char path[1024], root[1024];
+	snprintf(path, sizeof(path), "%s%s%s", (dir[0] == '/') ? "" : getRootDir(), (dir[0] == '/') ? "" : "/", dir);
+	meta_root(path, 1, root, sizeof(root));
+
+	int64_t mtime = meta_stat(root, nullptr);
+	if (mtime < 0 || (!strcmp(root, build_root) && mtime == build_mtime)) return;
+
+	strcpy(build_root, root);
+	build_mtime = mtime;
+
+	// never let a full queue run the build on the main thread
+	build_job = offload_try_work([]() { index_job(); }, OFFLOAD_UI);
+	if (!build_job) build_root[0] = 0;
+}
+
+int mraindex_get(const char *mra, mra_meta_t *meta)
+{
+	char path[1024], root[1024];
+	snprintf(path, sizeof(path), "%s%s%s", (mra[0] == '/') ? "" : getRootDir(), (mra[0] == '/') ? "" : "/", mra);
+
+	int len = strlen(path);
+	if (len <= 4 || strcasecmp(path + len - 4, ".mra")) return 0;
+
+	int64_t size;
+	int64_t mtime = meta_stat(path, &size);
+	if (mtime < 0) return 0;
+
+	meta_root(path, 0, root, sizeof(root));
+
+	pthread_mutex_lock(&index_lock);
+	int loaded = index_cur && !strcmp(index_cur->root, root);
+	pthread_mutex_unlock(&index_lock);
+
+	// the build job replaces index_cur only for build_root
+	if (!loaded && (!build_job || offload_job_done(build_job) || strcmp(build_root, root)))
+	{
+		mraindex_t *idx = index_load(root);
+		if (!idx)
+		{
+			idx = new mraindex_t();
+			snprintf(idx->root, sizeof(idx->root), "%s", root);
+			idx->names.push_back(0);
+		}
+		index_publish(idx);
+	}
+
+	pthread_mutex_lock(&index_lock);
+	mraindex_t *idx = index_cur;
+	if (idx && !strcmp(idx->root, root))
+	{
+		int n = meta_find(idx, path);
+		if (n >= 0 && idx->recs[n].mtime == mtime && idx->recs[n].size == size)
+		{
+			meta_get(idx, &idx->recs[n], meta);
+			pthread_mutex_unlock(&index_lock);
+			return 1;
+		}
+	}
+	pthread_mutex_unlock(&index_lock);
+
+	if (!meta_parse(path, meta)) return 0;
+
+	// add it, a running build might replace the index and take it in anyway
+	pthread_mutex_lock(&index_lock);
+	idx = index_cur;
+	uint8_t *buf = nullptr;
+	size_t buf_size = 0;
+	if (idx && !strcmp(idx->root, root))
+	{
+		int n = meta_find(idx, path);
+		if (n >= 0) idx->recs.erase(idx->recs.begin() + n);
+		meta_add(idx, path, mtime, size, meta);
+		meta_sort(idx);
+		buf = index_pack(idx, &buf_size);
+	}
+	pthread_mutex_unlock(&index_lock);
+
+	uint32_t hash = meta_hash(root);
+	if (buf) offload_add_work([buf, buf_size, hash]() { index_write(buf, buf_size, hash); }, OFFLOAD_IO);
+	return 1;
+}
@@ -0,0 +1,32 @@
+#ifndef MRA_INDEX_H
+#define MRA_INDEX_H
+
+#include <inttypes.h>
+
+// Metadata of the MRAs of a top level folder (_Arcade and its subfolders),
+// kept in tmpfs so the menu and the pre-load steps don't parse the XMLs
+// again. All calls are main thread only.
+
+struct mra_meta_t
+{
+	char name[256];
+	char setname[256];
+	char rbf[1024];
+	char year[16];
+	char manufacturer[256];
+	char zips[1024];     // zips of ROM #0, '|' separated
+	int has_setname;
+	int same_dir;
+	int rotation;        // -1 - not given, 0 - horizontal, 1 - vertical
+};
+
+// Starts a background build of the index of the folder holding dir,
+// never blocks.
+void mraindex_update(const char *dir);
+
+// Gets the metadata of an MRA (full or root relative path). An MRA which
+// isn't indexed or changed since is parsed and added. Returns 0 if it
+// can't be read.
+int mraindex_get(const char *mra, mra_meta_t *meta);
+
+#endif
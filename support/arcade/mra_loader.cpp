@@ -2,8 +2,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <atomic>
 
 #include "../../sxmlc.h"
 #include "../../user_io.h"
@@ -13,9 +19,16 @@
 #include "../../fpga_io.h"
 #include "../../lib/md5/md5.h"
 #include "../../shmem.h"
+#include "../../romindex.h"
+#include "../../offload.h"
+#include "../../cfg.h"
+#include "../../swap_util.h"
+#include "../../crc.h"
+#include "../../launch.h"
 
 #include "buffer.h"
 #include "mra_loader.h"
+#include "mra_index.h"
 
 #define kBigTextSize 1024
 struct arc_struct {
@@ -39,6 +52,12 @@ struct arc_struct {
 	int ito;
 	int imap;
 	int file_size;
+	int hash_skip;
+	int part_failed;
+	int romcount;
+	int cached;           // the rom is sent from the image cache
+	int cached_verified;
+	uint32_t cached_size;
 	uint32_t address;
 	uint32_t crc;
 	buffer_data *data;
@@ -57,6 +76,12 @@ static int  nvram_idx  = 0;
 static int  nvram_size = 0;
 static char nvram_name[200] = {};
 
+// content of the NVRAM file, unchanged NVRAM isn't written again
+static uint32_t nvram_crc = 0;
+static int nvram_crc_valid = 0;
+static offload_job_t nvram_job = 0;
+static offload_job_t sw_job[2] = {};
+
 void arcade_nvm_save()
 {
 	if(nvram_idx && nvram_size)
@@ -75,7 +100,18 @@ void arcade_nvm_save()
 			user_io_file_rx_data(buf, nvram_size);
 			user_io_set_upload(0);
 
-			FileSave(path, buf, nvram_size);
+			uint32_t crc = crc32_update(0, buf, nvram_size);
+			if (nvram_crc_valid && crc == nvram_crc)
+			{
+				printf("nvram unchanged, not saved\n");
+			}
+			else
+			{
+				offload_wait(nvram_job);
+				nvram_job = FileSaveAsync(path, buf, nvram_size);
+				nvram_crc = crc;
+				nvram_crc_valid = 1;
+			}
 			delete(buf);
 		}
 	}
@@ -92,8 +128,12 @@ static void arcade_nvm_load()
 			memset(buf, 0, nvram_size);
 
 			strcat(path, nvram_name);
+			nvram_crc_valid = 0;
 			if (FileLoadConfig(path, buf, nvram_size))
 			{
+				nvram_crc = crc32_update(0, buf, nvram_size);
+				nvram_crc_valid = 1;
+
 				printf("Sending nvram (idx=%d, size=%d) to core\n", nvram_idx, nvram_size);
 				user_io_set_index(nvram_idx);
 				user_io_set_download(1);
@@ -134,10 +174,11 @@ void arcade_sw_save(int n)
 		strcpy(path, (n) ? CONFIG_DIR"/cheats/" : CONFIG_DIR"/dips/");
 		FileCreatePath(path);
 		strcat(path, sw->name);
-		if (FileSave(path, &sw->dip_cur, sizeof(sw->dip_cur)))
-		{
-			sw->dip_saved = sw->dip_cur;
-		}
+
+		offload_job_t *job = &sw_job[n ? 1 : 0];
+		offload_wait(*job);
+		*job = FileSaveAsync(path, &sw->dip_cur, sizeof(sw->dip_cur));
+		sw->dip_saved = sw->dip_cur;
 	}
 }
 
@@ -174,6 +215,7 @@ static void set_arcade_root(const char *path)
 	}
 
 	printf("mame_root %s\n", mame_root);
+	romindex_update(mame_root);
 }
 
 static const char *get_arcade_root(int rbf)
@@ -223,13 +265,11 @@ static int rom_checksz(int idx, int chunk)
 	return 1;
 }
 
-static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *md5context)
+static int rom_data(const uint8_t *buf, int chunk, int map)
 {
 	uint8_t offsets[8]; // assert (unitlen <= 8)
 	int bytes_in_iter = 0;
 
-	if (md5context) MD5Update(md5context, buf, chunk);
-
 	int idx = 0;
 	if (!map) map = 1;
 
@@ -258,40 +298,371 @@ static int rom_data(const uint8_t *buf, int chunk, int map, struct MD5Context *m
 		map_reg >>= 4;
 	}
 
-	while (chunk)
+	int units = chunk / bytes_in_iter;
+	scatter_units(romdata + romlen[idx], buf, units, unitlen, offsets, bytes_in_iter);
+	romlen[idx] += units * unitlen;
+
+	// a part ending inside a unit still takes the whole unit
+	chunk -= units * bytes_in_iter;
+	if (chunk)
+	{
+		buf += units * bytes_in_iter;
+		for (int i = 0; i < chunk; i++) romdata[romlen[idx] + offsets[i]] = buf[i];
+		romlen[idx] += unitlen;
+	}
+
+	return 1;
+}
+
+// MD5 of the ROM parts is calculated on the offload pool while the parts
+// are assembled. The chunk buffers are shared by the reader and the hash
+// stage, a buffer is reused once both let go of it. Chunks are hashed in
+// order by whichever job drains the fifo.
+#define HASH_BUFS     8
+#define HASH_BUF_SIZE (64 * 1024)
+
+struct hash_buf_t
+{
+	uint8_t *data;
+	int size;
+	struct MD5Context *ctx;
+	std::atomic<int> refs;
+};
+
+static hash_buf_t hash_bufs[HASH_BUFS];
+static hash_buf_t *hash_fifo[HASH_BUFS];
+static uint32_t hash_head = 0, hash_tail = 0;
+static int hash_draining = 0;
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static hash_buf_t *hash_get()
+{
+	for (;;)
 	{
-		for (int i = 0; i < bytes_in_iter; i++)
+		for (int i = 0; i < HASH_BUFS; i++)
 		{
-			*(romdata + romlen[idx] + offsets[i]) = *buf++;
-			chunk--;
+			hash_buf_t *b = &hash_bufs[i];
+			if (b->refs.load(std::memory_order_acquire)) continue;
+
+			if (!b->data) b->data = (uint8_t*)malloc(HASH_BUF_SIZE);
+			if (!b->data) return NULL;
+
+			b->size = 0;
+			b->refs.store(1);
+			return b;
 		}
-		romlen[idx] += unitlen;
+		sched_yield();
+	}
+}
+
+static void hash_put(hash_buf_t *b)
+{
+	b->refs.fetch_sub(1, std::memory_order_release);
+}
+
+static void hash_drain()
+{
+	pthread_mutex_lock(&hash_lock);
+	if (!hash_draining)
+	{
+		hash_draining = 1;
+		while (hash_tail != hash_head)
+		{
+			hash_buf_t *b = hash_fifo[hash_tail % HASH_BUFS];
+			pthread_mutex_unlock(&hash_lock);
+
+			MD5Update(b->ctx, b->data, b->size);
+
+			pthread_mutex_lock(&hash_lock);
+			hash_tail++;
+			hash_put(b);
+		}
+		hash_draining = 0;
+	}
+	pthread_mutex_unlock(&hash_lock);
+}
+
+// queues b->size bytes of b, the caller still has to hash_put() it
+static void hash_submit(hash_buf_t *b, struct MD5Context *ctx)
+{
+	b->ctx = ctx;
+	b->refs.fetch_add(1);
+
+	pthread_mutex_lock(&hash_lock);
+	hash_fifo[hash_head % HASH_BUFS] = b;
+	hash_head++;
+	pthread_mutex_unlock(&hash_lock);
+
+	offload_add_work([]() { hash_drain(); }, OFFLOAD_DECOMPRESS);
+}
+
+static void hash_data(struct MD5Context *ctx, const uint8_t *buf, int size)
+{
+	while (size > 0)
+	{
+		hash_buf_t *b = hash_get();
+		if (!b)
+		{
+			MD5Update(ctx, buf, size);
+			return;
+		}
+
+		b->size = (size > HASH_BUF_SIZE) ? HASH_BUF_SIZE : size;
+		memcpy(b->data, buf, b->size);
+		hash_submit(b, ctx);
+		hash_put(b);
+
+		buf += b->size;
+		size -= b->size;
+	}
+}
+
+// waits until every queued chunk is hashed
+static void hash_sync()
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&hash_lock);
+		int busy = hash_draining || (hash_tail != hash_head);
+		pthread_mutex_unlock(&hash_lock);
+		if (!busy) break;
+		sched_yield();
 	}
+}
+
+// Assembled roms are remembered in tmpfs along with the mtimes of the MRA
+// and the zips they were read from. While none of them changes, the MD5
+// check of a rom which passed it is skipped (mra_md5_cache), and the
+// assembled image itself is sent instead of re-building it (mra_rom_cache_mb).
+#define ROMMEMO_DIR   "/tmp/mrarom"
+#define ROMMEMO_MAGIC 0x524D4D01
+#define ROMMEMO_ZIPS  16
+#define ROMMEMO_MIN   (64 * 1024) // smaller images are assembled fast enough
+
+struct rommemo_zip_t
+{
+	char path[kBigTextSize];
+	int64_t mtime;
+	int64_t size;
+};
+
+struct rommemo_t
+{
+	uint32_t magic;
+	int64_t mra_mtime;
+	int64_t mra_size;
+	uint32_t verified;  // md5 matched
+	uint32_t rom_size;  // of the image file, 0 if there is none
+	uint32_t count;
+	rommemo_zip_t zips[ROMMEMO_ZIPS];
+};
 
+static char memo_mra[kBigTextSize] = {};
+static rommemo_t memo_cur;
+static int memo_valid = 0;
+
+static int memo_stat(const char *path, int64_t *mtime, int64_t *size)
+{
+	struct stat64 st;
+	if (stat64(path, &st)) return 0;
+
+	*mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	*size = st.st_size;
 	return 1;
 }
 
+// ordinal tells apart the alternatives of the same rom index
+static void memo_name(char *name, int ordinal, int index, const char *md5, const char *ext)
+{
+	char key[kBigTextSize * 2];
+	snprintf(key, sizeof(key), "%s|%d|%d|%s", memo_mra, ordinal, index, md5);
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = key; *p; p++) hash = (hash ^ (uint8_t)tolower(*p)) * 16777619u;
+	sprintf(name, ROMMEMO_DIR "/%08X%s", hash, ext);
+}
+
+static void memo_start()
+{
+	memset(&memo_cur, 0, sizeof(memo_cur));
+	memo_cur.magic = ROMMEMO_MAGIC;
+	memo_valid = (cfg.mra_md5_cache || cfg.mra_rom_cache_mb) && memo_mra[0] &&
+		memo_stat(memo_mra, &memo_cur.mra_mtime, &memo_cur.mra_size);
+}
+
+// remembers the zip of a part, name is zip path/member
+static void memo_add_zip(const char *name)
+{
+	if (!memo_valid) return;
+
+	char path[kBigTextSize];
+	snprintf(path, sizeof(path), "%s", getFullPath(name));
+	char *p = strcasestr(path, ".zip/");
+	if (!p)
+	{
+		memo_valid = 0;
+		return;
+	}
+	p[4] = 0;
+
+	for (uint32_t i = 0; i < memo_cur.count; i++)
+	{
+		if (!strcmp(memo_cur.zips[i].path, path)) return;
+	}
+
+	rommemo_zip_t *zip = &memo_cur.zips[memo_cur.count];
+	if (memo_cur.count >= ROMMEMO_ZIPS || !memo_stat(path, &zip->mtime, &zip->size))
+	{
+		memo_valid = 0;
+		return;
+	}
+
+	strcpy(zip->path, path);
+	memo_cur.count++;
+}
+
+// 1 if the rom was assembled before and nothing changed since
+static int memo_check(int ordinal, int index, const char *md5, rommemo_t *memo)
+{
+	if (!memo_valid) return 0;
+
+	char name[64];
+	memo_name(name, ordinal, index, md5, "");
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+	int ok = read(fd, memo, sizeof(rommemo_t)) == sizeof(rommemo_t);
+	close(fd);
+
+	ok = ok && memo->magic == ROMMEMO_MAGIC && memo->count <= ROMMEMO_ZIPS &&
+		memo->mra_mtime == memo_cur.mra_mtime && memo->mra_size == memo_cur.mra_size;
+
+	for (uint32_t i = 0; ok && i < memo->count; i++)
+	{
+		int64_t mtime, size;
+		ok = memo_stat(memo->zips[i].path, &mtime, &size) && mtime == memo->zips[i].mtime && size == memo->zips[i].size;
+	}
+
+	if (ok && memo->rom_size)
+	{
+		// the image might have been dropped to make room for others
+		int64_t mtime, size;
+		memo_name(name, ordinal, index, md5, ".rom");
+		if (!memo_stat(name, &mtime, &size) || size != memo->rom_size) memo->rom_size = 0;
+	}
+
+	return ok;
+}
+
+static int memo_write(const char *name, const void *buf, uint32_t size)
+{
+	char tmp_name[80];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return 0;
+
+	int ok = write(fd, buf, size) == (ssize_t)size;
+	close(fd);
+	if (!ok || rename(tmp_name, name))
+	{
+		unlink(tmp_name);
+		return 0;
+	}
+	return 1;
+}
+
+// drops the least recently used images until size more bytes fit into mra_rom_cache_mb
+static int memo_make_room(uint32_t size)
+{
+	uint64_t limit = cfg.mra_rom_cache_mb * 1024ULL * 1024ULL;
+	if (size > limit) return 0;
+
+	for (;;)
+	{
+		DIR *d = opendir(ROMMEMO_DIR);
+		if (!d) return 1;
+
+		char oldest[300] = {};
+		time_t oldest_time = 0;
+		uint64_t total = 0;
+
+		struct dirent *de;
+		while ((de = readdir(d)))
+		{
+			int len = strlen(de->d_name);
+			if (len < 4 || strcmp(de->d_name + len - 4, ".rom")) continue;
+
+			char name[300];
+			struct stat st;
+			snprintf(name, sizeof(name), ROMMEMO_DIR "/%s", de->d_name);
+			if (stat(name, &st)) continue;
+
+			total += st.st_size;
+			if (!oldest[0] || st.st_mtime < oldest_time)
+			{
+				strcpy(oldest, name);
+				oldest_time = st.st_mtime;
+			}
+		}
+		closedir(d);
+
+		if (total + size <= limit || !oldest[0]) return total + size <= limit;
+		unlink(oldest);
+	}
+}
+
+static void memo_store(int ordinal, int index, const char *md5, int verified, const uint8_t *rom, uint32_t rom_size)
+{
+	if (!memo_valid || !memo_cur.count) return;
+
+	mkdir(ROMMEMO_DIR, 0755);
+
+	char name[64];
+	memo_cur.verified = verified;
+	memo_cur.rom_size = 0;
+
+	if (rom && cfg.mra_rom_cache_mb && rom_size >= ROMMEMO_MIN && memo_make_room(rom_size))
+	{
+		memo_name(name, ordinal, index, md5, ".rom");
+		if (memo_write(name, rom, rom_size)) memo_cur.rom_size = rom_size;
+	}
+
+	memo_name(name, ordinal, index, md5, "");
+	memo_write(name, &memo_cur, sizeof(memo_cur));
+}
+
 static int rom_file(const char *name, uint32_t crc32, int start, int len, int map, struct MD5Context *md5context)
 {
 	fileTYPE f = {};
-	static uint8_t buf[8192];
 	if (!FileOpenZip(&f, name, crc32)) return 0;
+	memo_add_zip(name);
 	if (start) FileSeek(&f, start, SEEK_SET);
 	unsigned long bytes2send = f.size - f.offset;
 	if (len > 0 && len < (int)bytes2send) bytes2send = len;
 
 	while (bytes2send)
 	{
-		uint16_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
-
-		FileReadAdv(&f, buf, chunk);
-		if (!rom_data(buf, chunk, map, md5context))
+		hash_buf_t *b = hash_get();
+		if (!b)
 		{
 			FileClose(&f);
 			return 0;
-		};
+		}
+
+		b->size = (bytes2send > HASH_BUF_SIZE) ? HASH_BUF_SIZE : bytes2send;
+
+		FileReadAdv(&f, b->data, b->size);
+		if (md5context) hash_submit(b, md5context);
+		int ok = rom_data(b->data, b->size, map);
+		bytes2send -= b->size;
+		hash_put(b);
 
-		bytes2send -= chunk;
+		if (!ok)
+		{
+			FileClose(&f);
+			return 0;
+		}
 	}
 
 	FileClose(&f);
@@ -321,9 +692,11 @@ static void rom_finish(int send, uint32_t address, int index)
 		{
 			uint8_t *data = romdata;
 			int len = romlen[0];
+			launch_phase(LAUNCH_TRANSFER);
 
 			// set index byte (0=bios rom, 1-n=OSD entry index)
 			user_io_set_index(romindex);
+			if (!address) address = user_io_ddr_window(len);
 
 			// prepare transmission of new file
 			user_io_set_download(1, address ? len : 0);
@@ -353,6 +726,7 @@ static void rom_finish(int send, uint32_t address, int index)
 
 			// signal end of transmission
 			user_io_set_download(0);
+			launch_phase(LAUNCH_READ);
 			printf("file_finish: 0x%X bytes sent to FPGA\n\n", len);
 		}
 		else
@@ -373,6 +747,71 @@ static void rom_finish(int send, uint32_t address, int index)
 }
 
 
+// sends a rom image from the cache, through DDR if the core has a window
+static int rom_send_cached(int ordinal, int index, const char *md5, uint32_t size, uint32_t address)
+{
+	char name[64];
+	memo_name(name, ordinal, index, md5, ".rom");
+
+	fileTYPE f = {};
+	if (!FileOpen(&f, name, 1)) return 0;
+	if (f.size != size)
+	{
+		FileClose(&f);
+		return 0;
+	}
+
+	// keeps it off the eviction list for a while
+	utimes(name, NULL);
+
+	if (!address) address = user_io_ddr_window(size);
+
+	char str[32];
+	sprintf(str, "ROM #%d", index);
+
+	user_io_set_index(romindex);
+	user_io_set_download(1, address ? size : 0);
+	ProgressMessage(0, 0, 0, 0);
+
+	uint32_t sent = 0;
+	uint8_t *mem = address ? (uint8_t *)shmem_map(fpga_mem(address), size) : NULL;
+	if (mem)
+	{
+		while (sent < size)
+		{
+			uint32_t chunk = (size - sent > 256 * 1024) ? 256 * 1024 : size - sent;
+			if (FileReadDirect(&f, mem + sent, chunk) != (int)chunk) break;
+
+			ProgressMessage("Sending", str, sent, size);
+			sent += chunk;
+		}
+		shmem_unmap(mem, size);
+	}
+	else if (!address)
+	{
+		fileReadStream *stream = FileReadStreamStart(&f, size);
+		if (stream)
+		{
+			uint8_t *data;
+			uint32_t chunk;
+			while ((chunk = FileReadStreamNext(stream, &data)))
+			{
+				ProgressMessage("Sending", str, sent, size);
+				user_io_file_tx_data(data, chunk);
+				sent += chunk;
+			}
+			FileReadStreamEnd(stream);
+		}
+	}
+
+	ProgressMessage(0, 0, 0, 0);
+	user_io_set_download(0);
+	FileClose(&f);
+
+	printf("file_finish: 0x%X bytes sent to FPGA from %s\n\n", sent, name);
+	return sent == size;
+}
+
 /*
  * adapted from https://gist.github.com/xsleonard/7341172
  *
@@ -465,6 +904,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			arc_info->zipname[0] = 0;
 			arc_info->address = 0;
 			arc_info->insideinterleave = 0;
+			hash_sync();
 			MD5Init(&arc_info->context);
 			ProgressMessage(0, 0, 0, 0);
 		}
@@ -708,6 +1148,29 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 				arc_info->error_msg[0] = 0;
 
 			rom_start(arc_info->romindex);
+
+			memo_start();
+			arc_info->romcount++;
+			arc_info->part_failed = 0;
+			arc_info->hash_skip = 0;
+			arc_info->cached = 0;
+
+			rommemo_t memo;
+			if (strlen(arc_info->zipname) && memo_check(arc_info->romcount, arc_info->romindex, arc_info->md5, &memo))
+			{
+				if (cfg.mra_rom_cache_mb && memo.rom_size && !(arc_info->romindex == 0 && arc_info->validrom0))
+				{
+					arc_info->cached = 1;
+					arc_info->cached_size = memo.rom_size;
+					arc_info->cached_verified = memo.verified;
+					printf("rom %d is cached, parts are not read\n", arc_info->romindex);
+				}
+				else if (cfg.mra_md5_cache && memo.verified)
+				{
+					arc_info->hash_skip = 1;
+					printf("md5 of rom %d is known, not checked\n", arc_info->romindex);
+				}
+			}
 		}
 
 		if (arc_info->insiderom && !strcasecmp(node->tag, "interleave"))
@@ -737,7 +1200,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			for (int i = 1; i < 8; i++) romlen[i] = romlen[0];
 		}
 
-		ProgressMessage("Loading", message, ftell(sd->file), arc_info->file_size);
+		ProgressMessage("Loading", message, SAX_Data_position(sd), arc_info->file_size);
 		break;
 
 	case XML_EVENT_TEXT:
@@ -765,9 +1228,22 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 		{
 			message[0] = 0;
 
-			if (arc_info->insiderom)
+			if (arc_info->insiderom && arc_info->cached)
+			{
+				if (!rom_send_cached(arc_info->romcount, arc_info->romindex, arc_info->md5, arc_info->cached_size, arc_info->address))
+				{
+					snprintf(arc_info->error_msg, kBigTextSize, "cached rom %d is unreadable", arc_info->romindex);
+				}
+				else if (arc_info->romindex == 0 && arc_info->cached_verified)
+				{
+					arc_info->validrom0 = 1;
+					arc_info->error_msg[0] = 0;
+				}
+			}
+			else if (arc_info->insiderom)
 			{
 				unsigned char checksum[16];
+				hash_sync();
 				MD5Final(checksum, &arc_info->context);
 
 				char hex[40];
@@ -778,6 +1254,13 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 					p += 2;
 				}
 
+				if (arc_info->hash_skip)
+				{
+					// a missing part still fails, nothing else could have changed
+					if (arc_info->part_failed) strcpy(hex, "skipped");
+					else snprintf(hex, sizeof(hex), "%s", arc_info->md5);
+				}
+
 				int checksumsame = !strlen(arc_info->zipname) || !strcasecmp(arc_info->md5, hex);
 				int no_checksum = !strcasecmp(arc_info->md5, "none") || !strlen(arc_info->md5);
 
@@ -807,6 +1290,12 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 
 				checksumsame |= no_checksum;
 
+				if (checksumsame && !arc_info->part_failed)
+				{
+					int verified = !no_checksum && !strcasecmp(arc_info->md5, hex);
+					memo_store(arc_info->romcount, arc_info->romindex, arc_info->md5, verified, romdata, romlen[0]);
+				}
+
 				rom_finish(checksumsame, arc_info->address, arc_info->romindex);
 			}
 			arc_info->insiderom = 0;
@@ -819,7 +1308,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			// suppress rom0 if we already sent a valid one
 			// this is useful for merged rom sets - if the first one was valid, use it
 			// the second might not be
-			if (arc_info->romindex == 0 && arc_info->validrom0 == 1) break;
+			if ((arc_info->romindex == 0 && arc_info->validrom0 == 1) || arc_info->cached) break;
 			char fname[kBigTextSize * 2 + 16];
 			int start, length, repeat;
 			uint32_t crc32;
@@ -863,7 +1352,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 
 					for (int i = 0; i < repeat; i++)
 					{
-						result = rom_file(fname, crc32, start, length, arc_info->imap, &arc_info->context);
+						result = rom_file(fname, crc32, start, length, arc_info->imap, arc_info->hash_skip ? NULL : &arc_info->context);
 
 						// we should check file not found error for the zip
 						if (result == 0)
@@ -877,8 +1366,26 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 						break;
 					}
 				}
+				// the set might have been renamed or merged, any zip with this crc will do
+				if (result == 0 && crc32)
+				{
+					memo_valid = 0;
+					char zip[kBigTextSize];
+					if (romindex_find_crc(crc32, 0, zip, sizeof(zip)) >= 0)
+					{
+						snprintf(fname, sizeof(fname), "%s/%s", zip, arc_info->partname);
+						printf("file: %s (by crc)\n", fname);
+						for (int i = 0; i < repeat; i++)
+						{
+							result = rom_file(fname, crc32, start, length, arc_info->imap, arc_info->hash_skip ? NULL : &arc_info->context);
+							if (result == 0) break;
+						}
+					}
+				}
+
 				if (result == 0)
 				{
+					arc_info->part_failed = 1;
 					printf("%s does not exist\n", arc_info->partname);
 					snprintf(arc_info->error_msg, kBigTextSize, "%s\n%s not found", fname, arc_info->partname);
 				}
@@ -891,7 +1398,11 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 				printf("data: ");
 				if (binary)
 				{
-					for (int i = 0; i < repeat; i++) rom_data(binary, len, arc_info->imap, &arc_info->context);
+					for (int i = 0; i < repeat; i++)
+					{
+						if (!arc_info->hash_skip) hash_data(&arc_info->context, binary, len);
+						rom_data(binary, len, arc_info->imap);
+					}
 					free(binary);
 				}
 				printf("%d(0x%X) bytes from xml\n", romlen[0] - prev_len, romlen[0] - prev_len);
@@ -900,7 +1411,7 @@ static int xml_send_rom(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, cons
 			if (!arc_info->insideinterleave) unitlen = 1;
 		}
 
-		if (!strcasecmp(node->tag, "patch") && arc_info->insiderom)
+		if (!strcasecmp(node->tag, "patch") && arc_info->insiderom && !arc_info->cached)
 		{
 			size_t len = 0;
 			unsigned char* binary = hexstr_to_char(arc_info->data->content, &len);
@@ -1071,18 +1582,25 @@ int arcade_send_rom(const char *xml)
 	sax.all_event = xml_send_rom;
 
 	set_arcade_root(xml);
+	snprintf(memo_mra, sizeof(memo_mra), "%s", getFullPath(xml));
 
 	// create the structure we use for the XML parser
 	struct arc_struct arc_info;
 	arc_info.data = buffer_init(kBigTextSize);
 	arc_info.error_msg[0] = 0;
 	arc_info.validrom0 = 0;
+	arc_info.hash_skip = 0;
+	arc_info.romcount = 0;
+	arc_info.cached = 0;
 	struct stat64 *st = getPathStat(xml);
 	if (st) arc_info.file_size = (int)st->st_size;
 	ProgressMessage(0, 0, 0, 0);
 
 	// parse
+	launch_phase(LAUNCH_READ);
 	XMLDoc_parse_file_SAX(xml, &sax, &arc_info);
+	hash_sync();
+	launch_phase(LAUNCH_POST);
 	if (arc_info.validrom0 == 0 && strlen(arc_info.error_msg))
 	{
 		strcpy(arcade_error_msg, arc_info.error_msg);
@@ -1102,6 +1620,14 @@ int arcade_send_rom(const char *xml)
 
 void arcade_pre_parse(const char *xml)
 {
+	static mra_meta_t meta;
+	if (mraindex_get(xml, &meta))
+	{
+		if (meta.has_setname) user_io_name_override(meta.setname, meta.same_dir);
+		if (meta.rotation >= 0) is_vertical = meta.rotation;
+		return;
+	}
+
 	SAX_Callbacks sax;
 	SAX_Callbacks_init(&sax);
 
@@ -1124,6 +1650,128 @@ void arcade_check_error()
 	}
 }
 
+struct part_check_t
+{
+	char zipname[kBigTextSize];
+	char missing[kBigTextSize];
+	int insiderom;
+	int romindex;
+	int rom_missing;
+	int roms0;         // index 0 roms, alternatives of merged sets
+	int roms0_missing;
+};
+
+// 1 if found, 0 if the index says it's not in any of the zips, -1 if unknown
+static int check_part(const char *zipnames, const char *partname, uint32_t crc)
+{
+	if (!zipnames[0]) return -1;
+	if (crc && romindex_find_crc(crc, 0, NULL, 0) >= 0) return 1;
+
+	char zipnames_list[kBigTextSize];
+	snprintf(zipnames_list, sizeof(zipnames_list), "%s", zipnames);
+
+	int res = 0;
+	char *zipname = NULL;
+	char *zipptr = zipnames_list;
+	const char *root = get_arcade_root(0);
+	while (res != 1 && (zipname = strsep(&zipptr, "|")) != NULL)
+	{
+		char fname[kBigTextSize * 2 + 16];
+		snprintf(fname, sizeof(fname), (zipname[0] == '/') ? "%s%s" : "%s/mame/%s", root, zipname);
+
+		int found = romindex_has_member(getFullPath(fname), partname, crc);
+		if (found) res = found;
+	}
+
+	return res;
+}
+
+static int xml_check_parts(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const int n, SAX_Data* sd)
+{
+	part_check_t *pc = (part_check_t *)sd->user;
+
+	switch (evt)
+	{
+	case XML_EVENT_START_NODE:
+		if (!strcasecmp(node->tag, "rom"))
+		{
+			pc->insiderom = 1;
+			pc->romindex = 0;
+			pc->rom_missing = 0;
+			pc->zipname[0] = 0;
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				if (!strcasecmp(node->attributes[i].name, "zip")) snprintf(pc->zipname, sizeof(pc->zipname), "%s", node->attributes[i].value);
+				if (!strcasecmp(node->attributes[i].name, "index")) pc->romindex = atoi(node->attributes[i].value);
+			}
+		}
+		else if (pc->insiderom && !pc->romindex && !strcasecmp(node->tag, "part"))
+		{
+			const char *name = "";
+			const char *zip = pc->zipname;
+			uint32_t crc = 0;
+			for (int i = 0; i < node->n_attributes; i++)
+			{
+				if (!strcasecmp(node->attributes[i].name, "name")) name = node->attributes[i].value;
+				if (!strcasecmp(node->attributes[i].name, "zip")) zip = node->attributes[i].value;
+				if (!strcasecmp(node->attributes[i].name, "crc")) crc = strtoul(node->attributes[i].value, NULL, 16);
+			}
+
+			if (name[0] && !pc->rom_missing && !check_part(zip, name, crc))
+			{
+				pc->rom_missing = 1;
+				snprintf(pc->missing, sizeof(pc->missing), "%s", name);
+			}
+		}
+		break;
+
+	case XML_EVENT_END_NODE:
+		if (!strcasecmp(node->tag, "rom"))
+		{
+			if (!pc->romindex)
+			{
+				pc->roms0++;
+				pc->roms0_missing += pc->rom_missing;
+			}
+			pc->insiderom = 0;
+		}
+		break;
+
+	case XML_EVENT_ERROR:
+		printf("XML parse: %s: ERROR %d\n", text, n);
+		break;
+	default:
+		break;
+	}
+
+	return true;
+}
+
+// Checks the ROM parts against the zip index before the core gets loaded.
+// Only says no if every alternative of ROM #0 misses a part.
+static int arcade_check_parts(const char *xml)
+{
+	if (!romindex_ready()) return 1;
+
+	SAX_Callbacks sax;
+	SAX_Callbacks_init(&sax);
+	sax.all_event = xml_check_parts;
+
+	part_check_t pc = {};
+	XMLDoc_parse_file_SAX(xml, &sax, &pc);
+
+	if (pc.roms0 && pc.roms0 == pc.roms0_missing)
+	{
+		static char msg[kBigTextSize];
+		printf("arcade_check_parts: %s not found\n", pc.missing);
+		snprintf(msg, sizeof(msg), "ROM part not found:\n%s", pc.missing);
+		Info(msg, 1000 * 5);
+		return 0;
+	}
+
+	return 1;
+}
+
 static const char *get_rbf_path(const char *rbfname)
 {
 	static char path[kBigTextSize];
@@ -1138,11 +1786,19 @@ static const char *get_rbf(const char *xml, int arcade)
 	static char rbfname[kBigTextSize];
 
 	rbfname[0] = 0;
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
+	static mra_meta_t meta;
+	if (arcade && mraindex_get(xml, &meta))
+	{
+		snprintf(rbfname, sizeof(rbfname), "%s", meta.rbf);
+	}
+	else
+	{
+		SAX_Callbacks sax;
+		SAX_Callbacks_init(&sax);
 
-	sax.all_event = xml_scan_rbf;
-	XMLDoc_parse_file_SAX(xml, &sax, rbfname);
+		sax.all_event = xml_scan_rbf;
+		XMLDoc_parse_file_SAX(xml, &sax, rbfname);
+	}
 
 	/* once we have the rbfname fragment from the MRA xml file
 	 * search the arcade folder for the match */
@@ -1211,6 +1867,8 @@ static const char *get_rbf(const char *xml, int arcade)
 	return lastfound[0] ? rbfname : NULL;
 }
 
+static void mgl_prefetch(const char *xml, const char *rbf);
+
 int xml_load(const char *xml)
 {
 	MenuHide();
@@ -1228,7 +1886,11 @@ int xml_load(const char *xml)
 
 	if (rbf)
 	{
+		// keep the current core, nothing would boot without the ROMs
+		if (is_arcade && !arcade_check_parts(path)) return 0;
+
 		printf("XML: %s, RBF: %s\n", path, rbf);
+		if (!is_arcade) mgl_prefetch(path, rbf);
 		fpga_load_rbf(rbf, NULL, path);
 	}
 	else
@@ -1362,3 +2024,62 @@ mgl_struct* mgl_get()
 {
 	return &mgl;
 }
+
+// The files of an MGL are read into the page cache while the FPGA is
+// programmed, it survives the restart so the loads after it come from RAM.
+// The core name isn't known before the restart, its games folder is guessed
+// from the rbf name. A wrong guess only costs a failed stat.
+#define MGL_PREFETCH_MAX (128 * 1024 * 1024)
+
+static char mgl_prefetch_path[sizeof(mgl.item) / sizeof(mgl.item[0])][kBigTextSize];
+
+static void mgl_prefetch(const char *xml, const char *rbf)
+{
+	// parsed again after the restart, nothing here may run the items
+	mgl_parse(xml);
+	mgl.done = 1;
+
+	char core[256];
+	const char *p = strrchr(rbf, '/');
+	snprintf(core, sizeof(core), "%s", p ? p + 1 : rbf);
+	char *ext = strrchr(core, '.');
+	if (ext) *ext = 0;
+
+	// strip the build date, "SNES_20230101" -> "SNES"
+	char *date = strrchr(core, '_');
+	if (date && strlen(date) == 9 && strspn(date + 1, "0123456789") == 8) *date = 0;
+
+	uint64_t total = 0;
+	for (int i = 0; i < mgl.count; i++)
+	{
+		if (mgl.item[i].action != MGL_ACTION_LOAD) continue;
+
+		char *name = mgl_prefetch_path[i];
+		if (mgl.item[i].path[0] == '/')
+		{
+			snprintf(name, kBigTextSize, "%s", mgl.item[i].path);
+		}
+		else
+		{
+			static char dir[kBigTextSize];
+			snprintf(dir, sizeof(dir), "%s", !strcasecmp(core, "minimig") ? "Amiga" : core);
+			prefixGameDir(dir, sizeof(dir));
+			if (dir[0] == '/') snprintf(name, kBigTextSize, "%s/%s", dir, mgl.item[i].path);
+			else snprintf(name, kBigTextSize, "%s/%s/%s", getRootDir(), dir, mgl.item[i].path);
+		}
+
+		struct stat64 st;
+		if (stat64(name, &st) || !S_ISREG(st.st_mode)) continue;
+		if (total + st.st_size > MGL_PREFETCH_MAX) continue;
+		total += st.st_size;
+
+		printf("MGL prefetch: %s\n", name);
+		offload_try_work([i]()
+		{
+			int fd = open(mgl_prefetch_path[i], O_RDONLY | O_CLOEXEC);
+			if (fd < 0) return;
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}, OFFLOAD_IO);
+	}
+}
@@ -10,6 +10,7 @@
 #include "../../input.h"
 #include "../../support.h"
 #include "../../ide.h"
+#include "../../scheduler.h"
 #include "archie.h"
 
 #define CONFIG_FILENAME  "ARCHIE.CFG"
@@ -52,22 +53,31 @@ enum state {
 #define LEDS    0x00         // mask 0xf8
 #define PRST    0x21         // nop
 
-#define QUEUE_LEN 8
+// every event is a byte pair, the pairs are queued as a whole so a
+// dropped ack never leaves half of one on the line
+#define QUEUE_LEN 64
 static unsigned char tx_queue[QUEUE_LEN][2];
 static unsigned char tx_queue_rptr, tx_queue_wptr;
 #define QUEUE_NEXT(a)  ((a+1)&(QUEUE_LEN-1))
+#define QUEUE_FREE()   ((tx_queue_rptr - tx_queue_wptr - 1)&(QUEUE_LEN-1))
 
-static unsigned long ack_timeout;
+// mouse motion is summed up here and goes out as one pair once the line is free
 static short mouse_x, mouse_y;
 
+// ack and reset timeouts run from a scheduler timer
+#define KBD_ACK_US    10000
+#define KBD_RESET_US  20000
+#define KBD_RX_BURST  8     // received bytes handled per poll
+
+static int kbd_timer = -1;
+static int kbd_in_tick = 0;
+static uint32_t kbd_delay = 0;
+
 #define FLAG_SCAN_ENABLED  0x01
 #define FLAG_MOUSE_ENABLED 0x02
 static unsigned char flags;
 
 // #define HOLD_OFF_TIME 2
-#ifdef HOLD_OFF_TIME
-static unsigned long hold_off_timer;
-#endif
 
 const char *archie_get_rom_name(void)
 {
@@ -160,7 +170,14 @@ void archie_set_rom(char *name)
 
 	// save file name
 	strcpy(config.rom_img, name);
-	user_io_file_tx(name, 1);
+	user_io_file_tx_cached(name, 1);
+}
+
+// the timer callback returns its next delay itself
+static void archie_kbd_timer(uint32_t delay_us)
+{
+	kbd_delay = delay_us;
+	if (!kbd_in_tick) scheduler_timer_set(kbd_timer, delay_us);
 }
 
 static void archie_kbd_enqueue(unsigned char state, unsigned char byte)
@@ -185,7 +202,9 @@ static void archie_kbd_tx(unsigned char state, unsigned char byte)
 	DisableIO();
 
 	kbd_state = (enum state)state;
-	ack_timeout = GetTimer(10);  // 10ms timeout
+	if (kbd_state <= STATE_RAK2) archie_kbd_timer(KBD_RESET_US);
+	else if (kbd_state != STATE_IDLE) archie_kbd_timer(KBD_ACK_US);
+	else archie_kbd_timer((tx_queue_rptr != tx_queue_wptr) ? 1 : 0);
 }
 
 static void archie_kbd_send(unsigned char state, unsigned char byte)
@@ -197,6 +216,76 @@ static void archie_kbd_send(unsigned char state, unsigned char byte)
 		archie_kbd_enqueue(state, byte);
 }
 
+static void archie_check_queue(void)
+{
+	if (tx_queue_rptr == tx_queue_wptr)
+	{
+		// queued keys go first, the motion summed up meanwhile follows
+		if (!(flags & FLAG_MOUSE_ENABLED) || !(mouse_x || mouse_y)) return;
+
+		archie_kbd_enqueue(STATE_WAIT4ACK1, mouse_x & 0x7f);
+		archie_kbd_enqueue(STATE_WAIT4ACK2, mouse_y & 0x7f);
+		mouse_x = mouse_y = 0;
+	}
+
+	archie_kbd_tx(tx_queue[tx_queue_rptr][0], tx_queue[tx_queue_rptr][1]);
+	tx_queue_rptr = QUEUE_NEXT(tx_queue_rptr);
+}
+
+static void archie_kbd_send_pair(unsigned char byte1, unsigned char byte2)
+{
+	if (QUEUE_FREE() < 2)
+	{
+		archie_debugf("KBD tx queue overflow");
+		return;
+	}
+
+	archie_kbd_enqueue(STATE_WAIT4ACK1, byte1);
+	archie_kbd_enqueue(STATE_WAIT4ACK2, byte2);
+	if (kbd_state == STATE_IDLE) archie_check_queue();
+}
+
+static uint32_t archie_kbd_tick(void)
+{
+	kbd_in_tick = 1;
+	kbd_delay = 0;
+
+	switch (kbd_state)
+	{
+	case STATE_HRST:
+	case STATE_RAK1:
+	case STATE_RAK2:
+		//archie_debugf("KBD timeout in reset state");
+		archie_kbd_tx(STATE_RAK1, HRST);
+		break;
+
+	case STATE_WAIT4ACK1:
+		archie_debugf(">>>> KBD ACK TIMEOUT 1ST BYTE <<<<");
+
+		// the second half of the pair is useless now
+		if (tx_queue_rptr != tx_queue_wptr && tx_queue[tx_queue_rptr][0] == STATE_WAIT4ACK2)
+			tx_queue_rptr = QUEUE_NEXT(tx_queue_rptr);
+		kbd_state = STATE_IDLE;
+		archie_check_queue();
+		break;
+
+	case STATE_WAIT4ACK2:
+		archie_debugf(">>>> KBD ACK TIMEOUT 2ND BYTE <<<<");
+		kbd_state = STATE_IDLE;
+		archie_check_queue();
+		break;
+
+	default:
+		// idle with queued bytes or the end of a hold off
+		kbd_state = STATE_IDLE;
+		archie_check_queue();
+		break;
+	}
+
+	kbd_in_tick = 0;
+	return kbd_delay;
+}
+
 static void archie_kbd_reset(void)
 {
 	archie_debugf("KBD reset");
@@ -353,8 +442,9 @@ void archie_init()
 			floppy[i].size = 0;
 	}
 */
+	// give archie 20ms to reply
+	if (kbd_timer < 0) kbd_timer = scheduler_timer_add("archie_kbd", archie_kbd_tick, 0);
 	archie_kbd_send(STATE_RAK1, HRST);
-	ack_timeout = GetTimer(20);  // give archie 20ms to reply
 }
 
 void archie_kbd(unsigned short code)
@@ -378,8 +468,7 @@ void archie_kbd(unsigned short code)
 	// select prefix for up or down event
 	unsigned char prefix = (code & 0x8000) ? KUDA : KDDA;
 
-	archie_kbd_send(STATE_WAIT4ACK1, prefix | (code >> 4));
-	archie_kbd_send(STATE_WAIT4ACK2, prefix | (code & 0x0f));
+	archie_kbd_send_pair(prefix | (code >> 4), prefix | (code & 0x0f));
 }
 
 void archie_mouse(unsigned char b, int16_t x, int16_t y)
@@ -402,16 +491,8 @@ void archie_mouse(unsigned char b, int16_t x, int16_t y)
 		return;
 	}
 
-	// ignore any mouse movement if mouse is disabled or if nothing to report
-	if ((flags & FLAG_MOUSE_ENABLED) && (mouse_x || mouse_y))
-	{
-		// send asap if no pending byte
-		if (kbd_state == STATE_IDLE) {
-			archie_kbd_send(STATE_WAIT4ACK1, mouse_x & 0x7f);
-			archie_kbd_send(STATE_WAIT4ACK2, mouse_y & 0x7f);
-			mouse_x = mouse_y = 0;
-		}
-	}
+	// send asap if no pending byte, otherwise the motion keeps adding up
+	if (kbd_state == STATE_IDLE) archie_check_queue();
 
 	// ignore mouse buttons if key scanning is disabled
 	if (flags & FLAG_SCAN_ENABLED)
@@ -427,23 +508,13 @@ void archie_mouse(unsigned char b, int16_t x, int16_t y)
 			if ((b&mask) != (buts&mask))
 			{
 				unsigned char prefix = (b&mask) ? KDDA : KUDA;
-				archie_kbd_send(STATE_WAIT4ACK1, prefix | 0x07);
-				archie_kbd_send(STATE_WAIT4ACK2, prefix | ((!mswap ^ !(get_key_mod() & (RGUI|LGUI))) ? s : remap[s]));
+				archie_kbd_send_pair(prefix | 0x07, prefix | ((!mswap ^ !(get_key_mod() & (RGUI|LGUI))) ? s : remap[s]));
 			}
 		}
 		buts = b;
 	}
 }
 
-static void archie_check_queue(void)
-{
-	if (tx_queue_rptr == tx_queue_wptr)
-		return;
-
-	archie_kbd_tx(tx_queue[tx_queue_rptr][0], tx_queue[tx_queue_rptr][1]);
-	tx_queue_rptr = QUEUE_NEXT(tx_queue_rptr);
-}
-
 static void check_reset()
 {
 	static uint32_t timer = 0;
@@ -480,41 +551,17 @@ void archie_poll(void)
 	check_cmos(status);
 	check_reset();
 
-#ifdef HOLD_OFF_TIME
-	if ((kbd_state == STATE_HOLD_OFF) && CheckTimer(hold_off_timer)) {
-		archie_debugf("KBD resume after hold off");
-		kbd_state = STATE_IDLE;
-		archie_check_queue();
-	}
-#endif
-
-	// timeout waiting for ack?
-	if ((kbd_state == STATE_WAIT4ACK1) || (kbd_state == STATE_WAIT4ACK2)) {
-		if (CheckTimer(ack_timeout)) {
-			if (kbd_state == STATE_WAIT4ACK1)
-				archie_debugf(">>>> KBD ACK TIMEOUT 1ST BYTE <<<<");
-			if (kbd_state == STATE_WAIT4ACK2)
-				archie_debugf(">>>> KBD ACK TIMEOUT 2ND BYTE <<<<");
-
-			kbd_state = STATE_IDLE;
-		}
-	}
-
-	// timeout in reset sequence?
-	if (kbd_state <= STATE_RAK2)
+	// every ack lets the next byte out right away, so a burst of events
+	// goes through within one poll instead of one byte per poll
+	for (int n = 0; n < KBD_RX_BURST; n++)
 	{
-		if (CheckTimer(ack_timeout))
+		spi_uio_cmd_cont(0x04);
+		if (spi_in() != 0xa1)
 		{
-			//archie_debugf("KBD timeout in reset state");
-
-			archie_kbd_send(STATE_RAK1, HRST);
-			ack_timeout = GetTimer(20);  // 20ms timeout
+			DisableIO();
+			break;
 		}
-	}
 
-	spi_uio_cmd_cont(0x04);
-	if (spi_in() == 0xa1)
-	{
 		unsigned char data = spi_in();
 		DisableIO();
 
@@ -525,14 +572,12 @@ void archie_poll(void)
 		case HRST:
 			archie_kbd_reset();
 			archie_kbd_send(STATE_RAK1, HRST);
-			ack_timeout = GetTimer(20);  // 20ms timeout
 			break;
 
 			// arm sends reset ack 1
 		case RAK1:
 			if (kbd_state == STATE_RAK1) {
 				archie_kbd_send(STATE_RAK2, RAK1);
-				ack_timeout = GetTimer(20);  // 20ms timeout
 			}
 			else
 				kbd_state = STATE_HRST;
@@ -542,7 +587,6 @@ void archie_poll(void)
 		case RAK2:
 			if (kbd_state == STATE_RAK2) {
 				archie_kbd_send(STATE_IDLE, RAK2);
-				ack_timeout = GetTimer(20);  // 20ms timeout
 			}
 			else
 				kbd_state = STATE_HRST;
@@ -553,27 +597,28 @@ void archie_poll(void)
 			archie_kbd_send(STATE_IDLE, KBID | 1);
 			break;
 
+			// arm requests mouse data, answered even if there is no motion
+		case RQMP:
+			archie_kbd_send_pair(mouse_x & 0x7f, mouse_y & 0x7f);
+			mouse_x = mouse_y = 0;
+			break;
+
 			// arm acks first byte
 		case BACK:
 			if (kbd_state != STATE_WAIT4ACK1) {
 				archie_debugf("KBD unexpected BACK, resetting KBD");
 				kbd_state = STATE_HRST;
+				archie_kbd_timer(KBD_RESET_US);
 			}
 			else {
 #ifdef HOLD_OFF_TIME
 				// wait some time before sending next byte
 				archie_debugf("KBD starting hold off");
 				kbd_state = STATE_HOLD_OFF;
-				hold_off_timer = GetTimer(10);
-				// wait some time before sending next byte
-				archie_debugf("KBD starting hold off");
-				kbd_state = STATE_HOLD_OFF;
-				hold_off_timer = GetTimer(10);
+				archie_kbd_timer(HOLD_OFF_TIME * 1000);
 #else
 				kbd_state = STATE_IDLE;
 				archie_check_queue();
-				kbd_state = STATE_IDLE;
-				archie_check_queue();
 #endif
 			}
 			break;
@@ -608,7 +653,7 @@ void archie_poll(void)
 #ifdef HOLD_OFF_TIME
 			archie_debugf("KBD starting hold off");
 			kbd_state = STATE_HOLD_OFF;
-			hold_off_timer = GetTimer(10);
+			archie_kbd_timer(HOLD_OFF_TIME * 1000);
 #else
 			kbd_state = STATE_IDLE;
 			archie_check_queue();
@@ -616,8 +661,6 @@ void archie_poll(void)
 			break;
 		}
 	}
-	else
-		DisableIO();
 }
 
 const char *archie_get_hdd_name(int i)
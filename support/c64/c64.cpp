@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <vector>
@@ -9,8 +10,10 @@
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../hardware.h"
+#include "../../offload.h"
 
 #include "c64.h"
+#include "c64_gcr.h"
 
 //#define dbgprintf printf
 #define dbgprintf(...)
@@ -322,10 +325,68 @@ struct img_info
 	uint32_t trk_map[168];
 	uint32_t spd_map[168];
 	int *sector_map;
+
+	uint8_t *bin;          // D64: whole image kept in RAM, written back on the offload pool
+	uint32_t bin_size;
+	offload_job_t flush_job;
+
+	uint8_t *trk[168];     // encoded track images: 2 bytes size + GCR data
+	uint32_t trk_len[168]; // bytes held in trk[]
 };
 
 static img_info gcr_info[16] = {};
 
+static void gcr_cache_drop(int idx, int track)
+{
+	if (track >= 168) return;
+	free(gcr_info[idx].trk[track]);
+	gcr_info[idx].trk[track] = 0;
+	gcr_info[idx].trk_len[track] = 0;
+}
+
+static void gcr_cache_clear(int idx)
+{
+	for (int i = 0; i < 168; i++) gcr_cache_drop(idx, i);
+}
+
+static void gcr_cache_put(int idx, int track, const uint8_t *data, uint32_t len)
+{
+	if (track >= 168) return;
+
+	gcr_cache_drop(idx, track);
+	uint8_t *buf = (uint8_t*)malloc(len);
+	if (!buf) return;
+
+	memcpy(buf, data, len);
+	gcr_info[idx].trk[track] = buf;
+	gcr_info[idx].trk_len[track] = len;
+}
+
+static void gcr_flush(int idx, uint32_t off, uint32_t len)
+{
+	img_info *info = &gcr_info[idx];
+
+	// keep the writes of a drive in order
+	offload_wait(info->flush_job);
+	info->flush_job = 0;
+
+	uint8_t *data = info->bin + off;
+	uint8_t *copy = info->f->filp ? (uint8_t*)malloc(len) : 0;
+	if (!copy)
+	{
+		FileWriteAt(info->f, off, data, len);
+		return;
+	}
+
+	memcpy(copy, data, len);
+	int fd = fileno(info->f->filp);
+	info->flush_job = offload_add_work([fd, copy, off, len]()
+		{
+			if (pwrite(fd, copy, len, off) != (ssize_t)len) printf("GCR: write error at %u.\n", off);
+			free(copy);
+		}, OFFLOAD_IO);
+}
+
 static uint8_t trk_buf[8192];
 static uint8_t gcr_buf[G64_MAX_TRACK_LEN*2];
 static uint8_t track_count[4] = {35, 40, 42, 70};
@@ -386,6 +447,7 @@ int c64_openGCR(const char *path, fileTYPE *f, int idx)
 	//       1=raw GCR supported  (G64_SUPPORT_GCR)
 	//       2=raw MFM supported  (G64_SUPPORT_MFM)
 
+	c64_closeGCR(idx);
 	gcr_info[idx].f = f;
 	if (!strcasecmp(path + strlen(path) - 4, ".g64") || !strcasecmp(path + strlen(path) - 4, ".g71"))
 	{
@@ -426,6 +488,21 @@ int c64_openGCR(const char *path, fileTYPE *f, int idx)
 		gcr_info[idx].id[0] = 0;
 		gcr_info[idx].id[1] = 0;
 		FileReadAdv(f, gcr_info[idx].id, 2);
+
+		// sector data is small enough to serve all reads and writes from RAM
+		uint32_t bin_size = gcr_info[idx].sector_map[84] * 256;
+		if (f->size < bin_size) bin_size = f->size;
+		gcr_info[idx].bin = (uint8_t*)malloc(bin_size);
+		if (gcr_info[idx].bin && FileReadAt(f, 0, gcr_info[idx].bin, bin_size) == (int)bin_size)
+		{
+			gcr_info[idx].bin_size = bin_size;
+		}
+		else
+		{
+			free(gcr_info[idx].bin);
+			gcr_info[idx].bin = 0;
+		}
+
 		printf("D64/D71 disk id1=%02X, id2=%02X, tracks=%d, sectors=%d\n", gcr_info[idx].id[0], gcr_info[idx].id[1], gcr_info[idx].tracks, gcr_info[idx].sector_map[84]);
 
 		return G64_SUPPORT_GCR | (gcr_info[idx].tracks > 42 ? G64_SUPPORT_DS : 0);
@@ -434,62 +511,14 @@ int c64_openGCR(const char *path, fileTYPE *f, int idx)
 
 void c64_closeGCR(int idx)
 {
-	gcr_info[idx].type = 0;
-}
-
-static const uint8_t gcr_lut[16] = {
-	0x0a, 0x0b, 0x12, 0x13,
-	0x0e, 0x0f, 0x16, 0x17,
-	0x09, 0x19, 0x1a, 0x1b,
-	0x0d, 0x1d, 0x1e, 0x15
-};
+	offload_wait(gcr_info[idx].flush_job);
+	gcr_info[idx].flush_job = 0;
 
-static const uint8_t bin_lut[32] = {
-	0, 0, 0, 0, 0, 0, 0, 0,
-	0, 8, 0, 1, 0, 12, 4, 5,
-	0, 0, 2, 3, 0, 15, 6, 7,
-	0, 9, 10, 11, 0, 13, 14, 0
-};
-
-static uint8_t *gcrptr;
-static int gcrcnt = 0;
-
-void bin2gcr(uint8_t bin)
-{
-	static uint64_t gcr = 0;
-
-	gcr <<= 5;
-	gcr |= gcr_lut[(bin >> 4) & 0xF];
-	gcr <<= 5;
-	gcr |= gcr_lut[bin & 0xF];
-
-	gcrcnt++;
-	if (gcrcnt == 4)
-	{
-		gcrcnt = 0;
-		*gcrptr++ = (uint8_t)(gcr >> 32);
-		*gcrptr++ = (uint8_t)(gcr >> 24);
-		*gcrptr++ = (uint8_t)(gcr >> 16);
-		*gcrptr++ = (uint8_t)(gcr >> 8);
-		*gcrptr++ = (uint8_t)(gcr);
-	}
-}
-
-void gcr2bin(uint8_t *gcr, uint8_t *bin)
-{
-	// from VICE
-	register uint32_t tmp = *gcr;
-	tmp <<= 13;
-
-	for (int i = 5; i < 13; i += 2, bin++)
-	{
-		gcr++;
-		tmp |= ((uint32_t)(*gcr)) << i;
-		*bin = bin_lut[(tmp >> 16) & 0x1f] << 4;
-		tmp <<= 5;
-		*bin |= bin_lut[(tmp >> 16) & 0x1f];
-		tmp <<= 5;
-	}
+	gcr_cache_clear(idx);
+	free(gcr_info[idx].bin);
+	gcr_info[idx].bin = 0;
+	gcr_info[idx].bin_size = 0;
+	gcr_info[idx].type = 0;
 }
 
 void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
@@ -503,8 +532,28 @@ void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 	uint32_t track_size;
 	
 	if (!gcr_info[idx].type) return;
+	gcr_init_tables();
 
-	if (gcr_info[idx].type == 2)
+	uint8_t *cached = (track < 168) ? gcr_info[idx].trk[track] : 0;
+	if (cached)
+	{
+		track_size = (cached[1] << 8) | cached[0];
+		uint32_t len = std::min(track_size + 2, blks * 256);
+		if (len <= gcr_info[idx].trk_len[track])
+		{
+			memcpy(gcr_buf, cached, len);
+		}
+		else
+		{
+			cached = 0;
+		}
+	}
+
+	if (cached)
+	{
+		dbgprintf("Track %d%s: cached, size %d\n", (track >> 1) + 1, (track & 1) ? ".5" : "", track_size);
+	}
+	else if (gcr_info[idx].type == 2)
 	{
 		if (track >= gcr_info[idx].tracks || !gcr_info[idx].trk_map[track])
 		{
@@ -516,6 +565,7 @@ void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 			FileSeek(gcr_info[idx].f, gcr_info[idx].trk_map[track], SEEK_SET);
 			FileReadAdv(gcr_info[idx].f, gcr_buf, blks * 256);
 			track_size = (gcr_buf[1] << 8) | gcr_buf[0];
+			gcr_cache_put(idx, track, gcr_buf, std::min(track_size + 2, blks * 256));
 			dbgprintf("Track %d%s: read ok, size %d\n", (track >> 1) + 1, (track & 1) ? ".5" : "", track_size);
 		}
 	}
@@ -531,47 +581,28 @@ void c64_readGCR(int idx, uint64_t lba, uint32_t blks)
 
 		// dbgprintf("GCR physical track=%d%s, logical track=%d, size=%d\n", (track >> 1) + 1, (track & 1) ? ".5" : "", track_h, size);
 		if (size) {
-			FileSeek(gcr_info[idx].f, gcr_info[idx].sector_map[track_f] * 256, SEEK_SET);
-			FileReadAdv(gcr_info[idx].f, trk_buf, size);
+			uint32_t pos = gcr_info[idx].sector_map[track_f] * 256;
+			const uint8_t *src = trk_buf;
+			if (pos + size <= gcr_info[idx].bin_size)
+			{
+				src = gcr_info[idx].bin + pos;
+			}
+			else
+			{
+				FileSeek(gcr_info[idx].f, pos, SEEK_SET);
+				FileReadAdv(gcr_info[idx].f, trk_buf, size);
+			}
 
-			uint8_t sec = 0;
-			gcrptr = gcr_buf + 2;
+			uint8_t *gcrptr = gcr_buf + 2;
 			for (int ptr = 0; ptr < size; ptr += 256)
 			{
-				gcrcnt = 0;
-				*gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF;
-				bin2gcr(0x08);
-				bin2gcr(sec ^ track_h ^ gcr_info[idx].id[0] ^ gcr_info[idx].id[1]);
-				bin2gcr(sec);
-				bin2gcr(track_h);
-				bin2gcr(gcr_info[idx].id[1]);
-				bin2gcr(gcr_info[idx].id[0]);
-				bin2gcr(0x0F);
-				bin2gcr(0x0F);
-				*gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55;
-				*gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55; *gcrptr++ = 0x55;
-
-				uint8_t cs = 0;
-				uint8_t bt;
-
-				*gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF; *gcrptr++ = 0xFF;
-				bin2gcr(0x07);
-				for (int i = 0; i < 256; i++)
-				{
-					bt = trk_buf[ptr + i];
-					cs ^= bt;
-					bin2gcr(bt);
-				}
-				bin2gcr(cs);
-				bin2gcr(0);
-				bin2gcr(0);
-
-				int gap = (track_h < 18) ? 8 : (track_h < 25) ? 17 : (track_h < 31) ? 12 : 9;
-				while (gap--) *gcrptr++ = 0x55;
-				sec++;
+				gcrptr = gcr_encode_sector(gcrptr, src + ptr, ptr / 256, track_h, gcr_info[idx].id);
 			}
 
 			track_size = gcrptr - gcr_buf - 2;
+			gcr_buf[0] = (uint8_t)track_size;
+			gcr_buf[1] = (uint8_t)(track_size >> 8);
+			gcr_cache_put(idx, track, gcr_buf, track_size + 2);
 			dbgprintf("Read GCR track %d: bin_size = %d, gcr_size = %d\n", track_f+1, size, track_size);
 		}
 		else {
@@ -667,6 +698,7 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 #endif
 
 	if (!gcr_info[idx].type) return;
+	gcr_init_tables();
 
 	static uint8_t sec_buf[260];
 
@@ -677,6 +709,9 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 
 	uint32_t track_size = (gcr_buf[1] << 8) | gcr_buf[0];
 
+	// the written image is used as is, D64 tracks get encoded again from the decoded data
+	gcr_cache_drop(idx, track);
+
 	if (gcr_info[idx].type == 2)
 	{
 		if (track >= gcr_info[idx].tracks) 
@@ -790,6 +825,8 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 	uint32_t off = 0, ptr = 2;
 	uint8_t sec = 0xFF;
 
+	uint8_t id[2] = { gcr_info[idx].id[0], gcr_info[idx].id[1] };
+
 	memcpy(gcr_buf + track_size + 2, gcr_buf + 2, track_size);
 	memset(trk_buf, 0, sizeof(trk_buf));
 
@@ -805,7 +842,7 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 			uint8_t *hdr = align(gcr_buf + ptr + off, 11);
 
 			uint32_t bin;
-			gcr2bin(hdr, (uint8_t*)&bin);
+			gcr_decode((uint8_t*)&bin, hdr, 1);
 			if (!started && (bin & 0xFF) == 8)
 			{
 				off = ptr - 2;
@@ -819,7 +856,7 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 			if ((bin & 0xFF) == 8)
 			{
 				sec = (uint8_t)(bin >> 16);
-				gcr2bin(hdr + 5, (uint8_t*)&bin);
+				gcr_decode((uint8_t*)&bin, hdr + 5, 1);
 				gcr_info[idx].id[1] = (uint8_t)(bin);
 				gcr_info[idx].id[0] = (uint8_t)(bin >> 8);
 
@@ -832,12 +869,7 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 					dbgprintf("data...\n\n");
 					uint8_t *data = align(gcr_buf + ptr + off, 330);
 
-					int dst = 0;
-					int src = 0;
-					for (; dst < 260; src += 5, dst += 4)
-					{
-						gcr2bin(data + src, sec_buf + dst);
-					}
+					gcr_decode(sec_buf, data, 65);
 
 					memcpy(trk_buf + (sec * 256), sec_buf + 1, 256);
 					/*
@@ -870,6 +902,17 @@ void c64_writeGCR(int idx, uint64_t lba, uint32_t blks)
 		}
 	}
 
-	FileSeek(gcr_info[idx].f, gcr_info[idx].sector_map[track] * 256, SEEK_SET);
+	// the disk id is part of every sector header
+	if (gcr_info[idx].id[0] != id[0] || gcr_info[idx].id[1] != id[1]) gcr_cache_clear(idx);
+
+	uint32_t pos = gcr_info[idx].sector_map[track] * 256;
+	if (pos + sec_cnt * 256 <= gcr_info[idx].bin_size)
+	{
+		memcpy(gcr_info[idx].bin + pos, trk_buf, sec_cnt * 256);
+		gcr_flush(idx, pos, sec_cnt * 256);
+		return;
+	}
+
+	FileSeek(gcr_info[idx].f, pos, SEEK_SET);
 	FileWriteAdv(gcr_info[idx].f, trk_buf, sec_cnt * 256);
 }
@@ -1,6 +1,8 @@
 #ifndef C64_H
 #define C64_H
 
+#include "c64_gcr.h"
+
 #define G64_BLOCK_COUNT_1541 31
 #define G64_BLOCK_COUNT_1571 52
 
@@ -0,0 +1,125 @@
+#include <string.h>
+#include <inttypes.h>
+
+#include "../../profiling.h"
+
+#include "c64_gcr.h"
+
+#define GCR_DISK_SECTORS 683U // 35 track D64
+
+static const uint8_t gcr_lut[16] = {
+	0x0a, 0x0b, 0x12, 0x13,
+	0x0e, 0x0f, 0x16, 0x17,
+	0x09, 0x19, 0x1a, 0x1b,
+	0x0d, 0x1d, 0x1e, 0x15
+};
+
+static const uint8_t bin_lut[32] = {
+	0, 0, 0, 0, 0, 0, 0, 0,
+	0, 8, 0, 1, 0, 12, 4, 5,
+	0, 0, 2, 3, 0, 15, 6, 7,
+	0, 9, 10, 11, 0, 13, 14, 0
+};
+
+// 8 bit <-> 10 bit GCR, built from the 4/5 bit tables above
+static uint16_t gcr_enc[256];
+static uint8_t gcr_dec[1024];
+
+void gcr_init_tables()
+{
+	static int done = 0;
+	if (__atomic_load_n(&done, __ATOMIC_ACQUIRE)) return;
+
+	// flagged only once filled, the bench may run on an offload thread
+	for (int i = 0; i < 256; i++) gcr_enc[i] = (gcr_lut[i >> 4] << 5) | gcr_lut[i & 0xF];
+	for (int i = 0; i < 1024; i++) gcr_dec[i] = (bin_lut[i >> 5] << 4) | bin_lut[i & 0x1F];
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+}
+
+// encodes groups of 4 bytes into 5 GCR bytes, returns the end of output
+uint8_t *gcr_encode(uint8_t *out, const uint8_t *bin, int groups)
+{
+	while (groups--)
+	{
+		uint32_t lo = (gcr_enc[bin[2]] << 10) | gcr_enc[bin[3]];
+		uint32_t hi = (gcr_enc[bin[0]] << 10) | gcr_enc[bin[1]];
+		out[0] = (uint8_t)(hi >> 12);
+		out[1] = (uint8_t)(hi >> 4);
+		out[2] = (uint8_t)((hi << 4) | (lo >> 16));
+		out[3] = (uint8_t)(lo >> 8);
+		out[4] = (uint8_t)lo;
+		bin += 4;
+		out += 5;
+	}
+	return out;
+}
+
+// decodes groups of 5 GCR bytes into 4 bytes
+void gcr_decode(uint8_t *bin, const uint8_t *gcr, int groups)
+{
+	while (groups--)
+	{
+		uint32_t hi = (gcr[0] << 12) | (gcr[1] << 4) | (gcr[2] >> 4);
+		uint32_t lo = ((gcr[2] & 0xF) << 16) | (gcr[3] << 8) | gcr[4];
+		bin[0] = gcr_dec[hi >> 10];
+		bin[1] = gcr_dec[hi & 0x3FF];
+		bin[2] = gcr_dec[lo >> 10];
+		bin[3] = gcr_dec[lo & 0x3FF];
+		gcr += 5;
+		bin += 4;
+	}
+}
+
+// header and data block of one sector with their syncs and gaps
+uint8_t *gcr_encode_sector(uint8_t *out, const uint8_t *data, uint8_t sec, uint8_t track_h, const uint8_t *id)
+{
+	uint8_t hdr[8] = { 0x08, (uint8_t)(sec ^ track_h ^ id[0] ^ id[1]), sec, track_h, id[1], id[0], 0x0F, 0x0F };
+	memset(out, 0xFF, 5);
+	out = gcr_encode(out + 5, hdr, 2);
+	memset(out, 0x55, 9);
+	out += 9;
+
+	static uint8_t blk[260];
+	uint8_t cs = 0;
+	blk[0] = 0x07;
+	for (int i = 0; i < 256; i++)
+	{
+		blk[i + 1] = data[i];
+		cs ^= data[i];
+	}
+	blk[257] = cs;
+	blk[258] = 0;
+	blk[259] = 0;
+
+	memset(out, 0xFF, 5);
+	out = gcr_encode(out + 5, blk, 65);
+
+	int gap = (track_h < 18) ? 8 : (track_h < 25) ? 17 : (track_h < 31) ? 12 : 9;
+	memset(out, 0x55, gap);
+	return out + gap;
+}
+
+void c64_gcr_bench()
+{
+	gcr_init_tables();
+
+	static uint8_t bin[GCR_DISK_SECTORS * 256];
+	static uint8_t gcr[GCR_DISK_SECTORS * 360];
+	const uint8_t id[2] = { 0x41, 0x42 };
+	const int loops = 16;
+
+	for (uint32_t i = 0; i < sizeof(bin); i++) bin[i] = (uint8_t)(i * 7 + (i >> 8));
+
+	uint64_t start = profiling_time_us();
+	uint8_t *end = gcr;
+	for (int n = 0; n < loops; n++)
+	{
+		end = gcr;
+		for (uint32_t sec = 0; sec < GCR_DISK_SECTORS; sec++) end = gcr_encode_sector(end, bin + sec * 256, sec % 21, 1 + sec / 21, id);
+	}
+	profiling_bench_report("gcr encode disk", profiling_time_us() - start, loops, sizeof(bin) * loops);
+
+	start = profiling_time_us();
+	for (int n = 0; n < loops; n++) gcr_decode(bin, gcr, (end - gcr) / 5);
+	profiling_bench_report("gcr decode disk", profiling_time_us() - start, loops, (end - gcr) * loops);
+}
@@ -0,0 +1,19 @@
+#ifndef C64_GCR_H
+#define C64_GCR_H
+
+#include <stdint.h>
+
+// 1541 GCR, every 4 bytes are 5 GCR bytes. gcr_init_tables() builds the
+// tables the others use, call it first.
+void gcr_init_tables();
+uint8_t *gcr_encode(uint8_t *out, const uint8_t *bin, int groups);
+void gcr_decode(uint8_t *bin, const uint8_t *gcr, int groups);
+
+// Header and data block of one sector with their syncs and gaps, returns
+// the end of output.
+uint8_t *gcr_encode_sector(uint8_t *out, const uint8_t *data, uint8_t sec, uint8_t track_h, const uint8_t *id);
+
+// Encode/decode throughput on a whole disk, for MiSTer_cmd and the bench.
+void c64_gcr_bench();
+
+#endif
@@ -5,10 +5,194 @@
 #include <string.h>
 #include <inttypes.h>
 #include <time.h>
+#include <atomic>
 #include "../../file_io.h"
+#include "../../offload.h"
 #include "../../cd.h"
 #include "mister_chd.h"
 
+// Decoded hunks of all open CHDs share one LRU cache, so interleaved data,
+// CDDA and subcode reads don't decompress the same hunk over and over.
+#define CHD_CACHE_BYTES (2 * 1024 * 1024)
+#define CHD_CACHE_SLOTS 128
+
+// Hunks ahead of a sequential stream are decoded on the offload thread.
+// libchdr is not reentrant per file, so one job at a time is in flight
+// and the main thread waits for it before touching the same file.
+#define CHD_PREFETCH_HUNKS 2
+#define CHD_STREAMS 4
+
+enum
+{
+	HUNK_VALID = 0,
+	HUNK_LOADING,
+	HUNK_FAILED
+};
+
+struct chd_hunk_t
+{
+	chd_file *chd;
+	int hunknum;
+	uint32_t size;
+	uint32_t last_use;
+	uint8_t *buf;
+	std::atomic<int> state;
+};
+
+struct chd_stream_t
+{
+	chd_file *chd;
+	int hunknum;
+	uint32_t last_use;
+};
+
+static chd_hunk_t hunk_cache[CHD_CACHE_SLOTS];
+static chd_hunk_t *hunk_last = NULL;
+static uint32_t hunk_cache_bytes = 0;
+static uint32_t hunk_cache_tick = 0;
+
+static chd_stream_t streams[CHD_STREAMS] = {};
+static chd_file *prefetch_chd = NULL;
+static offload_job_t prefetch_job = 0;
+
+static void hunk_free(chd_hunk_t *h)
+{
+	if (hunk_last == h) hunk_last = NULL;
+	hunk_cache_bytes -= h->size;
+	free(h->buf);
+	h->buf = NULL;
+	h->chd = NULL;
+	h->size = 0;
+}
+
+static chd_hunk_t *hunk_find(chd_file *chd_f, int hunknum)
+{
+	if (hunk_last && hunk_last->chd == chd_f && hunk_last->hunknum == hunknum) return hunk_last;
+
+	for (int i = 0; i < CHD_CACHE_SLOTS; i++)
+	{
+		if (hunk_cache[i].chd == chd_f && hunk_cache[i].hunknum == hunknum) return &hunk_cache[i];
+	}
+	return NULL;
+}
+
+static chd_hunk_t *hunk_lru()
+{
+	chd_hunk_t *lru = NULL;
+	for (int i = 0; i < CHD_CACHE_SLOTS; i++)
+	{
+		chd_hunk_t *h = &hunk_cache[i];
+		if (h->buf && h->state.load(std::memory_order_acquire) != HUNK_LOADING &&
+			(!lru || (int32_t)(h->last_use - lru->last_use) < 0)) lru = h;
+	}
+	return lru;
+}
+
+// returns an unkeyed slot with a buffer of the given size
+static chd_hunk_t *hunk_alloc(uint32_t size)
+{
+	chd_hunk_t *slot = NULL;
+	for (int i = 0; i < CHD_CACHE_SLOTS && !slot; i++)
+	{
+		if (!hunk_cache[i].buf) slot = &hunk_cache[i];
+	}
+
+	// out of slots or over budget, recycle the oldest hunks
+	while (!slot || hunk_cache_bytes + size > CHD_CACHE_BYTES)
+	{
+		chd_hunk_t *lru = hunk_lru();
+		if (!lru) break;
+
+		if (!slot && lru->size == size && hunk_cache_bytes <= CHD_CACHE_BYTES)
+		{
+			if (hunk_last == lru) hunk_last = NULL;
+			lru->chd = NULL;
+			return lru;
+		}
+
+		hunk_free(lru);
+		if (!slot) slot = lru;
+	}
+
+	slot->buf = (uint8_t *)malloc(size);
+	if (!slot->buf) return NULL;
+
+	slot->size = size;
+	hunk_cache_bytes += size;
+	return slot;
+}
+
+static void prefetch_wait(chd_file *chd_f)
+{
+	if (!prefetch_chd || (chd_f && chd_f != prefetch_chd)) return;
+	offload_wait(prefetch_job);
+	prefetch_chd = NULL;
+}
+
+static int prefetch_idle()
+{
+	if (prefetch_chd && !offload_job_done(prefetch_job)) return 0;
+	prefetch_chd = NULL;
+	return 1;
+}
+
+static void prefetch_start(chd_file *chd_f, int hunknum)
+{
+	chd_hunk_t *hunk = hunk_alloc(chd_get_header(chd_f)->hunkbytes);
+	if (!hunk) return;
+
+	hunk->chd = chd_f;
+	hunk->hunknum = hunknum;
+	hunk->last_use = hunk_cache_tick;
+	hunk->state.store(HUNK_LOADING, std::memory_order_relaxed);
+
+	prefetch_job = offload_try_work([hunk, chd_f, hunknum]()
+	{
+		chd_error err = chd_read(chd_f, hunknum, hunk->buf);
+		hunk->state.store((err == CHDERR_NONE) ? HUNK_VALID : HUNK_FAILED, std::memory_order_release);
+	}, OFFLOAD_DECOMPRESS);
+
+	if (prefetch_job) prefetch_chd = chd_f;
+	else hunk_free(hunk);
+}
+
+// queues the first uncached hunk past the given one
+static void prefetch_ahead(chd_file *chd_f, int hunknum)
+{
+	if (!prefetch_idle()) return;
+
+	int total = chd_get_header(chd_f)->totalhunks;
+	for (int i = 1; i <= CHD_PREFETCH_HUNKS && hunknum + i < total; i++)
+	{
+		if (hunk_find(chd_f, hunknum + i)) continue;
+		prefetch_start(chd_f, hunknum + i);
+		break;
+	}
+}
+
+// data and CDDA of one disc interleave, so each file can carry a few
+// independent streams; a stream becomes sequential once it moves by a hunk
+static chd_stream_t *stream_update(chd_file *chd_f, int hunknum)
+{
+	chd_stream_t *lru = &streams[0];
+	for (int i = 0; i < CHD_STREAMS; i++)
+	{
+		chd_stream_t *st = &streams[i];
+		if (st->chd == chd_f && (hunknum == st->hunknum || hunknum == st->hunknum + 1))
+		{
+			st->hunknum = hunknum;
+			st->last_use = hunk_cache_tick;
+			return st;
+		}
+		if ((int32_t)(st->last_use - lru->last_use) < 0) lru = st;
+	}
+
+	lru->chd = chd_f;
+	lru->hunknum = hunknum;
+	lru->last_use = hunk_cache_tick;
+	return NULL;
+}
+
 void lba_to_hunkinfo(chd_file *chd_f, int lba, int *hunknumber, int *hunkoffset)
 {
 	const chd_header *chd_header = chd_get_header(chd_f);
@@ -31,8 +215,11 @@ int mister_chd_log(const char *format, ...)
 chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 {
 	cd_toc->last = -1;
-	
-	chd_error err = chd_open(getFullPath(filename), CHD_OPEN_READ, NULL, &cd_toc->chd_f);
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", getFullPath(filename));
+
+	chd_error err = chd_open(path, CHD_OPEN_READ, NULL, &cd_toc->chd_f);
 	if (err != CHDERR_NONE)
 	{
 		cd_toc->chd_f = NULL;
@@ -54,6 +241,13 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 	int chd_fd = fileno((FILE *)chd_core_file(cd_toc->chd_f)->argp);
 	if (chd_fd) fcntl(chd_fd, F_SETFD, FD_CLOEXEC);
 
+	//Every metadata lookup walks the CHD metadata list from its start
+	if (cd_toc_cache_load(path, cd_toc))
+	{
+		mister_chd_log("Loaded cached TOC: %d tracks, end %d\n", cd_toc->last, cd_toc->end);
+		return CHDERR_NONE;
+	}
+
 	//Load track info
 	int sector_cnt = 0;
 	for (cd_toc->last = 0; cd_toc->last < 99; cd_toc->last++)
@@ -157,10 +351,52 @@ chd_error mister_load_chd(const char *filename, toc_t *cd_toc)
 		mister_chd_log("Track %d: Type: %s PreGap: %d PreGapType: %s Frames: %d start: %d end %d\n", cd_toc->last, track_type, pregap, pgtype, frames, cd_toc->tracks[cd_toc->last].start, cd_toc->tracks[cd_toc->last].end);
 
 	}
+
+	if (cd_toc->last) cd_toc_cache_store(path, cd_toc);
 	return CHDERR_NONE;
 }
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum)
+// decoded hunk from the cache, decodes it on a miss
+static chd_hunk_t *hunk_get(chd_file *chd_f, int hunknum, chd_error *err)
+{
+	chd_hunk_t *hunk = hunk_find(chd_f, hunknum);
+	if (hunk && hunk->state.load(std::memory_order_acquire) != HUNK_VALID)
+	{
+		prefetch_wait(chd_f);
+		if (hunk->state.load(std::memory_order_acquire) != HUNK_VALID)
+		{
+			hunk_free(hunk);
+			hunk = NULL;
+		}
+	}
+
+	if (!hunk)
+	{
+		prefetch_wait(chd_f);
+		hunk = hunk_alloc(chd_get_header(chd_f)->hunkbytes);
+		if (!hunk)
+		{
+			*err = CHDERR_OUT_OF_MEMORY;
+			return NULL;
+		}
+
+		*err = chd_read(chd_f, hunknum, hunk->buf);
+		if (*err != CHDERR_NONE)
+		{
+			hunk_free(hunk);
+			mister_chd_log("ERROR %s\n", chd_error_string(*err));
+			return NULL;
+		}
+		hunk->chd = chd_f;
+		hunk->hunknum = hunknum;
+		hunk->state.store(HUNK_VALID, std::memory_order_relaxed);
+	}
+	hunk->last_use = ++hunk_cache_tick;
+	hunk_last = hunk;
+	return hunk;
+}
+
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf)
 {
 
 	int tmphnum = 0;
@@ -170,17 +406,103 @@ chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, ui
 
 
 	//mister_chd_log("READ LBA: %d, dest_offset: %d sector offset: %d length %d chd_f %p\n", lba, d_offset, s_offset, length, chd_f);
-	if (tmphnum != *hunknum)
+	chd_error err = CHDERR_NONE;
+	chd_hunk_t *hunk = hunk_get(chd_f, tmphnum, &err);
+	if (!hunk) return err;
+
+	int sector_offset = hunkofs * CD_FRAME_SIZE;
+	memcpy(destbuf + d_offset, hunk->buf + sector_offset + s_offset, length);
+
+	if (stream_update(chd_f, tmphnum)) prefetch_ahead(chd_f, tmphnum);
+	return CHDERR_NONE;
+}
+
+chd_error mister_chd_open_hdd(const char *filename, chd_file **chd_f)
+{
+	*chd_f = NULL;
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", getFullPath(filename));
+
+	chd_error err = chd_open(path, CHD_OPEN_READ, NULL, chd_f);
+	if (err != CHDERR_NONE)
 	{
-		chd_error err = chd_read(chd_f, tmphnum, hunkbuf);
-		if (err != CHDERR_NONE)
-		{
-			mister_chd_log("ERROR %s\n", chd_error_string(err));
-			return err;
-		}
-		*hunknum = tmphnum;
+		*chd_f = NULL;
+		return err;
 	}
-	int sector_offset = hunkofs * CD_FRAME_SIZE;
-	memcpy(destbuf + d_offset, hunkbuf + sector_offset + s_offset, length);
+
+	// CD images have 2448 byte units
+	const chd_header *chd_header = chd_get_header(*chd_f);
+	if (!chd_header || chd_header->unitbytes != 512 || !chd_header->hunkbytes || (chd_header->hunkbytes % 512))
+	{
+		chd_close(*chd_f);
+		*chd_f = NULL;
+		return CHDERR_UNSUPPORTED_FORMAT;
+	}
+
+	mister_chd_log("hunkbytes %d logical length %llu\n", chd_header->hunkbytes, chd_header->logicalbytes);
+
+	int chd_fd = fileno((FILE *)chd_core_file(*chd_f)->argp);
+	if (chd_fd) fcntl(chd_fd, F_SETFD, FD_CLOEXEC);
+	return CHDERR_NONE;
+}
+
+chd_error mister_chd_read(chd_file *chd_f, uint64_t offset, uint8_t *destbuf, uint32_t length)
+{
+	uint8_t *start = destbuf;
+	uint32_t hunkbytes = chd_get_header(chd_f)->hunkbytes;
+	int hunknum = -1;
+	int seq = 0;
+
+	while (length)
+	{
+		hunknum = (int)(offset / hunkbytes);
+		uint32_t ofs = (uint32_t)(offset % hunkbytes);
+		uint32_t len = (length < hunkbytes - ofs) ? length : hunkbytes - ofs;
+
+		chd_error err = CHDERR_NONE;
+		chd_hunk_t *hunk = hunk_get(chd_f, hunknum, &err);
+		if (!hunk) return err;
+
+		memcpy(destbuf, hunk->buf + ofs, len);
+
+		// sequential if the first hunk continues a stream, the rest moves it along
+		chd_stream_t *st = stream_update(chd_f, hunknum);
+		if (destbuf == start) seq = (st != NULL);
+		destbuf += len;
+		offset += len;
+		length -= len;
+	}
+
+	if (seq) prefetch_ahead(chd_f, hunknum);
 	return CHDERR_NONE;
 }
+
+void mister_chd_prefetch(chd_file *chd_f, int lba)
+{
+	if (!chd_f || lba < 0) return;
+
+	int hunknum = 0;
+	int hunkofs = 0;
+	lba_to_hunkinfo(chd_f, lba, &hunknum, &hunkofs);
+
+	// arm a stream right at the target so the first read already counts as sequential
+	stream_update(chd_f, hunknum);
+	if (!hunk_find(chd_f, hunknum) && prefetch_idle()) prefetch_start(chd_f, hunknum);
+}
+
+void mister_chd_close(chd_file *chd_f)
+{
+	if (!chd_f) return;
+
+	prefetch_wait(chd_f);
+	for (int i = 0; i < CHD_CACHE_SLOTS; i++)
+	{
+		if (hunk_cache[i].chd == chd_f) hunk_free(&hunk_cache[i]);
+	}
+	for (int i = 0; i < CHD_STREAMS; i++)
+	{
+		if (streams[i].chd == chd_f) streams[i].chd = NULL;
+	}
+	chd_close(chd_f);
+}
@@ -5,7 +5,19 @@
 #include <libchdr/cdrom.h>
 #include "../../cd.h"
 
-chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf, uint8_t *hunkbuf, int *hunknum);
+// reads go through an LRU cache of decoded hunks shared by all open CHDs
+chd_error mister_chd_read_sector(chd_file *chd_f, int lba, uint32_t d_offset, uint32_t s_offset, int length, uint8_t *destbuf);
 chd_error mister_load_chd(const char *filename, toc_t *cd_toc);
 
+// HDD images (512 byte units), reads are byte addressed and share the
+// cache and the stream prefetch with the CD reads
+chd_error mister_chd_open_hdd(const char *filename, chd_file **chd_f);
+chd_error mister_chd_read(chd_file *chd_f, uint64_t offset, uint8_t *destbuf, uint32_t length);
+
+// decodes the hunk holding lba ahead of time, e.g. when CDDA playback seeks
+void mister_chd_prefetch(chd_file *chd_f, int lba);
+
+// drops the cached hunks of the file and closes it
+void mister_chd_close(chd_file *chd_f);
+
 #endif
@@ -42,6 +42,8 @@
 #include "../../cd.h"
 #include <libchdr/chd.h>
 
+#define CD_SUB_BATCH 75
+
 class cdd_t
 {
 public:
@@ -69,9 +71,12 @@ private:
 	int scanOffset;
 	int audioLength;
 	int audioOffset;
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 	int chd_audio_read_lba;
+	cd_cdda_t cdda;
+	__off64_t sub_pos;    // .sub file position of the next sector
+	__off64_t sub_start;  // batch of interleaved subcode
+	int sub_cnt;
+	uint16_t sub_words[CD_SUB_BATCH][48];
 	uint8_t stat[10];
 	uint8_t comm[10];
 
@@ -7,6 +7,7 @@
 
 #include "megacd.h"
 #include "../chd/mister_chd.h"
+#include "../../iotrace.h"
 
 cdd_t cdd;
 
@@ -15,13 +16,14 @@ cdd_t::cdd_t() {
 	loaded = 0;
 	index = 0;
 	lba = 0;
+	sub_pos = 0;
+	sub_start = 0;
+	sub_cnt = 0;
 	scanOffset = 0;
 	isData = 1;
 	status = CD_STAT_NO_DISC;
 	audioLength = 0;
 	audioOffset = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 	CanSendData = NULL;
 
@@ -37,39 +39,6 @@ cdd_t::cdd_t() {
 	stat[9] = 0x4;
 }
 
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if(*instr == 10) instr++;
-		*in = instr;
-	}
-	while (!*out && **in);
-
-	return *out;
-}
-
 
 int cdd_t::LoadCUE(const char* filename) {
 	static char fname[1024 + 10];
@@ -117,6 +86,7 @@ int cdd_t::LoadCUE(const char* filename) {
 			*ptr = 0;
 
 			if(!FileOpen(&this->toc.tracks[this->toc.last].f, fname)) return -1;
+			FileAdvise(&this->toc.tracks[this->toc.last].f, FILE_ADV_SEQUENTIAL);
 
 			printf("\x1b[32mMCD: Open track file: %s\n\x1b[0m", fname);
 
@@ -196,6 +166,7 @@ int cdd_t::LoadCUE(const char* filename) {
 			if (!this->toc.tracks[this->toc.last].f.opened())
 			{
 				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
+				FileAdvise(&this->toc.tracks[this->toc.last].f, FILE_ADV_SEQUENTIAL);
 				this->toc.tracks[this->toc.last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
 				if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
 				{
@@ -258,14 +229,6 @@ int cdd_t::Load(const char *filename)
 			printf("ERROR %s\n", chd_error_string(err));
 			return -1;
 		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
  	} else {
 		return (-1);
 
@@ -273,7 +236,7 @@ int cdd_t::Load(const char *filename)
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	} else {
 		fd_img = &this->toc.tracks[0].f;
 
@@ -311,17 +274,13 @@ int cdd_t::Load(const char *filename)
 
 void cdd_t::Unload()
 {
+	cd_cdda_reset(&this->cdda);
+
 	if (this->loaded)
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -339,6 +298,7 @@ void cdd_t::Unload()
 
 	memset(&this->toc, 0x00, sizeof(this->toc));
 	this->sectorSize = 0;
+	this->sub_cnt = 0;
 }
 
 void cdd_t::Reset() {
@@ -482,7 +442,7 @@ void cdd_t::Update() {
 
 		this->isData = this->toc.tracks[this->index].type;
 
-		if (this->toc.sub.opened()) FileSeek(&this->toc.sub, this->lba * 96, SEEK_SET);
+		this->sub_pos = (__off64_t)this->lba * 96;
 
 		if (this->toc.tracks[this->index].type)
 		{
@@ -911,7 +871,9 @@ void cdd_t::SeekToLBA(int lba, int play) {
 		this->audioOffset = 0;
 	}
 
-	if (this->toc.sub.opened()) FileSeek(&this->toc.sub, lba * 96, SEEK_SET);
+	if (this->toc.chd_f) mister_chd_prefetch(this->toc.chd_f, lba + this->toc.tracks[index].offset);
+
+	this->sub_pos = (__off64_t)lba * 96;
 
 }
 
@@ -919,6 +881,7 @@ void cdd_t::ReadData(uint8_t *buf)
 {
 	if (this->toc.tracks[this->index].type && (this->lba >= 0))
 	{
+		iotrace_add(IOTRACE_CD, 0, IOTRACE_READ, this->lba, this->sectorSize, 1, nullptr);
 
 		if (this->toc.chd_f)
 		{
@@ -928,7 +891,7 @@ void cdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[0].offset, 0, read_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			cd_read_track(&this->toc, 0, this->lba, 1, buf, read_offset, 2048);
 		} else {
 			if (this->sectorSize == 2048)
 			{
@@ -954,46 +917,47 @@ int cdd_t::ReadCDDA(uint8_t *buf)
 		return this->audioLength;
 	}
 
-	if (this->toc.chd_f)
+	for (int i = 0; i < this->audioLength / 2352; i++)
 	{
-		for(int i = 0; i < this->audioLength / 2352; i++)
-		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 2352*i, 0, 2352, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		}
+		cd_cdda_read_toc(&this->cdda, &this->toc, this->index, this->chd_audio_read_lba + i, buf + 2352 * i);
+	}
 
-		//CHD audio requires byteswap. There's probably a better way to do this...
+	if ((this->audioLength / 2352) > 1)
+	{
+		this->chd_audio_read_lba++;
+	}
 
-		for (int swapidx = 0; swapidx < this->audioLength; swapidx += 2)
-		{
-			uint8_t temp = buf[swapidx];
-			buf[swapidx] = buf[swapidx+1];
-			buf[swapidx+1] = temp;
-		}
+	return this->audioLength;
+}
 
-		if ((this->audioLength / 2352) > 1)
-		{
-			this->chd_audio_read_lba++;
-		}
+// For every byte its four 2-bit pairs, one per 16-bit lane, with the low
+// bit at bit 15 and the high bit at bit 7. Row j of the subcode is shifted
+// right by j which stays within the lanes.
+static uint64_t subcode_lut[256];
 
-	} else if (this->toc.tracks[this->index].f.opened()) {
-		FileReadAdv(&this->toc.tracks[this->index].f, buf, this->audioLength);
+static uint64_t subcode_spread(int b)
+{
+	uint64_t v = 0;
+	for (int k = 0; k < 4; k++)
+	{
+		int bits = (b >> (6 - k * 2)) & 3;
+		v |= (uint64_t)(((bits & 1) << 15) | ((bits >> 1) << 7)) << (k * 16);
 	}
-
-	return this->audioLength;
+	return v;
 }
 
 void InterleaveSubcode(uint8_t *subc_data, uint16_t *buf)
 {
-	for(int i = 0, n=0; i < 96; i+=2,n++)
+	if (!subcode_lut[0xFF])
 	{
-		int code = 0;
-		for (int j = 0; j < 8; j++)
-		{
-			int bits = (subc_data[(j * 12) + (i / 8)] >> (6 - (i&6))) & 3;
-			code |= ((bits & 1) << (15 - j));
-			code |= ((bits >> 1) << (7 - j));
-		}
-		buf[n] = code;
+		for (int b = 0; b < 256; b++) subcode_lut[b] = subcode_spread(b);
+	}
+
+	for (int q = 0; q < 12; q++)
+	{
+		uint64_t code = 0;
+		for (int j = 0; j < 8; j++) code |= subcode_lut[subc_data[(j * 12) + q]] >> j;
+		memcpy(buf + q * 4, &code, sizeof(code));
 	}
 }
 
@@ -1005,16 +969,33 @@ int cdd_t::ReadSubcode(uint16_t* buf)
 	{
 		//Just use the read sector call with an offset, since we previously read that sector, it is already in the hunk cache
 		if (this->toc.tracks[this->index].sbc_type == SUBCODE_RW_RAW) {
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, (uint8_t *)buf, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, (uint8_t *)buf);
 		} else if (this->toc.tracks[this->index].sbc_type == SUBCODE_RW) {
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, subc, this->chd_hunkbuf, &this->chd_hunknum);
+			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->index].offset, 0, CD_MAX_SECTOR_DATA, 96, subc);
 			InterleaveSubcode(subc, buf);
 		} else {
 			err = -1;
 		}
 	} else if (this->toc.sub.opened()) {
-		FileReadAdv(&this->toc.sub, subc, 96);
-		InterleaveSubcode(subc, buf);
+		// a second of subcode is read and interleaved at a time
+		if (this->sub_pos < this->sub_start || this->sub_pos >= this->sub_start + this->sub_cnt * 96)
+		{
+			static uint8_t raw[CD_SUB_BATCH * 96];
+			int res = FileReadAt(&this->toc.sub, this->sub_pos, raw, sizeof(raw));
+			this->sub_start = this->sub_pos;
+			this->sub_cnt = (res > 0) ? res / 96 : 0;
+			for (int i = 0; i < this->sub_cnt; i++) InterleaveSubcode(raw + i * 96, this->sub_words[i]);
+		}
+
+		if (this->sub_pos < this->sub_start + this->sub_cnt * 96)
+		{
+			memcpy(buf, this->sub_words[(this->sub_pos - this->sub_start) / 96], 96);
+		}
+		else
+		{
+			memset(buf, 0, 96);
+		}
+		this->sub_pos += 96;
 	} else {
 		err = -1;
 	}
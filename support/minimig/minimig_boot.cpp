@@ -14,7 +14,7 @@
 #include "minimig_fdd.h"
 #include "../../cfg.h"
 
-static uint8_t buffer[1024];
+static uint8_t buffer[BALL_SIZE]; // the largest boot file
 
 static void mem_upload_init(unsigned long addr)
 {
@@ -150,142 +150,77 @@ static void BootEnableMem()
 
 static void BootClearScreen(int adr, int size)
 {
-	int i;
+	static const uint8_t zero[1024] = {};
+
+	size *= 2;
 	mem_upload_init(adr);
-	for (i = 0; i<size; i++)
+	while (size > 0)
 	{
-		mem_write16(0x0000);
-		//mem_write16(i);
+		int len = (size < (int)sizeof(zero)) ? size : (int)sizeof(zero);
+		spi_block_write(zero, 0, len);
+		size -= len;
 	}
 	mem_upload_fini();
 }
 
-static void BootUploadLogo()
+// Reads a whole boot file, a short one is padded with zeros.
+static int BootReadFile(const char *name, int size)
 {
 	fileTYPE file = {};
-	int x, y;
-	int i = 0;
-	int adr;
-
-	if (FileOpen(&file, user_io_make_filepath(HomeDir(), LOGO_FILE)) || FileOpen(&file, LOGO_FILE)) {
-		FileReadSec(&file, buffer);
-		mem_upload_init(SCREEN_BPL1 + LOGO_OFFSET);
-		adr = SCREEN_BPL1 + LOGO_OFFSET;
-		for (y = 0; y<LOGO_HEIGHT; y++)
+	if (!FileOpen(&file, user_io_make_filepath(HomeDir(), name)) && !FileOpen(&file, name)) return 0;
+
+	memset(buffer, 0, size);
+	FileReadAdv(&file, buffer, size);
+	FileClose(&file);
+	return 1;
+}
+
+static void BootUploadBlock(int adr, const uint8_t *data, int size)
+{
+	mem_upload_init(adr);
+	spi_block_write(data, 0, size);
+	mem_upload_fini();
+}
+
+static void BootUploadLogo()
+{
+	if (BootReadFile(LOGO_FILE, LOGO_SIZE))
+	{
+		// the two bitplanes one after the other, a burst per line
+		const uint8_t *src = buffer;
+		for (int y = 0; y < LOGO_HEIGHT; y++, src += LOGO_WIDTH / 8)
 		{
-			for (x = 0; x<LOGO_WIDTH / 16; x++)
-			{
-				if (i == 512)
-				{
-					mem_upload_fini();
-					FileReadSec(&file, buffer);
-					mem_upload_init(adr);
-					i = 0;
-				}
-				spi8(buffer[i++]);
-				spi8(buffer[i++]);
-				//for (tmp=0; tmp<0x80000; tmp++);
-				//printf("i=%03d  x=%03d  y=%03d  dat[0]=0x%08x  dat[1]=0x%08x\n", i, x, y, buffer[i], buffer[i+1]);
-				adr += 2;
-			}
-			mem_upload_fini();
-			mem_upload_init(SCREEN_BPL1 + LOGO_OFFSET + (y + 1)*(SCREEN_WIDTH / 8));
-			adr = SCREEN_BPL1 + LOGO_OFFSET + (y + 1)*(SCREEN_WIDTH / 8);
+			BootUploadBlock(SCREEN_BPL1 + LOGO_OFFSET + y * (SCREEN_WIDTH / 8), src, LOGO_WIDTH / 8);
 		}
-		mem_upload_fini();
-		mem_upload_init(SCREEN_BPL2 + LOGO_OFFSET);
-		adr = SCREEN_BPL2 + LOGO_OFFSET;
-		for (y = 0; y<LOGO_HEIGHT; y++)
+		for (int y = 0; y < LOGO_HEIGHT; y++, src += LOGO_WIDTH / 8)
 		{
-			for (x = 0; x<LOGO_WIDTH / 16; x++)
-			{
-				if (i == 512)
-				{
-					mem_upload_fini();
-					FileReadSec(&file, buffer);
-					mem_upload_init(adr);
-					i = 0;
-				}
-				spi8(buffer[i++]);
-				spi8(buffer[i++]);
-				adr += 2;
-			}
-			mem_upload_fini();
-			mem_upload_init(SCREEN_BPL2 + LOGO_OFFSET + (y + 1)*(SCREEN_WIDTH / 8));
-			adr = SCREEN_BPL2 + LOGO_OFFSET + (y + 1)*(SCREEN_WIDTH / 8);
+			BootUploadBlock(SCREEN_BPL2 + LOGO_OFFSET + y * (SCREEN_WIDTH / 8), src, LOGO_WIDTH / 8);
 		}
-		mem_upload_fini();
-		FileClose(&file);
 	}
 }
 
 static void BootUploadBall()
 {
-	fileTYPE file = {};
-	int x;
-	int i = 0;
-	int adr;
-
-	if (FileOpen(&file, user_io_make_filepath(HomeDir(), BALL_FILE)) || FileOpen(&file, BALL_FILE))
-	{
-		FileReadSec(&file, buffer);
-		mem_upload_init(BALL_ADDRESS);
-		adr = BALL_ADDRESS;
-		for (x = 0; x<BALL_SIZE / 2; x++)
-		{
-			if (i == 512)
-			{
-				mem_upload_fini();
-				FileReadSec(&file, buffer);
-				mem_upload_init(adr);
-				i = 0;
-			}
-			spi8(buffer[i++]);
-			spi8(buffer[i++]);
-			adr += 2;
-		}
-		mem_upload_fini();
-		FileClose(&file);
-	}
+	if (BootReadFile(BALL_FILE, BALL_SIZE)) BootUploadBlock(BALL_ADDRESS, buffer, BALL_SIZE);
 }
 
 static void BootUploadCopper()
 {
-	fileTYPE file = {};
-	int x;
-	int i = 0;
-	int adr;
-
-	if (FileOpen(&file, user_io_make_filepath(HomeDir(), COPPER_FILE)) || FileOpen(&file, COPPER_FILE))
+	if (BootReadFile(COPPER_FILE, COPPER_SIZE))
 	{
-		FileReadSec(&file, buffer);
-		mem_upload_init(COPPER_ADDRESS);
-		adr = COPPER_ADDRESS;
-		for (x = 0; x<COPPER_SIZE / 2; x++)
-		{
-			if (i == 512)
-			{
-				mem_upload_fini();
-				FileReadSec(&file, buffer);
-				mem_upload_init(adr);
-				i = 0;
-			}
-			spi8(buffer[i++]);
-			spi8(buffer[i++]);
-			adr += 2;
-		}
-		mem_upload_fini();
-		FileClose(&file);
+		BootUploadBlock(COPPER_ADDRESS, buffer, COPPER_SIZE);
 	}
 	else {
-		mem_upload_init(COPPER_ADDRESS);
-		mem_write16(0x00e0); mem_write16(0x0008);
-		mem_write16(0x00e2); mem_write16(0x0000);
-		mem_write16(0x00e4); mem_write16(0x0008);
-		mem_write16(0x00e6); mem_write16(0x5000);
-		mem_write16(0x0100); mem_write16(0xa200);
-		mem_write16(0xffff); mem_write16(0xfffe);
-		mem_upload_fini();
+		static const uint8_t copper[] =
+		{
+			0x00, 0xe0, 0x00, 0x08,
+			0x00, 0xe2, 0x00, 0x00,
+			0x00, 0xe4, 0x00, 0x08,
+			0x00, 0xe6, 0x50, 0x00,
+			0x01, 0x00, 0xa2, 0x00,
+			0xff, 0xff, 0xff, 0xfe
+		};
+		BootUploadBlock(COPPER_ADDRESS, copper, sizeof(copper));
 	}
 }
 
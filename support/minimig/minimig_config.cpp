@@ -5,6 +5,11 @@
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <stdlib.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "../../hardware.h"
 #include "../../file_io.h"
@@ -13,6 +18,7 @@
 #include "../../input.h"
 #include "../../cfg.h"
 #include "../../ide.h"
+#include "../../fpga_io.h"
 #include "minimig_boot.h"
 #include "minimig_fdd.h"
 #include "minimig_config.h"
@@ -46,52 +52,119 @@ typedef struct
 mm_configTYPE minimig_config = { };
 static unsigned char romkey[3072];
 
-static void SendFileV2(fileTYPE* file, unsigned char* key, int keysize, int address, int size)
+// the last Kickstart, decrypted, so a config apply with the same ROM
+// doesn't read and decrypt it again
+static struct
 {
-	static uint8_t buf[512];
-	unsigned int keyidx = 0;
-	printf("File size: %dkB\n", size >> 1);
-	printf("[");
-	if (keysize)
+	char name[1024];
+	__off64_t file_size;
+	int keysize;
+	uint8_t *data;
+	uint32_t size;
+} kick = {};
+
+static void rom_decrypt(uint8_t *buf, uint32_t size, const uint8_t *key, int keysize, unsigned int *keyidx)
+{
+	while (size)
 	{
-		// read header
-		FileReadAdv(file, buf, 0xb);
+		uint32_t n = keysize - *keyidx;
+		if (n > size) n = size;
+
+		const uint8_t *k = key + *keyidx;
+		uint32_t i = 0;
+#ifdef __ARM_NEON
+		for (; i + 16 <= n; i += 16) vst1q_u8(buf + i, veorq_u8(vld1q_u8(buf + i), vld1q_u8(k + i)));
+#endif
+		for (; i < n; i++) buf[i] ^= k[i];
+
+		buf += n;
+		size -= n;
+		*keyidx += n;
+		if ((int)*keyidx >= keysize) *keyidx = 0;
 	}
+}
 
-	for (int i = 0; i<size; i++)
+// The core increments the address itself, so every chunk goes out in one
+// frame as a block transfer.
+static void SendMem(const uint8_t *data, int address, uint32_t size)
+{
+	const uint32_t chunk = 16 * 1024;
+
+	printf("File size: %dkB\n", size >> 10);
+	printf("[");
+	for (uint32_t pos = 0; pos < size; pos += chunk)
 	{
-		if (!(i & 31)) printf("*");
-		FileReadAdv(file, buf, 512);
+		printf("*");
+		uint32_t len = (size - pos < chunk) ? size - pos : chunk;
 
-		if (keysize)
-		{
-			// decrypt ROM
-			for (int j = 0; j<512; j++)
-			{
-				buf[j] ^= key[keyidx++];
-				if ((int)keyidx >= keysize) keyidx -= keysize;
-			}
-		}
 		EnableIO();
-		unsigned int adr = address + i * 512;
+		unsigned int adr = address + pos;
 		spi8(UIO_MM2_WR);
 		spi8(adr & 0xff); adr = adr >> 8;
 		spi8(adr & 0xff); adr = adr >> 8;
 		spi8(adr & 0xff); adr = adr >> 8;
 		spi8(adr & 0xff); adr = adr >> 8;
-		for (int j = 0; j<512; j = j + 4)
-		{
-			spi8(buf[j + 0]);
-			spi8(buf[j + 1]);
-			spi8(buf[j + 2]);
-			spi8(buf[j + 3]);
-		}
+		fpga_spi_fast_block_write_8(data + pos, len);
 		DisableIO();
 	}
-
 	printf("]\n");
 }
 
+static void SendFileV2(fileTYPE* file, unsigned char* key, int keysize, int address, int size)
+{
+	static uint8_t buf[64 * 1024];
+	unsigned int keyidx = 0;
+	uint32_t total = size * 512;
+
+	if (keysize)
+	{
+		// read header
+		FileReadAdv(file, buf, 0xb);
+	}
+
+	for (uint32_t pos = 0; pos < total; pos += sizeof(buf))
+	{
+		uint32_t len = (total - pos < sizeof(buf)) ? total - pos : sizeof(buf);
+		int got = FileReadAdv(file, buf, len);
+		if (got < (int)len) memset(buf + (got > 0 ? got : 0), 0, len - (got > 0 ? got : 0));
+
+		if (keysize) rom_decrypt(buf, len, key, keysize, &keyidx);
+		SendMem(buf, address + pos, len);
+	}
+}
+
+static const uint8_t *LoadKickstart(fileTYPE *file, const char *name, int keysize, uint32_t size)
+{
+	if (kick.data && kick.size == size && kick.file_size == file->size && kick.keysize == keysize && !strcmp(kick.name, name))
+	{
+		printf("Kickstart from RAM\n");
+		return kick.data;
+	}
+
+	free(kick.data);
+	kick.data = (uint8_t*)malloc(size);
+	kick.name[0] = 0;
+	if (!kick.data) return nullptr;
+
+	uint8_t hdr[0xb];
+	if (keysize) FileReadAdv(file, hdr, sizeof(hdr));
+	if (FileReadAdv(file, kick.data, size) != (int)size)
+	{
+		BootPrint("Kickstart read error!");
+		free(kick.data);
+		kick.data = nullptr;
+		return nullptr;
+	}
+
+	unsigned int keyidx = 0;
+	if (keysize) rom_decrypt(kick.data, size, romkey, keysize, &keyidx);
+
+	snprintf(kick.name, sizeof(kick.name), "%s", name);
+	kick.file_size = file->size;
+	kick.keysize = keysize;
+	kick.size = size;
+	return kick.data;
+}
 
 static char UploadKickstart(char *name)
 {
@@ -124,19 +197,26 @@ static char UploadKickstart(char *name)
 		for (int i = 0; i < 4; i++) spi8(1);
 		DisableIO();
 
+		const uint8_t *rom;
 		if (file.size == 0x100000) {
 			// 1MB Kickstart ROM
 			BootPrint("Uploading 1MB Kickstart ...");
-			SendFileV2(&file, NULL, 0, 0xe00000, file.size >> 10);
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 10);
+			rom = LoadKickstart(&file, name, 0, 0x100000);
+			if (rom)
+			{
+				SendMem(rom, 0xe00000, 0x80000);
+				SendMem(rom + 0x80000, 0xf80000, 0x80000);
+			}
 			FileClose(&file);
-			return(1);
+			return(rom != nullptr);
 		}
 		else if ((file.size == 8203) && keysize) {
 			// Cloanto encrypted A1000 boot ROM
 			BootPrint("Uploading encrypted A1000 boot ROM");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
+			rom = LoadKickstart(&file, name, keysize, 0x2000);
 			FileClose(&file);
+			if (!rom) return(0);
+			SendMem(rom, 0xf80000, 0x2000);
 			//clear tag (write 0 to $fc0000) to force bootrom to load Kickstart from disk
 			//and not use one which was already there.
 			spi_uio_cmd32_cont(UIO_MM2_WR, 0xfc0000);
@@ -147,52 +227,38 @@ static char UploadKickstart(char *name)
 		else if (file.size == 0x2000) {
 			// 8KB A1000 boot ROM
 			BootPrint("Uploading A1000 boot ROM");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
+			rom = LoadKickstart(&file, name, 0, 0x2000);
 			FileClose(&file);
+			if (!rom) return(0);
+			SendMem(rom, 0xf80000, 0x2000);
 			spi_uio_cmd32_cont(UIO_MM2_WR, 0xfc0000);
 			spi8(0x00);spi8(0x00);
 			DisableIO();
 			return(1);
 		  }
-		else if (file.size == 0x80000) {
+		else if (file.size == 0x80000 || ((file.size == 0x8000b) && keysize)) {
 			// 512KB Kickstart ROM
-			BootPrint("Uploading 512KB Kickstart ...");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name);
-			SendFileV2(&file, NULL, 0, 0xe00000, file.size >> 9);
-			FileClose(&file);
-			return(1);
-		}
-		else if ((file.size == 0x8000b) && keysize) {
-			// 512KB Kickstart ROM
-			BootPrint("Uploading 512 KB Kickstart (Probably Amiga Forever encrypted...)");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name);
-			SendFileV2(&file, romkey, keysize, 0xe00000, file.size >> 9);
-			FileClose(&file);
-			return(1);
-		}
-		else if (file.size == 0x40000) {
-			// 256KB Kickstart ROM
-			BootPrint("Uploading 256 KB Kickstart...");
-			SendFileV2(&file, NULL, 0, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name); // TODO will this work
-			SendFileV2(&file, NULL, 0, 0xfc0000, file.size >> 9);
+			BootPrint((file.size == 0x80000) ? "Uploading 512KB Kickstart ..." : "Uploading 512 KB Kickstart (Probably Amiga Forever encrypted...)");
+			rom = LoadKickstart(&file, name, (file.size == 0x80000) ? 0 : keysize, 0x80000);
+			if (rom)
+			{
+				SendMem(rom, 0xf80000, 0x80000);
+				SendMem(rom, 0xe00000, 0x80000);
+			}
 			FileClose(&file);
-			return(1);
+			return(rom != nullptr);
 		}
-		else if ((file.size == 0x4000b) && keysize) {
+		else if (file.size == 0x40000 || ((file.size == 0x4000b) && keysize)) {
 			// 256KB Kickstart ROM
-			BootPrint("Uploading 256 KB Kickstart (Probably Amiga Forever encrypted...");
-			SendFileV2(&file, romkey, keysize, 0xf80000, file.size >> 9);
-			FileClose(&file);
-			FileOpen(&file, name); // TODO will this work
-			SendFileV2(&file, romkey, keysize, 0xfc0000, file.size >> 9);
+			BootPrint((file.size == 0x40000) ? "Uploading 256 KB Kickstart..." : "Uploading 256 KB Kickstart (Probably Amiga Forever encrypted...");
+			rom = LoadKickstart(&file, name, (file.size == 0x40000) ? 0 : keysize, 0x40000);
+			if (rom)
+			{
+				SendMem(rom, 0xf80000, 0x40000);
+				SendMem(rom, 0xfc0000, 0x40000);
+			}
 			FileClose(&file);
-			return(1);
+			return(rom != nullptr);
 		}
 		else {
 			BootPrint("Unsupported ROM file size!");
@@ -285,7 +351,7 @@ static char* GetConfigurationName(int num, int chk)
 
 int minimig_cfg_save(int num)
 {
-	return FileSaveConfig(GetConfigurationName(num, 0), &minimig_config, sizeof(minimig_config));
+	return FileSaveConfigLater(GetConfigurationName(num, 0), &minimig_config, sizeof(minimig_config));
 }
 
 const char* minimig_get_cfg_info(int num, int label)
@@ -489,8 +555,7 @@ int minimig_cfg_load(int num)
 
 	for (int i = 0; i < 4; i++)
 	{
-		df[i].status = 0;
-		FileClose(&df[i].file);
+		EjectFloppy(&df[i]);
 	}
 
 	// print config to boot screen
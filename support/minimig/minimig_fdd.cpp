@@ -24,11 +24,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 // 2010-01-09   - support for variable number of tracks
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "../../hardware.h"
 #include "../../file_io.h"
 #include "minimig_fdd.h"
 #include "minimig_config.h"
+#include "minimig_mfm.h"
 #include "../../debug.h"
 #include "../../user_io.h"
 #include "../../menu.h"
@@ -51,104 +54,72 @@ unsigned char Error;
 
 #define B2W(a,b) (((((uint16_t)(a))<<8) & 0xFF00) | ((uint16_t)(b) & 0x00FF))
 
-						  // sends the data in the sector buffer to the FPGA, translated into an Amiga floppy format sector
-						  // note that we do not insert clock bits because they will be stripped by the Amiga software anyway
+#define SECTOR_WORDS MFM_SECTOR_WORDS
+#define TRACK_BYTES (SECTOR_COUNT * 512)
+
+// sends the data in the sector buffer to the FPGA, translated into an Amiga floppy format sector
 void SendSector(unsigned char *pData, unsigned char sector, unsigned char track, unsigned char dsksynch, unsigned char dsksyncl)
 {
-	unsigned char checksum[4];
-	unsigned short i;
-	unsigned char x,y;
-	unsigned char *p;
+	uint16_t words[SECTOR_WORDS];
+	mfm_encode_sector(words, pData, sector, track, B2W(dsksynch, dsksyncl));
+	spi_write((uint8_t*)words, sizeof(words), 1);
+}
 
-	// preamble
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
-
-	// synchronization
-	spi_w(B2W(dsksynch, dsksyncl));
-	spi_w(B2W(dsksynch, dsksyncl));
-
-	// odd bits of header
-	x = 0x55;
-	checksum[0] = x;
-	y = (track >> 1) & 0x55;
-	checksum[1] = y;
-	spi_w(B2W(x,y));
-
-	x = (sector >> 1) & 0x55;
-	checksum[2] = x;
-	y = ((11 - sector) >> 1) & 0x55;
-	checksum[3] = y;
-	spi_w(B2W(x, y));
-
-	// even bits of header
-	x = 0x55;
-	checksum[0] ^= x;
-	y = track & 0x55;
-	checksum[1] ^= y;
-	spi_w(B2W(x, y));
-
-	x = sector & 0x55;
-	checksum[2] ^= x;
-	y = (11 - sector) & 0x55;
-	checksum[3] ^= y;
-	spi_w(B2W(x, y));
-
-	// sector label and reserved area (changes nothing to checksum)
-	i = 0x10;
-	while (i--) spi_w(0xAAAA);
+// returns the encoded track from the RAM copy of the disk
+static uint16_t *GetTrackMFM(adfTYPE *drive, unsigned char track, uint16_t dsksync)
+{
+	if (!drive->mfm[track])
+	{
+		drive->mfm[track] = (uint16_t*)malloc(SECTOR_COUNT * SECTOR_WORDS * sizeof(uint16_t));
+		if (!drive->mfm[track]) return NULL;
+		drive->mfm_sync[track] = 0;
+	}
 
-	// send header checksum
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
-	spi_w(B2W(checksum[0] | 0xAA, checksum[1] | 0xAA));
-	spi_w(B2W(checksum[2] | 0xAA, checksum[3] | 0xAA));
-
-	// calculate data checksum
-	checksum[0] = 0;
-	checksum[1] = 0;
-	checksum[2] = 0;
-	checksum[3] = 0;
-
-	p = pData;
-	i = DATA_SIZE / 2 / 4;
-	while (i--)
+	// the sync word is part of every sector, copy protections change it
+	if (drive->mfm_sync[track] != dsksync)
 	{
-		x = *p++;
-		checksum[0] ^= x ^ x >> 1;
-		x = *p++;
-		checksum[1] ^= x ^ x >> 1;
-		x = *p++;
-		checksum[2] ^= x ^ x >> 1;
-		x = *p++;
-		checksum[3] ^= x ^ x >> 1;
+		mfm_encode_track(drive->mfm[track], drive->image + track * TRACK_BYTES, track, dsksync, SECTOR_COUNT);
+		drive->mfm_sync[track] = dsksync;
 	}
 
-	// send data checksum
-	spi_w(0xAAAA);
-	spi_w(0xAAAA);
-	spi_w(B2W(checksum[0] | 0xAA, checksum[1] | 0xAA));
-	spi_w(B2W(checksum[2] | 0xAA, checksum[3] | 0xAA));
+	return drive->mfm[track];
+}
 
-	// odd bits of data field
-	i = DATA_SIZE / 4;
-	p = pData;
-	while (i--)
+static void SendTrackSector(adfTYPE *drive, unsigned char sector, unsigned char track, uint16_t dsksync)
+{
+	uint16_t *mfm = GetTrackMFM(drive, track, dsksync);
+	if (!mfm)
 	{
-		x = (*p++ >> 1) | 0xAA;
-		y = (*p++ >> 1) | 0xAA;
-		spi_w(B2W(x, y));
+		SendSector(drive->image + (track * SECTOR_COUNT + sector) * 512, sector, track, (unsigned char)(dsksync >> 8), (unsigned char)dsksync);
+		return;
 	}
 
-	// even bits of data field
-	i = DATA_SIZE / 4;
-	p = pData;
-	while (i--)
+	spi_write((uint8_t*)(mfm + sector * SECTOR_WORDS), SECTOR_WORDS * sizeof(uint16_t), 1);
+}
+
+// writes a track of the RAM copy back to the file on the offload thread
+static void FlushTrack(adfTYPE *drive, unsigned char track)
+{
+	// keep the writes of a drive in order
+	offload_wait(drive->flush_job);
+	drive->flush_job = 0;
+
+	uint32_t off = track * TRACK_BYTES;
+	unsigned char *data = drive->image + off;
+	unsigned char *copy = (unsigned char*)malloc(TRACK_BYTES);
+	if (!copy)
 	{
-		x = *p++ | 0xAA;
-		y = *p++ | 0xAA;
-		spi_w(B2W(x, y));
+		FileWriteAt(&drive->file, off, data, TRACK_BYTES);
+		return;
 	}
+
+	memcpy(copy, data, TRACK_BYTES);
+	int fd = fileno(drive->file.filp);
+	drive->flush_job = offload_add_work([fd, copy, off]()
+		{
+			if (pwrite(fd, copy, TRACK_BYTES, off) != TRACK_BYTES) printf("FDD: write error at %u.\n", off);
+			free(copy);
+		}, OFFLOAD_IO);
 }
 
 void SendGap(void)
@@ -189,7 +160,7 @@ void ReadTrack(adfTYPE *drive)
 		lba = (drive->track * SECTOR_COUNT) + sector;
 	}
 
-	if (!FileSeekLBA(&drive->file, lba))
+	if (!drive->image && !FileSeekLBA(&drive->file, lba))
 	{
 		return;
 	}
@@ -207,7 +178,7 @@ void ReadTrack(adfTYPE *drive)
 
 	while (1)
 	{
-		FileReadSec(&drive->file, sector_buffer);
+		if (!drive->image) FileReadSec(&drive->file, sector_buffer);
 
 		EnableFpga();
 
@@ -241,7 +212,8 @@ void ReadTrack(adfTYPE *drive)
 			{
 				//GenerateHeader(sector_header, sector_buffer, sector, track, dsksync);
 				//SendSector(sector_header, sector_buffer);
-				SendSector(sector_buffer, sector, track, (unsigned char)(dsksync >> 8), (unsigned char)dsksync);
+				if (drive->image) SendTrackSector(drive, sector, track, dsksync);
+				else SendSector(sector_buffer, sector, track, (unsigned char)(dsksync >> 8), (unsigned char)dsksync);
 
 				if (sector == LAST_SECTOR)
 					SendGap();
@@ -265,7 +237,7 @@ void ReadTrack(adfTYPE *drive)
 			// go to the start of current track
 			sector = 0;
 			lba = drive->track * SECTOR_COUNT;
-			if (!FileSeekLBA(&drive->file, lba))
+			if (!drive->image && !FileSeekLBA(&drive->file, lba))
 			{
 				return;
 			}
@@ -565,13 +537,14 @@ void WriteTrack(adfTYPE *drive)
 	//    drive->track_prev = drive->track + 1; // This causes a read that directly follows a write to the previous track to return bad data.
 	drive->track_prev = -1; // just to force next read from the start of current track
 
+	int written = 0;
 	while (FindSync(drive))
 	{
 		if (GetHeader(&Track, &Sector))
 		{
 			if (Track == drive->track)
 			{
-				if (!FileSeekLBA(&drive->file, lba+Sector))
+				if (!drive->image && !FileSeekLBA(&drive->file, lba+Sector))
 				{
 					return;
 				}
@@ -580,7 +553,13 @@ void WriteTrack(adfTYPE *drive)
 				{
 					if (drive->status & DSK_WRITABLE)
 					{
-						FileWriteSec(&drive->file, sector_buffer);
+						if (drive->image && Sector < SECTOR_COUNT)
+						{
+							memcpy(drive->image + (lba + Sector) * 512, sector_buffer, 512);
+							drive->mfm_sync[drive->track] = 0;
+							written = 1;
+						}
+						else if (!drive->image) FileWriteSec(&drive->file, sector_buffer);
 					}
 					else
 					{
@@ -598,6 +577,8 @@ void WriteTrack(adfTYPE *drive)
 			Info("Write error");
 		}
 	}
+
+	if (written) FlushTrack(drive, drive->track);
 }
 
 void UpdateDriveStatus(void)
@@ -629,6 +610,8 @@ void HandleFDD(unsigned char c1, unsigned char c2)
 // insert floppy image pointed to to by global <file> into <drive>
 void InsertFloppy(adfTYPE *drive, char* path)
 {
+	EjectFloppy(drive);
+
 	int writable = FileCanWrite(path);
 
 	if (!FileOpenEx(&drive->file, path, writable ? O_RDWR | O_SYNC : O_RDONLY))
@@ -647,6 +630,16 @@ void InsertFloppy(adfTYPE *drive, char* path)
 	}
 	drive->tracks = (unsigned char)tracks;
 
+	// keep the whole disk in RAM, track reads never wait for the storage
+	uint32_t size = tracks * TRACK_BYTES;
+	drive->image = (unsigned char*)malloc(size);
+	if (drive->image && (uint32_t)FileReadAdv(&drive->file, drive->image, size) != size)
+	{
+		menu_debugf("Couldn't load the floppy into RAM.\n");
+		free(drive->image);
+		drive->image = NULL;
+	}
+
 	strcpy(drive->name, path);
 
 	// initialize the rest of drive struct
@@ -664,3 +657,21 @@ void InsertFloppy(adfTYPE *drive, char* path)
 	menu_debugf("drive tracks: %u\n", drive->tracks);
 	menu_debugf("drive status: 0x%02X\n", drive->status);
 }
+
+void EjectFloppy(adfTYPE *drive)
+{
+	offload_wait(drive->flush_job);
+	drive->flush_job = 0;
+
+	free(drive->image);
+	drive->image = NULL;
+	for (int i = 0; i < MAX_TRACKS; i++)
+	{
+		free(drive->mfm[i]);
+		drive->mfm[i] = NULL;
+		drive->mfm_sync[i] = 0;
+	}
+
+	drive->status = 0;
+	FileClose(&drive->file);
+}
@@ -2,6 +2,7 @@
 #define __MINIMIG_FDD_H__
 
 #include "../../file_io.h"
+#include "../../offload.h"
 
 // floppy disk interface defs
 #define CMD_RDTRK 0x01
@@ -22,6 +23,10 @@ typedef struct
 	unsigned char track; /*current track*/
 	unsigned char track_prev; /*previous track*/
 	char          name[1024]; /*floppy name*/
+	unsigned char *image; /*whole disk in RAM, NULL if it didn't fit*/
+	uint16_t      *mfm[MAX_TRACKS]; /*encoded tracks, built on first read*/
+	uint16_t      mfm_sync[MAX_TRACKS]; /*sync word of the encoded track, 0 if not valid*/
+	offload_job_t flush_job; /*track write-back in flight*/
 } adfTYPE;
 
 extern unsigned char drives;
@@ -30,6 +35,7 @@ extern adfTYPE df[4];
 void UpdateDriveStatus(void);
 void HandleFDD(unsigned char c1, unsigned char c2);
 void InsertFloppy(adfTYPE *drive, char* path);
+void EjectFloppy(adfTYPE *drive);
 
 #endif
 
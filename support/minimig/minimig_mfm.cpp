@@ -0,0 +1,121 @@
+#include <string.h>
+#include "minimig_mfm.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#define B2W(a,b) (((((uint16_t)(a))<<8) & 0xFF00) | ((uint16_t)(b) & 0x00FF))
+
+// data checksum, xor of every long word with its odd bits
+static uint32_t data_checksum(const uint8_t *p)
+{
+#ifdef __ARM_NEON
+	uint8x16_t acc = vdupq_n_u8(0);
+	for (int i = 0; i < MFM_SECTOR_BYTES; i += 16)
+	{
+		uint8x16_t v = vld1q_u8(p + i);
+		acc = veorq_u8(acc, veorq_u8(v, vshrq_n_u8(v, 1)));
+	}
+
+	uint32x4_t acc32 = vreinterpretq_u32_u8(acc);
+	return vgetq_lane_u32(acc32, 0) ^ vgetq_lane_u32(acc32, 1) ^ vgetq_lane_u32(acc32, 2) ^ vgetq_lane_u32(acc32, 3);
+#else
+	uint8_t c[4] = {};
+	for (int i = 0; i < MFM_SECTOR_BYTES; i++) c[i & 3] ^= p[i] ^ p[i] >> 1;
+
+	uint32_t res;
+	memcpy(&res, c, sizeof(res));
+	return res;
+#endif
+}
+
+// odd (shift 1) or even (shift 0) bits of the data field
+static void data_bits(uint16_t *out, const uint8_t *p, int shift)
+{
+#ifdef __ARM_NEON
+	const uint8x16_t clk = vdupq_n_u8(0xAA);
+	for (int i = 0; i < MFM_SECTOR_BYTES; i += 16)
+	{
+		uint8x16_t v = vld1q_u8(p + i);
+		if (shift) v = vshrq_n_u8(v, 1);
+
+		// byte pairs become big endian words
+		vst1q_u8((uint8_t*)(out + i / 2), vrev16q_u8(vorrq_u8(v, clk)));
+	}
+#else
+	for (int i = 0; i < MFM_SECTOR_BYTES; i += 2)
+	{
+		*out++ = B2W((p[i] >> shift) | 0xAA, (p[i + 1] >> shift) | 0xAA);
+	}
+#endif
+}
+
+void mfm_encode_sector(uint16_t *out, const uint8_t *data, uint8_t sector, uint8_t track, uint16_t sync)
+{
+	uint8_t checksum[4];
+	uint8_t x, y;
+
+	// preamble
+	*out++ = 0xAAAA;
+	*out++ = 0xAAAA;
+
+	// synchronization
+	*out++ = sync;
+	*out++ = sync;
+
+	// odd bits of header
+	x = 0x55;
+	checksum[0] = x;
+	y = (track >> 1) & 0x55;
+	checksum[1] = y;
+	*out++ = B2W(x, y);
+
+	x = (sector >> 1) & 0x55;
+	checksum[2] = x;
+	y = ((11 - sector) >> 1) & 0x55;
+	checksum[3] = y;
+	*out++ = B2W(x, y);
+
+	// even bits of header
+	x = 0x55;
+	checksum[0] ^= x;
+	y = track & 0x55;
+	checksum[1] ^= y;
+	*out++ = B2W(x, y);
+
+	x = sector & 0x55;
+	checksum[2] ^= x;
+	y = (11 - sector) & 0x55;
+	checksum[3] ^= y;
+	*out++ = B2W(x, y);
+
+	// sector label and reserved area (changes nothing to checksum)
+	for (int i = 0; i < 0x10; i++) *out++ = 0xAAAA;
+
+	// header checksum
+	*out++ = 0xAAAA;
+	*out++ = 0xAAAA;
+	*out++ = B2W(checksum[0] | 0xAA, checksum[1] | 0xAA);
+	*out++ = B2W(checksum[2] | 0xAA, checksum[3] | 0xAA);
+
+	// data checksum
+	uint32_t sum = data_checksum(data);
+	memcpy(checksum, &sum, sizeof(checksum));
+	*out++ = 0xAAAA;
+	*out++ = 0xAAAA;
+	*out++ = B2W(checksum[0] | 0xAA, checksum[1] | 0xAA);
+	*out++ = B2W(checksum[2] | 0xAA, checksum[3] | 0xAA);
+
+	// odd, then even bits of data field
+	data_bits(out, data, 1);
+	data_bits(out + MFM_SECTOR_BYTES / 2, data, 0);
+}
+
+void mfm_encode_track(uint16_t *out, const uint8_t *data, uint8_t track, uint16_t sync, int sectors)
+{
+	for (int i = 0; i < sectors; i++)
+	{
+		mfm_encode_sector(out + i * MFM_SECTOR_WORDS, data + i * MFM_SECTOR_BYTES, i, track, sync);
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef __MINIMIG_MFM_H__
+#define __MINIMIG_MFM_H__
+
+#include <stdint.h>
+
+// Amiga floppy format encoder. Clock bits are not inserted since the Amiga
+// software strips them anyway. Words are in the order they go to the FPGA.
+
+#define MFM_SECTOR_BYTES 512
+#define MFM_SECTOR_WORDS 544 // preamble, sync, header, label, checksums, data
+
+void mfm_encode_sector(uint16_t *out, const uint8_t *data, uint8_t sector, uint8_t track, uint16_t sync);
+void mfm_encode_track(uint16_t *out, const uint8_t *data, uint8_t track, uint16_t sync, int sectors);
+
+#endif
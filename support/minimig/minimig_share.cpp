@@ -6,10 +6,12 @@
 #include <sys/statvfs.h>
 #include <dirent.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <map>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include "../../hardware.h"
 #include "../../file_io.h"
@@ -17,6 +19,8 @@
 #include "../../spi.h"
 #include "../../cfg.h"
 #include "../../shmem.h"
+#include "../../offload.h"
+#include "../../sharedir.h"
 #include "miminig_fs_messages.h"
 
 #define SHMEM_ADDR      0x27FF4000
@@ -46,14 +50,17 @@ static uint8_t *shmem = 0;
 static char basepath[1024] = {};
 static int baselen = 0;
 
+typedef sharedir_item_t dir_item_t;
+
 struct lock
 {
 	uint16_t mode;
 	std::string path;
-	std::vector<dirent64> dir_items;
+	std::vector<dir_item_t> dir_items;
 };
 
 static std::map<uint32_t, lock> locks;
+static std::unordered_map<std::string, int> lock_paths; // number of locks per path
 static uint32_t next_key = 1;
 
 static uint32_t get_key()
@@ -74,33 +81,29 @@ static uint32_t add_lock(uint16_t mode, const char* path)
 {
 	uint32_t key = get_key();
 	locks[key] = { mode, path, {} };
+	lock_paths[path]++;
 
 	dbg_print("+ add lock: %d, %s\n", key, path);
 	return key;
 }
 
-static int has_locks(const char* path)
+static void del_lock(uint32_t key)
 {
-	int has = 0;
-	for (const auto &pair : locks)
-	{
-		if (pair.second.path == path)
-		{
-			if (!has)
-			{
-				dbg_print("! path %s has locks:", path);
-			}
+	auto it = locks.find(key);
+	if (it == locks.end()) return;
 
-			has = 1;
-			dbg_print(" %d", pair.first);
-		}
-	}
+	auto path = lock_paths.find(it->second.path);
+	if (path != lock_paths.end() && !--path->second) lock_paths.erase(path);
+	locks.erase(it);
+}
 
-	if (has)
-	{
-		dbg_print("\n");
-	}
-	return has;
+static int has_locks(const char* path)
+{
+	auto it = lock_paths.find(path);
+	if (it == lock_paths.end()) return 0;
+
+	dbg_print("! path %s has %d locks\n", path, it->second);
+	return 1;
 }
 
 static std::map<uint32_t, fileTYPE> open_file_handles;
@@ -120,6 +123,178 @@ static uint32_t get_fp()
 	return fp;
 }
 
+// Read-ahead windows of the files being read sequentially, one per handle
+// for the last RA_SLOTS handles so copies of several files don't evict each
+// other. Once a window is full the following one is read on the offload
+// thread, the request buffer only takes a few KB per packet.
+#define RA_SIZE  (64 * 1024)
+#define RA_SLOTS 4
+
+struct ra_t
+{
+	uint32_t key;
+	uint32_t off;
+	uint32_t len;
+	uint32_t next;      // end of the previous read
+	uint32_t used;
+	uint8_t *buf;
+
+	int ahead;          // the window after this one is (being) read
+	uint32_t ahead_off;
+	int ahead_len;
+	uint8_t *ahead_buf;
+	offload_job_t job;
+};
+
+static uint8_t ra_bufs[RA_SLOTS][2][RA_SIZE];
+static ra_t ra[RA_SLOTS] = {};
+static uint32_t ra_clock = 0;
+
+// The shared memory is uncached and faults on unaligned accesses (which
+// libc memcpy does), words are used only when both sides line up.
+static void __attribute__((noinline, optimize("no-tree-loop-distribute-patterns"))) memcpyb(void *dst, const void *src, int len)
+{
+	uint8_t *d = (uint8_t*)dst;
+	const uint8_t *s = (const uint8_t*)src;
+
+	if (!(((uintptr_t)d ^ (uintptr_t)s) & 3))
+	{
+		while (len > 0 && ((uintptr_t)d & 3))
+		{
+			*d++ = *s++;
+			len--;
+		}
+
+		uint32_t *dw = (uint32_t*)d;
+		const uint32_t *sw = (const uint32_t*)s;
+		for (; len >= 16; len -= 16, dw += 4, sw += 4)
+		{
+			uint32_t a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+			dw[0] = a;
+			dw[1] = b;
+			dw[2] = c;
+			dw[3] = e;
+		}
+		for (; len >= 4; len -= 4) *dw++ = *sw++;
+
+		d = (uint8_t*)dw;
+		s = (const uint8_t*)sw;
+	}
+
+	while (len-- > 0) *d++ = *s++;
+}
+
+static void ra_wait(ra_t *r)
+{
+	if (r->job) offload_wait(r->job);
+	r->job = 0;
+	r->ahead = 0;
+}
+
+static void ra_drop(uint32_t key)
+{
+	for (int i = 0; i < RA_SLOTS; i++)
+	{
+		if (!ra[i].key || (key && ra[i].key != key)) continue;
+		ra_wait(&ra[i]);
+		ra[i].key = 0;
+	}
+}
+
+static ra_t *ra_get(uint32_t key)
+{
+	ra_t *r = &ra[0];
+	for (int i = 0; i < RA_SLOTS; i++)
+	{
+		if (ra[i].key == key)
+		{
+			r = &ra[i];
+			break;
+		}
+		if (ra[i].used < r->used) r = &ra[i];
+	}
+
+	if (!r->buf)
+	{
+		r->buf = ra_bufs[r - ra][0];
+		r->ahead_buf = ra_bufs[r - ra][1];
+	}
+
+	if (r->key != key)
+	{
+		ra_wait(r);
+		r->key = key;
+		r->len = 0;
+		r->next = UINT32_MAX;
+	}
+
+	r->used = ++ra_clock;
+	return r;
+}
+
+static void ra_start_ahead(ra_t *r, fileTYPE *f)
+{
+	uint32_t end = r->off + r->len;
+	if (r->ahead || r->len < RA_SIZE || !f->filp || f->zcache) return;
+
+	// positional reads on the descriptor don't disturb the main thread
+	int fd = fileno(f->filp);
+	r->ahead_len = 0;
+	r->ahead_off = end;
+	r->job = offload_try_work([r, fd, end]()
+	{
+		ssize_t len = pread64(fd, r->ahead_buf, RA_SIZE, end);
+		r->ahead_len = (len < 0) ? -1 : (int)len;
+	}, OFFLOAD_IO);
+	r->ahead = r->job != 0;
+}
+
+static int ra_read(uint32_t key, fileTYPE *f, void *dst, uint32_t sz)
+{
+	uint32_t off = f->offset;
+	ra_t *r = ra_get(key);
+
+	uint32_t end = r->off + r->len;
+	int hit = r->len && off >= r->off && off <= end && (off + sz <= end || r->len < RA_SIZE);
+	if (!hit && r->ahead && off == r->ahead_off && off == r->next)
+	{
+		ra_wait(r);
+		if (r->ahead_len >= 0)
+		{
+			uint8_t *buf = r->buf;
+			r->buf = r->ahead_buf;
+			r->ahead_buf = buf;
+
+			r->off = off;
+			r->len = r->ahead_len;
+			end = off + r->len;
+			hit = off + sz <= end || r->len < RA_SIZE;
+		}
+	}
+
+	if (!hit && (off == r->next || !off) && sz < RA_SIZE)
+	{
+		ra_wait(r);
+
+		int len = FileReadAt(f, off, r->buf, RA_SIZE, -1);
+		if (len < 0) return 0;
+
+		r->off = off;
+		r->len = len;
+		end = off + len;
+		hit = 1;
+	}
+
+	r->next = off + sz;
+	if (!hit) return FileReadAdv(f, dst, sz);
+
+	uint32_t n = (off + sz <= end) ? sz : end - off;
+	memcpyb(dst, r->buf + (off - r->off), n);
+	FileSeek(f, off + n, SEEK_SET);
+	ra_start_ahead(r, f);
+	return n;
+}
+
 static char* find_path(uint32_t key, const char *name)
 {
 	dbg_print("find_path(%d, %s)\n", key, name);
@@ -323,7 +498,7 @@ static int process_request(void *reqres_buffer)
 			FreeLockRequest *req = (FreeLockRequest*)reqres_buffer;
 
 			uint32_t key = SWAP_INT(req->key);
-			locks.erase(key);
+			del_lock(key);
 			dbg_print("  lock: %d\n", key);
 
 			ret = 0;
@@ -409,6 +584,7 @@ static int process_request(void *reqres_buffer)
 
 			int disk_key = 666;
 			static char fn[256];
+			struct stat64 *item_st = nullptr;
 			if (rtype == ACTION_EXAMINE_OBJECT)
 			{
 				dbg_print("  examine first\n");
@@ -423,22 +599,14 @@ static int process_request(void *reqres_buffer)
 				locks[key].dir_items.clear();
 				if (PathIsDir(name, 0))
 				{
-					const char* full_path = getFullPath(name);
-					DIR *d = opendir(full_path);
-					if (!d)
+					const std::vector<dir_item_t> *items = sharedir_get(name, 1);
+					if (!items)
 					{
-						printf("Couldn't open dir: %s\n", full_path);
 						ret = ERROR_OBJECT_WRONG_TYPE;
 						break;
 					}
 
-					struct dirent64 *de;
-					while ((de = readdir64(d)))
-					{
-						if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) continue;
-						locks[key].dir_items.push_back(*de);
-					}
-					closedir(d);
+					locks[key].dir_items = *items;
 				}
 			}
 			else
@@ -458,17 +626,21 @@ static int process_request(void *reqres_buffer)
 				}
 
 				strcat(name, "/");
-				strcat(name, locks[key].dir_items[listed].d_name);
-				memcpy(fn, locks[key].dir_items[listed].d_name, sizeof(fn));
+				strcat(name, locks[key].dir_items[listed].de.d_name);
+				memcpy(fn, locks[key].dir_items[listed].de.d_name, sizeof(fn));
+				item_st = &locks[key].dir_items[listed].st;
 				ret = 0;
 			}
 
 			dbg_print("    name: %s\n", name);
 			dbg_print("    fn: %s\n", fn);
 
+			// entries of a listing come with their stat
+			struct stat64 *st = item_st ? item_st : getPathStat(name);
+
 			int type = 0;
-			if (FileExists(name, 0)) type = ST_FILE;
-			else if (PathIsDir(name, 0)) type = ST_USERDIR;
+			if (st && S_ISREG(st->st_mode)) type = ST_FILE;
+			else if (st && S_ISDIR(st->st_mode)) type = ST_USERDIR;
 			else
 			{
 				ret = ERROR_OBJECT_NOT_FOUND;
@@ -478,7 +650,6 @@ static int process_request(void *reqres_buffer)
 			time_t time = 0;
 			uint32_t size = 0;
 
-			struct stat64 *st = getPathStat(name);
 			if (st)
 			{
 				time = st->st_mtime;
@@ -622,7 +793,7 @@ static int process_request(void *reqres_buffer)
 
 			DISKLED_ON;
 			uint32_t length = SWAP_INT(req->length);
-			length = FileReadAdv(&open_file_handles[key], shmem + DATA_BUFFER, length);
+			length = ra_read(key, &open_file_handles[key], shmem + DATA_BUFFER, length);
 
 			res->actual = SWAP_INT(length);
 			ret = 0;
@@ -645,6 +816,7 @@ static int process_request(void *reqres_buffer)
 
 			DISKLED_ON;
 			uint32_t length = SWAP_INT(req->length);
+			ra_drop(key);
 			length = FileWriteAdv(&open_file_handles[key], shmem + DATA_BUFFER, length);
 
 			res->actual = SWAP_INT(length);
@@ -700,6 +872,7 @@ static int process_request(void *reqres_buffer)
 
 			if (open_file_handles.find(key) != open_file_handles.end())
 			{
+				ra_drop(key);
 				FileClose(&open_file_handles[key]);
 				open_file_handles.erase(key);
 			}
@@ -885,6 +1058,24 @@ static int process_request(void *reqres_buffer)
 		break;
 	}
 
+	switch (rtype)
+	{
+		case ACTION_WRITE:
+			sharedir_written();
+			// fall through
+		case ACTION_FINDOUTPUT:
+		case ACTION_FINDUPDATE:
+		case ACTION_DELETE_OBJECT:
+		case ACTION_RENAME_OBJECT:
+		case ACTION_CREATE_DIR:
+			sharedir_drop();
+			break;
+
+		case ACTION_END:
+			sharedir_close();
+			break;
+	}
+
 	int success = ret ? 0 : 1;
 	reqres->success = SWAP_INT(success);
 	reqres->error_code = SWAP_INT(ret);
@@ -923,8 +1114,11 @@ void minimig_share_poll()
 
 void minimig_share_reset()
 {
+	ra_drop(0);
 	open_file_handles.clear();
 	locks.clear();
+	lock_paths.clear();
+	sharedir_drop();
 	next_fp = 1;
 	next_key = 1;
 }
@@ -2,11 +2,22 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
 
+#include "../../file_io.h"
 #include "../../hardware.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../swap_util.h"
+#include "../../offload.h"
+#include "../../blockdev.h"
+#include "../../crc.h"
+#include "../../launch.h"
 
 #include "miniz.h"
 #include "n64.h"
@@ -24,21 +35,21 @@ static constexpr auto RAM_SIZE = 0x800000U;
 static constexpr auto CARTID_LENGTH = 6U; // Ex: NSME00
 static constexpr auto MD5_LENGTH = 16U;
 static constexpr auto CARTID_PREFIX = "ID:";
-static constexpr auto RESET_OPT = "[0]";
-static constexpr auto RELOAD_SAVE_OPT = "[40]";
-static constexpr auto AUTODETECT_OPT = "[64]";
-static constexpr auto CIC_TYPE_OPT = "[68:65]";
-static constexpr auto NO_EPAK_OPT = "[70]";
-static constexpr auto CPAK_OPT = "[71]";
-static constexpr auto RPAK_OPT = "[72]";
-static constexpr auto TPAK_OPT = "[73]";
-static constexpr auto RTC_OPT = "[74]";
-static constexpr auto SAVE_TYPE_OPT = "[77:75]";
-static constexpr auto SYS_TYPE_OPT = "[80:79]";
-static constexpr auto AUTOPAK_OPT = "[81]";
-static constexpr auto PATCHES_OPT = "[90]";
-static constexpr auto CHEATS_OPT = "[103]";
-static constexpr const char* const CONTROLLER_OPTS[] = { "[51:49]", "[54:52]", "[57:55]", "[60:58]" };
+static constexpr status_opt_t RESET_OPT = user_io_status_opt("[0]");
+static constexpr status_opt_t RELOAD_SAVE_OPT = user_io_status_opt("[40]");
+static constexpr status_opt_t AUTODETECT_OPT = user_io_status_opt("[64]");
+static constexpr status_opt_t CIC_TYPE_OPT = user_io_status_opt("[68:65]");
+static constexpr status_opt_t NO_EPAK_OPT = user_io_status_opt("[70]");
+static constexpr status_opt_t CPAK_OPT = user_io_status_opt("[71]");
+static constexpr status_opt_t RPAK_OPT = user_io_status_opt("[72]");
+static constexpr status_opt_t TPAK_OPT = user_io_status_opt("[73]");
+static constexpr status_opt_t RTC_OPT = user_io_status_opt("[74]");
+static constexpr status_opt_t SAVE_TYPE_OPT = user_io_status_opt("[77:75]");
+static constexpr status_opt_t SYS_TYPE_OPT = user_io_status_opt("[80:79]");
+static constexpr status_opt_t AUTOPAK_OPT = user_io_status_opt("[81]");
+static constexpr status_opt_t PATCHES_OPT = user_io_status_opt("[90]");
+static constexpr status_opt_t CHEATS_OPT = user_io_status_opt("[103]");
+static constexpr status_opt_t CONTROLLER_OPTS[] = { user_io_status_opt("[51:49]"), user_io_status_opt("[54:52]"), user_io_status_opt("[57:55]"), user_io_status_opt("[60:58]") };
 
 // Simple hash function, see: https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
 // (Modified to make it case-insensitive)
@@ -253,27 +264,12 @@ static ByteOrder detect_rom_endianness(const uint8_t* data) {
 }
 
 static void normalize_data(uint8_t* data, size_t size, ByteOrder endianness) {
-	static uint8_t temp0, temp1, temp2;
 	switch (endianness) {
 	case ByteOrder::BYTE_SWAPPED:
-		for (size_t i = 0; i < (size & ~1U); i += 2) {
-			temp0 = data[0];
-			data[0] = data[1];
-			data[1] = temp0;
-			data += 2;
-		}
+		swap16_buf(data, size / 2);
 		break;
 	case ByteOrder::LITTLE_ENDIAN:
-		for (size_t i = 0; i < (size & ~3U); i += 4) {
-			temp0 = data[0];
-			temp1 = data[1];
-			temp2 = data[2];
-			data[0] = data[3];
-			data[1] = temp2;
-			data[2] = temp1;
-			data[3] = temp0;
-			data += 4;
-		}
+		swap32_buf(data, size / 4);
 		break;
 	default:
 		// Do nothing
@@ -658,111 +654,343 @@ static bool parse_and_apply_db_tags(char* tags) {
 	return (system_type != SystemType::UNKNOWN && cic_type != CIC::UNKNOWN);
 }
 
-static bool md5_matches(const char* line, const char* md5) {
-	for (size_t i = MD5_LENGTH * 2; i > 0; --i, line++, md5++) {
-		int c = *line;
-		if (!c || *md5 != tolower(c)) {
-			return false;
-		}
-	}
+static const char* DB_FILE_NAMES[] = {
+	"N64-database_user.txt",
+	"N64-database.txt"
+};
 
-	return true;
+/* The database text files are compiled into hash tables (MD5 -> tags,
+   cart ID -> tags) on first use. The tables are kept in tmpfs and mmap'd,
+   so later loads don't parse the text at all. A table is rebuilt when the
+   mtime or size of its text file changes. */
+static constexpr auto DB_CACHE_DIR = "/tmp/n64db";
+static constexpr uint32_t DB_CACHE_MAGIC = 0x4E444201;
+
+struct db_header {
+	uint32_t magic;
+	uint32_t size;       // of the whole table
+	int64_t src_mtime;
+	int64_t src_size;
+	uint32_t md5_slots;  // power of 2
+	uint32_t id_slots;   // power of 2
+	uint32_t wild_count; // ID patterns with '_' or shorter than a full ID, in file order
+	uint32_t pad;
+};
+
+struct db_md5_slot {
+	uint8_t md5[MD5_LENGTH];
+	uint32_t tags;       // text offset, 0 = empty slot
+};
+
+struct db_id_slot {
+	char id[CARTID_LENGTH];
+	uint8_t len;
+	uint8_t pad;
+	uint32_t order;      // line of the ID among all ID lines
+	uint32_t tags;
+};
+
+struct db_table {
+	const uint8_t* base;
+	size_t size;
+	bool mapped;
+};
+
+static db_table db_tables[sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES)] = {};
+
+static uint32_t db_hash(const void* key, size_t len) {
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) h = (h ^ ((const uint8_t*)key)[i]) * 16777619u;
+	return h;
 }
 
-// Returns numbers of matching characters if match, otherwize 0
-static size_t cart_id_is_match(const char* line, const char* cart_id) {
+static int hex_digit(int c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	c = tolower(c);
+	return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+// Compiles a database text file, the returned table is malloc'd
+static uint8_t* db_build(const char* path, int64_t mtime, int64_t size) {
+	fileTextReader reader = {};
+	if (!FileOpenTextReader(&reader, path)) return nullptr;
+
+	struct db_line {
+		const char* tags;
+		uint8_t key[MD5_LENGTH];
+		uint8_t len;         // 0 = MD5 line
+		uint32_t order;
+	};
+
+	std::vector<db_line> lines;
+	uint32_t md5_count = 0, id_count = 0, wild_count = 0;
+	size_t text_size = 1;
+
 	const auto prefix_len = strlen(CARTID_PREFIX);
+	while (const char* line = FileReadLine(&reader)) {
+		db_line l = {};
 
-	// A valid ID line should start with "ID:"
-	if (strncmp(line, CARTID_PREFIX, prefix_len)) {
-		return 0;
+		if (!strncmp(line, CARTID_PREFIX, prefix_len)) {
+			// '_' = don't care, a space ends the pattern early
+			const char* lp = line + prefix_len;
+			size_t i = 0;
+			while (i < CARTID_LENGTH && lp[i] && !(i && isspace(lp[i]))) i++;
+			if (!i || isspace(lp[0])) continue;
+
+			memcpy(l.key, lp, i);
+			l.len = i;
+			l.order = id_count++;
+			l.tags = lp + i;
+
+			if (i < CARTID_LENGTH || memchr(lp, '_', i)) wild_count++;
+		}
+		else {
+			size_t i = 0;
+			for (; i < MD5_LENGTH * 2; i++) {
+				int d = hex_digit(line[i]);
+				if (d < 0) break;
+				l.key[i / 2] = (l.key[i / 2] << 4) | d;
+			}
+			if (i < MD5_LENGTH * 2) continue;
+
+			l.tags = line + (MD5_LENGTH * 2);
+			md5_count++;
+		}
+
+		text_size += strlen(l.tags) + 1;
+		lines.push_back(l);
 	}
 
-	// Skip the line if it doesn't match our cart_id, '_' = don't care
-	const char* lp = line + prefix_len;
-	for (size_t i = 0; i < CARTID_LENGTH && *lp; i++, lp++) {
-		if (i && isspace(*lp)) {
-			return i; // Early termination
+	uint32_t md5_slots = 16, id_slots = 16;
+	while (md5_slots < md5_count * 2) md5_slots <<= 1;
+	while (id_slots < (id_count - wild_count) * 2) id_slots <<= 1;
+
+	size_t total = sizeof(db_header) + md5_slots * sizeof(db_md5_slot) + (id_slots + wild_count) * sizeof(db_id_slot) + text_size;
+	auto buf = (uint8_t*)calloc(1, total);
+	if (!buf) return nullptr;
+
+	auto hdr = (db_header*)buf;
+	hdr->magic = DB_CACHE_MAGIC;
+	hdr->size = total;
+	hdr->src_mtime = mtime;
+	hdr->src_size = size;
+	hdr->md5_slots = md5_slots;
+	hdr->id_slots = id_slots;
+	hdr->wild_count = wild_count;
+
+	auto md5_tab = (db_md5_slot*)(hdr + 1);
+	auto id_tab = (db_id_slot*)(md5_tab + md5_slots);
+	auto wild = id_tab + id_slots;
+	auto text = (char*)(wild + wild_count);
+	uint32_t text_pos = 1;
+
+	for (const auto& l : lines) {
+		uint32_t tags = text_pos;
+
+		if (!l.len) {
+			// first entry of a hash wins, like the line by line search did
+			uint32_t n = db_hash(l.key, MD5_LENGTH) & (md5_slots - 1);
+			while (md5_tab[n].tags && memcmp(md5_tab[n].md5, l.key, MD5_LENGTH)) n = (n + 1) & (md5_slots - 1);
+			if (md5_tab[n].tags) continue;
+
+			memcpy(md5_tab[n].md5, l.key, MD5_LENGTH);
+			md5_tab[n].tags = tags;
 		}
+		else {
+			db_id_slot* slot;
+			if (l.len < CARTID_LENGTH || memchr(l.key, '_', l.len)) {
+				slot = wild++;
+			}
+			else {
+				uint32_t n = db_hash(l.key, CARTID_LENGTH) & (id_slots - 1);
+				while (id_tab[n].tags && memcmp(id_tab[n].id, l.key, CARTID_LENGTH)) n = (n + 1) & (id_slots - 1);
+				if (id_tab[n].tags) continue;
+				slot = &id_tab[n];
+			}
 
-		if (*lp != '_' && *lp != cart_id[i]) {
-			return 0; // Character didn't match pattern
+			memcpy(slot->id, l.key, l.len);
+			slot->len = l.len;
+			slot->order = l.order;
+			slot->tags = tags;
 		}
+
+		strcpy(text + tags, l.tags);
+		text_pos += strlen(l.tags) + 1;
 	}
 
-	return CARTID_LENGTH;
+	printf("N64 data file %s: %u hashes, %u IDs\n", path, md5_count, id_count);
+	return buf;
 }
 
-static uint8_t detect_rom_settings_in_db(const char* lookup_hash, const char* db_file_name) {
-	fileTextReader reader = {};
+static void db_close(db_table* table) {
+	if (!table->base) return;
 
-	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
+	if (table->mapped) munmap((void*)table->base, table->size);
+	else free((void*)table->base);
+	table->base = nullptr;
+}
 
-	if (!FileOpenTextReader(&reader, full_path)) {
-		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
-		return 0;
+// Returns the table of a database file, compiling it if the text changed
+static const db_header* db_open(size_t idx) {
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", getFullPath(HomeDir()));
+	snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s", DB_FILE_NAMES[idx]);
+
+	struct stat64 st;
+	db_table* table = &db_tables[idx];
+	if (stat64(path, &st)) {
+		db_close(table);
+		printf("Failed to open N64 data file \"%s\".\n", DB_FILE_NAMES[idx]);
+		return nullptr;
+	}
+
+	int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	if (table->base) {
+		auto hdr = (const db_header*)table->base;
+		if (hdr->src_mtime == mtime && hdr->src_size == st.st_size) return hdr;
+		db_close(table);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "%s/%016llX", DB_CACHE_DIR, (unsigned long long)fnv_hash(path));
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		struct stat64 cst;
+		if (!fstat64(fd, &cst) && cst.st_size >= (off64_t)sizeof(db_header)) {
+			void* p = mmap(nullptr, cst.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			if (p != MAP_FAILED) {
+				auto hdr = (const db_header*)p;
+				if (hdr->magic == DB_CACHE_MAGIC && hdr->size == cst.st_size && hdr->src_mtime == mtime && hdr->src_size == st.st_size) {
+					table->base = (const uint8_t*)p;
+					table->size = cst.st_size;
+					table->mapped = true;
+				}
+				else {
+					munmap(p, cst.st_size);
+				}
+			}
+		}
+		close(fd);
+		if (table->base) return (const db_header*)table->base;
 	}
 
-	while (const char* line = FileReadLine(&reader)) {
-		// Skip the line if it doesn't start with our hash
-		if (!md5_matches(line, lookup_hash)) continue;
-
-		const char* s = line + (MD5_LENGTH * 2);
-		char* tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for MD5 %s, but the tag was malformed! (%s)\n", lookup_hash, s);
-			return 2;
-		}
+	uint8_t* buf = db_build(path, mtime, st.st_size);
+	if (!buf) {
+		printf("Failed to open N64 data file \"%s\".\n", DB_FILE_NAMES[idx]);
+		return nullptr;
+	}
 
-		printf("Found ROM entry for MD5 %s: [%s]\n", lookup_hash, tags);
+	table->base = buf;
+	table->size = ((db_header*)buf)->size;
+	table->mapped = false;
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+	mkdir(DB_CACHE_DIR, 0755);
+	char tmp_name[80];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+	fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd >= 0) {
+		bool ok = write(fd, buf, table->size) == (ssize_t)table->size;
+		close(fd);
+		if (!ok || rename(tmp_name, name)) unlink(tmp_name);
 	}
 
-	return 0;
+	return (const db_header*)buf;
 }
 
-static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, const char* db_file_name) {
-	fileTextReader reader = {};
+static const char* db_text(const db_header* db) {
+	auto ids = (const db_id_slot*)((const db_md5_slot*)(db + 1) + db->md5_slots);
+	return (const char*)(ids + db->id_slots + db->wild_count);
+}
 
-	snprintf(full_path, sizeof(full_path), "%s/%s", HomeDir(), db_file_name);
+static const char* db_find_md5(const db_header* db, const uint8_t* md5) {
+	auto md5_tab = (const db_md5_slot*)(db + 1);
+	uint32_t n = db_hash(md5, MD5_LENGTH) & (db->md5_slots - 1);
+	while (md5_tab[n].tags) {
+		if (!memcmp(md5_tab[n].md5, md5, MD5_LENGTH)) return db_text(db) + md5_tab[n].tags;
+		n = (n + 1) & (db->md5_slots - 1);
+	}
 
-	if (!FileOpenTextReader(&reader, full_path)) {
-		printf("Failed to open N64 data file \"%s\".\n", db_file_name);
-		return 0;
+	return nullptr;
+}
+
+// First ID line in the file matching cart_id, exact IDs or patterns
+static const char* db_find_id(const db_header* db, const char* cart_id) {
+	auto md5_tab = (const db_md5_slot*)(db + 1);
+	auto id_tab = (const db_id_slot*)(md5_tab + db->md5_slots);
+	auto wild = id_tab + db->id_slots;
+
+	const db_id_slot* found = nullptr;
+	uint32_t n = db_hash(cart_id, CARTID_LENGTH) & (db->id_slots - 1);
+	while (id_tab[n].tags) {
+		if (!memcmp(id_tab[n].id, cart_id, CARTID_LENGTH)) {
+			found = &id_tab[n];
+			break;
+		}
+		n = (n + 1) & (db->id_slots - 1);
 	}
 
-	while (const char* line = FileReadLine(&reader)) {
-		// Skip lines that doesn't start with our ID
-		size_t i;
-		if (!(i = cart_id_is_match(line, cart_id))) continue;
-
-		auto s = line + strlen(CARTID_PREFIX) + i;
-		auto tags = new char[strlen(s) + 1];
-		if (sscanf(s, "%*[ \t]%[^#;]", tags) <= 0) {
-			printf("Found ROM entry for ID [%s], but the tag was malformed! \"%s\".\n", cart_id, s);
-			return 2;
+	for (uint32_t i = 0; i < db->wild_count && (!found || wild[i].order < found->order); i++) {
+		size_t k = 0;
+		while (k < wild[i].len && (wild[i].id[k] == '_' || wild[i].id[k] == cart_id[k])) k++;
+		if (k == wild[i].len) {
+			found = &wild[i];
+			break;
 		}
+	}
+
+	return found ? db_text(db) + found->tags : nullptr;
+}
+
+static uint8_t detect_rom_settings_in_db(const char* lookup_hash, size_t db_idx) {
+	const db_header* db = db_open(db_idx);
+	if (!db) return 0;
 
-		printf("Found ROM entry for ID [%s]: \"%s\".\n", cart_id, tags);
+	uint8_t md5[MD5_LENGTH];
+	for (size_t i = 0; i < MD5_LENGTH; i++) {
+		int hi = hex_digit(lookup_hash[i * 2]), lo = hex_digit(lookup_hash[i * 2 + 1]);
+		if (hi < 0 || lo < 0) return 0;
+		md5[i] = (hi << 4) | lo;
+	}
+
+	const char* s = db_find_md5(db, md5);
+	if (!s) return 0;
 
-		// 2 = System region and/or CIC wasn't in DB, will need further detection
-		return parse_and_apply_db_tags(tags) ? 3 : 2;
+	std::vector<char> tags(strlen(s) + 1);
+	if (sscanf(s, "%*[ \t]%[^#;]", tags.data()) <= 0) {
+		printf("Found ROM entry for MD5 %s, but the tag was malformed! (%s)\n", lookup_hash, s);
+		return 2;
 	}
 
-	return 0;
+	printf("Found ROM entry for MD5 %s: [%s]\n", lookup_hash, tags.data());
+
+	// 2 = System region and/or CIC wasn't in DB, will need further detection
+	return parse_and_apply_db_tags(tags.data()) ? 3 : 2;
 }
 
-static const char* DB_FILE_NAMES[] = {
-	"N64-database_user.txt",
-	"N64-database.txt"
-};
+static uint8_t detect_rom_settings_in_db_with_cartid(const char* cart_id, size_t db_idx) {
+	const db_header* db = db_open(db_idx);
+	if (!db) return 0;
+
+	const char* s = db_find_id(db, cart_id);
+	if (!s) return 0;
+
+	std::vector<char> tags(strlen(s) + 1);
+	if (sscanf(s, "%*[ \t]%[^#;]", tags.data()) <= 0) {
+		printf("Found ROM entry for ID [%s], but the tag was malformed! \"%s\".\n", cart_id, s);
+		return 2;
+	}
+
+	printf("Found ROM entry for ID [%s]: \"%s\".\n", cart_id, tags.data());
+
+	// 2 = System region and/or CIC wasn't in DB, will need further detection
+	return parse_and_apply_db_tags(tags.data()) ? 3 : 2;
+}
 
 static uint8_t detect_rom_settings_in_dbs_with_md5(const char* lookup_hash) {
 	uint8_t detected = 0;
 	for (auto i = 0U; i < (sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES)); i++) {
-		if ((detected = detect_rom_settings_in_db(lookup_hash, DB_FILE_NAMES[i]))) {
+		if ((detected = detect_rom_settings_in_db(lookup_hash, i))) {
 			break;
 		}
 	}
@@ -784,7 +1012,7 @@ static uint8_t detect_rom_settings_in_dbs_with_cartid(const char* lookup_id) {
 
 	uint8_t detected = 0;
 	for (auto i = 0U; i < (sizeof(DB_FILE_NAMES) / sizeof(*DB_FILE_NAMES)); i++) {
-		if ((detected = detect_rom_settings_in_db_with_cartid(lookup_id, DB_FILE_NAMES[i]))) {
+		if ((detected = detect_rom_settings_in_db_with_cartid(lookup_id, i))) {
 			break;
 		}
 	}
@@ -1163,6 +1391,38 @@ static void get_old_save_path(char* save_path) {
 	}
 }
 
+// Save file of every 512 byte block of the save address space, rebuilt when
+// the layout changes. The images themselves are small enough to be kept
+// mapped by the block cache, which also writes them back in the background.
+static uint32_t save_map_key = ~0U;
+static struct {
+	uint32_t blocks;
+	uint32_t offset[sizeof(save_files) / sizeof(*save_files) + 1];
+	uint8_t file[(0x20000 + 7 * 0x8000) / 512]; // FlashRAM and 7 paks
+} save_map = {};
+
+static int find_save_file(int64_t pos, N64SaveFile** save_file) {
+	uint32_t key = ((uint32_t)get_cart_save_type() << 16) ^ ((uint32_t)(bool)user_io_status_get(TPAK_OPT) << 8) ^ mounted_save_files;
+	if (key != save_map_key) {
+		save_map_key = key;
+		save_map.blocks = 0;
+		for (unsigned char i = 0; i <= mounted_save_files && i < (sizeof(save_map.offset) / sizeof(*save_map.offset)); i++) {
+			save_map.offset[i] = get_save_offset(i);
+			if (!i) continue;
+
+			uint32_t end = save_map.offset[i] >> 9;
+			if (end > sizeof(save_map.file)) end = sizeof(save_map.file);
+			while (save_map.blocks < end) save_map.file[save_map.blocks++] = i - 1;
+		}
+	}
+
+	if (pos < 0 || (pos >> 9) >= save_map.blocks) return -1;
+
+	int idx = save_map.file[pos >> 9];
+	if (!(*save_file = save_files[idx]) || !(*save_file)->is_mounted()) return -1;
+	return idx;
+}
+
 void n64_load_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buffer, uint32_t buffer_size, uint32_t blksz, uint32_t sz) {
 	int invalid = 0;
 	int done = 0;
@@ -1170,28 +1430,26 @@ void n64_load_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 	int64_t pos = lba * blksz;
 	N64SaveFile* save_file;
 
-	do {
-		if ((file_idx >= mounted_save_files) || !(save_file = save_files[file_idx]) || !save_file->is_mounted()) {
-			buffer_lba = -1;
-			invalid = 1;
-			break;
-		}
-		if (pos < get_save_offset(file_idx + 1)) {
-			break;
-		}
-		file_idx++;
-	} while (1);
+	int map_idx = find_save_file(pos, &save_file);
+	if (map_idx < 0) {
+		buffer_lba = -1;
+		invalid = 1;
+	}
+	else {
+		file_idx = map_idx;
+	}
 
 	fileTYPE* image;
 	if (!invalid && (image = save_file->get_image()) && image->size) {
 		diskled_on();
-		pos -= get_save_offset(file_idx);
-		uint32_t read_sz;
-		if (FileSeek(image, pos, SEEK_SET) && (read_sz = FileReadAdv(image, buffer, sz))) {
+		pos -= save_map.offset[file_idx];
+		// pending save writes are only in the block cache
+		int read_sz = blockdev_read(BLOCKDEV_SD(file_idx), image, pos, buffer, sz);
+		if (read_sz > 0) {
 			if ((save_file->type == MemoryType::CPAK) || (save_file->type == MemoryType::TPAK)) {
 				normalize_data(buffer, read_sz, ByteOrder::LITTLE_ENDIAN);
 			}
-			if (read_sz < sz) {
+			if ((uint32_t)read_sz < sz) {
 				// Pad block that wasn't filled completely
 				memset(buffer + read_sz, 0, sz - read_sz);
 			}
@@ -1227,16 +1485,13 @@ void n64_save_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 	int64_t pos = lba * blksz;
 	N64SaveFile* save_file;
 
-	do {
-		if ((file_idx >= mounted_save_files) || !(save_file = save_files[file_idx]) || !save_file->is_mounted()) {
-			invalid = 1;
-			break;
-		}
-		if (pos < get_save_offset(file_idx + 1)) {
-			break;
-		}
-		file_idx++;
-	} while (1);
+	int map_idx = find_save_file(pos, &save_file);
+	if (map_idx < 0) {
+		invalid = 1;
+	}
+	else {
+		file_idx = map_idx;
+	}
 
 	// Fetch sector data from FPGA ...
 	EnableIO();
@@ -1248,7 +1503,7 @@ void n64_save_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 		return;
 	}
 
-	pos -= get_save_offset(file_idx);
+	pos -= save_map.offset[file_idx];
 	fileTYPE* image;
 
 	if (!sz || !(image = save_file->get_image()) || (pos >= image->size)) {
@@ -1260,12 +1515,10 @@ void n64_save_savedata(uint64_t lba, int ack, uint64_t& buffer_lba, uint8_t* buf
 	}
 
 	diskled_on();
-	if (FileSeek(image, pos, SEEK_SET)) {
-		if ((save_file->type == MemoryType::CPAK) || (save_file->type == MemoryType::TPAK)) {
-			normalize_data(buffer, sz, ByteOrder::LITTLE_ENDIAN);
-		}
-		done = FileWriteAdv(image, buffer, sz, -1) >= 0;
+	if ((save_file->type == MemoryType::CPAK) || (save_file->type == MemoryType::TPAK)) {
+		normalize_data(buffer, sz, ByteOrder::LITTLE_ENDIAN);
 	}
+	done = blockdev_write(BLOCKDEV_SD(file_idx), image, pos, buffer, sz) > 0;
 
 	if (done && ((pos + blksz) >= image->size)) {
 		printf("Saved save data to \"%s\". (%lld bytes)\n", get_image_name(file_idx), image->size);
@@ -1297,77 +1550,182 @@ static void mount_all_saves() {
 	}
 }
 
-static int cheat_compare(const volatile uint8_t* mem, const int32_t new_val, const cheat_code_flags flags) {
-	if (flags.cmp_type == ComparisionType::OPTYPE_ALWAYS)
+/* The cheat list is compiled once when it's sent: each code becomes an op
+   with its compare value, access width and the number of chained codes a
+   failed conditional skips precomputed. Consecutive plain writes into the
+   same RDRAM word are merged into single 16/32-bit writes, and compares read
+   whole words instead of single bytes from the uncached mapping. */
+enum cheat_op_flags : uint8_t {
+	CHEAT_OP_INVALID = 0x1,
+	CHEAT_OP_BOOT = 0x2,
+	CHEAT_OP_BOOT_DONE = 0x4,
+	CHEAT_OP_GS_BUTTON = 0x8,
+	CHEAT_OP_CHAINED = 0x10 // skipped by a preceding failed conditional
+};
+
+struct cheat_op {
+	uint32_t address;
+	uint32_t value;     // byte n goes to address + n
+	uint32_t expect;    // compare value, masked and reversed
+	uint32_t src;       // index in cheat_codes
+	uint16_t skip;      // ops to skip if the compare fails
+	uint8_t mask;       // bytes accessed, bit n = address + n
+	uint8_t cmp;
+	uint8_t flags;
+};
+
+static std::vector<cheat_op> cheat_ops;
+
+static bool cheat_op_plain_write(const cheat_op& op) {
+	return !(op.flags & (CHEAT_OP_INVALID | CHEAT_OP_BOOT | CHEAT_OP_GS_BUTTON | CHEAT_OP_CHAINED)) &&
+		op.cmp == (uint8_t)ComparisionType::OPTYPE_ALWAYS && ((op.address & 3) + (32 - __builtin_clz(op.mask))) <= 4;
+}
+
+static void cheats_compile() {
+	cheat_ops.clear();
+	cheat_ops.reserve(cheat_codes_count);
+
+	for (uint32_t i = 0; i < cheat_codes_count; i++) {
+		const cheat_code& code = cheat_codes[i];
+		cheat_op op = {};
+
+		op.address = code.address;
+		op.value = code.replace;
+		op.src = i;
+		op.mask = code.flags.cmp_mask;
+		op.cmp = (uint8_t)code.flags.cmp_type;
+		if ((code.address >= RAM_SIZE) || !code.flags.cmp_mask) op.flags |= CHEAT_OP_INVALID;
+		if (code.flags.is_boot_code) op.flags |= CHEAT_OP_BOOT;
+		if (code.flags.is_gs_button_code) op.flags |= CHEAT_OP_GS_BUTTON;
+		if (code.compare & 0x1) op.flags |= CHEAT_OP_CHAINED;
+
+		for (size_t n = 0; op.mask >> n; n++) {
+			op.expect <<= 8;
+			if (op.mask & (0x1 << n)) op.expect |= (code.replace >> (n * 8)) & 0xff;
+		}
+
+		// merge into the previous write if both go to the same word
+		if (!cheat_ops.empty() && cheat_op_plain_write(op) && cheat_op_plain_write(cheat_ops.back()) &&
+			(cheat_ops.back().address & ~3) == (op.address & ~3)) {
+			cheat_op& prev = cheat_ops.back();
+			uint32_t base = op.address & ~3;
+			uint32_t prev_mask = prev.mask << (prev.address & 3), new_mask = op.mask << (op.address & 3);
+			uint32_t value = prev.value << ((prev.address & 3) * 8), new_value = op.value << ((op.address & 3) * 8);
+
+			uint32_t bytes = 0;
+			for (int n = 0; n < 4; n++) if (new_mask & (1 << n)) bytes |= 0xffU << (n * 8);
+
+			uint32_t mask = prev_mask | new_mask;
+			if (mask == 0xf || mask == 0x3 || mask == 0xc) {
+				prev.address = base;
+				prev.mask = mask;
+				prev.value = (value & ~bytes) | (new_value & bytes);
+				if (mask == 0xc) {
+					prev.address += 2;
+					prev.mask = 0x3;
+					prev.value >>= 16;
+				}
+				continue;
+			}
+		}
+
+		cheat_ops.push_back(op);
+	}
+
+	for (size_t i = 0; i < cheat_ops.size(); i++) {
+		size_t n = i + 1;
+		while (n < cheat_ops.size() && (cheat_ops[n].flags & CHEAT_OP_CHAINED)) n++;
+		cheat_ops[i].skip = n - i - 1;
+	}
+
+	if (cheat_ops.size() != cheat_codes_count) printf("Cheat codes: %u ops after merging writes.\n", (uint32_t)cheat_ops.size());
+}
+
+static uint32_t cheat_read(const volatile uint8_t* rdram, uint32_t address, size_t len) {
+	uint32_t base = address & ~3, shift = (address & 3) * 8;
+	uint64_t v = *(const volatile uint32_t*)(rdram + base);
+	if (shift + len * 8 > 32) {
+		if (base + 4 >= RAM_SIZE) {
+			v = 0;
+			for (size_t n = 0; n < len; n++) v |= (uint64_t)rdram[address + n] << (shift + n * 8);
+		}
+		else {
+			v |= (uint64_t)*(const volatile uint32_t*)(rdram + base + 4) << 32;
+		}
+	}
+
+	return (uint32_t)(v >> shift);
+}
+
+static int cheat_compare(const volatile uint8_t* rdram, const cheat_op* op) {
+	if (op->cmp == (uint8_t)ComparisionType::OPTYPE_ALWAYS)
 		return 1;
 
-	uint32_t old_val_masked = 0, new_val_masked = 0;
+	size_t len = 32 - __builtin_clz(op->mask);
+	uint32_t mem = cheat_read(rdram, op->address, len);
 
 	// Mask and reverse
-	for (size_t i = 0; flags.cmp_mask >> i; i++) {
+	uint32_t old_val_masked = 0;
+	for (size_t i = 0; i < len; i++) {
 		old_val_masked <<= 8;
-		new_val_masked <<= 8;
-		if (flags.cmp_mask & (0x1 << i)) {
-			old_val_masked |= mem[i];
-			new_val_masked |= (new_val >> (i * 8)) & 0xff;
-		}
+		if (op->mask & (0x1 << i)) old_val_masked |= (mem >> (i * 8)) & 0xff;
 	}
 
 	// Return "0" if not equal according to comparision type, so next code will get skipped
-	switch (flags.cmp_type) {
+	switch ((ComparisionType)op->cmp) {
 	case ComparisionType::OPTYPE_EQUALS:
-		return new_val_masked == old_val_masked;
+		return op->expect == old_val_masked;
 	case ComparisionType::OPTYPE_GREATER:
-		return new_val_masked > old_val_masked;
+		return op->expect > old_val_masked;
 	case ComparisionType::OPTYPE_LESS:
-		return new_val_masked < old_val_masked;
+		return op->expect < old_val_masked;
 	case ComparisionType::OPTYPE_GREATER_EQ:
-		return new_val_masked >= old_val_masked;
+		return op->expect >= old_val_masked;
 	case ComparisionType::OPTYPE_LESS_EQ:
-		return new_val_masked <= old_val_masked;
+		return op->expect <= old_val_masked;
 	case ComparisionType::OPTYPE_NOT_EQ:
-		return new_val_masked != old_val_masked;
+		return op->expect != old_val_masked;
 	default:
 		// Unknown comparision type
 		return -1;
 	}
 }
 
-static int cheat_execute(cheat_code* code) {
-	if ((code->address >= RAM_SIZE) || !code->flags.cmp_mask)
+static int cheat_execute(cheat_op* op) {
+	if (op->flags & CHEAT_OP_INVALID)
 		return -1;
 
 	// Boot code, run only once. Skip if already executed.
-	if (code->flags.is_boot_code) {
-		if (code->flags.is_boot_code_executed)
+	if (op->flags & CHEAT_OP_BOOT) {
+		if (op->flags & CHEAT_OP_BOOT_DONE)
 			return 1;
 
-		code->flags.is_boot_code_executed = true;
+		op->flags |= CHEAT_OP_BOOT_DONE;
 	}
 
 	// Game Shark button code. Only run if certain button is pressed. Hard-coded to F5 right now.
-	if (code->flags.is_gs_button_code && !is_key_pressed(63))
+	if ((op->flags & CHEAT_OP_GS_BUTTON) && !is_key_pressed(63))
 		return 1;
 
-	volatile uint8_t* mem = ((volatile uint8_t*)rdram_ptr) + code->address;
-
-	int result = cheat_compare(mem, code->replace, code->flags);
+	int result = cheat_compare((volatile uint8_t*)rdram_ptr, op);
 	if (result != 1) return result;
 
-	if ((code->flags.cmp_mask == 0xf) && !(code->address & 0x3)) {
+	volatile uint8_t* mem = ((volatile uint8_t*)rdram_ptr) + op->address;
+
+	if ((op->mask == 0xf) && !(op->address & 0x3)) {
 		// 32-bit aligned write
-		*(uint32_t*)mem = code->replace;
+		*(volatile uint32_t*)mem = op->value;
 	}
-	else if ((code->flags.cmp_mask == 0x3) && !(code->address & 0x1)) {
+	else if ((op->mask == 0x3) && !(op->address & 0x1)) {
 		// 16-bit aligned write
-		*(uint16_t*)mem = code->replace & 0xffff;
+		*(volatile uint16_t*)mem = op->value & 0xffff;
 	}
 	else {
 		// Write byte-by-byte to memory in big-endian order
-		if (code->flags.cmp_mask & (0x1 << 0)) mem[0] = (code->replace >> (8 * 0)) & 0xff;
-		if (code->flags.cmp_mask & (0x1 << 1)) mem[1] = (code->replace >> (8 * 1)) & 0xff;
-		if (code->flags.cmp_mask & (0x1 << 2)) mem[2] = (code->replace >> (8 * 2)) & 0xff;
-		if (code->flags.cmp_mask & (0x1 << 3)) mem[3] = (code->replace >> (8 * 3)) & 0xff;
+		if (op->mask & (0x1 << 0)) mem[0] = (op->value >> (8 * 0)) & 0xff;
+		if (op->mask & (0x1 << 1)) mem[1] = (op->value >> (8 * 1)) & 0xff;
+		if (op->mask & (0x1 << 2)) mem[2] = (op->value >> (8 * 2)) & 0xff;
+		if (op->mask & (0x1 << 3)) mem[3] = (op->value >> (8 * 3)) & 0xff;
 	}
 
 	return 1;
@@ -1376,6 +1734,7 @@ static int cheat_execute(cheat_code* code) {
 void n64_cheats_send(const void* buf_ptr, const uint32_t size) {
 	cheat_codes = (cheat_code*)buf_ptr;
 	cheat_codes_count = size;
+	cheats_compile();
 }
 
 static unsigned long poll_timer = 0;
@@ -1383,8 +1742,8 @@ static unsigned long poll_timer = 0;
 void n64_reset() {
 	printf("Resetting N64...\n");
 	if (cheat_codes && cheats_loaded() && cheats_enabled()) {
-		for (uint32_t i = 0; i < cheat_codes_count; i++) {
-			cheat_codes[i].flags.is_boot_code_executed = false;
+		for (auto& op : cheat_ops) {
+			op.flags &= ~CHEAT_OP_BOOT_DONE;
 		}
 
 		poll_timer = GetTimer(2500);
@@ -1422,13 +1781,11 @@ void n64_poll() {
 				}
 			}
 			else if (cheat_codes && cheats_enabled()) {
-				for (uint32_t i = 0; i < cheat_codes_count; i++) {
-					switch (cheat_execute(&cheat_codes[i])) {
+				for (size_t i = 0; i < cheat_ops.size(); i++) {
+					switch (cheat_execute(&cheat_ops[i])) {
 					case 0:
 						// Unfullfilled conditional code (DXXXXXXX), skip the next flagged code(s)
-						while ((i < (cheat_codes_count - 1)) && (cheat_codes[i + 1].compare & 0x1)) {
-							i++;
-						}
+						i += cheat_ops[i].skip;
 						// Fall through
 					case 1:
 						// Normal code (8XXXXXXX)
@@ -1436,11 +1793,12 @@ void n64_poll() {
 					}
 
 					// Invalid or unhandled code.
+					const cheat_code& code = cheat_codes[cheat_ops[i].src];
 					printf("Invalid cheat code: %08x\t%08x\t%08x\t%08x !\n",
-						cheat_codes[i].address,
-						cheat_codes[i].compare,
-						cheat_codes[i].replace,
-						*(uint32_t*)&cheat_codes[i].flags);
+						code.address,
+						code.compare,
+						code.replace,
+						*(uint32_t*)&code.flags);
 					Info("Invalid cheat code! Disabling cheats.", 1500);
 					cheats_disable();
 					break;
@@ -1454,6 +1812,8 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 	static uint8_t buf[4096];
 	fileTYPE f;
 
+	launch_phase(LAUNCH_READ);
+
 	if (!FileOpen(&f, name, 1)) {
 		return 0;
 	}
@@ -1558,28 +1918,35 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 	user_io_set_download(1, load_addr ? data_size : 0);
 	ProgressMessage();
 
-	while (data_left) {
-		size_t chunk = (data_left > sizeof(buf)) ? sizeof(buf) : data_left;
+	/* The file is read ahead on the offload pool. Each chunk is normalized once,
+	   then hashed (MD5 and cheat CRC) on a worker while it's sent to the core. */
+	fileReadStream* stream = FileReadStreamStart(&f, data_size);
+	uint8_t* data;
+	size_t chunk;
 
-		FileReadAdv(&f, buf, chunk);
+	while (data_left && (chunk = stream ? FileReadStreamNext(stream, &data) : 0)) {
+		if (chunk > data_left) chunk = data_left;
+		size_t hashed = 0;
 
 		// Perform sanity checks and detect ROM endianness
 		if (is_first_chunk) {
 			if (chunk < 4096) {
 				// Signal end of transmission
 				user_io_set_download(0);
+				FileReadStreamEnd(stream);
+				FileClose(&f);
+				if (mem) shmem_unmap(mem, data_size);
 				*current_rom_path = '\0';
 				printf("Failed to load ROM: must be at least 4096 bytes.\n");
 
 				return 0;
 			}
 
-			rom_endianness = detect_rom_endianness(buf);
+			rom_endianness = detect_rom_endianness(data);
 		}
 
 		// Normalize data to big-endian format, if needed
-		normalize_data(buf, chunk, rom_endianness);
-		MD5Update(&ctx, buf, chunk);
+		normalize_data(data, chunk, rom_endianness);
 
 		if (is_first_chunk) {
 			/* Try to detect ROM settings based on header MD5 hash.
@@ -1587,16 +1954,19 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 			   copy of the context before calling MD5Final, otherwise the file
 			   hash will be incorrect later on. */
 
+			hashed = 4096;
+			MD5Update(&ctx, data, hashed);
+
 			MD5Context ctx_header;
 			memcpy(&ctx_header, &ctx, sizeof(struct MD5Context));
 			MD5Final(md5, &ctx_header);
 			md5_to_hex(md5, md5_hex);
 			printf("Header MD5 hash: %s\n", md5_hex);
 
-			trim(internal_name, 20, (char*)&buf[0x20]);
+			trim(internal_name, 20, (char*)&data[0x20]);
 			rom_settings_detected = detect_rom_settings_in_dbs_with_md5(md5_hex);
-			memcpy(controller_settings, &buf[0x34], sizeof(controller_settings));
-			calc_bootcode_checksums(bootcode_sums, buf);
+			memcpy(controller_settings, &data[0x34], sizeof(controller_settings));
+			calc_bootcode_checksums(bootcode_sums, data);
 
 			/* The first byte (starting at 0x3b) indicates the type of ROM
 				 'N' = Cartridge
@@ -1608,7 +1978,7 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 			   The 4th byte indicates the region and language for the game
 			   The 5th byte indicates the revision of the game */
 
-			auto p_cid = (char*)&buf[0x3b];
+			auto p_cid = (char*)&data[0x3b];
 			for (auto i = 0; i < 4; i++, p_cid++) {
 				if (isalnum(*p_cid)) {
 					cart_id[i] = *p_cid;
@@ -1619,7 +1989,7 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 			}
 
 			if (strncmp(cart_id, "????", 4)) {
-				sprintf(cart_id + 4, "%02X", buf[0x3f]);
+				sprintf(cart_id + 4, "%02X", data[0x3f]);
 				printf("Cartridge ID: %s\n", cart_id);
 			}
 			else {
@@ -1627,25 +1997,41 @@ int n64_rom_tx(const char* name, unsigned char idx, uint32_t load_addr, uint32_t
 			}
 		}
 
+		// CRC32 is used for cheat look-up. Cheat files from gamehacking.org use byte swapped CRC32 for some reason...
+		auto p_ctx = &ctx;
+		auto p_crc = &file_crc;
+		offload_job_t job = offload_add_work([p_ctx, p_crc, data, chunk, hashed]() {
+			MD5Update(p_ctx, data + hashed, chunk - hashed);
+
+			uint8_t swapped[4096];
+			for (size_t pos = 0; pos < chunk; pos += sizeof(swapped)) {
+				size_t sz = (chunk - pos > sizeof(swapped)) ? sizeof(swapped) : chunk - pos;
+				memcpy(swapped, data + pos, sz);
+				normalize_data(swapped, sz, ByteOrder::BYTE_SWAPPED);
+				*p_crc = crc32_update(*p_crc, swapped, sz);
+			}
+		}, OFFLOAD_DECOMPRESS);
+
 		// Copy to DDR memory for fast ROM loading
 		if (mem) {
-			memcpy(write_ptr, buf, chunk);
+			memcpy(write_ptr, data, chunk);
 			write_ptr += chunk;
 		}
 		else {
 			// Fallback to normal (slow) loading
-			user_io_file_tx_data(buf, chunk);
+			user_io_file_tx_data(data, chunk);
 		}
 
 		ProgressMessage("Loading", f.name, data_size - data_left, data_size);
 		data_left -= chunk;
 		is_first_chunk = false;
 
-		// CRC32 is used for cheat look-up. Cheat files from gamehacking.org use byte swapped CRC32 for some reason...
-		normalize_data(buf, chunk, ByteOrder::BYTE_SWAPPED);
-		file_crc = crc32(file_crc, buf, chunk);
+		// the chunk goes back to the reader with the next call
+		offload_wait(job);
 	}
 
+	if (stream) FileReadStreamEnd(stream);
+
 	MD5Final(md5, &ctx);
 	md5_to_hex(md5, md5_hex);
 	printf("File MD5: %s\n", md5_hex);
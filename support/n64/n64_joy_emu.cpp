@@ -8,10 +8,11 @@ static constexpr int MAX_CARDINAL = 85;
 static constexpr float OUTER_DEADZONE = 2.0f;
 static constexpr float WEDGE_BOUNDARY = (float)(MAX_CARDINAL - MAX_DIAG) / MAX_DIAG;
 static constexpr float MAX_DIST = hypotf(MAX_DIAG, MAX_DIAG);
+static constexpr status_opt_t STICK_SWAP_OPT = user_io_status_opt("TV", 1);
 
 void stick_swap(int num, int stick, int* num2, int* stick2)
 {
-	int get = user_io_status_get("TV", 1);
+	int get = user_io_status_get(STICK_SWAP_OPT);
 	int p2 = get & 1;
 	int p3 = get & 2;
 	int swap = get & 4;
@@ -0,0 +1,159 @@
+// Part of Neogeo_MiSTer
+// (C) 2019 Sean 'furrtek' Gonsalves
+
+#include <stdint.h>
+
+#include "../../profiling.h"
+#include "neogeo_convert.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	/*
+	In C ROMs, a word provides two bitplanes for an 8-pixel wide line
+	They're used in pairs to provide 32 bits at once (all four bitplanes)
+	For one sprite tile, bytes are used like this: ([...] represents one 8-pixel wide line)
+	Even ROM					Odd ROM
+	[  40 41  ][  00 01  ]		[  42 43  ][  02 03  ]
+	[  44 45  ][  04 05  ]  	[  46 47  ][  06 07  ]
+	[  48 49  ][  08 09  ]  	[  4A 4B  ][  0A 0B  ]
+	[  4C 4D  ][  0C 0D  ]  	[  4E 4F  ][  0E 0F  ]
+	[  50 51  ][  10 11  ]  	[  52 53  ][  12 13  ]
+	...							...
+	The data read for a given tile line (16 pixels) is always the same, only the rendering order of the pixels can change
+	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 16 pixels of a tile
+	line can be read sequentially: () are 16-bit words, [] is the 4-word burst read
+	[(40 41) (00 01) (42 43) (02 03)]
+	[(44 45) (04 05) (46 47) (06 07)]...
+	Word interleaving is done on the FPGA side to mix the two C ROMs data (even/odd)
+
+	In:  FEDCBA9876 54321 0
+	Out: FEDCBA9876 15432 0
+	*/
+
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+
+	/*
+	0 <- 20
+	1 <- 21
+	2 <- 00
+	3 <- 01
+	4 <- 22
+	5 <- 23
+	6 <- 02
+	7 <- 03
+	...
+
+	00 -> 02
+	01 -> 03
+	02 -> 06
+	03 -> 07
+	...
+	*/
+}
+
+void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
+}
+
+void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
+{
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
+}
+
+void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
+{
+	/*
+	In S ROMs, a byte provides two pixels
+	For one fix tile, bytes are used like this: ([...] represents a pair of pixels)
+	[10][18][00][08]
+	[11][19][01][09]
+	[12][1A][02][0A]
+	[13][1B][03][0B]
+	[14][1C][04][0C]
+	[15][1D][05][0D]
+	[16][1E][06][0E]
+	[17][1F][07][0F]
+	The data read for a given tile line (8 pixels) is always the same
+	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 8 pixels of a tile
+	line can be read sequentially: () are 16-bit words, [] is the 2-word burst read
+	[(10 18) (00 08)]
+	[(11 19) (01 09)]...
+
+	In:  FEDCBA9876543210
+	Out: FEDCBA9876510432
+	*/
+	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
+}
+
+// spr_convert for whole 32 word blocks
+void spr_convert_blocks(const uint16_t* buf_in, uint16_t* buf_out, uint32_t blocks)
+{
+	for (; blocks; blocks--, buf_in += 32, buf_out += 32)
+	{
+#ifdef __ARM_NEON
+		uint16x8x2_t a = { { vld1q_u16(buf_in + 16), vld1q_u16(buf_in) } };
+		uint16x8x2_t b = { { vld1q_u16(buf_in + 24), vld1q_u16(buf_in + 8) } };
+		vst2q_u16(buf_out, a);
+		vst2q_u16(buf_out + 16, b);
+#else
+		for (int i = 0; i < 16; i++)
+		{
+			buf_out[i * 2] = buf_in[16 + i];
+			buf_out[i * 2 + 1] = buf_in[i];
+		}
+#endif
+	}
+}
+
+// Both ROMs of a pair in their 16-bit halves of the DDR words
+void spr_merge(const uint16_t* lo, const uint16_t* hi, uint16_t* buf_out, uint32_t size)
+{
+	uint32_t i = 0;
+#ifdef __ARM_NEON
+	for (; i + 8 <= size; i += 8)
+	{
+		uint16x8x2_t v = { { vld1q_u16(lo + i), vld1q_u16(hi + i) } };
+		vst2q_u16(buf_out + i * 2, v);
+	}
+#endif
+	for (; i < size; i++)
+	{
+		buf_out[i * 2] = lo[i];
+		buf_out[i * 2 + 1] = hi[i];
+	}
+}
+
+void neogeo_convert_bench()
+{
+	static uint16_t buf_in[512 * 1024];
+	static uint16_t buf_out[512 * 1024];
+	const int loops = 8;
+	const uint32_t words = sizeof(buf_in) / 2;
+
+	for (uint32_t i = 0; i < words; i++) buf_in[i] = (uint16_t)(i * 13 + (i >> 9));
+
+	uint64_t start = profiling_time_us();
+	for (int n = 0; n < loops; n++) spr_convert(buf_in, buf_out, words);
+	profiling_bench_report("spr_convert 1MB", profiling_time_us() - start, loops, sizeof(buf_in) * loops);
+
+	start = profiling_time_us();
+	for (int n = 0; n < loops; n++) spr_convert_blocks(buf_in, buf_out, words / 32);
+	profiling_bench_report("spr_convert_blocks 1MB", profiling_time_us() - start, loops, sizeof(buf_in) * loops);
+
+	start = profiling_time_us();
+	for (int n = 0; n < loops; n++) spr_convert_dbl(buf_in, buf_out, words);
+	profiling_bench_report("spr_convert_dbl 1MB", profiling_time_us() - start, loops, sizeof(buf_in) * loops);
+
+	start = profiling_time_us();
+	for (int n = 0; n < loops; n++) spr_merge(buf_in, buf_in + words / 2, buf_out, words / 2);
+	profiling_bench_report("spr_merge 1MB", profiling_time_us() - start, loops, sizeof(buf_in) * loops);
+
+	start = profiling_time_us();
+	for (int n = 0; n < loops; n++) fix_convert((uint8_t*)buf_in, (uint8_t*)buf_out, sizeof(buf_in));
+	profiling_bench_report("fix_convert 1MB", profiling_time_us() - start, loops, sizeof(buf_in) * loops);
+}
@@ -0,0 +1,22 @@
+#ifndef NEOGEO_CONVERT_H
+#define NEOGEO_CONVERT_H
+
+#include <stdint.h>
+
+// C ROM (sprite) and S ROM (fix) layouts for the SDRAM burst reads, sizes
+// are in words for the sprite ones and in bytes for fix_convert.
+void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t size);
+void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t size);
+void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size);
+void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size);
+
+// spr_convert for whole 32 word blocks
+void spr_convert_blocks(const uint16_t* buf_in, uint16_t* buf_out, uint32_t blocks);
+
+// Both ROMs of a pair in their 16-bit halves of the DDR words
+void spr_merge(const uint16_t* lo, const uint16_t* hi, uint16_t* buf_out, uint32_t size);
+
+// Throughput of the conversions on 1MB, for MiSTer_cmd and the bench.
+void neogeo_convert_bench();
+
+#endif
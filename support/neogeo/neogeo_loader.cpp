@@ -2,17 +2,29 @@
 // (C) 2019 Sean 'furrtek' Gonsalves
 
 #include <string.h>
+#include <ctype.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <time.h>   // clock_gettime, CLOCK_REALTIME
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
 #include "neogeo_loader.h"
 #include "neogeocd.h"
+#include "neogeo_convert.h"
 #include "../../sxmlc.h"
 #include "../../user_io.h"
 #include "../../fpga_io.h"
 #include "../../osd.h"
 #include "../../menu.h"
 #include "../../shmem.h"
+#include "../../swap_util.h"
+#include "../../file_io.h"
+#include "../../offload.h"
+#include "../../cfg.h"
+#include "../../launch.h"
 
 struct NeoFile
 {
@@ -28,86 +40,6 @@ struct NeoFile
 	uint8_t Filler2[4096 - 512];	//fill to 4096
 };
 
-static inline void spr_convert(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	/*
-	In C ROMs, a word provides two bitplanes for an 8-pixel wide line
-	They're used in pairs to provide 32 bits at once (all four bitplanes)
-	For one sprite tile, bytes are used like this: ([...] represents one 8-pixel wide line)
-	Even ROM					Odd ROM
-	[  40 41  ][  00 01  ]		[  42 43  ][  02 03  ]
-	[  44 45  ][  04 05  ]  	[  46 47  ][  06 07  ]
-	[  48 49  ][  08 09  ]  	[  4A 4B  ][  0A 0B  ]
-	[  4C 4D  ][  0C 0D  ]  	[  4E 4F  ][  0E 0F  ]
-	[  50 51  ][  10 11  ]  	[  52 53  ][  12 13  ]
-	...							...
-	The data read for a given tile line (16 pixels) is always the same, only the rendering order of the pixels can change
-	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 16 pixels of a tile
-	line can be read sequentially: () are 16-bit words, [] is the 4-word burst read
-	[(40 41) (00 01) (42 43) (02 03)]
-	[(44 45) (04 05) (46 47) (06 07)]...
-	Word interleaving is done on the FPGA side to mix the two C ROMs data (even/odd)
-
-	In:  FEDCBA9876 54321 0
-	Out: FEDCBA9876 15432 0
-	*/
-
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
-
-	/*
-	0 <- 20
-	1 <- 21
-	2 <- 00
-	3 <- 01
-	4 <- 22
-	5 <- 23
-	6 <- 02
-	7 <- 03
-	...
-
-	00 -> 02
-	01 -> 03
-	02 -> 06
-	03 -> 07
-	...
-	*/
-}
-
-static inline void spr_convert_skp(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf_out[i << 1] = buf_in[(i & ~0x1F) | ((i >> 1) & 0xF) | (((i & 1) ^ 1) << 4)];
-}
-
-static inline void spr_convert_dbl(uint16_t* buf_in, uint16_t* buf_out, uint32_t size)
-{
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x3F) | ((i ^ 1) & 1) | ((i >> 1) & 0x1E) | (((i & 2) ^ 2) << 4)];
-}
-
-static void fix_convert(uint8_t* buf_in, uint8_t* buf_out, uint32_t size)
-{
-	/*
-	In S ROMs, a byte provides two pixels
-	For one fix tile, bytes are used like this: ([...] represents a pair of pixels)
-	[10][18][00][08]
-	[11][19][01][09]
-	[12][1A][02][0A]
-	[13][1B][03][0B]
-	[14][1C][04][0C]
-	[15][1D][05][0D]
-	[16][1E][06][0E]
-	[17][1F][07][0F]
-	The data read for a given tile line (8 pixels) is always the same
-	To take advantage of the SDRAM burst read feature, the data can be loaded so that all 8 pixels of a tile
-	line can be read sequentially: () are 16-bit words, [] is the 2-word burst read
-	[(10 18) (00 08)]
-	[(11 19) (01 09)]...
-
-	In:  FEDCBA9876543210
-	Out: FEDCBA9876510432
-	*/
-	for (uint32_t i = 0; i < size; i++) buf_out[i] = buf_in[(i & ~0x1F) | ((i >> 2) & 7) | ((i & 1) << 3) | (((i & 2) << 3) ^ 0x10)];
-}
-
 static const char *get_name(const char *path, const char *name)
 {
 	static char buf[1024];
@@ -139,6 +71,7 @@ static uint32_t neogeo_file_tx(const char* path, const char* name, uint8_t neo_f
 
 	sprintf(name_buf, "%s/%s", path, name);
 	if (!FileOpen(&f, name_buf, 0)) return 0;
+	FileAdvise(&f, FILE_ADV_ONESHOT);
 	if (!size && offset < f.size) size = f.size - offset;
 	if (!size) return 0;
 
@@ -213,29 +146,186 @@ static void make_path(const char *root, const char *name, char *path)
 	strcat(path, name);
 }
 
-extern uint8_t loadbuf[];
-static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
+// Converted C/S ROMs are kept in tmpfs (neogeo_rom_cache_mb) in the layout
+// the core wants, along with the mtimes of their source file and of the
+// romsets.xml they were loaded through. A relaunch only copies them.
+#define NEOCACHE_DIR   "/tmp/neorom"
+#define NEOCACHE_MAGIC 0x4E474301
+#define NEOCACHE_MIN   (64 * 1024)
+#define NEOCACHE_CROM  0x40 // layout type of the C ROMs
+
+struct neocache_t
 {
-	fileTYPE f = {};
-	static char name_buf[1024];
+	uint32_t magic;
+	uint32_t size;
+	int64_t src_mtime;
+	int64_t src_size;
+	int64_t xml_mtime;
+	int64_t xml_size;
+};
 
-	make_path(path, name, name_buf);
-	if (!FileOpen(&f, name_buf, 0)) return 0;
-	if (!size && offset < f.size) size = f.size - offset;
-	if (!size)
+static int64_t neocache_xml_mtime = 0, neocache_xml_size = 0;
+
+static int neocache_stat(const char *path, int64_t *mtime, int64_t *size)
+{
+	struct stat64 st;
+	if (stat64(path, &st)) return 0;
+
+	*mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+	*size = st.st_size;
+	return 1;
+}
+
+// the xml the next ROMs are described by, NULL for .neo files
+static void neocache_set_xml(const char *xml)
+{
+	neocache_xml_mtime = 0;
+	neocache_xml_size = 0;
+	if (xml) neocache_stat(getFullPath(xml), &neocache_xml_mtime, &neocache_xml_size);
+}
+
+// fills the header and the cache file name of a converted ROM
+static int neocache_key(char *name, neocache_t *hdr, const char *src, uint32_t offset, uint32_t size, uint32_t expand, int type, int swap)
+{
+	if (!cfg.neogeo_rom_cache_mb || size < NEOCACHE_MIN) return 0;
+
+	char path[1024];
+	snprintf(path, sizeof(path), "%s", getFullPath(src));
+
+	char key[1200];
+	snprintf(key, sizeof(key), "%s|%u|%u|%u|%d|%d", path, offset, size, expand, type, swap);
+
+	uint32_t hash = 2166136261u;
+	for (const char *p = key; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	sprintf(name, NEOCACHE_DIR "/%08X", hash);
+
+	// members of a zip go by the zip itself
+	char *p = strcasestr(path, ".zip/");
+	if (p) p[4] = 0;
+
+	memset(hdr, 0, sizeof(neocache_t));
+	hdr->magic = NEOCACHE_MAGIC;
+	hdr->size = expand ? expand : size;
+	hdr->xml_mtime = neocache_xml_mtime;
+	hdr->xml_size = neocache_xml_size;
+	return neocache_stat(path, &hdr->src_mtime, &hdr->src_size);
+}
+
+// returns the descriptor positioned at the data if the cached ROM is still valid
+static int neocache_open(const char *name, const neocache_t *hdr)
+{
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return -1;
+
+	neocache_t cur;
+	if (read(fd, &cur, sizeof(cur)) != sizeof(cur) || memcmp(&cur, hdr, sizeof(cur)))
 	{
-		FileClose(&f);
-		return 0;
+		close(fd);
+		unlink(name);
+		return -1;
+	}
+
+	// keeps it off the eviction list for a while
+	utimes(name, NULL);
+	return fd;
+}
+
+static int neocache_read(int fd, void *buf, uint32_t size)
+{
+	uint8_t *p = (uint8_t*)buf;
+	while (size)
+	{
+		ssize_t res = read(fd, p, size);
+		if (res <= 0) return 0;
+		p += res;
+		size -= res;
 	}
+	return 1;
+}
 
-	size *= 2;
+// drops the least recently used ROMs until size more bytes fit into neogeo_rom_cache_mb
+static int neocache_make_room(uint32_t size)
+{
+	uint64_t limit = cfg.neogeo_rom_cache_mb * 1024ULL * 1024ULL;
+	if (size > limit) return 0;
 
-	FileSeek(&f, offset, SEEK_SET);
-	printf("CROM %s (offset %u, size %u) with index %u\n", name, offset, size, index);
-	const char *dispname = get_name(path, name);
+	for (;;)
+	{
+		DIR *d = opendir(NEOCACHE_DIR);
+		if (!d) return 1;
 
-	// Put pairs of bitplanes in the correct order for the core
+		char oldest[300] = {};
+		time_t oldest_time = 0;
+		uint64_t total = 0;
+
+		struct dirent *de;
+		while ((de = readdir(d)))
+		{
+			if (de->d_name[0] == '.') continue;
+
+			char name[300];
+			struct stat st;
+			snprintf(name, sizeof(name), NEOCACHE_DIR "/%s", de->d_name);
+			if (stat(name, &st)) continue;
 
+			total += st.st_size;
+			if (!oldest[0] || st.st_mtime < oldest_time)
+			{
+				strcpy(oldest, name);
+				oldest_time = st.st_mtime;
+			}
+		}
+		closedir(d);
+
+		if (total + size <= limit || !oldest[0]) return total + size <= limit;
+		unlink(oldest);
+	}
+}
+
+// starts a cache file, the data is appended while the ROM is converted
+static int neocache_create(const char *name, const neocache_t *hdr)
+{
+	mkdir(NEOCACHE_DIR, 0755);
+	if (!neocache_make_room(hdr->size + sizeof(neocache_t))) return -1;
+
+	char tmp_name[64];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return -1;
+
+	// the magic is only valid once all data is there
+	neocache_t tmp = *hdr;
+	tmp.magic = 0;
+	if (write(fd, &tmp, sizeof(tmp)) != sizeof(tmp))
+	{
+		close(fd);
+		unlink(tmp_name);
+		return -1;
+	}
+	return fd;
+}
+
+static int neocache_append(int fd, const void *buf, uint32_t size)
+{
+	return fd >= 0 && write(fd, buf, size) == (ssize_t)size;
+}
+
+static void neocache_finish(int fd, const char *name, const neocache_t *hdr, int ok)
+{
+	if (fd < 0) return;
+
+	char tmp_name[64];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+
+	ok = ok && pwrite(fd, hdr, sizeof(neocache_t), 0) == sizeof(neocache_t);
+	close(fd);
+	if (!ok || rename(tmp_name, name)) unlink(tmp_name);
+}
+
+extern uint8_t loadbuf[];
+static uint32_t load_crom_direct(fileTYPE *f, const char *dispname, uint8_t index, uint32_t size)
+{
 	uint32_t remain = size;
 	uint32_t map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
 
@@ -247,13 +337,9 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 
 		//printf("partsz=%d, map_addr=0x%X\n", partsz, map_addr);
 		void *base = shmem_map(map_addr, partsz);
-		if (!base)
-		{
-			FileClose(&f);
-			return 0;
-		}
+		if (!base) return 0;
 
-		FileReadAdv(&f, loadbuf, partsz/2);
+		FileReadAdv(f, loadbuf, partsz/2);
 		spr_convert_skp((uint16_t*)loadbuf, ((uint16_t*)base) + ((index ^ 1) & 1), partsz / 4);
 
 		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
@@ -263,15 +349,187 @@ static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t ind
 		map_addr += partsz;
 	}
 
-	FileClose(&f);
 	ProgressMessage();
-
 	return map_addr - 0x38000000;
 }
 
-static inline void spr_bswap(uint32_t* buf, uint32_t size)
+// The two C ROMs of a pair share the 32-bit words of one DDR region. A
+// converted ROM is kept in RAM until its partner shows up, then both go
+// to DDR in a single pass of whole words instead of scattered halves.
+struct crom_pending_t
+{
+	uint16_t *data;
+	uint32_t size;  // bytes of this ROM, the region is twice as large
+	uint32_t map_addr;
+	uint8_t index;
+};
+
+static crom_pending_t crom_pending = {};
+
+static void crom_write(const crom_pending_t *a, const crom_pending_t *b)
+{
+	uint32_t size = a->size * 2;
+	uint16_t *base = (uint16_t*)shmem_map(a->map_addr, size);
+	if (!base)
+	{
+		printf("CROM: can't map 0x%X (%u bytes)\n", a->map_addr, size);
+		return;
+	}
+
+	if (b)
+	{
+		// ROMs with even index go to the odd halves
+		const crom_pending_t *lo = (a->index & 1) ? a : b;
+		const crom_pending_t *hi = (a->index & 1) ? b : a;
+		spr_merge(lo->data, hi->data, base, a->size / 2);
+	}
+	else
+	{
+		uint16_t *out = base + ((a->index ^ 1) & 1);
+		for (uint32_t i = 0; i < a->size / 2; i++) out[i << 1] = a->data[i];
+	}
+
+	shmem_unmap(base, size);
+}
+
+// writes out a ROM still waiting for its partner
+static void crom_flush()
+{
+	if (!crom_pending.data) return;
+
+	crom_write(&crom_pending, NULL);
+	free(crom_pending.data);
+	crom_pending.data = NULL;
+}
+
+// Reads through the offload read-ahead while the sprite conversion of each
+// chunk is split between the main thread and a worker.
+static int crom_read_convert(fileTYPE *f, const char *dispname, uint16_t *out, uint32_t size)
 {
-	for (uint32_t i = 0; i < size; i++) buf[i] = (buf[i] & 0xFF0000FF) | ((buf[i] & 0xFF00) << 8) | ((buf[i] & 0xFF0000) >> 8);
+	fileReadStream *stream = FileReadStreamStart(f, size);
+	if (!stream) return 0;
+
+	uint32_t done = 0;
+	uint8_t *data;
+	uint32_t chunk;
+
+	ProgressMessage();
+	while ((chunk = FileReadStreamNext(stream, &data)))
+	{
+		if (chunk > size - done) chunk = size - done;
+
+		uint32_t blocks = chunk / 64;
+		uint32_t half = blocks / 2;
+		const uint16_t *in = (const uint16_t*)data;
+		uint16_t *dst = out + done / 2;
+
+		offload_job_t job = offload_add_work([in, dst, half]() { spr_convert_blocks(in, dst, half); }, OFFLOAD_DECOMPRESS);
+		spr_convert_blocks(in + half * 32, dst + half * 32, blocks - half);
+
+		if (chunk & 63)
+		{
+			// the last block of an odd sized ROM
+			uint16_t tmp_in[32] = {}, tmp_out[32];
+			memcpy(tmp_in, data + blocks * 64, chunk & 63);
+			spr_convert_blocks(tmp_in, tmp_out, 1);
+			memcpy(dst + blocks * 32, tmp_out, chunk & 63);
+		}
+
+		offload_wait(job);
+
+		done += chunk;
+		ProgressMessage("Loading", dispname, done, size);
+		if (done >= size) break;
+	}
+
+	FileReadStreamEnd(stream);
+	ProgressMessage();
+
+	return done == size;
+}
+
+static uint32_t load_crom_to_mem(const char* path, const char* name, uint8_t index, uint32_t offset, uint32_t size)
+{
+	fileTYPE f = {};
+	static char name_buf[1024];
+
+	make_path(path, name, name_buf);
+	if (!FileOpen(&f, name_buf, 0)) return 0;
+	FileAdvise(&f, FILE_ADV_ONESHOT);
+	if (!size && offset < f.size) size = f.size - offset;
+	if (!size)
+	{
+		FileClose(&f);
+		return 0;
+	}
+
+	FileSeek(&f, offset, SEEK_SET);
+	printf("CROM %s (offset %u, size %u) with index %u\n", name, offset, size * 2, index);
+	const char *dispname = get_name(path, name);
+
+	crom_pending_t cur = {};
+	cur.size = size;
+	cur.index = index;
+	cur.map_addr = 0x38000000 + (((index - 64) >> 1) * 1024 * 1024);
+
+	// too little RAM to hold it, convert straight into DDR
+	cur.data = (uint16_t*)malloc(size + 64);
+	if (!cur.data)
+	{
+		crom_flush();
+		uint32_t res = load_crom_direct(&f, dispname, index, size * 2);
+		FileClose(&f);
+		return res;
+	}
+
+	char cache_name[64];
+	neocache_t cache_hdr;
+	int cached = 0;
+	int use_cache = neocache_key(cache_name, &cache_hdr, name_buf, offset, size, 0, NEOCACHE_CROM, 0);
+	if (use_cache)
+	{
+		int fd = neocache_open(cache_name, &cache_hdr);
+		if (fd >= 0)
+		{
+			cached = neocache_read(fd, cur.data, size);
+			close(fd);
+			if (cached) printf("CROM %s: converted copy from cache\n", name);
+			else unlink(cache_name);
+		}
+	}
+
+	if (!cached)
+	{
+		if (!crom_read_convert(&f, dispname, cur.data, size))
+		{
+			printf("CROM %s: read error\n", name);
+			free(cur.data);
+			FileClose(&f);
+			return 0;
+		}
+
+		if (use_cache)
+		{
+			int fd = neocache_create(cache_name, &cache_hdr);
+			neocache_finish(fd, cache_name, &cache_hdr, neocache_append(fd, cur.data, size));
+		}
+	}
+	FileClose(&f);
+
+	if (crom_pending.data && crom_pending.index == (index ^ 1) && crom_pending.map_addr == cur.map_addr && crom_pending.size == cur.size)
+	{
+		crom_write(&cur, &crom_pending);
+		free(crom_pending.data);
+		free(cur.data);
+		crom_pending.data = NULL;
+	}
+	else
+	{
+		crom_flush();
+		crom_pending = cur;
+	}
+
+	return cur.map_addr + size * 2 - 0x38000000;
 }
 
 static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_file_type, uint8_t index, uint32_t offset, uint32_t size, uint32_t expand, int swap, uint32_t addr)
@@ -281,6 +539,7 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 
 	make_path(path, name, name_buf);
 	if (!FileOpen(&f, name_buf, 0)) return 0;
+	FileAdvise(&f, FILE_ADV_ONESHOT);
 	if (!size && offset < f.size) size = f.size - offset;
 	if (!size)
 	{
@@ -292,6 +551,32 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 	printf("ROM %s (offset %u, size %u, exp %u, type %u, addr %u) with index %u\n", name, offset, size, expand, neo_file_type, addr, index);
 	const char *dispname = get_name(path, name);
 
+	// raw ROMs have nothing to convert, so they are never cached
+	char cache_name[64];
+	neocache_t cache_hdr;
+	int cache_rd = -1, cache_wr = -1;
+	uint8_t *cache_buf = NULL;
+	if (neo_file_type != NEO_FILE_RAW && neocache_key(cache_name, &cache_hdr, name_buf, offset, size, expand, neo_file_type, swap))
+	{
+		cache_rd = neocache_open(cache_name, &cache_hdr);
+		if (cache_rd >= 0)
+		{
+			printf("ROM %s: converted copy from cache\n", name);
+			FileClose(&f);
+		}
+		else
+		{
+			// converted into RAM first since reading back the uncached DDR is slow
+			cache_buf = (uint8_t*)malloc(LOADBUF_SZ);
+			if (cache_buf) cache_wr = neocache_create(cache_name, &cache_hdr);
+			if (cache_wr < 0)
+			{
+				free(cache_buf);
+				cache_buf = NULL;
+			}
+		}
+	}
+
 	uint32_t remainf = size;
 
 	if(expand) size = expand;
@@ -312,22 +597,37 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 		void *base = shmem_map(map_addr, partsz);
 		if (!base)
 		{
-			FileClose(&f);
+			if (cache_rd >= 0) close(cache_rd);
+			else FileClose(&f);
+			neocache_finish(cache_wr, cache_name, &cache_hdr, 0);
+			free(cache_buf);
 			return 0;
 		}
 
-		if (neo_file_type == NEO_FILE_FIX)
+		void *out = cache_buf ? cache_buf : base;
+		if (cache_rd >= 0)
+		{
+			if (!neocache_read(cache_rd, base, partsz))
+			{
+				printf("ROM %s: cache read error\n", name);
+				shmem_unmap(base, partsz);
+				close(cache_rd);
+				unlink(cache_name);
+				return 0;
+			}
+		}
+		else if (neo_file_type == NEO_FILE_FIX)
 		{
 			memset(loadbuf, 0, partsz);
 			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			fix_convert(loadbuf, (uint8_t*)base, partsz);
+			fix_convert(loadbuf, (uint8_t*)out, partsz);
 		}
 		else if (neo_file_type == NEO_FILE_SPR)
 		{
 			memset(loadbuf, 0, partsz);
 			if (partszf) FileReadAdv(&f, loadbuf, partszf);
-			if (swap) spr_bswap((uint32_t*)loadbuf, partsz / 4);
-			spr_convert_dbl((uint16_t*)loadbuf, (uint16_t*)base, partsz / 2);
+			if (swap) swap32_mid_buf(loadbuf, partsz / 4);
+			spr_convert_dbl((uint16_t*)loadbuf, (uint16_t*)out, partsz / 2);
 		}
 		else
 		{
@@ -335,6 +635,16 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 			if (partszf) FileReadAdv(&f, base, partszf);
 		}
 
+		if (cache_buf)
+		{
+			memcpy(base, cache_buf, partsz);
+			if (!neocache_append(cache_wr, cache_buf, partsz))
+			{
+				neocache_finish(cache_wr, cache_name, &cache_hdr, 0);
+				cache_wr = -1;
+			}
+		}
+
 		ProgressMessage("Loading", dispname, size - (remain - partsz), size);
 
 		shmem_unmap(base, partsz);
@@ -342,7 +652,10 @@ static uint32_t load_rom_to_mem(const char* path, const char* name, uint8_t neo_
 		map_addr += partsz;
 	}
 
-	FileClose(&f);
+	if (cache_rd >= 0) close(cache_rd);
+	else FileClose(&f);
+	neocache_finish(cache_wr, cache_name, &cache_hdr, 1);
+	free(cache_buf);
 	ProgressMessage();
 
 	return size;
@@ -407,6 +720,7 @@ static uint32_t neogeo_tx(const char* path, const char* name, uint8_t neo_file_t
 		return sz;
 	}
 
+	crom_flush();
 	if (crom_sz)
 	{
 		sz = crom_sz;
@@ -543,12 +857,176 @@ static void parse_xml(const char* filename, const SAX_Callbacks* sax, void* user
 	}
 }
 
+// The parsed romsets.xml is kept in tmpfs, so scans (also after a core
+// reload) don't parse it again until it changes.
+#define ROMSETS_DIR   "/tmp"
+#define ROMSETS_NAME  "neogeo_romsets.bin"
+#define ROMSETS_CACHE ROMSETS_DIR "/" ROMSETS_NAME
+#define ROMSETS_MAGIC 0x4E475201
+
+struct romsets_hdr_t
+{
+	uint32_t magic;
+	char path[1024];
+	uint32_t pad;   // no implicit padding in the compared part
+	int64_t mtime;
+	int64_t size;
+	uint32_t count;
+};
+
+static romsets_hdr_t romsets_loaded = {};
+
+static int romsets_load(const romsets_hdr_t *key)
+{
+	int fd = open(ROMSETS_CACHE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	romsets_hdr_t hdr;
+	int ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && !memcmp(&hdr, key, offsetof(romsets_hdr_t, count)) &&
+		hdr.count <= sizeof(roms) / sizeof(roms[0]) &&
+		read(fd, roms, hdr.count * sizeof(rom_info)) == (ssize_t)(hdr.count * sizeof(rom_info));
+	close(fd);
+
+	rom_cnt = ok ? hdr.count : 0;
+	return ok;
+}
+
+// runs on the offload pool, owns buf
+static void romsets_write(uint8_t *buf, size_t size)
+{
+	cache_write(ROMSETS_DIR, ROMSETS_NAME, buf, size, 0);
+	free(buf);
+}
+
+static void romsets_store(const romsets_hdr_t *key)
+{
+	size_t size = sizeof(romsets_hdr_t) + rom_cnt * sizeof(rom_info);
+	uint8_t *buf = (uint8_t*)malloc(size);
+	if (!buf) return;
+
+	romsets_hdr_t *hdr = (romsets_hdr_t*)buf;
+	*hdr = *key;
+	hdr->count = rom_cnt;
+	memcpy(hdr + 1, roms, rom_cnt * sizeof(rom_info));
+
+	offload_add_work([buf, size]() { romsets_write(buf, size); }, OFFLOAD_IO);
+}
+
+// Every set name of romsets.xml (also each one of a ",a,b," list) hashed to
+// its romset, so a directory listing does one lookup per entry. The first
+// romset naming a set wins, as the linear search did.
+#define ROMSET_MAP_SIZE 4096
+
+struct romset_map_t
+{
+	uint32_t hash;
+	uint16_t rom;   // index + 1, 0 - free
+	uint8_t off;
+	uint8_t len;
+};
+
+static romset_map_t romset_map[ROMSET_MAP_SIZE];
+static uint32_t romset_map_cnt = 0;
+
+static uint32_t romset_hash(const char *name, int len)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)tolower((uint8_t)name[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static const romset_map_t *romset_map_get(const char *name, int len, uint32_t hash)
+{
+	for (uint32_t n = hash & (ROMSET_MAP_SIZE - 1);; n = (n + 1) & (ROMSET_MAP_SIZE - 1))
+	{
+		const romset_map_t *m = &romset_map[n];
+		if (!m->rom) return m;
+		if (m->hash == hash && m->len == len && !strncasecmp(roms[m->rom - 1].name + m->off, name, len)) return m;
+	}
+}
+
+static void romset_map_add(uint32_t rom, int off, int len)
+{
+	// the table stays at most half full
+	if (len <= 0 || romset_map_cnt >= ROMSET_MAP_SIZE / 2) return;
+
+	const char *name = roms[rom].name + off;
+	uint32_t hash = romset_hash(name, len);
+	romset_map_t *m = (romset_map_t*)romset_map_get(name, len, hash);
+	if (m->rom) return;
+
+	m->hash = hash;
+	m->rom = rom + 1;
+	m->off = off;
+	m->len = len;
+	romset_map_cnt++;
+}
+
+static void romset_map_build()
+{
+	memset(romset_map, 0, sizeof(romset_map));
+	romset_map_cnt = 0;
+
+	for (uint32_t i = 0; i < rom_cnt; i++)
+	{
+		const char *name = roms[i].name;
+		if (name[0] != ',')
+		{
+			romset_map_add(i, 0, strlen(name));
+			continue;
+		}
+
+		int start = 1;
+		for (int n = 1; name[n] && n < 255; n++)
+		{
+			if (name[n] != ',') continue;
+			romset_map_add(i, start, n - start);
+			start = n + 1;
+		}
+	}
+}
+
+// returns the romset index, first is set if name is the first of a list
+static int romset_map_find(const char *name, int *first)
+{
+	int len = strlen(name);
+	if (!len || len > 255) return -1;
+
+	const romset_map_t *m = romset_map_get(name, len, romset_hash(name, len));
+	if (!m->rom) return -1;
+
+	*first = (roms[m->rom - 1].name[0] != ',') || (m->off == 1);
+	return m->rom - 1;
+}
+
 int neogeo_scan_xml(char *path)
 {
 	static char full_path[1024];
 	sprintf(full_path, "%s/romsets.xml", path);
 	if(!FileExists(full_path)) sprintf(full_path, "%s/%s/romsets.xml", getRootDir(), HomeDir());
 
+	romsets_hdr_t key = {};
+	struct stat64 st;
+	if (!stat64(getFullPath(full_path), &st))
+	{
+		key.magic = ROMSETS_MAGIC;
+		snprintf(key.path, sizeof(key.path), "%s", getFullPath(full_path));
+		key.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		key.size = st.st_size;
+
+		if (romsets_loaded.magic && !memcmp(&romsets_loaded, &key, offsetof(romsets_hdr_t, count))) return rom_cnt;
+		if (romsets_load(&key))
+		{
+			romsets_loaded = key;
+			romset_map_build();
+			return rom_cnt;
+		}
+	}
+
 	SAX_Callbacks sax;
 	SAX_Callbacks_init(&sax);
 
@@ -556,6 +1034,10 @@ int neogeo_scan_xml(char *path)
 	rom_cnt = 0;
 	sax.all_event = xml_scan;
 	parse_xml(full_path, &sax, 0);
+
+	romsets_loaded = key;
+	romset_map_build();
+	if (key.magic) romsets_store(&key);
 	return rom_cnt;
 }
 
@@ -596,28 +1078,14 @@ char *neogeo_get_altname(char *path, char *name, char *altname)
 		if (*altname) return altname;
 	}
 
-	sprintf(full_path, ",%s,", altname);
-	for (uint32_t i = 0; i < rom_cnt; i++)
-	{
-		if (roms[i].name[0] == ',')
-		{
-			char *p = strcasestr(roms[i].name, full_path);
-			if (p)
-			{
-				if (roms[i].hide) return (char*)-1;
-				if(p == roms[i].name) return roms[i].altname;
+	int first;
+	int i = romset_map_find(altname, &first);
+	if (i < 0) return NULL;
+	if (roms[i].hide) return (char*)-1;
+	if (first) return roms[i].altname;
 
-				sprintf(full_path, "%s (%s)", roms[i].altname, altname);
-				return full_path;
-			}
-		}
-		else if (!strcasecmp(altname, roms[i].name))
-		{
-			if (roms[i].hide) return (char*)-1;
-			return roms[i].altname;
-		}
-	}
-	return NULL;
+	sprintf(full_path, "%s (%s)", roms[i].altname, altname);
+	return full_path;
 }
 
 static int has_name(const char *nameset, const char *name)
@@ -1144,6 +1612,9 @@ int neogeo_romset_tx(char* name, int cd_en)
 	if (!romset) return 0;
 	romset++;
 
+	// the ROMs are mostly read straight into the FPGA memory
+	launch_phase(LAUNCH_READ);
+
 	int system_mvs, system_cdz;
 	static char full_path[1024];
 
@@ -1161,6 +1632,7 @@ int neogeo_romset_tx(char* name, int cd_en)
 	crom_start = 0;
 	crom_sz = 0;
 	set_config(0, -1);
+	neocache_set_xml(NULL);
 
 	const char* home = HomeDir(cd_en ? NEOCD_DIR : NULL);
 
@@ -1199,6 +1671,7 @@ int neogeo_romset_tx(char* name, int cd_en)
 				if (!FileExists(full_path)) sprintf(full_path, "%s/%s/romsets.xml", getRootDir(), home);
 			}
 			printf("xml for %s: %s\n", name, full_path);
+			neocache_set_xml(full_path);
 
 			SAX_Callbacks sax;
 			SAX_Callbacks_init(&sax);
@@ -140,13 +140,7 @@ void neocd_reset() {
 }
 
 int neocd_send_data(uint8_t* buf, int len, uint8_t index) {
-	// set index byte
-	user_io_set_index(index);
-
-	user_io_set_download(1);
-	user_io_file_tx_data(buf, len);
-	user_io_set_download(0);
-	return 1;
+	return user_io_send_data(buf, len, index);
 }
 
 int neocd_is_en() {
@@ -9,44 +9,39 @@
 #include "../../spi.h"
 #include "../../hardware.h"
 #include "../../menu.h"
+#include "../../scheduler.h"
 #include "pcecd.h"
 
 
 static int need_reset=0;
 static uint8_t has_command = 0;
 
-void pcecd_poll()
+static uint32_t pcecd_tick()
 {
-	static uint32_t poll_timer = 0;
-	static uint8_t last_req = 0;
-	static uint8_t adj = 0;
-
-	if (!poll_timer) poll_timer = GetTimer(13);
+	// 16.0ms between frames if reading data, 13.33ms otherwise (including latency counts)
+	uint32_t delay = ((!pcecdd.latency) && (pcecdd.state == PCECD_STATE_READ)) ? 16000 : 13333;
 
-	if (CheckTimer(poll_timer))
-	{
-		if ((!pcecdd.latency) && (pcecdd.state == PCECD_STATE_READ)) {
-			poll_timer += 16;				// 16.0ms between frames if reading data */
-		} else {
-			poll_timer += 13 + ((adj == 3) ? 1 : 0);	// 13.33ms otherwise (including latency counts) */
-			if (adj > 3) adj = 3;
-			if (--adj <= 0) adj = 3;
-		}
+	if (pcecdd.has_status && !pcecdd.latency) {
 
-		if (pcecdd.has_status && !pcecdd.latency) {
+		pcecdd.SendStatus(pcecdd.GetStatus());
+		pcecdd.has_status = 0;
+	}
+	else if (pcecdd.data_req && !pcecdd.latency) {
 
-			pcecdd.SendStatus(pcecdd.GetStatus());
-			pcecdd.has_status = 0;
-		}
-		else if (pcecdd.data_req && !pcecdd.latency) {
+		pcecdd.SendDataRequest();
+		pcecdd.data_req = false;
+	}
 
-			pcecdd.SendDataRequest();
-			pcecdd.data_req = false;
-		}
+	pcecdd.Update();
+	return delay;
+}
 
-		pcecdd.Update();
-	}
+void pcecd_poll()
+{
+	static int poll_timer = -1;
+	static uint8_t last_req = 0;
 
+	if (poll_timer < 0) poll_timer = scheduler_timer_add("pcecd", pcecd_tick, 13000);
 
 	uint8_t req = spi_uio_cmd_cont(UIO_CD_GET);
 	if (req != last_req)
@@ -247,9 +242,5 @@ void pcecd_set_image(int num, const char *filename)
 }
 
 int pcecd_send_data(uint8_t* buf, int len, uint8_t index) {
-	user_io_set_index(index);
-	user_io_set_download(1);
-	user_io_file_tx_data(buf, len);
-	user_io_set_download(0);
-	return 1;
+	return user_io_send_data(buf, len, index);
 }
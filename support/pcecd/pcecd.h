@@ -89,6 +89,8 @@ public:
 
 private:
 	toc_t toc;
+	cd_cdda_t cdda;
+	cd_cdda_t data;
 	int index;
 	int lba;
 	int cnt;
@@ -101,8 +103,6 @@ private:
 	uint8_t CDDAMode;
 	sense_t sense;
 	uint8_t region;
-	uint8_t *chd_hunkbuf;
-	int chd_hunknum;
 
 	uint16_t stat;
 	uint8_t comm[14];
@@ -117,7 +117,6 @@ private:
 	void LBAToMSF(int lba, msf_t* msf);
 	void MSFToLBA(int* lba, msf_t* msf);
 	void MSFToLBA(int* lba, uint8_t m, uint8_t s, uint8_t f);
-	int GetTrackByLBA(int lba, toc_t* toc);
 	void CommandError(uint8_t key,	uint8_t asc, uint8_t ascq, uint8_t fru);
 };
 
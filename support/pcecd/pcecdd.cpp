@@ -6,6 +6,7 @@
 
 #include "../../file_io.h"
 #include "../../user_io.h"
+#include "../../iotrace.h"
 
 #include "../chd/mister_chd.h"
 #include "pcecd.h"
@@ -40,39 +41,6 @@ pcecdd_t::pcecdd_t() {
 
 }
 
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if(*instr == 10) instr++;
-		*in = instr;
-	}
-	while (!*out && **in);
-
-	return *out;
-}
-
 int pcecdd_t::LoadCUE(const char* filename) {
 	static char fname[1024 + 10];
 	static char line[128];
@@ -119,6 +87,7 @@ int pcecdd_t::LoadCUE(const char* filename) {
 			*ptr = 0;
 
 			if(!FileOpen(&this->toc.tracks[this->toc.last].f, fname)) return -1;
+			FileAdvise(&this->toc.tracks[this->toc.last].f, FILE_ADV_SEQUENTIAL);
 
 			printf("\x1b[32mPCECD: Open track file: %s\n\x1b[0m", fname);
 
@@ -209,6 +178,7 @@ int pcecdd_t::LoadCUE(const char* filename) {
 			if (!this->toc.tracks[this->toc.last].f.opened())
 			{
 				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
+				FileAdvise(&this->toc.tracks[this->toc.last].f, FILE_ADV_SEQUENTIAL);
 				this->toc.tracks[this->toc.last].start = bb + ss * 75 + mm * 60 * 75 + pregap;
 				this->toc.tracks[this->toc.last].offset = (pregap * this->toc.tracks[this->toc.last].sector_size) - hdr;
 				if (this->toc.last && !this->toc.tracks[this->toc.last - 1].end)
@@ -258,14 +228,6 @@ int pcecdd_t::Load(const char *filename)
 		if (LoadCUE(filename)) return -1;
 	} else if (!strncasecmp(".chd", ext, 4)) {
 		mister_load_chd(filename, &this->toc);
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 	} else {
 		return -1;
 	}
@@ -287,18 +249,15 @@ int pcecdd_t::Load(const char *filename)
 
 void pcecdd_t::Unload()
 {
+	cd_cdda_reset(&this->cdda);
+	cd_cdda_reset(&this->data);
+
 	if (this->loaded)
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
+			mister_chd_close(this->toc.chd_f);
 			this->toc.chd_f = NULL;
-			if (this->chd_hunkbuf)
-			{
-				free(this->chd_hunkbuf);
-				this->chd_hunkbuf = NULL;
-				this->chd_hunknum = -1;
-			}
 		} else {
 			for (int i = 0; i < this->toc.last; i++)
 			{
@@ -416,7 +375,7 @@ void pcecdd_t::Update() {
 			return;
 		}
 
-		this->index = GetTrackByLBA(this->lba, &this->toc);
+		this->index = this->toc.GetTrackByLBA(this->lba);
 
 		DISKLED_ON;
 
@@ -424,10 +383,6 @@ void pcecdd_t::Update() {
 		{
 			if (!this->toc.tracks[this->index].type)
 			{
-				if (this->toc.tracks[this->index].f.opened()) 
-				{
-					FileSeek(&this->toc.tracks[index].f, (this->lba * 2352) - this->toc.tracks[index].offset, SEEK_SET);
-				}
 				sec_buf[0] = 0x30;
 				sec_buf[1] = 0x09;
 				ReadCDDA(sec_buf + 2);
@@ -568,7 +523,7 @@ void pcecdd_t::CommandExec() {
 		new_lba = ((comm[1] << 16) | (comm[2] << 8) | comm[3]) & 0x1FFFFF;
 		int cnt_ = comm[4] ? comm[4] : 256;
 
-		int index = GetTrackByLBA(new_lba, &this->toc);
+		int index = this->toc.GetTrackByLBA(new_lba);
 
 		this->index = index;
 
@@ -598,6 +553,9 @@ void pcecdd_t::CommandExec() {
 		this->lba = new_lba;
 		this->cnt = cnt_;
 
+		// fetch the target while the seek time runs
+		if (this->toc.tracks[index].type) cd_data_seek_toc(&this->data, &this->toc, index, new_lba);
+
 		if (this->toc.tracks[index].f.opened())
 		{
 			int offset = (new_lba * this->toc.tracks[index].sector_size) - this->toc.tracks[index].offset;
@@ -671,9 +629,10 @@ void pcecdd_t::CommandExec() {
 		printf("seek time ticks: %d\n", this->latency);
 
 		this->lba = new_lba;
-		int index = GetTrackByLBA(new_lba, &this->toc);
+		int index = this->toc.GetTrackByLBA(new_lba);
 
 		this->index = index;
+		if (!this->toc.tracks[index].type) cd_cdda_seek_toc(&this->cdda, &this->toc, index, new_lba);
 
 		this->CDDAStart = new_lba;
 		this->CDDAEnd = this->toc.end;
@@ -836,34 +795,12 @@ void pcecdd_t::MSFToLBA(int* lba, msf_t* msf) {
 	*lba = msf->f + msf->s * 75 + msf->m * 60 * 75 - 150;
 }
 
-int pcecdd_t::GetTrackByLBA(int lba, toc_t* toc) {
-	int index = 0;
-	while ((toc->tracks[index].end <= lba) && (index < toc->last)) index++;
-	return index;
-}
-
 void pcecdd_t::ReadData(uint8_t *buf)
 {
 	if (this->toc.tracks[this->index].type && (this->lba >= 0))
 	{
-		if (this->toc.chd_f)
-		{
-			int s_offset = 0;
-			if (this->toc.tracks[this->index].sector_size != 2048)
-			{
-				s_offset += 16;
-			}
-
-			mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, s_offset, 2048, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		} else {
-			if (this->toc.tracks[this->index].sector_size == 2048)
-			{
-				FileSeek(&this->toc.tracks[this->index].f, this->lba * 2048 - this->toc.tracks[this->index].offset, SEEK_SET);
-			} else {
-				FileSeek(&this->toc.tracks[this->index].f, this->lba * 2352 + 16 - this->toc.tracks[this->index].offset, SEEK_SET);
-			}
-			FileReadAdv(&this->toc.tracks[this->index].f, buf, 2048);
-		}
+		iotrace_add(IOTRACE_CD, 0, IOTRACE_READ, this->lba, 2048, 1, nullptr);
+		cd_data_read_toc(&this->data, &this->toc, this->index, this->lba, buf);
 	}
 }
 
@@ -873,18 +810,7 @@ int pcecdd_t::ReadCDDA(uint8_t *buf)
 	this->audioOffset = 0;// 2352;
 
 
-	if (this->toc.chd_f)
-	{
-		mister_chd_read_sector(this->toc.chd_f, this->lba + this->toc.tracks[this->index].offset, 0, 0, this->audioLength, buf, this->chd_hunkbuf, &this->chd_hunknum);
-		for (int swapidx = 0; swapidx < this->audioLength; swapidx += 2)
-		{
-			uint8_t temp = buf[swapidx];
-			buf[swapidx] = buf[swapidx+1];
-			buf[swapidx+1] = temp;
-		}
-	} else if (this->toc.tracks[this->index].f.opened()) {
-		FileReadAdv(&this->toc.tracks[this->index].f, buf, this->audioLength);
-	}
+	cd_cdda_read_toc(&this->cdda, &this->toc, this->index, this->lba, buf);
 
 	return this->audioLength;
 }
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stddef.h>
+#include <sys/stat.h>
 
 #include "../../file_io.h"
 #include "../../user_io.h"
@@ -12,44 +14,11 @@
 #include "psx.h"
 #include "mcdheader.h"
 #include "../../cd.h"
+#include "../../iotrace.h"
 #include "../chd/mister_chd.h"
 #include <libchdr/chd.h>
 
 static char buf[1024];
-static uint8_t *chd_hunkbuf = NULL;
-static int chd_hunknum;
-
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if (*instr == 10) instr++;
-		*in = instr;
-	} while (!*out && **in);
-
-	return *out;
-}
 
 static uint32_t libCryptSectors[16] =
 {
@@ -104,18 +73,18 @@ static uint16_t libCryptMask(fileTYPE* sbi_file)
 
 static void unload_chd(toc_t *table)
 {
+	cd_pool_remove(table);
 	if (table->chd_f)
 	{
-		chd_close(table->chd_f);
+		mister_chd_close(table->chd_f);
 	}
-	if (chd_hunkbuf) free(chd_hunkbuf);
 	memset(table, 0, sizeof(toc_t));
-	chd_hunknum = -1;
 
 }
 
 static void unload_cue(toc_t *table)
 {
+	cd_pool_remove(table);
 	for (int i = 0; i < table->last; i++)
 	{
 		FileClose(&table->tracks[i].f);
@@ -154,9 +123,6 @@ static int load_chd(const char *filename, toc_t *table)
 
 	table->end = table->tracks[table->last - 1].end + 1;
 
-	chd_hunkbuf = (uint8_t *)malloc(table->chd_hunksize);
-	chd_hunknum = -1;
-
 	return 1;
 }
 
@@ -212,6 +178,7 @@ static int load_cue(const char* filename, toc_t *table)
 			*ptr = 0;
 
 			if (!FileOpen(&table->tracks[table->last].f, fname)) return 0;
+			FileAdvise(&table->tracks[table->last].f, FILE_ADV_SEQUENTIAL);
 
 			printf("\x1b[32mPSX: Open track file: %s\n\x1b[0m", fname);
 
@@ -341,7 +308,9 @@ static int load_cd_image(const char *filename, toc_t *table)
 	}
 	else if (!strncasecmp(".cue", ext, 4))
 	{
-		return load_cue(filename, table);
+		if (!load_cue(filename, table)) return 0;
+		cd_pool_add(table);
+		return 1;
 	}
 
 	return 0;
@@ -470,87 +439,40 @@ int psx_chd_hunksize()
 }
 
 
-void psx_read_cd(uint8_t *buffer, int lba, int cnt)
+// PSX TOC layout: track ends are inclusive and a track with offset set lives
+// in the first track's file, CHD frames are shifted by the fake 150 sector pregap
+static void psx_locate(const toc_t *table, int lba, cd_loc_t *loc)
 {
-	//printf("req lba=%d, cnt=%d\n", lba, cnt);
+	loc->blank = 1;
+	if (lba < table->tracks[0].start || !table->last) return;
 
-	while (cnt > 0)
+	// first track with end >= lba
+	int i = table->GetTrackByLBA(lba - 1);
+	if (i >= table->last || lba < table->tracks[i].start)
 	{
-		if (lba < toc.tracks[0].start || !toc.last)
-		{
-			memset(buffer, 0, CD_SECTOR_LEN);
-		}
-		else
-		{
-			memset(buffer, 0xAA, CD_SECTOR_LEN);
-			for (int i = 0; i < toc.last; i++)
-			{
-				if (lba >= toc.tracks[i].start && lba <= toc.tracks[i].end)
-				{
-					if (!toc.chd_f)
-					{
-						if (toc.tracks[i].offset)
-            {
-							FileSeek(&toc.tracks[0].f, toc.tracks[i].offset+((lba-toc.tracks[i].start)*CD_SECTOR_LEN), SEEK_SET);
-
-            }else {
-							FileSeek(&toc.tracks[i].f, (lba - toc.tracks[i].start) * CD_SECTOR_LEN, SEEK_SET);
-            }
-					}
-					while (cnt)
-					{
-            if (toc.tracks[i+1].pregap && lba > (toc.tracks[i+1].start-toc.tracks[i+1].indexes[1]))
-            {
-              //The TOC is setup so that pregap sectors are actually part of the
-              //PREVIOUS track. If the pregap field is set the file doesn't contain
-              //this data, so we have to fake it. 
-              //Check the next track's pregap and indexes[1] values to determine
-              //if we're reading pregap sectors
-              
-
-              memset(buffer, 0x0, CD_SECTOR_LEN);
-            }
-            else if (toc.chd_f)
-						{
+		loc->fill = 0xAA;
+		return;
+	}
 
-							// The "fake" 150 sector pregap moves all the LBAs up by 150, so adjust here to read where the core actually wants data from
-							int read_lba = lba - toc.tracks[0].indexes[1];
-							if (mister_chd_read_sector(toc.chd_f, (read_lba + toc.tracks[i].offset), 0, 0, CD_SECTOR_LEN, buffer, chd_hunkbuf, &chd_hunknum) == CHDERR_NONE)
-							{
-								if (!toc.tracks[i].type) //CHD requires byteswap of audio data
-								{
-									for (int swapidx = 0; swapidx < CD_SECTOR_LEN; swapidx += 2)
-									{
-										uint8_t temp = buffer[swapidx];
-										buffer[swapidx] = buffer[swapidx + 1];
-										buffer[swapidx + 1] = temp;
-									}
-								}
-							}
-							else {
-								printf("\x1b[32mPSX: CHD read error: %d\n\x1b[0m", lba);
-							}
-						}
-						else {
-							if (toc.tracks[i].offset)
-								FileReadAdv(&toc.tracks[0].f, buffer, CD_SECTOR_LEN);
-							else
-								FileReadAdv(&toc.tracks[i].f, buffer, CD_SECTOR_LEN);
-						}
-						if ((lba + 1) > toc.tracks[i].end) break;
-						buffer += CD_SECTOR_LEN;
-						cnt--;
-						lba++;
-					}
-					break;
-				}
-			}
-		}
+	//The TOC is setup so that pregap sectors are actually part of the
+	//PREVIOUS track. If the pregap field is set the file doesn't contain
+	//this data, so we have to fake it.
+	const cd_track_t *next = &table->tracks[i + 1];
+	if (next->pregap && lba > (next->start - next->indexes[1])) return;
+
+	const cd_track_t *trk = &table->tracks[i];
+	loc->blank = 0;
+	loc->audio = !trk->type;
+	loc->chd_lba = lba - table->tracks[0].indexes[1] + trk->offset;
+	loc->f = (fileTYPE *)(trk->offset ? &table->tracks[0].f : &trk->f);
+	loc->pos = trk->offset + (__off64_t)(lba - trk->start) * CD_SECTOR_LEN;
+}
 
-		buffer += CD_SECTOR_LEN;
-		cnt--;
-		lba++;
-	}
+void psx_read_cd(uint8_t *buffer, int lba, int cnt)
+{
+	//printf("req lba=%d, cnt=%d\n", lba, cnt);
+	iotrace_add(IOTRACE_CD, 0, IOTRACE_READ, lba, CD_SECTOR_LEN, cnt, nullptr);
+	if (cnt > 0) cd_read_sectors(&toc, lba, cnt, buffer, 0, CD_SECTOR_LEN, psx_locate);
 }
 
 #define ROOT_FOLDER_LBA 150 + 22
@@ -658,8 +580,101 @@ static game_info_t psx_get_game_info()
 	return { game_id, region_t::UNKNOWN };
 }
 
+// Game id, region and libcrypt mask of an image are kept in tmpfs, keyed by
+// its size and mtime and those of the .sbi sources, so remounts, disc swaps
+// and core reloads don't read the disc and sbi.zip again.
+#define PSX_INFO_DIR   "/tmp/psxinfo"
+#define PSX_INFO_MAGIC 0x50534901
+
+struct psx_info_t
+{
+	uint32_t magic;
+	char path[1024];
+	uint64_t size;
+	int64_t mtime;
+	int end;
+	int64_t sbi_zip_mtime;
+	int64_t sbi_mtime;
+	// results
+	char game_id[12];
+	int region;
+	uint16_t mask;
+	uint16_t has_sbi;
+};
+
+static char cur_game_id[12] = {};
+
+static int64_t file_mtime(const char *path)
+{
+	struct stat64 st;
+	return stat64(path, &st) ? 0 : (int64_t)st.st_mtime;
+}
+
+static int psx_info_key(const char *path, psx_info_t *info, char *cache_name)
+{
+	struct stat64 st;
+	if (stat64(getFullPath(path), &st)) return 0;
+
+	memset(info, 0, sizeof(psx_info_t));
+	info->magic = PSX_INFO_MAGIC;
+	snprintf(info->path, sizeof(info->path), "%s", path);
+	info->size = st.st_size;
+	info->mtime = st.st_mtime;
+	info->end = toc.end;
+
+	sprintf(buf, "%s/sbi.zip", HomeDir());
+	info->sbi_zip_mtime = file_mtime(getFullPath(buf));
+
+	int name_len = strlen(path);
+	strcpy(buf, path);
+	strcpy((name_len > 4) ? buf + name_len - 4 : buf + name_len, ".sbi");
+	info->sbi_mtime = file_mtime(getFullPath(buf));
+
+	// FNV-1a of the path, the header tells collisions apart
+	uint32_t hash = 2166136261u;
+	for (const char *p = path; *p; p++) hash = (hash ^ (uint8_t)*p) * 16777619u;
+	sprintf(cache_name, PSX_INFO_DIR "/%08X", hash);
+	return 1;
+}
+
+static int psx_info_load(const char *path, psx_info_t *info)
+{
+	psx_info_t key;
+	char name[64];
+	if (!psx_info_key(path, &key, name)) return 0;
+
+	FILE *fp = fopen(name, "rb");
+	if (!fp) return 0;
+
+	int ok = fread(info, sizeof(psx_info_t), 1, fp) == 1 && !memcmp(info, &key, offsetof(psx_info_t, game_id));
+	fclose(fp);
+
+	info->game_id[sizeof(info->game_id) - 1] = 0;
+	return ok;
+}
+
+static void psx_info_store(const char *path, const psx_info_t *res)
+{
+	psx_info_t info;
+	char name[64];
+	if (!psx_info_key(path, &info, name)) return;
+
+	memcpy(info.game_id, res->game_id, sizeof(info.game_id));
+	info.region = res->region;
+	info.mask = res->mask;
+	info.has_sbi = res->has_sbi;
+
+	mkdir(PSX_INFO_DIR, 0755);
+	FILE *fp = fopen(name, "wb");
+	if (!fp) return;
+
+	int ok = fwrite(&info, sizeof(info), 1, fp) == 1;
+	if (fclose(fp) || !ok) unlink(name);
+}
+
 const char* psx_get_game_id()
 {
+	if (toc.last && *cur_game_id) return cur_game_id;
 	return psx_get_game_info().game_id;
 }
 
@@ -691,12 +706,23 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 		if (load_cd_image(filename, &toc) && toc.last)
 		{
 			int reset = 0;
-			game_info_t game_info = psx_get_game_info();
-			const char* game_id = game_info.game_id;
-			region_t region = psx_get_region();
-			if (region == region_t::UNKNOWN)
-				region = game_info.region;
-			printf("Game ID: %s, region: %s\n", game_id, region_string(region));
+			psx_info_t info;
+			int cached = psx_info_load(filename, &info);
+			if (!cached)
+			{
+				memset(&info, 0, sizeof(info));
+				game_info_t game_info = psx_get_game_info();
+				snprintf(info.game_id, sizeof(info.game_id), "%s", game_info.game_id);
+				region_t region = psx_get_region();
+				if (region == region_t::UNKNOWN)
+					region = game_info.region;
+				info.region = region;
+			}
+
+			strcpy(cur_game_id, info.game_id);
+			const char* game_id = cur_game_id;
+			region_t region = (region_t)info.region;
+			printf("Game ID: %s, region: %s%s\n", game_id, region_string(region), cached ? " (cached)" : "");
 
 			int name_len = strlen(filename);
 
@@ -752,27 +778,39 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 				}
 			}
 
-			uint16_t mask = 0;
-
-			fileTYPE sbi_file = {};
-			bool has_sbi_file = false;
+			uint16_t mask = info.mask;
 
-			// search for .sbi file in PSX/sbi.zip
-			sprintf(buf, "%s/sbi.zip/%s.sbi", HomeDir(), game_id);
-			has_sbi_file = (FileOpen(&sbi_file, buf, 1));
-
-			if (!has_sbi_file)
+			if (!cached)
 			{
-				// search for .sbi file base on image name
-				strcpy(buf, filename);
-				strcpy((name_len > 4) ? buf + name_len - 4 : buf + name_len, ".sbi");
+				fileTYPE sbi_file = {};
+				bool has_sbi_file = false;
+
+				// search for .sbi file in PSX/sbi.zip
+				sprintf(buf, "%s/sbi.zip/%s.sbi", HomeDir(), game_id);
 				has_sbi_file = (FileOpen(&sbi_file, buf, 1));
-			}
 
-			if (has_sbi_file)
+				if (!has_sbi_file)
+				{
+					// search for .sbi file base on image name
+					strcpy(buf, filename);
+					strcpy((name_len > 4) ? buf + name_len - 4 : buf + name_len, ".sbi");
+					has_sbi_file = (FileOpen(&sbi_file, buf, 1));
+				}
+
+				if (has_sbi_file)
+				{
+					printf("Found SBI file: %s\n", buf);
+					mask = libCryptMask(&sbi_file);
+					FileClose(&sbi_file);
+				}
+
+				info.mask = mask;
+				info.has_sbi = has_sbi_file;
+				psx_info_store(filename, &info);
+			}
+			else if (info.has_sbi)
 			{
-				printf("Found SBI file: %s\n", buf);
-				mask = libCryptMask(&sbi_file);
+				printf("SBI mask: %04X (cached)\n", mask);
 			}
 
 			send_cue_and_metadata(&toc, mask, region, reset);
@@ -788,6 +826,7 @@ void psx_mount_cd(int f_index, int s_index, const char *filename)
 	if (!loaded)
 	{
 		printf("Unmount CD\n");
+		*cur_game_id = 0;
 		unload_cue(&toc);
 		unload_chd(&toc);
 		mount_cd(0, s_index);
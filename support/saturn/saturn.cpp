@@ -55,7 +55,7 @@ void saturn_poll()
 		{
 			last_req = req;
 
-			for (int i = 0; i < 6; i++) data_in[i] = spi_w(0);
+			spi_read((uint8_t*)data_in, sizeof(data_in), 1);
 			DisableIO();
 
 			satcdd.SetCommand((uint8_t*)data_in);
@@ -67,9 +67,8 @@ void saturn_poll()
 		satcdd.Process(&time_mode);
 		poll_timer += CalcTimerOffset(time_mode);
 
-		uint16_t* s = (uint16_t*)satcdd.GetStatus();
 		spi_uio_cmd_cont(UIO_CD_SET);
-		for (int i = 0; i < 6; i++) spi_w(s[i]);
+		spi_write(satcdd.GetStatus(), 12, 1);
 		DisableIO();
 
 		satcdd.Update();
@@ -205,13 +204,7 @@ void saturn_reset() {
 }
 
 int saturn_send_data(uint8_t* buf, int len, uint8_t index) {
-	// set index byte
-	user_io_set_index(index);
-
-	user_io_set_download(1);
-	user_io_file_tx_data(buf, len);
-	user_io_set_download(0);
-	return 1;
+	return user_io_send_data(buf, len, index);
 }
 
 static char int_blank[] = {
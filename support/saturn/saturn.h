@@ -61,6 +61,8 @@ public:
 
 private:
 	toc_t toc;
+	cd_cdda_t cdda;
+	cd_cdda_t data;
 	int lba;
 	int track;
 	int index;
@@ -82,8 +84,6 @@ private:
 	uint8_t cd_buf[4096 + 2];
 	int audioLength;
 	int audioFirst;
-	int chd_hunknum;
-	uint8_t *chd_hunkbuf;
 	int chd_audio_read_lba;
 
 
@@ -7,11 +7,31 @@
 #include "saturn.h"
 #include "../../shmem.h"
 #include "../chd/mister_chd.h"
+#include "../../iotrace.h"
 
 #define SHMEM_ADDR  0x31000000
 
 satcdd_t satcdd;
 
+// bin track sectors in the raw layout for the data ring, 2048 byte sectors
+// get their user data at +16 like a raw sector has it
+static void data_fetch(const void *src, int track, int lba, int count, uint8_t *buf)
+{
+	const toc_t *toc = (const toc_t *)src;
+	const cd_track_t *trk = &toc->tracks[track];
+	int size = toc->sectorSize;
+	int len = count * size;
+
+	int res = FileReadAt((fileTYPE *)&trk->f, (__off64_t)lba * size - trk->offset, buf, len);
+	if (res < 0) res = 0;
+	if (res < len) memset(buf + res, 0, len - res);
+
+	if (size == 2048)
+	{
+		for (int i = count - 1; i >= 0; i--) memmove(buf + i * 2352 + 16, buf + i * 2048, 2048);
+	}
+}
+
 satcdd_t::satcdd_t() {
 	loaded = 0;
 	state = Open;
@@ -28,8 +48,6 @@ satcdd_t::satcdd_t() {
 	speed = 0;
 	audioLength = 0;
 	audioFirst = 0;
-	chd_hunkbuf = NULL;
-	chd_hunknum = -1;
 	SendData = NULL;
 
 	stat[0] = SATURN_STAT_OPEN;
@@ -46,38 +64,6 @@ satcdd_t::satcdd_t() {
 	SetChecksum(stat);
 }
 
-static int sgets(char *out, int sz, char **in)
-{
-	*out = 0;
-	do
-	{
-		char *instr = *in;
-		int cnt = 0;
-
-		while (*instr && *instr != 10)
-		{
-			if (*instr == 13)
-			{
-				instr++;
-				continue;
-			}
-
-			if (cnt < sz - 1)
-			{
-				out[cnt++] = *instr;
-				out[cnt] = 0;
-			}
-
-			instr++;
-		}
-
-		if (*instr == 10) instr++;
-		*in = instr;
-	} while (!*out && **in);
-
-	return *out;
-}
-
 int satcdd_t::LoadCUE(const char* filename) {
 	static char fname[1024 + 10];
 	static char line[128];
@@ -130,6 +116,7 @@ int satcdd_t::LoadCUE(const char* filename) {
 			*ptr = 0;
 
 			if (!FileOpen(&this->toc.tracks[this->toc.last + 1].f, fname)) return -1;
+			FileAdvise(&this->toc.tracks[this->toc.last + 1].f, FILE_ADV_SEQUENTIAL);
 			FileSeek(&this->toc.tracks[this->toc.last + 1].f, 0, SEEK_SET);
 			file_size = this->toc.tracks[this->toc.last + 1].f.size;
 
@@ -222,6 +209,7 @@ int satcdd_t::LoadCUE(const char* filename) {
 			if (!this->toc.tracks[this->toc.last].f.opened())
 			{
 				FileOpen(&this->toc.tracks[this->toc.last].f, fname);
+				FileAdvise(&this->toc.tracks[this->toc.last].f, FILE_ADV_SEQUENTIAL);
 				new_file = 0;
 			}
 
@@ -334,13 +322,6 @@ int satcdd_t::Load(const char *filename)
 			return -1;
 		}
 
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-		}
-
-		this->chd_hunkbuf = (uint8_t *)malloc(this->toc.chd_hunksize);
-		this->chd_hunknum = -1;
 		if (this->toc.tracks[0].sector_size)
 		{
 			this->sectorSize = this->toc.tracks[0].sector_size;
@@ -351,9 +332,11 @@ int satcdd_t::Load(const char *filename)
 
 	}
 
+	this->toc.sectorSize = this->sectorSize;
+
 	/*if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, 0, 0x10, (uint8_t *)header);
 	}
 	else {
 		fd_img = &this->toc.tracks[0].f;
@@ -394,17 +377,14 @@ int satcdd_t::Load(const char *filename)
 
 void satcdd_t::Unload()
 {
+	cd_cdda_reset(&this->cdda);
+	cd_cdda_reset(&this->data);
+
 	if (this->loaded)
 	{
 		if (this->toc.chd_f)
 		{
-			chd_close(this->toc.chd_f);
-		}
-
-		if (this->chd_hunkbuf)
-		{
-			free(this->chd_hunkbuf);
-			this->chd_hunkbuf = NULL;
+			mister_chd_close(this->toc.chd_f);
 		}
 
 		for (int i = 0; i < this->toc.last; i++)
@@ -439,7 +419,7 @@ int satcdd_t::GetBootHeader(uint8_t *buf) {
 
 	if (this->toc.chd_f)
 	{
-		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf, this->chd_hunkbuf, &this->chd_hunknum);
+		mister_chd_read_sector(this->toc.chd_f, 0, 0, offset, 256, buf);
 	}
 	else 
 	{
@@ -1037,6 +1017,11 @@ void satcdd_t::Update() {
 		}
 		this->track = this->toc.GetTrackByLBA(this->lba);
 		this->index = this->toc.GetIndexByLBA(this->track, this->lba);
+		if (this->toc.chd_f) mister_chd_prefetch(this->toc.chd_f, this->lba + this->toc.tracks[this->track].offset);
+		else if (this->toc.tracks[this->track].type && this->toc.tracks[this->track].f.filp)
+		{
+			cd_cdda_seek(&this->data, data_fetch, &this->toc, this->track, (this->lba >= 0) ? this->lba : 0, this->toc.tracks[this->track].end);
+		}
 
 #ifdef SATURN_DEBUG
 		//LBAToMSF(this->lba + 150, &msf);
@@ -1114,11 +1099,10 @@ void satcdd_t::MakeSecureRingData(uint8_t *buf) {
 
 void satcdd_t::ReadData(uint8_t *buf)
 {
-	int offs = 0; 
-	
 	if (this->toc.tracks[this->track].type)
 	{
 		int lba_ = this->lba >= 0 ? this->lba : 0;
+		iotrace_add(IOTRACE_CD, 0, IOTRACE_READ, lba_, this->sectorSize, 1, nullptr);
 		if (this->toc.chd_f)
 		{
 			int read_offset = 0;
@@ -1127,23 +1111,19 @@ void satcdd_t::ReadData(uint8_t *buf)
 				read_offset += 16;
 			}
 
-			mister_chd_read_sector(this->toc.chd_f, lba_ + this->toc.tracks[this->track].offset, read_offset, 0, this->sectorSize, buf, this->chd_hunkbuf, &this->chd_hunknum);
+			cd_read_track(&this->toc, this->track, lba_, 1, buf + read_offset, 0, this->sectorSize);
 		}
 		else {
-			if (this->sectorSize == 2048)
-			{
-				offs = (lba_ * 2048) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf + 16, 2048);
-			}
-			else {
-				offs = (lba_ * 2352) - this->toc.tracks[this->track].offset;
-				FileSeek(&this->toc.tracks[this->track].f, offs, SEEK_SET);
-				FileReadAdv(&this->toc.tracks[this->track].f, buf, 2352);
-			}
+			// served from a ring refilled on the offload pool, zipped images are read in place
+			static uint8_t sector[2352];
+			int async = this->toc.tracks[this->track].f.filp != NULL;
+			cd_cdda_read(&this->data, data_fetch, &this->toc, this->track, lba_, this->toc.tracks[this->track].end, sector, async);
+
+			if (this->sectorSize == 2048) memcpy(buf + 16, sector + 16, 2048);
+			else memcpy(buf, sector, 2352);
 #ifdef SATURN_DEBUG
 			//printf("\x1b[32mSaturn: ");
-			//printf("Read data, lba = %i, track = %i, offset = %i", lba_, this->track, offs);
+			//printf("Read data, lba = %i, track = %i", lba_, this->track);
 			//printf(" (%u)\n\x1b[0m", frame_cnt);
 #endif // SATURN_DEBUG
 		}
@@ -1155,32 +1135,12 @@ int satcdd_t::ReadCDDA(uint8_t *buf, int first)
 	int sec_offs = first ? 0 : 1;
 
 	uint8_t *dest = buf;
-	if (this->toc.chd_f)
+	if (this->toc.chd_f || this->toc.tracks[this->track].f.opened())
 	{
+		int read_lba = this->toc.chd_f ? this->chd_audio_read_lba : this->lba;
 		for (int i = sec_offs; i < 2; i++, dest += 4096)
 		{
-			mister_chd_read_sector(this->toc.chd_f, this->chd_audio_read_lba + this->toc.tracks[this->track].offset + i, 0, 0, 2352, dest, this->chd_hunkbuf, &this->chd_hunknum);
-
-			//CHD audio requires byteswap. There's probably a better way to do this...
-			for (int swapidx = 0; swapidx < 2352; swapidx += 2)
-			{
-				uint8_t temp = dest[swapidx];
-				dest[swapidx] = dest[swapidx + 1];
-				dest[swapidx + 1] = temp;
-			}
-		}
-
-		/*if ((len / 2352) > 1)
-		{
-			this->chd_audio_read_lba++;
-		}*/
-	}
-	else if (this->toc.tracks[this->track].f.opened()) {
-		int offs = (this->lba * 2352) - this->toc.tracks[this->track].offset;
-		for (int i = sec_offs; i < 2; i++, dest += 4096)
-		{
-			FileSeek(&this->toc.tracks[this->track].f, offs + (i * 2352), SEEK_SET);
-			FileReadAdv(&this->toc.tracks[this->track].f, dest, 2352);
+			cd_cdda_read_toc(&this->cdda, &this->toc, this->track, read_lba + i, dest);
 		}
 	}
 
@@ -1197,7 +1157,7 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 {
 	static int buf_num_read = 0, buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_acquire(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
 	if (header) {
 		ReadData(data_ptr);
@@ -1207,7 +1167,7 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 		ReadData(data_ptr);
 	}
 	int boot = (data_ptr[12] == 0x00 && data_ptr[13] == 0x02 && data_ptr[14] == 0x00 && data_ptr[15] == 0x01);
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_release(shmem_ptr);
 
 
 	buf_num_write++;
@@ -1226,14 +1186,14 @@ int satcdd_t::DataSectorSend(uint8_t* header, int speed)
 
 int satcdd_t::RingDataSend(uint8_t* header, int speed)
 {
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_acquire(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr;
 	if (header) {
 		MakeSecureRingData(data_ptr);
 		memcpy(data_ptr + 12, header, 12);
 		memset(data_ptr + 2348, 0, 4);
 	}
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_release(shmem_ptr);
 
 	uint16_t mode = (speed == 2 ? 0x0101 : 0x0000) | 0x0404;
 
@@ -1249,11 +1209,11 @@ int satcdd_t::AudioSectorSend(int first)
 
 	if (first) buf_num_read = buf_num_write = 0;
 
-	uint8_t *shmem_ptr = (uint8_t*)shmem_map(SHMEM_ADDR, 4096 * 4);
+	uint8_t *shmem_ptr = (uint8_t*)shmem_acquire(SHMEM_ADDR, 4096 * 4);
 	uint8_t *data_ptr = shmem_ptr + (buf_num_write * 4096);
 
 	ReadCDDA(data_ptr, first);
-	shmem_unmap(shmem_ptr, 4096 * 4);
+	shmem_release(shmem_ptr);
 
 	if (first) buf_num_write++;
 	buf_num_write++;
@@ -56,6 +56,7 @@ static const char *MZMACHINES[MAX_MZMACHINES] = { "MZ80K", "MZ80C", "MZ1200", "M
 
 static sharpmz_config_t      config;
 static uint8_t               sector_buffer[1024];
+static uint8_t               bank_buffer[0x20000];   // Largest memory bank, tapes and dumps move in one transfer.
 static sharpmz_tape_header_t tapeHeader;
 static tape_queue_t          tapeQueue;
 static unsigned char         debugEnabled = 0;
@@ -125,7 +126,7 @@ void sharpmz_set_rom(romData_t &image)
 //
 int sharpmz_save_config(void)
 {
-    FileSaveConfig(SHARPMZ_CONFIG_FILENAME, &config, sizeof(config));
+    FileSaveConfigLater(SHARPMZ_CONFIG_FILENAME, &config, sizeof(config));
 
     // For calls from the UI, return a state to progress on to.
     //
@@ -1925,7 +1926,6 @@ void sharpmz_send_file(romData_t &image, char *dirPrefix)
 //
 short sharpmz_read_ram(const char *memDumpFile, short bank)
 {
-    unsigned int  actualWriteSize;
     fileTYPE      file = {};
 
     // Open the memory image debug file for writing.
@@ -1947,16 +1947,16 @@ short sharpmz_read_ram(const char *memDumpFile, short bank)
         spi8(0x00);                                       // A7-A0
         //spi8(0x00);                                       // Setup to read addr first byte.
 
-        // The bank size is stored in the config.
+        // The bank size is stored in the config, read it in one go and write it out in one go.
         //
-        for (unsigned long j = 0; j < MZBANKSIZE[mb] or actualWriteSize == 0; j += actualWriteSize)
-        {
-            spi_read(sector_buffer, 512, 0);
+        spi_read(bank_buffer, MZBANKSIZE[mb], 0);
 
-            DISKLED_ON;
-            actualWriteSize=FileWriteAdv(&file, sector_buffer, MZBANKSIZE[mb] >= 512 ? 512 : MZBANKSIZE[mb]);
-            DISKLED_OFF;
+        DISKLED_ON;
+        if(FileWriteAdv(&file, bank_buffer, MZBANKSIZE[mb]) != (int)MZBANKSIZE[mb])
+        {
+            sharpmz_debugf("Bank %d, short write\n", mb);
         }
+        DISKLED_OFF;
 
         // Indicate end of upload.
         //spi8(SHARPMZ_EOF);
@@ -2085,6 +2085,20 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
     if(dstCMT == 0)
         sharpmz_reset(10, 50000);
 
+    // Read the whole program first, the transfer below then goes out as one block.
+    //
+    DISKLED_ON;
+    actualReadSize = sharpmz_file_read(&file, bank_buffer, tapeHeader.fileSize);
+    DISKLED_OFF;
+
+    sharpmz_debugf("Bytes to read, actual:%d, sizeHeader:%d", actualReadSize, tapeHeader.fileSize);
+    if(tapeHeader.fileSize && actualReadSize == 0)
+    {
+        sharpmz_debugf("Bad tape or corruption, should never be 0, actual:%d, sizeHeader:%d", actualReadSize, tapeHeader.fileSize);
+        FileClose(&file);
+        return(4);
+    }
+
     // Load the data from tape to RAM.
     //
     EnableFpga();                                         // Start the transmission session, clear address and set ioctl_download.
@@ -2102,24 +2116,7 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
         spi8(0x00);
     }
 
-    for (unsigned short i = 0; i < tapeHeader.fileSize && actualReadSize > 0; i += actualReadSize)
-    {
-        DISKLED_ON;
-        actualReadSize = sharpmz_file_read(&file, sector_buffer, 512);
-        DISKLED_OFF;
-
-        sharpmz_debugf("Bytes to read, actual:%d, index:%d, sizeHeader:%d", actualReadSize, i, tapeHeader.fileSize);
-
-        if(actualReadSize > 0)
-        {
-            // Write the sector (or part) to the fpga memory.
-            spi_write(sector_buffer, actualReadSize, 0);
-        } else
-        {
-            sharpmz_debugf("Bad tape or corruption, should never be 0, actual:%d, index:%d, sizeHeader:%d", actualReadSize, i, tapeHeader.fileSize);
-            return(4);
-        }
-    }
+    spi_write(bank_buffer, actualReadSize, 0);
     DisableFpga();
 
     // signal end of transmission
@@ -2128,6 +2125,15 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
     spi8(SHARPMZ_EOF);
     DisableFpga();
 
+    // A short tape is still an error, as before, but the session is closed properly.
+    //
+    if(actualReadSize < tapeHeader.fileSize)
+    {
+        sharpmz_debugf("Bad tape or corruption, short read, actual:%d, sizeHeader:%d", actualReadSize, tapeHeader.fileSize);
+        FileClose(&file);
+        return(4);
+    }
+
     // Now load header - this is done last because the emulator monitor wipes the stack area on reset.
     //
     EnableFpga();                                         // Start the transmission session, clear address and set ioctl_download.
@@ -2204,9 +2210,8 @@ short sharpmz_load_tape_to_ram(const char *tapeFile, unsigned char dstCMT)
 //
 short sharpmz_save_tape_from_cmt(const char *tapeFile)
 {
-    short          dataSize = 0;
-    unsigned short actualWriteSize;
-    unsigned short writeSize = 0;
+    int            dataSize = 0;
+    int            writeSize = 0;
     char           fileName[21];
 
     // Handle for the MZF file to be written.
@@ -2235,20 +2240,15 @@ short sharpmz_save_tape_from_cmt(const char *tapeFile)
             dataSize = tapeHeader.fileSize;
         }
         sharpmz_debugf("mb=%d, tapesize=%04x\n", mb, tapeHeader.fileSize);
-        for (; dataSize > 0; dataSize -= actualWriteSize)
+        if(dataSize > 0)
         {
-            sharpmz_debugf("mb=%d, dataSize=%04x, writeSize=%04x\n", mb, dataSize, writeSize);
-            if(mb == SHARPMZ_MEMBANK_CMT_HDR)
-            {
-                writeSize = MZ_TAPE_HEADER_SIZE;
-            } else
-            {
-                writeSize = dataSize > 512 ? 512 : dataSize;
-            }
-            spi_read(sector_buffer, writeSize, 0);
+            // The whole header or data area in one transfer.
+            //
+            writeSize = dataSize;
+            spi_read(bank_buffer, writeSize, 0);
             if(mb == SHARPMZ_MEMBANK_CMT_HDR)
             {
-                memcpy(&tapeHeader, &sector_buffer, MZ_TAPE_HEADER_SIZE);
+                memcpy(&tapeHeader, bank_buffer, MZ_TAPE_HEADER_SIZE);
 
                 // Now open the file for writing. If no name provided, use the one stored in the header.
                 //
@@ -2270,11 +2270,15 @@ short sharpmz_save_tape_from_cmt(const char *tapeFile)
                 if (!sharpmz_file_write(&file, fileName))
                 {
                     sharpmz_debugf("Failed to open tape file:%s\n", fileName);
+                    DisableFpga();
                     return(3);
                 }
             }
             DISKLED_ON;
-            actualWriteSize=FileWriteAdv(&file, sector_buffer, writeSize);
+            if(FileWriteAdv(&file, bank_buffer, writeSize) != writeSize)
+            {
+                sharpmz_debugf("mb=%d, short write of %04x\n", mb, writeSize);
+            }
             DISKLED_OFF;
         }
 
@@ -5,13 +5,35 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <glob.h>
+#include <unistd.h>
+#include <atomic>
 
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../spi.h"
+#include "../../offload.h"
+#include "../../crc.h"
 
 static uint8_t hdr[512];
 
+// Only the 32KB banks holding the header candidates are read for detection:
+// $0000-$ffff (LoROM/HiROM) and $408000-$40ffff (ExHiROM).
+#define PROBE_BANK 0x8000
+static uint8_t probe[3 * PROBE_BANK];
+
+// detection results of recent ROMs, keyed by the crc of the probed banks
+#define HDR_CACHE_SLOTS 8
+
+struct hdr_cache_t
+{
+	uint32_t crc;
+	uint32_t size;
+	uint8_t hdr[16];
+};
+
+static hdr_cache_t hdr_cache[HDR_CACHE_SLOTS] = {};
+static uint32_t hdr_cache_next = 0;
+
 enum HeaderField {
 	CartName = 0x00,
 	Mapper = 0x15,
@@ -26,17 +48,24 @@ enum HeaderField {
 	ResetVector = 0x3c,
 };
 
-static uint32_t score_header(const uint8_t *data, uint32_t size, uint32_t addr)
+static const uint8_t *probe_bank(uint32_t addr)
+{
+	return probe + ((addr < 0x10000) ? (addr & ~0x7fff) : 2 * PROBE_BANK);
+}
+
+static uint32_t score_header(uint32_t size, uint32_t addr)
 {
 	if (size < addr + 64) return 0;  //image too small to contain header at this location?
+	const uint8_t *bank = probe_bank(addr);
+	const uint8_t *data = bank + (addr & 0x7fff);
 	int score = 0;
 
-	uint16_t resetvector = data[addr + ResetVector] | (data[addr + ResetVector + 1] << 8);
-	uint16_t checksum = data[addr + Checksum] | (data[addr + Checksum + 1] << 8);
-	uint16_t complement = data[addr + Complement] | (data[addr + Complement + 1] << 8);
+	uint16_t resetvector = data[ResetVector] | (data[ResetVector + 1] << 8);
+	uint16_t checksum = data[Checksum] | (data[Checksum + 1] << 8);
+	uint16_t complement = data[Complement] | (data[Complement + 1] << 8);
 
-	uint8_t resetop = data[(addr & ~0x7fff) | (resetvector & 0x7fff)];  //first opcode executed upon reset
-	uint8_t mapper = data[addr + Mapper] & ~0x10;                      //mask off irrelevent FastROM-capable bit
+	uint8_t resetop = bank[resetvector & 0x7fff];  //first opcode executed upon reset
+	uint8_t mapper = data[Mapper] & ~0x10;                      //mask off irrelevent FastROM-capable bit
 
 																	   //$00:[0000-7fff] contains uninitialized RAM and MMIO.
 																	   //reset vector must point to ROM at $00:[8000-ffff] to be considered valid.
@@ -98,21 +127,21 @@ static uint32_t score_header(const uint8_t *data, uint32_t size, uint32_t addr)
 	if (addr == 0x007fc0 && mapper == 0x22) score += 2;  //0x22 is usually SDD1
 	if (addr == 0x40ffc0 && mapper == 0x25) score += 2;  //0x25 is usually ExHiROM
 
-	if (data[addr + Company] == 0x33) score += 2;        //0x33 indicates extended header
-	if (data[addr + RomType] < 0x08) score++;
-	if (data[addr + RomSize] < 0x10) score++;
-	if (data[addr + RamSize] < 0x08) score++;
-	if (data[addr + CartRegion] < 14) score++;
+	if (data[Company] == 0x33) score += 2;        //0x33 indicates extended header
+	if (data[RomType] < 0x08) score++;
+	if (data[RomSize] < 0x10) score++;
+	if (data[RamSize] < 0x08) score++;
+	if (data[CartRegion] < 14) score++;
 
 	if (score < 0) score = 0;
 	return score;
 }
 
-static uint32_t find_header(const uint8_t *data, uint32_t size)
+static uint32_t find_header(uint32_t size)
 {
-	uint32_t score_lo = score_header(data, size, 0x007fc0);
-	uint32_t score_hi = score_header(data, size, 0x00ffc0);
-	uint32_t score_ex = score_header(data, size, 0x40ffc0);
+	uint32_t score_lo = score_header(size, 0x007fc0);
+	uint32_t score_hi = score_header(size, 0x00ffc0);
+	uint32_t score_ex = score_header(size, 0x40ffc0);
 	if (score_ex) score_ex += 4;  //favor ExHiROM on images > 32mbits
 
 	if (score_lo >= score_hi && score_lo >= score_ex)
@@ -127,166 +156,188 @@ static uint32_t find_header(const uint8_t *data, uint32_t size)
 	return score_ex ? 0x40ffc0 : 0;
 }
 
+static int probe_read(fileTYPE *f, uint32_t offset, uint8_t *buf, uint32_t len, uint32_t size)
+{
+	if (offset >= size) return 1;
+	if (len > size - offset) len = size - offset;
+	return FileSeek(f, offset, SEEK_SET) && FileReadAdv(f, buf, len) == (int)len;
+}
+
 uint8_t* snes_get_header(fileTYPE *f)
 {
 	memset(hdr, 0, sizeof(hdr));
+	memset(probe, 0, sizeof(probe));
+
 	uint32_t size = f->size;
-	uint8_t *prebuf = (uint8_t*)malloc(size);
-	if (prebuf)
+	uint32_t base = 0;
+	if (size & 512)
 	{
-		FileSeekLBA(f, 0);
-		if (FileReadAdv(f, prebuf, size))
-		{
-			uint8_t *buf = prebuf;
+		base = 512;
+		size -= 512;
+	}
 
-			if (size & 512)
+	if (probe_read(f, base, probe, 2 * PROBE_BANK, size) &&
+		probe_read(f, base + 0x408000, probe + 2 * PROBE_BANK, PROBE_BANK, size))
+	{
+		uint32_t crc = crc32_update(0, probe, sizeof(probe));
+		uint32_t rom_size = size;
+		for (int i = 0; i < HDR_CACHE_SLOTS; i++)
+		{
+			hdr_cache_t *c = &hdr_cache[i];
+			if (c->size == rom_size && c->crc == crc)
 			{
-				buf += 512;
-				size -= 512;
+				memcpy(hdr, c->hdr, sizeof(c->hdr));
+				FileSeekLBA(f, 0);
+				return hdr;
 			}
+		}
 
-			*(uint32_t*)(&hdr[8]) = size;
+		*(uint32_t*)(&hdr[8]) = size;
 
-			bool is_bsx_bios = false;
-			if (!memcmp(buf+0x7FC0, "Satellaview BS-X     ", 21)) {
-				is_bsx_bios = true;
-			}
+		bool is_bsx_bios = false;
+		if (!memcmp(probe + 0x7FC0, "Satellaview BS-X     ", 21)) {
+			is_bsx_bios = true;
+		}
 
-			uint32_t addr = find_header(buf, size);
-			if (addr)
+		uint32_t addr = find_header(size);
+		if (addr)
+		{
+			const uint8_t *h = probe_bank(addr) + (addr & 0x7fff);
+			uint8_t ramsz = h[RamSize];
+			if (ramsz >= 0x08) ramsz = 0;
+
+			//re-calc rom size
+			uint8_t romsz = 15;
+			size--;
+			if (!(size & 0xFF000000))
 			{
-				uint8_t ramsz = buf[addr + RamSize];
-				if (ramsz >= 0x08) ramsz = 0;
-
-				//re-calc rom size
-				uint8_t romsz = 15;
-				size--;
-				if (!(size & 0xFF000000))
+				while (!(size & 0x1000000))
 				{
-					while (!(size & 0x1000000))
-					{
-						romsz--;
-						size <<= 1;
-					}
+					romsz--;
+					size <<= 1;
 				}
+			}
+
+			bool has_bsx_slot = false;
+			if (h[-14] == 'Z' && h[-11] == 'J' &&
+				((h[-13] >= 'A' && h[-13] <= 'Z') || (h[-13] >= '0' && h[-13] <= '9')) &&
+				(h[Company] == 0x33 || (h[-10] == 0x00 && h[-4] == 0x00)) ) {
+				has_bsx_slot = true;
+			}
 
-				bool has_bsx_slot = false;
-				if (buf[addr - 14] == 'Z' && buf[addr - 11] == 'J' &&
-					((buf[addr - 13] >= 'A' && buf[addr - 13] <= 'Z') || (buf[addr - 13] >= '0' && buf[addr - 13] <= '9')) &&
-					(buf[addr + Company] == 0x33 || (buf[addr - 10] == 0x00 && buf[addr - 4] == 0x00)) ) {
-					has_bsx_slot = true;
+			//Rom type: 0-Low, 1-High, 2-ExHigh, 3-SpecialLoRom
+			hdr[1] = (addr == 0x00ffc0) ? 1 :
+					 (addr == 0x40ffc0) ? 2 :
+					 has_bsx_slot ? 3 :
+					 0;
+
+			//BSX 3
+			if (is_bsx_bios) {
+				hdr[1] = 0x30;
+			}
+			else {
+
+				//DSPn types 8..B
+				if (h[Mapper] == 0x20 && h[RomType] == 0x03)
+				{	//DSP1
+					hdr[1] |= 0x84;
+				}
+				else if (h[Mapper] == 0x21 && h[RomType] == 0x03)
+				{	//DSP1B
+					hdr[1] |= 0x80;
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0x05 && h[Company] != 0xb2)
+				{	//DSP1B
+					hdr[1] |= 0x80;
+				}
+				else if (h[Mapper] == 0x31 && (h[RomType] == 0x03 || h[RomType] == 0x05))
+				{	//DSP1B
+					hdr[1] |= 0x80;
+				}
+				else if (h[Mapper] == 0x20 && h[RomType] == 0x05)
+				{	//DSP2
+					hdr[1] |= 0x90;
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0x05 && h[Company] == 0xb2)
+				{	//DSP3
+					hdr[1] |= 0xA0;
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0x03)
+				{	//DSP4
+					hdr[1] |= 0xB0;
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0xf6)
+				{	//ST010
+					hdr[1] |= 0x88;
+					ramsz = 1;
+					if (h[RomSize] < 10) hdr[1] |= 0x20; // ST011
+				}
+				else if (h[Mapper] == 0x30 && h[RomType] == 0x25)
+				{	//OBC1
+					hdr[1] |= 0xC0;
 				}
 
-				//Rom type: 0-Low, 1-High, 2-ExHigh, 3-SpecialLoRom
-				hdr[1] = (addr == 0x00ffc0) ? 1 :
-						 (addr == 0x40ffc0) ? 2 :
-						 has_bsx_slot ? 3 :
-						 0;
+				if (h[Mapper] == 0x3a && (h[RomType] == 0xf5 || h[RomType] == 0xf9)) {
+					//SPC7110
+					hdr[1] |= 0xD0;
+					if (h[RomType] == 0xf9) hdr[1] |= 0x08; // with RTC
+				}
 
-				//BSX 3
-				if (is_bsx_bios) {
-					hdr[1] = 0x30;
+				if (h[Mapper] == 0x35 && h[RomType] == 0x55)
+				{
+					//S-RTC (+ExHigh)
+					hdr[1] |= 0x08;
 				}
-				else {
-
-					//DSPn types 8..B
-					if (buf[addr + Mapper] == 0x20 && buf[addr + RomType] == 0x03)
-					{	//DSP1
-						hdr[1] |= 0x84;
-					}
-					else if (buf[addr + Mapper] == 0x21 && buf[addr + RomType] == 0x03)
-					{	//DSP1B
-						hdr[1] |= 0x80;
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0x05 && buf[addr + Company] != 0xb2)
-					{	//DSP1B
-						hdr[1] |= 0x80;
-					}
-					else if (buf[addr + Mapper] == 0x31 && (buf[addr + RomType] == 0x03 || buf[addr + RomType] == 0x05))
-					{	//DSP1B
-						hdr[1] |= 0x80;
-					}
-					else if (buf[addr + Mapper] == 0x20 && buf[addr + RomType] == 0x05)
-					{	//DSP2
-						hdr[1] |= 0x90;
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0x05 && buf[addr + Company] == 0xb2)
-					{	//DSP3
-						hdr[1] |= 0xA0;
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0x03)
-					{	//DSP4
-						hdr[1] |= 0xB0;
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0xf6)
-					{	//ST010
-						hdr[1] |= 0x88;
-						ramsz = 1;
-						if (buf[addr + RomSize] < 10) hdr[1] |= 0x20; // ST011
-					}
-					else if (buf[addr + Mapper] == 0x30 && buf[addr + RomType] == 0x25)
-					{	//OBC1
-						hdr[1] |= 0xC0;
-					}
-
-					if (buf[addr + Mapper] == 0x3a && (buf[addr + RomType] == 0xf5 || buf[addr + RomType] == 0xf9)) {
-						//SPC7110
-						hdr[1] |= 0xD0;
-						if (buf[addr + RomType] == 0xf9) hdr[1] |= 0x08; // with RTC
-					}
-
-					if (buf[addr + Mapper] == 0x35 && buf[addr + RomType] == 0x55)
-					{
-						//S-RTC (+ExHigh)
-						hdr[1] |= 0x08;
-					}
-
-					//CX4 4
-					if (buf[addr + Mapper] == 0x20 && buf[addr + RomType] == 0xf3)
-					{
-						hdr[1] |= 0x40;
-					}
-
-					//SDD1 5
-					if (buf[addr + Mapper] == 0x32 && (buf[addr + RomType] == 0x43 || buf[addr + RomType] == 0x45))
-					{
-						if (romsz < 14) hdr[1] |= 0x50; // except Star Ocean un-SDD1
-					}
-
-					//SA1 6
-					if (buf[addr + Mapper] == 0x23 && (buf[addr + RomType] == 0x32 || buf[addr + RomType] == 0x34 || buf[addr + RomType] == 0x35))
-					{
-						hdr[1] |= 0x60;
-					}
-
-					//GSU 7
-					if (buf[addr + Mapper] == 0x20 && (buf[addr + RomType] == 0x13 || buf[addr + RomType] == 0x14 || buf[addr + RomType] == 0x15 || buf[addr + RomType] == 0x1a))
-					{
-						ramsz = buf[addr - 3];
-						if (ramsz == 0xFF) ramsz = 5; //StarFox
-						if (ramsz > 6) ramsz = 6;
-						hdr[1] |= 0x70;
-					}
-
-					//1..2,E..F - reserved for other mappers.
+
+				//CX4 4
+				if (h[Mapper] == 0x20 && h[RomType] == 0xf3)
+				{
+					hdr[1] |= 0x40;
 				}
 
-				hdr[2] = 0;
+				//SDD1 5
+				if (h[Mapper] == 0x32 && (h[RomType] == 0x43 || h[RomType] == 0x45))
+				{
+					if (romsz < 14) hdr[1] |= 0x50; // except Star Ocean un-SDD1
+				}
+
+				//SA1 6
+				if (h[Mapper] == 0x23 && (h[RomType] == 0x32 || h[RomType] == 0x34 || h[RomType] == 0x35))
+				{
+					hdr[1] |= 0x60;
+				}
 
-				//PAL Regions
-				if ((buf[addr + CartRegion] >= 0x02 && buf[addr + CartRegion] <= 0x0C) || buf[addr + CartRegion] == 0x11)
+				//GSU 7
+				if (h[Mapper] == 0x20 && (h[RomType] == 0x13 || h[RomType] == 0x14 || h[RomType] == 0x15 || h[RomType] == 0x1a))
 				{
-					hdr[3] |= 1;
+					ramsz = h[-3];
+					if (ramsz == 0xFF) ramsz = 5; //StarFox
+					if (ramsz > 6) ramsz = 6;
+					hdr[1] |= 0x70;
 				}
 
-				hdr[0] = (ramsz << 4) | romsz;
-				printf("Size from header: 0x%X, calculated size: 0x%X\n", buf[addr + RomSize], romsz);
+				//1..2,E..F - reserved for other mappers.
 			}
-			*(uint32_t*)(&hdr[4]) = addr;
+
+			hdr[2] = 0;
+
+			//PAL Regions
+			if ((h[CartRegion] >= 0x02 && h[CartRegion] <= 0x0C) || h[CartRegion] == 0x11)
+			{
+				hdr[3] |= 1;
+			}
+
+			hdr[0] = (ramsz << 4) | romsz;
+			printf("Size from header: 0x%X, calculated size: 0x%X\n", h[RomSize], romsz);
 		}
-		FileSeekLBA(f, 0);
-		free(prebuf);
+		*(uint32_t*)(&hdr[4]) = addr;
+
+		hdr_cache_t *c = &hdr_cache[hdr_cache_next++ % HDR_CACHE_SLOTS];
+		c->crc = crc;
+		c->size = rom_size;
+		memcpy(c->hdr, hdr, sizeof(c->hdr));
 	}
+	FileSeekLBA(f, 0);
 	return hdr;
 }
 
@@ -342,24 +393,107 @@ static void msu_send_command(uint64_t cmd)
 	DisableIO();
 }
 
+// The playing track is read ahead into a ring on the offload pool, so the
+// core's sector requests are answered from RAM. The ring is filled with
+// pread, so the worker never touches the fileTYPE.
+#define MSU_RING (256 * 1024)
+#define MSU_FILL (32 * 1024)
+
+static uint8_t *msu_ring = NULL;
+static uint32_t msu_pos = 0;                // file offset of the next sector to send
+static std::atomic<uint32_t> msu_end(0);    // ring holds data up to here, written by the worker
+static offload_job_t msu_job = 0;
+
+static int msu_fd(fileTYPE *f)
+{
+	return (msu_ring && f->size && f->filp) ? fileno(f->filp) : -1;
+}
+
+static void msu_stop()
+{
+	offload_wait(msu_job);
+	msu_job = 0;
+}
+
+static void msu_restart(uint32_t pos)
+{
+	msu_stop();
+	if (!msu_ring) msu_ring = (uint8_t*)malloc(MSU_RING);
+	msu_pos = pos;
+	msu_end.store(pos, std::memory_order_relaxed);
+}
+
+static void msu_fill(fileTYPE *f)
+{
+	int fd = msu_fd(f);
+	if (fd < 0 || !offload_job_done(msu_job)) return;
+
+	uint32_t end = msu_end.load(std::memory_order_acquire);
+	uint32_t limit = msu_pos + MSU_RING;
+	if (limit - end < MSU_FILL) return;
+
+	uint8_t *ring = msu_ring;
+	msu_job = offload_try_work([fd, ring, end, limit]()
+		{
+			uint32_t pos = end;
+			while (pos < limit)
+			{
+				uint32_t off = pos % MSU_RING;
+				uint32_t len = MSU_FILL;
+				if (len > MSU_RING - off) len = MSU_RING - off;
+				if (len > limit - pos) len = limit - pos;
+
+				// past the end of the track plays silence
+				ssize_t n = pread(fd, ring + off, len, pos);
+				if (n < 0) n = 0;
+				if ((uint32_t)n < len) memset(ring + off + n, 0, len - n);
+
+				pos += len;
+				msu_end.store(pos, std::memory_order_release);
+			}
+		}, OFFLOAD_IO);
+}
+
 static int msu_send_data(fileTYPE *f, int idx)
 {
 	int chunk = sizeof(buf);
 
-	memset(buf, 0, chunk);
-	if (f->size) FileReadAdv(f, buf, chunk);
+	if (msu_fd(f) >= 0)
+	{
+		// underrun: let the pending fill land, read directly if it's still short
+		if (msu_end.load(std::memory_order_acquire) - msu_pos < (uint32_t)chunk) msu_stop();
+		if (msu_end.load(std::memory_order_acquire) - msu_pos >= (uint32_t)chunk)
+		{
+			memcpy(buf, msu_ring + (msu_pos % MSU_RING), chunk);
+		}
+		else
+		{
+			ssize_t n = pread(msu_fd(f), buf, chunk, msu_pos);
+			if (n < 0) n = 0;
+			memset(buf + n, 0, chunk - n);
+			msu_end.store(msu_pos + chunk, std::memory_order_relaxed);
+		}
+		msu_pos += chunk;
+	}
+	else
+	{
+		memset(buf, 0, chunk);
+		if (f->size) FileReadAdv(f, buf, chunk);
+	}
 
 	user_io_set_index(idx);
 	user_io_set_download(1);
 	user_io_file_tx_data(buf, chunk);
 	user_io_set_download(0);
 
+	msu_fill(f);
 	return 1;
 }
 
 void snes_msu_init(const char* name)
 {
 	static fileTYPE f = {};
+	msu_stop();
 	FileClose(&f_audio);
 
 	memset(snes_romFileName, 0, 1024);
@@ -408,7 +542,10 @@ void snes_poll(void)
 		case 0x35:
 			snprintf(SelectedPath, sizeof(SelectedPath), "%s-%d.pcm", snes_romFileName, data);
 			printf("MSU: New track selected: %s\n", SelectedPath);
+			msu_stop();
 			FileOpen(&f_audio, SelectedPath);
+			msu_restart(0);
+			msu_fill(&f_audio);
 			printf(f_audio.size ? "MSU: Track mounted\n" : "MSU: Track not found!\n");
 			msu_send_command((f_audio.size << 16) | MSU_AUDIO_TRACK_MOUNTED);
 			break;
@@ -416,6 +553,7 @@ void snes_poll(void)
 		case 0x36:
 			printf("MSU: Jump to offset: 0x%X\n", data * 1024);
 			FileSeek(&f_audio, data * 1024, SEEK_SET);
+			msu_restart(data * 1024);
 			// fallthrough
 
 		case 0x34:
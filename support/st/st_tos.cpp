@@ -8,6 +8,9 @@
 #include "../../debug.h"
 #include "../../user_io.h"
 #include "../../fpga_io.h"
+#include "../../spi.h"
+#include "../../blockcache.h"
+#include "../../blockdev.h"
 #include "st_tos.h"
 
 #define ST_WRITE_MEMORY 0x08
@@ -117,8 +120,7 @@ static void memory_read(uint8_t *data, uint32_t words)
 	spi8(ST_READ_MEMORY);
 
 	// transmitted bytes must be multiple of 2 (-> words)
-	uint16_t *buf = (uint16_t*)data;
-	while (words--) *buf++ = spi_w(0);
+	spi_block_read(data, 1, words * 2);
 
 	DisableIO();
 }
@@ -128,8 +130,7 @@ static void memory_write(uint8_t *data, uint32_t words)
 	EnableIO();
 	spi8(ST_WRITE_MEMORY);
 
-	uint16_t *buf = (uint16_t*)data;
-	while (words--) spi_w(*buf++);
+	spi_block_write(data, 1, words * 2);
 
 	DisableIO();
 }
@@ -241,7 +242,7 @@ static void handle_acsi(unsigned char *buffer)
 				if (lba + length <= blocks)
 				{
 					DISKLED_ON;
-					FileSeekLBA(&hdd_image[target], lba);
+					uint64_t off = (uint64_t)lba * 512;
 					while (length)
 					{
 						uint32_t len = length;
@@ -249,8 +250,9 @@ static void handle_acsi(unsigned char *buffer)
 						length -= len;
 
 						len *= 512;
-						FileReadAdv(&hdd_image[target], buf, len);
+						blockdev_read(BLOCKDEV_ACSI(target), &hdd_image[target], off, buf, len);
 						memory_write(buf, len / 2);
+						off += len;
 					}
 					DISKLED_OFF;
 
@@ -291,7 +293,7 @@ static void handle_acsi(unsigned char *buffer)
 				if (lba + length <= blocks)
 				{
 					DISKLED_ON;
-					FileSeekLBA(&hdd_image[target], lba);
+					uint64_t off = (uint64_t)lba * 512;
 					while (length)
 					{
 						uint32_t len = length;
@@ -300,7 +302,8 @@ static void handle_acsi(unsigned char *buffer)
 
 						len *= 512;
 						memory_read(buf, len / 2);
-						FileWriteAdv(&hdd_image[target], buf, len);
+						blockdev_write(BLOCKDEV_ACSI(target), &hdd_image[target], off, buf, len);
+						off += len;
 					}
 					DISKLED_OFF;
 					dma_ack(0x00);
@@ -334,6 +337,12 @@ static void handle_acsi(unsigned char *buffer)
 			asc[target] = 0x00;
 			break;
 
+		case 0x35: // synchronize cache
+			blockcache_flush(BLOCKCACHE_ACSI(target));
+			dma_ack(0x00);
+			asc[target] = 0x00;
+			break;
+
 		case 0x1a: // mode sense
 			if (device == 0) {
 				tos_debugf("ACSI: mode sense, blocks = %u", blocks);
@@ -395,11 +404,15 @@ static void fill_tx(uint16_t fill, uint32_t len, int index)
 	user_io_set_index(index);
 	user_io_set_download(1);
 
-	len /= 2;
-	EnableFpga();
-	spi8(FIO_FILE_TX_DAT);
-	while(len--) spi_w(fill);
-	DisableFpga();
+	static uint16_t buf[2048];
+	for (uint32_t i = 0; i < sizeof(buf) / 2; i++) buf[i] = fill;
+
+	while (len)
+	{
+		uint32_t chunk = (len > sizeof(buf)) ? sizeof(buf) : len;
+		user_io_file_tx_data((const uint8_t*)buf, chunk);
+		len -= chunk;
+	}
 
 	user_io_set_download(0);
 }
@@ -415,20 +428,30 @@ void tos_load_cartridge(const char *name)
 	{
 		tos_debugf("Set cartridge: %s\n", tos_cart_img);
 
+		// the image is sent on every reset, keep it until the cartridge changes
 		const int sz = (128 * 1024) + 4;
-		uint8_t *buf = new uint8_t[sz];
-		if (buf)
+		static uint8_t *buf = NULL;
+		static char buf_img[1024] = {};
+		static int buf_dongle = -1;
+
+		int dongle = (config.system_ctrl & TOS_CONTROL_DONGLE) ? 1 : 0;
+		if (!buf) buf = new uint8_t[sz];
+		if (buf && (dongle != buf_dongle || strcmp(buf_img, tos_cart_img)))
 		{
 			memset(buf, -1, sz);
-			if (!(config.system_ctrl & TOS_CONTROL_DONGLE)) FileLoad(tos_cart_img, buf, sz);
+			if (!dongle) FileLoad(tos_cart_img, buf, sz);
+			strcpy(buf_img, tos_cart_img);
+			buf_dongle = dongle;
+		}
 
+		if (buf)
+		{
 			user_io_set_index(2);
 			user_io_set_download(1);
 			user_io_file_tx_data(buf + 4, sz - 4);
 			DisableFpga();
 
 			user_io_set_download(0);
-			delete buf;
 		}
 	}
 }
@@ -506,6 +529,7 @@ static void tos_select_hdd_image(int i, const char *name)
 	tos_debugf("Select ACSI%c image %s", '0' + i, name);
 
 	strcpy(config.acsi_img[i], name);
+	blockcache_drop(BLOCKCACHE_ACSI(i));
 	if (!strlen(name))
 	{
 		FileClose(&hdd_image[i]);
@@ -568,8 +592,8 @@ void tos_reset(char cold)
 		{
 			tos_debugf("TOS.IMG:\n  size = %d", len);
 
-			if (len >= 256 * 1024) user_io_file_tx(config.tos_img, 0);
-			else if (len == 192 * 1024) user_io_file_tx(config.tos_img, 1);
+			if (len >= 256 * 1024) user_io_file_tx_cached(config.tos_img, 0);
+			else if (len == 192 * 1024) user_io_file_tx_cached(config.tos_img, 1);
 			else tos_debugf("WARNING: Unexpected TOS size!");
 		}
 		else
@@ -626,7 +650,7 @@ void tos_config_save(int slot)
 {
 	char name[64] = { CONFIG_FILENAME };
 	name[7] = '0' + slot;
-	FileSaveConfig(name, &config, sizeof(config));
+	FileSaveConfigLater(name, &config, sizeof(config));
 }
 
 // configuration file check
@@ -29,6 +29,8 @@
 #include <time.h>
 #include <assert.h>
 
+#include <vector>
+
 #include "../../file_io.h"
 #include "../../user_io.h"
 #include "../../menu.h"
@@ -47,239 +49,188 @@
 #define UEF_stopBit     1
 #define UEF_Baud        (1000000.0/(16.0*52.0))
 
+// One entry per chunk that produces tape bits, in tape order
 typedef struct {
-    // UEF header
     uint16_t    id;
+    uint32_t    offset;         // chunk data in the file image
     uint32_t    length;
-    // chunk data
-    uint32_t    file_offset;
-    uint32_t    bit_offset_start;
-    uint32_t    bit_offset_end;
+    uint32_t    bit_start;      // prefix sum of the bit lengths
+    uint32_t    bit_len;
     uint32_t    pre_carrier;
-} __attribute__((packed)) ChunkInfo;
-
-// TODO - allocate this as part of the desc structure
-static ChunkInfo s_ChunkData = { 0,0,0,0,0,0 };
-
+} UEF_Chunk;
 
-
-static uint16_t ReadChunkHeader(FILE* f, ChunkInfo* chunk)
+static uint16_t UEF_Read16(const uint8_t *p)
 {
-    chunk->id = -1;
-    chunk->length = 0;
-
-    if (fread(chunk, 1, UEF_ChunkHeaderSize, f) != UEF_ChunkHeaderSize) {
-        return (-1);
-    }
-
-    //fprintf(stderr, "ReadChunkHeader: chunk->id %d chunk->length %d\n", chunk->id,chunk->length);
-    return chunk->id;
+    return p[0] | (p[1] << 8);
 }
 
-static ChunkInfo* GetChunkAtPosFile(FILE *f, uint32_t* p_bit_pos)
+// Parses the chunk list of an uncompressed UEF image once. Returns the tape length in bits.
+static uint32_t UEF_BuildIndex(const uint8_t *data, uint32_t size, std::vector<UEF_Chunk> &index)
 {
-    uint32_t bit_pos = *p_bit_pos;
-    uint8_t length_check = (bit_pos == 0xffffffff);
-    ChunkInfo* chunk = &s_ChunkData;
-
-    //fprintf(stderr, "Find pos : %d\n", bit_pos);
-
-    if (chunk->bit_offset_start <= bit_pos && bit_pos < chunk->bit_offset_end) {
-        bit_pos -= chunk->bit_offset_start;
-        *p_bit_pos = bit_pos;
-        return chunk;
-    }
-
-    uint32_t chunk_start = 0;
-    uint32_t chunk_bitlen = 0;
+    uint32_t pos = 12;          // sizeof(UEF_header)
+    uint32_t bit_pos = 0;
 
-    if (chunk->bit_offset_end != 0 && bit_pos >= chunk->bit_offset_end) {
-        fseek(f, chunk->file_offset + chunk->length, SEEK_SET);
-        chunk_start = chunk->bit_offset_end;
-        bit_pos -= chunk_start;
+    while (pos + UEF_ChunkHeaderSize <= size) {
+        UEF_Chunk chunk = {};
+        chunk.id = UEF_Read16(data + pos);
+        memcpy(&chunk.length, data + pos + 2, sizeof(chunk.length));
+        chunk.offset = pos + UEF_ChunkHeaderSize;
 
-    } else {
-        fseek(f, 12, SEEK_SET);     // sizeof(UEF_header)
-    }
+        uint32_t avail = size - chunk.offset;
+        if (chunk.length > avail) chunk.length = avail;
 
-    chunk->bit_offset_end = 0;
+        const uint8_t *p = data + chunk.offset;
+        uint16_t id = chunk.id;
 
-    while (!feof(f)) {
-        uint16_t id = ReadChunkHeader(f, chunk);
+        //fprintf(stderr, "Parse ChunkID : %04x - Length : %4d bytes (%04x) - Offset = %d\n", chunk.id, chunk.length, chunk.length, chunk.offset);
 
-        if (id == (uint16_t) - 1) {
-            break;
-        }
+        if (UEF_tapeID == id) {
+            chunk.bit_len = chunk.length * 10;
 
-        //fprintf(stderr, "Parse ChunkID : %04x - Length : %4d bytes (%04x) - Offset = %d\n", chunk->id, chunk->length, chunk->length, (uint32_t)ftell(f));
-        chunk->file_offset = ftell(f);
+        } else if (UEF_gapID == id || UEF_highToneID == id) {
+            if (chunk.length < 2) break;
+            chunk.bit_len = UEF_Read16(p) * (UEF_Baud / 1000.0);
 
-        if (UEF_tapeID == id || UEF_gapID == id || UEF_highToneID == id || UEF_highDummyID == id) {
+        } else if (UEF_highDummyID == id) {
+            if (chunk.length < 4) break;
+            chunk.pre_carrier = UEF_Read16(p) * (UEF_Baud / 1000.0);
+            uint32_t post_carrier = UEF_Read16(p + 2) * (UEF_Baud / 1000.0);
+            chunk.bit_len = chunk.pre_carrier + 20 + post_carrier;
 
-            if (id == UEF_tapeID) {
-                chunk_bitlen = chunk->length * 10;
+        } else if (UEF_infoID == id) {
+            char buffer[64];
+            uint32_t length = chunk.length;
 
-            } else if (id == UEF_gapID || id == UEF_highToneID) {
-                uint16_t ms;
+            while (length > 0) {
+                uint32_t read_len = length;
 
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
-                    break;
+                if (read_len > sizeof(buffer) - 1) {
+                    read_len = sizeof(buffer) - 1;
                 }
 
-                chunk_bitlen = ms * (UEF_Baud / 1000.0);
-                fseek(f, -sizeof(ms), SEEK_CUR);
-
-            } else if (id == UEF_highDummyID) {
-                uint16_t ms;
-
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
-                    break;
-                }
-
-                chunk->pre_carrier = ms * (UEF_Baud / 1000.0);
-
-                if (fread(&ms, 1, sizeof(ms), f) != sizeof(ms)) {
-                    break;
-                }
-
-                uint32_t post_carrier = ms * (UEF_Baud / 1000.0);
-                chunk_bitlen = chunk->pre_carrier + 20 + post_carrier;
-                fseek(f, -sizeof(ms) * 2, SEEK_CUR);
-            }
+                memcpy(buffer, p, read_len);
+                buffer[read_len] = '\0';
+                fprintf(stderr, "Drv02:UEF Info : '%s'", buffer);
 
-            if (bit_pos < chunk_bitlen) {
-                chunk->bit_offset_start = chunk_start;
-                chunk->bit_offset_end = chunk_start + chunk_bitlen;
-                break;
+                p += read_len;
+                length -= read_len;
             }
 
-            bit_pos -= chunk_bitlen;
-            chunk_start += chunk_bitlen;
+        } else if (UEF_freqChgID == id) {
+            float freq = 0;
+            if (chunk.length >= sizeof(freq)) memcpy(&freq, p, sizeof(freq));
+            fprintf(stderr, "Drv02:Ignoring base frequency change : %d", (int)freq);
 
-        } else if (length_check) {
+        } else if (UEF_floatGapID == id) {
+            float gap = 0;
+            if (chunk.length >= sizeof(gap)) memcpy(&gap, p, sizeof(gap));
+            fprintf(stderr, "Drv02:Ignoring floating point gap : %d ms", (int)(gap * 1000.f));
 
-            if (UEF_infoID == id) {
-                char buffer[64];
-                uint32_t length = chunk->length;
+        } else if (UEF_securityID == id) {
+            fprintf(stderr, "Drv02:UEF security block ignored");
 
-                while (length > 0) {
-                    uint32_t read_len = length;
-
-                    if (read_len > sizeof(buffer) - 1) {
-                        read_len = sizeof(buffer) - 1;
-                    }
-
-                    if (fread(buffer, 1, read_len, f) != read_len) {
-                        break;
-                    }
-
-                    buffer[read_len] = '\0';
-                    fprintf(stderr, "Drv02:UEF Info : '%s'", buffer);
-
-                    length -= read_len;
-                }
-
-            } else if (UEF_freqChgID == id) {
-                float freq;
-
-                if (fread(&freq, 1, sizeof(freq), f) != sizeof(freq)) {
-                    break;
-                }
-
-                fprintf(stderr, "Drv02:Ignoring base frequency change : %d", (int)freq);
-
-            } else if (UEF_floatGapID == id) {
-                float gap;
-
-                if (fread(&gap, 1, sizeof(gap), f) != sizeof(gap)) {
-                    break;
-                }
-
-                fprintf(stderr, "Drv02:Ignoring floating point gap : %d ms", (int)(gap * 1000.f));
-
-            } else if (UEF_securityID == id) {
-
-                fprintf(stderr, "Drv02:UEF security block ignored");
-
-            } else {
-                fprintf(stderr, "Drv02:Unknown UEF block ID %04x", id);
-            }
+        } else {
+            fprintf(stderr, "Drv02:Unknown UEF block ID %04x", id);
+        }
 
-            fseek(f, chunk->file_offset, SEEK_SET);
+        if (chunk.bit_len) {
+            chunk.bit_start = bit_pos;
+            bit_pos += chunk.bit_len;
+            index.push_back(chunk);
         }
 
-        fseek(f, chunk->length, SEEK_CUR);
+        pos = chunk.offset + chunk.length;
     }
 
-    /*DEBUG(1, "OK!");*/
-
-    *p_bit_pos = bit_pos;
-    return chunk->bit_offset_end ? chunk : 0;
+    return bit_pos;
 }
 
-static uint8_t GetBitAtPos(FILE *f, uint32_t bit_pos)
+// Packs tape bits MSB first and hands every full buffer to the FPGA
+typedef struct {
+    uint8_t    *buf;
+    uint32_t    buf_size;
+    uint32_t    pos;
+    uint32_t    acc;
+    uint32_t    cnt;
+    uint32_t    sent;
+    uint32_t    total;
+    fileTYPE   *file;
+    int         use_progress;
+} UEF_Writer;
+
+static void UEF_Flush(UEF_Writer *w)
 {
-    ChunkInfo* info = GetChunkAtPosFile(f, &bit_pos);
+    if (!w->pos) return;
 
-    if (!info) {
-        return 0;
-    }
+    if (w->use_progress) ProgressMessage("Loading", w->file->name, w->sent, w->total);
+    user_io_file_tx_data(w->buf, w->pos);
+    w->sent += w->pos;
+    w->pos = 0;
+}
 
-    uint16_t id = info->id;
+static inline void UEF_PutByte(UEF_Writer *w, uint8_t val)
+{
+    w->buf[w->pos++] = val;
+    if (w->pos == w->buf_size) UEF_Flush(w);
+}
 
-    if (id == UEF_gapID) {
-        return 0;
+// n <= 24
+static inline void UEF_PutBits(UEF_Writer *w, uint32_t bits, uint32_t n)
+{
+    w->acc = (w->acc << n) | bits;
+    w->cnt += n;
 
-    } else if (id == UEF_highToneID) {
-        return 1;
+    while (w->cnt >= 8) {
+        w->cnt -= 8;
+        UEF_PutByte(w, (uint8_t)(w->acc >> w->cnt));
     }
+}
 
-    if (id == UEF_tapeID) {
-
-        uint32_t byte_offset = bit_pos / 10;
-        uint32_t bit_offset = bit_pos - byte_offset * 10;
-
-        if (bit_offset == 0) {
-            return UEF_startBit;
-        }
+static void UEF_PutRun(UEF_Writer *w, uint32_t bit, uint32_t n)
+{
+    while (n && w->cnt) {
+        UEF_PutBits(w, bit, 1);
+        n--;
+    }
 
-        if (bit_offset == 9) {
-            return UEF_stopBit;
-        }
+    uint8_t fill = bit ? 0xFF : 0x00;
+    for (; n >= 8; n -= 8) UEF_PutByte(w, fill);
 
-        uint8_t byte;
-        fseek(f, info->file_offset + byte_offset, SEEK_SET);
-        int ret=fread(&byte, 1, sizeof(byte), f);
-        if (ret<0) fprintf(stderr,"uef: error reading byte\n");
+    UEF_PutBits(w, bit ? (1 << n) - 1 : 0, n);
+}
 
-        bit_offset -= 1;        // E (0,7)
-        assert(bit_offset < 8);
+// start bit, data bits LSB first, stop bit
+static uint16_t s_frame[256];
 
-        return (byte & (1 << bit_offset)) ? 1 : 0;
+static void UEF_InitFrames()
+{
+    for (int i = 0; i < 256; i++) {
+        uint32_t rev = 0;
+        for (int bit = 0; bit < 8; bit++) {
+            if (i & (1 << bit)) rev |= 0x80 >> bit;
+        }
+        s_frame[i] = (UEF_startBit << 9) | (rev << 1) | UEF_stopBit;
     }
+}
 
-    assert(id == UEF_highDummyID);
-
-    if ((bit_pos < info->pre_carrier) || (bit_pos >= info->pre_carrier + 20)) {
-        return 1;
-    }
+static void UEF_PutChunk(UEF_Writer *w, const uint8_t *data, const UEF_Chunk *chunk)
+{
+    if (chunk->id == UEF_gapID) {
+        UEF_PutRun(w, 0, chunk->bit_len);
 
-    bit_pos -= info->pre_carrier;
-    bit_pos %= 10;
+    } else if (chunk->id == UEF_highToneID) {
+        UEF_PutRun(w, 1, chunk->bit_len);
 
-    if (bit_pos == 0) {
-        return UEF_startBit;
-    }
+    } else if (chunk->id == UEF_tapeID) {
+        const uint8_t *p = data + chunk->offset;
+        for (uint32_t i = 0; i < chunk->length; i++) UEF_PutBits(w, s_frame[p[i]], 10);
 
-    if (bit_pos == 9) {
-        return UEF_stopBit;
+    } else if (chunk->id == UEF_highDummyID) {
+        UEF_PutRun(w, 1, chunk->pre_carrier);
+        UEF_PutBits(w, s_frame['A'], 10);
+        UEF_PutBits(w, s_frame['A'], 10);
+        UEF_PutRun(w, 1, chunk->bit_len - chunk->pre_carrier - 20);
     }
-
-    bit_pos -= 1;       // E (0,7)
-    assert(bit_pos < 8);
-    uint8_t byte = 'A';
-
-    return (byte & (1 << bit_pos)) ? 1 : 0;
 }
 
 #define BUFLEN      16384
@@ -287,42 +238,34 @@ static uint8_t GetBitAtPos(FILE *f, uint32_t bit_pos)
 
 #define kBufferSize 4096
 
-static int uef_copy_file(fileTYPE *source, FILE *dest)
+static int uef_copy_file(fileTYPE *source, std::vector<uint8_t> &dest)
 {
-unsigned char in[CHUNK];
-int num_bytes;
-
-
-  do {
-       num_bytes = FileReadAdv(source, in, CHUNK,-1);
-       fprintf(stderr,"fread: %d\n",num_bytes);
-       if (num_bytes<0) {
-           fprintf(stderr,"uef_copy_file: error reading data\n");
-           return -1;
-       }
-       if (fwrite(in, 1, num_bytes, dest) != (size_t)num_bytes || ferror(dest)) {
-           fprintf(stderr,"uef_copy_file: error writing data\n");
-           return -1;
-       }
-   } while (num_bytes!=0);
+  dest.resize(source->size);
+
+  int num_bytes = FileReadAdv(source, dest.data(), dest.size(), -1);
+  if (num_bytes<0) {
+      fprintf(stderr,"uef_copy_file: error reading data\n");
+      dest.clear();
+      return -1;
+  }
 
+  dest.resize(num_bytes);
   return 0;
 }
 
-/* Decompress from file source to file dest until stream ends or EOF.
+/* Decompress from file source into the dest buffer until stream ends or EOF.
    inf() returns Z_OK on success, Z_MEM_ERROR if memory could not be
    allocated for processing, Z_DATA_ERROR if the deflate data is
    invalid or incomplete, Z_VERSION_ERROR if the version of zlib.h and
    the version of the library linked do not match, or Z_ERRNO if there
-   is an error reading or writing the files. */
-static int uef_inflate_file(fileTYPE *source, FILE *dest)
+   is an error reading the file. */
+static int uef_inflate_file(fileTYPE *source, std::vector<uint8_t> &dest)
 {
 
     int ret;
-    unsigned have;
     z_stream strm;
     unsigned char in[CHUNK];
-    unsigned char out[CHUNK];
+    size_t have = 0;
 
     /* allocate inflate state */
     strm.zalloc = Z_NULL;
@@ -335,6 +278,9 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
     if (ret != Z_OK)
         return ret;
 
+    // tapes compress well, start with room for a 4:1 ratio
+    dest.resize(source->size * 4 + CHUNK);
+
     /* decompress until deflate stream ends or end of file */
     do {
 
@@ -342,19 +288,20 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
         strm.avail_in= res;
         if (res<0) {
             (void)inflateEnd(&strm);
+            dest.resize(have);
             return Z_ERRNO;
         }
         if (strm.avail_in == 0)
             break;
         strm.next_in = in;
 
-        /* run inflate() on input until output buffer not full */
+        /* run inflate() on input until the output has room left */
         do {
 
-            strm.avail_out = CHUNK;
-            strm.next_out = out;
-
+            if (dest.size() - have < CHUNK) dest.resize(dest.size() * 2);
 
+            strm.avail_out = dest.size() - have;
+            strm.next_out = dest.data() + have;
 
             ret = inflate(&strm, Z_NO_FLUSH);
             assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
@@ -362,23 +309,22 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
             case Z_NEED_DICT:
                 ret = Z_DATA_ERROR;     /* and fall through */
                 (void)inflateEnd(&strm);
+                dest.resize(have);
                 return ret;
             break;
             case Z_DATA_ERROR:
                 (void)inflateEnd(&strm);
+                dest.resize(have);
                 return ret;
             break;
             case Z_MEM_ERROR:
                 (void)inflateEnd(&strm);
+                dest.resize(have);
                 return ret;
             break;
             }
 
-            have = CHUNK - strm.avail_out;
-            if (fwrite(out, 1, have, dest) != have || ferror(dest)) {
-                (void)inflateEnd(&strm);
-                return Z_ERRNO;
-            }
+            have = dest.size() - strm.avail_out;
 
         } while (strm.avail_out == 0);
 
@@ -387,6 +333,7 @@ static int uef_inflate_file(fileTYPE *source, FILE *dest)
 
     /* clean up and return */
     (void)inflateEnd(&strm);
+    dest.resize(have);
     return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
 }
 
@@ -394,7 +341,6 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
 {
         uint32_t buf_size=kBufferSize;
         unsigned char fbuf[kBufferSize];
-        int addr=0;
 
         typedef struct {
             char    ueftag[10];
@@ -416,96 +362,62 @@ int UEF_FileSend(fileTYPE *inputfile,int use_progress)
         // we need to rewind to the beginning
         FileSeek(inputfile, 0, SEEK_SET);
 
-        FILE *uncompressed_file= tmpfile();
+        std::vector<uint8_t> data;
 
         // 1f 8b is the gzip magic number
         if (fbuf[0]==0x1f && fbuf[1]==0x8b) {
             fprintf(stderr,"UEF is compressed\n");
-            uef_inflate_file(inputfile, uncompressed_file);
+            uef_inflate_file(inputfile, data);
         }
         else {
-            uef_copy_file(inputfile,uncompressed_file);
+            uef_copy_file(inputfile, data);
             fprintf(stderr,"UEF is not compressed\n");
         }
 
-        rewind(uncompressed_file);
-
-        if (fread(&header, 1, sizeof(UEF_header), uncompressed_file) != sizeof(UEF_header)) {
+        if (data.size() < sizeof(UEF_header)) {
             fprintf(stderr,"Couldn't read file header\n");
+            return 0;
+        }
 
-        } else if (memcmp(header.ueftag, "UEF File!\0", sizeof(header.ueftag)) != 0) {
+        memcpy(&header, data.data(), sizeof(UEF_header));
+        if (memcmp(header.ueftag, "UEF File!\0", sizeof(header.ueftag)) != 0) {
             fprintf(stderr,"UEF file header mismatch\n");
             fprintf(stderr,"File compressed?\n");
+            return 0;
+        }
 
-        } else {
-            fprintf(stderr,"UEF: %s %d %d\n",header.ueftag,header.minor_version,header.major_version);
-
-            // figure out how big the file is
-            fseek(uncompressed_file, 0L, SEEK_END);
-            uint32_t size =ftell(uncompressed_file);
-            fprintf(stderr,"size: %d\n",size);
-            rewind(uncompressed_file);
-//FILE *outfile = fopen("tape.raw","wb");
-
-
-            //
-            //  Read the header to find out how big the audio file should be
-            //
-            memset(&s_ChunkData, 0x00, sizeof(ChunkInfo));
-            uint32_t numbits = 0xffffffff;
-            GetChunkAtPosFile(uncompressed_file,&numbits);
-
-            numbits = ~numbits;
-
-            uint32_t bits_per_second = 1225;
-            fprintf(stderr, "Bit length  : %d\n", numbits);
-            fprintf(stderr, "Wave length : %ds\n", numbits / bits_per_second);
-            fprintf(stderr, "Byte length : %d\n", (numbits + 7) / 8);
-
-            // size is the output size of the file we are creating (or dynamically sending)
-            size= (numbits + 7) / 8;
-            uint32_t  orig_size=size;
-
-            fprintf(stderr,"output size: %d\n",size);
-
-            // clear the header
-            memset(&s_ChunkData, 0x00, sizeof(ChunkInfo));
-            uint32_t tot_size=0;
-            uint32_t cur_size=0;
-            uint32_t act_size=0;
-
-            while (size) {
-                cur_size= size;
-                if (cur_size>  buf_size) cur_size=buf_size;
-                act_size=cur_size;
-                // artifically clamp size to the end of the bit stream
-                if (addr + act_size >  orig_size)
-                   act_size = orig_size  - addr;
-
-               tot_size+=act_size;
-               // this is a very naive conversion, but it'll have to do for now..
-               for (uint32_t pos = 0; pos < act_size; ++pos) {
-                   uint8_t val = 0;
-                   for (uint32_t bit = 0; bit < 8; ++bit) {
-                      val = val << 1;
-                      val = val | GetBitAtPos(uncompressed_file, ((addr + pos) << 3) + bit);
-                   }
-
-                   fbuf[pos] = val;
-               }
-               if (use_progress) ProgressMessage("Loading", inputfile->name, orig_size-size  , orig_size);
-               user_io_file_tx_data(fbuf, act_size);
-               if (act_size!=cur_size)
-                  fprintf(stderr,"truncated?\n");
-//fwrite(fbuf,1,act_size,outfile);
-               size -= cur_size;
-               addr += cur_size;
-            }
-         fclose(uncompressed_file);
+        fprintf(stderr,"UEF: %s %d %d\n",header.ueftag,header.minor_version,header.major_version);
 
-//fclose(outfile);
-      }
-  return 0;
-}
+        // the whole image is parsed and decoded from memory
+        uint32_t size = data.size();
+        fprintf(stderr,"size: %d\n",size);
+
+        std::vector<UEF_Chunk> index;
+        uint32_t numbits = UEF_BuildIndex(data.data(), size, index);
+
+        uint32_t bits_per_second = 1225;
+        fprintf(stderr, "Bit length  : %d\n", numbits);
+        fprintf(stderr, "Wave length : %ds\n", numbits / bits_per_second);
+        fprintf(stderr, "Byte length : %d\n", (numbits + 7) / 8);
+
+        // size is the output size of the file we are creating (or dynamically sending)
+        size= (numbits + 7) / 8;
+        fprintf(stderr,"output size: %d\n",size);
 
+        UEF_InitFrames();
 
+        UEF_Writer w = {};
+        w.buf = fbuf;
+        w.buf_size = buf_size;
+        w.total = size;
+        w.file = inputfile;
+        w.use_progress = use_progress;
+
+        for (const UEF_Chunk &chunk : index) UEF_PutChunk(&w, data.data(), &chunk);
+
+        // pad the last byte
+        if (w.cnt) UEF_PutBits(&w, 0, 8 - w.cnt);
+        UEF_Flush(&w);
+
+        return 0;
+}
@@ -38,6 +38,7 @@
 #include "../../fpga_io.h"
 #include "../../shmem.h"
 #include "../../ide.h"
+#include "../../blockdev.h"
 #include "x86_share.h"
 
 #define FDD0_BASE   0xF200
@@ -268,13 +269,9 @@ static void x86_dma_sendbuf(uint32_t address, uint32_t length, uint32_t *data)
 	fpga_spi_fast(address);
 	fpga_spi_fast(0);
 
+	// the FDD and higher regions take one byte per transfer
 	if(address < FDD0_BASE) fpga_spi_fast_block_write((uint16_t*)data, length * 2);
-	else
-	{
-		uint8_t *buf = (uint8_t*)data;
-		length *= 4;
-		while (length--) spi_w(*buf++);
-	}
+	else fpga_spi_fast_block_write_8((uint8_t*)data, length * 4);
 	DisableIO();
 }
 
@@ -288,14 +285,13 @@ static void x86_dma_recvbuf(uint32_t address, uint32_t length, uint32_t *data)
 	if (address < FDD0_BASE) fpga_spi_fast_block_read((uint16_t*)data, length * 2);
 	else if (address == FDD0_BASE)
 	{
-		while (length--) *data++ = spi_w(0);
-	}
-	else
-	{
-		uint8_t *buf = (uint8_t*)data;
-		length *= 4;
-		while (length--) *buf++ = spi_w(0);
+		// FDD parameters, one 16-bit transfer per dword
+		uint16_t words[16];
+		if (length > 16) length = 16;
+		fpga_spi_fast_block_read(words, length);
+		for (uint32_t i = 0; i < length; i++) data[i] = words[i];
 	}
+	else fpga_spi_fast_block_read_8((uint8_t*)data, length * 4);
 	DisableIO();
 }
 
@@ -349,19 +345,31 @@ static uint8_t get_fdd_bios_type(char type)
 
 static fileTYPE fdd0_image = {};
 static fileTYPE fdd1_image = {};
+
+// The core asks for floppy sectors one by one, so the rest of the track
+// is read along with the first one and served from here.
+#define FDD_CACHE_SECTORS 36
+
+static struct
+{
+	fileTYPE *img;
+	uint32_t lba;
+	uint32_t cnt;
+	uint32_t buf[128 * FDD_CACHE_SECTORS];
+} fdd_cache = {};
+
+static int fdd_spt[2] = {};
 static fileTYPE ide_image[4] = {};
 static bool boot_from_floppy = 1;
 
 static int img_read(fileTYPE *f, uint32_t lba, void *buf, uint32_t cnt)
 {
-	if (!FileSeekLBA(f, lba)) return 0;
-	return FileReadAdv(f, buf, cnt * 512);
+	return blockdev_read(BLOCKDEV_FDD(f == &fdd1_image), f, (uint64_t)lba * 512, buf, cnt * 512);
 }
 
 static uint32_t img_write(fileTYPE *f, uint32_t lba, void *buf, uint32_t cnt)
 {
-	if (!FileSeekLBA(f, lba)) return 0;
-	return FileWriteAdv(f, buf, cnt * 512);
+	return blockdev_write(BLOCKDEV_FDD(f == &fdd1_image), f, (uint64_t)lba * 512, buf, cnt * 512);
 }
 
 static void fdd_set(int num, char* filename)
@@ -369,6 +377,7 @@ static void fdd_set(int num, char* filename)
 	floppy_type[num] = FDD_TYPE_1440;
 
 	fileTYPE *fdd_image = num ? &fdd1_image : &fdd0_image;
+	if (fdd_cache.img == fdd_image) fdd_cache.cnt = 0;
 
 	int floppy = ide_img_mount(fdd_image, filename, 1);
 	uint32_t size = fdd_image->size/512;
@@ -430,6 +439,7 @@ static void fdd_set(int num, char* filename)
 	}
 
 	int floppy_total_sectors = floppy_spt * floppy_heads * floppy_cylinders;
+	fdd_spt[num] = floppy_spt;
 
 	printf("floppy:\n");
 	printf("  cylinders:     %d\n", floppy_cylinders);
@@ -460,7 +470,12 @@ static void hdd_set(int num, char* filename)
 	int len = strlen(filename);
 	int vhd = (len > 4 && !strcasecmp(filename + len - 4, ".vhd"));
 
-	if (num > 1 && !vhd)
+	blockdev_detach(&ide_image[num]);
+	if (blockdev_attach(BLOCKDEV_IDE(num), &ide_image[num], filename))
+	{
+		present = 1;
+	}
+	else if (num > 1 && !vhd)
 	{
 		const char *img_name = cdrom_parse(num, filename);
 		if (img_name) present = ide_img_mount(&ide_image[num], img_name, 0);
@@ -480,6 +495,7 @@ static void hdd_set(int num, char* filename)
 		{
 			fseek(fd, 0L, SEEK_END);
 			size = ftello64(fd);
+			if (present) size = ide_image[num].size; // CHDs are smaller than the disk
 			if ((hdd_fi = FindHDDInfoBySize(size)))
 			{
 				ide_img_set(num, present ? &ide_image[num] : 0, cd, hdd_fi->sectors, hdd_fi->heads);
@@ -674,9 +690,21 @@ static void fdd_io(uint8_t read)
 
 		if (img->size)
 		{
-			if (img_read(img, sd_params.lba, &secbuf, 1))
+			uint32_t lba = sd_params.lba;
+			if (fdd_cache.img != img || lba < fdd_cache.lba || lba >= fdd_cache.lba + fdd_cache.cnt)
+			{
+				// read the whole track
+				uint32_t spt = fdd_spt[img == &fdd1_image];
+				if (!spt || spt > FDD_CACHE_SECTORS) spt = 1;
+
+				fdd_cache.img = img;
+				fdd_cache.lba = lba - (lba % spt);
+				fdd_cache.cnt = img_read(img, fdd_cache.lba, fdd_cache.buf, spt) / 512;
+			}
+
+			if (lba >= fdd_cache.lba && lba < fdd_cache.lba + fdd_cache.cnt)
 			{
-				x86_dma_sendbuf(FDD0_BASE + 255, 128, secbuf);
+				x86_dma_sendbuf(FDD0_BASE + 255, 128, fdd_cache.buf + (lba - fdd_cache.lba) * 128);
 				res = 1;
 			}
 		}
@@ -702,6 +730,7 @@ static void fdd_io(uint8_t read)
 			{
 				if (img->mode & O_RDWR)
 				{
+					if (fdd_cache.img == img) fdd_cache.cnt = 0;
 					if (img_write(img, sd_params.lba, secbuf, sd_params.cnt))
 					{
 						res = 1;
@@ -761,7 +790,7 @@ static char* get_config_name()
 void x86_config_save()
 {
 	config.ver = CFG_VER;
-	FileSaveConfig(get_config_name(), &config, sizeof(config));
+	FileSaveConfigLater(get_config_name(), &config, sizeof(config));
 }
 
 void x86_config_load()
@@ -30,18 +30,22 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <sys/statvfs.h>
 #include <time.h>
 
 #include <map>
 #include <string>
 #include <vector>
+#include <unordered_map>
 
 #include "../../hardware.h"
 #include "../../user_io.h"
 #include "../../file_io.h"
 #include "../../cfg.h"
 #include "../../shmem.h"
+#include "../../offload.h"
+#include "../../sharedir.h"
 
 #define SHMEM_ADDR      0x300CE000
 #define SHMEM_SIZE      0x2000
@@ -96,11 +100,7 @@ enum AL_SUBFUNCTIONS {
 static char basepath[1024] = {};
 static int baselen = 0;
 
-struct dir_item_t
-{
-	dirent64 de;
-	stat64 st;
-};
+typedef sharedir_item_t dir_item_t;
 
 struct lock
 {
@@ -109,6 +109,7 @@ struct lock
 };
 
 static std::map<short, lock> locks;
+static std::unordered_map<uint16_t, short> lock_tokens;
 static short next_key = 0;
 
 static short get_key()
@@ -128,15 +129,20 @@ static short get_key()
 
 static short get_lock(const uint16_t token)
 {
-	for (const auto &pair : locks)
-	{
-		if (pair.second.token == token)
-		{
-			dbg_print("! token %u has lock: %d\n", token, pair.first);
-			return pair.first;
-		}
-	}
-	return 0;
+	auto it = lock_tokens.find(token);
+	if (it == lock_tokens.end()) return 0;
+
+	dbg_print("! token %u has lock: %d\n", token, it->second);
+	return it->second;
+}
+
+static void del_lock(short key)
+{
+	auto it = locks.find(key);
+	if (it == locks.end()) return;
+
+	lock_tokens.erase(it->second.token);
+	locks.erase(it);
 }
 
 static short add_lock(const uint16_t token)
@@ -150,6 +156,7 @@ static short add_lock(const uint16_t token)
 	{
 		key = get_key();
 		locks[key] = { token, {} };
+		lock_tokens[token] = key;
 		dbg_print("+ add lock: %d, %u\n", key, token);
 	}
 	return key;
@@ -173,6 +180,117 @@ static short get_fp()
 	return fp;
 }
 
+// Read-ahead window for the file DOS reads sequentially, in (512 byte)
+// requests which would all go to the storage otherwise. Once a window is
+// full the following one is read on the offload thread, so a long copy
+// only waits for the storage when DOS is faster than it.
+#define RA_SIZE (64 * 1024)
+
+static uint8_t ra_bufs[2][RA_SIZE];
+
+static struct
+{
+	short key;
+	uint32_t off;
+	uint32_t len;
+	uint32_t next;      // end of the previous read
+	uint8_t *buf;
+
+	int ahead;          // the window after this one is (being) read
+	uint32_t ahead_off;
+	int ahead_len;
+	uint8_t *ahead_buf;
+	offload_job_t job;
+} ra = {};
+
+static void __attribute__((noinline)) memcpyb(void *dst, const void *src, int len);
+
+static void ra_drop()
+{
+	if (ra.job) offload_wait(ra.job);
+	ra.job = 0;
+	ra.ahead = 0;
+	ra.key = 0;
+}
+
+static void ra_start_ahead(fileTYPE *f)
+{
+	uint32_t end = ra.off + ra.len;
+	if (ra.ahead || ra.len < RA_SIZE || !f->filp || f->zcache) return;
+
+	// positional reads on the descriptor don't disturb the main thread
+	int fd = fileno(f->filp);
+	ra.ahead_len = 0;
+	ra.ahead_off = end;
+	ra.job = offload_try_work([fd, end]()
+	{
+		ssize_t len = pread64(fd, ra.ahead_buf, RA_SIZE, end);
+		ra.ahead_len = (len < 0) ? -1 : (int)len;
+	}, OFFLOAD_IO);
+	ra.ahead = ra.job != 0;
+}
+
+static int ra_read(short key, fileTYPE *f, uint32_t off, void *dst, uint32_t sz)
+{
+	if (!ra.buf)
+	{
+		ra.buf = ra_bufs[0];
+		ra.ahead_buf = ra_bufs[1];
+	}
+
+	if (ra.key != key)
+	{
+		ra_drop();
+		ra.key = key;
+		ra.len = 0;
+		ra.next = UINT32_MAX;
+	}
+
+	uint32_t end = ra.off + ra.len;
+	int hit = ra.len && off >= ra.off && off <= end && (off + sz <= end || ra.len < RA_SIZE);
+	if (!hit && ra.ahead && off == ra.ahead_off && off == ra.next)
+	{
+		offload_wait(ra.job);
+		ra.job = 0;
+		ra.ahead = 0;
+
+		if (ra.ahead_len >= 0)
+		{
+			uint8_t *buf = ra.buf;
+			ra.buf = ra.ahead_buf;
+			ra.ahead_buf = buf;
+
+			ra.off = off;
+			ra.len = ra.ahead_len;
+			end = off + ra.len;
+			hit = off + sz <= end || ra.len < RA_SIZE;
+		}
+	}
+
+	if (!hit && (off == ra.next || !off) && sz < RA_SIZE)
+	{
+		if (ra.job) offload_wait(ra.job);
+		ra.job = 0;
+		ra.ahead = 0;
+
+		int len = FileReadAt(f, off, ra.buf, RA_SIZE, -1);
+		if (len < 0) return -1;
+
+		ra.off = off;
+		ra.len = len;
+		end = off + len;
+		hit = 1;
+	}
+
+	ra.next = off + sz;
+	if (!hit) return FileReadAt(f, off, dst, sz, -1);
+
+	uint32_t n = (off + sz <= end) ? sz : end - off;
+	memcpyb(dst, ra.buf + (off - ra.off), n);
+	ra_start_ahead(f);
+	return n;
+}
+
 static char* find_path(const char *name)
 {
 	dbg_print("find_path(%s)\n", name);
@@ -268,11 +386,39 @@ static char* find_path(const char *name)
 	return str;
 }
 
-static void __attribute__((noinline)) memcpyb(void *dst, const void *src, int len)
+// One side is the uncached request buffer where unaligned (and so libc
+// memcpy) accesses fault. Words are used only when both sides line up,
+// the loops must not be turned into a memcpy call.
+static void __attribute__((noinline, optimize("no-tree-loop-distribute-patterns"))) memcpyb(void *dst, const void *src, int len)
 {
-	char *d = (char*)dst;
-	char *s = (char*)src;
-	while (len--) *d++ = *s++;
+	uint8_t *d = (uint8_t*)dst;
+	const uint8_t *s = (const uint8_t*)src;
+
+	if (!(((uintptr_t)d ^ (uintptr_t)s) & 3))
+	{
+		while (len > 0 && ((uintptr_t)d & 3))
+		{
+			*d++ = *s++;
+			len--;
+		}
+
+		uint32_t *dw = (uint32_t*)d;
+		const uint32_t *sw = (const uint32_t*)s;
+		for (; len >= 16; len -= 16, dw += 4, sw += 4)
+		{
+			uint32_t a = sw[0], b = sw[1], c = sw[2], e = sw[3];
+			dw[0] = a;
+			dw[1] = b;
+			dw[2] = c;
+			dw[3] = e;
+		}
+		for (; len >= 4; len -= 4) *dw++ = *sw++;
+
+		d = (uint8_t*)dw;
+		s = (const uint8_t*)sw;
+	}
+
+	while (len-- > 0) *d++ = *s++;
 }
 
 
@@ -291,7 +437,7 @@ static uint32_t get_attr(char *path, uint16_t *time, uint16_t *date, uint32_t *s
 	if (date) *date = 0;
 	if (size) *size = 0;
 
-	stat64 *st = getPathStat(path);
+	struct stat64 *st = getPathStat(path);
 	if (!st) return 0;
 
 	tm *t = localtime(&st->st_mtime);
@@ -713,6 +859,7 @@ static int process_request(void *reqres_buffer)
 		key = *(short *)buf;
 		if (open_file_handles.find(key) != open_file_handles.end())
 		{
+			if (ra.key == key) ra_drop();
 			FileClose(&open_file_handles[key]);
 			open_file_handles.erase(key);
 
@@ -740,9 +887,7 @@ static int process_request(void *reqres_buffer)
 		uint16_t sz = buf[6] | (buf[7] << 8);
 		dbg_print("  read %d bytes at %d\n", sz, off);
 
-		FileSeek(&open_file_handles[key], off, SEEK_SET);
-
-		int read = FileReadAdv(&open_file_handles[key], buf, sz, -1);
+		int read = ra_read(key, &open_file_handles[key], off, buf, sz);
 		if (read < 0)
 		{
 			res = 5;
@@ -771,6 +916,7 @@ static int process_request(void *reqres_buffer)
 		memcpyb(&off, buf, 4);
 		uint16_t sz = buf[6] | (buf[7] << 8);
 		dbg_print("  write %d bytes at %d\n", sz, off);
+		if (ra.key == key) ra_drop();
 
 		FileSeek(&open_file_handles[key], off, SEEK_SET);
 
@@ -974,12 +1120,10 @@ static int process_request(void *reqres_buffer)
 		*flt++ = 0;
 		key = add_lock(token);
 
-		const char* full_path = getFullPath(path);
-		DIR *d = opendir(full_path);
-		if (!d)
+		const std::vector<dir_item_t> *items = sharedir_get(path, 0);
+		if (!items)
 		{
-			locks.erase(key);
-			printf("Couldn't open dir: %s\n", full_path);
+			del_lock(key);
 			res = 0x12;
 			break;
 		}
@@ -1007,24 +1151,16 @@ static int process_request(void *reqres_buffer)
 		}
 		else
 		{
-			struct dirent64 de, *de2;
-			while ((de2 = readdir64(d)))
+			for (const auto &item : *items)
 			{
-				if (de2->d_type == DT_REG || (attr & FAT_DIR))
+				if ((item.de.d_type == DT_REG || (attr & FAT_DIR)) && cmp_name(item.de.d_name, flt))
 				{
-					memcpy(&de, de2, sizeof(dirent64));
-					sprintf(str, "%s/%s", path, de.d_name);
-					stat64 *st = getPathStat(str);
-
-					if (st && cmp_name(de.d_name, flt))
-					{
-						name83(de2->d_name, de.d_name);
-						de.d_name[11] = 0;
-						locks[key].dir_items.push_back({ de, *st });
-					}
+					dir_item_t found = item;
+					name83(item.de.d_name, found.de.d_name);
+					found.de.d_name[11] = 0;
+					locks[key].dir_items.push_back(found);
 				}
 			}
-			closedir(d);
 		}
 	}
 	// fall through
@@ -1049,7 +1185,7 @@ static int process_request(void *reqres_buffer)
 
 		if (idx >= locks[key].dir_items.size())
 		{
-			if (locks.find(key) != locks.end()) locks.erase(key);
+			del_lock(key);
 
 			dbg_print("No more items\n");
 			res = 0x12;
@@ -1117,6 +1253,26 @@ static int process_request(void *reqres_buffer)
 
 	}
 
+	switch (func)
+	{
+	case AL_WRITE:
+		sharedir_written();
+		// fall through
+	case AL_RMDIR:
+	case AL_MKDIR:
+	case AL_SETATTR:
+	case AL_RENAME:
+	case AL_DELETE:
+	case AL_CREATE:
+	case AL_SPOPEN:
+		sharedir_drop();
+		break;
+
+	case AL_CLOSE:
+		sharedir_close();
+		break;
+	}
+
 	((short *)reqres_buffer)[0] = reslen;
 	((short *)reqres_buffer)[2] = res;
 	dbg_print("result %d, %d:\n", reslen, res);
@@ -1156,8 +1312,11 @@ void x86_share_poll()
 
 void x86_share_reset()
 {
+	ra_drop();
 	open_file_handles.clear();
 	locks.clear();
+	lock_tokens.clear();
+	sharedir_drop();
 	next_fp = 1;
 	next_key = 1;
 }
@@ -0,0 +1,180 @@
+#include "swap_util.h"
+#include "profiling.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+// NEON loops handle 32 bytes per pass, the scalar tails finish the rest.
+
+void swap16_buf(void *buf, size_t count)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+#ifdef __ARM_NEON
+	for (; count >= 16; count -= 16, p += 32)
+	{
+		uint8x16_t a = vld1q_u8(p);
+		uint8x16_t b = vld1q_u8(p + 16);
+		vst1q_u8(p, vrev16q_u8(a));
+		vst1q_u8(p + 16, vrev16q_u8(b));
+	}
+#endif
+
+	for (; count; count--, p += 2)
+	{
+		uint8_t t = p[0];
+		p[0] = p[1];
+		p[1] = t;
+	}
+}
+
+void swap32_buf(void *buf, size_t count)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+#ifdef __ARM_NEON
+	for (; count >= 8; count -= 8, p += 32)
+	{
+		uint8x16_t a = vld1q_u8(p);
+		uint8x16_t b = vld1q_u8(p + 16);
+		vst1q_u8(p, vrev32q_u8(a));
+		vst1q_u8(p + 16, vrev32q_u8(b));
+	}
+#endif
+
+	for (; count; count--, p += 4)
+	{
+		uint8_t t0 = p[0], t1 = p[1];
+		p[0] = p[3];
+		p[1] = p[2];
+		p[2] = t1;
+		p[3] = t0;
+	}
+}
+
+void swap32_words_buf(void *buf, size_t count)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+#ifdef __ARM_NEON
+	for (; count >= 8; count -= 8, p += 32)
+	{
+		uint16x8_t a = vreinterpretq_u16_u8(vld1q_u8(p));
+		uint16x8_t b = vreinterpretq_u16_u8(vld1q_u8(p + 16));
+		vst1q_u8(p, vreinterpretq_u8_u16(vrev32q_u16(a)));
+		vst1q_u8(p + 16, vreinterpretq_u8_u16(vrev32q_u16(b)));
+	}
+#endif
+
+	for (; count; count--, p += 4)
+	{
+		uint8_t t0 = p[0], t1 = p[1];
+		p[0] = p[2];
+		p[1] = p[3];
+		p[2] = t0;
+		p[3] = t1;
+	}
+}
+
+void swap32_mid_buf(void *buf, size_t count)
+{
+	uint8_t *p = (uint8_t *)buf;
+
+#ifdef __ARM_NEON
+	uint32x4_t mo = vdupq_n_u32(0xFF0000FF);
+	uint32x4_t mh = vdupq_n_u32(0x00FF0000);
+	uint32x4_t ml = vdupq_n_u32(0x0000FF00);
+
+	for (; count >= 8; count -= 8, p += 32)
+	{
+		uint32x4_t a = vreinterpretq_u32_u8(vld1q_u8(p));
+		uint32x4_t b = vreinterpretq_u32_u8(vld1q_u8(p + 16));
+		a = vorrq_u32(vandq_u32(a, mo), vorrq_u32(vandq_u32(vshlq_n_u32(a, 8), mh), vandq_u32(vshrq_n_u32(a, 8), ml)));
+		b = vorrq_u32(vandq_u32(b, mo), vorrq_u32(vandq_u32(vshlq_n_u32(b, 8), mh), vandq_u32(vshrq_n_u32(b, 8), ml)));
+		vst1q_u8(p, vreinterpretq_u8_u32(a));
+		vst1q_u8(p + 16, vreinterpretq_u8_u32(b));
+	}
+#endif
+
+	for (; count; count--, p += 4)
+	{
+		uint8_t t = p[1];
+		p[1] = p[2];
+		p[2] = t;
+	}
+}
+
+void scatter_units(void *dst, const void *src, size_t units, int unitlen, const uint8_t *offsets, int bytes)
+{
+	uint8_t *d = (uint8_t *)dst;
+	const uint8_t *s = (const uint8_t *)src;
+
+	int identity = (bytes == unitlen);
+	for (int i = 0; i < bytes && identity; i++) identity = (offsets[i] == i);
+	if (identity)
+	{
+		memcpy(d, s, units * unitlen);
+		return;
+	}
+
+#ifdef __ARM_NEON
+	// one 8 byte block of dst per pass, vtbl picks its bytes out of the next
+	// 8 source bytes and the mask keeps what the other parts have put there
+	int fits = (unitlen == 2 || unitlen == 4 || unitlen == 8);
+	for (int i = 0; i < bytes && fits; i++) fits = (offsets[i] < unitlen);
+	if (fits)
+	{
+		uint8_t idx[8], msk[8];
+		int upb = 8 / unitlen;
+		for (int j = 0; j < 8; j++)
+		{
+			idx[j] = 0xFF;
+			for (int i = 0; i < bytes; i++)
+			{
+				if (offsets[i] == j % unitlen) idx[j] = (j / unitlen) * bytes + i;
+			}
+			msk[j] = (idx[j] == 0xFF) ? 0 : 0xFF;
+		}
+
+		uint8x8_t vidx = vld1_u8(idx);
+		uint8x8_t vmsk = vld1_u8(msk);
+		int step = upb * bytes;
+
+		for (; units >= (size_t)upb && units * bytes >= 8; units -= upb, d += 8, s += step)
+		{
+			uint8x8_t t = vtbl1_u8(vld1_u8(s), vidx);
+			vst1_u8(d, vbsl_u8(vmsk, t, vld1_u8(d)));
+		}
+	}
+#endif
+
+	for (; units; units--, d += unitlen)
+	{
+		for (int i = 0; i < bytes; i++) d[offsets[i]] = *s++;
+	}
+}
+
+static void swap_bench_run(const char *name, void (*fn)(void *, size_t), size_t elem)
+{
+	static uint8_t buf[1024 * 1024];
+	const int loops = 16;
+
+	for (uint32_t i = 0; i < sizeof(buf); i++) buf[i] = (uint8_t)(i * 13 + (i >> 9));
+
+	uint64_t start = profiling_time_us();
+	for (int n = 0; n < loops; n++) fn(buf, sizeof(buf) / elem);
+	profiling_bench_report(name, profiling_time_us() - start, loops, sizeof(buf) * loops);
+}
+
+void swap_bench()
+{
+	// swap16/swap32 are also the n64 ROM normalize_data
+	swap_bench_run("swap16 1MB", swap16_buf, 2);
+	swap_bench_run("swap32 1MB", swap32_buf, 4);
+	swap_bench_run("swap32_words 1MB", swap32_words_buf, 4);
+	swap_bench_run("swap32_mid 1MB", swap32_mid_buf, 4);
+}
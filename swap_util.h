@@ -0,0 +1,35 @@
+/*
+* swap_util.h
+*
+*/
+
+#ifndef SWAP_UTIL_H
+#define SWAP_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-place byte order conversion of whole buffers, count is in elements.
+// Buffers need no particular alignment.
+
+// AB -> BA, e.g. CHD CDDA samples
+void swap16_buf(void *buf, size_t count);
+
+// ABCD -> DCBA
+void swap32_buf(void *buf, size_t count);
+
+// ABCD -> CDAB
+void swap32_words_buf(void *buf, size_t count);
+
+// ABCD -> ACBD, NeoGeo sprite ROM layout
+void swap32_mid_buf(void *buf, size_t count);
+
+// Interleaved ROM layouts: src is cut into groups of bytes, group n goes
+// to the dst unit n (unitlen bytes each), byte i at offsets[i]. Bytes of
+// dst not in offsets are kept.
+void scatter_units(void *dst, const void *src, size_t units, int unitlen, const uint8_t *offsets, int bytes);
+
+// Throughput of the swaps on a 1MB buffer, for MiSTer_cmd.
+void swap_bench();
+
+#endif
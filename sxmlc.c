@@ -39,6 +39,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#if !defined(SXMLC_UNICODE) && defined(__linux__)
+#define SXMLC_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 #include "sxmlc.h"
 
 /*
@@ -1592,6 +1599,29 @@ int XMLDoc_parse_file_SAX(const SXML_CHAR* filename, const SAX_Callbacks* sax, v
 	if (sax == NULL || filename == NULL || filename[0] == NULC)
 		return false;
 
+#ifdef SXMLC_MMAP
+	/* Parse the mapped file as a buffer instead of reading it through stdio one
+	   char at a time. The tail of the last page is zero filled, so it doubles
+	   as the terminator, unless the file ends on a page boundary. */
+	{
+		int fd = open(filename, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+
+		struct stat st;
+		if (!fstat(fd, &st) && st.st_size > 0 && (st.st_size % sysconf(_SC_PAGESIZE)) && st.st_size < 0x7FFFFFFF) {
+			void* map = mmap(NULL, st.st_size + 1, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (map != MAP_FAILED) {
+				ret = XMLDoc_parse_buffer_SAX((const SXML_CHAR*)map, filename, sax, user);
+				munmap(map, st.st_size + 1);
+				return ret;
+			}
+		}
+		else close(fd);
+	}
+#endif
+
 	f = sx_fopen(filename, fmode);
 	if (f == NULL)
 		return false;
@@ -1606,6 +1636,7 @@ int XMLDoc_parse_file_SAX(const SXML_CHAR* filename, const SAX_Callbacks* sax, v
 	sd.name = (SXML_CHAR*)filename;
 	sd.user = user;
 	sd.file = f;
+	sd.buffer = NULL;
 #ifdef SXMLC_UNICODE
 	bom = freadBOM(f, NULL, NULL); /* Skip BOM, if any */
 	/* In Unicode, re-open the file in text-mode if there is no BOM (or UTF-8) as we assume that
@@ -1636,9 +1667,20 @@ int XMLDoc_parse_buffer_SAX(const SXML_CHAR* buffer, const SXML_CHAR* name, cons
 
 	sd.name = name;
 	sd.user = user;
+	sd.file = NULL;
+	sd.buffer = &dsb;
 	return _parse_data_SAX((void*)&dsb, DATA_SOURCE_BUFFER, sax, &sd);
 }
 
+long SAX_Data_position(const SAX_Data* sd)
+{
+	if (sd == NULL)
+		return 0;
+	if (sd->buffer != NULL)
+		return sd->buffer->cur_pos;
+	return sd->file != NULL ? ftell(sd->file) : 0;
+}
+
 int XMLDoc_parse_file_DOM_text_as_nodes(const SXML_CHAR* filename, XMLDoc* doc, int text_as_nodes)
 {
 	DOM_through_SAX dom;
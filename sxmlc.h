@@ -270,10 +270,16 @@ typedef enum _XMLEvent {
 typedef struct _SAX_Data {
 	const SXML_CHAR* name;
 	FILE *file;
+	DataSourceBuffer *buffer;
 	int line_num;
 	void* user;
 } SAX_Data;
 
+/*
+ Current read position in the parsed file or buffer.
+ */
+long SAX_Data_position(const SAX_Data* sd);
+
 /*
  User callbacks used for SAX parsing. Return values of these callbacks should be 0 to stop parsing.
  Members can be set to NULL to disable handling of some events.
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <netdb.h>
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <bluetooth.h>
+#include <hci.h>
+#include <hci_lib.h>
+
+#include "file_io.h"
+#include "battery.h"
+#include "offload.h"
+#include "scheduler.h"
+#include "profiling.h"
+#include "sysstatus.h"
+
+#define SYSSTATUS_TICK_US    250000
+#define SYSSTATUS_PERIOD_US  2000000
+
+static sysstatus_t status = {};
+
+// owned by the job while it's in flight, published on the main thread
+static sysstatus_t sample = {};
+static char sample_root[1024];
+static offload_job_t sample_job = 0;
+
+static uint64_t next_sample_us = 0;
+static int nl_fd = -1;
+static int timer_id = -1;
+
+static void sample_net(sysstatus_t *st)
+{
+	struct ifaddrs *ifaddr, *ifa, *ifae = 0, *ifaw = 0;
+
+	st->eth[0] = 0;
+	st->wlan[0] = 0;
+
+	if (getifaddrs(&ifaddr) == -1)
+	{
+		printf("getifaddrs: error\n");
+		return;
+	}
+
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+	{
+		if (ifa->ifa_addr == NULL) continue;
+		if (!memcmp(ifa->ifa_addr->sa_data, "\x00\x00\xa9\xfe", 4)) continue; // 169.254.x.x
+
+		if ((strcmp(ifa->ifa_name, "eth0") == 0)     && (ifa->ifa_addr->sa_family == AF_INET)) ifae = ifa;
+		if ((strncmp(ifa->ifa_name, "wlan", 4) == 0) && (ifa->ifa_addr->sa_family == AF_INET)) ifaw = ifa;
+	}
+
+	if (ifae) getnameinfo(ifae->ifa_addr, sizeof(struct sockaddr_in), st->eth, sizeof(st->eth), NULL, 0, NI_NUMERICHOST);
+	if (ifaw) getnameinfo(ifaw->ifa_addr, sizeof(struct sockaddr_in), st->wlan, sizeof(st->wlan), NULL, 0, NI_NUMERICHOST);
+
+	freeifaddrs(ifaddr);
+}
+
+static void sample_run()
+{
+	sample.has_battery = getBattery(0, &sample.bat);
+	sample_net(&sample);
+	sample.bluetooth = hci_get_route(0) >= 0;
+
+	struct statvfs buf;
+	sample.storage_avail = statvfs(sample_root, &buf) ? 0 : (uint64_t)buf.f_bsize * buf.f_bavail;
+}
+
+// interface and address changes trigger a sample right away
+static void netlink_open()
+{
+	nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl_fd < 0) return;
+
+	struct sockaddr_nl addr = {};
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+	if (bind(nl_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		close(nl_fd);
+		nl_fd = -1;
+	}
+}
+
+static int netlink_changed()
+{
+	static char buf[4096];
+	int changed = 0;
+	while (nl_fd >= 0 && recv(nl_fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) changed = 1;
+	return changed;
+}
+
+static uint32_t sysstatus_tick()
+{
+	if (sample_job && offload_job_done(sample_job))
+	{
+		uint32_t seq = status.seq + 1;
+		status = sample;
+		status.seq = seq ? seq : 1;
+		sample_job = 0;
+	}
+
+	uint64_t now = profiling_time_us();
+	if (netlink_changed()) next_sample_us = now;
+
+	if (!sample_job && now >= next_sample_us)
+	{
+		snprintf(sample_root, sizeof(sample_root), "%s", getRootDir());
+
+		// a busy pool just delays the sample, it never runs here
+		sample_job = offload_try_work([] { sample_run(); }, OFFLOAD_IO);
+		if (sample_job) next_sample_us = now + SYSSTATUS_PERIOD_US;
+	}
+
+	return SYSSTATUS_TICK_US;
+}
+
+void sysstatus_init()
+{
+	if (timer_id >= 0) return;
+
+	netlink_open();
+	timer_id = scheduler_timer_add("sysstatus", sysstatus_tick, 1);
+}
+
+const sysstatus_t *sysstatus_get()
+{
+	return &status;
+}
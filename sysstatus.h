@@ -0,0 +1,27 @@
+#ifndef SYSSTATUS_H
+#define SYSSTATUS_H
+
+#include <inttypes.h>
+#include "battery.h"
+
+// Battery, network, bluetooth and storage state, sampled on the offload
+// pool at a low rate (and on interface changes) so the menu never waits on
+// SMBus or getifaddrs. All calls are main thread only.
+
+struct sysstatus_t
+{
+	int has_battery;
+	battery_data_t bat;
+	char eth[64];            // IP of eth0, empty if down
+	char wlan[64];           // IP of the first wlan, empty if down
+	int bluetooth;           // an HCI adapter is present
+	uint64_t storage_avail;  // free bytes of the root dir
+	uint32_t seq;            // bumped by every new sample, 0 - none yet
+};
+
+void sysstatus_init();
+
+// Latest published sample.
+const sysstatus_t *sysstatus_get();
+
+#endif
@@ -0,0 +1,388 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <atomic>
+
+#include "thumbs.h"
+#include "file_io.h"
+#include "user_io.h"
+#include "video.h"
+#include "offload.h"
+#include "lib/imlib2/Imlib2.h"
+
+#define THUMBS_DIR   "/tmp/thumbs"
+#define THUMBS_MAGIC 0x424D4854 // "THMB"
+#define THUMBS_FILES 8
+#define THUMBS_ITEMS 4096
+#define THUMBS_MAX   (32 * 1024 * 1024)
+#define THUMBS_ART   "boxart"
+#define THUMB_W      96
+#define THUMB_H      128
+
+struct thumbs_hdr_t
+{
+	uint32_t magic;
+	uint16_t thumb_w;
+	uint16_t thumb_h;
+	int64_t mtime[2];   // the folder and its art folder
+	char dir[1024];
+	uint32_t count;
+	uint32_t pixels;
+};
+
+// sorted by hash, followed by the pixels
+struct thumbs_item_t
+{
+	uint32_t hash;
+	uint16_t w;
+	uint16_t h;
+	uint32_t offset;    // in pixels
+};
+
+struct thumbs_build_t
+{
+	thumbs_item_t *items;
+	uint32_t *pix;
+	uint32_t count;
+	uint32_t pixels;
+};
+
+enum
+{
+	THUMBS_LOAD = 0,
+	THUMBS_BUILD,
+	THUMBS_WAIT,
+	THUMBS_DONE
+};
+
+static struct
+{
+	char dir[1024];         // as given to thumbs_select
+	thumbs_hdr_t key;
+	uint32_t hash;          // 0 - not a folder
+	int state;
+	uint8_t *map;
+	size_t size;
+
+	uint32_t shown;         // name hash of the last selection
+	const uint8_t *shown_map;
+	int visible;
+} cur = {};
+
+static std::atomic<uint32_t> build_hash(0);
+static std::atomic<uint32_t> built_hash(0);
+
+static uint32_t name_hash(const char *name, int len)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len; i++) hash = (hash ^ (uint8_t)tolower((uint8_t)name[i])) * 16777619u;
+	return hash ? hash : 1;
+}
+
+static int64_t dir_mtime(const char *path)
+{
+	struct stat64 st;
+	if (stat64(path, &st) || !S_ISDIR(st.st_mode)) return 0;
+	return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+static uint32_t thumbs_key(const char *full, thumbs_hdr_t *hdr)
+{
+	memset(hdr, 0, sizeof(thumbs_hdr_t));
+	hdr->mtime[0] = dir_mtime(full);
+	if (!hdr->mtime[0]) return 0;
+
+	char art[1100];
+	snprintf(art, sizeof(art), "%s/" THUMBS_ART, full);
+	hdr->mtime[1] = dir_mtime(art);
+
+	hdr->magic = THUMBS_MAGIC;
+	hdr->thumb_w = THUMB_W;
+	hdr->thumb_h = THUMB_H;
+	snprintf(hdr->dir, sizeof(hdr->dir), "%s", full);
+	return name_hash(hdr->dir, strlen(hdr->dir));
+}
+
+static int thumbs_load(const thumbs_hdr_t *key, uint32_t hash)
+{
+	char name[64];
+	sprintf(name, THUMBS_DIR "/%08X", hash);
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return 0;
+
+	int ok = 0;
+	struct stat64 st;
+	if (!fstat64(fd, &st) && st.st_size >= (__off64_t)sizeof(thumbs_hdr_t))
+	{
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			const thumbs_hdr_t *hdr = (const thumbs_hdr_t *)map;
+			if (!memcmp(hdr, key, offsetof(thumbs_hdr_t, count)) && hdr->count <= THUMBS_ITEMS &&
+				st.st_size == (__off64_t)(sizeof(thumbs_hdr_t) + hdr->count * sizeof(thumbs_item_t) + (uint64_t)hdr->pixels * sizeof(uint32_t)))
+			{
+				cur.map = (uint8_t *)map;
+				cur.size = st.st_size;
+				ok = 1;
+			}
+			else
+			{
+				munmap(map, st.st_size);
+			}
+		}
+	}
+
+	close(fd);
+	return ok;
+}
+
+static void thumbs_unmap()
+{
+	if (cur.map) munmap(cur.map, cur.size);
+	cur.map = NULL;
+	cur.size = 0;
+}
+
+static const thumbs_item_t *thumbs_find(uint32_t hash)
+{
+	const thumbs_hdr_t *hdr = (const thumbs_hdr_t *)cur.map;
+	const thumbs_item_t *items = (const thumbs_item_t *)(hdr + 1);
+
+	int lo = 0, hi = (int)hdr->count - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (items[mid].hash == hash)
+		{
+			const thumbs_item_t *item = &items[mid];
+			return (item->offset + (uint32_t)item->w * item->h <= hdr->pixels) ? item : NULL;
+		}
+
+		if (items[mid].hash < hash) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return NULL;
+}
+
+// Imlib2 is shared with the menu background, the lock is held per image.
+static int thumbs_decode(const char *path, uint32_t *dst, uint16_t *w, uint16_t *h)
+{
+	int ok = 0;
+	video_imlib_lock();
+
+	Imlib_Image img = imlib_load_image_without_cache(path);
+	if (img)
+	{
+		imlib_context_set_image(img);
+		int sw = imlib_image_get_width();
+		int sh = imlib_image_get_height();
+
+		Imlib_Image small = NULL;
+		int dw = THUMB_W, dh = THUMB_H;
+		if (sw > 0 && sh > 0)
+		{
+			dh = sh * THUMB_W / sw;
+			if (dh > THUMB_H)
+			{
+				dh = THUMB_H;
+				dw = sw * THUMB_H / sh;
+			}
+			if (dw < 1) dw = 1;
+			if (dh < 1) dh = 1;
+			small = imlib_create_cropped_scaled_image(0, 0, sw, sh, dw, dh);
+		}
+		imlib_free_image_and_decache();
+
+		if (small)
+		{
+			imlib_context_set_image(small);
+			memcpy(dst, imlib_image_get_data_for_reading_only(), dw * dh * sizeof(uint32_t));
+			imlib_free_image();
+
+			*w = dw;
+			*h = dh;
+			ok = 1;
+		}
+	}
+
+	video_imlib_unlock();
+	return ok;
+}
+
+static void thumbs_scan(const char *dir, thumbs_build_t *b)
+{
+	DIR *d = opendir(dir);
+	if (!d) return;
+
+	struct dirent *de;
+	while ((de = readdir(d)) && b->count < THUMBS_ITEMS)
+	{
+		if (de->d_name[0] == '.') continue;
+
+		const char *ext = strrchr(de->d_name, '.');
+		if (!ext || (strcasecmp(ext, ".png") && strcasecmp(ext, ".jpg") && strcasecmp(ext, ".jpeg"))) continue;
+		if (b->pixels + THUMB_W * THUMB_H > THUMBS_MAX / sizeof(uint32_t)) break;
+
+		// the art folder goes first and wins
+		uint32_t hash = name_hash(de->d_name, ext - de->d_name);
+		uint32_t i = 0;
+		while (i < b->count && b->items[i].hash != hash) i++;
+		if (i < b->count) continue;
+
+		char path[1400];
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+
+		thumbs_item_t *item = &b->items[b->count];
+		if (!thumbs_decode(path, b->pix + b->pixels, &item->w, &item->h)) continue;
+
+		item->hash = hash;
+		item->offset = b->pixels;
+		b->pixels += (uint32_t)item->w * item->h;
+		b->count++;
+	}
+	closedir(d);
+}
+
+static int cmp_item(const void *a, const void *b)
+{
+	uint32_t x = ((const thumbs_item_t *)a)->hash, y = ((const thumbs_item_t *)b)->hash;
+	return (x > y) - (x < y);
+}
+
+static void thumbs_write(const thumbs_hdr_t *hdr, const thumbs_build_t *b, uint32_t hash)
+{
+	char name[16];
+	sprintf(name, "%08X", hash);
+
+	struct iovec iov[3] = {
+		{ (void*)hdr, sizeof(thumbs_hdr_t) },
+		{ b->items, b->count * sizeof(thumbs_item_t) },
+		{ b->pix, b->pixels * sizeof(uint32_t) }
+	};
+	cache_writev(THUMBS_DIR, name, iov, 3, THUMBS_FILES);
+}
+
+// runs on the offload pool, owns full
+static void thumbs_build(char *full, uint32_t hash)
+{
+	thumbs_hdr_t hdr;
+	thumbs_build_t b = {};
+
+	// untouched pages of the pixel buffer cost nothing
+	b.items = (thumbs_item_t *)malloc(THUMBS_ITEMS * sizeof(thumbs_item_t));
+	b.pix = (uint32_t *)malloc(THUMBS_MAX);
+
+	if (b.items && b.pix && thumbs_key(full, &hdr) == hash)
+	{
+		char art[1100];
+		snprintf(art, sizeof(art), "%s/" THUMBS_ART, full);
+		thumbs_scan(art, &b);
+		thumbs_scan(full, &b);
+
+		qsort(b.items, b.count, sizeof(thumbs_item_t), cmp_item);
+		hdr.count = b.count;
+		hdr.pixels = b.pixels;
+		thumbs_write(&hdr, &b, hash);
+		if (b.count) printf("thumbs: %u images of %s\n", b.count, full);
+	}
+
+	free(b.items);
+	free(b.pix);
+	free(full);
+
+	built_hash.store(hash);
+	build_hash.store(0);
+}
+
+static void thumbs_update()
+{
+	switch (cur.state)
+	{
+	case THUMBS_LOAD:
+		cur.state = thumbs_load(&cur.key, cur.hash) ? THUMBS_DONE : THUMBS_BUILD;
+		break;
+
+	case THUMBS_BUILD:
+		// one folder at a time, others wait for their turn
+		if (!build_hash.load())
+		{
+			char *full = strdup(cur.key.dir);
+			uint32_t hash = cur.hash;
+			if (!full) break;
+
+			build_hash.store(hash);
+			if (offload_try_work([full, hash]() { thumbs_build(full, hash); }, OFFLOAD_UI))
+			{
+				cur.state = THUMBS_WAIT;
+			}
+			else
+			{
+				free(full);
+				build_hash.store(0);
+			}
+		}
+		break;
+
+	case THUMBS_WAIT:
+		if (built_hash.load() == cur.hash)
+		{
+			thumbs_load(&cur.key, cur.hash);
+			cur.state = THUMBS_DONE;
+		}
+		break;
+	}
+}
+
+void thumbs_select(const char *dir, const char *name)
+{
+	if (!is_menu()) return;
+
+	if (strcmp(cur.dir, dir))
+	{
+		thumbs_hide();
+		thumbs_unmap();
+		snprintf(cur.dir, sizeof(cur.dir), "%s", dir);
+		cur.hash = thumbs_key(getFullPath(dir), &cur.key);
+		cur.state = THUMBS_LOAD;
+	}
+
+	if (!cur.hash) return;
+	if (cur.state != THUMBS_DONE) thumbs_update();
+
+	uint32_t hash = name ? name_hash(name, strlen(name)) : 0;
+	if (hash == cur.shown && cur.map == cur.shown_map) return;
+	cur.shown = hash;
+	cur.shown_map = cur.map;
+
+	const thumbs_item_t *item = (hash && cur.map) ? thumbs_find(hash) : NULL;
+	if (item)
+	{
+		const thumbs_hdr_t *hdr = (const thumbs_hdr_t *)cur.map;
+		const uint32_t *pix = (const uint32_t *)((const thumbs_item_t *)(hdr + 1) + hdr->count);
+		cur.visible = video_menu_thumb(pix + item->offset, item->w, item->h);
+	}
+	else if (cur.visible)
+	{
+		video_menu_thumb(NULL, 0, 0);
+		cur.visible = 0;
+	}
+}
+
+void thumbs_hide()
+{
+	cur.shown = 0;
+	cur.shown_map = NULL;
+	if (!cur.visible) return;
+
+	video_menu_thumb(NULL, 0, 0);
+	cur.visible = 0;
+}
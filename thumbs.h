@@ -0,0 +1,17 @@
+#ifndef THUMBS_H
+#define THUMBS_H
+
+// Box art of the file browser. The art of a folder is <name>.png or .jpg
+// in its "boxart" subfolder or next to the files, name being the entry
+// without its extension. A worker decodes and scales a folder's art once
+// into an atlas of framebuffer pixels in tmpfs, kept while both folders
+// stay unchanged. Browsing maps the atlas and copies the thumbnail of the
+// selected entry, so it costs a lookup and a small copy per key press.
+// It shows on the menu core only, the others have no background behind
+// the OSD. Main thread only.
+
+// Called on every pass of the browser, name is null for folders.
+void thumbs_select(const char *dir, const char *name);
+void thumbs_hide();
+
+#endif
@@ -10,8 +10,6 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 
-#include "lib/imlib2/Imlib2.h"
-
 #include "hardware.h"
 #include "osd.h"
 #include "user_io.h"
@@ -29,6 +27,7 @@
 #include "charrom.h"
 #include "scaler.h"
 #include "miniz.h"
+#include "zstd.h"
 #include "cheats.h"
 #include "video.h"
 #include "audio.h"
@@ -36,9 +35,20 @@
 #include "ide.h"
 #include "ide_cdrom.h"
 #include "profiling.h"
+#include "launch.h"
+#include "blockcache.h"
+#include "blockdev.h"
+#include "offload.h"
+#include "crc.h"
+#include "iotrace.h"
+#include "scheduler.h"
 
 #include "support.h"
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 static char core_path[1024] = {};
 static char rbf_path[1024] = {};
 
@@ -86,6 +96,11 @@ void user_io_store_filename(char *filename)
 	if (p) *p = 0;
 }
 
+const char *user_io_get_filename()
+{
+	return last_filename;
+}
+
 const char *get_image_name(int i)
 {
 	if (!sd_image[i].size)  return NULL;
@@ -414,64 +429,50 @@ int substrcpy(char *d, const char *s, char idx)
 	return (int)(d - b);
 }
 
-static char cur_status[16] = {};
+static uint32_t ss_base = 0;
+static uint32_t ss_size = 0;
 
-int user_io_status_bits(const char *opt, int *s, int *e, int ex, int single)
+// The cores only tell about a saved state through the counter word of its
+// slot. A save follows a hotkey or an OSD option, which both pass through
+// here, so the slots are checked every few frames for a while after those
+// and once a second otherwise.
+#define SS_POLL_FAST 20
+#define SS_POLL_IDLE 1000
+#define SS_FAST_TIME 3000
+static unsigned long ss_poll_timer = 0;
+static unsigned long ss_fast_timer = 0;
+
+static void ss_kick()
 {
-	uint32_t start = 0, end = 0;
-	if (opt[0] == '[')
-	{
-		if (!single && sscanf(opt, "[%u:%u]", &end, &start) == 2)
-		{
-			if (start > 127 || end > 127 || end <= start) return 0;
-		}
-		else if (sscanf(opt, "[%u]", &start) == 1)
-		{
-			if (start > 127) return 0;
-			end = start;
-		}
-		else return 0;
-	}
-	else
-	{
-		if ((opt[0] >= '0') && (opt[0] <= '9')) start = opt[0] - '0';
-		else if ((opt[0] >= 'A') && (opt[0] <= 'V')) start = opt[0] - 'A' + 10;
-		else return 0;
+	if (!ss_base) return;
+	ss_fast_timer = GetTimer(SS_FAST_TIME);
+	ss_poll_timer = 0;
+}
 
-		if (!single && (opt[1] >= '0') && (opt[1] <= '9')) end = opt[1] - '0';
-		else if (!single && (opt[1] >= 'A') && (opt[1] <= 'V')) end = opt[1] - 'A' + 10;
-		else
-		{
-			single = 1;
-			end = start;
-		}
+static char cur_status[16] = {};
 
-		if (ex)
-		{
-			start += 32;
-			end += 32;
-		}
+int user_io_status_bits(const char *opt, int *s, int *e, int ex, int single)
+{
+	status_opt_t o = user_io_status_opt(opt, ex, single);
+	if (!o.size) return 0;
 
-		if (start > 127 || end > 127 || (!single && end <= start)) return 0;
-	}
+	if (s) *s = o.start;
+	if (e) *e = o.end;
+	return o.size;
+}
 
-	//max 8 bits per option
-	if (end - start > 8) return 0;
+uint32_t user_io_status_get(status_opt_t opt)
+{
+	if (!opt.size) return 0;
 
-	if (s) *s = (int)start;
-	if (e) *e = (int)end;
-	return 1 + end - start;
+	uint32_t x = (cur_status[opt.end / 8] << 8) | cur_status[opt.start / 8];
+	x >>= opt.start % 8;
+	return x & ~(0xffffffff << opt.size);
 }
 
 uint32_t user_io_status_get(const char *opt, int ex)
 {
-	int start, end;
-	int size = user_io_status_bits(opt, &start, &end, ex);
-	if (!size) return 0;
-
-	uint32_t x = (cur_status[end / 8] << 8) | cur_status[start / 8];
-	x >>= start % 8;
-	return x & ~(0xffffffff << size);
+	return user_io_status_get(user_io_status_opt(opt, ex));
 }
 
 uint32_t user_io_status_mask(const char *opt)
@@ -489,17 +490,20 @@ uint32_t user_io_hd_mask(const char *opt)
 
 void user_io_status_set(const char *opt, uint32_t value, int ex)
 {
-	int start, end;
-	int size = user_io_status_bits(opt, &start, &end, ex);
-	if (!size) return;
+	user_io_status_set(user_io_status_opt(opt, ex), value);
+}
+
+void user_io_status_set(status_opt_t opt, uint32_t value)
+{
+	if (!opt.size) return;
 
-	int s = start / 8;
-	int e = end / 8;
+	int s = opt.start / 8;
+	int e = opt.end / 8;
 
-	uint32_t mask = ~(0xffffffff << size);
-	mask <<= start % 8;
+	uint32_t mask = ~(0xffffffff << opt.size);
+	mask <<= opt.start % 8;
 	uint32_t x = (cur_status[e] << 8) | cur_status[s];
-	x = (x & ~mask) | ((value << (start % 8)) & mask);
+	x = (x & ~mask) | ((value << (opt.start % 8)) & mask);
 
 	cur_status[s] = (char)x;
 	if (e != s) cur_status[e] = (char)(x >> 8);
@@ -510,6 +514,7 @@ void user_io_status_set(const char *opt, uint32_t value, int ex)
 		for (uint32_t i = 0; i < sizeof(cur_status); i += 2) spi_w((cur_status[i + 1] << 8) | cur_status[i]);
 		DisableIO();
 	}
+	ss_kick();
 }
 
 int user_io_status_save(const char *filename)
@@ -598,8 +603,8 @@ int user_io_get_joy_transl()
 }
 
 static int use_cheats = 0;
-static uint32_t ss_base = 0;
-static uint32_t ss_size = 0;
+static uint32_t ddr_base = 0;
+static uint32_t ddr_size = 0;
 static uint32_t uart_speeds[13] = {};
 static char uart_speed_labels[13][32] = {};
 static uint32_t midi_speeds[13] = {};
@@ -607,6 +612,9 @@ static char midi_speed_labels[13][32] = {};
 static const uint32_t mlink_speeds[13] = { 110, 300, 600, 1200, 2400, 4800, 9600, 14400, 19200, 31250, 38400, 57600, 115200 };
 static const char mlink_speed_labels[13][32] = { "110", "300", "600", "1200", "2400", "4800", "9600", "14400", "19200", "31250/MIDI", "38400", "57600", "115200" };
 static char defmra[1024] = {};
+
+// smallest file worth uploading through the core's DDR window
+#define DDR_UPLOAD_MIN (1024 * 1024)
 static int boot0_loaded = 0;
 static int boot0_mounted = 0;
 
@@ -664,6 +672,28 @@ static void parse_config()
 					}
 				}
 
+				if (!strncasecmp(p, "DDR", 3))
+				{
+					char *end = 0;
+					ddr_base = strtoul(p + 3, &end, 16);
+					p = end;
+					if (p && *p == ':')
+					{
+						p++;
+						ddr_size = strtoul(p, &end, 16);
+						p = end;
+					}
+
+					printf("Got DDR upload window: base=0x%X, size=0x%X\n", ddr_base, ddr_size);
+
+					if (!ddr_size || ddr_base < 0x20000000 || ddr_base >= 0x40000000 || (ddr_base + ddr_size) > 0x40000000)
+					{
+						ddr_size = 0;
+						ddr_base = 0;
+						printf("Invalid DDR upload window!\n");
+					}
+				}
+
 				if (!strncasecmp(p, "UART", 4))
 				{
 					p += 4;
@@ -1306,8 +1336,50 @@ int user_io_get_width()
 	return fio_size;
 }
 
+// Drive emulation of the cores which need it, picked once the core is known
+// so user_io_poll() doesn't go through the whole list of is_xxx() on every pass.
+struct core_hooks_t
+{
+	void (*poll)();        // every poll pass, nullptr - core has no drive clock
+	void (*reset)();       // user reset
+	void (*blank_save)(uint8_t *buffer, int size, uint32_t lba, int cnt);  // save sectors without an image
+};
+
+static void pce_blanksave(uint8_t *buffer, int size, uint32_t lba, int)
+{
+	memset(buffer, 0, size);
+	if (!lba) memcpy(buffer, "HUBM\x00\x88\x10\x80", 8);
+}
+
+static void mcd_blanksave(uint8_t *buffer, int, uint32_t lba, int) { mcd_fill_blanksave(buffer, lba); }
+static void saturn_blanksave(uint8_t *buffer, int, uint32_t lba, int) { saturn_fill_blanksave(buffer, lba); }
+static void psx_blanksave(uint8_t *buffer, int, uint32_t lba, int cnt) { psx_fill_blanksave(buffer, lba, cnt); }
+
+static const core_hooks_t hooks_none = {};
+static const core_hooks_t hooks_megacd = { mcd_poll, mcd_reset, mcd_blanksave };
+static const core_hooks_t hooks_pce = { pcecd_poll, pcecd_reset, pce_blanksave };
+static const core_hooks_t hooks_saturn = { saturn_poll, saturn_reset, saturn_blanksave };
+static const core_hooks_t hooks_psx = { psx_poll, nullptr, psx_blanksave };
+static const core_hooks_t hooks_neocd = { neocd_poll, neocd_reset, nullptr };
+static const core_hooks_t hooks_n64 = { n64_poll, nullptr, nullptr };
+
+static const core_hooks_t *core_hooks = &hooks_none;
+
+static void user_io_hooks_init()
+{
+	if (is_megacd()) core_hooks = &hooks_megacd;
+	else if (is_pce()) core_hooks = &hooks_pce;
+	else if (is_saturn()) core_hooks = &hooks_saturn;
+	else if (is_psx()) core_hooks = &hooks_psx;
+	else if (is_neogeo_cd()) core_hooks = &hooks_neocd;
+	else if (is_n64()) core_hooks = &hooks_n64;
+	else core_hooks = &hooks_none;
+}
+
 void user_io_init(const char *path, const char *xml)
 {
+	PROFILE_FUNCTION();
+
 	char *name;
 	static char mainpath[512];
 	core_name[0] = 0;
@@ -1370,7 +1442,10 @@ void user_io_init(const char *path, const char *xml)
 		SelectINI();
 	}
 
-	cfg_parse();
+	{
+		BOOT_SCOPE("cfg_parse");
+		cfg_parse();
+	}
 	cfg_print();
 	while (cfg.waitmount[0] && !is_menu())
 	{
@@ -1392,7 +1467,10 @@ void user_io_init(const char *path, const char *xml)
 	uint8_t hotswap[4] = {};
 	ide_reset(hotswap);
 
-	parse_config();
+	{
+		BOOT_SCOPE("parse_config");
+		parse_config();
+	}
 	if (!xml && defmra[0] && FileExists(defmra))
 	{
 		// attn: FC option won't use name from defmra!
@@ -1412,12 +1490,16 @@ void user_io_init(const char *path, const char *xml)
 		bootcore_init(xml ? xml : path);
 	}
 
-	video_init();
+	{
+		BOOT_SCOPE("video_init");
+		video_init();
+	}
 	if (strlen(cfg.font)) LoadFont(cfg.font);
 	load_volume();
 
 	user_io_send_buttons(1);
 	if (xml && isXmlName(xml) == 2) mgl_parse(xml);
+	user_io_hooks_init();
 
 	switch (core_type)
 	{
@@ -1645,6 +1727,7 @@ void user_io_init(const char *path, const char *xml)
 	if (!mgl_get()->count || is_menu() || is_st() || is_archie() || user_io_core_type() == CORE_TYPE_SHARPMZ)
 	{
 		mgl_get()->done = 1;
+		launch_end();
 	}
 	else
 	{
@@ -1663,20 +1746,33 @@ int user_io_get_joyswap()
 	return joyswap;
 }
 
+// stick updates of a batch are merged per stick, only the last one goes out
+static void user_io_analog_send(uint8_t cmd, uint8_t joy, char valueX, char valueY)
+{
+	uint16_t words[3] = { joy };
+	int count = 1;
+	if (io_ver) words[count++] = (valueY << 8) | (uint8_t)(valueX);
+	else
+	{
+		words[count++] = (uint8_t)valueX;
+		words[count++] = (uint8_t)valueY;
+	}
+
+	if (spi_batch_add(cmd, joy, words, count)) return;
+
+	spi_uio_cmd_cont(cmd);
+	for (int i = 0; i < count; i++) spi_w(words[i]);
+	DisableIO();
+}
+
 void user_io_l_analog_joystick(unsigned char joystick, char valueX, char valueY)
 {
 	uint8_t joy = (joystick > 1 || !joyswap) ? joystick : (joystick >= 15) ? (joystick ^ 16) : (joystick ^ 1);
 
 	if (core_type == CORE_TYPE_8BIT)
 	{
-		spi_uio_cmd8_cont(UIO_ASTICK, joy);
-		if(io_ver) spi_w((valueY << 8) | (uint8_t)(valueX));
-		else
-		{
-			spi8(valueX);
-			spi8(valueY);
-		}
-		DisableIO();
+		user_io_analog_send(UIO_ASTICK, joy, valueX, valueY);
+		input_latency_sent();
 	}
 }
 
@@ -1686,14 +1782,8 @@ void user_io_r_analog_joystick(unsigned char joystick, char valueX, char valueY)
 
 	if (core_type == CORE_TYPE_8BIT)
 	{
-		spi_uio_cmd8_cont(UIO_ASTICK_2, joy);
-		if (io_ver) spi_w((valueY << 8) | (uint8_t)(valueX));
-		else
-		{
-			spi8(valueX);
-			spi8(valueY);
-		}
-		DisableIO();
+		user_io_analog_send(UIO_ASTICK_2, joy, valueX, valueY);
+		input_latency_sent();
 	}
 }
 
@@ -1706,10 +1796,17 @@ void user_io_digital_joystick(unsigned char joystick, uint64_t map, int newdir)
 	// by other mapping being pressed
 	uint32_t bitmask = (uint32_t)(map) | (uint32_t)(map >> 32);
 	use32 |= bitmask >> 16;
-	spi_uio_cmd_cont((joy < 2) ? (UIO_JOYSTICK0 + joy) : (UIO_JOYSTICK2 + joy - 2));
-	spi_w(bitmask);
-	if(use32) spi_w(bitmask >> 16);
-	DisableIO();
+	uint16_t cmd = (joy < 2) ? (UIO_JOYSTICK0 + joy) : (UIO_JOYSTICK2 + joy - 2);
+	uint16_t words[2] = { (uint16_t)bitmask, (uint16_t)(bitmask >> 16) };
+	if (!spi_batch_add(cmd, 0, words, use32 ? 2 : 1))
+	{
+		spi_uio_cmd_cont(cmd);
+		spi_w(words[0]);
+		if(use32) spi_w(words[1]);
+		DisableIO();
+	}
+	input_latency_sent();
+	ss_kick();
 
 	if (!is_minimig() && joy_transl == 1 && newdir)
 	{
@@ -1773,19 +1870,22 @@ uint8_t user_io_ps2_ctl(uint8_t *kbd_ctl, uint8_t *mouse_ctl)
 	return res;
 }
 
-// 16 byte fifo for amiga key codes to limit max key rate sent into the core
-#define KBD_FIFO_SIZE  16   // must be power of 2
-static unsigned short kbd_fifo[KBD_FIFO_SIZE];
+// fifo for amiga key codes to limit max key rate sent into the core
+#define KBD_FIFO_SIZE  64   // must be power of 2
+static uint32_t kbd_fifo[KBD_FIFO_SIZE];
 static unsigned char kbd_fifo_r = 0, kbd_fifo_w = 0;
 static long kbd_timer = 0;
 
+// core has a FIFO of its own: 1 - yes, 0 - no, -1 - not asked yet
+static int kbd_burst = -1;
+
 static void kbd_fifo_minimig_send(uint32_t code)
 {
 	spi_uio_cmd8((code&OSD) ? UIO_KBD_OSD : UIO_KEYBOARD, code & 0xff);
 	kbd_timer = GetTimer(10);  // next key after 10ms earliest
 }
 
-static void kbd_fifo_enqueue(unsigned short code)
+static void kbd_fifo_enqueue(uint32_t code)
 {
 	// if fifo full just drop the value. This should never happen
 	if (((kbd_fifo_w + 1)&(KBD_FIFO_SIZE - 1)) == kbd_fifo_r)
@@ -1796,22 +1896,482 @@ static void kbd_fifo_enqueue(unsigned short code)
 	kbd_fifo_w = (kbd_fifo_w + 1)&(KBD_FIFO_SIZE - 1);
 }
 
+// free slots in the FIFO of the core, -1 if it has none
+static int kbd_core_free()
+{
+	uint16_t res;
+
+	spi_uio_cmd_cont(UIO_KBD_FIFO);
+	res = spi_w(0);
+	DisableIO();
+
+	return ((res & 0xFF00) == 0xA500) ? (res & 0xFF) : -1;
+}
+
+// sends as many queued codes as the core can take in one transfer
+static int kbd_fifo_burst()
+{
+	int n = kbd_core_free();
+	if (n < 0) return 0;
+
+	int cnt = (kbd_fifo_w - kbd_fifo_r)&(KBD_FIFO_SIZE - 1);
+	if (n > cnt) n = cnt;
+	if (!n) return 1;
+
+	spi_uio_cmd_cont(UIO_KBD_BURST);
+	spi_w(n);
+	while (n--)
+	{
+		uint32_t code = kbd_fifo[kbd_fifo_r];
+		spi_w(((code & OSD) ? 0x100 : 0) | (code & 0xff));
+		kbd_fifo_r = (kbd_fifo_r + 1)&(KBD_FIFO_SIZE - 1);
+	}
+	DisableIO();
+	return 1;
+}
+
 // send pending bytes if timer has run up
 static void kbd_fifo_poll()
 {
+	if (kbd_fifo_w == kbd_fifo_r)
+		return;
+
+	if (kbd_burst < 0)
+	{
+		kbd_burst = (kbd_core_free() >= 0);
+		if (kbd_burst) printf("Keyboard: core FIFO found, burst mode.\n");
+	}
+
+	if (kbd_burst)
+	{
+		kbd_burst = kbd_fifo_burst();
+		return;
+	}
+
 	// timer enabled and runnig?
 	if (kbd_timer && !CheckTimer(kbd_timer))
 		return;
 
 	kbd_timer = 0;  // timer == 0 means timer is not running anymore
 
-	if (kbd_fifo_w == kbd_fifo_r)
-		return;
-
 	kbd_fifo_minimig_send(kbd_fifo[kbd_fifo_r]);
 	kbd_fifo_r = (kbd_fifo_r + 1)&(KBD_FIFO_SIZE - 1);
 }
 
+// Savestates are written on the offload pool: the slot is copied out of DDR,
+// optionally gzip compressed (savestate_compress), and the file is replaced
+// atomically. Loading takes plain, gzip and zstd files.
+//
+// With savestate_delta the full file is only a base: following saves are
+// appended to "<name>.delta" as XOR/RLE records of the blocks that changed
+// since the previous save. The journal is tied to the base by its crc32.
+#define SS_BLOCK        256
+#define SS_REBASE       16
+#define SS_JOURNAL_MAGIC 0x4C4A5353 // SSJL
+#define SS_DELTA_MAGIC  0x44445353 // SSDD
+
+struct ss_journal_t
+{
+	uint32_t magic;
+	uint32_t base_crc;
+	uint32_t size;
+};
+
+struct ss_delta_t
+{
+	uint32_t magic;
+	uint32_t size;    // state size
+	uint32_t len;     // payload length
+	uint32_t crc;     // payload crc32
+};
+
+struct ss_job_t
+{
+	char path[1024];
+	char delta[1100]; // journal to apply on a load, empty if none
+	const void *base;
+	uint32_t size;
+	offload_job_t job;
+
+	// worker side delta state, reset by ss_reset()
+	uint8_t *prev;
+	uint32_t prev_size;
+	uint32_t deltas;
+	uint32_t journal_len;
+};
+
+static ss_job_t ss_jobs[4];
+
+static void ss_reset(ss_job_t *job)
+{
+	free(job->prev);
+	job->prev = NULL;
+	job->prev_size = 0;
+	job->deltas = 0;
+	job->journal_len = 0;
+}
+
+static int ss_block_equal(const uint8_t *a, const uint8_t *b, uint32_t len)
+{
+#ifdef __ARM_NEON
+	if (len == SS_BLOCK)
+	{
+		uint8x16_t acc = vdupq_n_u8(0);
+		for (uint32_t i = 0; i < SS_BLOCK; i += 64)
+		{
+			acc = vorrq_u8(acc, veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+			acc = vorrq_u8(acc, veorq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16)));
+			acc = vorrq_u8(acc, veorq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32)));
+			acc = vorrq_u8(acc, veorq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48)));
+		}
+		uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+		return !(vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1));
+	}
+#endif
+	return !memcmp(a, b, len);
+}
+
+// XOR of the block, zero runs as 0x80|(n-1), literals as (n-1) followed by n bytes
+static uint32_t ss_rle_xor(uint8_t *out, const uint8_t *cur, const uint8_t *prev, uint32_t len)
+{
+	uint8_t x[SS_BLOCK];
+	for (uint32_t i = 0; i < len; i++) x[i] = cur[i] ^ prev[i];
+
+	uint32_t pos = 0;
+	uint32_t i = 0;
+	while (i < len)
+	{
+		uint32_t n = 0;
+		if (!x[i])
+		{
+			while (i + n < len && n < 128 && !x[i + n]) n++;
+			out[pos++] = 0x80 | (n - 1);
+		}
+		else
+		{
+			while (i + n < len && n < 128 && (x[i + n] || (i + n + 1 < len && x[i + n + 1]))) n++;
+			out[pos++] = n - 1;
+			memcpy(out + pos, x + i, n);
+			pos += n;
+		}
+		i += n;
+	}
+	return pos;
+}
+
+static int ss_write_file(const char *path, const void *data, size_t len, int append)
+{
+	char tmp_name[1100];
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", path);
+
+	int fd = append ? open(path, O_WRONLY | O_APPEND | O_CLOEXEC) : open(tmp_name, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if (fd < 0) return 0;
+
+	int ok = write(fd, data, len) == (ssize_t)len && !fsync(fd);
+	close(fd);
+	if (append) return ok;
+
+	ok = ok && !rename(tmp_name, path);
+	if (!ok) unlink(tmp_name);
+	return ok;
+}
+
+static void *ss_gzip(const uint8_t *data, uint32_t size, size_t *out_len)
+{
+	size_t len = 0;
+	uint8_t *raw = (uint8_t*)tdefl_compress_mem_to_heap(data, size, &len, tdefl_create_comp_flags_from_zip_params(1, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY));
+	if (!raw) return NULL;
+
+	uint8_t *out = (uint8_t*)malloc(len + 18);
+	if (out)
+	{
+		static const uint8_t hdr[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3 };
+		memcpy(out, hdr, sizeof(hdr));
+		memcpy(out + 10, raw, len);
+
+		uint32_t tail[2] = { crc32_update(0, data, size), size };
+		memcpy(out + 10 + len, tail, sizeof(tail));
+		*out_len = len + 18;
+	}
+	free(raw);
+	return out;
+}
+
+// appends the changes against the previous save, 0 if a new base is due
+static int ss_write_delta(ss_job_t *job, const uint8_t *data)
+{
+	uint32_t size = job->size;
+	if (!job->prev || job->prev_size != size || job->deltas >= SS_REBASE) return 0;
+
+	// a journal over half of the state costs more than a new base
+	uint32_t limit = size / 2;
+	if (job->journal_len >= limit) return 0;
+
+	uint8_t *rec = (uint8_t*)malloc(sizeof(ss_delta_t) + limit + SS_BLOCK * 2);
+	if (!rec) return 0;
+
+	uint32_t len = 0;
+	uint8_t *payload = rec + sizeof(ss_delta_t);
+	for (uint32_t off = 0; off < size && len < limit; off += SS_BLOCK)
+	{
+		uint32_t blen = (size - off < SS_BLOCK) ? size - off : SS_BLOCK;
+		if (ss_block_equal(data + off, job->prev + off, blen)) continue;
+
+		uint32_t idx = off / SS_BLOCK;
+		memcpy(payload + len, &idx, sizeof(idx));
+		len += sizeof(idx);
+		len += ss_rle_xor(payload + len, data + off, job->prev + off, blen);
+	}
+
+	int ok = 0;
+	if (len < limit)
+	{
+		ss_delta_t hdr = { SS_DELTA_MAGIC, size, len, crc32_update(0, payload, len) };
+		memcpy(rec, &hdr, sizeof(hdr));
+
+		char name[1100];
+		snprintf(name, sizeof(name), "%s.delta", job->path);
+		ok = ss_write_file(name, rec, sizeof(hdr) + len, 1);
+		if (ok)
+		{
+			job->deltas++;
+			job->journal_len += sizeof(hdr) + len;
+			printf("Wrote %u byte delta (%u) to %s\n", len, job->deltas, name);
+		}
+	}
+
+	free(rec);
+	return ok;
+}
+
+static void ss_write(ss_job_t *job)
+{
+	uint8_t *data = (uint8_t*)malloc(job->size);
+	if (!data)
+	{
+		printf("Unable to allocate %u bytes for %s\n", job->size, job->path);
+		return;
+	}
+
+	memcpy(data, job->base, job->size);
+
+	if (cfg.savestate_delta && ss_write_delta(job, data))
+	{
+		free(job->prev);
+		job->prev = data;
+		return;
+	}
+
+	const void *out = data;
+	size_t out_len = job->size;
+	void *packed = NULL;
+	if (cfg.savestate_compress)
+	{
+		packed = ss_gzip(data, job->size, &out_len);
+		if (packed) out = packed;
+		else out_len = job->size;
+	}
+
+	int ok = ss_write_file(job->path, out, out_len, 0);
+	if (ok) printf("Wrote %u bytes (%u in file) to %s\n", job->size, (uint32_t)out_len, job->path);
+	else printf("Unable to write file: %s\n", job->path);
+	free(packed);
+
+	char name[1100];
+	snprintf(name, sizeof(name), "%s.delta", job->path);
+
+	ss_reset(job);
+	if (ok && cfg.savestate_delta)
+	{
+		// a journal left over from an older base is ignored by its crc
+		ss_journal_t hdr = { SS_JOURNAL_MAGIC, crc32_update(0, data, job->size), job->size };
+		if (ss_write_file(name, &hdr, sizeof(hdr), 0))
+		{
+			job->prev = data;
+			job->prev_size = job->size;
+			job->journal_len = sizeof(hdr);
+			return;
+		}
+	}
+	else if (ok)
+	{
+		unlink(name);
+	}
+
+	free(data);
+}
+
+// whole file at an absolute path, the file_io helpers share their path buffers with the main thread
+static uint8_t *ss_read_all(int fd, uint32_t *size)
+{
+	struct stat64 st;
+	if (fstat64(fd, &st) || st.st_size <= 0 || st.st_size > INT_MAX) return NULL;
+
+	*size = (uint32_t)st.st_size;
+	uint8_t *buf = (uint8_t*)malloc(*size);
+	if (buf && pread(fd, buf, *size, 0) != (ssize_t)*size)
+	{
+		free(buf);
+		buf = NULL;
+	}
+	return buf;
+}
+
+// applies the journal of a base just read into dst, returns the new state size
+static int ss_apply_delta(const char *jname, uint8_t *dst, int size)
+{
+	if (size <= 0 || !jname[0]) return size;
+
+	int fd = open(jname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return size;
+
+	uint32_t jlen = 0;
+	uint8_t *buf = ss_read_all(fd, &jlen);
+	int ok = buf != NULL;
+	close(fd);
+
+	ss_journal_t jhdr;
+	if (ok && jlen >= sizeof(jhdr))
+	{
+		memcpy(&jhdr, buf, sizeof(jhdr));
+		ok = jhdr.magic == SS_JOURNAL_MAGIC && jhdr.size == (uint32_t)size && jhdr.base_crc == crc32_update(0, dst, size);
+	}
+	else ok = 0;
+
+	uint32_t count = 0;
+	uint32_t pos = sizeof(jhdr);
+	while (ok && pos + sizeof(ss_delta_t) <= jlen)
+	{
+		ss_delta_t hdr;
+		memcpy(&hdr, buf + pos, sizeof(hdr));
+		pos += sizeof(hdr);
+
+		// stop at a torn or foreign record, the states before it are still good
+		if (hdr.magic != SS_DELTA_MAGIC || hdr.size != (uint32_t)size || hdr.len > jlen - pos ||
+			hdr.crc != crc32_update(0, buf + pos, hdr.len)) break;
+
+		const uint8_t *p = buf + pos;
+		const uint8_t *end = p + hdr.len;
+		while (p + sizeof(uint32_t) <= end)
+		{
+			uint32_t idx;
+			memcpy(&idx, p, sizeof(idx));
+			p += sizeof(idx);
+
+			uint32_t off = idx * SS_BLOCK;
+			if (off >= (uint32_t)size) break;
+			uint32_t blen = ((uint32_t)size - off < SS_BLOCK) ? (uint32_t)size - off : SS_BLOCK;
+
+			uint32_t i = 0;
+			while (i < blen && p < end)
+			{
+				uint8_t tok = *p++;
+				uint32_t n = (tok & 0x7F) + 1;
+				if (i + n > blen) n = blen - i;
+				if (!(tok & 0x80))
+				{
+					if (p + n > end) n = end - p;
+					for (uint32_t k = 0; k < n; k++) dst[off + i + k] ^= p[k];
+					p += n;
+				}
+				i += n;
+			}
+		}
+
+		pos += hdr.len;
+		count++;
+	}
+
+	free(buf);
+	if (count) printf("process_ss: applied %u deltas from %s\n", count, jname);
+	return size;
+}
+
+static int ss_read(const char *name, void *dst, uint32_t len)
+{
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		printf("Unable to open file: %s\n", name);
+		return 0;
+	}
+
+	uint8_t magic[4] = {};
+	if (pread(fd, magic, sizeof(magic), 0) < 0) magic[0] = 0;
+
+	int gz = magic[0] == 0x1F && magic[1] == 0x8B && magic[2] == 8;
+	int zst = magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD;
+	if (!gz && !zst)
+	{
+		int ret = pread(fd, dst, len, 0);
+		close(fd);
+		return ret < 0 ? 0 : ret;
+	}
+
+	int ret = 0;
+	uint32_t size = 0;
+	uint8_t *buf = ss_read_all(fd, &size);
+	if (buf)
+	{
+		if (zst)
+		{
+			size_t res = ZSTD_decompress(dst, len, buf, size);
+			if (!ZSTD_isError(res)) ret = (int)res;
+		}
+		else if (size > 18)
+		{
+			// skip the optional gzip header fields
+			uint32_t pos = 10;
+			uint8_t flg = buf[3];
+			if ((flg & 4) && pos + 2 <= size) pos += 2 + (buf[pos] | (buf[pos + 1] << 8));
+			if (flg & 8) while (pos < size && buf[pos++]);
+			if (flg & 16) while (pos < size && buf[pos++]);
+			if (flg & 2) pos += 2;
+
+			if (pos < size - 8)
+			{
+				size_t res = tinfl_decompress_mem_to_mem(dst, len, buf + pos, size - 8 - pos, TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+				if (res != TINFL_DECOMPRESS_MEM_TO_MEM_FAILED) ret = (int)res;
+			}
+		}
+	}
+	free(buf);
+	close(fd);
+
+	if (!ret) printf("Unable to unpack file: %s\n", name);
+	return ret;
+}
+
+// Fills a slot from its file. The header goes last, a core reads the
+// slot as empty until then.
+static void ss_load(ss_job_t *job)
+{
+	uint8_t *dst = (uint8_t*)job->base;
+	uint32_t len = job->size;
+	memset(dst + 8, 0, len - 8);
+
+	uint8_t *buf = job->path[0] ? (uint8_t*)malloc(len) : NULL;
+	if (buf)
+	{
+		int ret = ss_apply_delta(job->delta, buf, ss_read(job->path, buf, len));
+		printf("process_ss: read %d bytes from file: %s\n", ret, job->path);
+		if (ret > 8)
+		{
+			memcpy(dst + 8, buf + 8, ret - 8);
+			__sync_synchronize();
+			((uint32_t*)dst)[1] = ((uint32_t*)buf)[1];
+		}
+		free(buf);
+	}
+	else if (job->path[0])
+	{
+		printf("Unable to allocate %u bytes for %s\n", len, job->path);
+	}
+
+	__sync_synchronize();
+	((uint32_t*)dst)[0] = 0xFFFFFFFF;
+}
+
 int process_ss(const char *rom_name, int enable)
 {
 	static char ss_name[1024] = {};
@@ -1829,10 +2389,12 @@ int process_ss(const char *rom_name, int enable)
 
 		uint32_t len = ss_size;
 		uint32_t map_addr = ss_base;
-		fileTYPE f = {};
 
 		for (int i = 0; i < 4; i++)
 		{
+			// a save in flight still reads this slot
+			offload_wait(ss_jobs[i].job);
+			ss_reset(&ss_jobs[i]);
 			if (!base[i]) base[i] = shmem_map(map_addr, len);
 			if (!base[i])
 			{
@@ -1841,7 +2403,6 @@ int process_ss(const char *rom_name, int enable)
 			else
 			{
 				ss_cnt[i] = 0xFFFFFFFF;
-				memset(base[i], 0, len);
 
 				if (!i)
 				{
@@ -1854,20 +2415,18 @@ int process_ss(const char *rom_name, int enable)
 					FileGenerateSavestatePath(rom_name, ss_name, i + 1);
 				}
 
-				if (FileExists(ss_name))
-				{
-					if (!FileOpen(&f, ss_name))
-					{
-						printf("Unable to open file: %s\n", ss_name);
-					}
-					else
-					{
-						int ret = FileReadAdv(&f, base[i], len);
-						FileClose(&f);
-						printf("process_ss: read %d bytes from file: %s\n", ret, ss_name);
-					}
-				}
-				*(uint32_t*)(base[i]) = 0xFFFFFFFF;
+				// the slot shows empty until the worker filled it
+				ss_job_t *job = &ss_jobs[i];
+				((uint32_t*)base[i])[0] = 0;
+				((uint32_t*)base[i])[1] = 0;
+				// the worker opens plain files by absolute path
+				char jname[1100];
+				snprintf(jname, sizeof(jname), "%s.delta", ss_name);
+				snprintf(job->path, sizeof(job->path), "%s", FileExists(ss_name, 0) ? getFullPath(ss_name) : "");
+				snprintf(job->delta, sizeof(job->delta), "%s", (job->path[0] && FileExists(jname, 0)) ? getFullPath(jname) : "");
+				job->base = base[i];
+				job->size = len;
+				job->job = offload_add_work([job] { ss_load(job); }, OFFLOAD_IO);
 			}
 
 			map_addr += len;
@@ -1880,11 +2439,10 @@ int process_ss(const char *rom_name, int enable)
 
 	if (!enabled) return 0;
 
-	static unsigned long ss_timer = 0;
-	if (ss_timer && !CheckTimer(ss_timer)) return 0;
-	ss_timer = GetTimer(1000);
+	if (ss_poll_timer && !CheckTimer(ss_poll_timer)) return 0;
+	int fast = ss_fast_timer && !CheckTimer(ss_fast_timer);
+	ss_poll_timer = GetTimer(fast ? SS_POLL_FAST : SS_POLL_IDLE);
 
-	fileTYPE f = {};
 	for (int i = 0; i < 4; i++)
 	{
 		if (base[i])
@@ -1892,7 +2450,8 @@ int process_ss(const char *rom_name, int enable)
 			uint32_t curcnt = ((uint32_t*)(base[i]))[0];
 			uint32_t size = ((uint32_t*)(base[i]))[1];
 
-			if (curcnt != ss_cnt[i])
+			// one job per slot at a time, its load or a write, a newer state waits for the next check
+			if (curcnt != ss_cnt[i] && offload_job_done(ss_jobs[i].job))
 			{
 				ss_cnt[i] = curcnt;
 				if (size) size = (size + 2) * 4;
@@ -1902,16 +2461,11 @@ int process_ss(const char *rom_name, int enable)
 					Info("Saving the state", 500);
 
 					*ss_sufx = i + '1';
-					if (FileOpenEx(&f, ss_name, O_CREAT | O_TRUNC | O_RDWR | O_SYNC))
-					{
-						int ret = FileWriteAdv(&f, base[i], size);
-						FileClose(&f);
-						printf("Wrote %d bytes to file: %s\n", ret, ss_name);
-					}
-					else
-					{
-						printf("Unable to create file: %s\n", ss_name);
-					}
+					ss_job_t *job = &ss_jobs[i];
+					snprintf(job->path, sizeof(job->path), "%s", getFullPath(ss_name));
+					job->base = base[i];
+					job->size = size;
+					job->job = offload_add_work([job] { ss_write(job); }, OFFLOAD_IO);
 				}
 			}
 		}
@@ -1920,12 +2474,16 @@ int process_ss(const char *rom_name, int enable)
 	return 1;
 }
 
+// index register of the core as last set, -1 - unknown
+static int fio_index = -1;
+
 void user_io_set_index(unsigned char index)
 {
 	EnableFpga();
 	spi8(FIO_FILE_INDEX);
 	spi8(index);
 	DisableFpga();
+	fio_index = index;
 }
 
 void user_io_set_aindex(uint16_t index)
@@ -1934,6 +2492,18 @@ void user_io_set_aindex(uint16_t index)
 	spi8(FIO_FILE_INDEX);
 	spi_w(index);
 	DisableFpga();
+	fio_index = index;
+}
+
+int user_io_send_data(const uint8_t *buf, int len, uint8_t index)
+{
+	// the core keeps the index, a run of sectors only needs the download frames
+	if (fio_index != index) user_io_set_index(index);
+
+	user_io_set_download(1);
+	user_io_file_tx_data(buf, len);
+	user_io_set_download(0);
+	return 1;
 }
 
 void user_io_set_download(unsigned char enable, int addr)
@@ -2001,6 +2571,10 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 	sd_image_cangrow[index] = (pre != 0);
 	sd_type[index] = 0;
 
+	blockcache_drop(index);
+	blockdev_detach(&sd_image[index]);
+	c64_closeGCR(index);
+
 	if (len)
 	{
 		if (!strcasecmp(user_io_get_core_name(), "apple-ii"))
@@ -2035,7 +2609,8 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 			else
 			{
 				writable = FileCanWrite(name);
-				ret = FileOpenEx(&sd_image[index], name, writable ? (O_RDWR | O_SYNC) : O_RDONLY);
+				ret = (!writable && FileOpenZipCache(&sd_image[index], name)) || FileOpenEx(&sd_image[index], name, writable ? (O_RDWR | O_SYNC) : O_RDONLY);
+				if (ret && writable) blockdev_attach(BLOCKDEV_SD(index), &sd_image[index], name);
 				if (ret && len > 4) {
 					if (!strcasecmp(name + len - 4, ".d64")
 						|| !strcasecmp(name + len - 4, ".g64")
@@ -2127,6 +2702,7 @@ int user_io_file_mount(const char *name, unsigned char index, char pre, int pre_
 
 void user_io_bufferinvalidate(unsigned char index)
 {
+	blockcache_drop(index);
 	buffer_lba[index] = -1;
 }
 
@@ -2370,6 +2946,64 @@ static int chr_parse(XMLEvent evt, const XMLNode* node, SXML_CHAR* text, const i
 	return true;
 }
 
+// Decoded palettes and charsets are kept in tmpfs until reboot, keyed by
+// path, size and mtime of the XML, so a core restart skips the parsing.
+#define PCOLCHR_CACHE_DIR   "/tmp/pcolchr"
+#define PCOLCHR_CACHE_MAGIC 0x4C4F4301
+
+struct pcolchr_cache_hdr_t
+{
+	uint32_t magic;
+	char path[1024];
+	uint64_t size;
+	int64_t mtime;
+};
+
+static int pcolchr_cache_key(const char *path, pcolchr_cache_hdr_t *hdr, char *cache_name)
+{
+	struct stat64 st;
+	if (stat64(path, &st)) return 0;
+
+	memset(hdr, 0, sizeof(pcolchr_cache_hdr_t));
+	hdr->magic = PCOLCHR_CACHE_MAGIC;
+	snprintf(hdr->path, sizeof(hdr->path), "%s", path);
+	hdr->size = st.st_size;
+	hdr->mtime = st.st_mtime;
+
+	// the header tells collisions apart
+	sprintf(cache_name, PCOLCHR_CACHE_DIR "/%08X", crc32_update(0, path, strlen(path)));
+	return 1;
+}
+
+static int pcolchr_cache_load(const char *path, int size)
+{
+	pcolchr_cache_hdr_t key, hdr;
+	char name[64];
+	if (!pcolchr_cache_key(path, &key, name)) return 0;
+
+	FILE *fp = fopen(name, "rb");
+	if (!fp) return 0;
+
+	int ok = fread(&hdr, sizeof(hdr), 1, fp) == 1 && !memcmp(&hdr, &key, sizeof(hdr)) && fread(col_attr, size, 1, fp) == 1;
+	fclose(fp);
+	return ok;
+}
+
+static void pcolchr_cache_store(const char *path, int size)
+{
+	pcolchr_cache_hdr_t hdr;
+	char name[64];
+	if (!pcolchr_cache_key(path, &hdr, name)) return;
+
+	mkdir(PCOLCHR_CACHE_DIR, 0755);
+	FILE *fp = fopen(name, "wb");
+	if (!fp) return;
+
+	int ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 && fwrite(col_attr, size, 1, fp) == 1;
+	fclose(fp);
+	if (!ok) unlink(name);
+}
+
 static void send_pcolchr(const char* name, unsigned char index, int type)
 {
 	static char full_path[1024];
@@ -2380,17 +3014,25 @@ static void send_pcolchr(const char* name, unsigned char index, int type)
 	if (!p) p = full_path + strlen(full_path);
 	strcpy(p, type ? ".chr" : ".col");
 
-	if (type)
+	int size = type ? 1024 : 1025;
+	int ok = pcolchr_cache_load(full_path, size);
+	if (!ok)
 	{
-		memcpy(col_attr, defchars, sizeof(defchars));
-		memcpy(col_attr+sizeof(defchars), defchars, sizeof(defchars));
+		if (type)
+		{
+			memcpy(col_attr, defchars, sizeof(defchars));
+			memcpy(col_attr+sizeof(defchars), defchars, sizeof(defchars));
+		}
+		else memset(col_attr, 0, sizeof(col_attr));
+
+		SAX_Callbacks sax;
+		SAX_Callbacks_init(&sax);
+		sax.all_event = type ? chr_parse : col_parse;
+		ok = XMLDoc_parse_file_SAX(full_path, &sax, 0);
+		if (ok) pcolchr_cache_store(full_path, size);
 	}
-	else memset(col_attr, 0, sizeof(col_attr));
 
-	SAX_Callbacks sax;
-	SAX_Callbacks_init(&sax);
-	sax.all_event = type ? chr_parse : col_parse;
-	if (XMLDoc_parse_file_SAX(full_path, &sax, 0))
+	if (ok)
 	{
 		printf("Send additional file %s\n", full_path);
 
@@ -2399,7 +3041,7 @@ static void send_pcolchr(const char* name, unsigned char index, int type)
 		user_io_set_index(index);
 
 		user_io_set_download(1);
-		user_io_file_tx_data(col_attr, type ? 1024 : 1025);
+		user_io_file_tx_data(col_attr, size);
 		user_io_set_download(0);
 	}
 }
@@ -2501,12 +3143,28 @@ int user_io_file_tx_a(const char* name, uint16_t index)
 	return 1;
 }
 
+uint32_t user_io_ddr_window(uint32_t size)
+{
+	// SPI stays as a fallback if the window can't be mapped
+	if (!ddr_base || is_snes() || size < DDR_UPLOAD_MIN || size > ddr_size) return 0;
+
+	void *mem = shmem_map(fpga_mem(ddr_base), size);
+	if (!mem) return 0;
+
+	shmem_unmap(mem, size);
+	return ddr_base;
+}
+
 int user_io_file_tx(const char* name, unsigned char index, char opensave, char mute, char composite, uint32_t load_addr)
 {
+	PROFILE_FUNCTION();
+
 	fileTYPE f = {};
 	static uint8_t buf[4096];
 
+	launch_phase(LAUNCH_OPEN);
 	if (!FileOpen(&f, name, mute)) return 0;
+	FileAdvise(&f, FILE_ADV_ONESHOT);
 
 	uint32_t bytes2send = f.size;
 
@@ -2521,6 +3179,9 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 		FileSeek(&f, off, SEEK_SET);
 	}
 
+	// cores advertising a DDR window get big files through memory instead of SPI
+	if (!load_addr) load_addr = user_io_ddr_window(bytes2send);
+
 	/* transmit the entire file using one transfer */
 	printf("Selected file %s with %u bytes to send for index %d.%d\n", name, bytes2send, index & 0x3F, index >> 6);
 	if(load_addr) printf("Load to address 0x%X\n", load_addr);
@@ -2619,6 +3280,14 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	file_crc = 0;
 	uint32_t skip = bytes2send & 0x3FF; // skip possible header up to 1023 bytes
 
+	// a whole, unpatched zip member comes with its CRC
+	int crc_known = 0;
+	if (!skip && !is_snes_bs && !f.offset && bytes2send == f.size)
+	{
+		file_crc = FileZipCRC(&f);
+		crc_known = file_crc != 0;
+	}
+
 	int use_progress = 1; // (bytes2send > (1024 * 1024)) ? 1 : 0;
 	int size = bytes2send;
 	if (use_progress) ProgressMessage(0, 0, 0, 0);
@@ -2662,6 +3331,8 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 
 	if (dosend && load_addr >= 0x20000000 && (load_addr + bytes2send) <= 0x40000000)
 	{
+		// the reads go straight to the FPGA memory
+		launch_phase(LAUNCH_READ);
 		uint32_t map_size = bytes2send + ((is_snes() && load_addr < 0x22000000) ? 0x800000 : 0);
 		uint8_t *mem = (uint8_t *)shmem_map(fpga_mem(load_addr), map_size);
 		if (mem)
@@ -2671,9 +3342,9 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 				uint32_t gap = (is_snes() && (load_addr < 0x22000000) && (load_addr + size - bytes2send) >= 0x22000000) ? 0x800000 : 0;
 
 				uint32_t chunk = (bytes2send > (256 * 1024)) ? (256 * 1024) : bytes2send;
-				FileReadAdv(&f, mem + size - bytes2send + gap, chunk);
+				FileReadDirect(&f, mem + size - bytes2send + gap, chunk);
 
-				if(!is_snes() && use_cheats) file_crc = crc32(file_crc, mem + skip + size - bytes2send, chunk - skip);
+				if(!is_snes() && use_cheats && !crc_known) file_crc = crc32_update(file_crc, mem + skip + size - bytes2send, chunk - skip);
 				skip = 0;
 
 				if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
@@ -2683,14 +3354,40 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 			shmem_unmap(mem, map_size);
 		}
 	}
+	else if (fileReadStream *stream = (dosend && bytes2send > sizeof(buf) && !is_snes_bs) ? FileReadStreamStart(&f, bytes2send) : nullptr)
+	{
+		// card reads on the offload thread overlap with the SPI transfer
+		uint8_t *data;
+		uint32_t chunk;
+		launch_phase(LAUNCH_TRANSFER);
+
+		while ((chunk = FileReadStreamNext(stream, &data)))
+		{
+			user_io_file_tx_data(data, chunk);
+
+			if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
+			bytes2send -= chunk;
+
+			if (skip >= chunk) skip -= chunk;
+			else
+			{
+				if (!crc_known) file_crc = crc32_update(file_crc, data + skip, chunk - skip);
+				skip = 0;
+			}
+		}
+
+		FileReadStreamEnd(stream);
+	}
 	else
 	{
 		while (dosend && bytes2send)
 		{
 			uint32_t chunk = (bytes2send > sizeof(buf)) ? sizeof(buf) : bytes2send;
 
+			launch_phase(LAUNCH_READ);
 			FileReadAdv(&f, buf, chunk);
 			if (is_snes() && is_snes_bs) snes_patch_bs_header(&f, buf);
+			launch_phase(LAUNCH_TRANSFER);
 			user_io_file_tx_data(buf, chunk);
 
 			if (use_progress) ProgressMessage("Loading", f.name, size - bytes2send, size);
@@ -2699,13 +3396,14 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 			if (skip >= chunk) skip -= chunk;
 			else
 			{
-				file_crc = crc32(file_crc, buf + skip, chunk - skip);
+				if (!crc_known) file_crc = crc32_update(file_crc, buf + skip, chunk - skip);
 				skip = 0;
 			}
 		}
 	}
 
 	// check if core requests some change while downloading
+	launch_phase(LAUNCH_POST);
 	check_status_change();
 
 	printf("Done.\n");
@@ -2720,7 +3418,9 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	}
 
 	// signal end of transmission
+	launch_phase(LAUNCH_RELEASE);
 	user_io_set_download(0);
+	launch_phase(LAUNCH_POST);
 	printf("\n");
 
 	if (is_zx81() && index)
@@ -2740,43 +3440,175 @@ int user_io_file_tx(const char* name, unsigned char index, char opensave, char m
 	return 1;
 }
 
+// Firmware images (TOS, RISC OS, cartridges) are resent on every reset,
+// so they are kept in RAM and only reloaded when the file changes.
+#define FW_CACHE_SLOTS 4
+
+struct fw_cache_t
+{
+	char name[1024];
+	int64_t mtime;
+	uint32_t size;
+	uint32_t last_use;
+	uint8_t *data;
+};
+
+static fw_cache_t fw_cache[FW_CACHE_SLOTS] = {};
+static uint32_t fw_cache_use = 0;
+
+static fw_cache_t *fw_cache_get(const char *name)
+{
+	struct stat64 st;
+	if (stat64(getFullPath(name), &st) || !st.st_size || st.st_size > 16 * 1024 * 1024) return NULL;
+	int64_t mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+
+	fw_cache_t *slot = &fw_cache[0];
+	for (int i = 0; i < FW_CACHE_SLOTS; i++)
+	{
+		fw_cache_t *c = &fw_cache[i];
+		if (c->data && !strcmp(c->name, name))
+		{
+			if (c->mtime == mtime && c->size == st.st_size)
+			{
+				c->last_use = ++fw_cache_use;
+				return c;
+			}
+			slot = c;
+			break;
+		}
+		if (!c->data || (slot->data && c->last_use < slot->last_use)) slot = c;
+	}
+
+	free(slot->data);
+	memset(slot, 0, sizeof(fw_cache_t));
+
+	uint8_t *data = (uint8_t*)malloc(st.st_size);
+	if (!data) return NULL;
+
+	if (FileLoad(name, data, st.st_size) != (int)st.st_size)
+	{
+		free(data);
+		return NULL;
+	}
+
+	snprintf(slot->name, sizeof(slot->name), "%s", name);
+	slot->mtime = mtime;
+	slot->size = st.st_size;
+	slot->data = data;
+	slot->last_use = ++fw_cache_use;
+	return slot;
+}
+
+int user_io_file_tx_cached(const char *name, unsigned char index)
+{
+	fw_cache_t *c = fw_cache_get(name);
+	if (!c || user_io_ddr_window(c->size)) return user_io_file_tx(name, index);
+
+	printf("Selected file %s with %u bytes to send for index %d.%d (cached)\n", name, c->size, index & 0x3F, index >> 6);
+
+	user_io_set_index(index);
+	const char *ext = strrchr(name, '.');
+	user_io_file_info(ext ? ext : "");
+
+	user_io_set_download(1);
+	user_io_file_tx_data(c->data, c->size);
+	check_status_change();
+	user_io_set_download(0);
+	return 1;
+}
+
 static char cfgstr[1024 * 10] = {};
+
+// Items of cfgstr, split once when it's read, so the menu can fetch any
+// item without walking the string from the start.
+static uint16_t cfg_item_start[sizeof(cfgstr)];
+static uint16_t cfg_item_len[sizeof(cfgstr)];
+static int cfg_items = 0;
+
+static void confstr_split(uint32_t len)
+{
+	cfg_items = 0;
+	uint32_t start = 0;
+	for (uint32_t i = 0; i <= len; i++)
+	{
+		if (!cfgstr[i] || cfgstr[i] == ';')
+		{
+			cfg_item_start[cfg_items] = start;
+			cfg_item_len[cfg_items] = i - start;
+			cfg_items++;
+			start = i + 1;
+		}
+	}
+}
+
 void user_io_read_confstr()
 {
 	spi_uio_cmd_cont(UIO_GET_STRING);
 
+	// the string is read in blocks, anything after the terminator is dropped
 	uint32_t j = 0;
 	while (j < sizeof(cfgstr) - 1)
 	{
-		char i = spi_in();
-		if (!i) break;
-		cfgstr[j++] = i;
+		uint32_t sz = sizeof(cfgstr) - 1 - j;
+		if (sz > 256) sz = 256;
+		spi_block_read((uint8_t*)cfgstr + j, 0, sz);
+
+		char *end = (char*)memchr(cfgstr + j, 0, sz);
+		if (end)
+		{
+			j = end - cfgstr;
+			break;
+		}
+		j += sz;
 	}
 
-	cfgstr[j++] = 0;
+	cfgstr[j] = 0;
 	DisableIO();
+
+	confstr_split(j);
 }
 
-char *user_io_get_confstr(int index)
+// Splits and walks a generated string of a large core, the core's string
+// is put back afterwards.
+void user_io_confstr_bench()
 {
-	int lidx = 0;
-	static char buffer[(1024*2) + 1];  // max bytes per config item
+	static char saved[sizeof(cfgstr)];
+	memcpy(saved, cfgstr, sizeof(cfgstr));
 
-	char *start = cfgstr;
-	while (lidx < index)
+	uint32_t len = snprintf(cfgstr, sizeof(cfgstr), "BENCH;;FS0,BINROM,Load ROM;FC1,SAV,Load Save;-;");
+	for (int i = 0; i < 48 && len < sizeof(cfgstr) - 128; i++)
 	{
-		start = strchr(start, ';');
-		if (!start) return NULL;
-		start++;
-		lidx++;
+		len += snprintf(cfgstr + len, sizeof(cfgstr) - len, "P%dO%X%X,Option %d,Off,On,Auto;", (i >> 4) + 1, (i * 2) & 0x1F, (i * 2 + 1) & 0x1F, i);
 	}
+	len += snprintf(cfgstr + len, sizeof(cfgstr) - len, "R0,Reset;J1,A,B,X,Y,Start,Select;V,v240101");
 
-	char *end = strchr(start, ';');
-	int len = end ? end - start : strlen(start);
+	const int loops = 1000;
+	uint64_t bytes = 0;
+	uint64_t start = profiling_time_us();
+	for (int n = 0; n < loops; n++)
+	{
+		confstr_split(len);
+		for (int i = 0; i < cfg_items; i++) if (user_io_get_confstr(i)) bytes += cfg_item_len[i];
+	}
+	uint64_t us = profiling_time_us() - start;
+
+	memcpy(cfgstr, saved, sizeof(cfgstr));
+	confstr_split(strlen(cfgstr));
+
+	profiling_bench_report("confstr split+walk", us, loops, bytes);
+}
+
+char *user_io_get_confstr(int index)
+{
+	static char buffer[(1024*2) + 1];  // max bytes per config item
+
+	if (index < 0 || index >= cfg_items) return NULL;
+
+	int len = cfg_item_len[index];
 	if (!len) return NULL;
 
 	if ((uint32_t)len > sizeof(buffer) - 1) len = sizeof(buffer) - 1;
-	memcpy(buffer, start, len);
+	memcpy(buffer, cfgstr + cfg_item_start[index], len);
 	buffer[len] = 0;
 	return buffer;
 }
@@ -2847,10 +3679,7 @@ void user_io_send_buttons(char force)
 		if (!user_io_osd_is_visible() && (key_map & BUTTON2) && !(map & BUTTON2))
 		{
 			if (is_minimig()) minimig_reset();
-			if (is_megacd()) mcd_reset();
-			if (is_neogeo_cd()) neocd_reset();
-			if (is_pce()) pcecd_reset();
-			if (is_saturn()) saturn_reset();
+			if (core_hooks->reset) core_hooks->reset();
 			if (is_x86() || is_pcxt()) x86_init();
 			if (is_uneon()) x86_ide_set();
 			if (is_st()) tos_reset(0);
@@ -2902,6 +3731,14 @@ void diskled_on()
 	diskled_is_on = 1;
 }
 
+// nothing to serve in time: no recent disk access, the OSD is closed and
+// the core has no drive emulation with its own clock in user_io_poll()
+int user_io_idle()
+{
+	if (diskled_is_on || menu_present()) return 0;
+	return !core_hooks->poll;
+}
+
 static void kbd_reply(char code)
 {
 	printf("kbd_reply = 0x%02X\n", code);
@@ -2926,10 +3763,14 @@ static int coldreset_req = 0;
 
 static uint32_t res_timer = 0;
 
+static void screenshot_poll();
+
 void user_io_poll()
 {
 	PROFILE_FUNCTION();
 
+	FileSaveConfigPoll();
+
 	if ((core_type != CORE_TYPE_SHARPMZ) &&
 		(core_type != CORE_TYPE_8BIT))
 	{
@@ -2937,27 +3778,37 @@ void user_io_poll()
 	}
 
 	user_io_send_buttons(0);
+	screenshot_poll();
+	video_menu_bg_poll();
+
+	// disk and CD drive requests wait out the window right before the
+	// vsync, the core is about to sample its input
+	int bulk = !scheduler_input_window();
 
 	if (is_minimig())
 	{
-		//HDD & FDD query
-		unsigned char  c1, c2;
-		EnableFpga();
-		uint16_t tmp = spi_w(0);
-		c1 = (uint8_t)(tmp >> 8); // cmd request and drive number
-		c2 = (uint8_t)tmp;      // track number
-		spi_w(0);
-		spi_w(0);
-		DisableFpga();
-		sysled_enable(0);
-		HandleFDD(c1, c2);
-		sysled_enable(1);
-
-		uint16_t sd_req = ide_check();
-		ide_io(0, sd_req & 7);
-		ide_io(1, (sd_req >> 3) & 7);
-		if (sd_req & 0x0100) ide_cdda_send_sector();
-		UpdateDriveStatus();
+		if (bulk)
+		{
+			//HDD & FDD query
+			unsigned char  c1, c2;
+			EnableFpga();
+			uint16_t tmp = spi_w(0);
+			c1 = (uint8_t)(tmp >> 8); // cmd request and drive number
+			c2 = (uint8_t)tmp;      // track number
+			spi_w(0);
+			spi_w(0);
+			DisableFpga();
+			sysled_enable(0);
+			HandleFDD(c1, c2);
+			sysled_enable(1);
+
+			uint16_t sd_req = ide_check();
+			ide_io(0, sd_req & 7);
+			ide_io(1, (sd_req >> 3) & 7);
+			if (sd_req & 0x0100) ide_cdda_send_sector();
+			blockcache_poll();
+			UpdateDriveStatus();
+		}
 
 		kbd_fifo_poll();
 
@@ -2977,14 +3828,20 @@ void user_io_poll()
 	}
 
 	// sd card emulation
-	if (is_x86() || is_pcxt())
+	if (!bulk)
+	{
+		// the requests stay pending in the core until the window ends
+	}
+	else if (is_x86() || is_pcxt())
 	{
 		x86_poll(0);
+		blockcache_poll();
 	}
 	else if ((core_type == CORE_TYPE_8BIT) && !is_menu() && !is_minimig())
 	{
 		if (is_st()) tos_poll();
 		if (is_snes() || is_sgb()) snes_poll();
+		blockcache_poll();
 
 		for (int i = 0; i < 4; i++)
 		{
@@ -3067,6 +3924,12 @@ void user_io_poll()
 			}
 			DisableIO();
 
+			// PSX CD reads are traced in psx_read_cd()
+			if (op && !(blksz == 2352 && is_psx()))
+			{
+				iotrace_add(IOTRACE_SD, disk, (op == 2) ? IOTRACE_WRITE : IOTRACE_READ, lba, blksz, blks, &sd_image[disk]);
+			}
+
 			if ((blks == G64_BLOCK_COUNT_1541+1 || blks == G64_BLOCK_COUNT_1571+1) && sd_type[disk])
 			{
 				if (op == 2) c64_writeGCR(disk, lba, blks-1);
@@ -3114,16 +3977,13 @@ void user_io_poll()
 					if (sz && lba <= size)
 					{
 						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
+						if (!sd_image_cangrow[disk])
 						{
-							if (!sd_image_cangrow[disk])
-							{
-								__off64_t rem = sd_image[disk].size - sd_image[disk].offset;
-								sz = (rem >= sz) ? sz : (int)rem;
-							}
-
-							if (sz) FileWriteAdv(&sd_image[disk], buffer[disk], sz);
+							__off64_t rem = sd_image[disk].size - lba * blksz;
+							sz = (rem >= sz) ? sz : (int)rem;
 						}
+
+						if (sz) blockdev_write(BLOCKDEV_SD(disk), &sd_image[disk], lba * blksz, buffer[disk], sz);
 					}
 				}
 			}
@@ -3159,13 +4019,10 @@ void user_io_poll()
 					else if (sd_image[disk].size)
 					{
 						diskled_on();
-						if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET))
+						if (blockdev_read(BLOCKDEV_SD(disk), &sd_image[disk], lba * blksz, buffer[disk], sizeof(buffer[disk])))
 						{
-							if (FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
-							{
-								done = 1;
-								buffer_lba[disk] = lba;
-							}
+							done = 1;
+							buffer_lba[disk] = lba;
 						}
 					}
 
@@ -3175,25 +4032,9 @@ void user_io_poll()
 					{
 						if (sd_image[disk].type == 2)
 						{
-							if (is_megacd())
+							if (core_hooks->blank_save)
 							{
-								mcd_fill_blanksave(buffer[disk], lba);
-							}
-							else if (is_pce())
-							{
-								memset(buffer[disk], 0, sizeof(buffer[disk]));
-								if (!lba)
-								{
-									memcpy(buffer[disk], "HUBM\x00\x88\x10\x80", 8);
-								}
-							}
-							else if (is_psx())
-							{
-								psx_fill_blanksave(buffer[disk], lba, blks);
-							}
-							else if (is_saturn())
-							{
-								saturn_fill_blanksave(buffer[disk], lba);
+								core_hooks->blank_save(buffer[disk], sizeof(buffer[disk]), lba, blks);
 							}
 							else
 							{
@@ -3233,8 +4074,7 @@ void user_io_poll()
 						psx_read_cd(buffer[disk], lba, buf_n);
 						buffer_lba[disk] = lba;
 					}
-					else if (FileSeek(&sd_image[disk], lba * blksz, SEEK_SET) &&
-						FileReadAdv(&sd_image[disk], buffer[disk], sizeof(buffer[disk])))
+					else if (blockdev_read(BLOCKDEV_SD(disk), &sd_image[disk], lba * blksz, buffer[disk], sizeof(buffer[disk])))
 					{
 						buffer_lba[disk] = lba;
 					}
@@ -3464,8 +4304,13 @@ void user_io_poll()
 	}
 	else if (CheckTimer(res_timer))
 	{
+		FileStoragePoll();
+
 		if (is_menu())
 		{
+			// pinned cores are copied to RAM one at a time in the background
+			fpga_rbf_preload();
+
 			static int got_cfg = 0;
 			if (!got_cfg)
 			{
@@ -3529,17 +4374,15 @@ void user_io_poll()
 		diskled_is_on = 0;
 	}
 
-	if (is_megacd()) mcd_poll();
-	if (is_pce()) pcecd_poll();
-	if (is_saturn()) saturn_poll();
-	if (is_psx()) psx_poll();
-	if (is_neogeo_cd()) neocd_poll();
-	if (is_n64()) n64_poll();
+	if (core_hooks->poll && bulk) core_hooks->poll();
 	process_ss(0);
 }
 
 static void send_keycode(unsigned short key, int press)
 {
+	input_latency_sent();
+	ss_kick();
+
 	if (is_pcxt())
 	{
 		//WIN+... we override this hotkey in the core.
@@ -3601,13 +4444,14 @@ static void send_keycode(unsigned short key, int press)
 		}
 
 		// send immediately if possible
-		if (CheckTimer(kbd_timer) && (kbd_fifo_w == kbd_fifo_r))
+		if (kbd_burst <= 0 && CheckTimer(kbd_timer) && (kbd_fifo_w == kbd_fifo_r))
 		{
 			kbd_fifo_minimig_send(code);
 		}
 		else
 		{
 			kbd_fifo_enqueue(code);
+			if (kbd_burst > 0) kbd_fifo_poll();
 		}
 		return;
 	}
@@ -3756,6 +4600,7 @@ static void send_keycode(unsigned short key, int press)
 void user_io_mouse(unsigned char b, int16_t x, int16_t y, int16_t w)
 {
 	if (osd_is_visible && !is_menu()) return;
+	input_latency_sent();
 
 	switch (core_type)
 	{
@@ -4083,38 +4928,151 @@ uint16_t user_io_get_sdram_cfg()
 	return sdram_cfg;
 }
 
-static struct { const char *fmtstr; Imlib_Load_Error errno; } err_strings[] = {
-  {"file '%s' does not exist", IMLIB_LOAD_ERROR_FILE_DOES_NOT_EXIST},
-  {"file '%s' is a directory", IMLIB_LOAD_ERROR_FILE_IS_DIRECTORY},
-  {"permission denied to read file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_READ},
-  {"no loader for the file format used in file '%s'", IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT},
-  {"path for file '%s' is too long", IMLIB_LOAD_ERROR_PATH_TOO_LONG},
-  {"a component of path '%s' does not exist", IMLIB_LOAD_ERROR_PATH_COMPONENT_NON_EXISTANT},
-  {"a component of path '%s' is not a directory", IMLIB_LOAD_ERROR_PATH_COMPONENT_NOT_DIRECTORY},
-  {"path '%s' has too many symbolic links", IMLIB_LOAD_ERROR_TOO_MANY_SYMBOLIC_LINKS},
-  {"ran out of file descriptors trying to access file '%s'", IMLIB_LOAD_ERROR_OUT_OF_FILE_DESCRIPTORS},
-  {"denied write permission for file '%s'", IMLIB_LOAD_ERROR_PERMISSION_DENIED_TO_WRITE},
-  {"out of disk space writing to file '%s'", IMLIB_LOAD_ERROR_OUT_OF_DISK_SPACE},
-  {(const char *)NULL, (Imlib_Load_Error) 0}
+// Screenshots are grabbed on the main thread, which only takes a frame
+// copy. Rescaling, PNG encoding and the write run on the offload pool,
+// completion is reported from user_io_poll(). The buffers are kept for
+// bursts and dropped after a while without captures.
+#define SHOT_SLOTS 2
+#define SHOT_KEEP_MS 10000
+
+struct screenshot_t
+{
+	unsigned char *buf;   // RGB
+	size_t buf_size;
+	int width, height;
+	int out_width, out_height;
+	char filename[1024];
+	char fullpath[1024];
+	offload_job_t job;
+	int busy;
+	int saved;            // written by the job
 };
 
-static void print_imlib_load_error (Imlib_Load_Error err, const char *filepath) {
-  int i;
-  for (i = 0; err_strings[i].fmtstr != NULL; i++) {
-    if (err == err_strings[i].errno) {
-	printf("Screenshot Error (%d): ",err);
-	printf(err_strings[i].fmtstr,filepath);
-	printf("\n");
-      return ;
-    }
-  }
-  /* Unrecognised error */
-    printf("Screenshot Error (%d): unrecognized error accessing file '%s'\n",err,filepath);
-  return ;
+static screenshot_t shots[SHOT_SLOTS] = {};
+static unsigned long shot_free_timer = 0;
+
+// bilinear resample of an RGB image, 16.16 fixed point
+static void screenshot_scale(const unsigned char *src, int sw, int sh, unsigned char *dst, int dw, int dh)
+{
+	uint32_t sx_step = ((uint32_t)sw << 16) / dw;
+	uint32_t sy_step = ((uint32_t)sh << 16) / dh;
+
+	for (int y = 0; y < dh; y++)
+	{
+		uint32_t sy = y * sy_step + (sy_step >> 1);
+		sy = (sy > 0x8000) ? sy - 0x8000 : 0;
+		int y0 = sy >> 16;
+		int y1 = (y0 + 1 < sh) ? y0 + 1 : y0;
+		uint32_t fy = (sy >> 8) & 0xFF;
+
+		const unsigned char *r0 = src + y0 * sw * 3;
+		const unsigned char *r1 = src + y1 * sw * 3;
+		for (int x = 0; x < dw; x++)
+		{
+			uint32_t sx = x * sx_step + (sx_step >> 1);
+			sx = (sx > 0x8000) ? sx - 0x8000 : 0;
+			int x0 = sx >> 16;
+			int x1 = (x0 + 1 < sw) ? x0 + 1 : x0;
+			uint32_t fx = (sx >> 8) & 0xFF;
+
+			for (int c = 0; c < 3; c++)
+			{
+				uint32_t top = r0[x0 * 3 + c] * (256 - fx) + r0[x1 * 3 + c] * fx;
+				uint32_t bot = r1[x0 * 3 + c] * (256 - fx) + r1[x1 * 3 + c] * fx;
+				*dst++ = (top * (256 - fy) + bot * fy + 32768) >> 16;
+			}
+		}
+	}
+}
+
+static void screenshot_encode(screenshot_t *shot)
+{
+	const unsigned char *img = shot->buf;
+	int w = shot->width, h = shot->height;
+
+	unsigned char *scaled = NULL;
+	if (shot->out_width > 0 && shot->out_height > 0 && (shot->out_width != w || shot->out_height != h))
+	{
+		scaled = (unsigned char *)malloc(shot->out_width * shot->out_height * 3);
+		if (scaled)
+		{
+			screenshot_scale(img, w, h, scaled, shot->out_width, shot->out_height);
+			img = scaled;
+			w = shot->out_width;
+			h = shot->out_height;
+		}
+	}
+
+	size_t len = 0;
+	void *png = tdefl_write_image_to_png_file_in_memory_ex(img, w, h, 3, &len, MZ_DEFAULT_LEVEL, 0);
+	free(scaled);
+
+	shot->saved = 0;
+	if (png)
+	{
+		FILE *fp = fopen(shot->fullpath, "wb");
+		if (fp)
+		{
+			shot->saved = (fwrite(png, 1, len, fp) == len);
+			if (fclose(fp)) shot->saved = 0;
+		}
+		mz_free(png);
+	}
+
+	if (!shot->saved) printf("Screenshot Error: can't save '%s'\n", shot->filename);
+}
+
+static void screenshot_poll()
+{
+	int busy = 0;
+	for (int i = 0; i < SHOT_SLOTS; i++)
+	{
+		screenshot_t *shot = &shots[i];
+		if (!shot->busy) continue;
+		if (!offload_job_done(shot->job))
+		{
+			busy = 1;
+			continue;
+		}
+
+		shot->busy = 0;
+		if (shot->saved)
+		{
+			char msg[1024];
+			snprintf(msg, 1024, "Screen saved to\n%s", shot->filename + strlen(SCREENSHOT_DIR"/"));
+			Info(msg);
+		}
+		else
+		{
+			Info("error in saving png");
+		}
+		shot_free_timer = GetTimer(SHOT_KEEP_MS);
+	}
+
+	if (!busy && shot_free_timer && CheckTimer(shot_free_timer))
+	{
+		shot_free_timer = 0;
+		for (int i = 0; i < SHOT_SLOTS; i++)
+		{
+			free(shots[i].buf);
+			shots[i].buf = NULL;
+			shots[i].buf_size = 0;
+		}
+	}
 }
 
 bool user_io_screenshot(const char *pngname, int rescale)
 {
+	screenshot_poll();
+
+	screenshot_t *shot = NULL;
+	for (int i = 0; i < SHOT_SLOTS && !shot; i++) if (!shots[i].busy) shot = &shots[i];
+	if (!shot)
+	{
+		Info("Screenshot in progress");
+		return false;
+	}
+
 	mister_scaler *ms = mister_scaler_init();
 	if (ms == NULL)
 	{
@@ -4122,43 +5080,44 @@ bool user_io_screenshot(const char *pngname, int rescale)
 		Info("Scaler not compatible");
 		return false;
 	}
-	else
+
+	size_t size = ms->width * ms->height * 3;
+	if (shot->buf_size < size)
+	{
+		free(shot->buf);
+		shot->buf = (unsigned char *)malloc(size);
+		shot->buf_size = shot->buf ? size : 0;
+	}
+
+	if (!shot->buf)
 	{
-		const char *basename = last_filename;
-		if( pngname && *pngname )
-			basename = pngname;
-		unsigned char *outputbuf = (unsigned char *)calloc(ms->width*ms->height * 4, 1);
-		// read the image into the outpubuf - RGBA format
-		mister_scaler_read_32(ms,outputbuf);
-		// using_data will keep a pointer and dispose of the outbuf
-		Imlib_Image im = imlib_create_image_using_data(ms->width,ms->height,(unsigned int *)outputbuf);
-		imlib_context_set_image(im);
-
-		static char filename[1024];
-		FileGenerateScreenshotName(basename, filename, 1024);
-
-		/* do we want to save a rescaled image? */
-		if (rescale)
-		{
-			Imlib_Image im_scaled=imlib_create_cropped_scaled_image(0,0,ms->width,ms->height,ms->output_width,ms->output_height);
-			imlib_free_image_and_decache();
-			imlib_context_set_image(im_scaled);
-		}
-		Imlib_Load_Error error;
-		imlib_save_image_with_error_return(getFullPath(filename),&error);
-		if (error != IMLIB_LOAD_ERROR_NONE)
-		{
-			print_imlib_load_error (error, filename);
-			Info("error in saving png");
-			return false;
-		}
-		imlib_free_image_and_decache();
 		mister_scaler_free(ms);
-		free(outputbuf);
-		char msg[1024];
-		snprintf(msg, 1024, "Screen saved to\n%s", filename + strlen(SCREENSHOT_DIR"/"));
-		Info(msg);
+		Info("error in saving png");
+		return false;
 	}
+
+	// only the frame copy happens here
+	mister_scaler_read(ms, shot->buf);
+	shot->width = ms->width;
+	shot->height = ms->height;
+	shot->out_width = rescale ? ms->output_width : 0;
+	shot->out_height = rescale ? ms->output_height : 0;
+	mister_scaler_free(ms);
+
+	const char *basename = last_filename;
+	if( pngname && *pngname )
+		basename = pngname;
+	FileGenerateScreenshotName(basename, shot->filename, sizeof(shot->filename));
+	snprintf(shot->fullpath, sizeof(shot->fullpath), "%s", getFullPath(shot->filename));
+
+	// a capture in the same second gets the same name, let the older one finish first
+	for (int i = 0; i < SHOT_SLOTS; i++)
+	{
+		if (shots[i].busy && !strcmp(shots[i].fullpath, shot->fullpath)) offload_wait(shots[i].job);
+	}
+
+	shot->busy = 1;
+	shot->job = offload_add_work([shot]() { screenshot_encode(shot); }, OFFLOAD_UI);
 	return true;
 }
 
@@ -73,6 +73,8 @@
 #define UIO_GET_RUMBLE  0x3F
 #define UIO_GET_FB_PAR  0x40
 #define UIO_SET_YC_PAR  0x41
+#define UIO_KBD_FIFO    0x42  // Get free space of the keyboard FIFO (0xA5xx), minimig
+#define UIO_KBD_BURST   0x43  // Count and key codes (bit 8 - OSD) in one transfer, minimig
 
 // codes as used by 8bit for file loading from OSD
 #define FIO_FILE_TX     0x53
@@ -175,11 +177,91 @@ int substrcpy(char *d, const char *s, char idx);
 
 void user_io_read_confstr();
 char *user_io_get_confstr(int index);
+void user_io_confstr_bench(); // for the bench harness
+// Status bits of an option: "[end:start]", "[bit]" or the legacy "SE" form
+// (0-9, A-V; ex selects the second 32 bits). size is 0 if the option is
+// invalid. It's constexpr, so options known at compile time cost nothing.
+struct status_opt_t
+{
+	uint8_t start;
+	uint8_t end;
+	uint8_t size;
+};
+
+constexpr int user_io_status_digit(char c)
+{
+	return (c >= '0' && c <= '9') ? c - '0' : (c >= 'A' && c <= 'V') ? c - 'A' + 10 : -1;
+}
+
+constexpr status_opt_t user_io_status_opt(const char *opt, int ex = 0, int single = 0)
+{
+	uint32_t start = 0, end = 0;
+	if (opt[0] == '[')
+	{
+		uint32_t num[2] = {};
+		int len[2] = {};
+		int i = 1;
+		for (int n = 0; n < 2; n++)
+		{
+			while (opt[i] == ' ' || (opt[i] >= '\t' && opt[i] <= '\r')) i++;
+			while (opt[i] >= '0' && opt[i] <= '9')
+			{
+				if (num[n] < 1000) num[n] = num[n] * 10 + opt[i] - '0';
+				len[n]++;
+				i++;
+			}
+			if (!len[n] || opt[i] != ':') break;
+			i++;
+		}
+
+		if (!single && len[1])
+		{
+			end = num[0];
+			start = num[1];
+			if (start > 127 || end > 127 || end <= start) return status_opt_t{};
+		}
+		else if (len[0])
+		{
+			start = num[0];
+			if (start > 127) return status_opt_t{};
+			end = start;
+		}
+		else return status_opt_t{};
+	}
+	else
+	{
+		if (user_io_status_digit(opt[0]) < 0) return status_opt_t{};
+		start = user_io_status_digit(opt[0]);
+
+		if (!single && user_io_status_digit(opt[1]) >= 0) end = user_io_status_digit(opt[1]);
+		else
+		{
+			single = 1;
+			end = start;
+		}
+
+		if (ex)
+		{
+			start += 32;
+			end += 32;
+		}
+
+		if (start > 127 || end > 127 || (!single && end <= start)) return status_opt_t{};
+	}
+
+	//max 8 bits per option
+	if (end - start > 8) return status_opt_t{};
+
+	return status_opt_t{ (uint8_t)start, (uint8_t)end, (uint8_t)(1 + end - start) };
+}
+
 int user_io_status_bits(const char *opt, int *s, int *e, int ex = 0, int single = 0);
 uint32_t user_io_status_mask(const char *opt);
 uint32_t user_io_hd_mask(const char *opt);
 uint32_t user_io_status_get(const char *opt, int ex = 0);
+uint32_t user_io_status_get(status_opt_t opt);
 void user_io_status_set(const char *opt, uint32_t value, int ex = 0);
+void user_io_status_set(status_opt_t opt, uint32_t value);
 int user_io_status_save(const char *filename);
 void user_io_status_reset();
 
@@ -217,11 +299,19 @@ uint16_t user_io_get_sdram_cfg();
 
 int user_io_file_tx(const char* name, unsigned char index = 0, char opensave = 0, char mute = 0, char composite = 0, uint32_t load_addr = 0);
 int user_io_file_tx_a(const char* name, uint16_t index);
+// same as user_io_file_tx, the file is kept in RAM and resent without reading it again
+int user_io_file_tx_cached(const char *name, unsigned char index = 0);
 unsigned char user_io_ext_idx(char *, char*);
 void user_io_set_index(unsigned char index);
 void user_io_set_aindex(uint16_t index);
 void user_io_set_download(unsigned char enable, int addr = 0);
 void user_io_file_tx_data(const uint8_t *addr, uint32_t len);
+
+// Sends a buffer as one download to the given index, as the CD drives do
+// for every sector. The index is only written when it changes.
+int user_io_send_data(const uint8_t *buf, int len, uint8_t index);
+// load address of the core's DDR upload window if it fits size bytes, 0 if SPI has to be used
+uint32_t user_io_ddr_window(uint32_t size);
 void user_io_set_upload(unsigned char enable, int addr = 0);
 void user_io_file_rx_data(uint8_t *addr, uint32_t len);
 void user_io_file_info(const char *ext);
@@ -256,11 +346,13 @@ int GetUARTbaud_idx(int mode);
 uint32_t ValidateUARTbaud(int mode, uint32_t baud);
 char * GetMidiLinkSoundfont();
 void user_io_store_filename(char *filename);
+const char *user_io_get_filename();
 int user_io_use_cheats();
 
 int process_ss(const char *rom_name, int enable = 1);
 
 void diskled_on();
+int user_io_idle();
 #define DISKLED_ON  diskled_on()
 #define DISKLED_OFF void()
 
@@ -11,6 +11,12 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <math.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 #include "hardware.h"
 #include "user_io.h"
@@ -26,6 +32,9 @@
 #include "str_util.h"
 #include "profiling.h"
 #include "offload.h"
+#include "crc.h"
+#include "pacing.h"
+#include "scheduler.h"
 
 #include "support.h"
 #include "lib/imlib2/Imlib2.h"
@@ -71,7 +80,8 @@ static int brd_x = 0;
 static int brd_y = 0;
 
 static int menu_bg = 0;
-static int menu_bgn = 0;
+static int menu_bgn = 0;   // background page shown
+static int menu_bgd = 1;   // and the one drawn
 
 static VideoInfo current_video_info;
 
@@ -206,7 +216,7 @@ static uint32_t getPLLdiv(uint32_t div)
 	return ((div / 2) << 8) | (div / 2);
 }
 
-static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko)
+static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko, int verbose)
 {
 	uint32_t c = 1;
 	while ((Fout*c) < 400) c++;
@@ -222,13 +232,13 @@ static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko)
 
 		if (ko && (ko <= 0.05f || ko >= 0.95f))
 		{
-			printf("Fvco=%f, C=%d, M=%d, K=%f ", fvco, c, m, ko);
+			if (verbose) printf("Fvco=%f, C=%d, M=%d, K=%f ", fvco, c, m, ko);
 			if (fvco > 1500.f)
 			{
-				printf("-> No exact parameters found\n");
+				if (verbose) printf("-> No exact parameters found\n");
 				return 0;
 			}
-			printf("-> K is outside allowed range\n");
+			if (verbose) printf("-> K is outside allowed range\n");
 			c++;
 		}
 		else
@@ -244,24 +254,16 @@ static int findPLLpar(double Fout, uint32_t *pc, uint32_t *pm, double *pko)
 	return 0;
 }
 
-static void setPLL(double Fout, vmode_custom_t *v)
+static void calcPLL(double Fout, uint32_t *pc, uint32_t *pm, double *pko, int verbose)
 {
-	PROFILE_FUNCTION();
-
-	double Fpix;
-	double fvco, ko;
-	uint32_t m, c;
-
-	printf("Calculate PLL for %.4f MHz:\n", Fout);
-
-	if (!findPLLpar(Fout, &c, &m, &ko))
+	if (!findPLLpar(Fout, pc, pm, pko, verbose))
 	{
-		c = 1;
+		uint32_t c = 1;
 		while ((Fout*c) < 400) c++;
 
-		fvco = Fout*c;
-		m = (uint32_t)(fvco / 50);
-		ko = ((fvco / 50) - m);
+		double fvco = Fout*c;
+		uint32_t m = (uint32_t)(fvco / 50);
+		double ko = ((fvco / 50) - m);
 
 		//Make sure K is in allowed range.
 		if (ko <= 0.05f)
@@ -273,8 +275,66 @@ static void setPLL(double Fout, vmode_custom_t *v)
 			m++;
 			ko = 0;
 		}
+
+		*pc = c;
+		*pm = m;
+		*pko = ko;
+	}
+}
+
+// PLL parameters of every pixel clock seen so far. The predefined modes
+// are filled in at startup, so mode switches and VRR changes between
+// known clocks skip the search.
+#define PLL_CACHE_NUM 48
+
+struct pll_par_t
+{
+	double Fout;
+	uint32_t c, m;
+	double ko;
+};
+
+static pll_par_t pll_cache[PLL_CACHE_NUM];
+static int pll_cache_num = 0;
+static int pll_cache_next = 0;
+
+static const pll_par_t *getPLLpar(double Fout, int verbose)
+{
+	for (int i = 0; i < pll_cache_num; i++)
+	{
+		if (pll_cache[i].Fout == Fout) return &pll_cache[i];
 	}
 
+	pll_par_t *par = &pll_cache[pll_cache_next];
+	pll_cache_next = (pll_cache_next + 1) % PLL_CACHE_NUM;
+	if (pll_cache_num < PLL_CACHE_NUM) pll_cache_num++;
+
+	par->Fout = Fout;
+	calcPLL(Fout, &par->c, &par->m, &par->ko, verbose);
+	return par;
+}
+
+static void pll_cache_init()
+{
+	for (uint32_t i = 0; i < VMODES_NUM; i++) getPLLpar(vmodes[i].Fpix, 0);
+	for (uint32_t i = 0; i < sizeof(tvmodes) / sizeof(tvmodes[0]); i++) getPLLpar(tvmodes[i].Fpix, 0);
+}
+
+static void setPLL(double Fout, vmode_custom_t *v)
+{
+	PROFILE_FUNCTION();
+
+	double Fpix;
+	double fvco, ko;
+	uint32_t m, c;
+
+	printf("Calculate PLL for %.4f MHz:\n", Fout);
+
+	const pll_par_t *par = getPLLpar(Fout, 1);
+	c = par->c;
+	m = par->m;
+	ko = par->ko;
+
 	uint32_t k = ko ? (uint32_t)(ko * 4294967296) : 1;
 
 	fvco = ko + m;
@@ -358,7 +418,84 @@ static bool scale_phases(FilterPhase out_phases[N_PHASES], FilterPhase *in_phase
 	return true;
 }
 
-static bool read_video_filter(int type, VideoFilter *out)
+// Parsed filter, gamma and shadow mask tables are kept in tmpfs next to the
+// mtime and size of their source, so switching presets doesn't parse text.
+#define VTBL_DIR   "/tmp/vidtbl"
+#define VTBL_MAGIC 0x56544201
+
+enum
+{
+	VTBL_FILTER = 0,
+	VTBL_GAMMA,
+	VTBL_MASK
+};
+
+struct vtbl_hdr_t
+{
+	uint32_t magic;
+	uint32_t kind;
+	uint32_t size;
+	int64_t src_mtime;
+	int64_t src_size;
+};
+
+static void vtbl_name(const char *path, char *name, char *tmp_name)
+{
+	uint32_t hash = 2166136261u;
+	while (*path) hash = (hash ^ (uint8_t)*path++) * 16777619u;
+	sprintf(name, VTBL_DIR "/%08X", hash);
+	sprintf(tmp_name, VTBL_DIR "/.%08X", hash);
+}
+
+// st is the stat of the source, looked up by path if not given
+static bool vtbl_load(const char *path, uint32_t kind, void *data, uint32_t size, const struct stat64 *st = nullptr)
+{
+	if (!st) st = getPathStat(path);
+	if (!st) return false;
+
+	char name[64], tmp_name[64];
+	vtbl_name(path, name, tmp_name);
+
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	vtbl_hdr_t hdr;
+	bool ok = read(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && hdr.magic == VTBL_MAGIC && hdr.kind == kind &&
+		hdr.size == size && hdr.src_mtime == (int64_t)st->st_mtime && hdr.src_size == (int64_t)st->st_size &&
+		read(fd, data, size) == (ssize_t)size;
+	close(fd);
+	return ok;
+}
+
+static void vtbl_store(const char *path, uint32_t kind, const void *data, uint32_t size, const struct stat64 *st = nullptr)
+{
+	if (!st) st = getPathStat(path);
+	if (!st) return;
+
+	mkdir(VTBL_DIR, 0755);
+
+	char name[64], tmp_name[64];
+	vtbl_name(path, name, tmp_name);
+
+	int fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return;
+
+	vtbl_hdr_t hdr = { VTBL_MAGIC, kind, size, (int64_t)st->st_mtime, (int64_t)st->st_size };
+	bool ok = write(fd, &hdr, sizeof(hdr)) == sizeof(hdr) && write(fd, data, size) == (ssize_t)size;
+	close(fd);
+
+	if (!ok || rename(tmp_name, name)) unlink(tmp_name);
+}
+
+struct VideoFilterTable
+{
+	VideoFilter flt;
+	int32_t count;       // phases in the file, -1 if too many
+	int32_t is_adaptive; // as declared by the file
+	int32_t valid;
+};
+
+static bool parse_video_filter(const char *filename, VideoFilterTable *tbl)
 {
 	PROFILE_FUNCTION();
 
@@ -367,14 +504,14 @@ static bool read_video_filter(int type, VideoFilter *out)
 	int count = 0;
 	bool is_adaptive = false;
 	int scale = 2;
+	bool opened = false;
 
-	memset(out, 0, sizeof(VideoFilter));
-
-	static char filename[1024];
-	snprintf(filename, sizeof(filename), COEFF_DIR"/%s", scaler_flt[type].filename);
+	VideoFilter *out = &tbl->flt;
+	memset(tbl, 0, sizeof(VideoFilterTable));
 
 	if (FileOpenTextReader(&reader, filename))
 	{
+		opened = true;
 		const char *line;
 		while ((line = FileReadLine(&reader)))
 		{
@@ -394,7 +531,11 @@ static bool read_video_filter(int type, VideoFilter *out)
 			int n = sscanf(line, "%d,%d,%d,%d", &phase[0], &phase[1], &phase[2], &phase[3]);
 			if (n == 4)
 			{
-				if (count >= (is_adaptive ? N_PHASES * 2 : N_PHASES)) return false; //too many
+				if (count >= (is_adaptive ? N_PHASES * 2 : N_PHASES)) //too many
+				{
+					tbl->count = -1;
+					return false;
+				}
 				phases[count].t[0] = phase[0] * scale;
 				phases[count].t[1] = phase[1] * scale;
 				phases[count].t[2] = phase[2] * scale;
@@ -404,10 +545,8 @@ static bool read_video_filter(int type, VideoFilter *out)
 		}
 	}
 
-	printf( "Filter \'%s\', phases: %d adaptive: %s\n",
-			scaler_flt[type].filename,
-			is_adaptive ? count / 2 : count,
-			is_adaptive ? "true" : "false" );
+	tbl->count = count;
+	tbl->is_adaptive = is_adaptive;
 
 	bool valid = false;
 	if (is_adaptive)
@@ -446,42 +585,75 @@ static bool read_video_filter(int type, VideoFilter *out)
 	MD5Update(&ctx, (unsigned char *)out->adaptive_phases, sizeof(VideoFilter::adaptive_phases));
 	MD5Final(out->digest.md5, &ctx);
 
-	return valid;
+	tbl->valid = valid;
+	return opened;
 }
 
-static void send_phases_legacy(int addr, const FilterPhase phases[N_PHASES])
+static bool read_video_filter(const char *name, VideoFilter *out)
 {
 	PROFILE_FUNCTION();
 
+	static VideoFilterTable tbl;
+	static char filename[1024];
+	snprintf(filename, sizeof(filename), COEFF_DIR"/%s", name);
+
+	if (!vtbl_load(filename, VTBL_FILTER, &tbl, sizeof(tbl)))
+	{
+		if (parse_video_filter(filename, &tbl)) vtbl_store(filename, VTBL_FILTER, &tbl, sizeof(tbl));
+		else if (tbl.count < 0)
+		{
+			memset(out, 0, sizeof(VideoFilter));
+			return false;
+		}
+	}
+
+	printf( "Filter \'%s\', phases: %d adaptive: %s\n",
+			name,
+			tbl.is_adaptive ? tbl.count / 2 : tbl.count,
+			tbl.is_adaptive ? "true" : "false" );
+
+	*out = tbl.flt;
+	return tbl.valid;
+}
+
+// Filter tables go out as one block, the largest is three full precision
+// sets of address/value pairs.
+static uint16_t flt_words[3 * N_PHASES * 8];
+
+static int put_phases_legacy(uint16_t *out, int addr, const FilterPhase phases[N_PHASES])
+{
+	int n = 0;
 	for (int idx = 0; idx < N_PHASES; idx += 16)
 	{
 		const FilterPhase *p = &phases[idx];
-		spi_w(((p->t[0] >> 1) & 0x1FF) | ((addr + 0) << 9));
-		spi_w(((p->t[1] >> 1) & 0x1FF) | ((addr + 1) << 9));
-		spi_w(((p->t[2] >> 1) & 0x1FF) | ((addr + 2) << 9));
-		spi_w(((p->t[3] >> 1) & 0x1FF) | ((addr + 3) << 9));
+		out[n++] = ((p->t[0] >> 1) & 0x1FF) | ((addr + 0) << 9);
+		out[n++] = ((p->t[1] >> 1) & 0x1FF) | ((addr + 1) << 9);
+		out[n++] = ((p->t[2] >> 1) & 0x1FF) | ((addr + 2) << 9);
+		out[n++] = ((p->t[3] >> 1) & 0x1FF) | ((addr + 3) << 9);
 		addr += 4;
 	}
+	return n;
 }
 
-static void send_phases(int addr, const FilterPhase phases[N_PHASES], bool full_precision)
+static int put_phases(uint16_t *out, int addr, const FilterPhase phases[N_PHASES], bool full_precision)
 {
-	PROFILE_FUNCTION();
-
 	const int skip = full_precision ? 1 : 4;
 	const int shift = full_precision ? 0 : 1;
 
 	addr *= full_precision ? (N_PHASES * 4) : (64 * 4);
 
+	int n = 0;
 	for (int idx = 0; idx < N_PHASES; idx += skip)
 	{
 		const FilterPhase *p = &phases[idx];
-		spi_w(addr + 0); spi_w((p->t[0] >> shift) & 0x3FF);
-		spi_w(addr + 1); spi_w((p->t[1] >> shift) & 0x3FF);
-		spi_w(addr + 2); spi_w((p->t[2] >> shift) & 0x3FF);
-		spi_w(addr + 3); spi_w((p->t[3] >> shift) & 0x3FF);
+		for (int i = 0; i < 4; i++)
+		{
+			out[n++] = addr + i;
+			out[n++] = (p->t[i] >> shift) & 0x3FF;
+		}
 		addr += 4;
 	}
+	return n;
 }
 
 static VideoFilterDigest horiz_filter_digest, vert_filter_digest;
@@ -497,33 +669,36 @@ static void send_video_filters(const VideoFilter *horiz, const VideoFilter *vert
 	const bool send_horiz = horiz_filter_digest != horiz->digest;
 	const bool send_vert = vert_filter_digest != vert->digest;
 
+	int n = 0;
 	switch( ver & 0x3 )
 	{
 		case 1:
-			if (send_horiz) send_phases_legacy(0, horiz->phases);
-			if (send_vert) send_phases_legacy(64, vert->phases);
+			if (send_horiz) n += put_phases_legacy(flt_words + n, 0, horiz->phases);
+			if (send_vert) n += put_phases_legacy(flt_words + n, 64, vert->phases);
 			break;
 		case 2:
-			if (send_horiz) send_phases(0, horiz->phases, full_precision);
-			if (send_vert) send_phases(1, vert->phases, full_precision);
+			if (send_horiz) n += put_phases(flt_words + n, 0, horiz->phases, full_precision);
+			if (send_vert) n += put_phases(flt_words + n, 1, vert->phases, full_precision);
 			break;
 		case 3:
-			if (send_horiz) send_phases(0, horiz->phases, full_precision);
-			if (send_vert) send_phases(1, vert->phases, full_precision);
+			if (send_horiz) n += put_phases(flt_words + n, 0, horiz->phases, full_precision);
+			if (send_vert) n += put_phases(flt_words + n, 1, vert->phases, full_precision);
 
 			if (horiz->is_adaptive && send_horiz)
 			{
-				send_phases(2, horiz->adaptive_phases, full_precision);
+				n += put_phases(flt_words + n, 2, horiz->adaptive_phases, full_precision);
 			}
 			else if (vert->is_adaptive && send_vert)
 			{
-				send_phases(3, vert->adaptive_phases, full_precision);
+				n += put_phases(flt_words + n, 3, vert->adaptive_phases, full_precision);
 			}
 			break;
 		default:
 			break;
 	}
 
+	if (n) spi_block_write((const uint8_t *)flt_words, 1, n * 2);
+
 	horiz_filter_digest = horiz->digest;
 	vert_filter_digest = vert->digest;
 
@@ -601,7 +776,7 @@ static char scaler_cfg_path[128] = { 0 };
 
 static void video_save_scaler_cfg()
 {
-	FileSaveConfig(scaler_cfg_path, &scaler_flt, sizeof(scaler_flt));
+	FileSaveConfigLater(scaler_cfg_path, &scaler_flt, sizeof(scaler_flt));
 }
 
 static void video_apply_scaler_flt(int type, int n)
@@ -620,7 +795,7 @@ void video_set_scaler_flt(int type, int n)
 void video_apply_scaler_coeff(int type, const char *name)
 {
 	strcpy(scaler_flt[type].filename, name);
-	read_video_filter(type, &scaler_flt_data[type]);
+	read_video_filter(scaler_flt[type].filename, &scaler_flt_data[type]);
 	setScaler();
 	user_io_send_buttons(1);
 }
@@ -663,59 +838,145 @@ static void loadScalerCfg()
 		}
 	}
 
-	if (!read_video_filter(VFILTER_HORZ, &scaler_flt_data[VFILTER_HORZ])) memset(&scaler_flt[VFILTER_HORZ], 0, sizeof(scaler_flt[VFILTER_HORZ]));
-	if (!read_video_filter(VFILTER_VERT, &scaler_flt_data[VFILTER_VERT])) memset(&scaler_flt[VFILTER_VERT], 0, sizeof(scaler_flt[VFILTER_VERT]));
-	if (!read_video_filter(VFILTER_SCAN, &scaler_flt_data[VFILTER_SCAN])) memset(&scaler_flt[VFILTER_SCAN], 0, sizeof(scaler_flt[VFILTER_SCAN]));
+	if (!read_video_filter(scaler_flt[VFILTER_HORZ].filename, &scaler_flt_data[VFILTER_HORZ])) memset(&scaler_flt[VFILTER_HORZ], 0, sizeof(scaler_flt[VFILTER_HORZ]));
+	if (!read_video_filter(scaler_flt[VFILTER_VERT].filename, &scaler_flt_data[VFILTER_VERT])) memset(&scaler_flt[VFILTER_VERT], 0, sizeof(scaler_flt[VFILTER_VERT]));
+	if (!read_video_filter(scaler_flt[VFILTER_SCAN].filename, &scaler_flt_data[VFILTER_SCAN])) memset(&scaler_flt[VFILTER_SCAN], 0, sizeof(scaler_flt[VFILTER_SCAN]));
 }
 
 static char active_gamma_cfg[1024] = { 0 };
 static char gamma_cfg[1024] = { 0 };
 static char has_gamma = 0; // set in video_init
 
+struct GammaTable
+{
+	uint32_t count;
+	uint16_t words[256 * 3];
+};
+
+static void parse_gamma(fileTextReader *reader, GammaTable *tbl)
+{
+	const char *line;
+	int index = 0;
+	tbl->count = 0;
+	while ((line = FileReadLine(reader)))
+	{
+		int c0, c1, c2;
+		int n = sscanf(line, "%d,%d,%d", &c0, &c1, &c2);
+		if (n == 1)
+		{
+			c1 = c0;
+			c2 = c0;
+			n = 3;
+		}
+
+		if (n == 3)
+		{
+			tbl->words[tbl->count++] = (index << 8) | (c0 & 0xFF);
+			tbl->words[tbl->count++] = (index << 8) | (c1 & 0xFF);
+			tbl->words[tbl->count++] = (index << 8) | (c2 & 0xFF);
+
+			index++;
+			if (index >= 256) break;
+		}
+	}
+}
+
+// curve of a gamma setting, from the table cache if it's there
+static bool load_gamma(const char *gcfg, GammaTable *tbl)
+{
+	static char filename[1024];
+	snprintf(filename, sizeof(filename), GAMMA_DIR"/%s", gcfg + 1);
+
+	bool loaded = vtbl_load(filename, VTBL_GAMMA, tbl, sizeof(GammaTable));
+	if (!loaded)
+	{
+		fileTextReader reader = {};
+		if (FileOpenTextReader(&reader, filename))
+		{
+			parse_gamma(&reader, tbl);
+			vtbl_store(filename, VTBL_GAMMA, tbl, sizeof(GammaTable));
+			loaded = true;
+		}
+	}
+	return loaded;
+}
+
+static void send_gamma(const char *gcfg, const GammaTable *tbl)
+{
+	if (tbl)
+	{
+		spi_uio_cmd_cont(UIO_SET_GAMCURV);
+		if (tbl->count) spi_block_write((const uint8_t *)tbl->words, 1, tbl->count * 2);
+		DisableIO();
+		spi_uio_cmd8(UIO_SET_GAMMA, gcfg[0]);
+	}
+	memcpy(active_gamma_cfg, gcfg, sizeof(active_gamma_cfg));
+}
+
 static void setGamma()
 {
 	PROFILE_FUNCTION();
 
 	if (!memcmp(active_gamma_cfg, gamma_cfg, sizeof(gamma_cfg))) return;
 
-	fileTextReader reader = {};
-	static char filename[1024];
+	static GammaTable tbl;
 
 	if (!has_gamma) return;
 
-	snprintf(filename, sizeof(filename), GAMMA_DIR"/%s", gamma_cfg + 1);
+	bool loaded = load_gamma(gamma_cfg, &tbl);
+	send_gamma(gamma_cfg, loaded ? &tbl : NULL);
+}
 
-	if (FileOpenTextReader(&reader, filename))
+// Parses all curves of GAMMA_DIR into the table cache, so stepping through
+// them in the OSD only reads the cache. Runs on a worker, the file_io
+// helpers aren't used there as they share static buffers.
+static void gamma_precompute()
+{
+	static char dir[1024];
+	snprintf(dir, sizeof(dir), "%s/" GAMMA_DIR, getRootDir());
+
+	offload_try_work([]
 	{
-		spi_uio_cmd_cont(UIO_SET_GAMCURV);
+		DIR *d = opendir(dir);
+		if (!d) return;
 
-		const char *line;
-		int index = 0;
-		while ((line = FileReadLine(&reader)))
+		int num = 0;
+		struct dirent *de;
+		while ((de = readdir(d)))
 		{
-			int c0, c1, c2;
-			int n = sscanf(line, "%d,%d,%d", &c0, &c1, &c2);
-			if (n == 1)
-			{
-				c1 = c0;
-				c2 = c0;
-				n = 3;
-			}
+			int len = strlen(de->d_name);
+			if (len < 5 || strcasecmp(de->d_name + len - 4, ".txt")) continue;
 
-			if (n == 3)
-			{
-				spi_w((index << 8) | (c0 & 0xFF));
-				spi_w((index << 8) | (c1 & 0xFF));
-				spi_w((index << 8) | (c2 & 0xFF));
+			char path[1280], name[1280];
+			snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+			snprintf(name, sizeof(name), GAMMA_DIR "/%s", de->d_name);
 
-				index++;
-				if (index >= 256) break;
+			struct stat64 st;
+			if (stat64(path, &st) || !S_ISREG(st.st_mode)) continue;
+
+			GammaTable tbl;
+			if (vtbl_load(name, VTBL_GAMMA, &tbl, sizeof(tbl), &st)) continue;
+
+			FILE *fp = fopen(path, "rb");
+			if (!fp) continue;
+
+			fileTextReader reader = {};
+			reader.buffer = (char*)calloc(1, st.st_size + 1);
+			reader.size = reader.buffer ? fread(reader.buffer, 1, st.st_size, fp) : 0;
+			reader.pos = reader.buffer;
+			fclose(fp);
+
+			if (reader.size)
+			{
+				parse_gamma(&reader, &tbl);
+				vtbl_store(name, VTBL_GAMMA, &tbl, sizeof(tbl), &st);
+				num++;
 			}
 		}
-		DisableIO();
-		spi_uio_cmd8(UIO_SET_GAMMA, gamma_cfg[0]);
-	}
-	memcpy(active_gamma_cfg, gamma_cfg, sizeof(gamma_cfg));
+		closedir(d);
+
+		if (num) printf("gamma: %d curves cached\n", num);
+	}, OFFLOAD_IO);
 }
 
 int video_get_gamma_en()
@@ -737,7 +998,7 @@ char* video_get_gamma_curve(int only_name)
 static char gamma_cfg_path[1024] = { 0 };
 static void video_save_gamma_cfg()
 {
-	FileSaveConfig(gamma_cfg_path, &gamma_cfg, sizeof(gamma_cfg));
+	FileSaveConfigLater(gamma_cfg_path, &gamma_cfg, sizeof(gamma_cfg));
 }
 
 static void video_apply_gamma_en(int n)
@@ -800,106 +1061,200 @@ enum
 	SM_MODE_COUNT
 };
 
-static void setShadowMask()
+// A mask file holds a table per minimal resolution. Every start point is
+// parsed up front into the words it sends, the current mode picks one.
+#define SM_SECTIONS 8
+#define SM_WORDS    (16 * 16 + 3)
+
+struct ShadowMaskTable
 {
-	PROFILE_FUNCTION();
+	uint32_t count;
+	struct
+	{
+		uint32_t res;
+		uint32_t count;
+		uint16_t words[SM_WORDS];
+	} sec[SM_SECTIONS];
+};
 
-	static char filename[1024];
-	has_shadow_mask = 0;
+static uint32_t parse_mask_section(fileTextReader *reader, char *start_pos, uint16_t *words)
+{
+	const char *line;
+	uint32_t cnt = 0;
+	int loaded = 0;
+	int w = -1, h = -1;
+	int y = 0;
+	int v2 = 0;
 
-	if (!spi_uio_cmd_cont(UIO_SHADOWMASK))
+	reader->pos = start_pos;
+	while ((line = FileReadLine(reader)))
 	{
-		DisableIO();
-		return;
+		if (w == -1)
+		{
+			if (!strcasecmp(line, "v2"))
+			{
+				v2 = 1;
+				continue;
+			}
+
+			if (!strncasecmp(line, "resolution=", 11))
+			{
+				continue;
+			}
+
+			int n = sscanf(line, "%d,%d", &w, &h);
+			if ((n != 2) || (w <= 0) || (h <= 0) || (w > 16) || (h > 16))
+			{
+				break;
+			}
+		}
+		else
+		{
+			unsigned int p[16];
+			int n = sscanf(line, "%X,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x", p + 0, p + 1, p + 2, p + 3, p + 4, p + 5, p + 6, p + 7, p + 8, p + 9, p + 10, p + 11, p + 12, p + 13, p + 14, p + 15);
+			if (n != w)
+			{
+				break;
+			}
+
+			for (int x = 0; x < 16; x++) words[cnt++] = SM_LUT(v2 ? (p[x] & 0x7FF) : (((p[x] & 7) << 8) | 0x2A));
+			y += 1;
+
+			if (y == h)
+			{
+				loaded = 1;
+				break;
+			}
+		}
 	}
 
-	has_shadow_mask = 1;
-	switch (video_get_shadow_mask_mode())
+	if (y == h)
 	{
-		default: spi_w(SM_FLAG(0)); break;
-		case SM_MODE_1X: spi_w(SM_FLAG(SM_FLAG_ENABLED)); break;
-		case SM_MODE_2X: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_2X)); break;
-		case SM_MODE_1X_ROTATED: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED)); break;
-		case SM_MODE_2X_ROTATED: spi_w(SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED | SM_FLAG_2X)); break;
+		words[cnt++] = SM_HMAX(w - 1);
+		words[cnt++] = SM_VMAX(h - 1);
 	}
 
-	int loaded = 0;
-	snprintf(filename, sizeof(filename), SMASK_DIR"/%s", shadow_mask_cfg + 1);
+	if (!loaded) words[cnt++] = SM_FLAG(0);
+	return cnt;
+}
 
-	fileTextReader reader;
-	if (FileOpenTextReader(&reader, filename))
+// returns false if the file has too many sections to be kept as a table
+static bool parse_mask(fileTextReader *reader, ShadowMaskTable *tbl)
+{
+	char *pos[SM_SECTIONS];
+	const char *line;
+	uint32_t res = 0;
+	bool fits = true;
+
+	tbl->count = 1;
+	tbl->sec[0].res = 0;
+	pos[0] = reader->pos;
+	while ((line = FileReadLine(reader)))
 	{
-		char *start_pos = reader.pos;
-		const char *line;
-		uint32_t res = 0;
-		while ((line = FileReadLine(&reader)))
+		if (!strncasecmp(line, "resolution=", 11) && sscanf(line + 11, "%u", &res))
 		{
-			if (!strncasecmp(line, "resolution=", 11))
+			if (tbl->count >= SM_SECTIONS)
 			{
-				if (sscanf(line + 11, "%u", &res))
-				{
-					if (v_cur.item[5] >= res)
-					{
-						start_pos = reader.pos;
-					}
-				}
+				fits = false;
+				break;
 			}
+
+			tbl->sec[tbl->count].res = res;
+			pos[tbl->count++] = reader->pos;
 		}
+	}
 
-		int w = -1, h = -1;
-		int y = 0;
-		int v2 = 0;
+	if (!fits) return false;
 
-		reader.pos = start_pos;
-		while ((line = FileReadLine(&reader)))
-		{
-			if (w == -1)
-			{
-				if (!strcasecmp(line, "v2"))
-				{
-					v2 = 1;
-					continue;
-				}
+	for (uint32_t i = 0; i < tbl->count; i++) tbl->sec[i].count = parse_mask_section(reader, pos[i], tbl->sec[i].words);
+	return true;
+}
 
-				if (!strncasecmp(line, "resolution=", 11))
-				{
-					continue;
-				}
+// words a mask setting sends, the mode flags first
+static uint32_t shadow_mask_words(const char *mask_cfg, uint16_t *words)
+{
+	static char filename[1024];
+	static ShadowMaskTable tbl;
 
-				int n = sscanf(line, "%d,%d", &w, &h);
-				if ((n != 2) || (w <= 0) || (h <= 0) || (w > 16) || (h > 16))
-				{
-					break;
-				}
+	switch (mask_cfg[0])
+	{
+		default: words[0] = SM_FLAG(0); break;
+		case SM_MODE_1X: words[0] = SM_FLAG(SM_FLAG_ENABLED); break;
+		case SM_MODE_2X: words[0] = SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_2X); break;
+		case SM_MODE_1X_ROTATED: words[0] = SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED); break;
+		case SM_MODE_2X_ROTATED: words[0] = SM_FLAG(SM_FLAG_ENABLED | SM_FLAG_ROTATED | SM_FLAG_2X); break;
+	}
+
+	uint32_t cnt = 1;
+	snprintf(filename, sizeof(filename), SMASK_DIR"/%s", mask_cfg + 1);
+
+	bool have_tbl = vtbl_load(filename, VTBL_MASK, &tbl, sizeof(tbl));
+	if (!have_tbl)
+	{
+		fileTextReader reader;
+		if (FileOpenTextReader(&reader, filename))
+		{
+			char *start_pos = reader.pos;
+			if (parse_mask(&reader, &tbl))
+			{
+				vtbl_store(filename, VTBL_MASK, &tbl, sizeof(tbl));
+				have_tbl = true;
 			}
 			else
 			{
-				unsigned int p[16];
-				int n = sscanf(line, "%X,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x,%x", p + 0, p + 1, p + 2, p + 3, p + 4, p + 5, p + 6, p + 7, p + 8, p + 9, p + 10, p + 11, p + 12, p + 13, p + 14, p + 15);
-				if (n != w)
-				{
-					break;
-				}
-
-				for (int x = 0; x < 16; x++) spi_w(SM_LUT(v2 ? (p[x] & 0x7FF) : (((p[x] & 7) << 8) | 0x2A)));
-				y += 1;
-
-				if (y == h)
+				// too many sections, find the one to use the slow way
+				const char *line;
+				uint32_t res = 0;
+				reader.pos = start_pos;
+				while ((line = FileReadLine(&reader)))
 				{
-					loaded = 1;
-					break;
+					if (!strncasecmp(line, "resolution=", 11))
+					{
+						if (sscanf(line + 11, "%u", &res))
+						{
+							if (v_cur.item[5] >= res)
+							{
+								start_pos = reader.pos;
+							}
+						}
+					}
 				}
+				cnt += parse_mask_section(&reader, start_pos, words + 1);
 			}
 		}
-
-		if (y == h)
+		else
 		{
-			spi_w(SM_HMAX(w - 1));
-			spi_w(SM_VMAX(h - 1));
+			words[cnt++] = SM_FLAG(0);
 		}
 	}
 
-	if (!loaded) spi_w(SM_FLAG(0));
+	if (have_tbl)
+	{
+		uint32_t sec = 0;
+		for (uint32_t i = 1; i < tbl.count; i++) if (v_cur.item[5] >= tbl.sec[i].res) sec = i;
+		memcpy(words + 1, tbl.sec[sec].words, tbl.sec[sec].count * sizeof(uint16_t));
+		cnt += tbl.sec[sec].count;
+	}
+
+	return cnt;
+}
+
+static void setShadowMask()
+{
+	PROFILE_FUNCTION();
+
+	static uint16_t words[SM_WORDS + 1];
+	has_shadow_mask = 0;
+
+	if (!spi_uio_cmd_cont(UIO_SHADOWMASK))
+	{
+		DisableIO();
+		return;
+	}
+
+	has_shadow_mask = 1;
+	uint32_t cnt = shadow_mask_words(shadow_mask_cfg, words);
+	spi_block_write((const uint8_t *)words, 1, cnt * 2);
 	DisableIO();
 }
 
@@ -923,7 +1278,7 @@ static char shadow_mask_cfg_path[1024] = { 0 };
 
 static void video_save_shadow_mask_cfg()
 {
-	FileSaveConfig(shadow_mask_cfg_path, &shadow_mask_cfg, sizeof(shadow_mask_cfg));
+	FileSaveConfigLater(shadow_mask_cfg_path, &shadow_mask_cfg, sizeof(shadow_mask_cfg));
 }
 
 static void video_apply_shadow_mask_mode(int n)
@@ -1001,23 +1356,39 @@ static char* get_preset_arg(const char *str)
 	return par;
 }
 
-static void load_flt_pres(const char *str, int type)
+static void stage_flt_pres(const char *str, ScalerFilter *flt, bool *read)
 {
 	char *arg = get_preset_arg(str);
 	if (arg[0])
 	{
 		if (!strcasecmp(arg, "same") || !strcasecmp(arg, "off"))
 		{
-			video_apply_scaler_flt(type, 0);
+			flt->mode = 0;
 		}
 		else
 		{
-			video_apply_scaler_coeff(type, arg);
-			video_apply_scaler_flt(type, 1);
+			snprintf(flt->filename, sizeof(flt->filename), "%s", arg);
+			flt->mode = 1;
+			*read = true;
 		}
 	}
 }
 
+// the upload of a preset goes right after a vsync, so it's done before the
+// next frame starts
+static void wait_vsync()
+{
+	static int fb = -1;
+	if (fb < 0) fb = open("/dev/fb0", O_RDWR | O_CLOEXEC);
+
+	int zero = 0;
+	if (fb >= 0) ioctl(fb, FBIO_WAITFORVSYNC, &zero);
+}
+
+// A preset is staged first: its lines only change copies of the filter,
+// mask and gamma settings, then all the tables they need are read (mostly
+// from the table cache). Only the settings which differ go out, together
+// after a vsync, so no half applied preset is ever shown.
 void video_loadPreset(char *name, bool save)
 {
 	char *arg;
@@ -1027,6 +1398,16 @@ void video_loadPreset(char *name, bool save)
 	bool mask_dirty = false;
 	bool gamma_dirty = false;
 
+	static ScalerFilter flt[3];
+	static VideoFilter flt_data[3];
+	static char mask[sizeof(shadow_mask_cfg)];
+	static char gamma[sizeof(gamma_cfg)];
+	bool flt_read[3] = {};
+
+	memcpy(flt, scaler_flt, sizeof(flt));
+	memcpy(mask, shadow_mask_cfg, sizeof(mask));
+	memcpy(gamma, gamma_cfg, sizeof(gamma));
+
 	if (FileOpenTextReader(&reader, name))
 	{
 		const char *line;
@@ -1034,17 +1415,17 @@ void video_loadPreset(char *name, bool save)
 		{
 			if (!strncasecmp(line, "hfilter=", 8))
 			{
-				load_flt_pres(line + 8, VFILTER_HORZ);
+				stage_flt_pres(line + 8, &flt[VFILTER_HORZ], &flt_read[VFILTER_HORZ]);
 				scaler_dirty = true;
 			}
 			else if (!strncasecmp(line, "vfilter=", 8))
 			{
-				load_flt_pres(line + 8, VFILTER_VERT);
+				stage_flt_pres(line + 8, &flt[VFILTER_VERT], &flt_read[VFILTER_VERT]);
 				scaler_dirty = true;
 			}
 			else if (!strncasecmp(line, "sfilter=", 8))
 			{
-				load_flt_pres(line + 8, VFILTER_SCAN);
+				stage_flt_pres(line + 8, &flt[VFILTER_SCAN], &flt_read[VFILTER_SCAN]);
 				scaler_dirty = true;
 			}
 			else if (!strncasecmp(line, "mask=", 5))
@@ -1053,8 +1434,8 @@ void video_loadPreset(char *name, bool save)
 				arg = get_preset_arg(line + 5);
 				if (arg[0])
 				{
-					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) video_apply_shadow_mask_mode(0);
-					else video_apply_shadow_mask(arg);
+					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) mask[0] = 0;
+					else snprintf(mask + 1, sizeof(mask) - 1, "%s", arg);
 				}
 			}
 			else if (!strncasecmp(line, "maskmode=", 9))
@@ -1063,11 +1444,11 @@ void video_loadPreset(char *name, bool save)
 				arg = get_preset_arg(line + 9);
 				if (arg[0])
 				{
-					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) video_apply_shadow_mask_mode(0);
-					else if (!strcasecmp(arg, "1x")) video_apply_shadow_mask_mode(SM_MODE_1X);
-					else if (!strcasecmp(arg, "2x")) video_apply_shadow_mask_mode(SM_MODE_2X);
-					else if (!strcasecmp(arg, "1x rotated")) video_apply_shadow_mask_mode(SM_MODE_1X_ROTATED);
-					else if (!strcasecmp(arg, "2x rotated")) video_apply_shadow_mask_mode(SM_MODE_2X_ROTATED);
+					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) mask[0] = 0;
+					else if (!strcasecmp(arg, "1x")) mask[0] = SM_MODE_1X;
+					else if (!strcasecmp(arg, "2x")) mask[0] = SM_MODE_2X;
+					else if (!strcasecmp(arg, "1x rotated")) mask[0] = SM_MODE_1X_ROTATED;
+					else if (!strcasecmp(arg, "2x rotated")) mask[0] = SM_MODE_2X_ROTATED;
 				}
 			}
 			else if (!strncasecmp(line, "gamma=", 6))
@@ -1076,17 +1457,63 @@ void video_loadPreset(char *name, bool save)
 				arg = get_preset_arg(line + 6);
 				if (arg[0])
 				{
-					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) video_apply_gamma_en(0);
+					if (!strcasecmp(arg, "off") || !strcasecmp(arg, "none")) gamma[0] = 0;
 					else
 					{
-						video_apply_gamma_curve(arg);
-						video_apply_gamma_en(1);
+						snprintf(gamma + 1, sizeof(gamma) - 1, "%s", arg);
+						gamma[0] = 1;
 					}
 				}
 			}
 		}
 	}
 
+	// everything is read before the first upload
+	for (int i = 0; i < 3; i++)
+	{
+		if (flt_read[i]) read_video_filter(flt[i].filename, &flt_data[i]);
+	}
+
+	bool send_scaler = flt_read[0] || flt_read[1] || flt_read[2] || memcmp(flt, scaler_flt, sizeof(flt));
+
+	static GammaTable gamma_tbl;
+	bool send_gamma_tbl = has_gamma && memcmp(gamma, active_gamma_cfg, sizeof(gamma));
+	bool gamma_loaded = send_gamma_tbl && load_gamma(gamma, &gamma_tbl);
+
+	static uint16_t mask_words[SM_WORDS + 1];
+	bool send_mask = memcmp(mask, shadow_mask_cfg, sizeof(mask)) != 0;
+	uint32_t mask_cnt = send_mask ? shadow_mask_words(mask, mask_words) : 0;
+
+	if (send_scaler || send_gamma_tbl || send_mask)
+	{
+		wait_vsync();
+
+		if (send_scaler)
+		{
+			memcpy(scaler_flt, flt, sizeof(flt));
+			for (int i = 0; i < 3; i++) if (flt_read[i]) scaler_flt_data[i] = flt_data[i];
+			spi_uio_cmd8(UIO_SET_FLTNUM, scaler_flt[0].mode);
+			setScaler();
+		}
+
+		if (send_gamma_tbl) send_gamma(gamma, gamma_loaded ? &gamma_tbl : NULL);
+
+		if (send_mask)
+		{
+			memcpy(shadow_mask_cfg, mask, sizeof(mask));
+			has_shadow_mask = 0;
+			if (spi_uio_cmd_cont(UIO_SHADOWMASK))
+			{
+				has_shadow_mask = 1;
+				spi_block_write((const uint8_t *)mask_words, 1, mask_cnt * 2);
+			}
+			DisableIO();
+		}
+
+		user_io_send_buttons(1);
+	}
+	memcpy(gamma_cfg, gamma, sizeof(gamma));
+
 	if (save)
 	{
 		if (scaler_dirty) video_save_scaler_cfg();
@@ -1097,34 +1524,28 @@ void video_loadPreset(char *name, bool save)
 
 static void hdmi_config_set_spd(bool val)
 {
-	int fd = i2c_open(0x39, 0);
-	if (fd >= 0)
+	if (i2c_dev_fd(0x39) >= 0)
 	{
-		uint8_t packet_val = i2c_smbus_read_byte_data(fd, 0x40);
+		uint8_t packet_val = i2c_dev_read(0x39, 0x40);
 		if (val)
 			packet_val |= 0x40;
 		else
 			packet_val &= ~0x40;
-		int res = i2c_smbus_write_byte_data(fd, 0x40, packet_val);
-		if (res < 0) printf("i2c: write error (%02X %02X): %d\n", 0x40, packet_val, res);
-		i2c_close(fd);
+		i2c_dev_write(0x39, 0x40, packet_val);
 	}
 }
 
 static void hdmi_config_set_spare(int packet, bool enabled)
 {
-	int fd = i2c_open(0x39, 0);
 	uint8_t mask = packet == 0 ? 0x01 : 0x02;
-	if (fd >= 0)
+	if (i2c_dev_fd(0x39) >= 0)
 	{
-		uint8_t packet_val = i2c_smbus_read_byte_data(fd, 0x40);
+		uint8_t packet_val = i2c_dev_read(0x39, 0x40);
 		if (enabled)
 			packet_val |= mask;
 		else
 			packet_val &= ~mask;
-		int res = i2c_smbus_write_byte_data(fd, 0x40, packet_val);
-		if (res < 0) printf("i2c: write error (%02X %02X): %d\n", 0x40, packet_val, res);
-		i2c_close(fd);
+		i2c_dev_write(0x39, 0x40, packet_val);
 	}
 }
 
@@ -1345,16 +1766,9 @@ static void hdmi_config_set_csc()
 		0xC3, (uint8_t)(clipMax & 0xff)
 	};
 
-	int fd = i2c_open(0x39, 0);
-	if (fd >= 0)
+	if (i2c_dev_fd(0x39) >= 0)
 	{
-		for (uint i = 0; i < sizeof(csc_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, csc_data[i], csc_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", csc_data[i], csc_data[i + 1], res);
-		}
-
-		i2c_close(fd);
+		i2c_dev_write_regs(0x39, csc_data, sizeof(csc_data));
 	}
 	else
 	{
@@ -1503,16 +1917,9 @@ static void hdmi_config_init()
 		0x09, 0x0A,				//
 	};
 
-	int fd = i2c_open(0x39, 0);
-	if (fd >= 0)
+	if (i2c_dev_fd(0x39) >= 0)
 	{
-		for (uint i = 0; i < sizeof(init_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, init_data[i], init_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", init_data[i], init_data[i + 1], res);
-		}
-
-		i2c_close(fd);
+		i2c_dev_write_regs(0x39, init_data, sizeof(init_data));
 	}
 	else
 	{
@@ -1524,29 +1931,29 @@ static void hdmi_config_init()
 
 static void spd_config(uint8_t *data)
 {
-	int fd = i2c_open(0x38, 0);
-	if (fd >= 0)
+	if (i2c_dev_fd(0x38) >= 0)
 	{
 		int res;
 		hdmi_config_set_spd(1);
 
-		res = i2c_smbus_write_byte_data(fd, 0x1F, 0x80);
+		res = i2c_dev_write(0x38, 0x1F, 0x80);
 		if (res < 0)
 		{
 			printf("i2c: Couldn't update SPD change register (0x1F, 0x80) %d\n", res);
 		}
 		else
 		{
+			uint8_t spd_data[31 * 2];
 			for (int i = 0; i < 31; i++)
 			{
-				res = i2c_smbus_write_byte_data(fd, i, data[i]);
-				if (res < 0) printf("i2c: SPD register write error (%02X %02x): %d\n", i, data[i], res);
+				spd_data[i * 2] = i;
+				spd_data[i * 2 + 1] = data[i];
 			}
+			i2c_dev_write_regs(0x38, spd_data, sizeof(spd_data));
 
-			res = i2c_smbus_write_byte_data(fd, 0x1F, 0x00);
+			res = i2c_dev_write(0x38, 0x1F, 0x00);
 			if (res < 0) printf("i2c: Couldn't update SPD change register (0x1F, 0x00), %d\n", res);
 		}
-		i2c_close(fd);
 	}
 	else
 	{
@@ -1672,21 +2079,21 @@ static void hdmi_config_set_hdr()
 	else
 	{
 		hdmi_config_set_spare(1, true);
-		int fd = i2c_open(0x38, 0);
-		int res = i2c_smbus_write_byte_data(fd, 0xFF, 0b10000000);
+		int res = i2c_dev_write(0x38, 0xFF, 0b10000000);
 		if (res < 0)
 		{
 			printf("i2c: hdr: Couldn't update Spare Packet change register (0xDF, 0x80) %d\n", res);
 		}
 
-		uint8_t addr = 0xe0;
+		uint8_t regs[sizeof(hdr_data) * 2];
 		for (uint i = 0; i < sizeof(hdr_data); i++)
 		{
-			res = i2c_smbus_write_byte_data(fd, addr, hdr_data[i]);
-			if (res < 0) printf("i2c: hdr register write error (%02X %02x): %d\n", addr, hdr_data[i], res);
-			addr += 1;
+			regs[i * 2] = 0xe0 + i;
+			regs[i * 2 + 1] = hdr_data[i];
 		}
-		res = i2c_smbus_write_byte_data(fd, 0xfF, 0x00);
+		i2c_dev_write_regs(0x38, regs, sizeof(regs));
+
+		res = i2c_dev_write(0x38, 0xfF, 0x00);
 		if (res < 0) printf("i2c: hdr: Couldn't update Spare Packet change register (0xDF, 0x00), %d\n", res);
 	}
 }
@@ -1719,16 +2126,9 @@ static void hdmi_config_set_mode(vmode_custom_t *vm)
 		0x3C, vic_mode,			// VIC
 	};
 
-	int fd = i2c_open(0x39, 0);
-	if (fd >= 0)
+	if (i2c_dev_fd(0x39) >= 0)
 	{
-		for (uint i = 0; i < sizeof(init_data); i += 2)
-		{
-			int res = i2c_smbus_write_byte_data(fd, init_data[i], init_data[i + 1]);
-			if (res < 0) printf("i2c: write error (%02X %02X): %d\n", init_data[i], init_data[i + 1], res);
-		}
-
-		i2c_close(fd);
+		i2c_dev_write_regs(0x39, init_data, sizeof(init_data));
 	}
 	else
 	{
@@ -1801,8 +2201,14 @@ static void edid_parse_cea_ext(uint8_t *cea)
 	}
 }
 
+static int edid_vrr_parsed = 0;
+
 static int find_edid_vrr_capability()
 {
+	// the EDID doesn't change for the life of the process
+	if (edid_vrr_parsed) return 0;
+	edid_vrr_parsed = 1;
+
 	uint8_t *cur_ext = NULL;
 	uint8_t ext_cnt = edid[126];
 
@@ -1832,9 +2238,58 @@ static int is_edid_valid()
 	return !memcmp(edid, magic, sizeof(magic));
 }
 
+// The EDID of the display is kept in tmpfs, so the restart on every core
+// load doesn't read it over i2c again. A hotplug since the last read sets
+// the HPD/monitor sense interrupt flags, which invalidates it.
+#define EDID_CACHE_FILE  "/tmp/edid.bin"
+#define EDID_CACHE_MAGIC 0x45444901
+
+struct edid_cache_t
+{
+	uint32_t magic;
+	uint32_t crc;
+	uint8_t edid[256];
+};
+
+static int edid_cache_load(int fd)
+{
+	int irq = i2c_smbus_read_byte_data(fd, 0x96);
+	if (irq < 0 || (irq & 0xC0)) return 0;
+
+	edid_cache_t cache;
+	int cfd = open(EDID_CACHE_FILE, O_RDONLY | O_CLOEXEC);
+	if (cfd < 0) return 0;
+
+	int ok = read(cfd, &cache, sizeof(cache)) == sizeof(cache) && cache.magic == EDID_CACHE_MAGIC &&
+		cache.crc == crc32_update(0, cache.edid, sizeof(cache.edid));
+	close(cfd);
+	if (!ok) return 0;
+
+	memcpy(edid, cache.edid, sizeof(edid));
+	if (!is_edid_valid()) return 0;
+
+	printf("EDID: cached, crc %08X\n", cache.crc);
+	return 1;
+}
+
+static void edid_cache_save()
+{
+	edid_cache_t cache;
+	cache.magic = EDID_CACHE_MAGIC;
+	memcpy(cache.edid, edid, sizeof(cache.edid));
+	cache.crc = crc32_update(0, cache.edid, sizeof(cache.edid));
+
+	int cfd = open(EDID_CACHE_FILE ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cfd < 0) return;
+
+	int ok = write(cfd, &cache, sizeof(cache)) == sizeof(cache);
+	close(cfd);
+	if (!ok || rename(EDID_CACHE_FILE ".tmp", EDID_CACHE_FILE)) unlink(EDID_CACHE_FILE ".tmp");
+}
+
 static int get_active_edid()
 {
-	int fd = i2c_open(0x39, 0);
+	int fd = i2c_dev_fd(0x39);
 	if (fd < 0)
 	{
 		printf("EDID: cannot find main i2c device\n");
@@ -1845,18 +2300,21 @@ static int get_active_edid()
 	int hpd_state = i2c_smbus_read_byte_data(fd, 0x42);
 	if (hpd_state < 0 || !(hpd_state & 0x20))
 	{
-		i2c_close(fd);
+		unlink(EDID_CACHE_FILE);
 		return 0;
 	}
 
+	if (edid_cache_load(fd)) return 1;
+
+	// clear the hotplug flags first, so a replug during the read shows up next time
+	i2c_smbus_write_byte_data(fd, 0x96, 0xC0);
 
 	for (int i = 0; i < 10; i++)
 	{
 		i2c_smbus_write_byte_data(fd, 0xC9, 0x03);
 		i2c_smbus_write_byte_data(fd, 0xC9, 0x13);
 	}
-	i2c_close(fd);
-	fd = i2c_open(0x3f, 0);
+	fd = i2c_dev_fd(0x3f);
 	if (fd < 0)
 	{
 		printf("EDID: cannot find i2c device.\n");
@@ -1871,7 +2329,6 @@ static int get_active_edid()
 		usleep(100000);
 	}
 
-	i2c_close(fd);
 	printf("EDID:\n"); hexdump(edid, sizeof(edid), 0);
 
 	if (!is_edid_valid())
@@ -1880,6 +2337,8 @@ static int get_active_edid()
 		bzero(edid, sizeof(edid));
 		return 0;
 	}
+
+	edid_cache_save();
 	return 1;
 }
 
@@ -2130,23 +2589,18 @@ static void set_vrr_mode()
 	};
 
 	int res = 0;
-	int fd = i2c_open(0x38, 0);
-	if (fd >= 0)
+	if (i2c_dev_fd(0x38) >= 0)
 	{
 		if (use_vrr == VRR_FREESYNC)
 		{
 			hdmi_config_set_spd(1);
-			res = i2c_smbus_write_byte_data(fd, 0x1F, 0b10000000);
+			res = i2c_dev_write(0x38, 0x1F, 0b10000000);
 			if (res < 0)
 			{
 				printf("i2c: Vrr: Couldn't update SPD change register (0x1F, 0x80) %d\n", res);
 			}
-			for (uint i = 0; i < sizeof(freesync_data); i += 2)
-			{
-				res = i2c_smbus_write_byte_data(fd, freesync_data[i], freesync_data[i + 1]);
-				if (res < 0) printf("i2c: Vrr register write error (%02X %02x): %d\n", freesync_data[i], freesync_data[i + 1], res);
-			}
-			res = i2c_smbus_write_byte_data(fd, 0x1F, 0x00);
+			i2c_dev_write_regs(0x38, freesync_data, sizeof(freesync_data));
+			res = i2c_dev_write(0x38, 0x1F, 0x00);
 			if (res < 0) printf("i2c: Vrr: Couldn't update SPD change register (0x1F, 0x00), %d\n", res);
 		}
 		else
@@ -2157,25 +2611,20 @@ static void set_vrr_mode()
 		if (use_vrr == VRR_VESA)
 		{
 			hdmi_config_set_spare(0, true);
-			res = i2c_smbus_write_byte_data(fd, 0xDF, 0b10000000);
+			res = i2c_dev_write(0x38, 0xDF, 0b10000000);
 			if (res < 0)
 			{
 				printf("i2c: Vrr: Couldn't update Spare Packet change register (0xDF, 0x80) %d\n", res);
 			}
 
-			for (uint i = 0; i < sizeof(vesa_data); i += 2)
-			{
-				res = i2c_smbus_write_byte_data(fd, vesa_data[i], vesa_data[i + 1]);
-				if (res < 0) printf("i2c: Vrr register write error (%02X %02x): %d\n", vesa_data[i], vesa_data[i + 1], res);
-			}
-			res = i2c_smbus_write_byte_data(fd, 0xDF, 0x00);
+			i2c_dev_write_regs(0x38, vesa_data, sizeof(vesa_data));
+			res = i2c_dev_write(0x38, 0xDF, 0x00);
 			if (res < 0) printf("i2c: Vrr: Couldn't update Spare Packet change register (0xDF, 0x00), %d\n", res);
 		}
 		else
 		{
 			hdmi_config_set_spare(0, false);
 		}
-		i2c_close(fd);
 	}
 	last_vrr_mode = cfg.vrr_mode;
 	last_vrr_rate = vrateh;
@@ -2489,7 +2938,9 @@ void video_cfg_reset()
 
 void video_init()
 {
-	yc_parse(yc_modes, sizeof(yc_modes) / sizeof(yc_modes[0]));
+	// the overrides are only used with YC output
+	if (cfg.vga_mode_int >= 2) yc_parse(yc_modes, sizeof(yc_modes) / sizeof(yc_modes[0]));
+	pll_cache_init();
 
 	fb_init();
 	hdmi_config_init();
@@ -2497,6 +2948,7 @@ void video_init()
 	video_mode_load();
 
 	has_gamma = spi_uio_cmd(UIO_SET_GAMMA);
+	if (has_gamma) gamma_precompute();
 
 	video_cfg_init();
 
@@ -2510,12 +2962,17 @@ int hasAPI1_5()
 	return api1_5 || is_menu();
 }
 
+// The core bumps a change counter in the first VRES word and the crc of the
+// framebuffer parameters on every change, so in the steady state only these
+// two words cross SPI and the rest of the block is never read.
 static bool get_video_info(bool force, VideoInfo *video_info)
 {
 	static uint16_t nres = 0;
 	bool res_changed = false;
 	bool fb_changed = false;
 
+	*video_info = current_video_info;
+
 	spi_uio_cmd_cont(UIO_GET_VRES);
 	uint16_t res = spi_w(0);
 	if ((nres != res) || force)
@@ -2535,10 +2992,6 @@ static bool get_video_info(bool force, VideoInfo *video_info)
 		video_info->interlaced = ( res & 0x100 ) != 0;
 		video_info->rotated = ( res & 0x200 ) != 0;
 	}
-	else
-	{
-		*video_info = current_video_info;
-	}
 	DisableIO();
 
 	static uint8_t fb_crc = 0;
@@ -2585,6 +3038,11 @@ static void video_scaler_description(const VideoInfo *vi, const vmode_custom_t *
 	snprintf(str, len, "%9s %6.2fMHz %5.1fHz", res, vm->Fpix, vrateh);
 }
 
+void video_get_info(VideoInfo *vi)
+{
+	*vi = current_video_info;
+}
+
 void video_core_description(char *str, size_t len)
 {
 	video_core_description(&current_video_info, &v_cur, str, len);
@@ -2822,47 +3280,91 @@ bool video_mode_select(uint32_t vtime, vmode_custom_t* out_mode)
 	return adjustable;
 }
 
-static void set_yc_mode()
+// YC encoder parameters per video timing. The ntsc mode and the yc.txt
+// overrides are fixed until Main restarts, so the timing is the whole key.
+#define YC_CACHE_NUM 8
+
+struct yc_par_t
 {
-	if (cfg.vga_mode_int >= 2)
+	uint32_t vtime, ctime, ptime, width;
+	bool interlaced;
+	uint16_t mode;
+	int64_t phase_inc;
+	uint32_t colorburst_range;
+};
+
+static yc_par_t yc_cache[YC_CACHE_NUM];
+static int yc_cache_num = 0;
+static int yc_cache_next = 0;
+
+static const yc_par_t *getYCpar(const VideoInfo *vi)
+{
+	for (int i = 0; i < yc_cache_num; i++)
 	{
-		float fps = current_video_info.vtime ? (100000000.f / current_video_info.vtime) : 0.f;
-		int pal = fps < 55.f;
-		double CLK_REF = (pal || (cfg.ntsc_mode == 1)) ? 4.43361875f : (cfg.ntsc_mode == 2) ? 3.575611f : 3.579545f;
-		double CLK_VIDEO = current_video_info.ctime * 100.f / current_video_info.ptime;
+		const yc_par_t *par = &yc_cache[i];
+		if (par->vtime == vi->vtime && par->ctime == vi->ctime && par->ptime == vi->ptime &&
+			par->width == vi->width && par->interlaced == vi->interlaced) return par;
+	}
 
-		float prate = current_video_info.width * 100.f;
-		prate /= current_video_info.ptime;
+	yc_par_t *par = &yc_cache[yc_cache_next];
+	yc_cache_next = (yc_cache_next + 1) % YC_CACHE_NUM;
+	if (yc_cache_num < YC_CACHE_NUM) yc_cache_num++;
 
-		int64_t PHASE_INC = ((int64_t)((CLK_REF / CLK_VIDEO) * 1099511627776LL)) & 0xFFFFFFFFFFLL;
+	par->vtime = vi->vtime;
+	par->ctime = vi->ctime;
+	par->ptime = vi->ptime;
+	par->width = vi->width;
+	par->interlaced = vi->interlaced;
 
-		int COLORBURST_START = (int)(3.7f * (CLK_VIDEO / CLK_REF));
-		int COLORBURST_END = (int)(9.0f * (CLK_VIDEO / CLK_REF)) + COLORBURST_START;
-		int COLORBURST_RANGE = (COLORBURST_START << 10) | COLORBURST_END;
+	float fps = vi->vtime ? (100000000.f / vi->vtime) : 0.f;
+	int pal = fps < 55.f;
+	double CLK_REF = (pal || (cfg.ntsc_mode == 1)) ? 4.43361875f : (cfg.ntsc_mode == 2) ? 3.575611f : 3.579545f;
+	double CLK_VIDEO = vi->ctime * 100.f / vi->ptime;
 
-		char yc_key[64];
-		char yc_key_expand[64];
-		sprintf(yc_key, "%s_%.1f%s%s", user_io_get_core_name(1), fps, current_video_info.interlaced ? "i" : "", (pal || !cfg.ntsc_mode) ? "" : (cfg.ntsc_mode == 1) ? "s" : "m");
-		snprintf(yc_key_expand, sizeof(yc_key_expand), "%s_%.2f", yc_key, prate);
-		printf("Calculated YC parameters for '%s': %s PHASE_INC=%lld, COLORBURST_START=%d, COLORBURST_END=%d\n", yc_key, pal ? "PAL" : (cfg.ntsc_mode == 1) ? "PAL60" : (cfg.ntsc_mode == 2) ? "PAL-M" : "NTSC", PHASE_INC, COLORBURST_START, COLORBURST_END);
+	float prate = vi->width * 100.f;
+	prate /= vi->ptime;
 
-		for (uint i = 0; i < sizeof(yc_modes) / sizeof(yc_modes[0]); i++)
-		{
+	int64_t PHASE_INC = ((int64_t)((CLK_REF / CLK_VIDEO) * 1099511627776LL)) & 0xFFFFFFFFFFLL;
+
+	int COLORBURST_START = (int)(3.7f * (CLK_VIDEO / CLK_REF));
+	int COLORBURST_END = (int)(9.0f * (CLK_VIDEO / CLK_REF)) + COLORBURST_START;
+	int COLORBURST_RANGE = (COLORBURST_START << 10) | COLORBURST_END;
+
+	char yc_key[64];
+	char yc_key_expand[64];
+	sprintf(yc_key, "%s_%.1f%s%s", user_io_get_core_name(1), fps, vi->interlaced ? "i" : "", (pal || !cfg.ntsc_mode) ? "" : (cfg.ntsc_mode == 1) ? "s" : "m");
+	snprintf(yc_key_expand, sizeof(yc_key_expand), "%s_%.2f", yc_key, prate);
+	printf("Calculated YC parameters for '%s': %s PHASE_INC=%lld, COLORBURST_START=%d, COLORBURST_END=%d\n", yc_key, pal ? "PAL" : (cfg.ntsc_mode == 1) ? "PAL60" : (cfg.ntsc_mode == 2) ? "PAL-M" : "NTSC", PHASE_INC, COLORBURST_START, COLORBURST_END);
+
+	for (uint i = 0; i < sizeof(yc_modes) / sizeof(yc_modes[0]); i++)
+	{
 		if (!strcasecmp(yc_modes[i].key, yc_key) || !strcasecmp(yc_modes[i].key, yc_key_expand))
-			{
-				printf("Override YC PHASE_INC with value: %lld\n", yc_modes[i].phase_inc);
-				PHASE_INC = yc_modes[i].phase_inc;
-				break;
-			}
+		{
+			printf("Override YC PHASE_INC with value: %lld\n", yc_modes[i].phase_inc);
+			PHASE_INC = yc_modes[i].phase_inc;
+			break;
 		}
+	}
+
+	par->mode = ((pal || cfg.ntsc_mode) ? 4 : 0) | ((cfg.vga_mode_int == 3) ? 3 : 1);
+	par->phase_inc = PHASE_INC;
+	par->colorburst_range = COLORBURST_RANGE;
+	return par;
+}
+
+static void set_yc_mode()
+{
+	if (cfg.vga_mode_int >= 2)
+	{
+		const yc_par_t *par = getYCpar(&current_video_info);
 
 		spi_uio_cmd_cont(UIO_SET_YC_PAR);
-		spi_w(((pal || cfg.ntsc_mode) ? 4 : 0) | ((cfg.vga_mode_int == 3) ? 3 : 1));
-		spi_w(PHASE_INC);
-		spi_w(PHASE_INC >> 16);
-		spi_w(PHASE_INC >> 32);
-		spi_w(COLORBURST_RANGE);
-		spi_w(COLORBURST_RANGE >> 16);
+		spi_w(par->mode);
+		spi_w(par->phase_inc);
+		spi_w(par->phase_inc >> 16);
+		spi_w(par->phase_inc >> 32);
+		spi_w(par->colorburst_range);
+		spi_w(par->colorburst_range >> 16);
 		DisableIO();
 	}
 	else
@@ -2879,24 +3381,29 @@ void video_mode_adjust()
 
 	const bool vid_changed = get_video_info(force, &video_info);
 
-	if (vid_changed || force)
-	{
-		current_video_info = video_info;
-		show_video_info(&video_info, &v_cur);
-		set_yc_mode();
-		if (cfg.direct_video) spd_config_dv();
-		//else if(use_vrr != VRR_FREESYNC) spd_config_hdmi();
-	}
-	force = false;
-
 	if (cfg.direct_video)
 	{
 		static int menu = 0;
 		int menu_now = menu_present();
-		if(menu != menu_now) spd_config_dv();
+		if (menu != menu_now && !vid_changed && !force) spd_config_dv();
 		menu = menu_now;
 	}
 
+	if (!vid_changed && !force)
+	{
+		set_vfilter(0); // update filters if flags have changed
+		return;
+	}
+
+	current_video_info = video_info;
+	pacing_set_frame_time(video_info.vtime, video_info.vtimeh);
+	scheduler_set_frame_time(video_info.vtime, video_info.vtimeh);
+	show_video_info(&video_info, &v_cur);
+	set_yc_mode();
+	if (cfg.direct_video) spd_config_dv();
+	//else if(use_vrr != VRR_FREESYNC) spd_config_hdmi();
+	force = false;
+
 	if (vid_changed && !is_menu())
 	{
 		if (cfg_has_video_sections())
@@ -2978,7 +3485,7 @@ static void fb_write_module_params()
 			fprintf(fp, "%d %d %d %d %d\n", 8888, 1, width, height, width * 4);
 			fclose(fp);
 		}
-	});
+	}, OFFLOAD_IO);
 }
 
 void video_fb_enable(int enable, int n)
@@ -3063,6 +3570,8 @@ int video_fb_state()
 }
 
 
+static void bg_wait(int show);
+
 static void video_fb_config()
 {
 	PROFILE_FUNCTION();
@@ -3082,6 +3591,9 @@ static void video_fb_config()
 	const int fb_scale_x = fb_scale;
 	const int fb_scale_y = v_cur.param.pr == 0 ? fb_scale : fb_scale * 2;
 
+	// a background being drawn still uses the old size
+	bg_wait(1);
+
 	fb_width = v_cur.item[1] / fb_scale_x;
 	fb_height = v_cur.item[5] / fb_scale_y;
 
@@ -3093,30 +3605,85 @@ static void video_fb_config()
 	fb_write_module_params();
 }
 
+// Framebuffer fills. The framebuffer is written through, so the stores go
+// out in whole 64 byte bursts and every pattern is built once per line type
+// in normal memory, then copied.
+static void fb_fill(volatile uint32_t *dst, uint32_t color, int count)
+{
+	uint32_t *d = (uint32_t *)dst;
+#ifdef __ARM_NEON
+	uint32x4_t v = vdupq_n_u32(color);
+	for (; count >= 16; count -= 16, d += 16)
+	{
+		vst1q_u32(d, v);
+		vst1q_u32(d + 4, v);
+		vst1q_u32(d + 8, v);
+		vst1q_u32(d + 12, v);
+	}
+#endif
+	while (count-- > 0) *d++ = color;
+}
+
+static void fb_copy(volatile uint32_t *dst, const uint32_t *src, int count)
+{
+	memcpy((void *)dst, src, count * sizeof(uint32_t));
+}
+
+// scratch line of the framebuffer width
+static uint32_t *fb_line()
+{
+	static uint32_t *line = 0;
+	static int line_len = 0;
+	if (line_len < fb_width)
+	{
+		free(line);
+		line = (uint32_t *)malloc(fb_width * sizeof(uint32_t));
+		line_len = line ? fb_width : 0;
+	}
+	return line;
+}
+
+static uint32_t bar_color(int base_color, int gray)
+{
+	uint32_t color = 0;
+	if (base_color & 4) color |= gray;
+	if (base_color & 2) color |= gray << 8;
+	if (base_color & 1) color |= gray << 16;
+	return color;
+}
+
 static void draw_checkers()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgd);
 
 	uint32_t col1 = 0x888888;
 	uint32_t col2 = 0x666666;
 	int sz = fb_width / 128;
+	int width = fb_width - 2 * brd_x;
+
+	// two line types, one per phase of the rows
+	uint32_t *rows = (uint32_t *)malloc(width * 2 * sizeof(uint32_t));
+	if (!rows) return;
+	uint32_t *phase[2] = { rows, rows + width };
+	for (int x = brd_x; x < fb_width - brd_x; x++)
+	{
+		int c = (x / sz) & 1;
+		phase[0][x - brd_x] = c ? col2 : col1;
+		phase[1][x - brd_x] = c ? col1 : col2;
+	}
 
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
-		int c1 = (y / sz) & 1;
-		int pos = y * fb_width;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			int c2 = c1 ^ ((x / sz) & 1);
-			buf[pos + x] = c2 ? col2 : col1;
-		}
+		fb_copy(buf + y * fb_width + brd_x, phase[(y / sz) & 1], width);
 	}
+	free(rows);
 }
 
 static void draw_hbars1()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgd);
 	int height = fb_height - 2 * brd_y;
+	int width = fb_width - 2 * brd_x;
 
 	int old_base = 0;
 	int gray = 255;
@@ -3134,15 +3701,7 @@ static void draw_hbars1()
 		}
 
 		gray = 255 * stp / sz;
-
-		for (int x = brd_x; x < fb_width - brd_x; x++)
-		{
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
-		}
+		fb_fill(buf + pos + brd_x, bar_color(base_color, gray), width);
 
 		stp--;
 		if (stp < 0) stp = 0;
@@ -3151,124 +3710,139 @@ static void draw_hbars1()
 
 static void draw_hbars2()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgd);
+	uint32_t *line = fb_line();
+	if (!line) return;
+
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
 
+	int old_type = -1;
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
 		int pos = y * fb_width;
 		int base_color = ((14 * (y - brd_y)) / height);
-		int inv = base_color & 1;
-		base_color >>= 1;
-		base_color = (inv ? base_color : 6 - base_color) + 1;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
+		if (base_color != old_type)
 		{
-			int gray = (256 * (x - brd_x)) / width;
-			if (inv) gray = 255 - gray;
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
+			old_type = base_color;
+			int inv = base_color & 1;
+			base_color >>= 1;
+			base_color = (inv ? base_color : 6 - base_color) + 1;
+			for (int x = brd_x; x < fb_width - brd_x; x++)
+			{
+				int gray = (256 * (x - brd_x)) / width;
+				if (inv) gray = 255 - gray;
+				line[x - brd_x] = bar_color(base_color, gray);
+			}
 		}
+		fb_copy(buf + pos + brd_x, line, width);
 	}
 }
 
 static void draw_vbars1()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgd);
+	uint32_t *line = fb_line();
+	if (!line) return;
+
 	int width = fb_width - 2 * brd_x;
 
 	int sz = width / 7;
 	int stp = 0;
 
-	for (int y = brd_y; y < fb_height - brd_y; y++)
+	// every line starts over, so they are all the same
+	int old_base = 0;
+	int gray = 255;
+	for (int x = brd_x; x < fb_width - brd_x; x++)
 	{
-		int pos = y * fb_width;
-		int old_base = 0;
-		int gray = 255;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
+		int base_color = ((7 * (x - brd_x)) / width) + 1;
+		if (old_base != base_color)
 		{
-			int base_color = ((7 * (x - brd_x)) / width) + 1;
-			if (old_base != base_color)
-			{
-				stp = sz;
-				old_base = base_color;
-			}
+			stp = sz;
+			old_base = base_color;
+		}
 
-			gray = 255 * stp / sz;
+		gray = 255 * stp / sz;
+		line[x - brd_x] = bar_color(base_color, gray);
 
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
+		stp--;
+		if (stp < 0) stp = 0;
+	}
 
-			stp--;
-			if (stp < 0) stp = 0;
-		}
+	for (int y = brd_y; y < fb_height - brd_y; y++)
+	{
+		fb_copy(buf + y * fb_width + brd_x, line, width);
 	}
 }
 
 static void draw_vbars2()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgd);
+	uint32_t *line = fb_line();
+	if (!line) return;
+
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
 
+	int old_gray = -1;
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
 		int pos = y * fb_width;
-		for (int x = brd_x; x < fb_width - brd_x; x++)
+		int gray_y = ((256 * (y - brd_y)) / height);
+		if (gray_y != old_gray)
 		{
-			int gray = ((256 * (y - brd_y)) / height);
-			int base_color = ((14 * (x - brd_x)) / width);
-			int inv = base_color & 1;
-			base_color >>= 1;
-			base_color = (inv ? base_color : 6 - base_color) + 1;
-
-			if (inv) gray = 255 - gray;
-			uint32_t color = 0;
-			if (base_color & 4) color |= gray;
-			if (base_color & 2) color |= gray << 8;
-			if (base_color & 1) color |= gray << 16;
-			buf[pos + x] = color;
+			old_gray = gray_y;
+			for (int x = brd_x; x < fb_width - brd_x; x++)
+			{
+				int gray = gray_y;
+				int base_color = ((14 * (x - brd_x)) / width);
+				int inv = base_color & 1;
+				base_color >>= 1;
+				base_color = (inv ? base_color : 6 - base_color) + 1;
+
+				if (inv) gray = 255 - gray;
+				line[x - brd_x] = bar_color(base_color, gray);
+			}
 		}
+		fb_copy(buf + pos + brd_x, line, width);
 	}
 }
 
 static void draw_spectrum()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
+	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgd);
+	uint32_t *line = fb_line();
+	if (!line) return;
+
 	int height = fb_height - 2 * brd_y;
 	int width = fb_width - 2 * brd_x;
 
+	int old_blue = -1;
 	for (int y = brd_y; y < fb_height - brd_y; y++)
 	{
 		int pos = y * fb_width;
 		int blue = ((256 * (y - brd_y)) / height);
-		for (int x = brd_x; x < fb_width - brd_x; x++)
+		if (blue != old_blue)
 		{
-			int green = ((256 * (x - brd_x)) / width) - blue / 2;
-			int red = 255 - green - blue / 2;
-			if (red < 0) red = 0;
-			if (green < 0) green = 0;
+			old_blue = blue;
+			for (int x = brd_x; x < fb_width - brd_x; x++)
+			{
+				int green = ((256 * (x - brd_x)) / width) - blue / 2;
+				int red = 255 - green - blue / 2;
+				if (red < 0) red = 0;
+				if (green < 0) green = 0;
 
-			buf[pos + x] = (red << 16) | (green << 8) | blue;
+				line[x - brd_x] = (red << 16) | (green << 8) | blue;
+			}
 		}
+		fb_copy(buf + pos + brd_x, line, width);
 	}
 }
 
 static void draw_black()
 {
-	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgn);
-
-	for (int y = 0; y < fb_height; y++)
-	{
-		int pos = y * fb_width;
-		for (int x = 0; x < fb_width; x++) buf[pos++] = 0;
-	}
+	volatile uint32_t* buf = fb_base + (FB_SIZE*menu_bgd);
+	fb_fill(buf, 0, fb_width * fb_height);
 }
 
 static uint64_t getus()
@@ -3382,212 +3956,433 @@ static Imlib_Image load_bg()
 }
 
 static int bg_has_picture = 0;
-extern uint8_t  _binary_logo_png_start[], _binary_logo_png_end[];
-void video_menu_bg(int n, int idle)
+
+// Finished backgrounds keyed by everything that goes into them, so menu
+// switches and idle steps become a copy into the framebuffer page.
+#define BG_CACHE_NUM 4
+#define BG_KEY_LEN   10
+
+struct bg_cache_t
 {
-	bg_has_picture = 0;
-	menu_bg = n;
-	if (n)
+	int key[BG_KEY_LEN];
+	int has_picture;
+	uint32_t used;
+	uint32_t *data;
+};
+
+static bg_cache_t bg_cache[BG_CACHE_NUM] = {};
+static uint32_t bg_cache_tick = 0;
+static const uint32_t *bg_clean = NULL; // the shown background as drawn, without the thumbnail
+
+static void bg_cache_key(int *key, int n, int idle)
+{
+	int k = 0;
+	key[k++] = n;
+	key[k++] = idle;
+	key[k++] = fb_width;
+	key[k++] = fb_height;
+	key[k++] = brd_x;
+	key[k++] = brd_y;
+	key[k++] = cfg.osd_rotate;
+	key[k++] = cfg.logo;
+	key[k++] = cfg.direct_video && (v_cur.item[5] < 300);
+	key[k++] = 0;
+}
+
+static int bg_cache_load(const int *key)
+{
+	for (int i = 0; i < BG_CACHE_NUM; i++)
+	{
+		bg_cache_t *c = &bg_cache[i];
+		if (c->data && !memcmp(c->key, key, sizeof(c->key)))
+		{
+			memcpy((void *)(fb_base + (FB_SIZE * menu_bgd)), c->data, fb_width * fb_height * sizeof(uint32_t));
+			bg_has_picture = c->has_picture;
+			bg_clean = c->data;
+			c->used = ++bg_cache_tick;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void bg_cache_store(const int *key)
+{
+	bg_cache_t *c = &bg_cache[0];
+	for (int i = 0; i < BG_CACHE_NUM; i++)
+	{
+		// backgrounds of another resolution won't be used again
+		if (bg_cache[i].data && (bg_cache[i].key[2] != fb_width || bg_cache[i].key[3] != fb_height))
+		{
+			if (bg_clean == bg_cache[i].data) bg_clean = NULL;
+			free(bg_cache[i].data);
+			bg_cache[i].data = NULL;
+		}
+
+		if (!bg_cache[i].data) c = &bg_cache[i];
+		else if (c->data && bg_cache[i].used < c->used) c = &bg_cache[i];
+	}
+
+	size_t size = fb_width * fb_height * sizeof(uint32_t);
+	free(c->data);
+	c->data = (uint32_t *)malloc(size);
+	bg_clean = c->data;
+	if (!c->data) return;
+
+	memcpy(c->data, (const void *)(fb_base + (FB_SIZE * menu_bgd)), size);
+	memcpy(c->key, key, sizeof(c->key));
+	c->has_picture = bg_has_picture;
+	c->used = ++bg_cache_tick;
+}
+
+// Imlib2 keeps its context and caches in globals, workers decoding
+// images take the lock around their calls.
+static pthread_mutex_t imlib_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void video_imlib_lock()
+{
+	pthread_mutex_lock(&imlib_mutex);
+}
+
+void video_imlib_unlock()
+{
+	pthread_mutex_unlock(&imlib_mutex);
+}
+
+struct imlib_guard_t
+{
+	imlib_guard_t() { video_imlib_lock(); }
+	~imlib_guard_t() { video_imlib_unlock(); }
+};
+
+// Thumbnail of the file browser, right of the OSD on the menu background.
+// A copy is kept, so it comes back after the background is redrawn.
+static uint32_t *thumb_pix = NULL;
+static int thumb_cap = 0;
+static int thumb_w = 0, thumb_h = 0;
+static int thumb_x = 0, thumb_y = 0;
+static int thumb_drawn = 0;
+
+static void thumb_clear()
+{
+	if (!thumb_drawn) return;
+	thumb_drawn = 0;
+
+	volatile uint32_t *buf = fb_base + (FB_SIZE * menu_bgn);
+	for (int y = thumb_y; y < thumb_y + thumb_h; y++)
+	{
+		int pos = y * fb_width + thumb_x;
+		if (bg_clean) fb_copy(buf + pos, bg_clean + pos, thumb_w);
+		else fb_fill(buf + pos, 0, thumb_w);
+	}
+}
+
+static void thumb_draw()
+{
+	thumb_x = fb_width - brd_x - thumb_w - fb_width / 32;
+	thumb_y = (fb_height - thumb_h) / 2;
+
+	volatile uint32_t *buf = fb_base + (FB_SIZE * menu_bgn);
+	for (int y = 0; y < thumb_h; y++)
+	{
+		fb_copy(buf + (thumb_y + y) * fb_width + thumb_x, thumb_pix + y * thumb_w, thumb_w);
+	}
+	thumb_drawn = 1;
+}
+
+int video_menu_thumb(const uint32_t *pix, int w, int h)
+{
+	// only the menu core has the background behind the OSD
+	if (!fb_base || !menu_bg || !is_menu() || cfg.osd_rotate) return 0;
+
+	thumb_clear();
+	thumb_w = 0;
+	if (!pix || w <= 0 || h <= 0) return 1;
+	if ((fb_width - 2 * brd_x) < w * 4 || (fb_height - 2 * brd_y) < h * 2) return 0;
+
+	if (w * h > thumb_cap)
 	{
-		//printf("**** BG DEBUG START ****\n");
-		//printf("n = %d\n", n);
+		free(thumb_pix);
+		thumb_pix = (uint32_t *)malloc(w * h * sizeof(uint32_t));
+		thumb_cap = thumb_pix ? w * h : 0;
+		if (!thumb_pix) return 0;
+	}
+
+	memcpy(thumb_pix, pix, w * h * sizeof(uint32_t));
+	thumb_w = w;
+	thumb_h = h;
+	thumb_draw();
+	return 1;
+}
+
+extern uint8_t  _binary_logo_png_start[], _binary_logo_png_end[];
+
+// The background is drawn into the page not shown, by a worker unless it
+// is cached, and shown by pointing the scaler at it once complete. So a
+// change doesn't tear and the menu keeps running while it's drawn.
+static Imlib_Image bg_logo = 0;
+static Imlib_Image bg_menubg = 0;
+static Imlib_Image bg_curtain = 0;
+static Imlib_Image bg_img[2] = {};
+
+static offload_job_t bg_job = 0;
+static int bg_busy = 0;
+static int bg_job_key[BG_KEY_LEN];
+static int bg_job_idle = 0;
+static int bg_job_picture = 0;
+
+static void bg_render(int n, int idle)
+{
+	imlib_guard_t imlib_guard;
+	Imlib_Image bg = bg_img[menu_bgd - 1];
+	bg_job_picture = 0;
 
-		Imlib_Load_Error error;
-		static Imlib_Image logo = 0;
-		if (!logo)
+	draw_black();
+
+	if (idle < 3)
+	{
+		switch (n)
 		{
-			unlink("/tmp/logo.png");
-			if (FileSave("/tmp/logo.png", _binary_logo_png_start, _binary_logo_png_end - _binary_logo_png_start))
+		case 1:
+			if (bg_menubg)
 			{
-				while(1)
-				{
-					error = IMLIB_LOAD_ERROR_NONE;
-					if ((logo = imlib_load_image_with_error_return("/tmp/logo.png", &error))) break;
-					else
-					{
-						if (error != IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT)
-						{
-							printf("logo.png error = %d\n", error);
-							break;
-						}
-					}
-					vs_wait();
-				};
+				imlib_context_set_image(bg_menubg);
+				int src_w = imlib_image_get_width();
+				int src_h = imlib_image_get_height();
+				//printf("menubg: src_w=%d, src_h=%d\n", src_w, src_h);
 
-				if (cfg.osd_rotate)
+				if (bg)
 				{
-					imlib_context_set_image(logo);
-					imlib_image_orientate(cfg.osd_rotate == 1 ? 3 : 1);
+					imlib_context_set_image(bg);
+					imlib_blend_image_onto_image(bg_menubg, 0,
+						0, 0,                           //int source_x, int source_y,
+						src_w, src_h,                   //int source_width, int source_height,
+						brd_x, brd_y,                   //int destination_x, int destination_y,
+						fb_width - (brd_x * 2), fb_height - (brd_y * 2) //int destination_width, int destination_height
+					);
+					bg_job_picture = 1;
+					break;
+				}
+				else
+				{
+					printf("*bg = 0!\n");
 				}
 			}
-			else
-			{
-				printf("Fail to save to /tmp/logo.png\n");
-			}
-			unlink("/tmp/logo.png");
-			printf("Logo = %p\n", logo);
+			draw_checkers();
+			break;
+		case 2:
+			draw_hbars1();
+			break;
+		case 3:
+			draw_hbars2();
+			break;
+		case 4:
+			draw_vbars1();
+			break;
+		case 5:
+			draw_vbars2();
+			break;
+		case 6:
+			draw_spectrum();
+			break;
+		case 7:
+			draw_black();
+			break;
 		}
+	}
 
-		menu_bgn = (menu_bgn == 1) ? 2 : 1;
+	if (cfg.logo && bg_logo && !idle)
+	{
+		imlib_context_set_image(bg_logo);
 
-		static Imlib_Image menubg = 0;
-		static Imlib_Image bg1 = 0, bg2 = 0;
-		if (!bg1) bg1 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 1)));
-		if (!bg1) printf("Warning: bg1 is 0\n");
-		if (!bg2) bg2 = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 2)));
-		if (!bg2) printf("Warning: bg2 is 0\n");
+		int src_w = imlib_image_get_width();
+		int src_h = imlib_image_get_height();
 
-		Imlib_Image *bg = (menu_bgn == 1) ? &bg1 : &bg2;
-		//printf("*bg = %p\n", *bg);
+		printf("logo: src_w=%d, src_h=%d\n", src_w, src_h);
 
-		static Imlib_Image curtain = 0;
-		if (!curtain)
-		{
-			curtain = imlib_create_image(fb_width, fb_height);
-			imlib_context_set_image(curtain);
-			imlib_image_set_has_alpha(1);
+		int width = fb_width - (brd_x * 2);
+		int height = fb_height - (brd_y * 2);
 
-			uint32_t *data = imlib_image_get_data();
-			int sz = fb_width * fb_height;
-			for (int i = 0; i < sz; i++)
+		int dst_w, dst_h;
+		int dst_x, dst_y;
+		if (cfg.osd_rotate)
+		{
+			dst_h = height / 2;
+			dst_w = src_w * dst_h / src_h;
+			if (cfg.osd_rotate == 1)
 			{
-				*data++ = 0x9F000000;
+				dst_x = brd_x;
+				dst_y = height - dst_h;
+			}
+			else
+			{
+				dst_x = width - dst_w;
+				dst_y = brd_y;
 			}
 		}
-
-		draw_black();
-
-		if (idle < 3)
+		else
 		{
-			switch (n)
-			{
-			case 1:
-				if (!menubg) menubg = load_bg();
-				if (menubg)
-				{
-					imlib_context_set_image(menubg);
-					int src_w = imlib_image_get_width();
-					int src_h = imlib_image_get_height();
-					//printf("menubg: src_w=%d, src_h=%d\n", src_w, src_h);
+			dst_x = brd_x;
+			dst_y = brd_y;
+			dst_w = width * 2 / 7;
+			dst_h = src_h * dst_w / src_w;
+		}
 
-					if (*bg)
-					{
-						imlib_context_set_image(*bg);
-						imlib_blend_image_onto_image(menubg, 0,
-							0, 0,                           //int source_x, int source_y,
-							src_w, src_h,                   //int source_width, int source_height,
-							brd_x, brd_y,                   //int destination_x, int destination_y,
-							fb_width - (brd_x * 2), fb_height - (brd_y * 2) //int destination_width, int destination_height
-						);
-						bg_has_picture = 1;
-						break;
-					}
-					else
-					{
-						printf("*bg = 0!\n");
-					}
-				}
-				draw_checkers();
-				break;
-			case 2:
-				draw_hbars1();
-				break;
-			case 3:
-				draw_hbars2();
-				break;
-			case 4:
-				draw_vbars1();
-				break;
-			case 5:
-				draw_vbars2();
-				break;
-			case 6:
-				draw_spectrum();
-				break;
-			case 7:
-				draw_black();
-				break;
-			}
+		if (bg)
+		{
+			if (cfg.direct_video && (v_cur.item[5] < 300)) dst_h /= 2;
+
+			imlib_context_set_image(bg);
+			imlib_blend_image_onto_image(bg_logo, 1,
+				0, 0,         //int source_x, int source_y,
+				src_w, src_h, //int source_width, int source_height,
+				dst_x, dst_y, //int destination_x, int destination_y,
+				dst_w, dst_h  //int destination_width, int destination_height
+			);
 		}
+		else
+		{
+			printf("*bg = 0!\n");
+		}
+	}
 
-		if (cfg.logo && logo && !idle)
+	if (bg_curtain)
+	{
+		if (idle > 1 && bg)
 		{
-			imlib_context_set_image(logo);
+			imlib_context_set_image(bg);
+			imlib_blend_image_onto_image(bg_curtain, 1,
+				0, 0,                //int source_x, int source_y,
+				fb_width, fb_height, //int source_width, int source_height,
+				0, 0,                //int destination_x, int destination_y,
+				fb_width, fb_height  //int destination_width, int destination_height
+			);
+		}
+	}
+	else
+	{
+		printf("curtain = 0!\n");
+	}
+}
 
-			int src_w = imlib_image_get_width();
-			int src_h = imlib_image_get_height();
+// shows the drawn page, the thumbnail goes on it before
+static void bg_show(int idle)
+{
+	menu_bgn = menu_bgd;
+	thumb_drawn = 0;
+	if (thumb_w && !idle) thumb_draw();
+	video_fb_enable(0);
+}
 
-			printf("logo: src_w=%d, src_h=%d\n", src_w, src_h);
+// waits for the page being drawn, shows it or drops it
+static void bg_wait(int show)
+{
+	if (!bg_busy) return;
+
+	offload_wait(bg_job);
+	bg_busy = 0;
+	if (!show) return;
 
-			int width = fb_width - (brd_x * 2);
-			int height = fb_height - (brd_y * 2);
+	bg_has_picture = bg_job_picture;
+	bg_cache_store(bg_job_key);
+	bg_show(bg_job_idle);
+}
+
+void video_menu_bg_poll()
+{
+	if (bg_busy && offload_job_done(bg_job)) bg_wait(1);
+}
+
+void video_menu_bg(int n, int idle)
+{
+	// a newer background replaces the one being drawn
+	bg_wait(0);
+
+	menu_bg = n;
+	if (n)
+	{
+		{
+			imlib_guard_t imlib_guard;
 
-			int dst_w, dst_h;
-			int dst_x, dst_y;
-			if (cfg.osd_rotate)
+			//printf("**** BG DEBUG START ****\n");
+			//printf("n = %d\n", n);
+
+			Imlib_Load_Error error;
+			if (!bg_logo)
 			{
-				dst_h = height / 2;
-				dst_w = src_w * dst_h / src_h;
-				if (cfg.osd_rotate == 1)
+				unlink("/tmp/logo.png");
+				if (FileSave("/tmp/logo.png", _binary_logo_png_start, _binary_logo_png_end - _binary_logo_png_start))
 				{
-					dst_x = brd_x;
-					dst_y = height - dst_h;
+					while(1)
+					{
+						error = IMLIB_LOAD_ERROR_NONE;
+						if ((bg_logo = imlib_load_image_with_error_return("/tmp/logo.png", &error))) break;
+						else
+						{
+							if (error != IMLIB_LOAD_ERROR_NO_LOADER_FOR_FILE_FORMAT)
+							{
+								printf("logo.png error = %d\n", error);
+								break;
+							}
+						}
+						vs_wait();
+					};
+
+					if (cfg.osd_rotate)
+					{
+						imlib_context_set_image(bg_logo);
+						imlib_image_orientate(cfg.osd_rotate == 1 ? 3 : 1);
+					}
 				}
 				else
 				{
-					dst_x = width - dst_w;
-					dst_y = brd_y;
+					printf("Fail to save to /tmp/logo.png\n");
 				}
-			}
-			else
-			{
-				dst_x = brd_x;
-				dst_y = brd_y;
-				dst_w = width * 2 / 7;
-				dst_h = src_h * dst_w / src_w;
+				unlink("/tmp/logo.png");
+				printf("Logo = %p\n", bg_logo);
 			}
 
-			if (*bg)
-			{
-				if (cfg.direct_video && (v_cur.item[5] < 300)) dst_h /= 2;
-
-				imlib_context_set_image(*bg);
-				imlib_blend_image_onto_image(logo, 1,
-					0, 0,         //int source_x, int source_y,
-					src_w, src_h, //int source_width, int source_height,
-					dst_x, dst_y, //int destination_x, int destination_y,
-					dst_w, dst_h  //int destination_width, int destination_height
-				);
-			}
-			else
+			menu_bgd = (menu_bgn == 1) ? 2 : 1;
+
+			if (!bg_img[0]) bg_img[0] = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 1)));
+			if (!bg_img[0]) printf("Warning: bg1 is 0\n");
+			if (!bg_img[1]) bg_img[1] = imlib_create_image_using_data(fb_width, fb_height, (uint32_t*)(fb_base + (FB_SIZE * 2)));
+			if (!bg_img[1]) printf("Warning: bg2 is 0\n");
+
+			bg_cache_key(bg_job_key, n, idle);
+			if (bg_cache_load(bg_job_key))
 			{
-				printf("*bg = 0!\n");
+				bg_show(idle);
+				return;
 			}
-		}
 
-		if (curtain)
-		{
-			if (idle > 1 && *bg)
+			if (!bg_curtain)
 			{
-				imlib_context_set_image(*bg);
-				imlib_blend_image_onto_image(curtain, 1,
-					0, 0,                //int source_x, int source_y,
-					fb_width, fb_height, //int source_width, int source_height,
-					0, 0,                //int destination_x, int destination_y,
-					fb_width, fb_height  //int destination_width, int destination_height
-				);
+				bg_curtain = imlib_create_image(fb_width, fb_height);
+				imlib_context_set_image(bg_curtain);
+				imlib_image_set_has_alpha(1);
+
+				uint32_t *data = imlib_image_get_data();
+				int sz = fb_width * fb_height;
+				for (int i = 0; i < sz; i++)
+				{
+					*data++ = 0x9F000000;
+				}
 			}
-		}
-		else
-		{
-			printf("curtain = 0!\n");
+
+			// the wallpaper is picked through the file_io helpers, so not on the worker
+			if (n == 1 && idle < 3 && !bg_menubg) bg_menubg = load_bg();
 		}
 
-		//test the fb driver
-		//vs_wait();
-		//printf("**** BG DEBUG END ****\n");
+		bg_job_idle = idle;
+		bg_busy = 1;
+		bg_job = offload_add_work([n, idle] { bg_render(n, idle); }, OFFLOAD_UI);
+		return;
 	}
 
+	bg_has_picture = 0;
+	thumb_drawn = 0;
+	bg_clean = NULL;
 	video_fb_enable(0);
 }
 
@@ -3887,6 +4682,55 @@ static void video_calculate_cvt_int(int h_pixels, int v_lines, float refresh_rat
 		vmode->param.pr ? ",pr" : "");
 }
 
+// Calculated CVT timings, the core resolution and refresh rarely change.
+#define CVT_CACHE_NUM 8
+
+struct cvt_cache_t
+{
+	int h_pixels, v_lines;
+	float refresh_rate;
+	bool reduced_blanking;
+	uint32_t item[9];
+	uint32_t rb, pr;
+	double Fpix;
+};
+
+static cvt_cache_t cvt_cache[CVT_CACHE_NUM];
+static int cvt_cache_num = 0;
+static int cvt_cache_next = 0;
+
+static void video_calculate_cvt_cached(int h_pixels, int v_lines, float refresh_rate, bool reduced_blanking, vmode_custom_t *vmode)
+{
+	for (int i = 0; i < cvt_cache_num; i++)
+	{
+		cvt_cache_t *e = &cvt_cache[i];
+		if (e->h_pixels == h_pixels && e->v_lines == v_lines && e->refresh_rate == refresh_rate && e->reduced_blanking == reduced_blanking)
+		{
+			memcpy(vmode->item, e->item, sizeof(e->item));
+			vmode->param.rb = e->rb;
+			vmode->param.pr = e->pr;
+			vmode->Fpix = e->Fpix;
+			printf("Cached %dx%d@%0.1fhz %s timings\n", h_pixels, v_lines, refresh_rate, reduced_blanking ? "CVT-RB" : "CVT");
+			return;
+		}
+	}
+
+	video_calculate_cvt_int(h_pixels, v_lines, refresh_rate, reduced_blanking, vmode);
+
+	cvt_cache_t *e = &cvt_cache[cvt_cache_next];
+	cvt_cache_next = (cvt_cache_next + 1) % CVT_CACHE_NUM;
+	if (cvt_cache_num < CVT_CACHE_NUM) cvt_cache_num++;
+
+	e->h_pixels = h_pixels;
+	e->v_lines = v_lines;
+	e->refresh_rate = refresh_rate;
+	e->reduced_blanking = reduced_blanking;
+	memcpy(e->item, vmode->item, sizeof(e->item));
+	e->rb = vmode->param.rb;
+	e->pr = vmode->param.pr;
+	e->Fpix = vmode->Fpix;
+}
+
 static void video_calculate_cvt(int h_pixels, int v_lines, float refresh_rate, int reduced_blanking, vmode_custom_t *vmode)
 {
 	// If the resolution it too wide and the core doesn't support pixel repetition then just do 1080p
@@ -3897,10 +4741,10 @@ static void video_calculate_cvt(int h_pixels, int v_lines, float refresh_rate, i
 		return;
 	}
 
-	video_calculate_cvt_int(h_pixels, v_lines, refresh_rate, reduced_blanking == 1, vmode);
+	video_calculate_cvt_cached(h_pixels, v_lines, refresh_rate, reduced_blanking == 1, vmode);
 	if (vmode->Fpix > 210.f && reduced_blanking == 2)
 	{
 		printf("Calculated pixel clock is too high. Trying CVT-RB timings.\n");
-		video_calculate_cvt_int(h_pixels, v_lines, refresh_rate, 1, vmode);
+		video_calculate_cvt_cached(h_pixels, v_lines, refresh_rate, 1, vmode);
 	}
 }
@@ -55,11 +55,22 @@ int   hasAPI1_5();
 
 void video_fb_enable(int enable, int n = 0);
 int video_fb_state();
+// The background is drawn in the back, the poll shows it once complete.
 void video_menu_bg(int n, int idle = 0);
+void video_menu_bg_poll();
 int video_bg_has_picture();
+
+// Shows the pixels (framebuffer format) over the menu background, null
+// removes them. Returns 0 if there is no room or no menu background.
+int video_menu_thumb(const uint32_t *pix, int w, int h);
+
+// Held by workers around their Imlib2 calls.
+void video_imlib_lock();
+void video_imlib_unlock();
 int video_chvt(int num);
 void video_cmd(char *cmd);
 
+void video_get_info(VideoInfo *vi);
 void video_core_description(char *str, size_t len);
 void video_scaler_description(char *str, size_t len);
 char* video_get_core_mode_name(int with_vrefresh = 1);